@@ -0,0 +1,169 @@
+/**
+ * @file approx.cpp
+ * @brief Accuracy and speed of an approximate mode against the reference
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "engine.h"
+#include "loader.h"
+#include "timing.h"
+#include "image.h"
+#include "cmdLine.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+/// Compute the map of \a engine on the pair, the final one if \a pp, else the
+/// raw one of image 1. Return the best time of \a repeat runs.
+static double run(StereoEngine& engine, const Image& im1, const Image& im2,
+                  int dMin, int dMax, bool pp, int repeat) {
+    double best=0;
+    for(int i=0; i<repeat; i++) {
+        const double t0 = wallClock();
+        engine.compute(im1, im2, dMin, dMax);
+        if(pp) {
+            engine.check();
+            engine.densify();
+        }
+        const double t = wallClock()-t0;
+        if(i==0 || t<best)
+            best = t;
+    }
+    return best;
+}
+
+/// Differences of map \a D to reference \a R: mean absolute difference of
+/// pixels valid in both, and percentage of pixels differing by more than 1,
+/// pixels valid in only one of the maps included.
+static void compare(const Image& R, const Image& D, int dMin, int dMax,
+                    double& mae, double& bad) {
+    const float lo=static_cast<float>(dMin), hi=static_cast<float>(dMax);
+    double sum=0;
+    long n=0, nBad=0;
+    for(int y=0; y<R.height(); y++)
+        for(int x=0; x<R.width(); x++) {
+            const float r=R(x,y), d=D(x,y);
+            const bool validR=(lo<=r && r<=hi), validD=(lo<=d && d<=hi);
+            if(validR && validD) {
+                const double e = std::fabs(d-r);
+                sum += e;
+                ++n;
+                nBad += (e>1);
+            } else
+                nBad += (validR!=validD);
+        }
+    mae = n? sum/n: 0;
+    bad = 100.0*nBad/(static_cast<double>(R.width())*R.height());
+}
+
+/// Compare an approximate mode, given by the options, with the reference
+/// adaptive weights on the same pair. Fail if it exceeds the tolerances.
+int main(int argc, char *argv[]) {
+    CmdLine cmd; cmd.prefixDoc="    ";
+    ParamStereo fast;
+    std::string aggreg("aw"), map("disp");
+    int repeat=1;
+    float maxBad=-1, maxMae=-1;
+    cmd.add( make_option('A',aggreg,"aggreg")
+             .doc("method of approximate mode: aw, pm, gf, bg, cross or sgm") );
+    cmd.add( make_option(0,fast.disparity.stride,"stride")
+             .doc("step between sampled pixels of windows") );
+    cmd.add( make_option(0,fast.disparity.cost16,"cost16")
+             .doc("raw costs on 16 bits") );
+    cmd.add( make_option(0,fast.disparity.intCost,"int-cost")
+             .doc("raw cost in integer arithmetic") );
+    cmd.add( make_option(0,fast.disparity.fastSum,"fast-sum")
+             .doc("vectorized aggregation") );
+    cmd.add( make_option(0,fast.disparity.intSum,"int-sum")
+             .doc("aggregation in fixed point, 16-bit costs") );
+    cmd.add( make_option(0,fast.disparity.tileWidth,"tile-width")
+             .doc("width of tiles of aggregation (0: fit L2 cache)") );
+    cmd.add( make_option(0,fast.disparity.tileHeight,"tile-height")
+             .doc("height of tiles of aggregation (0: 32)") );
+    cmd.add( make_option(0,fast.levels,"levels")
+             .doc("levels of coarse to fine search") );
+    cmd.add( make_option(0,fast.occlusion.fast_median,"fast-median")
+             .doc("joint histogram median, with -m pp") );
+    cmd.add( make_option('m',map,"map")
+             .doc("map compared: disp (raw) or pp (densified)") );
+    cmd.add( make_option('n',repeat,"repeat")
+             .doc("runs of each mode, the best time being kept") );
+    cmd.add( make_option(0,maxBad,"max-bad")
+             .doc("max percentage of pixels differing by more than 1, "
+                  "else failure (negative: none)") );
+    cmd.add( make_option(0,maxMae,"max-mae")
+             .doc("max mean absolute difference, else failure (negative: "
+                  "none)") );
+    try {
+        cmd.process(argc, argv);
+    } catch(std::string str) {
+        std::cerr << "Error: " << str << std::endl<<std::endl;
+        argc=1; // To display usage
+    }
+    if(argc != 5) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [options] im1.png im2.png dmin dmax\n"
+                  << "Options:\n" << cmd;
+        return 1;
+    }
+    if(map!="disp" && map!="pp") {
+        std::cerr << "Error: map should be disp or pp" << std::endl;
+        return 1;
+    }
+    if(!fast.setAggregation(aggreg) || !fast.disparity.check() ||
+       !fast.occlusion.check())
+        return 1;
+    if(repeat < 1) {
+        std::cerr << "Error: repeat must be positive" << std::endl;
+        return 1;
+    }
+    const int dMin=std::atoi(argv[3]), dMax=std::atoi(argv[4]);
+    if(dMin > dMax) {
+        std::cerr << "Error: dmin must not exceed dmax" << std::endl;
+        return 1;
+    }
+    Image im1, im2;
+    if(!loadImage(argv[1], im1) || !loadImage(argv[2], im2))
+        return 1;
+    if(im1.width()!=im2.width() || im1.height()!=im2.height()) {
+        std::cerr << "The images must have the same size" << std::endl;
+        return 1;
+    }
+
+    const bool pp = (map=="pp");
+    ParamStereo ref; // Exact adaptive weights
+    ref.lrCheck = fast.lrCheck = pp;
+    StereoEngine refEngine(ref, true), fastEngine(fast, true);
+    const double tRef = run(refEngine, im1, im2, dMin, dMax, pp, repeat);
+    const double tFast = run(fastEngine, im1, im2, dMin, dMax, pp, repeat);
+    double mae, bad;
+    compare(refEngine.disparity(), fastEngine.disparity(), dMin, dMax,
+            mae, bad);
+
+    std::printf("reference %10.3f s\n", tRef);
+    std::printf("fast      %10.3f s  speedup %.2f\n", tFast,
+                (tFast>0)? tRef/tFast: 0);
+    std::printf("mean absolute difference %.3f, bad (>1) %.2f%%\n", mae, bad);
+    bool ok=true;
+    if(maxBad>=0 && bad>maxBad) {
+        std::printf("FAIL: bad pixels above %.2f%%\n", maxBad);
+        ok = false;
+    }
+    if(maxMae>=0 && mae>maxMae) {
+        std::printf("FAIL: mean absolute difference above %.3f\n", maxMae);
+        ok = false;
+    }
+    return ok? 0: 1;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file argList.h
+ * @brief Lists of integers in arguments of the tools
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARGLIST_H
+#define ARGLIST_H
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// Parse list \a str of positive integers separated by commas.
+inline bool parseList(const std::string& str, std::vector<int>& v) {
+    std::istringstream in(str);
+    std::string item;
+    v.clear();
+    while(std::getline(in, item, ',')) {
+        int n=0;
+        if(!(std::istringstream(item)>>n).eof() || n<=0)
+            return false;
+        v.push_back(n);
+    }
+    return !v.empty();
+}
+
+#endif
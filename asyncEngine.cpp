@@ -0,0 +1,214 @@
+/**
+ * @file asyncEngine.cpp
+ * @brief Pairs computed in the background, completion by callback or future
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "asyncEngine.h"
+#include "parallel.h"
+#include "timing.h"
+#include <string>
+
+/// Compute the pair of \a job in \a r, whose id and range are set.
+void AsyncEngine::compute(const Job& job, AsyncResult& r) {
+    r.id = job.id;
+    r.dMin = job.dMin;
+    r.dMax = job.dMax;
+    engine.compute(job.im1, job.im2, job.dMin, job.dMax);
+    engine.check();
+    engine.densify();
+    r.ok = !computationCancelled();
+    if(! r.ok)
+        return;
+    r.disparity = engine.disparity().clone();
+    if(engine.param().confidence)
+        r.confidence = engine.confidence().clone();
+}
+
+/// Give \a r to the callback and to the future of \a job.
+void AsyncEngine::complete(Job& job, const AsyncResult& r) {
+    if(job.callback)
+        job.callback(r, job.data);
+#if __cplusplus >= 201103L
+    if(job.promise)
+        job.promise->set_value(r);
+#endif
+}
+
+#if __cplusplus >= 201103L
+
+/// Constructor, starting the worker thread. The engine recycles the memory of
+/// cost volumes from one pair to the next.
+AsyncEngine::AsyncEngine(const ParamStereo& param)
+: engine(param, true), next(0), threads(parallelThreads()), running(-1),
+  done(false), thread(&AsyncEngine::run, this) {}
+
+/// Destructor, cancelling the pairs not done, whose completion is given with
+/// ok false.
+AsyncEngine::~AsyncEngine() {
+    std::deque<Job> left;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        left.swap(queue);
+        if(running >= 0)
+            cancelComputation();
+    }
+    cond.notify_all();
+    thread.join();
+    for(size_t i=0; i<left.size(); i++) {
+        AsyncResult r = {left[i].id, false, Image(), Image(),
+                         left[i].dMin, left[i].dMax};
+        complete(left[i], r);
+    }
+}
+
+/// Queue \a job, return its number.
+int AsyncEngine::push(Job& job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    job.id = next++;
+    queue.push_back(std::move(job));
+    cond.notify_all();
+    return queue.back().id;
+}
+
+/// Queue the pair \a im1, \a im2 of range [\a dMin,\a dMax], copied, and
+/// return its number. At the end, \a callback is called with \a data by the
+/// worker thread, which it should not block for long.
+int AsyncEngine::submit(const Image& im1, const Image& im2, int dMin, int dMax,
+                        AsyncCallback callback, void* data) {
+    Job job;
+    job.im1 = im1.clone(); // The caller may modify them afterwards
+    job.im2 = im2.clone();
+    job.dMin = dMin;
+    job.dMax = dMax;
+    job.callback = callback;
+    job.data = data;
+    return push(job);
+}
+
+/// Queue the pair \a im1, \a im2 of range [\a dMin,\a dMax], copied, and
+/// return the future of its maps. Its number is put in \a id if not 0.
+std::future<AsyncResult> AsyncEngine::submit(const Image& im1,
+                                             const Image& im2,
+                                             int dMin, int dMax, int* id) {
+    Job job;
+    job.im1 = im1.clone();
+    job.im2 = im2.clone();
+    job.dMin = dMin;
+    job.dMax = dMax;
+    job.callback = 0;
+    job.data = 0;
+    job.promise = std::make_shared<std::promise<AsyncResult> >();
+    std::future<AsyncResult> f = job.promise->get_future();
+    const int n = push(job);
+    if(id)
+        *id = n;
+    return f;
+}
+
+/// Cancel pair \a id: removed if queued, with ok false, cancelled if being
+/// computed. Return false if it is already completed.
+bool AsyncEngine::cancel(int id) {
+    Job job;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(running == id) {
+            cancelComputation();
+            return true;
+        }
+        std::deque<Job>::iterator it=queue.begin();
+        while(it!=queue.end() && it->id!=id)
+            ++it;
+        if(it == queue.end())
+            return false;
+        job = std::move(*it);
+        queue.erase(it);
+        cond.notify_all();
+    }
+    AsyncResult r = {job.id, false, Image(), Image(), job.dMin, job.dMax};
+    complete(job, r);
+    return true;
+}
+
+/// Wait until all pairs submitted are done.
+void AsyncEngine::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(!queue.empty() || running>=0)
+        cond.wait(lock);
+}
+
+/// Loop of the worker thread: compute the queued pairs until destruction.
+/// Threads are set for it only with OpenMP, whose number is per thread.
+void AsyncEngine::run() {
+    if(std::string(parallelBackend()) == "OpenMP")
+        setParallelThreads(threads);
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        while(!done && queue.empty())
+            cond.wait(lock);
+        if(done)
+            return;
+        Job job = std::move(queue.front());
+        queue.pop_front();
+        running = job.id;
+        cancelComputation(false);
+        lock.unlock();
+        AsyncResult r;
+        compute(job, r);
+        complete(job, r);
+        lock.lock();
+        running = -1;
+        cancelComputation(false);
+        cond.notify_all();
+    }
+}
+
+#else
+
+/// Constructor.
+AsyncEngine::AsyncEngine(const ParamStereo& param)
+: engine(param, true), next(0) {}
+
+/// Destructor.
+AsyncEngine::~AsyncEngine() {}
+
+/// Compute the pair \a im1, \a im2 of range [\a dMin,\a dMax] at once, then
+/// call \a callback with \a data, and return its number.
+int AsyncEngine::submit(const Image& im1, const Image& im2, int dMin, int dMax,
+                        AsyncCallback callback, void* data) {
+    Job job;
+    job.id = next++;
+    job.im1 = im1;
+    job.im2 = im2;
+    job.dMin = dMin;
+    job.dMax = dMax;
+    job.callback = callback;
+    job.data = data;
+    AsyncResult r;
+    compute(job, r);
+    cancelComputation(false);
+    complete(job, r);
+    return job.id;
+}
+
+/// No pair can be cancelled, all being done.
+bool AsyncEngine::cancel(int) {
+    return false;
+}
+
+/// All pairs are done.
+void AsyncEngine::wait() {}
+
+#endif
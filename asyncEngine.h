@@ -0,0 +1,97 @@
+/**
+ * @file asyncEngine.h
+ * @brief Pairs computed in the background, completion by callback or future
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASYNCENGINE_H
+#define ASYNCENGINE_H
+
+#include "engine.h"
+#include "image.h"
+#if __cplusplus >= 201103L
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#endif
+
+/// Maps of a pair computed by AsyncEngine
+struct AsyncResult {
+    int id;           ///< Number returned by submit()
+    bool ok;          ///< False if cancelled
+    Image disparity;  ///< Final map of image 1, own copy
+    Image confidence; ///< With ParamStereo::confidence, own copy
+    int dMin, dMax;   ///< Disparity range
+};
+
+/// Completion of a pair, called with the data given to submit()
+typedef void (*AsyncCallback)(const AsyncResult& result, void* data);
+
+/// Pairs computed in the background by a StereoEngine, in submission order.
+///
+/// submit() queues a pair and returns at once. A single worker thread owns
+/// the engine, whose threads compute the pairs one after the other, so that
+/// many requests can be in flight without a thread each. The caller learns
+/// the completion by a callback, run by the worker thread, or with C++11 by
+/// a std::future. cancel() drops a queued pair, or cancels the one being
+/// computed through cancelComputation() of timing.h, global to the process,
+/// so that no other computation should run meanwhile. The destructor cancels
+/// the pairs left. Without C++11, submit() computes the pair at once.
+class AsyncEngine {
+public:
+    explicit AsyncEngine(const ParamStereo& param);
+    ~AsyncEngine();
+    int submit(const Image& im1, const Image& im2, int dMin, int dMax,
+               AsyncCallback callback, void* data=0);
+#if __cplusplus >= 201103L
+    std::future<AsyncResult> submit(const Image& im1, const Image& im2,
+                                    int dMin, int dMax, int* id=0);
+#endif
+    bool cancel(int id);
+    void wait();
+private:
+    /// Pair to compute
+    struct Job {
+        int id;
+        Image im1, im2;
+        int dMin, dMax;
+        AsyncCallback callback; ///< Completion, or 0
+        void* data;             ///< Its data
+#if __cplusplus >= 201103L
+        std::shared_ptr<std::promise<AsyncResult> > promise; ///< Or empty
+#endif
+    };
+    StereoEngine engine;
+    int next; ///< Number of next pair
+    void compute(const Job& job, AsyncResult& r);
+    static void complete(Job& job, const AsyncResult& r);
+#if __cplusplus >= 201103L
+    int threads;           ///< Threads of the engine
+    std::deque<Job> queue; ///< Pairs to compute
+    int running;           ///< Pair being computed, or -1
+    bool done;             ///< Destruction started
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+    int push(Job& job);
+    void run();
+#endif
+    AsyncEngine(const AsyncEngine&);            ///< Forbidden
+    AsyncEngine& operator=(const AsyncEngine&); ///< Forbidden
+};
+
+#endif
@@ -0,0 +1,340 @@
+/**
+ * @file bench.cpp
+ * @brief Micro-benchmarks of the main kernels on synthetic images
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "disparity.h"
+#include "occlusion.h"
+#include "rawCost.h"
+#include "loader.h"
+#include "timing.h"
+#include "image.h"
+#include "cmdLine.h"
+#include "argList.h"
+#include "io_png.h"
+#include "io_tiff.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+/// Combinations of weights, each a variant of support and costCombined
+static const char* COMBS[] = {"left", "max", "min", "mult", "plus"};
+
+/// Inputs of the kernels, for an image size, a range and a radius
+struct Case {
+    int w, h;          ///< Image size
+    int dMin, dMax;    ///< Disparity range
+    int radius;        ///< Radius of windows
+    const char* comb;  ///< Combination of weights
+    std::string dir;   ///< Directory of temporary files
+    Image im1, im2;    ///< Synthetic pair
+    Image disp1, disp2; ///< Disparity maps of the pair
+    OcclusionMask mask; ///< Failing left-right check
+};
+
+/// Pseudo-random generator, for reproducible images
+static unsigned int lcg(unsigned int& seed) {
+    seed = seed*1664525u + 1013904223u;
+    return seed>>8;
+}
+
+/// Synthetic pair of size \a c.w x \a c.h: random blocks of colors in im1,
+/// and im2 shifted by a disparity constant on bands of 32 columns, recorded in
+/// disp1 and disp2.
+static void synthetic(Case& c) {
+    const int w=c.w, h=c.h, n=c.dMax-c.dMin+1, bw=(w+3)/4;
+    unsigned int seed=1;
+    std::vector<float> block(3*bw*((h+3)/4));
+    for(size_t i=0; i<block.size(); i++)
+        block[i] = static_cast<float>(lcg(seed)%256);
+    std::vector<int> d((w+31)/32);
+    for(size_t i=0; i<d.size(); i++)
+        d[i] = c.dMin + static_cast<int>(lcg(seed)%n);
+    c.im1 = Image(w,h,3);
+    c.im2 = Image(w,h,3);
+    c.disp1 = Image(w,h);
+    c.disp2 = Image(w,h);
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            const int dx = d[x/32];
+            const int xs = std::min(w-1, std::max(0, x-dx));
+            for(int k=0; k<3; k++) {
+                c.im1(x,y,k) = block[3*((y/4)*bw+x/4)+k];
+                c.im2(x,y,k) = block[3*((y/4)*bw+xs/4)+k];
+            }
+            c.disp1(x,y) = static_cast<float>(dx);
+            c.disp2(x,y) = static_cast<float>(-dx);
+        }
+    c.mask = OcclusionMask(c.disp1, c.dMin, c.dMax);
+    detect_occlusion(c.disp1, c.disp2, 0, c.mask);
+}
+
+/// Parameters of disparity computation of the case
+static ParamDisparity param(const Case& c) {
+    ParamDisparity p;
+    p.radius = c.radius;
+    p.setCombination(c.comb);
+    return p;
+}
+
+/// Adaptive weights: the cost volume, then support and costCombined at all
+/// pixels and disparities.
+static double benchAW(Case& c) {
+    Image d1(c.w,c.h), d2(c.w,c.h);
+    disparityAW(c.im1, c.im2, c.dMin, c.dMax, param(c), d1, d2);
+    return static_cast<double>(c.w)*c.h*(c.dMax-c.dMin+1);
+}
+
+/// Query points: support and costCombined of a window at all disparities,
+/// with the raw costs of the window only.
+static double benchPoints(Case& c) {
+    std::vector<PointDisparity> pts(64);
+    for(size_t i=0; i<pts.size(); i++) {
+        pts[i].x = static_cast<int>(i*37%c.w);
+        pts[i].y = static_cast<int>(i*53%c.h);
+    }
+    disparityPoints(c.im1, c.im2, c.dMin, c.dMax, param(c), pts);
+    return static_cast<double>(pts.size())*(c.dMax-c.dMin+1);
+}
+
+/// Raw costs of the whole volume, layer by layer of rows.
+static double benchCostVolume(Case& c) {
+    const ParamDisparity p = param(c);
+    CostRows<float>* rows = newCostRows<float>(c.im1, c.im2, p);
+    CostVolume* cost = costVolume(*rows, c.w, c.h, c.dMin, c.dMax);
+    delete cost;
+    delete rows;
+    return static_cast<double>(c.w)*c.h*(c.dMax-c.dMin+1);
+}
+
+/// Gray level and horizontal gradient.
+static double benchGradX(Case& c) {
+    c.im1.gray().gradX();
+    return static_cast<double>(c.w)*c.h;
+}
+
+/// Median filter of radius 1 of the color image, guidance of the filling.
+static double benchMedian(Case& c) {
+    c.im1.median(1);
+    return static_cast<double>(c.w)*c.h;
+}
+
+/// Weighted median at pixels failing the left-right check, the window having
+/// the radius of the case.
+static double benchWeightedMedian(Case& c) {
+    Image disp = c.disp1.clone();
+    const ParamOcclusion p;
+    disp.weightedMedian(c.im1, c.mask, c.dMin, c.dMax, c.radius,
+                        p.sigma_space, p.sigma_color);
+    return static_cast<double>(c.w)*c.h;
+}
+
+/// Left-right check.
+static double benchDetectOcclusion(Case& c) {
+    OcclusionMask mask(c.disp1, c.dMin, c.dMax);
+    detect_occlusion(c.disp1, c.disp2, 1, mask);
+    return static_cast<double>(c.w)*c.h;
+}
+
+/// Name of temporary file \a name in directory of the case.
+static std::string tmpFile(const Case& c, const char* name) {
+    return c.dir+"/"+name;
+}
+
+/// Encoding of im1 as 8-bit color PNG.
+static double benchPngWrite(Case& c) {
+    std::vector<unsigned char> data(3*c.w*c.h);
+    for(int k=0; k<3; k++)
+        for(int y=0; y<c.h; y++)
+            for(int x=0; x<c.w; x++)
+                data[(k*c.h+y)*c.w+x]=static_cast<unsigned char>(c.im1(x,y,k));
+    if(io_png_write_u8(tmpFile(c,"bench.png").c_str(), &data[0], c.w, c.h, 3))
+        std::cerr << "Error writing " << tmpFile(c,"bench.png") << std::endl;
+    return static_cast<double>(c.w)*c.h;
+}
+
+/// Decoding of the PNG written by benchPngWrite.
+static double benchPngRead(Case& c) {
+    Image im;
+    if(! loadImage(tmpFile(c,"bench.png").c_str(), im))
+        std::cerr << "Error reading " << tmpFile(c,"bench.png") << std::endl;
+    return static_cast<double>(c.w)*c.h;
+}
+
+/// Encoding of disp1 as float TIFF.
+static double benchTiffWrite(Case& c) {
+    if(! save_disparity(tmpFile(c,"bench.tif").c_str(), c.disp1,
+                        c.dMin, c.dMax))
+        std::cerr << "Error writing " << tmpFile(c,"bench.tif") << std::endl;
+    return static_cast<double>(c.w)*c.h;
+}
+
+/// Decoding of the TIFF written by benchTiffWrite.
+static double benchTiffRead(Case& c) {
+    size_t w, h;
+    float* pix = io_tiff_read_f32_gray(tmpFile(c,"bench.tif").c_str(), &w,&h);
+    if(! pix)
+        std::cerr << "Error reading " << tmpFile(c,"bench.tif") << std::endl;
+    std::free(pix);
+    return static_cast<double>(c.w)*c.h;
+}
+
+/// A kernel and the parameters it depends on
+struct Kernel {
+    const char* name;
+    double (*run)(Case&); ///< Return the work, in units
+    double (*prepare)(Case&); ///< Run before the measures, or 0
+    bool range, radius, comb; ///< Parameters it depends on
+    const char* unit;     ///< Unit of throughput
+};
+
+static const Kernel KERNELS[] = {
+    {"aw", benchAW, 0, true, true, true, "Mpx.disp/s"},
+    {"points", benchPoints, 0, true, true, true, "Mpt.disp/s"},
+    {"cost-volume", benchCostVolume, 0, true, false, false, "Mpx.disp/s"},
+    {"gradX", benchGradX, 0, false, false, false, "Mpx/s"},
+    {"median", benchMedian, 0, false, false, false, "Mpx/s"},
+    {"weighted-median", benchWeightedMedian, 0, false, true, false, "Mpx/s"},
+    {"detect-occlusion", benchDetectOcclusion, 0, false, false, false, "Mpx/s"},
+    {"png-write", benchPngWrite, 0, false, false, false, "Mpx/s"},
+    {"png-read", benchPngRead, benchPngWrite, false, false, false, "Mpx/s"},
+    {"tiff-write", benchTiffWrite, 0, false, false, false, "Mpx/s"},
+    {"tiff-read", benchTiffRead, benchTiffWrite, false, false, false, "Mpx/s"}
+};
+
+/// Parse list \a str of sizes WxH separated by commas.
+static bool parseSizes(const std::string& str, std::vector<int>& sizes) {
+    std::istringstream in(str);
+    std::string item;
+    sizes.clear();
+    while(std::getline(in, item, ',')) {
+        int w=0, h=0;
+        char x=0;
+        std::istringstream s(item);
+        if(!((s>>w>>x>>h) && s.eof() && x=='x' && w>0 && h>0))
+            return false;
+        sizes.push_back(w);
+        sizes.push_back(h);
+    }
+    return !sizes.empty();
+}
+
+/// Best wall time of \a repeat runs of kernel \a k on case \a c, in seconds,
+/// and its work in \a work.
+static double measure(const Kernel& k, Case& c, int repeat, double& work) {
+    if(k.prepare)
+        k.prepare(c);
+    double best=0;
+    for(int i=0; i<repeat; i++) {
+        const double t0 = wallClock();
+        work = k.run(c);
+        const double t = wallClock()-t0;
+        if(i==0 || t<best)
+            best = t;
+    }
+    return best;
+}
+
+/// Run the selected kernels on all combinations of sizes, ranges, radii and,
+/// for aggregation, combinations of weights.
+int main(int argc, char *argv[]) {
+    CmdLine cmd; cmd.prefixDoc="    ";
+    std::string sizeStr("320x240,640x480"), rangeStr("16,64"),
+        radiusStr("9,17"), dir(".");
+    int repeat=3;
+    cmd.add( make_option('s',sizeStr,"sizes")
+             .doc("image sizes WxH, separated by commas") );
+    cmd.add( make_option('d',rangeStr,"ranges")
+             .doc("numbers of disparities, separated by commas") );
+    cmd.add( make_option('R',radiusStr,"radii")
+             .doc("radii of windows, separated by commas") );
+    cmd.add( make_option('n',repeat,"repeat")
+             .doc("runs of each measure, the best one being kept") );
+    cmd.add( make_option(0,dir,"dir")
+             .doc("directory of temporary files of PNG and TIFF codecs") );
+    try {
+        cmd.process(argc, argv);
+    } catch(std::string str) {
+        std::cerr << "Error: " << str << std::endl<<std::endl;
+        argc=-1; // To display usage
+    }
+    std::vector<int> sizes, ranges, radii;
+    if(argc < 1 || !parseSizes(sizeStr, sizes) ||
+       !parseList(rangeStr, ranges) || !parseList(radiusStr, radii) ||
+       repeat<1) {
+        std::cerr << "Usage: " << argv[0] << " [options] [kernel ...]\n"
+                  << "Kernels (default all):";
+        for(size_t k=0; k<sizeof(KERNELS)/sizeof(*KERNELS); k++)
+            std::cerr << ' ' << KERNELS[k].name;
+        std::cerr << "\nOptions:\n" << cmd;
+        return 1;
+    }
+    std::vector<const Kernel*> kernels;
+    for(size_t k=0; k<sizeof(KERNELS)/sizeof(*KERNELS); k++) {
+        bool selected = (argc==1);
+        for(int i=1; i<argc; i++)
+            selected = selected || (KERNELS[k].name == std::string(argv[i]));
+        if(selected)
+            kernels.push_back(&KERNELS[k]);
+    }
+    if(kernels.empty()) {
+        std::cerr << "Error: no known kernel selected" << std::endl;
+        return 1;
+    }
+
+    std::printf("%-16s %9s %5s %4s %4s %10s %12s\n", "kernel", "size",
+                "disp", "R", "comb", "time (ms)", "throughput");
+    Case c;
+    c.dir = dir;
+    for(size_t s=0; s<sizes.size(); s+=2)
+        for(size_t d=0; d<ranges.size(); d++) {
+            c.w = sizes[s];
+            c.h = sizes[s+1];
+            c.dMin = -(ranges[d]-1); // Range as in tsukuba
+            c.dMax = 0;
+            c.radius = radii[0];
+            c.comb = "mult";
+            synthetic(c);
+            for(size_t k=0; k<kernels.size(); k++) {
+                const Kernel& K = *kernels[k];
+                if(!K.range && d>0)
+                    continue;
+                const size_t nR = K.radius? radii.size(): 1;
+                const size_t nC = K.comb? sizeof(COMBS)/sizeof(*COMBS): 1;
+                for(size_t r=0; r<nR; r++)
+                    for(size_t m=0; m<nC; m++) {
+                        c.radius = radii[r];
+                        c.comb = K.comb? COMBS[m]: "mult";
+                        double work=0;
+                        const double t = measure(K, c, repeat, work);
+                        char size[32];
+                        std::sprintf(size, "%dx%d", c.w, c.h);
+                        std::printf("%-16s %9s %5d %4d %4s %10.2f %8.1f %s\n",
+                                    K.name, size,
+                                    K.range? ranges[d]: 0,
+                                    K.radius? c.radius: 0,
+                                    K.comb? c.comb: "-", 1e3*t,
+                                    (t>0)? work/t*1e-6: 0, K.unit);
+                        std::fflush(stdout);
+                    }
+            }
+        }
+    std::remove(tmpFile(c,"bench.png").c_str());
+    std::remove(tmpFile(c,"bench.tif").c_str());
+    return 0;
+}
@@ -0,0 +1,237 @@
+/**
+ * @file bilateralGrid.cpp
+ * @brief Disparity map estimation by bilateral grid filtering of costs
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bilateralGrid.h"
+#include "disparity.h"
+#include "image.h"
+#include "rawCost.h"
+#include <algorithm>
+#include <vector>
+#include <limits>
+#include <iostream>
+#include <cmath>
+
+/// Cells of margin around the grid, the radius of its blur
+static const int PAD=2;
+
+/// Bilateral grid of Chen et al. (2007), guided by a gray image.
+///
+/// A layer is splatted in the cell of each pixel, of sigmaS pixels in x and
+/// y and sigmaR gray levels, blurred by the binomial kernel [1 4 6 4 1]/16
+/// in the three dimensions, then sliced at the pixels by trilinear
+/// interpolation, the sum of costs being divided by the number of pixels. The
+/// cells of the pixels are computed once, so that the cost per pixel of a
+/// layer is constant, the grid being small.
+class BilateralGrid {
+public:
+    BilateralGrid(const Image& guide, float sigmaS, float sigmaR);
+    void filter(const Image& p, int x0, int x1, float out, Image& q);
+private:
+    int w, h, gw, gh, gd; ///< Dimensions of the image and of the grid
+    std::vector<int> ix, iy, iz;   ///< Cell below of column, row, pixel
+    std::vector<float> ax, ay, az; ///< Fractions of trilinear interpolation
+    std::vector<size_t> splat;     ///< Nearest cell of each pixel
+    std::vector<float> num, den, tmp; ///< Sums of costs and of pixels
+    void blur(std::vector<float>& g);
+    size_t cell(int x, int y, int z) const {
+        return (static_cast<size_t>(y)*gw+x)*gd+z;
+    }
+    float slice(const std::vector<float>& g, size_t i, float fx, float fy,
+                float fz) const;
+};
+
+/// Cell \a i below coordinate \a f>=0 of the grid and fraction \a a beyond.
+static void below(float f, int& i, float& a) {
+    i = static_cast<int>(f);
+    a = f-i;
+}
+
+/// Constructor. Guidance with more than one channel is converted to gray.
+BilateralGrid::BilateralGrid(const Image& guide, float sigmaS, float sigmaR)
+: w(guide.width()), h(guide.height()),
+  ix(w), iy(h), iz(static_cast<size_t>(w)*h),
+  ax(w), ay(h), az(iz.size()), splat(iz.size()) {
+    const Image g = (guide.channels()==1)? guide: guide.gray();
+    float lo=std::numeric_limits<float>::max(), hi=-lo;
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            lo = std::min(lo, g(x,y));
+            hi = std::max(hi, g(x,y));
+        }
+    gw = static_cast<int>((w-1)/sigmaS)+2+2*PAD;
+    gh = static_cast<int>((h-1)/sigmaS)+2+2*PAD;
+    gd = static_cast<int>((hi-lo)/sigmaR)+2+2*PAD;
+    for(int x=0; x<w; x++)
+        below(x/sigmaS+PAD, ix[x], ax[x]);
+    for(int y=0; y<h; y++)
+        below(y/sigmaS+PAD, iy[y], ay[y]);
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            const size_t i = static_cast<size_t>(y)*w+x;
+            below((g(x,y)-lo)/sigmaR+PAD, iz[i], az[i]);
+            splat[i] = cell(ix[x]+(ax[x]>=.5f), iy[y]+(ay[y]>=.5f),
+                            iz[i]+(az[i]>=.5f));
+        }
+    num.resize(static_cast<size_t>(gw)*gh*gd);
+    den.resize(num.size());
+    tmp.resize(num.size());
+}
+
+/// Convolution of grid \a g by [1 4 6 4 1]/16 along each dimension, null
+/// outside.
+void BilateralGrid::blur(std::vector<float>& g) {
+    const int dims[3] = {gd, gw, gh};
+    const size_t steps[3] = {1, static_cast<size_t>(gd),
+                             static_cast<size_t>(gw)*gd};
+    for(int a=0; a<3; a++) {
+        const int n=dims[a];
+        const size_t s=steps[a];
+        for(size_t i=0; i<g.size(); i++) {
+            const int c = static_cast<int>(i/s%n); // Coordinate along a
+            float v = 6*g[i];
+            if(c >= 1)  v += 4*g[i-s];
+            if(c >= 2)  v += g[i-2*s];
+            if(c+1 < n) v += 4*g[i+s];
+            if(c+2 < n) v += g[i+2*s];
+            tmp[i] = v/16;
+        }
+        g.swap(tmp);
+    }
+}
+
+/// Trilinear interpolation of grid \a g in the cube of corner cell \a i,
+/// with fractions \a fx, \a fy, \a fz.
+float BilateralGrid::slice(const std::vector<float>& g, size_t i,
+                           float fx, float fy, float fz) const {
+    const size_t sx=gd, sy=static_cast<size_t>(gw)*gd;
+    const float* c = &g[i];
+    const float v00 = c[0]*(1-fz)+c[1]*fz, v10 = c[sx]*(1-fz)+c[sx+1]*fz;
+    const float v01 = c[sy]*(1-fz)+c[sy+1]*fz;
+    const float v11 = c[sx+sy]*(1-fz)+c[sx+sy+1]*fz;
+    return (v00*(1-fx)+v10*fx)*(1-fy) + (v01*(1-fx)+v11*fx)*fy;
+}
+
+/// Filter layer \a p, defined in columns [\a x0,\a x1), result in \a q in the
+/// same columns, \a out where no pixel is near.
+void BilateralGrid::filter(const Image& p, int x0, int x1, float out,
+                           Image& q) {
+    std::fill(num.begin(), num.end(), 0.0f);
+    std::fill(den.begin(), den.end(), 0.0f);
+    for(int y=0; y<h; y++)
+        for(int x=x0; x<x1; x++) {
+            const size_t k = splat[static_cast<size_t>(y)*w+x];
+            num[k] += p(x,y);
+            den[k] += 1;
+        }
+    blur(num);
+    blur(den);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<h; y++)
+        for(int x=x0; x<x1; x++) {
+            const size_t i = static_cast<size_t>(y)*w+x;
+            const size_t k = cell(ix[x], iy[y], iz[i]);
+            const float n = slice(num, k, ax[x], ay[y], az[i]);
+            const float d = slice(den, k, ax[x], ay[y], az[i]);
+            q(x,y) = (d>0)? n/d: out;
+        }
+}
+
+/// Disparity computation by bilateral grid filtering of the cost volume.
+///
+/// Each layer of the cost volume is filtered by a bilateral grid guided by
+/// the gray levels of the image, an approximation of the aggregation of
+/// adaptive weights with the weights of the pixel only (CombineLeft), whose
+/// cost per pixel does not depend on the window. The cells have gammaPos/2
+/// pixels and gammaCol gray levels. For image 2, the layers are shifted to be
+/// expressed in its coordinates and filtered with its own guidance. Output
+/// maps are as with disparityAW.
+/// \param im1,im2 the two color images
+/// \param dMin,dMax disparity range
+/// \param param raw cost computation parameters
+/// \param disp1 output disparity map from image 1 to image 2
+/// \param disp2 output disparity map from image 2 to image 1
+void disparityBG(Image im1, Image im2,
+                 int dMin, int dMax, const ParamDisparity& param,
+                 Image& disp1, Image& disp2) {
+    if(param.intCost && !(is_8bit(im1) && is_8bit(im2))) {
+        std::cerr << "Warning: images are not 8-bit, "
+                  << "using float raw cost" << std::endl;
+        ParamDisparity p(param);
+        p.intCost = false;
+        disparityBG(im1, im2, dMin, dMax, p, disp1, disp2);
+        return;
+    }
+    const int width=im1.width(), height=im1.height();
+    const float sigmaS = std::max(1.0f, param.gammaPos/2);
+    const float sigmaR = param.gammaCol;
+
+    CostRows<float>* rows = newCostRows<float>(im1, im2, param);
+    CostVolume* cost = costVolume(*rows, width, height, dMin, dMax,
+                                  0, 0, param.costPages);
+    const float costOut = rows->maxCost();
+    delete rows;
+
+    BilateralGrid bg1(im1, sigmaS, sigmaR), bg2(im2, sigmaS, sigmaR);
+    Image p(width,height), q(width,height); // Layer and filtered layer
+    Image E1(width,height), E2(width,height);
+    E1.fill(std::numeric_limits<float>::max());
+    E2.fill(std::numeric_limits<float>::max());
+    for(int d=dMin; d<=dMax; d++) {
+        const int x0=std::max(0,-d), x1=std::min(width,width-d);
+        if(x0 >= x1)
+            continue;
+        // Layer in coordinates of image 1, pixel x matched to x+d
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=x0; x<x1; x++)
+                p(x,y) = cost->get(x,y,d);
+        bg1.filter(p, x0, x1, costOut, q);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=x0; x<x1; x++)
+                if(E1(x,y) > q(x,y)) {
+                    E1(x,y) = q(x,y);
+                    disp1(x,y) = static_cast<float>(d);
+                }
+        if(param.leftOnly)
+            continue;
+        // Layer in coordinates of image 2, pixel x matched to x-d
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=x0+d; x<x1+d; x++)
+                p(x,y) = cost->get(x-d,y,d);
+        bg2.filter(p, x0+d, x1+d, costOut, q);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=x0+d; x<x1+d; x++)
+                if(E2(x,y) > q(x,y)) {
+                    E2(x,y) = q(x,y);
+                    disp2(x,y) = -static_cast<float>(d);
+                }
+    }
+    delete cost;
+}
@@ -0,0 +1,246 @@
+/**
+ * @file costVolume.cpp
+ * @brief Storage of raw matching costs for all disparities
+ * @author Laura F. Julia <fernandl@imagine.enpc.fr>
+ *         Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Laura F. Julia, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "costVolume.h"
+
+/// Alignment in bytes of the cost array (a cache line)
+static const size_t ALIGN=64;
+
+/// Block kept by alignedDelete for the next alignedNew, see recycleCosts().
+static char* keptMem=0;
+static size_t keptSize=0; ///< Usable bytes of keptMem
+static bool recycle=false; ///< Keep blocks?
+
+/// Allocate at least \a size bytes, of which the start \a aligned is aligned
+/// on a cache line, \a size being set to the usable bytes. The returned
+/// pointer should be freed with alignedDelete.
+char* alignedNew(size_t& size, void*& aligned) {
+    char* mem=0;
+#ifdef _OPENMP
+#pragma omp critical(alignedNew)
+#endif
+    if(keptMem && size<=keptSize && keptSize/2<=size) {
+        mem = keptMem;
+        size = keptSize;
+        keptMem = 0;
+    }
+    if(! mem)
+        mem = new char[size+ALIGN];
+    size_t shift = reinterpret_cast<size_t>(mem) % ALIGN;
+    aligned = mem + (shift? ALIGN-shift: 0);
+    return mem;
+}
+
+/// Free block \a mem of \a size usable bytes returned by alignedNew, or keep
+/// it for the next allocation if recycling.
+void alignedDelete(char* mem, size_t size) {
+    char* old=mem;
+#ifdef _OPENMP
+#pragma omp critical(alignedNew)
+#endif
+    if(recycle && mem && (!keptMem || keptSize<size)) {
+        old = keptMem;
+        keptMem = mem;
+        keptSize = size;
+    }
+    delete [] old;
+}
+
+/// Keep released cost volumes in memory for the next ones (\a on) or not.
+///
+/// The largest block freed is kept, reused by a volume of at most its size and
+/// at least half. This saves the allocation and page faults of the biggest
+/// buffer when many pairs are processed in a process, see option --batch.
+/// Stopping recycling frees the kept block.
+void recycleCosts(bool on) {
+    recycle = on;
+    if(! on) {
+        delete [] keptMem;
+        keptMem = 0;
+        keptSize = 0;
+    }
+}
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+/// Size in bytes of the header of a cost file, data begins aligned after it
+static const size_t HEADER=ALIGN;
+
+/// Map file \a fileName for a volume of \a size bytes.
+///
+/// If the file exists and begins with \a header, it is mapped privately and
+/// \a existing is set. Otherwise, the temporary file fileName.tmp is created,
+/// writing \a header, and mapped shared. The mapping is returned in \a base and
+/// \a baseSize, the start of the data is returned, 0 in case of failure.
+void* mapCostFile(const std::string& fileName, const int header[8],
+                  size_t size, bool& existing, void*& base, size_t& baseSize) {
+    existing = false;
+    base = 0;
+    baseSize = HEADER+size;
+#ifdef __unix__
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if(fd >= 0) {
+        int h[8];
+        struct stat st;
+        existing = (fstat(fd,&st)==0
+                    && static_cast<size_t>(st.st_size)==baseSize
+                    && read(fd,h,sizeof(h))==sizeof(h)
+                    && std::memcmp(h,header,sizeof(h))==0);
+        if(existing) {
+            base = mmap(0,baseSize, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd,0);
+            close(fd);
+            if(base != MAP_FAILED)
+                return static_cast<char*>(base)+HEADER;
+            base = 0;
+            return 0;
+        }
+        close(fd);
+    }
+    std::string tmp = fileName+".tmp";
+    fd = open(tmp.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if(fd < 0)
+        return 0;
+    if(ftruncate(fd, baseSize) != 0) {
+        close(fd);
+        unlink(tmp.c_str());
+        return 0;
+    }
+    base = mmap(0, baseSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        base = 0;
+        unlink(tmp.c_str());
+        return 0;
+    }
+    std::memcpy(base, header, 8*sizeof(int));
+    return static_cast<char*>(base)+HEADER;
+#else
+    (void)fileName; (void)header;
+    return 0;
+#endif
+}
+
+/// Map an anonymous scratch file of \a size bytes in directory \a dir.
+///
+/// The file is removed at once, so that it disappears with its mapping,
+/// returned in \a base and \a baseSize. Return the start of the data, 0 in
+/// case of failure.
+void* mapScratchFile(const std::string& dir, size_t size,
+                     void*& base, size_t& baseSize) {
+    base = 0;
+    baseSize = size;
+#ifdef __unix__
+    std::string name = dir+"/awcostXXXXXX";
+    std::vector<char> path(name.begin(), name.end());
+    path.push_back(0);
+    int fd = mkstemp(&path[0]);
+    if(fd < 0)
+        return 0;
+    unlink(&path[0]);
+    if(ftruncate(fd, baseSize) != 0) {
+        close(fd);
+        return 0;
+    }
+    base = mmap(0, baseSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        base = 0;
+        return 0;
+    }
+    return base;
+#else
+    (void)dir;
+    return 0;
+#endif
+}
+
+/// Advise the system that \a size bytes of a mapped file from \a data will
+/// be needed soon (MADV_WILLNEED), starting the reads.
+void adviseCostFile(const void* data, size_t size) {
+#if defined(__unix__) && defined(MADV_WILLNEED)
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t a = reinterpret_cast<size_t>(data), start = a/page*page;
+    madvise(reinterpret_cast<void*>(start), a+size-start, MADV_WILLNEED);
+#else
+    (void)data; (void)size;
+#endif
+}
+
+/// Size in bytes of a huge page
+static const size_t HUGE_PAGE=size_t(2)<<20;
+
+/// Anonymous memory of \a size bytes in huge \a pages, for a cost volume.
+///
+/// The start of the data, returned, is aligned on a huge page. The mapping is
+/// returned in \a base and \a baseSize, to be freed with unmapCostFile. In
+/// case of failure, a warning is displayed and 0 returned.
+void* mapCostMemory(size_t size, CostPages pages,
+                    void*& base, size_t& baseSize) {
+    base = 0;
+    baseSize = (size+HUGE_PAGE-1)/HUGE_PAGE*HUGE_PAGE;
+#if defined(__linux__) && defined(MAP_HUGETLB) && defined(MADV_HUGEPAGE)
+    int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+    if(pages == PagesHuge)
+        flags |= MAP_HUGETLB; // Aligned by the system
+    else
+        baseSize += HUGE_PAGE; // Margin for alignment
+    base = mmap(0, baseSize, PROT_READ|PROT_WRITE, flags, -1, 0);
+    if(base == MAP_FAILED) {
+        base = 0;
+        std::cerr << "Warning: no huge pages available for cost volume"
+                  << std::endl;
+        return 0;
+    }
+    char* data = static_cast<char*>(base);
+    if(pages == PagesTransparent) {
+        size_t shift = reinterpret_cast<size_t>(data) % HUGE_PAGE;
+        data += shift? HUGE_PAGE-shift: 0;
+        madvise(data, baseSize-HUGE_PAGE, MADV_HUGEPAGE);
+    }
+    return data;
+#else
+    (void)pages;
+    std::cerr << "Warning: huge pages not supported" << std::endl;
+    return 0;
+#endif
+}
+
+/// Unmap file mapped by mapCostFile, or memory mapped by mapCostMemory.
+void unmapCostFile(void* base, size_t baseSize) {
+#ifdef __unix__
+    munmap(base, baseSize);
+#else
+    (void)base; (void)baseSize;
+#endif
+}
+
+/// Rename temporary file created by mapCostFile to \a fileName, making it
+/// visible to later runs. Called once the costs are filled.
+bool commitCostFile(const std::string& fileName) {
+    std::string tmp = fileName+".tmp";
+    return std::rename(tmp.c_str(), fileName.c_str()) == 0;
+}
@@ -0,0 +1,334 @@
+/**
+ * @file costVolume.h
+ * @brief Storage of raw matching costs for all disparities
+ * @author Laura F. Julia <fernandl@imagine.enpc.fr>
+ *         Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Laura F. Julia, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSTVOLUME_H
+#define COSTVOLUME_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cassert>
+#include <string>
+#include <vector>
+
+/// Memory pages of cost volumes
+enum CostPages {
+    PagesNormal,      ///< Standard allocation
+    PagesTransparent, ///< Transparent huge pages, requested with madvise
+    PagesHuge         ///< Explicit huge pages, reserved by the system
+};
+
+char* alignedNew(size_t& size, void*& aligned);
+void alignedDelete(char* mem, size_t size);
+void recycleCosts(bool on);
+void* mapCostMemory(size_t size, CostPages pages,
+                    void*& base, size_t& baseSize);
+void* mapCostFile(const std::string& fileName, const int header[8],
+                  size_t size, bool& existing, void*& base, size_t& baseSize);
+void* mapScratchFile(const std::string& dir, size_t size,
+                     void*& base, size_t& baseSize);
+void adviseCostFile(const void* data, size_t size);
+void unmapCostFile(void* base, size_t baseSize);
+bool commitCostFile(const std::string& fileName);
+
+/// Cost volume, raw matching costs of all pixels at all disparities.
+///
+/// All costs are stored in a single aligned block of memory. The layout is
+/// selected at construction:
+///   - DispMajor [d][y][x]: each disparity is a contiguous image layer.
+///   - PixelMajor [y][x][d]: the costs of a pixel are contiguous.
+///   - RowRagged [y][d][x]: row y has only the layers of its own interval of
+///     disparities, see ragged(). Stride strideY() is meaningless.
+/// Access is through strides, so that code can be written independently of the
+/// layout. The volume is not copyable, its size is potentially huge. Costs
+/// (x,y,d) with x+d outside the image are not defined.
+///
+/// The volume can also be rolling: only a given number of rows are resident,
+/// row y being stored at index y%rows(). It is the responsibility of the user
+/// to compute the rows before using them.
+///
+/// The storage type T is float or unsigned short. In the latter case, costs
+/// in [0,maxCost] are quantized in fixed point: a cost is scale() times the
+/// stored value. Since costs are bounded, this is more accurate than half
+/// floats for the same memory. Raw access through ptr() gives stored values,
+/// get() and set() convert to/from float costs.
+///
+/// Instead of memory, the volume can also be backed by a memory mapped file,
+/// see mapped(). This allows reusing volumes across runs. A volume larger
+/// than memory can be spilled to a scratch file, see scratch(). Large volumes
+/// can be allocated in huge pages to reduce TLB misses, see CostPages.
+template <typename T>
+class CostVolumeT {
+public:
+    /// Order of storage of costs in memory
+    enum Layout {
+        DispMajor, ///< [d][y][x]
+        PixelMajor, ///< [y][x][d]
+        RowRagged   ///< [y][d][x] with range of d depending on y
+    };
+    CostVolumeT(int width, int height, int dMin, int dMax, float maxCost,
+                Layout layout=DispMajor, int rows=0,
+                CostPages pages=PagesNormal);
+    ~CostVolumeT();
+    static CostVolumeT* mapped(const std::string& fileName,
+                               int width, int height, int dMin, int dMax,
+                               float maxCost, bool& existing);
+    static CostVolumeT* ragged(int width, int height, int dMin, int dMax,
+                               float maxCost,
+                               const int* rowLo, const int* rowHi,
+                               CostPages pages=PagesNormal);
+    static CostVolumeT* scratch(const std::string& dir,
+                                int width, int height, int dMin, int dMax,
+                                float maxCost);
+    bool commit() const;
+    void willNeed(int y0, int y1) const;
+
+    int width() const { return w; }
+    int height() const { return h; }
+    int rows() const { return hr; } ///< Number of resident rows
+    int dMin() const { return d0; }
+    int dMax() const { return d0+nd-1; }
+    int nDisp() const { return nd; }
+    Layout layout() const { return l; }
+    /// Strides in number of elements between successive x, y and d.
+    ptrdiff_t strideX() const { return sx; }
+    ptrdiff_t strideY() const { return sy; }
+    ptrdiff_t strideD() const { return sd; }
+    /// Factor to apply to stored values to get costs
+    float scale() const { return s; }
+
+    const T* ptr(int x,int y,int d) const { return tab+offset(x,y,d); }
+    T*       ptr(int x,int y,int d)       { return tab+offset(x,y,d); }
+    float get(int x,int y,int d) const { return s*tab[offset(x,y,d)]; }
+    void set(int x,int y,int d, float v) { tab[offset(x,y,d)]=encode(v); }
+    void setRow(int y, int d, const float* v, int x0, int x1);
+private:
+    T* tab;     ///< Aligned array of costs
+    char* mem;  ///< Allocated memory, tab is inside
+    size_t memSize; ///< Usable bytes of mem
+    int w, h;   ///< Dimensions of images
+    int hr;     ///< Number of resident rows
+    int d0, nd; ///< Min disparity and number of disparities
+    Layout l;   ///< Layout in memory
+    ptrdiff_t sx, sy, sd; ///< Strides
+    float s, invS; ///< Quantization step and its inverse
+    void* mapBase;     ///< Start of mapped file, 0 if in memory
+    size_t mapSize;    ///< Size of mapped file
+    std::string file;  ///< Name of mapped file, if not committed yet
+    std::vector<ptrdiff_t> rowOff; ///< Offset of (0,y,dMin), for RowRagged
+
+    ptrdiff_t offset(int x, int y, int d) const {
+        if(! rowOff.empty())
+            return rowOff[y] + x + (d-d0)*sd;
+        return x*sx + (y<hr? y: y%hr)*sy + (d-d0)*sd;
+    }
+    T encode(float v) const;
+    void init(float maxCost, int rows);
+    void alloc(size_t size, CostPages pages);
+    CostVolumeT(int width, int height, int dMin, int dMax, Layout layout)
+    : tab(0), mem(0), memSize(0), w(width), h(height), hr(height), d0(dMin),
+      nd(dMax-dMin+1), l(layout), mapBase(0), mapSize(0) {}
+    CostVolumeT(const CostVolumeT&);            ///< Forbidden
+    CostVolumeT& operator=(const CostVolumeT&); ///< Forbidden
+};
+
+/// Float cost volume, the reference
+typedef CostVolumeT<float> CostVolume;
+/// Cost volume quantized on 16 bits
+typedef CostVolumeT<unsigned short> CostVolume16;
+
+/// Constructor, costs are not initialized.
+///
+/// \a maxCost is an upper bound of costs, used only for quantized storage.
+/// If \a rows is positive and less than \a height, only this number of rows is
+/// resident (rolling volume). Memory is in \a pages.
+template <typename T>
+CostVolumeT<T>::CostVolumeT(int width, int height, int dMin, int dMax,
+                            float maxCost, Layout layout, int rows,
+                            CostPages pages)
+: tab(0), mem(0), memSize(0), w(width), h(height), hr(height),
+  d0(dMin), nd(dMax-dMin+1), l(layout), mapBase(0), mapSize(0) {
+    init(maxCost, rows);
+    alloc(static_cast<size_t>(w)*hr*nd*sizeof(T), pages);
+}
+
+/// Destructor
+template <typename T>
+CostVolumeT<T>::~CostVolumeT() {
+    if(mapBase)
+        unmapCostFile(mapBase, mapSize);
+    alignedDelete(mem, memSize);
+}
+
+/// Set strides and quantization.
+template <typename T>
+void CostVolumeT<T>::init(float maxCost, int rows) {
+    assert(w>=0 && h>=0 && nd>0);
+    s = invS = 1.0f;
+    if(0<rows && rows<h)
+        hr = rows;
+    if(l == DispMajor) {
+        sx = 1;
+        sy = w;
+        sd = static_cast<ptrdiff_t>(w)*hr;
+    } else if(l == RowRagged) {
+        sx = 1;
+        sy = 0;
+        sd = w;
+    } else {
+        sd = 1;
+        sx = nd;
+        sy = static_cast<ptrdiff_t>(w)*nd;
+    }
+    if(T(0.5f) == T(0) && maxCost>0) { // Integral type
+        s = maxCost / T(-1);
+        invS = T(-1) / maxCost;
+    }
+}
+
+/// Allocate \a size bytes of costs in \a pages, aligned on a cache line.
+///
+/// If huge pages are not available, normal allocation is used.
+template <typename T>
+void CostVolumeT<T>::alloc(size_t size, CostPages pages) {
+    void* aligned=0;
+    if(pages != PagesNormal)
+        aligned = mapCostMemory(size, pages, mapBase, mapSize);
+    if(! aligned) {
+        memSize = size;
+        mem = alignedNew(memSize, aligned);
+    }
+    tab = static_cast<T*>(aligned);
+}
+
+/// Volume in layout DispMajor backed by memory mapped file \a fileName.
+///
+/// If the file exists with the same dimensions, its costs are used as is and
+/// \a existing is set. Otherwise, a temporary file is created and costs must
+/// be filled, then the file made permanent with commit(). Return 0 if the
+/// file cannot be mapped.
+template <typename T>
+CostVolumeT<T>* CostVolumeT<T>::mapped(const std::string& fileName,
+                                       int width, int height,
+                                       int dMin, int dMax, float maxCost,
+                                       bool& existing) {
+    CostVolumeT* v = new CostVolumeT(width, height, dMin, dMax, DispMajor);
+    v->init(maxCost, 0);
+    const size_t size = static_cast<size_t>(width)*height*v->nd*sizeof(T);
+    const int header[8] = {0x41574356 /*AWCV*/, 1 /*version*/, width, height,
+                           dMin, dMax, static_cast<int>(sizeof(T)),
+                           static_cast<int>(T(0.5f)!=T(0))};
+    void* data = mapCostFile(fileName, header, size, existing,
+                             v->mapBase, v->mapSize);
+    if(! data) {
+        delete v;
+        return 0;
+    }
+    v->tab = static_cast<T*>(data);
+    if(! existing)
+        v->file = fileName;
+    return v;
+}
+
+/// Volume in layout RowRagged, row y having only disparities in
+/// [rowLo[y],rowHi[y]] (possibly empty).
+///
+/// Memory is proportional to the sum of the lengths of these intervals
+/// instead of height*(dMax-dMin+1). No other cost must be accessed.
+template <typename T>
+CostVolumeT<T>* CostVolumeT<T>::ragged(int width, int height,
+                                       int dMin, int dMax, float maxCost,
+                                       const int* rowLo, const int* rowHi,
+                                       CostPages pages) {
+    CostVolumeT* v = new CostVolumeT(width, height, dMin, dMax, RowRagged);
+    v->init(maxCost, 0);
+    v->rowOff.resize(height);
+    ptrdiff_t size=0;
+    for(int y=0; y<height; y++) {
+        const int lo=std::max(dMin,rowLo[y]), hi=std::min(dMax,rowHi[y]);
+        v->rowOff[y] = size - static_cast<ptrdiff_t>(lo-dMin)*width;
+        if(lo <= hi)
+            size += static_cast<ptrdiff_t>(hi-lo+1)*width;
+    }
+    v->alloc(static_cast<size_t>(size)*sizeof(T), pages);
+    return v;
+}
+
+/// Volume in layout RowRagged with all disparities in each row, [y][d][x],
+/// backed by an anonymous scratch file in directory \a dir.
+///
+/// The rows of a band are contiguous in the file, read in the order of the
+/// traversal of aggregation, so that the volume may exceed memory, pages
+/// being read back from disk when needed, see willNeed(). Return 0 if the
+/// file cannot be mapped.
+template <typename T>
+CostVolumeT<T>* CostVolumeT<T>::scratch(const std::string& dir,
+                                        int width, int height,
+                                        int dMin, int dMax, float maxCost) {
+    CostVolumeT* v = new CostVolumeT(width, height, dMin, dMax, RowRagged);
+    v->init(maxCost, 0);
+    v->rowOff.resize(height);
+    const ptrdiff_t row = static_cast<ptrdiff_t>(width)*v->nd;
+    for(int y=0; y<height; y++)
+        v->rowOff[y] = y*row;
+    void* data = mapScratchFile(dir, static_cast<size_t>(height)*row*sizeof(T),
+                                v->mapBase, v->mapSize);
+    if(! data) {
+        delete v;
+        return 0;
+    }
+    v->tab = static_cast<T*>(data);
+    return v;
+}
+
+/// Announce that rows [y0,y1) will be read soon, so that the system reads
+/// ahead the pages of a volume of scratch().
+template <typename T>
+void CostVolumeT<T>::willNeed(int y0, int y1) const {
+    if(!mapBase || rowOff.empty() || y0>=y1)
+        return;
+    const T* end = (y1<h)? tab+rowOff[y1]: tab+rowOff[h-1]+nd*sd;
+    adviseCostFile(tab+rowOff[y0], (end-(tab+rowOff[y0]))*sizeof(T));
+}
+
+/// Make mapped file permanent after filling costs.
+template <typename T>
+bool CostVolumeT<T>::commit() const {
+    return mapBase && !file.empty() && commitCostFile(file);
+}
+
+/// Stored value of cost \a v.
+template <typename T>
+inline T CostVolumeT<T>::encode(float v) const {
+    return static_cast<T>(v*invS+0.5f);
+}
+
+/// No quantization for float volume.
+template <>
+inline float CostVolumeT<float>::encode(float v) const {
+    return v;
+}
+
+/// Set costs of pixels (x,y,d) for x0<=x<x1, with v[x] the cost of x.
+template <typename T>
+void CostVolumeT<T>::setRow(int y, int d, const float* v, int x0, int x1) {
+    T* e = ptr(x0,y,d);
+    for(int x=x0; x<x1; x++, e+=sx)
+        *e = encode(v[x]);
+}
+
+#endif
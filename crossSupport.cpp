@@ -0,0 +1,222 @@
+/**
+ * @file crossSupport.cpp
+ * @brief Disparity map estimation by cross-based support aggregation
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crossSupport.h"
+#include "disparity.h"
+#include "image.h"
+#include "rawCost.h"
+#include <algorithm>
+#include <vector>
+#include <limits>
+#include <iostream>
+#include <cmath>
+
+/// Columns processed together in vertical pass
+static const int BLOCK=64;
+
+/// Cross-based support regions of Zhang et al. (2009).
+///
+/// Each pixel p has four arms, the longest segments of at most L pixels from p
+/// in directions left, right, up and down whose colors differ from the one of
+/// p by less than tau in every channel. The support region of p is the union
+/// of the horizontal segments of the pixels of its vertical segment. Sums over
+/// these regions are computed with running sums, at a cost per pixel
+/// independent of L.
+class CrossSupport {
+public:
+    CrossSupport(const Image& im, int L, float tau);
+    void filter(const float* p, float* q);
+private:
+    int w, h;
+    std::vector<short> left, right, up, down; ///< Arm lengths
+    std::vector<float> invArea; ///< Inverse of number of pixels of region
+    std::vector<float> horiz;   ///< Buffer of horizontal sums
+    std::vector<double> vert;   ///< Buffer of running vertical sums
+    int arm(const Image& im, int x, int y, int dx, int dy,
+            int L, float tau) const;
+    void sum(const float* p, float* q);
+};
+
+/// Length of arm of pixel (x,y) in direction (dx,dy).
+int CrossSupport::arm(const Image& im, int x, int y, int dx, int dy,
+                      int L, float tau) const {
+    const int c=im.channels();
+    int k=1;
+    for(int xq=x+dx, yq=y+dy; k<=L; k++, xq+=dx, yq+=dy) {
+        if(xq<0 || xq>=w || yq<0 || yq>=h)
+            break;
+        float diff=0;
+        for(int i=0; i<c; i++)
+            diff = std::max(diff, std::abs(im(xq,yq,i)-im(x,y,i)));
+        if(diff >= tau)
+            break;
+    }
+    return k-1;
+}
+
+/// Constructor, computing arms of length at most \a L and threshold \a tau.
+CrossSupport::CrossSupport(const Image& im, int L, float tau)
+: w(im.width()), h(im.height()),
+  left(w*h), right(w*h), up(w*h), down(w*h), invArea(w*h),
+  horiz(w*h), vert(static_cast<size_t>(w)*(h+1)) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            const int i=y*w+x;
+            left[i]  = static_cast<short>(arm(im, x, y, -1, 0, L, tau));
+            right[i] = static_cast<short>(arm(im, x, y, +1, 0, L, tau));
+            up[i]    = static_cast<short>(arm(im, x, y, 0, -1, L, tau));
+            down[i]  = static_cast<short>(arm(im, x, y, 0, +1, L, tau));
+        }
+    std::vector<float> one(w*h, 1.0f);
+    sum(&one[0], &invArea[0]);
+    for(int i=0; i<w*h; i++)
+        invArea[i] = 1/invArea[i];
+}
+
+/// Sums of \a p over support regions, result in \a q.
+void CrossSupport::sum(const float* p, float* q) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<h; y++) { // Horizontal sums, from running sums in row
+        std::vector<double> s(w+1);
+        const float* pr = p+y*w;
+        s[0] = 0;
+        for(int x=0; x<w; x++)
+            s[x+1] = s[x]+pr[x];
+        for(int x=0; x<w; x++) {
+            const int i=y*w+x;
+            horiz[i] = static_cast<float>(s[x+right[i]+1]-s[x-left[i]]);
+        }
+    }
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int xb=0; xb<w; xb+=BLOCK) { // Running sums in columns
+        const int x1 = std::min(w,xb+BLOCK);
+        for(int x=xb; x<x1; x++)
+            vert[x] = 0;
+        for(int y=0; y<h; y++)
+            for(int x=xb; x<x1; x++)
+                vert[(y+1)*w+x] = vert[y*w+x]+horiz[y*w+x];
+    }
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<h; y++) // Vertical sums
+        for(int x=0; x<w; x++) {
+            const int i=y*w+x;
+            q[i] = static_cast<float>(vert[(y+down[i]+1)*w+x]-
+                                      vert[(y-up[i])*w+x]);
+        }
+}
+
+/// Mean of \a p over support regions, result in \a q.
+void CrossSupport::filter(const float* p, float* q) {
+    sum(p, q);
+    for(int i=0; i<w*h; i++)
+        q[i] *= invArea[i];
+}
+
+/// Disparity computation by cross-based support aggregation.
+///
+/// Each layer of the cost volume is averaged over the cross-based support
+/// regions of the pixels, see CrossSupport, before winner-take-all. The arms
+/// have length at most \a param.radius and color threshold \a param.gammaCol.
+/// The regions of the original method are the intersections of the ones of
+/// matched pixels, so that they depend on the disparity; here each image uses
+/// its own, as the guidance of disparityGF. For image 2, the layers are
+/// shifted to be expressed in its coordinates. Output maps are as with
+/// disparityAW.
+/// \param im1,im2 the two color images
+/// \param dMin,dMax disparity range
+/// \param param raw cost computation parameters
+/// \param disp1 output disparity map from image 1 to image 2
+/// \param disp2 output disparity map from image 2 to image 1
+void disparityCross(Image im1, Image im2,
+                    int dMin, int dMax, const ParamDisparity& param,
+                    Image& disp1, Image& disp2) {
+    if(param.intCost && !(is_8bit(im1) && is_8bit(im2))) {
+        std::cerr << "Warning: images are not 8-bit, "
+                  << "using float raw cost" << std::endl;
+        ParamDisparity p(param);
+        p.intCost = false;
+        disparityCross(im1, im2, dMin, dMax, p, disp1, disp2);
+        return;
+    }
+    const int width=im1.width(), height=im1.height();
+
+    CostRows<float>* rows = newCostRows<float>(im1, im2, param);
+    CostVolume* cost = costVolume(*rows, width, height, dMin, dMax,
+                                  0, 0, param.costPages);
+    const float costOut = rows->maxCost();
+    delete rows;
+
+    CrossSupport cs1(im1, param.radius, param.gammaCol),
+        cs2(im2, param.radius, param.gammaCol);
+    // Layer and aggregated layer, contiguous for the filter
+    std::vector<float> bufP(static_cast<size_t>(width)*height), bufQ(bufP);
+    Image p(&bufP[0],width,height), q(&bufQ[0],width,height);
+    Image E1(width,height), E2(width,height);
+    E1.fill(std::numeric_limits<float>::max());
+    E2.fill(std::numeric_limits<float>::max());
+    for(int d=dMin; d<=dMax; d++) {
+        const int x0=std::max(0,-d), x1=std::min(width,width-d);
+        if(x0 >= x1)
+            continue;
+        // Layer in coordinates of image 1, pixel x matched to x+d
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=0; x<width; x++)
+                p(x,y) = (x0<=x && x<x1)? cost->get(x,y,d): costOut;
+        cs1.filter(&p(0,0), &q(0,0));
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=x0; x<x1; x++)
+                if(E1(x,y) > q(x,y)) {
+                    E1(x,y) = q(x,y);
+                    disp1(x,y) = static_cast<float>(d);
+                }
+        if(param.leftOnly)
+            continue;
+        // Layer in coordinates of image 2, pixel x matched to x-d
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=0; x<width; x++)
+                p(x,y) = (x0+d<=x && x<x1+d)? cost->get(x-d,y,d): costOut;
+        cs2.filter(&p(0,0), &q(0,0));
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=x0+d; x<x1+d; x++)
+                if(E2(x,y) > q(x,y)) {
+                    E2(x,y) = q(x,y);
+                    disp2(x,y) = -static_cast<float>(d);
+                }
+    }
+    delete cost;
+}
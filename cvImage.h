@@ -0,0 +1,79 @@
+/**
+ * @file cvImage.h
+ * @brief Images on the pixels of OpenCV matrices, and the reverse
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CVIMAGE_H
+#define CVIMAGE_H
+
+// Only for programs using OpenCV, which the library does not need: nothing
+// here is compiled in the library.
+#include "imageView.h"
+#include <opencv2/core/core.hpp>
+
+/// Buffer of the pixels of 2D matrix \a m of 8-bit, 16-bit or float
+/// samples, its data 0 for other matrices.
+inline PixelBuffer bufferOf(const cv::Mat& m) {
+    const int depth = m.depth();
+    const bool known = (m.dims==2 && (depth==CV_8U || depth==CV_16U ||
+                                      depth==CV_32F));
+    PixelBuffer b(known? const_cast<uchar*>(m.data): 0, m.cols, m.rows,
+                  m.channels(), (depth==CV_8U)? SampleU8:
+                  (depth==CV_16U)? SampleU16: SampleF32,
+                  known? static_cast<ptrdiff_t>(m.step[0]): 0);
+    return b;
+}
+
+/// Image \a im on the pixels of float matrix \a m (CV_32FC1, CV_32FC3...),
+/// without copy, channels in the order of \a m (BGR for OpenCV), see
+/// viewImage of imageView.h. It is valid while the data of \a m are.
+inline bool viewImage(const cv::Mat& m, Image& im) {
+    const PixelBuffer b = bufferOf(m);
+    return b.data && viewImage(b, im);
+}
+
+/// Image of matrix \a m, whose channels are BGR if \a bgr: a view if \a m
+/// is float and \a bgr is false or \a m is gray, else a planar copy in RGB
+/// order, see toImage of imageView.h. Empty if the type is not supported.
+inline Image toImage(const cv::Mat& m, bool bgr=true) {
+    const PixelBuffer b = bufferOf(m);
+    return b.data? toImage(b, bgr): Image();
+}
+
+/// Matrix on the pixels of image \a im, without copy, for display or
+/// processing by OpenCV: the channels must be interleaved (single channel
+/// maps, such as StereoEngine::disparity(), always are), empty otherwise. It
+/// is valid while \a im or one of its copies lives, and is modified by the
+/// next steps of an engine whose map it is.
+inline cv::Mat matOf(const Image& im) {
+    if(im.width()==0 || (im.channels()>1 && im.layout()==Image::Planar))
+        return cv::Mat();
+    return cv::Mat(im.height(), im.width(), CV_MAKETYPE(CV_32F,im.channels()),
+                   const_cast<float*>(im.row(0)),
+                   static_cast<size_t>(im.stride())*sizeof(float));
+}
+
+/// Write disparity map \a disp in matrix \a out of the caller, with values
+/// outside [\a dMin,\a dMax] invalid, see writeDisparity of imageView.h:
+/// CV_32F, CV_16U (KITTI) or CV_8U, allocated as CV_32F if empty.
+inline bool writeDisparity(const Image& disp, cv::Mat& out,
+                           int dMin, int dMax) {
+    if(out.empty())
+        out.create(disp.height(), disp.width(), CV_32F);
+    const PixelBuffer b = bufferOf(out);
+    return b.data && out.channels()==1 && writeDisparity(disp, b, dMin, dMax);
+}
+
+#endif
@@ -18,26 +18,22 @@
 
 #include "disparity.h"
 #include "image.h"
+#include "rawCost.h"
+#include "simd.h"
+#include "simdKernels.h"
+#include "nan.h"
+#include "occlusion.h"
+#include "parallel.h"
+#include "timing.h"
+#include "weights.h"
 #include <algorithm>
+#include <vector>
 #include <limits>
 #include <iostream>
 #include <cmath>
 #include <cassert>
-
-/// Combination of weights, defined at compile time. Usage of a function pointer
-/// is significantly slower, unfortunately.
-#if   defined(COMB_LEFT)
-    static float COMB_WEIGHTS(float w1, float)    { return w1; }
-#elif defined(COMB_MAX)
-    static float COMB_WEIGHTS(float w1, float w2) { return std::max(w1,w2); }
-#elif defined(COMB_MIN)
-    static float COMB_WEIGHTS(float w1, float w2) { return std::min(w1,w2); }
-#elif defined(COMB_MULT)
-    static float COMB_WEIGHTS(float w1, float w2) { return w1*w2; }
-#elif defined(COMB_PLUS)
-    static float COMB_WEIGHTS(float w1, float w2) { return w1+w2; }
-#else
-#error "Unknown combination of weights"
+#ifdef __unix__
+#include <unistd.h>
 #endif
 
 /// Check that all parameters have a reasonable value.
@@ -67,110 +63,1896 @@ bool ParamDisparity::check() const {
         std::cerr << "Error: radius of patch must be positive";
         ok = false;
     }
+    if(stride<1) {
+        std::cerr << "Error: stride of window must be positive";
+        ok = false;
+    }
+    if(tileWidth<0 || tileHeight<0) {
+        std::cerr << "Error: tile dimensions must be positive (0: automatic)";
+        ok = false;
+    }
+    if(sgmP1<0 || sgmP2<sgmP1) {
+        std::cerr << "Error: SGM penalties must satisfy 0<=P1<=P2";
+        ok = false;
+    }
+    if(sgmPaths!=4 && sgmPaths!=8) {
+        std::cerr << "Error: number of SGM paths must be 4 or 8";
+        ok = false;
+    }
+    if(pmIterations<1) {
+        std::cerr << "Error: number of PatchMatch iterations must be positive";
+        ok = false;
+    }
+    if(searchY<0) {
+        std::cerr << "Error: vertical search radius must be positive";
+        ok = false;
+    }
+    if(intCost && rawCost!=CostADGrad) {
+        std::cerr << "Error: integer cost is only for AD+gradient raw cost";
+        ok = false;
+    }
+    if(!(0<=sparse && sparse<1)) {
+        std::cerr << "Error: threshold of sparse taps must be in [0,1)";
+        ok = false;
+    }
+    if(adaptRadius<0) {
+        std::cerr << "Error: gradient of adaptive radius must be positive";
+        ok = false;
+    }
+    if(dispChunk<0) {
+        std::cerr << "Error: disparities of chunks must be positive";
+        ok = false;
+    }
+    if(cascade<0) {
+        std::cerr << "Error: number of candidates of cascade must be positive";
+        ok = false;
+    }
+    if(dispSum && offsetSum) {
+        std::cerr << "Error: sums by disparity and by offset are exclusive";
+        ok = false;
+    }
     if(!ok) std::cout << std::endl;
     return ok;
 }
 
-/// Computes image of raw matching costs e at disparity d.
+/// Set combination of weights from its name, see show_weights.
+bool ParamDisparity::setCombination(const std::string& name) {
+    if(name == "left")
+        comb = CombineLeft;
+    else if(name == "max")
+        comb = CombineMax;
+    else if(name == "min")
+        comb = CombineMin;
+    else if(name == "mult")
+        comb = CombineMult;
+    else if(name == "plus")
+        comb = CombinePlus;
+    else {
+        std::cerr << "Error: unknown combination " << name
+                  << " (should be left, max, min, mult or plus)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Set raw cost from its name: "ad", "census", "ad-census" or "rank".
+bool ParamDisparity::setRawCost(const std::string& name) {
+    if(name == "ad")
+        rawCost = CostADGrad;
+    else if(name == "census")
+        rawCost = CostCensus;
+    else if(name == "ad-census")
+        rawCost = CostADCensus;
+    else if(name == "rank")
+        rawCost = CostRank;
+    else {
+        std::cerr << "Error: unknown raw cost " << name
+                  << " (should be ad, census, ad-census or rank)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Set memory pages of cost volumes from name: "normal", "thp" (transparent
+/// huge pages) or "huge" (explicit huge pages).
+bool ParamDisparity::setCostPages(const std::string& name) {
+    if(name == "normal")
+        costPages = PagesNormal;
+    else if(name == "thp")
+        costPages = PagesTransparent;
+    else if(name == "huge")
+        costPages = PagesHuge;
+    else {
+        std::cerr << "Error: unknown memory pages " << name
+                  << " (should be normal, thp or huge)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Whether image \a im can be packed by packRGBX, its color distances being
+/// then computed by distRGBX.
+static bool packable(const Image& im) {
+    return im.width()>0 && im.channels()<=4 && is_8bit(im);
+}
+
+/// Support windows of all pixels of an image, as color distances to center.
 ///
-/// At each pixel, a linear combination of colors L1 distance (with max
-/// threshold) and x-derivatives absolute difference (with max threshold).
-/// \param im1 first image
-/// \param im2 second image
-/// \param gradient1,gradient2 the gradient images
-/// \param d the disparity (layer of the cost volume)
-/// \param param parameters for cost computation
-static Image costLayer(Image im1, Image im2,
-                       Image gradient1, Image gradient2,
-                       int d, const ParamDisparity& param) {
-    assert(im1.channels() == im2.channels());
-    const int width=im1.width(), height=im1.height(), channels=im1.channels();
-    Image cost(width,height);
-    for(int y=0; y<height; y++)
-        for(int x=0; x<width; x++) {
-            // Max distance if disparity moves outside image
-            float costColor = param.tauCol;
-            float costGradient = param.tauGrad;
-
-            // Color L1 distance
-            if(0<=x+d && x+d<width) {
-                // L1 color distance.
-                costColor = 0;
-                for(int i=0; i<channels; i++)
-                    costColor += std::abs(im1(x,y,i)-im2(x+d,y,i));
-                costColor /= (float)channels;
-                // Color threshold
-                if(costColor > param.tauCol)
-                    costColor = param.tauCol;
-
-                // x-derivatives absolute difference and threshold
-                costGradient=std::min(std::abs(gradient1(x,y)-gradient2(x+d,y)),
-                                      param.tauGrad);
+/// The L1 color distance of (x+i,y+j) to (x,y), truncated to an integer, is
+/// stored on 16 bits. It is symmetric, the distance of (x,y) to (x+i,y+j):
+/// only the offsets of the half window j>0 or j=0, i>=0 are stored, the
+/// distance at offset -(i,j) being the one of (i,j) at the pixel shifted by
+/// the offset. For each row of the image, the distances of an offset, indexed
+/// by j*(2r+1)+i, are a row indexed by x, so that the windows of neighbor
+/// pixels share their cache lines. Weights are then a
+/// lookup in distC, exactly as support() computes them. The tensor needs
+/// (2r+1)^2+1 bytes per pixel and is shared read-only among threads. For an
+/// 8-bit image, the distances are computed on its packRGBX copy.
+class SupportTensor {
+public:
+    SupportTensor(const Image& im, int r, int s);
+    void window(int x, int y, const float* distC, Image& w) const;
+private:
+    int width, height, r, s, dim, half; ///< half: offsets of half window
+    std::vector<unsigned short> tab;
+    class Rows;
+    void row(const Image& im, Image8& packed, int yp);
+    /// Color distances of row y to the pixels at offset (i,j)*s, in the half
+    /// window, indexed by x
+    unsigned short* dist(int y, int i, int j) {
+        return &tab[(static_cast<size_t>(y)*half+j*dim+i)*width];
+    }
+    const unsigned short* dist(int y, int i, int j) const {
+        return &tab[(static_cast<size_t>(y)*half+j*dim+i)*width];
+    }
+};
+
+/// Rows of a SupportTensor computed by a parallel loop
+class SupportTensor::Rows : public ParallelBody {
+public:
+    Rows(SupportTensor& t, const Image& i, Image8& p)
+    : tensor(t), im(i), packed(p) {}
+    void run(int yp, int) { tensor.row(im, packed, yp); }
+private:
+    SupportTensor& tensor;
+    const Image& im;
+    Image8& packed; ///< Packed copy of im, or empty
+};
+
+/// Constructor, computing color distances of all pixels in parallel.
+SupportTensor::SupportTensor(const Image& im, int radius, int step)
+: width(im.width()), height(im.height()), r(radius), s(step),
+  dim(2*radius+1), half((dim*dim+1)/2),
+  tab(static_cast<size_t>(width)*height*half) {
+    Image8 packed = packable(im)? packRGBX(im): Image8();
+    Rows rows(*this, im, packed);
+    parallelFor(height, rows);
+}
+
+/// Color distances t[xp] of pixels (xp,yp) of \a im to (xp+dx,yp+dy), for
+/// xa<=xp<xb, with \a C channels (see dist1).
+template <int C>
+static void distRow(const Image& im, int c, int yp, int dx, int dy,
+                    int xa, int xb, unsigned short* t) {
+    const ptrdiff_t px=im.step(), sc=im.channelStep();
+    const float* p = im.row(yp)+xa*px;
+    const float* q = im.row(yp+dy)+(xa+dx)*px;
+    for(int xp=xa; xp<xb; xp++, p+=px, q+=px)
+        t[xp] = static_cast<unsigned short>(dist1<C>(p, q, sc, c));
+}
+
+/// Color distances of the half windows of pixels of row \a yp of \a im, or of
+/// \a packed if not empty.
+void SupportTensor::row(const Image& im, Image8& packed, int yp) {
+    const int c=im.channels();
+    int y0, y1;
+    taps(yp, height, r, s, y0, y1);
+    std::vector<int> d(packed.width()>0? width: 0);
+    for(int y=0; y<=y1; y++)
+        for(int x=(y? -r: 0); x<=r; x++) {
+            unsigned short* t = dist(yp,x,y);
+            const int xa=std::max(0,-x*s), xb=std::min(width,width-x*s);
+            if(! d.empty()) {
+                if(xa < xb)
+                    distRGBX(&packed(xa,yp), false, &packed(xa+x*s,yp+y*s),
+                             xb-xa, &d[0]);
+                for(int xp=xa; xp<xb; xp++)
+                    t[xp] = static_cast<unsigned short>(d[xp-xa]);
+                continue;
+            }
+            switch(c) {
+            case 1:  distRow<1>(im, c, yp, x*s, y*s, xa, xb, t); break;
+            case 3:  distRow<3>(im, c, yp, x*s, y*s, xa, xb, t); break;
+            case 4:  distRow<4>(im, c, yp, x*s, y*s, xa, xb, t); break;
+            default: distRow<0>(im, c, yp, x*s, y*s, xa, xb, t); break;
             }
-            // Linear combination of the two penalties
-            cost(x,y) = (1-param.alpha)*costColor + param.alpha*costGradient;
         }
-    return cost;
 }
 
-/// Compute the cost volume.
-static Image* costVolume(const Image& im1, const Image& im2,
-                         int dMin, int dMax, const ParamDisparity& param) {
-    // Compute x-derivatives of both images
-    Image grad1 = im1.gray().gradX();
-    Image grad2 = im2.gray().gradX();
-
-    // Compute raw matching cost for all disparities.
-    Image* cost = new Image[dMax-dMin+1];
-    for(int d=dMin; d<=dMax; d++)
-        cost[d-dMin] = costLayer(im1, im2, grad1, grad2, d, param);
-    return cost;
+/// Support window \a w of pixel (xp,yp), as support() would compute it.
+void SupportTensor::window(int xp, int yp, const float* distC, Image& w) const{
+    if(!  (0<=xp && xp<width))
+        return;
+    int x0, x1, y0, y1;
+    taps(xp, width, r, s, x0, x1);
+    taps(yp, height, r, s, y0, y1);
+    for(int y=y0; y<=y1; y++)
+        for(int x=x0; x<=x1; x++)
+            if(y>0 || (y==0 && x>=0))
+                w(x+r,y+r) = distC[dist(yp,x,y)[xp]];
+            else // Distance of the pixel at offset -(x,y)
+                w(x+r,y+r) = distC[dist(yp+y*s,-x,-y)[xp+x*s]];
 }
 
-/// Fill support weights.
+/// Support weights of all pixels of a row, tabulated by offset in window.
 ///
-/// \param im The image
-/// \param xp,yp Center point
-/// \param r Window radius
-/// \param distC Tabulated color distances
-/// \param w The output support window
-static void support(const Image& im, int xp, int yp, int r,
-                    float* distC, Image& w) {
-    const int width=im.width(), height=im.height(), c=im.channels();
-    assert(0<=yp && yp<height);
-    if(!  (0<=xp && xp<width))
+/// For row y, the weight of pixel (x+i,y+j) in the support window of (x,y) is
+/// stored in the row of index (j+r)*(2r+1)+(i+r) at position x. These rows are
+/// computed in contiguous loops over x on a planar copy of the image, the
+/// support window of a pixel being then a mere gather, see window(). For an
+/// 8-bit image, the copy is packed by packRGBX and the distances are computed
+/// by distRGBX. If k>0, the weights are given by expWeights instead of distC.
+class SupportRow {
+public:
+    SupportRow(const Image& im, int r, int s, const float* distC, float k=0);
+    void compute(int y, int xBegin, int xEnd);
+    void window(int x, Image& w) const;
+    /// Weights of tap (i,j) of the windows of the row, indexed by x, the ones
+    /// of tap (i+1,j) being one width further
+    const float* tap(int i, int j) const {
+        return &tab[static_cast<size_t>((j+r)*dim+i+r)*width];
+    }
+private:
+    int width, height, channels, r, s, dim;
+    const float* distC;
+    float k;                  ///< Factor of expWeights, 0 for distC
+    int y;                    ///< Current row
+    Image8 packed;            ///< Packed copy of image, or empty
+    std::vector<float> plane; ///< Planar copy of image, if not packed
+    std::vector<float> diff;  ///< Color distances to center for an offset
+    std::vector<int> idiff;   ///< The same, if packed
+    std::vector<float> tab;   ///< Weights by window offset and x
+};
+
+/// Constructor, \a distC being the tabulated color weights and \a kExp the
+/// factor of expWeights, if they are not used.
+SupportRow::SupportRow(const Image& im, int radius, int step,
+                       const float* dist, float kExp)
+: width(im.width()), height(im.height()), channels(im.channels()),
+  r(radius), s(step), dim(2*radius+1), distC(dist), k(kExp), y(-1),
+  packed(packable(im)? packRGBX(im): Image8()),
+  plane(packed.width()>0? 0: static_cast<size_t>(width)*height*channels),
+  diff(width), idiff(packed.width()>0? width: 0),
+  tab(static_cast<size_t>(dim)*dim*width) {
+    if(packed.width() > 0)
         return;
-    for(int y=-r; y<=r; y++)
-        if(0<=yp+y && yp+y<height)
-            for(int x=-r; x<=r; x++)
-                if(0<=xp+x && xp+x<width) {
-                    float d=0;
-                    for(int i=0; i<c; i++)
-                        d += std::abs(im(xp+x,yp+y,i)-im(xp,yp,i));
-                    w(x+r,y+r)=distC[static_cast<int>(d)];
-                }
+    const size_t n = static_cast<size_t>(width)*height;
+    for(int i=0; i<channels; i++)
+        for(int yy=0; yy<height; yy++)
+            for(int x=0; x<width; x++)
+                plane[i*n+yy*width+x] = im(x,yy,i);
+}
+
+/// Compute weights in support windows of pixels (x,yp), xBegin<=x<xEnd.
+void SupportRow::compute(int yp, int xBegin, int xEnd) {
+    const size_t n = static_cast<size_t>(width)*height;
+    y = yp;
+    int j0, j1;
+    taps(y, height, r, s, j0, j1);
+    for(int j=j0; j<=j1; j++)
+        for(int i=-r; i<=r; i++) {
+            const int x0=std::max(xBegin,-i*s), x1=std::min(xEnd,width-i*s);
+            if(x0>=x1)
+                continue;
+            float* w = &tab[static_cast<size_t>((j+r)*dim+i+r)*width];
+            if(packed.width() > 0) {
+                distRGBX(&packed(x0,y), false, &packed(x0+i*s,y+j*s), x1-x0,
+                         &idiff[x0]);
+                if(k > 0)
+                    expWeights(&idiff[x0], x1-x0, k, w+x0);
+                else
+                    for(int x=x0; x<x1; x++)
+                        w[x] = distC[idiff[x]];
+                continue;
+            }
+            std::fill(diff.begin()+x0, diff.begin()+x1, 0.0f);
+            for(int c=0; c<channels; c++) {
+                const float* p = &plane[c*n+y*width];
+                const float* q = &plane[c*n+(y+j*s)*width+i*s];
+                for(int x=x0; x<x1; x++)
+                    diff[x] += std::abs(q[x]-p[x]);
+            }
+            if(k > 0)
+                expWeights(&diff[x0], x1-x0, k, w+x0);
+            else
+                for(int x=x0; x<x1; x++)
+                    w[x] = distC[static_cast<int>(diff[x])];
+        }
+}
+
+/// Support window of pixel (x,y), y the row of the last compute().
+///
+/// As with support(), weights of pixels outside the image are not set.
+void SupportRow::window(int x, Image& w) const {
+    int i0, i1, j0, j1;
+    taps(x, width, r, s, i0, i1);
+    taps(y, height, r, s, j0, j1);
+    for(int j=j0; j<=j1; j++) {
+        const float* t = &tab[static_cast<size_t>((j+r)*dim+r)*width+x];
+        for(int i=i0; i<=i1; i++)
+            w(i+r,j+r) = t[i*width];
+    }
+}
+
+/// Accumulate a run of \a n window taps of contiguous weights \a wp, \a wq
+/// and spatial weights \a dp, the costs \a e being at stride \a sx.
+template <class Comb, typename T>
+inline void accumulate(const float* wp, const float* wq, const float* dp,
+                       const T* e, ptrdiff_t sx, int n, float& num, float& den){
+    for(int x=0; x<n; x++, e+=sx) {
+        float comb = Comb::hoisted? Comb::comb(wp[x],wq[x]):
+                                    dp[x]*Comb::comb(wp[x],wq[x]);
+        num+=comb**e;
+        den+=comb;
+    }
+}
+
+/// Rows of a window summed by one call of SimdKernels::sumWindow
+static const int FAST_ROWS=64;
+
+/// Vectorized sums of the taps of rows [y0,y1] of costCombined, for unit
+/// stride float costs, by the kernel of simdKernels().
+///
+/// The taps of a row fitting in vectors are accumulated in vector registers,
+/// the others in \a num and \a den, so the result is not bit-exact.
+template <class Comb>
+inline void accumulateFast(const float* wp, const float* wq, const float* dp,
+                           const CostVolumeT<float>& cost, int x, int yp,
+                           int y0, int y1, int d, int dim, int n,
+                           float& num, float& den) {
+    const float* e[FAST_ROWS]; // Raw costs of runs
+    for(int y=y0; y<=y1; y+=FAST_ROWS) {
+        const int rows = std::min(FAST_ROWS, y1-y+1);
+        for(int i=0; i<rows; i++)
+            e[i] = cost.ptr(x, yp+y+i, d);
+        const int shift = (y-y0)*dim;
+        simdKernels().sumWindow[Comb::id](wp+shift, wq+shift, dp+shift, e,
+                                          rows, dim, n, num, den);
+    }
+}
+
+/// Quantized costs have no vectorized version.
+template <class Comb, typename T>
+inline void accumulateFast(const float* wp, const float* wq, const float* dp,
+                           const CostVolumeT<T>& cost, int x, int yp,
+                           int y0, int y1, int d, int dim, int n,
+                           float& num, float& den) {
+    for(int y=y0; y<=y1; y++, wp+=dim, wq+=dim, dp+=dim)
+        accumulate<Comb>(wp, wq, dp, cost.ptr(x,yp+y,d), 1, n, num, den);
+}
+
+#ifdef FAST_MATH
+/// Sum by laneWindow of simdKernels(), arguments as accumulateFast. The
+/// result depends neither on the instruction set nor on the threads.
+template <class Comb>
+inline bool accumulateLanes(const float* wp, const float* wq, const float* dp,
+                            const CostVolumeT<float>& cost, int x, int yp,
+                            int y0, int y1, int d, int dim, int n,
+                            float& num, float& den) {
+    float lnum[SUM_LANES]={0}, lden[SUM_LANES]={0};
+    const float* e[FAST_ROWS]; // Raw costs of runs
+    for(int y=y0; y<=y1; y+=FAST_ROWS) {
+        const int rows = std::min(FAST_ROWS, y1-y+1);
+        for(int i=0; i<rows; i++)
+            e[i] = cost.ptr(x, yp+y+i, d);
+        const int shift = (y-y0)*dim;
+        simdKernels().laneWindow[Comb::id](wp+shift, wq+shift, dp+shift, e,
+                                           rows, dim, n, lnum, lden);
+    }
+    for(int m=SUM_LANES/2; m>0; m/=2) // Sum of halves
+        for(int i=0; i<m; i++) {
+            lnum[i] += lnum[i+m];
+            lden[i] += lden[i+m];
+        }
+    num = lnum[0];
+    den = lden[0];
+    return true;
 }
 
+/// Quantized costs keep the exact sums.
+template <class Comb, typename T>
+inline bool accumulateLanes(const float*, const float*, const float*,
+                            const CostVolumeT<T>&, int, int, int, int, int,
+                            int, int, float&, float&) {
+    return false;
+}
+#endif
+
 /// Combined cost of matching points (xp,yp) to (xq,yp).
 ///
-/// The support weights of p and q are \a wp and \a wq. The elementary pixel
-/// cost is in image \a e.
-float costCombined(int xp, int xq, int yp, int r,
-                   const Image& wp, const Image& wq,
-                   const float* distP, const Image& e) {
-    const int width = e.width();
+/// The support weights of p and q are \a wp and \a wq, windows of dimension
+/// (2r+1)x(2r+1) in row-major order. The elementary pixel costs are in layer
+/// \a d of the cost volume \a cost. Whatever the storage type of costs,
+/// accumulation is in float. Only the part of the window inside both images is
+/// used, so costs of pixels matched outside are never read; taps are then
+/// contiguous runs with no test, the run being specialized for unit stride.
+/// If Comb::hoisted, \a wp is premultiplied by \a distP. If Comb::left,
+/// \a denP is the sum of \a wp in the image, the denominator when the window
+/// of q is not clipped more than the one of p (the reverse if Comb::right,
+/// \a wp being then the weights of q). If \a fast, runs are summed
+/// with SIMD instructions, in a different order. Taps are at step \a s
+/// pixels; for s>1, costs of a run are not contiguous and \a fast is ignored.
+/// With build option FAST_MATH and not \a fast, unit stride float costs are
+/// summed in fixed lanes, see accumulateLanes.
+/// If \a R>0, it is the radius \a r, known at compilation: a run of the whole
+/// window width is then a loop of fixed length, unrolled by the compiler.
+template <class Comb, int R, typename T>
+float costCombined(int xp, int xq, int yp, int r, int s,
+                   const float* wp, const float* wq,
+                   const float* distP, const CostVolumeT<T>& cost, int d,
+                   float denP, bool fast) {
+    assert(R==0 || r==R);
+    if(R)
+        r = R;
+    const int width=cost.width(), height=cost.height(), dim=2*r+1;
+    const ptrdiff_t sx=cost.strideX()*s;
+    // Window span inside both images
+    int x0, x1, y0, y1, t0, t1;
+    taps(std::min(xp,xq), width, r, s, x0, t1);
+    taps(std::max(xp,xq), width, r, s, t0, x1);
+    taps(yp, height, r, s, y0, y1);
+    const int n=x1-x0+1; // Length of runs
+    const int shift=(y0+r)*dim+x0+r; // Index in window of first tap
+    wp += shift; wq += shift; distP += shift;
     float num=0, den=0; // Numerator and denominator in the fraction
-    for(int y=-r; y<=r; y++)
-        if(0<=yp+y && yp+y<e.height())
-            for(int x=-r; x<=r; x++)
-                if(0<=xp+x && xp+x<width && 0<=xq+x && xq+x<width) {
-                    float w1=wp(x+r,y+r); // Weight p
-                    float w2=wq(x+r,y+r); // Weight q
-                    float comb = distP[(y+r)*(2*r+1)+(x+r)]*COMB_WEIGHTS(w1,w2);
-                    num+=comb*e(xp+x,yp+y);
-                    den+=comb;
+    taps(Comb::right? xq: xp, width, r, s, t0, t1);
+    const bool dot = (Comb::left && x0==t0 && x1==t1);
+#ifdef FAST_MATH
+    if(!fast && sx==1 && accumulateLanes<Comb>(wp, wq, distP, cost, xp+x0, yp,
+                                                y0, y1, d, dim, n, num, den))
+        return cost.scale()*num/(dot? denP: den);
+#endif
+    if(dot) { // Dot product of weights and costs
+        for(int y=y0; y<=y1; y++, wp+=dim) {
+            const T* e = cost.ptr(xp+x0*s,yp+y*s,d); // Raw costs of run
+            if(R && n==dim && sx==1)
+                for(int x=0; x<dim; x++)
+                    num+=wp[x]*e[x];
+            else
+                for(int x=0; x<n; x++, e+=sx)
+                    num+=wp[x]**e;
+        }
+        return cost.scale()*num/denP;
+    }
+    if(fast && sx==1) {
+        accumulateFast<Comb>(wp, wq, distP, cost, xp+x0, yp, y0, y1, d, dim, n,
+                             num, den);
+        return cost.scale()*num/den;
+    }
+    for(int y=y0; y<=y1; y++, wp+=dim, wq+=dim, distP+=dim) {
+        const T* e = cost.ptr(xp+x0*s,yp+y*s,d); // Raw costs of run
+        if(R && n==dim && sx==1) // Whole row, fixed length
+            accumulate<Comb>(wp, wq, distP, e, 1, dim, num, den);
+        else if(sx == 1)
+            accumulate<Comb>(wp, wq, distP, e, 1, n, num, den);
+        else
+            accumulate<Comb>(wp, wq, distP, e, sx, n, num, den);
+    }
+    return cost.scale()*num/den;
+}
+
+#ifdef WORK_COUNTERS
+/// Taps of the window of costCombined for matching (xp,yp) to (xq,yp), with
+/// forms of size \a width x \a height.
+inline double windowTaps(int xp, int xq, int yp, int r, int s,
+                         int width, int height) {
+    int x0, x1, y0, y1, t0, t1;
+    taps(std::min(xp,xq), width, r, s, x0, t1);
+    taps(std::max(xp,xq), width, r, s, t0, x1);
+    taps(yp, height, r, s, y0, y1);
+    return static_cast<double>(x1-x0+1)*(y1-y0+1);
+}
+#endif
+
+/// Factor of the bound of the denominator of costPruned, above the rounding
+/// errors of the sums of weights
+static const float PRUNE_MARGIN=1.001f;
+
+/// Combined cost of costCombined, summed in its exact order, or infinity as
+/// soon as a lower bound of it reaches \a bound (option prune): the cost is
+/// then not lower than \a bound.
+///
+/// Raw costs and weights are non-negative. After row y of the window, the
+/// numerator can only increase, and the denominator is at most its current
+/// value plus \a rest[y+r], a bound of the weights of the rows below. The
+/// taps summed and the ones skipped are added to \a summed and \a skipped.
+template <class Comb, int R, typename T>
+float costPruned(int xp, int xq, int yp, int r, int s,
+                 const float* wp, const float* wq,
+                 const float* distP, const CostVolumeT<T>& cost, int d,
+                 float denP, const float* rest, float bound,
+                 double& summed, double& skipped) {
+    assert(R==0 || r==R);
+    if(R)
+        r = R;
+    const int width=cost.width(), height=cost.height(), dim=2*r+1;
+    const ptrdiff_t sx=cost.strideX()*s;
+    int x0, x1, y0, y1, t0, t1;
+    taps(std::min(xp,xq), width, r, s, x0, t1);
+    taps(std::max(xp,xq), width, r, s, t0, x1);
+    taps(yp, height, r, s, y0, y1);
+    const int n=x1-x0+1;
+    const int shift=(y0+r)*dim+x0+r;
+    wp += shift; wq += shift; distP += shift;
+    float num=0, den=0;
+    taps(xp, width, r, s, t0, t1);
+    const bool dot = (Comb::left && x0==t0 && x1==t1);
+    for(int y=y0; y<=y1; y++, wp+=dim, wq+=dim, distP+=dim) {
+        const T* e = cost.ptr(xp+x0*s,yp+y*s,d); // Raw costs of run
+        if(R && n==dim && sx==1) // Whole row, fixed length
+            accumulate<Comb>(wp, wq, distP, e, 1, dim, num, den);
+        else if(sx == 1)
+            accumulate<Comb>(wp, wq, distP, e, 1, n, num, den);
+        else
+            accumulate<Comb>(wp, wq, distP, e, sx, n, num, den);
+        if(y == y1)
+            break;
+        const float lower = dot? cost.scale()*num/denP:
+            cost.scale()*num/((den+rest[y+r])*PRUNE_MARGIN);
+        if(lower >= bound) {
+            summed += static_cast<double>(y-y0+1)*n;
+            skipped += static_cast<double>(y1-y)*n;
+            return std::numeric_limits<float>::infinity();
+        }
+    }
+    summed += static_cast<double>(y1-y0+1)*n;
+    return cost.scale()*num/(dot? denP: den);
+}
+
+/// Step in taps of the screening windows of param.cascade
+static const int CASCADE_STEP=3;
+
+/// Cost of costCombined restricted to the taps (i,j) of the window multiple
+/// of \a step, a cheap estimate to screen disparities (param.cascade).
+template <class Comb, typename T>
+float costScreen(int xp, int xq, int yp, int r, int s,
+                 const float* wp, const float* wq,
+                 const float* distP, const CostVolumeT<T>& cost, int d,
+                 int step) {
+    const int width=cost.width(), height=cost.height(), dim=2*r+1;
+    const ptrdiff_t sx=cost.strideX()*s;
+    int x0, x1, y0, y1, t0, t1;
+    taps(std::min(xp,xq), width, r, s, x0, t1);
+    taps(std::max(xp,xq), width, r, s, t0, x1);
+    taps(yp, height, r, s, y0, y1);
+    x0 = -(-x0/step)*step; // Multiples of step, the center included
+    y0 = -(-y0/step)*step;
+    float num=0, den=0;
+    for(int y=y0; y<=y1; y+=step) {
+        const T* e = cost.ptr(xp+x0*s,yp+y*s,d);
+        const int o = (y+r)*dim+r;
+        for(int x=x0; x<=x1; x+=step, e+=step*sx) {
+            const float comb = Comb::hoisted? Comb::comb(wp[o+x],wq[o+x]):
+                distP[o+x]*Comb::comb(wp[o+x],wq[o+x]);
+            num += comb**e;
+            den += comb;
+        }
+    }
+    return cost.scale()*num/den;
+}
+
+/// Cost of costCombined restricted to the window of radius \a rp<=r taps
+/// centered in the windows \a wp, \a wq and \a distP of radius \a r
+/// (param.adaptRadius), in the same order.
+template <class Comb, typename T>
+float costRadius(int xp, int xq, int yp, int r, int s, int rp,
+                 const float* wp, const float* wq,
+                 const float* distP, const CostVolumeT<T>& cost, int d) {
+    const int width=cost.width(), height=cost.height(), dim=2*r+1;
+    const ptrdiff_t sx=cost.strideX()*s;
+    // Window span inside both images
+    int x0, x1, y0, y1, t0, t1;
+    taps(std::min(xp,xq), width, rp, s, x0, t1);
+    taps(std::max(xp,xq), width, rp, s, t0, x1);
+    taps(yp, height, rp, s, y0, y1);
+    const int n=x1-x0+1; // Length of runs
+    const int shift=(y0+r)*dim+x0+r; // Index in window of first tap
+    wp += shift; wq += shift; distP += shift;
+    float num=0, den=0;
+    for(int y=y0; y<=y1; y++, wp+=dim, wq+=dim, distP+=dim) {
+        const T* e = cost.ptr(xp+x0*s,yp+y*s,d); // Raw costs of run
+        if(sx == 1)
+            accumulate<Comb>(wp, wq, distP, e, 1, n, num, den);
+        else
+            accumulate<Comb>(wp, wq, distP, e, sx, n, num, den);
+    }
+    return cost.scale()*num/den;
+}
+
+/// Cost of costCombined restricted to the \a n taps (ti[k],tj[k]) of the
+/// window of p, in row-major order, whose weights are at index to[k] of the
+/// windows (param.sparse). Taps of q outside the image are skipped, the
+/// weights of the others being renormalized.
+template <class Comb, typename T>
+float costSparse(int xp, int xq, int yp, int r, int s,
+                 const float* wp, const float* wq,
+                 const float* distP, const CostVolumeT<T>& cost, int d,
+                 const int* ti, const int* tj, const int* to, int n) {
+    const ptrdiff_t sx=cost.strideX()*s;
+    int t0, t1;
+    taps(xq, cost.width(), r, s, t0, t1);
+    float num=0, den=0;
+    const T* e=0; // Raw costs of row j
+    for(int k=0, j=r+1; k<n; k++) {
+        if(tj[k] != j) {
+            j = tj[k];
+            e = cost.ptr(xp,yp+j*s,d);
+        }
+        if(ti[k]<t0 || t1<ti[k])
+            continue;
+        const int o=to[k];
+        const float comb = Comb::hoisted? Comb::comb(wp[o],wq[o]):
+            distP[o]*Comb::comb(wp[o],wq[o]);
+        num += comb*e[ti[k]*sx];
+        den += comb;
+    }
+    return cost.scale()*num/den;
+}
+
+/// Combined costs \a E of (xp,yp) at the SUM_LANES disparities from \a d,
+/// whose windows in both images are fully inside horizontally, by dispWindow
+/// of simdKernels() (option dispSum).
+///
+/// The costs of a pixel are contiguous in the volume \a cost, of layout
+/// PixelMajor, as are the weights of q of a tap in \a support2, the support
+/// of the row of yp in the target image. The window \a wp and \a distP are
+/// walked once for all disparities, each one being summed in its lane in the
+/// order of costCombined, so that the result is the same. \a wq and \a e are
+/// buffers of 2r+1 pointers.
+///
+/// With CombLeft, this is the product of the weights of p by the matrix of
+/// costs of its window (taps x disparities). It is not batched with the
+/// neighbors of p into a GEMM: their matrices are shifted by one tap per
+/// pixel, so that a BLAS call needs a copy of each (im2col) costing as much
+/// as the product, and the sums are bound by the multiplications and
+/// additions, not fused to stay exact, rather than by the loads of costs.
+template <class Comb>
+inline bool costsCombined(int xp, int yp, int r, int s, const float* wp,
+                          const SupportRow& support2, const float* distP,
+                          const CostVolumeT<float>& cost, int d, float denP,
+                          const float** wq, const float** e, float* E) {
+    assert(cost.strideD() == 1);
+    const int dim=2*r+1;
+    int y0, y1;
+    taps(yp, cost.height(), r, s, y0, y1);
+    for(int y=y0; y<=y1; y++) {
+        e[y-y0] = cost.ptr(xp-r*s, yp+y*s, d);
+        wq[y-y0] = Comb::left? e[y-y0]: support2.tap(-r,y)+xp+d;
+    }
+    const int shift=(y0+r)*dim; // Index in window of first tap
+    float num[SUM_LANES], den[SUM_LANES];
+    const ptrdiff_t se=cost.strideX()*s, sq=Comb::left? se: cost.width();
+    simdKernels().dispWindow[Comb::id](wp+shift, distP+shift, wq, sq, e, se,
+                                       y1-y0+1, dim, num, den);
+    for(int k=0; k<SUM_LANES; k++)
+        E[k] = cost.scale()*num[k]/(Comb::left? denP: den[k]);
+    return true;
+}
+
+/// Quantized costs have no vectorized version.
+template <class Comb, typename T>
+inline bool costsCombined(int, int, int, int, const float*, const SupportRow&,
+                          const float*, const CostVolumeT<T>&, int, float,
+                          const float**, const float**, float*) {
+    return false;
+}
+
+/// Scale of support weights in fixed point, 1 being represented by ONE15
+static const float ONE15=32767.0f;
+/// Scale of spatial weights in fixed point
+static const float ONE16=65535.0f;
+
+/// Quantize the \a n weights \a w in [0,1] to fixed point \a q of scale \a s.
+static void quantize(const float* w, int n, float s, unsigned short* q) {
+    for(int i=0; i<n; i++)
+        q[i] = static_cast<unsigned short>(w[i]*s+0.5f);
+}
+
+/// Fixed point version of accumulate: weights \a wp, \a wq on 15 bits,
+/// spatial weights \a dp on 16 bits, costs \a e stored on 16 bits. Each tap
+/// adds the high 16 bits of weight times cost to \a num, and the weight to
+/// \a den. Used only with quantized costs, see aggregateComb().
+template <class Comb, typename T>
+inline void accumulateInt(const unsigned short* wp, const unsigned short* wq,
+                          const unsigned short* dp, const T* e, ptrdiff_t sx,
+                          int n, unsigned& num, unsigned& den) {
+    for(int x=0; x<n; x++, e+=sx) {
+        unsigned comb = Comb::icomb(wp[x],wq[x]);
+        if(! Comb::hoisted)
+            comb = (comb*dp[x])>>16;
+        num += (comb*static_cast<unsigned>(*e))>>16;
+        den += comb;
+    }
+}
+
+/// Vectorized version of accumulateInt for unit stride: VSIZE16 taps per
+/// instruction, sums of pairs of lanes in 32-bit accumulators \a vnum and
+/// \a vden. The result is exactly the one of accumulateInt.
+template <class Comb>
+inline void accumulateInt(const unsigned short* wp, const unsigned short* wq,
+                          const unsigned short* dp, const unsigned short* e,
+                          int n, vu32& vnum, vu32& vden,
+                          unsigned& num, unsigned& den) {
+    int x=0;
+    for(; x+VSIZE16<=n; x+=VSIZE16) {
+        vu16 comb = Comb::vicomb(vload16(wp+x),vload16(wq+x));
+        if(! Comb::hoisted)
+            comb = vmulhi16(comb,vload16(dp+x));
+        vnum = vaddpairs15(vnum, vmulhi16(comb,vload16(e+x)));
+        vden = vaddpairs15(vden, comb);
+    }
+    accumulateInt<Comb>(wp+x, wq+x, dp+x, e+x, 1, n-x, num, den);
+}
+
+/// Float costs have no vectorized version.
+template <class Comb, typename T>
+inline void accumulateInt(const unsigned short* wp, const unsigned short* wq,
+                          const unsigned short* dp, const T* e,
+                          int n, vu32&, vu32&, unsigned& num, unsigned& den) {
+    accumulateInt<Comb>(wp, wq, dp, e, 1, n, num, den);
+}
+
+/// Fixed point version of costCombined.
+///
+/// Support weights \a wp and \a wq are on 15 bits, \a wp premultiplied by the
+/// spatial weights if Comb::hoisted, and spatial weights \a distP on 16 bits.
+/// Sums are in 32-bit integers, exact whatever the order, and do not overflow
+/// for r<180. The relative precision of each tap is about 2^-15. Taps are at
+/// step \a s pixels. If \a R>0, it is the radius \a r, as in costCombined.
+template <class Comb, int R, typename T>
+float costCombinedInt(int xp, int xq, int yp, int r, int s,
+                      const unsigned short* wp, const unsigned short* wq,
+                      const unsigned short* distP, const CostVolumeT<T>& cost,
+                      int d) {
+    assert(R==0 || r==R);
+    if(R)
+        r = R;
+    const int width=cost.width(), height=cost.height(), dim=2*r+1;
+    const ptrdiff_t sx=cost.strideX()*s;
+    // Window span inside both images
+    int x0, x1, y0, y1, t0, t1;
+    taps(std::min(xp,xq), width, r, s, x0, t1);
+    taps(std::max(xp,xq), width, r, s, t0, x1);
+    taps(yp, height, r, s, y0, y1);
+    const int n=x1-x0+1; // Length of runs
+    const int shift=(y0+r)*dim+x0+r; // Index in window of first tap
+    wp += shift; wq += shift; distP += shift;
+    unsigned num=0, den=0;
+    vu32 vnum=vzero32(), vden=vzero32();
+    for(int y=y0; y<=y1; y++, wp+=dim, wq+=dim, distP+=dim) {
+        const T* e = cost.ptr(xp+x0*s,yp+y*s,d); // Raw costs of run
+        if(R && n==dim && sx==1) // Whole row, fixed length
+            accumulateInt<Comb>(wp, wq, distP, e, dim, vnum, vden, num, den);
+        else if(sx == 1)
+            accumulateInt<Comb>(wp, wq, distP, e, n, vnum, vden, num, den);
+        else
+            accumulateInt<Comb>(wp, wq, distP, e, sx, n, num, den);
+    }
+    num += vsum32(vnum);
+    den += vsum32(vden);
+    return cost.scale()*65536.0f*static_cast<float>(num)/
+        static_cast<float>(den);
+}
+
+/// Sub-pixel disparity, vertex of the parabola through the costs \a Em, \a E0
+/// and \a Ep at disparities d-1, d and d+1, with E0 the minimum. The offset
+/// to \a d is in [-1/2,1/2].
+static float subpixel(int d, float Em, float E0, float Ep) {
+    const float den = Em-2*E0+Ep;
+    if(! (den > 0))
+        return static_cast<float>(d);
+    const float offset = (Em-Ep)/(2*den);
+    return static_cast<float>(d) + std::max(-0.5f,std::min(0.5f,offset));
+}
+
+/// Confidence of minimum \a E of cost curve \a curve at index \a i, in [0,1].
+///
+/// It is 1-E/E', with E' the minimum of the costs at indices other than i-1,
+/// i and i+1, the neighbors of a minimum being always close to it. Unknown
+/// costs are NaN. If there is no other cost, the confidence is 1.
+static float confidence(const std::vector<float>& curve, int i, float E) {
+    float E2 = std::numeric_limits<float>::max();
+    for(int k=0; k<static_cast<int>(curve.size()); k++)
+        if((k<i-1 || i+1<k) && curve[k]<E2) // False for NaN
+            E2 = curve[k];
+    if(E2 == std::numeric_limits<float>::max())
+        return 1.0f;
+    return (E2>0)? 1-E/E2: 0.0f;
+}
+
+/// Keep in \a top at pixel (x,y) the top.k() lowest costs of \a curve, index
+/// i being disparity dMin+i, NaN costs being skipped. As comparisons are
+/// strict, ties are in increasing disparity, the first being the one of WTA.
+static void candidates(const std::vector<float>& curve, int dMin,
+                       Candidates& top, int x, int y) {
+    const int k=top.k();
+    int n=0; // Candidates found
+    for(int i=0; i<static_cast<int>(curve.size()); i++) {
+        const float E = curve[i];
+        if(!is_number(E) || (n==k && !(E<top.cost(x,y,k-1))))
+            continue;
+        int j = (n<k)? n++: k-1;
+        for(; j>0 && E<top.cost(x,y,j-1); j--) { // Insertion sort
+            top.cost(x,y,j) = top.cost(x,y,j-1);
+            top.disp(x,y,j) = top.disp(x,y,j-1);
+        }
+        top.cost(x,y,j) = E;
+        top.disp(x,y,j) = static_cast<float>(dMin+i);
+    }
+    for(; n<k; n++)
+        top.cost(x,y,n) = top.disp(x,y,n) = NaN;
+}
+
+/// Dimensions \a tileW x \a tileH of tiles for aggregation.
+///
+/// Unless set in \a param, the height is 32 rows and the width is such that
+/// the \a nd costs of \a elemSize bytes of a tile and its halo fit in the L2
+/// cache. The width is at least \a nd: the weights of nd-1 windows of the
+/// target image are computed at the start of each row of a tile.
+static void tileSize(const ParamDisparity& param, int width, int height,
+                     int nd, size_t elemSize, int& tileW, int& tileH) {
+    long cache = 1<<20;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    if(sysconf(_SC_LEVEL2_CACHE_SIZE) > 0)
+        cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    const int r = param.radius;
+    tileH = (param.tileHeight>0)? param.tileHeight: 32;
+    tileW = param.tileWidth;
+    if(tileW <= 0)
+        tileW = std::max(nd, static_cast<int>(cache/((tileH+2*r)*nd*elemSize))
+                         - 2*r);
+    tileW = std::min(tileW, width);
+    tileH = std::min(tileH, height);
+}
+
+/// Combination aggregating the map of image 2 with its own weights, for
+/// ParamDisparity::rightWeights: CombRight for CombLeft, else the same one.
+template <class Comb> struct RightOf { typedef Comb type; };
+template <> struct RightOf<CombLeft> { typedef CombRight type; };
+
+/// Aggregation of a tile, with workspace of a thread. If \a R>0, it is the
+/// radius of windows in taps, known at compilation.
+template <class Comb, typename T, int R>
+class TileAggregator {
+public:
+    TileAggregator(const Image& im1, const Image& im2, int dMin, int dMax,
+                   const ParamDisparity& param,
+                   float* distC, const float* distP,
+                   const CostVolumeT<T>& cost,
+                   const SupportTensor* tensor1, const SupportTensor* tensor2,
+                   const Image* rangeLo, const Image* rangeHi, Image* conf,
+                   Candidates* top);
+    void run(int x0, int x1, int y0, int y1, Image& E1, Image& disp1,
+             Image& E2, Image& disp2, int ox, int oy);
+    /// Taps summed and skipped by costPruned, costSparse or costRadius, and
+    /// by all sums if built with WORK_COUNTERS
+    double summed, skipped;
+    /// Disparities aggregated and not (range, border, cascade), counted if
+    /// built with WORK_COUNTERS
+    double evaluated, excluded;
+private:
+    const Image &im1, &im2;
+    const int dMin, dMax, nd;
+    const int s, r; ///< Step between taps and radius of window in taps
+    const ParamDisparity& param;
+    float* distC;
+    const float* distP;
+    const CostVolumeT<T>& cost;
+    const SupportTensor *tensor1, *tensor2; ///< Precomputed windows, or 0
+    const Image *rangeLo, *rangeHi; ///< Per-pixel disparity range, or 0
+    Image* conf; ///< Confidence map of image 1, or 0
+    Candidates* top; ///< Best disparities of image 1, or 0
+    std::vector<float> curve; ///< Costs of current pixel, for conf and top
+    /// Map of image 2 aggregated with the weights of image 2 only, the ones
+    /// of weights2, premultiplied by distP (CombLeft and param.rightWeights)
+    const bool right;
+    std::vector<float> den2; ///< Sums of weights2, if right
+    /// Costs of image 1 summed by window offset for a row, see offsetRow()
+    const bool offset;
+    SupportRow support1;
+    /// Costs of layout PixelMajor, SUM_LANES disparities being summed at once
+    /// by costsCombined, with the supports of the target image in support2Row
+    /// (also used by offsetRow)
+    const bool vec;
+    SupportRow support2Row;
+    std::vector<float> block; ///< Costs of costsCombined at index d-dMin
+    std::vector<const float*> runs; ///< Buffers of costsCombined
+    /// Sums of offsetRow at index (d-dMin)*tile width+x-x0, and its costs,
+    /// NaN where x+d is outside the image; weights of image 1 times spatial
+    /// weight of the offset and their sums over the window at index x-x0
+    std::vector<float> offNum, offDen, offE, pre, denP;
+    /// Disparities that cannot win skipped by costPruned (param.prune), with
+    /// the bounds of the weights of the rows of the window below each one
+    const bool pruning;
+    std::vector<float> rest;
+    /// Disparities of the param.cascade best costs of costScreen, the only
+    /// ones aggregated, at index d-dMin
+    const bool cascade;
+    std::vector<char> candidate;
+    std::vector<std::pair<float,int> > screened; ///< Costs of costScreen
+    void screen(int x, int y, int d0, int d1);
+    /// Whether the range of pixel (x,y) meets [dMin,dMax]
+    bool inRange(int x, int y) const {
+        return std::max(dMin, static_cast<int>((*rangeLo)(x,y))) <=
+               std::min(dMax, static_cast<int>((*rangeHi)(x,y)));
+    }
+    /// Windows of radius of pixelRadius(), summed by costRadius
+    const bool adaptive;
+    int pixelRadius(int x, int y) const;
+    /// Taps of the window of p of weight above param.sparse, the only ones
+    /// summed by costSparse: offsets in taps and index in the window
+    const bool sparse;
+    std::vector<int> sparseI, sparseJ, sparseO;
+    /// Weight window in reference image and weight windows in target image
+    /// for each disparity (useless for CombLeft unless right, but better to
+    /// have readable code than multiplying special cases), in a single buffer.
+    std::vector<float> windows;
+    Image W1;
+    std::vector<Image> weights2; ///< Window of x+d at index (x+d-dMin)%nd
+    Image8 packed2; ///< Packed im2 for support2, if 8-bit
+    /// Fixed point copies of W1, weights2 and distP, for param.intSum
+    std::vector<unsigned short> windowsQ, distPQ;
+    void support2(int xq, int y, int k);
+    void offsetRow(int y, int x0, int x1);
+    void offsetWTA(int y, int x0, int x1, Image& E1, Image& disp1,
+                   Image& E2, Image& disp2, int ox, int oy);
+    const unsigned short* windowQ(int k) const {
+        return &windowsQ[static_cast<size_t>(k)*(2*r+1)*(2*r+1)];
+    }
+};
+
+/// Constructor, allocating the buffers of weight windows.
+template <class Comb, typename T, int R>
+TileAggregator<Comb,T,R>::TileAggregator(const Image& im1_, const Image& im2_,
+                                  int dMin_, int dMax_,
+                                  const ParamDisparity& param_,
+                                  float* distC_, const float* distP_,
+                                  const CostVolumeT<T>& cost_,
+                                  const SupportTensor* t1,
+                                  const SupportTensor* t2,
+                                  const Image* lo, const Image* hi,
+                                  Image* confidence, Candidates* top_)
+: im1(im1_), im2(im2_), dMin(dMin_), dMax(dMax_),
+  nd(Comb::left && !(param_.rightWeights && !param_.leftOnly)? 1: // Unused
+     dMax_-dMin_+1),
+  s(param_.stride), r(param_.radius/param_.stride), param(param_),
+  distC(distC_), distP(distP_), cost(cost_),
+  tensor1(t1), tensor2(t2), rangeLo(lo), rangeHi(hi), conf(confidence),
+  top(top_), right(Comb::left && param_.rightWeights && !param_.leftOnly),
+  den2(nd),
+  offset(param_.offsetSum && cost_.strideX()==1 && !lo && !param_.intSum &&
+         !(param_.adaptRadius>0)),
+  support1((t1 && !offset)? Image(): im1_, r, s, distC,
+           expScale(im1_.channels(), param_)),
+  vec(cost_.layout()==CostVolumeT<T>::PixelMajor && !param_.intSum),
+  support2Row(((vec || offset) && (!Comb::left || right))? im2_: Image(),
+              r, s, distC, expScale(im1_.channels(), param_)),
+  block(vec? dMax_-dMin_+1: 0), runs(vec? 2*(2*r+1): 0),
+#ifdef FAST_MATH // Sums in lanes, not the ones of costPruned
+  pruning(false),
+#else
+  pruning(param_.prune && !offset && !vec && !param_.intSum &&
+          !param_.fastSum && !param_.subpixel && !confidence && !top_ &&
+          !(param_.sparse>0) && !(param_.adaptRadius>0)),
+#endif
+  rest(2*r+1),
+  cascade(param_.cascade>0 && !offset && !vec && !(param_.adaptRadius>0)),
+  candidate(cascade? dMax_-dMin_+1: 0),
+  adaptive(param_.adaptRadius>0 && !param_.intSum),
+  sparse(param_.sparse>0 && !offset && !vec && !param_.intSum && !adaptive),
+  windows(static_cast<size_t>(nd+1)*(2*r+1)*(2*r+1)) {
+    const int dim=2*r+1; // window dimension
+    summed = skipped = evaluated = excluded = 0;
+    W1 = Image(&windows[0], dim, dim);
+    weights2.resize(nd);
+    for(int k=0; k<nd; k++)
+        weights2[k] = Image(&windows[(k+1)*dim*dim], dim, dim);
+    if(conf || top)
+        curve.resize(dMax-dMin+1);
+    if(!vec && !tensor2 && (!Comb::left || right) && packable(im2))
+        packed2 = packRGBX(im2);
+    if(param.intSum) {
+        windowsQ.resize(windows.size());
+        distPQ.resize(dim*dim);
+        quantize(distP, dim*dim, ONE16, &distPQ[0]);
+    }
+}
+
+/// Support window of pixel (xq,y) in target image, stored in weights2[k].
+template <class Comb, typename T, int R>
+void TileAggregator<Comb,T,R>::support2(int xq, int y, int k) {
+    Image& w = weights2[k];
+    if(vec)
+        support2Row.window(xq, w);
+    else if(tensor2)
+        tensor2->window(xq, y, distC, w);
+    else if(packed2.width() > 0)
+        supportRGBX(packed2, xq,y, r, s, distC, w,
+                    expScale(im1.channels(), param));
+    else
+        support(im2, xq,y, r, s, distC, w);
+    if(right)
+        den2[k] = premultiply(w, xq,y, r,s, cost.width(),cost.height(), distP);
+    if(param.intSum)
+        quantize(&w(0,0), w.width()*w.height(), ONE15,
+                 &windowsQ[static_cast<size_t>(k+1)*w.width()*w.height()]);
+}
+
+/// Sums of the weighted costs of pixels (x,y) of image 1, x0<=x<x1, at all
+/// disparities, by window offset (param.offsetSum).
+///
+/// The outer loops are on the taps of the window, in the order of
+/// costCombined, each one adding its terms to the sums of all pixels and
+/// disparities, in contiguous runs of x: the weights of the tap are rows of
+/// support1 and support2Row, and the costs rows of the volume, with no gather
+/// nor window buffer. The sums are the ones of costCombined.
+template <class Comb, typename T, int R>
+void TileAggregator<Comb,T,R>::offsetRow(int y, int x0, int x1) {
+    const int width=cost.width(), n=x1-x0, dim=2*r+1;
+    offNum.assign(static_cast<size_t>(dMax-dMin+1)*n, 0.0f);
+    offDen.assign(offNum.size(), 0.0f);
+    offE.resize(offNum.size());
+    pre.resize(n);
+    denP.assign(n, 0.0f);
+    int j0, j1;
+    taps(y, cost.height(), r, s, j0, j1);
+    for(int j=j0; j<=j1; j++)
+        for(int i=-r; i<=r; i++) {
+            const float dp = distP[(j+r)*dim+i+r];
+            const float* w1 = support1.tap(i,j);
+            const float* w2 = Comb::left? w1: support2Row.tap(i,j);
+            // Pixels x whose tap is in the image
+            const int xa=std::max(x0,-i*s), xb=std::min(x1,width-i*s);
+            if(Comb::hoisted)
+                for(int x=xa; x<xb; x++)
+                    pre[x-x0] = w1[x]*dp;
+            if(Comb::left) // Sums of premultiply()
+                for(int x=xa; x<xb; x++)
+                    denP[x-x0] += pre[x-x0];
+            for(int d=dMin; d<=dMax; d++) {
+                // Also pixel x+d and its tap in the image
+                const int a=std::max(xa,std::max(-d,-d-i*s));
+                const int b=std::min(xb,std::min(width-d,width-d-i*s));
+                if(a >= b)
+                    continue;
+                const T* e = cost.ptr(a+i*s, y+j*s, d); // Costs of run
+                const size_t o = static_cast<size_t>(d-dMin)*n+a-x0;
+                float *num=&offNum[o], *den=&offDen[o];
+                const float *p=&pre[a-x0], *u=w1+a, *q=w2+a+d;
+                for(int k=0; k<b-a; k++) {
+                    const float comb = Comb::hoisted? Comb::comb(p[k],q[k]):
+                                                      dp*Comb::comb(u[k],q[k]);
+                    num[k] += comb*e[k];
+                    den[k] += comb;
+                }
+            }
+        }
+    for(int d=dMin; d<=dMax; d++)
+        for(int x=x0; x<x1; x++) {
+            const size_t o = static_cast<size_t>(d-dMin)*n+x-x0;
+            offE[o] = NaN;
+            if(! (0<=x+d && x+d<width))
+                continue;
+            int a0, a1, b0, b1; // Taps of p and q
+            taps(x, width, r, s, a0, a1);
+            taps(x+d, width, r, s, b0, b1);
+            const bool dot = (Comb::left && b0<=a0 && a1<=b1);
+            offE[o] = cost.scale()*offNum[o]/(dot? denP[x-x0]: offDen[o]);
+        }
+}
+
+/// Winner-take-all of the costs of offsetRow for pixels (x,y), x0<=x<x1,
+/// arguments as in run().
+///
+/// It is vectorized across pixels by argminRow of simdKernels(), disparities
+/// in increasing order for disp1. Pixel x+d of E2 is reached by the pixels x
+/// of the row in increasing order, that is in decreasing order of d, which is
+/// the order of the diagonal scan for disp2. As the comparisons are strict,
+/// ties are resolved as in run(). Neighbor costs of the best one for subpixel
+/// and the costs of conf are read in offE.
+template <class Comb, typename T, int R>
+void TileAggregator<Comb,T,R>::offsetWTA(int y, int x0, int x1,
+                                         Image& E1, Image& disp1,
+                                         Image& E2, Image& disp2,
+                                         int ox, int oy) {
+    const int width=cost.width(), n=x1-x0;
+    const SimdKernels& k = simdKernels();
+    for(int d=dMin; d<=dMax; d++) {
+        const float* e = &offE[static_cast<size_t>(d-dMin)*n];
+        float *best=&E1(x0,y), *arg=&disp1(x0,y);
+        const float fd = static_cast<float>(d);
+        for(int x=k.argminRow(e, fd, n, best, arg); x<n; x++)
+            if(e[x] < best[x]) {
+                best[x] = e[x];
+                arg[x] = fd;
+            }
+    }
+    for(int d=dMax; !param.leftOnly && d>=dMin; d--) {
+        const int a=std::max(x0,-d), b=std::min(x1,width-d);
+        if(a >= b)
+            continue;
+        const float* e = &offE[static_cast<size_t>(d-dMin)*n+a-x0];
+        float *best=&E2(a+d-ox,y-oy), *arg=&disp2(a+d-ox,y-oy);
+        const float fd = -static_cast<float>(d);
+        for(int x=k.argminRow(e, fd, b-a, best, arg); x<b-a; x++)
+            if(e[x] < best[x]) {
+                best[x] = e[x];
+                arg[x] = fd;
+            }
+    }
+    for(int x=x0; x<x1; x++) {
+        if(E1(x,y) == std::numeric_limits<float>::max())
+            continue;
+        const int i = static_cast<int>(disp1(x,y))-dMin;
+        const float* e = &offE[x-x0];
+        if(conf || top)
+            for(int d=0; d<=dMax-dMin; d++)
+                curve[d] = e[static_cast<size_t>(d)*n];
+        if(conf)
+            (*conf)(x,y) = confidence(curve, i, E1(x,y));
+        if(top)
+            candidates(curve, dMin, *top, x, y);
+        const float Em = (i>0)? e[static_cast<size_t>(i-1)*n]: NaN;
+        const float Ep = (i<dMax-dMin)? e[static_cast<size_t>(i+1)*n]: NaN;
+        if(param.subpixel && is_number(Em) && is_number(Ep))
+            disp1(x,y) = subpixel(i+dMin, Em, E1(x,y), Ep);
+    }
+}
+
+/// Mark in candidate the param.cascade disparities of [d0,d1] of lowest cost
+/// of costScreen at pixel (x,y), W1 and weights2 being its windows.
+template <class Comb, typename T, int R>
+void TileAggregator<Comb,T,R>::screen(int x, int y, int d0, int d1) {
+    screened.clear();
+    for(int d=d0; d<=d1; d++)
+        if(0<=x+d && x+d<cost.width()) {
+            const int k = (x+d-dMin)%nd;
+            const float E = costScreen<Comb>(x, x+d, y, r,s, &W1(0,0),
+                                             &weights2[k](0,0), distP, cost,
+                                             d, CASCADE_STEP);
+            screened.push_back(std::make_pair(E,d));
+        }
+    const size_t n = std::min(screened.size(),
+                              static_cast<size_t>(param.cascade));
+    if(n < screened.size())
+        std::nth_element(screened.begin(), screened.begin()+n,
+                         screened.end());
+    std::fill(candidate.begin(), candidate.end(), 0);
+    for(size_t i=0; i<n; i++)
+        candidate[screened[i].second-dMin] = 1;
+}
+
+/// Smallest radius in taps of param.adaptRadius
+static const int ADAPT_MIN_RADIUS=2;
+/// Radius of the neighborhood of the texture measure of param.adaptRadius
+static const int ADAPT_TEXTURE=2;
+
+/// Radius in taps of the window of pixel (x,y) for param.adaptRadius: r,
+/// halved for each doubling above param.adaptRadius of the mean absolute
+/// horizontal gradient of image 1 in the neighborhood of radius ADAPT_TEXTURE,
+/// down to ADAPT_MIN_RADIUS. Textured pixels need no large window.
+template <class Comb, typename T, int R>
+int TileAggregator<Comb,T,R>::pixelRadius(int x, int y) const {
+    const int w=im1.width(), h=im1.height(), c=im1.channels();
+    float g=0;
+    int n=0;
+    const int i1=std::min(w-2,x+ADAPT_TEXTURE);
+    const int j1=std::min(h-1,y+ADAPT_TEXTURE);
+    for(int j=std::max(0,y-ADAPT_TEXTURE); j<=j1; j++)
+        for(int i=std::max(1,x-ADAPT_TEXTURE); i<=i1; i++, n++)
+            for(int k=0; k<c; k++)
+                g += std::abs(im1(i+1,j,k)-im1(i-1,j,k));
+    if(n == 0)
+        return r;
+    g /= 2.0f*n*c;
+    int rp=r;
+    for(float t=param.adaptRadius; t<=g && rp/2>=ADAPT_MIN_RADIUS; t*=2)
+        rp /= 2;
+    return rp;
+}
+
+/// Aggregation of tile [x0,x1)x[y0,y1), winner-take-all.
+///
+/// E1 and disp1 are updated at pixels of the tile. E2 and disp2 are updated at
+/// pixels (x+d,y) stored at (x+d-ox,y-oy). If a per-pixel range is given,
+/// only disparities inside it are tested.
+template <class Comb, typename T, int R>
+void TileAggregator<Comb,T,R>::run(int x0, int x1, int y0, int y1,
+                            Image& E1, Image& disp1,
+                            Image& E2, Image& disp2, int ox, int oy) {
+    const int width=cost.width();
+    for(int y=y0; y<y1; y++) {
+        if(rangeLo) { // Skip rows of empty ranges
+            int x=x0;
+            while(x<x1 && !inRange(x,y)) ++x;
+            if(x == x1) {
+#ifdef WORK_COUNTERS
+                excluded += static_cast<double>(x1-x0)*(dMax-dMin+1);
+#endif
+                continue;
+            }
+        }
+        if(!tensor1 || offset)
+            support1.compute(y, x0, x1);
+        if((vec || offset) && (!Comb::left || right))
+            support2Row.compute(y, std::max(0,x0+dMin),
+                                std::min(width,x1+dMax));
+        if(offset)
+            offsetRow(y, x0, x1);
+        if(offset && !right) {
+            offsetWTA(y, x0, x1, E1, disp1, E2, disp2, ox, oy);
+            continue;
+        }
+        int next2=x0+dMin; // Next window of target image to compute
+        for(int x=x0; x<x1; x++) {
+            if(rangeLo && !inRange(x,y)) {
+#ifdef WORK_COUNTERS
+                excluded += dMax-dMin+1;
+#endif
+                continue;
+            }
+            const int rp = adaptive? pixelRadius(x,y): r;
+            // Windows of target image up to disparity dMax
+            if(!Comb::left || right)
+                for(; next2<=x+dMax; next2++)
+                    support2(next2,y, (next2-dMin)%nd);
+            // Reference window weights
+            if(tensor1)
+                tensor1->window(x, y, distC, W1);
+            else
+                support1.window(x, W1);
+            const float den1 = Comb::hoisted?
+                premultiply(W1, x,y, r,s, width,cost.height(), distP): 0;
+            if(param.intSum)
+                quantize(&W1(0,0), W1.width()*W1.height(), ONE15,
+                         &windowsQ[0]);
+            if(pruning) { // Bounds of weights by row, W1 premultiplied or not
+                int i0, i1, j0, j1;
+                taps(x, width, r, s, i0, i1);
+                taps(y, cost.height(), r, s, j0, j1);
+                float sum=0;
+                for(int j=j1; j>=j0; j--) {
+                    rest[j+r] = sum;
+                    const float *w=&W1(r,j+r), *dp=distP+(j+r)*(2*r+1)+r;
+                    for(int i=i0; i<=i1; i++)
+                        sum += Comb::hoisted? Comb::comb(w[i],1.0f):
+                                              dp[i]*Comb::comb(w[i],1.0f);
+                }
+            }
+            if(sparse) { // Significant taps of p, W1 premultiplied or not
+                sparseI.clear(); sparseJ.clear(); sparseO.clear();
+                int i0, i1, j0, j1;
+                taps(x, width, r, s, i0, i1);
+                taps(y, cost.height(), r, s, j0, j1);
+                for(int j=j0; j<=j1; j++)
+                    for(int i=i0; i<=i1; i++) {
+                        const int o = (j+r)*(2*r+1)+i+r;
+                        const float w = W1(i+r,j+r);
+                        if((Comb::hoisted? w: distP[o]*w) > param.sparse) {
+                            sparseI.push_back(i);
+                            sparseJ.push_back(j);
+                            sparseO.push_back(o);
+                        }
+                    }
+                const double n = sparseO.size(), all=(i1-i0+1)*(j1-j0+1);
+                summed += n*(dMax-dMin+1);
+                skipped += (all-n)*(dMax-dMin+1);
+            }
+            int d0=dMin, d1=dMax;
+            if(rangeLo) {
+                d0 = std::max(d0, static_cast<int>((*rangeLo)(x,y)));
+                d1 = std::min(d1, static_cast<int>((*rangeHi)(x,y)));
+            }
+            if(cascade)
+                screen(x, y, d0, d1);
+            if(adaptive && d0<=d1) {
+                const double n=(2*rp+1)*(2*rp+1), all=(2*r+1)*(2*r+1);
+                summed += n*(d1-d0+1);
+                skipped += (all-n)*(d1-d0+1);
+            }
+            int v0=d0, v1=d0; // Disparities [v0,v1) done by costsCombined
+            if(vec && !adaptive && r*s<=x && x<width-r*s) { // Window inside
+                v0 = std::max(d0, r*s-x);
+                const int last = std::min(d1, width-1-r*s-x);
+                for(v1=v0; v1+SUM_LANES-1<=last; v1+=SUM_LANES)
+                    costsCombined<Comb>(x, y, r,s, &W1(0,0), support2Row,
+                                        distP, cost, v1, den1, &runs[0],
+                                        &runs[2*r+1], &block[v1-dMin]);
+            }
+            float Eprev=NaN, Em=NaN, Ep=NaN; // Costs at d-1, best-1, best+1
+            bool follow=false; // Whether d-1 is the best so far
+            if(conf || top)
+                std::fill(curve.begin(), curve.end(), NaN);
+#ifdef WORK_COUNTERS
+            const double before = evaluated;
+#endif
+            for(int d=d0; d<=d1; d++) {
+                if(!(0<=x+d && x+d<width) || (cascade && !candidate[d-dMin])){
+                    Eprev = NaN;
+                    follow = false;
+                } else {
+                    const int k = (x+d-dMin)%nd;
+                    const float bound = !pruning? 0.0f:
+                        (param.leftOnly || right)? E1(x,y):
+                        std::max(E1(x,y), E2(x+d-ox,y-oy));
+                    float E = pruning?
+                        costPruned<Comb,R>(x, x+d, y, r,s, &W1(0,0),
+                                           &weights2[k](0,0), distP, cost, d,
+                                           den1, &rest[0], bound,
+                                           summed, skipped):
+                        sparse?
+                        costSparse<Comb>(x, x+d, y, r,s, &W1(0,0),
+                                         &weights2[k](0,0), distP, cost, d,
+                                         &sparseI[0], &sparseJ[0],
+                                         &sparseO[0],
+                                         static_cast<int>(sparseO.size())):
+                        offset? offE[static_cast<size_t>(d-dMin)*
+                                     (x1-x0)+x-x0]:
+                        (v0<=d && d<v1)? block[d-dMin]:
+                        adaptive?
+                        costRadius<Comb>(x, x+d, y, r,s, rp, &W1(0,0),
+                                         &weights2[k](0,0), distP, cost, d):
+                        param.intSum?
+                        costCombinedInt<Comb,R>(x, x+d, y, r,s, windowQ(0),
+                                              windowQ(k+1), &distPQ[0],
+                                              cost, d):
+                        costCombined<Comb,R>(x, x+d, y, r,s,
+                                           &W1(0,0), &weights2[k](0,0), distP,
+                                           cost, d, den1, param.fastSum);
+#ifdef WORK_COUNTERS
+                    evaluated++;
+                    if(!pruning && !sparse && !adaptive) // Else counted
+                        summed += (right? 2: 1)*windowTaps(x, x+d, y, r,s,
+                                                           width,
+                                                           cost.height());
+#endif
+                    if(E1(x,y) > E) {
+                        E1(x,y) = E;
+                        disp1(x,y) = static_cast<float>(d);
+                        Em = Eprev;
+                        Ep = NaN;
+                        follow = true;
+                    } else if(follow) {
+                        Ep = E;
+                        follow = false;
+                    }
+                    Eprev = E;
+                    if(conf || top)
+                        curve[d-dMin] = E;
+                    if(right) // Weights of q given first
+                        E = adaptive?
+                            costRadius<typename RightOf<Comb>::type>(x, x+d,
+                                       y, r,s, rp, &weights2[k](0,0),
+                                       &W1(0,0), distP, cost, d):
+                            param.intSum?
+                            costCombinedInt<Comb,R>(x, x+d, y, r,s,
+                                                    windowQ(k+1), windowQ(0),
+                                                    &distPQ[0], cost, d):
+                            costCombined<typename RightOf<Comb>::type,R>(x,
+                                       x+d, y, r,s, &weights2[k](0,0),
+                                       &W1(0,0), distP, cost, d, den2[k],
+                                       param.fastSum);
+                    if(!param.leftOnly && E2(x+d-ox,y-oy) > E) {
+                        E2(x+d-ox,y-oy) = E;
+                        disp2(x+d-ox,y-oy)= -static_cast<float>(d);
+                    }
+                }
+            }
+#ifdef WORK_COUNTERS
+            excluded += (dMax-dMin+1)-(evaluated-before);
+#endif
+            if(conf && E1(x,y) < std::numeric_limits<float>::max()) {
+                const int i = static_cast<int>(disp1(x,y))-dMin;
+                (*conf)(x,y) = confidence(curve, i, E1(x,y));
+            }
+            if(top && E1(x,y) < std::numeric_limits<float>::max())
+                candidates(curve, dMin, *top, x, y);
+            if(param.subpixel && is_number(Em) && is_number(Ep))
+                disp1(x,y) = subpixel(static_cast<int>(disp1(x,y)),
+                                      Em, E1(x,y), Ep);
+        }
+    }
+}
+
+/// Disparities [rowLo[y],rowHi[y]] of costs needed in row y, the union of
+/// ranges [lo,hi] of pixels of rows y-r to y+r. They are accumulated in
+/// \a rowLo and \a rowHi, which must be initialized with the full range.
+static void rowRanges(const Image& lo, const Image& hi, int r,
+                      std::vector<int>& rowLo, std::vector<int>& rowHi) {
+    const int w=lo.width(), h=lo.height();
+    std::vector<int> l(h,rowHi[0]+1), u(h,rowLo[0]-1); // Empty ranges
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            l[y] = std::min(l[y], static_cast<int>(lo(x,y)));
+            u[y] = std::max(u[y], static_cast<int>(hi(x,y)));
+        }
+    for(int y=0; y<h; y++) {
+        int a=rowHi[y]+1, b=rowLo[y]-1;
+        for(int j=std::max(0,y-r); j<=std::min(h-1,y+r); j++) {
+            a = std::min(a,l[j]);
+            b = std::max(b,u[j]);
+        }
+        rowLo[y] = std::max(rowLo[y],a);
+        rowHi[y] = std::min(rowHi[y],b);
+    }
+}
+
+/// Layout of the cost volumes of aggregate, PixelMajor for the sums over
+/// disparities of \a param.dispSum, only of float costs and not \a ragged.
+template <typename T>
+static typename CostVolumeT<T>::Layout costLayout(const ParamDisparity& param,
+                                                  bool ragged) {
+    const bool floats = (T(0.5f) != T(0));
+    return (param.dispSum && floats && !ragged)? CostVolumeT<T>::PixelMajor:
+                                                 CostVolumeT<T>::DispMajor;
+}
+
+/// Units of aggregate, tiles of a band of rows, run by a parallel loop.
+///
+/// Each thread has its aggregator and, without full cost volume, its rolling
+/// volume, created at its first unit. The rows of the rolling volume are kept
+/// from a unit to the next one of the thread if they are still resident,
+/// which is the case for contiguous units of a static schedule. If
+/// touchRows, the first unit of each band computes instead the rows of the
+/// band in the full volume.
+template <class Comb, typename T, int R>
+class TileUnits : public ParallelBody {
+public:
+    TileUnits(const Image& im1, const Image& im2, int dMin, int dMax,
+              const ParamDisparity& param, float* distC, const float* distP,
+              CostVolumeT<T>* fullCost, const CostRows<T>* rows,
+              const SupportTensor* tensor1, const SupportTensor* tensor2,
+              const Image* rangeLo, const Image* rangeHi, Image* conf,
+              Candidates* top, int tileW, int tileH,
+              const std::vector<int>& rowLo, const std::vector<int>& rowHi,
+              Image& E1, Image& disp1,
+              std::vector<Image>& E2t, std::vector<Image>& disp2t,
+              const std::vector<int>& ox, ProgressStep& progress);
+    ~TileUnits();
+    void run(int u, int thread);
+    void counts(double& summed, double& skipped,
+                double& evaluated, double& excluded) const;
+    bool touchRows; ///< Whether units compute the rows of costs of bands
+private:
+    const Image &im1, &im2;
+    const int dMin, dMax;
+    const ParamDisparity& param;
+    float* distC;
+    const float* distP;
+    CostVolumeT<T>* fullCost; ///< Full volume, or 0 for rolling ones
+    const CostRows<T>* rows;  ///< Raw costs, 0 if fullCost is complete
+    const SupportTensor *tensor1, *tensor2;
+    const Image *rangeLo, *rangeHi;
+    Image* conf;
+    Candidates* top;
+    const int tileW, tileH, nTiles;
+    const std::vector<int> &rowLo, &rowHi;
+    Image &E1, &disp1;
+    std::vector<Image> &E2t, &disp2t;
+    const std::vector<int>& ox;
+    ProgressStep& progress;
+    /// Workspace of a thread
+    struct Workspace {
+        TileAggregator<Comb,T,R>* agg;
+        CostVolumeT<T>* rollCost; ///< Rolling volume, or 0
+        int firstRow, nextRow;    ///< Rows [firstRow,nextRow) computed
+    };
+    std::vector<Workspace> work;
+    TileUnits(const TileUnits&);            ///< Forbidden
+    TileUnits& operator=(const TileUnits&); ///< Forbidden
+};
+
+/// Constructor, with no workspace yet.
+template <class Comb, typename T, int R>
+TileUnits<Comb,T,R>::TileUnits(const Image& im1_, const Image& im2_,
+                               int dMin_, int dMax_,
+                               const ParamDisparity& param_,
+                               float* distC_, const float* distP_,
+                               CostVolumeT<T>* full, const CostRows<T>* rows_,
+                               const SupportTensor* t1,
+                               const SupportTensor* t2,
+                               const Image* lo, const Image* hi, Image* conf_,
+                               Candidates* top_, int tileW_, int tileH_,
+                               const std::vector<int>& rowLo_,
+                               const std::vector<int>& rowHi_,
+                               Image& E1_, Image& disp1_,
+                               std::vector<Image>& E2t_,
+                               std::vector<Image>& disp2t_,
+                               const std::vector<int>& ox_,
+                               ProgressStep& progress_)
+: touchRows(false), im1(im1_), im2(im2_), dMin(dMin_), dMax(dMax_),
+  param(param_), distC(distC_), distP(distP_), fullCost(full), rows(rows_),
+  tensor1(t1), tensor2(t2), rangeLo(lo), rangeHi(hi), conf(conf_),
+  top(top_), tileW(tileW_), tileH(tileH_),
+  nTiles((im1_.width()+tileW_-1)/tileW_),
+  rowLo(rowLo_), rowHi(rowHi_), E1(E1_), disp1(disp1_),
+  E2t(E2t_), disp2t(disp2t_), ox(ox_), progress(progress_) {
+    Workspace none = {0, 0, 0, 0};
+    work.assign(parallelThreads(), none);
+}
+
+/// Destructor, freeing the workspaces.
+template <class Comb, typename T, int R>
+TileUnits<Comb,T,R>::~TileUnits() {
+    for(size_t i=0; i<work.size(); i++) {
+        delete work[i].agg;
+        delete work[i].rollCost;
+    }
+}
+
+/// Taps summed and skipped, disparities evaluated and excluded, in the
+/// aggregators of the threads, see TileAggregator.
+template <class Comb, typename T, int R>
+void TileUnits<Comb,T,R>::counts(double& summed, double& skipped,
+                                 double& evaluated, double& excluded) const {
+    summed = skipped = evaluated = excluded = 0;
+    for(size_t i=0; i<work.size(); i++)
+        if(work[i].agg) {
+            summed += work[i].agg->summed;
+            skipped += work[i].agg->skipped;
+            evaluated += work[i].agg->evaluated;
+            excluded += work[i].agg->excluded;
+        }
+}
+
+/// Unit \a u, aggregation of its tile by thread \a thread, or the rows of
+/// costs of its band if touchRows.
+template <class Comb, typename T, int R>
+void TileUnits<Comb,T,R>::run(int u, int thread) {
+    if(computationCancelled())
+        return;
+    const int width=im1.width(), height=im1.height(), r=param.radius;
+    const int x0=(u%nTiles)*tileW, x1=std::min(width,x0+tileW);
+    const int y0=(u/nTiles)*tileH, y1=std::min(height,y0+tileH);
+    if(touchRows) {
+        if(u%nTiles == 0) {
+            TraceSpan span("cost rows", u/nTiles);
+            for(int y=y0; y<y1; y++)
+                rows->row(y, *fullCost, rowLo[y], rowHi[y], thread);
+        }
+        return;
+    }
+    TraceSpan span("aw tile", u);
+    if(fullCost && u%nTiles==0) // Rows read by the next band, if on disk
+        fullCost->willNeed(std::min(height,y1+r),
+                           std::min(height,y1+tileH+r));
+    assert(thread < static_cast<int>(work.size()));
+    Workspace& ws = work[thread];
+    if(! ws.agg) {
+        if(! fullCost)
+            ws.rollCost = new CostVolumeT<T>(width, height, dMin, dMax,
+                                             rows->maxCost(),
+                                             costLayout<T>(param, false),
+                                             tileH+2*r, param.costPages);
+        ws.agg = new TileAggregator<Comb,T,R>(im1, im2, dMin, dMax, param,
+                                              distC, distP,
+                                              fullCost? *fullCost:
+                                              *ws.rollCost,
+                                              tensor1, tensor2,
+                                              rangeLo, rangeHi, conf, top);
+    }
+    if(ws.rollCost) { // Compute missing rows
+        const int first = std::max(0,y0-r);
+        if(first < std::max(ws.firstRow, ws.nextRow-ws.rollCost->rows()) ||
+           first > ws.nextRow) // Not resident
+            ws.firstRow = ws.nextRow = first;
+        for(; ws.nextRow<y1+r && ws.nextRow<height; ws.nextRow++)
+            rows->row(ws.nextRow, *ws.rollCost,
+                     rowLo[ws.nextRow], rowHi[ws.nextRow], thread);
+    }
+    ws.agg->run(x0,x1, y0,y1, E1, disp1, E2t[u], disp2t[u],
+                ox[u], (nTiles>1)? y0: 0);
+    progress.advance(static_cast<long>(x1-x0)*(y1-y0));
+}
+
+/// Bands of rows at the end of aggregate, run by a parallel loop: the tiles
+/// of E2 and disp2 are merged into them, then the left-right check is
+/// written in occ if not 0.
+class MergeBands : public ParallelBody {
+public:
+    MergeBands(Image& E2_, Image& disp2_, const std::vector<Image>& E2t_,
+               const std::vector<Image>& disp2t_, const std::vector<int>& ox_,
+               int nTiles_, int tileH_, const Image& disp1_, Image* occ_,
+               int dMin_, int tolDisp_)
+    : E2(E2_), disp2(disp2_), E2t(E2t_), disp2t(disp2t_), ox(ox_),
+      nTiles(nTiles_), tileH(tileH_), disp1(disp1_), occ(occ_), dMin(dMin_),
+      tolDisp(tolDisp_) {}
+    void run(int b, int);
+private:
+    Image &E2, &disp2;
+    const std::vector<Image> &E2t, &disp2t;
+    const std::vector<int>& ox;
+    const int nTiles, tileH;
+    const Image& disp1;
+    Image* occ;
+    const int dMin, tolDisp;
+};
+
+/// Band \a b.
+void MergeBands::run(int b, int) {
+    const int height=disp1.height();
+    for(int u=b*nTiles; nTiles>1 && u<(b+1)*nTiles; u++)
+        for(int y=0; y<E2t[u].height(); y++)
+            for(int x=0; x<E2t[u].width(); x++)
+                if(E2(ox[u]+x,b*tileH+y) > E2t[u](x,y)) {
+                    E2(ox[u]+x,b*tileH+y) = E2t[u](x,y);
+                    disp2(ox[u]+x,b*tileH+y) = disp2t[u](x,y);
                 }
-    return num/den;
+    for(int y=b*tileH; occ && y<std::min(height,(b+1)*tileH); y++)
+        detect_occlusion_row(disp1, disp2, *occ, y,
+                             static_cast<float>(dMin-1), tolDisp);
+}
+
+/// Merge dissimilarities \a E2c and disparities \a disp2c of a chunk of
+/// disparities (param.dispChunk) into \a E2 and \a disp2, those of the
+/// previous chunks, of lower disparities. A row by row traversal reaching q
+/// from the pixels p=q-d in increasing order of x, thus decreasing d, keeps
+/// the first one of equal costs: the chunk wins ties.
+static void mergeChunk(Image& E2, Image& disp2,
+                       const Image& E2c, const Image& disp2c) {
+    const float none=std::numeric_limits<float>::max();
+    for(int y=0; y<E2.height(); y++)
+        for(int x=0; x<E2.width(); x++)
+            if(E2c(x,y)<=E2(x,y) && E2c(x,y)<none) {
+                E2(x,y) = E2c(x,y);
+                disp2(x,y) = disp2c(x,y);
+            }
+}
+
+/// Aggregation of raw costs with adaptive weights, winner-take-all.
+///
+/// The image is traversed by tiles, see tileSize(). Tiles are distributed
+/// dynamically to threads, balancing the load. A tile owns the pixels of E1
+/// it updates, but pixels x+d of E2 may be shared with neighbor tiles. If a
+/// band of rows has several tiles, each tile updates its own copy of the
+/// pixels of E2 it reaches, and copies are merged from left to right at the
+/// end. Updates of a given pixel of E2 are thus in same order as with a
+/// traversal row by row, and the result is the same.
+///
+/// With \a param.rolling, no full cost volume is computed: each thread keeps
+/// a rolling volume of the rows of a band and its halo, computing new rows as
+/// it proceeds. Tiles are then statically scheduled in contiguous blocks, so
+/// that rows are recomputed only at the start of each block. Otherwise, the
+/// full volume is mapped from the cache directory \a param.costCache if not
+/// empty. With \a param.weightTensor, all support windows are precomputed.
+/// With \a param.dispChunk, the range is processed by chunks of disparities,
+/// each with its own volume, E1 keeping its minima and E2 being merged by
+/// mergeChunk().
+///
+/// If \a rangeLo and \a rangeHi are not 0, pixel (x,y) is tested only at
+/// disparities in [rangeLo(x,y),rangeHi(x,y)]. A row of costs then has only
+/// the layers in the union of ranges of the rows of windows including it, in
+/// a ragged volume. The cache is not used, as the volume is incomplete.
+/// \param im1,im2 the two color images
+/// \param dMin,dMax disparity range
+/// \param param parameters for cost computation
+/// \param distC,distP tabulated color and spatial weights
+/// \param rangeLo,rangeHi per-pixel disparity range, or 0 for \a dMin,dMax
+/// \param disp1 output disparity map from image 1 to image 2
+/// \param disp2 output disparity map from image 2 to image 1
+/// \param conf output confidence map of image 1, or 0
+/// \param top output candidates of image 1, or 0
+/// \param keep if not 0, full cost volume to use, or computed then stored in
+/// it if 0, the caller becoming its owner (not with rolling or range)
+/// \param keepT if not 0, the same for the support tensors of both images
+/// If \a R>0, it is the radius of windows in taps, param.radius/param.stride.
+template <class Comb, typename T, int R>
+static void aggregate(const Image& im1, const Image& im2, int dMin, int dMax,
+                      const ParamDisparity& param,
+                      float* distC, const float* distP,
+                      const Image* rangeLo, const Image* rangeHi,
+                      Image& disp1, Image& disp2, Image* conf, Image* occ,
+                      Candidates* top, CostVolumeT<T>** keep=0,
+                      SupportTensor** keepT=0) {
+    const int width=im1.width(), height=im1.height();
+    const int r = param.radius;
+    // Disparities of a chunk, see param.dispChunk
+    const bool chunked = (param.dispChunk>0 && param.dispChunk<dMax-dMin+1 &&
+                          !keep && param.costCache.empty() && !rangeLo &&
+                          !conf && !top && !param.subpixel &&
+                          param.cascade==0);
+    const int nd = chunked? param.dispChunk: dMax-dMin+1;
+    int tileW, tileH;
+    tileSize(param, width, height, nd, sizeof(T), tileW, tileH);
+    const int nBands = (height+tileH-1)/tileH, nTiles=(width+tileW-1)/tileW;
+    const int nUnits = nBands*nTiles;
+
+    CostVolumeT<T>* fullCost = keep? *keep: 0;
+    StageTimer timer(fullCost? 0: "cost setup");
+    CostRows<T>* rows = fullCost? 0: newCostRows<T>(im1, im2, param);
+    timer.stop();
+
+    // Precomputed support windows
+    SupportTensor *tensor1 = keepT? keepT[0]: 0, *tensor2 = keepT? keepT[1]: 0;
+    const bool needT2 = (!Comb::left || param.rightWeights);
+    if(param.weightTensor && (!tensor1 || (needT2 && !tensor2))) {
+        StageTimer timerTensor("support tensor");
+        if(! tensor1)
+            tensor1 = new SupportTensor(im1, r/param.stride, param.stride);
+        if(needT2 && !tensor2)
+            tensor2 = new SupportTensor(im2, r/param.stride, param.stride);
+        if(keepT) {
+            keepT[0] = tensor1;
+            keepT[1] = tensor2;
+        }
+    }
+
+    // Images of dissimilarity 1->2 and 2->1
+    const int nChunks = (dMax-dMin)/nd+1;
+    ProgressStep progress("aggregation",
+                          static_cast<long>(width)*height*nChunks);
+    Image E1(width,height), E2(width,height);
+    E1.fill(std::numeric_limits<float>::max());
+    E2.fill(std::numeric_limits<float>::max());
+    for(int c0=dMin; c0<=dMax; c0+=nd) {
+        const int c1 = std::min(dMax, c0+nd-1);
+        // Disparities of costs needed in each row
+        std::vector<int> rowLo(height,c0), rowHi(height,c1);
+        if(rangeLo)
+            rowRanges(*rangeLo, *rangeHi, r, rowLo, rowHi);
+
+        StageTimer timerVolume(fullCost? 0: "cost volume");
+        if(!fullCost && !param.rolling && !param.costCache.empty() && !rangeLo)
+            fullCost = cachedCostVolume(*rows, im1, im2, dMin, dMax, param);
+        if(!fullCost && !param.rolling && !param.costScratch.empty() &&
+           !rangeLo)
+            fullCost = scratchCostVolume(*rows, width, height, c0, c1,
+                                         param.costScratch);
+        // Whether costs are computed in parallel region, by aggregating
+        // threads
+        const bool touch = (!param.rolling && !fullCost && param.firstTouch);
+        const typename CostVolumeT<T>::Layout layout =
+            costLayout<T>(param, rangeLo!=0);
+        const int *lo = rangeLo? &rowLo[0]: 0, *hi = rangeHi? &rowHi[0]: 0;
+        if(touch)
+            fullCost = newCostVolume(*rows, width, height, c0, c1, lo, hi,
+                                     param.costPages, layout);
+        if(! param.rolling && !fullCost)
+            fullCost = costVolume(*rows, width, height, c0, c1, lo, hi,
+                                  param.costPages, layout);
+
+        timerVolume.stop();
+        if(keep)
+            *keep = fullCost;
+
+        StageTimer timerAggreg("aggregation",
+                               static_cast<double>(width)*height*(c1-c0+1));
+        // Dissimilarities 2->1 of the chunk, merged below into E2
+        Image E2c = chunked? Image(width,height): E2;
+        Image disp2c = chunked? disp2.clone(): disp2;
+        if(chunked)
+            E2c.fill(std::numeric_limits<float>::max());
+        // Pixels of E2 and disp2 updated by each tile, with their offset
+        std::vector<Image> E2t(nUnits,E2c), disp2t(nUnits,disp2c);
+        std::vector<int> ox(nUnits,0);
+        if(nTiles>1 && !param.leftOnly)
+            for(int u=0; u<nUnits; u++) {
+                const int x0=(u%nTiles)*tileW, x1=std::min(width,x0+tileW);
+                const int y0=(u/nTiles)*tileH, y1=std::min(height,y0+tileH);
+                ox[u] = std::max(0,x0+c0);
+                const int w = std::min(width,x1+c1)-ox[u];
+                E2t[u] = Image(std::max(w,0), y1-y0);
+                disp2t[u] = Image(std::max(w,0), y1-y0);
+                E2t[u].fill(std::numeric_limits<float>::max());
+            }
+
+        TileUnits<Comb,T,R> units(im1, im2, c0, c1, param, distC, distP,
+                                  fullCost, rows, tensor1, tensor2,
+                                  rangeLo, rangeHi, conf, top, tileW, tileH,
+                                  rowLo, rowHi, E1, disp1, E2t, disp2t, ox,
+                                  progress);
+        if(touch) {
+            // Rows of a band first touched by the thread of its first tile,
+            // the same distribution of tiles being used for aggregation.
+            units.touchRows = true;
+            parallelFor(nUnits, units, ParallelStatic);
+            units.touchRows = false;
+        }
+        parallelFor(nUnits, units, (!fullCost || touch)? ParallelStatic:
+                                                         ParallelDynamic);
+        double summed, skipped, evaluated, excluded;
+        units.counts(summed, skipped, evaluated, excluded);
+        if(summed > 0) {
+            addCount("taps summed", summed);
+            addCount("taps skipped", skipped);
+        }
+        if(evaluated+excluded > 0) {
+            addCount("disps evaluated", evaluated);
+            addCount("disps skipped", excluded);
+        }
+
+        // Merge E2, left-right check
+        if((nTiles>1 && !param.leftOnly) || (occ && !chunked)) {
+            MergeBands merge(E2c, disp2c, E2t, disp2t, ox, nTiles, tileH,
+                             disp1, chunked? 0: occ, dMin, param.tolDisp);
+            parallelFor(nBands, merge);
+        }
+        if(chunked && !param.leftOnly)
+            mergeChunk(E2, disp2, E2c, disp2c);
+        if(chunked) {
+            delete fullCost;
+            fullCost = 0;
+        }
+    }
+    if(chunked && occ) { // Left-right check of the maps of all chunks
+        std::vector<Image> none;
+        std::vector<int> noOffset;
+        MergeBands check(E2, disp2, none, none, noOffset, 1, tileH, disp1,
+                         occ, dMin, param.tolDisp);
+        parallelFor(nBands, check);
+    }
+    if(! keepT) {
+        delete tensor1;
+        delete tensor2;
+    }
+    if(! keep)
+        delete fullCost;
+    delete rows;
+}
+
+/// Radii of windows in taps with aggregation specialized at compilation, as
+/// a sequence AW_RADIUS(r1)AW_RADIUS(r2)... (CMake variable AW_RADII).
+#ifndef AW_RADII
+#define AW_RADII AW_RADIUS(17)
+#endif
+
+/// Aggregation with costs of type \a T, specialized for the radius of windows
+/// in taps if it is in AW_RADII, else with the radius known at run time.
+template <class Comb, typename T>
+static void aggregateRadius(const Image& im1, const Image& im2,
+                            int dMin, int dMax, const ParamDisparity& param,
+                            float* distC, const float* distP,
+                            const Image* rangeLo, const Image* rangeHi,
+                            Image& disp1, Image& disp2, Image* conf,
+                            Image* occ, Candidates* top,
+                            CostVolumeT<T>** keep, SupportTensor** keepT) {
+    switch(param.radius/param.stride) {
+#define AW_RADIUS(R) \
+    case R: \
+        aggregate<Comb,T,R>(im1, im2, dMin, dMax, param, distC, distP, \
+                            rangeLo, rangeHi, disp1, disp2, conf, occ, top, \
+                            keep, keepT); \
+        break;
+    AW_RADII
+#undef AW_RADIUS
+    default:
+        aggregate<Comb,T,0>(im1, im2, dMin, dMax, param, distC, distP,
+                            rangeLo, rangeHi, disp1, disp2, conf, occ, top,
+                            keep, keepT);
+    }
+}
+
+/// Aggregation with combination of weights \a Comb, for storage type of
+/// costs selected in \a param. The volume and the support tensors are kept
+/// in \a keep (or \a keep16) and \a keepT if not 0, see aggregate.
+template <class Comb>
+static void aggregateComb(const Image& im1, const Image& im2,
+                          int dMin, int dMax, const ParamDisparity& param,
+                          float* distC, const float* distP,
+                          const Image* rangeLo, const Image* rangeHi,
+                          Image& disp1, Image& disp2, Image* conf,
+                          Image* occ, Candidates* top, CostVolume** keep,
+                          CostVolume16** keep16, SupportTensor** keepT) {
+    if(param.cost16 || param.intSum)
+        aggregateRadius<Comb,unsigned short>(im1, im2, dMin, dMax, param,
+                                             distC, distP, rangeLo, rangeHi,
+                                             disp1, disp2, conf, occ, top,
+                                             keep16, keepT);
+    else
+        aggregateRadius<Comb,float>(im1, im2, dMin, dMax, param, distC, distP,
+                                    rangeLo, rangeHi, disp1, disp2, conf, occ,
+                                    top, keep, keepT);
 }
 
 /// Adaptive Weights disparity computation.
@@ -180,80 +1962,761 @@ float costCombined(int xp, int xq, int yp, int r,
 /// \param dMin,dMax disparity range
 /// \param param raw cost computation parameters
 /// \param disp1 output disparity map from image 1 to image 2
-/// \param disp2 output disparity map from image 2 to image 1
+/// \param disp2 output disparity map from image 2 to image 1, unless
+/// \a param.leftOnly: its dissimilarities are then not computed
+/// \param conf if not 0, output confidence map of image 1, see confidence()
+/// \param occ if not 0, output disp1 with pixels failing the left-right check
+/// of tolerance \a param.tolDisp set to dMin-1, as detect_occlusion does. The
+/// check is fused with the merge of the rows of disp2.
+/// \param top if not 0, output best top->k()>0 disparities of image 1 and
+/// their costs, see Candidates (not with param.dispChunk nor prune)
 void disparityAW(Image im1, Image im2,
                  int dMin, int dMax, const ParamDisparity& param,
-                 Image& disp1, Image& disp2) {
-    const int width=im1.width(), height=im1.height();
-    const int r = param.radius;
-#ifdef COMB_LEFT // Disparity range
-    const int nd = 1; // Do not compute useless weights in target image
-#else
-    const int nd = dMax-dMin+1;
+                 Image& disp1, Image& disp2, Image* conf, Image* occ,
+                 Candidates* top) {
+    disparityAW(im1, im2, dMin, dMax, param, Image(), Image(), disp1, disp2,
+                conf, occ, top);
+}
+
+/// Adaptive Weights disparity computation in per-pixel range, keeping the
+/// cost volume in \a keep or \a keep16 and the support tensors in \a keepT
+/// if not 0 (see aggregate).
+static void disparityAW(const Image& im1, const Image& im2,
+                        int dMin, int dMax, const ParamDisparity& param,
+                        const Image& rangeLo, const Image& rangeHi,
+                        Image& disp1, Image& disp2, Image* conf, Image* occ,
+                        Candidates* top, CostVolume** keep,
+                        CostVolume16** keep16, SupportTensor** keepT) {
+    if(param.intCost && !(is_8bit(im1) && is_8bit(im2))) {
+        std::cerr << "Warning: images are not 8-bit, "
+                  << "using float raw cost" << std::endl;
+        ParamDisparity p(param);
+        p.intCost = false;
+        disparityAW(im1, im2, dMin, dMax, p, rangeLo, rangeHi, disp1, disp2,
+                    conf, occ, top, keep, keep16, keepT);
+        return;
+    }
+    const bool range = (rangeLo.width()>0 && rangeHi.width()>0);
+    const Image *lo = range? &rangeLo: 0, *hi = range? &rangeHi: 0;
+    if(top && top->k()>0) { // Pixels out of range have no candidate
+        top->disp.fill(NaN);
+        top->cost.fill(NaN);
+    } else
+        top = 0;
+
+    float* distC = colorWeights(im1.channels(), param);
+    float* distP = spatialWeights(param);
+
+    switch(param.comb) {
+    case ParamDisparity::CombineLeft:
+        aggregateComb<CombLeft>(im1,im2, dMin,dMax, param, distC,distP,
+                                lo,hi, disp1,disp2, conf, occ, top,
+                                keep, keep16, keepT);
+        break;
+    case ParamDisparity::CombineMax:
+        aggregateComb<CombMax>(im1,im2, dMin,dMax, param, distC,distP,
+                               lo,hi, disp1,disp2, conf, occ, top,
+                               keep, keep16, keepT);
+        break;
+    case ParamDisparity::CombineMin:
+        aggregateComb<CombMin>(im1,im2, dMin,dMax, param, distC,distP,
+                               lo,hi, disp1,disp2, conf, occ, top,
+                               keep, keep16, keepT);
+        break;
+    case ParamDisparity::CombineMult:
+        aggregateComb<CombMult>(im1,im2, dMin,dMax, param, distC,distP,
+                                lo,hi, disp1,disp2, conf, occ, top,
+                                keep, keep16, keepT);
+        break;
+    case ParamDisparity::CombinePlus:
+        aggregateComb<CombPlus>(im1,im2, dMin,dMax, param, distC,distP,
+                                lo,hi, disp1,disp2, conf, occ, top,
+                                keep, keep16, keepT);
+        break;
+    }
+    delete [] distC;
+    delete [] distP;
+}
+
+/// Adaptive Weights disparity computation in per-pixel range.
+///
+/// Pixel (x,y) of image 1 is tested only at disparities in [dMin,dMax] and in
+/// [rangeLo(x,y),rangeHi(x,y)]. If the range images are empty, the search is
+/// over [dMin,dMax] at all pixels.
+void disparityAW(Image im1, Image im2,
+                 int dMin, int dMax, const ParamDisparity& param,
+                 const Image& rangeLo, const Image& rangeHi,
+                 Image& disp1, Image& disp2, Image* conf, Image* occ,
+                 Candidates* top) {
+    disparityAW(im1, im2, dMin, dMax, param, rangeLo, rangeHi, disp1, disp2,
+                conf, occ, top, 0, 0, 0);
+}
+
+/// Constructor, nothing being kept.
+SharedCosts::SharedCosts()
+: dMin(0), dMax(-1), costs(0), costs16(0), tensor1(0), tensor2(0) {}
+
+/// Release the volume, the support windows and the images.
+void SharedCosts::clear() {
+    delete costs;
+    delete costs16;
+    delete tensor1;
+    delete tensor2;
+    costs = 0;
+    costs16 = 0;
+    tensor1 = tensor2 = 0;
+    im1 = im2 = Image();
+}
+
+/// Whether \a a and \a b are the same image, not only equal.
+static bool same(Image a, Image b) {
+    return (a.width()==b.width() && a.height()==b.height() &&
+            a.channels()==b.channels() && a.stride()==b.stride() &&
+            a.width()>0 && &a(0,0)==&b(0,0));
+}
+
+/// Release what cannot be reused for images \a I1, \a I2, range
+/// [\a d0,\a d1] and parameters \a p.
+void SharedCosts::update(const Image& I1, const Image& I2, int d0, int d1,
+                         const ParamDisparity& p) {
+    const bool windows = (param.radius/param.stride==p.radius/p.stride &&
+                          param.stride==p.stride && p.weightTensor);
+    if(!same(im1,I1) || !same(im2,I2) || dMin!=d0 || dMax!=d1 ||
+       param.tauCol!=p.tauCol || param.tauGrad!=p.tauGrad ||
+       param.alpha!=p.alpha || param.rawCost!=p.rawCost ||
+       param.intCost!=p.intCost || param.offsetY!=p.offsetY ||
+       param.searchY!=p.searchY ||
+       (param.cost16||param.intSum) != (p.cost16||p.intSum)) {
+        SupportTensor* keep1 = 0; // Windows of the same image 1
+        if(same(im1,I1) && windows) {
+            keep1 = tensor1;
+            tensor1 = 0;
+        }
+        clear();
+        tensor1 = keep1;
+        im1 = I1;
+        im2 = I2;
+        dMin = d0;
+        dMax = d1;
+    } else if(param.radius/param.stride!=p.radius/p.stride ||
+              param.stride!=p.stride || param.comb!=p.comb ||
+              !p.weightTensor) {
+        delete tensor1;
+        delete tensor2;
+        tensor1 = tensor2 = 0;
+    }
+    param = p;
+}
+
+/// Adaptive Weights disparity computation, with the cost volume and the
+/// support windows of \a shared.
+///
+/// Same as disparityAW on the full range, but what can be reused from the
+/// previous call with \a shared is, and what is computed is kept in it for
+/// the next one. The full cost volume is needed: \a param.rolling is
+/// ignored.
+void disparityAW(Image im1, Image im2,
+                 int dMin, int dMax, const ParamDisparity& param,
+                 SharedCosts& shared, Image& disp1, Image& disp2,
+                 Image* conf, Image* occ, Candidates* top) {
+    ParamDisparity p(param);
+    p.rolling = false;
+    shared.update(im1, im2, dMin, dMax, p);
+    SupportTensor* tensors[2] = {shared.tensor1, shared.tensor2};
+    disparityAW(im1, im2, dMin, dMax, p, Image(), Image(), disp1, disp2,
+                conf, occ, top, &shared.costs, &shared.costs16, tensors);
+    shared.tensor1 = tensors[0];
+    shared.tensor2 = tensors[1];
+}
+
+/// Fill occlusions by weighted median with the support weights of disparityAW.
+///
+/// This is fill_occlusion with the weights of the aggregation instead of the
+/// bilateral weights of ParamOcclusion: the window of an occluded pixel of
+/// \a mask is its support window in image \a im, computed by the
+/// same tabulated color and spatial weights (\a param.gammaCol, gammaPos,
+/// radius and stride), with no exponential. The pixels are known only after
+/// both disparity maps, so their windows are recomputed rather than kept from
+/// the aggregation. \a disparity, densified, is filtered in place.
+void fillOcclusionAW(Image& disparity, const Image& im,
+                     const OcclusionMask& mask, int dMin, int dMax,
+                     const ParamDisparity& param) {
+    const int width=im.width(), height=im.height();
+    const int s=param.stride, r=param.radius/s, dim=2*r+1;
+    const std::vector<int> list=mask.pixels(); // Pixels to fill
+    float* distC = colorWeights(im.channels(), param);
+    float* distP = spatialWeights(param);
+    const int n=static_cast<int>(list.size());
+    std::vector<float> out(n);
+#ifdef _OPENMP
+#pragma omp parallel
 #endif
+    {
+        Image w(dim,dim);
+        std::vector<float> tab(dMax-dMin+1);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,16)
+#endif
+        for(int i=0; i<n; i++) {
+            const int xp=list[i]%width, yp=list[i]/width;
+            support(im, xp, yp, r, s, distC, w);
+            int x0, x1, y0, y1;
+            taps(xp, width, r, s, x0, x1);
+            taps(yp, height, r, s, y0, y1);
+            std::fill(tab.begin(), tab.end(), 0.0f);
+            float sum=0;
+            for(int y=y0; y<=y1; y++)
+                for(int x=x0; x<=x1; x++) {
+                    const float v=std::floor(disparity(xp+x*s,yp+y*s)+0.5f);
+                    const float wt = w(x+r,y+r)*distP[(y+r)*dim+x+r];
+                    tab[static_cast<int>(v)-dMin] += wt;
+                    sum += wt;
+                }
+            int d=-1;
+            for(float cumul=0; cumul<sum/2;)
+                cumul += tab[++d];
+            out[i] = static_cast<float>(dMin+d);
+        }
+    }
+    for(int i=0; i<n; i++)
+        disparity(list[i]%width,list[i]/width) = out[i];
+    delete [] distC;
+    delete [] distP;
+}
 
-    // Tabulated proximity weights (color distance)
-    const int maxL1 = im1.channels()*255; // Maximum L1 distance between colors
-    float* distC = new float[maxL1+1];
-    float e2=exp(-1/(im1.channels()*param.gammaCol));
-    distC[0]=1.0f;
-    for(int x=1; x<=maxL1; x++)
-        distC[x] = e2*distC[x-1]; // distC[x] = exp(-x/(c*gamma))
+/// Adaptive Weights disparity computation in region of interest \a roi.
+///
+/// The images are viewed on the rows of \a roi and its halo of R+2 rows, and
+/// to its columns extended by R+2 and by the disparity range, so that all
+/// pixels matched from \a roi and their neighborhoods for raw costs are kept.
+/// Only pixels of \a roi are aggregated, with an empty per-pixel range
+/// elsewhere. The time is thus proportional to the
+/// area of \a roi extended by R and the disparity range, and disp1 inside
+/// \a roi is the same as computed on the whole image. Pixels of disp2 get
+/// their disparity only from pixels of \a roi. Other pixels of disp1 and
+/// disp2 are not modified. The part of \a roi outside the image is ignored.
+void disparityAW_roi(Image im1, Image im2, const Rect& rect,
+                     int dMin, int dMax, const ParamDisparity& param,
+                     Image& disp1, Image& disp2) {
+    // Halo of windows, and of neighborhoods of raw costs (gradient, census)
+    const int r = param.radius + RawCostCensus::RADIUS;
+    Rect roi(std::max(0,rect.x), std::max(0,rect.y));
+    roi.w = std::min(im1.width(), rect.x+rect.w)-roi.x;
+    roi.h = std::min(im1.height(),rect.y+rect.h)-roi.y;
+    if(roi.w<=0 || roi.h<=0)
+        return;
+    const int x0=std::max(0,roi.x+std::min(0,dMin)-r);
+    const int x1=std::min(im1.width(),roi.x+roi.w+std::max(0,dMax)+r);
+    const int y0=std::max(0,roi.y-r), y1=std::min(im1.height(),roi.y+roi.h+r);
+    const int w=x1-x0, h=y1-y0;
+    Image lo(w,h), hi(w,h);
+    lo.fill(static_cast<float>(dMax+1)); // Empty range
+    hi.fill(static_cast<float>(dMin-1));
+    for(int y=roi.y; y<roi.y+roi.h; y++)
+        for(int x=roi.x; x<roi.x+roi.w; x++) {
+            lo(x-x0,y-y0) = static_cast<float>(dMin);
+            hi(x-x0,y-y0) = static_cast<float>(dMax);
+        }
+    Image d1=disp1.crop(x0,y0,w,h), d2=disp2.crop(x0,y0,w,h);
+    disparityAW(im1.view(x0,y0,w,h), im2.view(x0,y0,w,h), dMin, dMax, param,
+                lo, hi, d1, d2);
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            if(lo(x,y) <= hi(x,y))
+                disp1(x0+x,y0+y) = d1(x,y);
+            disp2(x0+x,y0+y) = d2(x,y);
+        }
+}
 
-    // Tabulated proximity weights (spatial distance)
-    const int dim=2*r+1; // window dimension
-    float *distP = new float[dim*dim], *d=distP;
-    for(int y=-r; y<=r; y++)
-    for(int x=-r; x<=r; x++)
-        *d++ = exp(-2.0f*sqrt((float)(x*x+y*y))/param.gammaPos);
+/// Aggregated costs of query point \a pt at all disparities.
+///
+/// The images are viewed around the window of \a pt, its halo for raw costs
+/// and the pixels it is matched to. Only the rows of costs of the window are
+/// computed, then each disparity is aggregated as in disparityAW.
+template <class Comb>
+static void queryPoint(const Image& im1, const Image& im2,
+                       int dMin, int dMax, const ParamDisparity& param,
+                       float* distC, const float* distP, PointDisparity& pt) {
+    const int s = param.stride, r = param.radius/s, R=r*s; // Window in taps
+    const int m = R + RawCostCensus::RADIUS; // Halo of raw costs
+    pt.disparity = NaN;
+    pt.cost.assign(dMax-dMin+1, NaN);
+    if(!(0<=pt.x && pt.x<im1.width() && 0<=pt.y && pt.y<im1.height()))
+        return;
+    const int x0=std::max(0,pt.x+std::min(0,dMin)-m);
+    const int x1=std::min(im1.width(),pt.x+std::max(0,dMax)+m+1);
+    const int y0=std::max(0,pt.y-m), y1=std::min(im1.height(),pt.y+m+1);
+    const int w=x1-x0, h=y1-y0, xp=pt.x-x0, yp=pt.y-y0;
+    Image c1=im1.view(x0,y0,w,h), c2=im2.view(x0,y0,w,h);
 
-    Image* cost = costVolume(im1, im2, dMin, dMax, param);
+    std::vector<int> rowLo(h,dMax+1), rowHi(h,dMin-1); // Only rows of window
+    for(int y=std::max(0,yp-R); y<=std::min(h-1,yp+R); y++) {
+        rowLo[y] = dMin;
+        rowHi[y] = dMax;
+    }
+    CostRows<float>* rows = newCostRows<float>(c1, c2, param);
+    CostVolume* cost = costVolume(*rows, w, h, dMin, dMax,
+                                  &rowLo[0], &rowHi[0]);
+    delete rows;
 
-    // Images of dissimilarity 1->2 and 2->1
-    Image E1(width,height), E2(width,height);
-    std::fill_n(&E1(0,0), width*height, std::numeric_limits<float>::max());
-    std::fill_n(&E2(0,0), width*height, std::numeric_limits<float>::max());
+    const int dim=2*r+1;
+    std::vector<float> windows(2*dim*dim);
+    Image W1(&windows[0], dim, dim), W2(&windows[dim*dim], dim, dim);
+    support(c1, xp,yp, r,s, distC, W1);
+    const float den1 = Comb::hoisted?
+        premultiply(W1, xp,yp, r,s, w,h, distP): 0;
+    float best = std::numeric_limits<float>::max();
+    for(int d=dMin; d<=dMax; d++)
+        if(0<=xp+d && xp+d<w) {
+            if(! Comb::left)
+                support(c2, xp+d,yp, r,s, distC, W2);
+            const float E = costCombined<Comb,0>(xp, xp+d, yp, r,s,
+                                               &W1(0,0), &W2(0,0), distP,
+                                               *cost, d, den1, param.fastSum);
+            pt.cost[d-dMin] = E;
+            if(E < best) {
+                best = E;
+                pt.disparity = static_cast<float>(d);
+            }
+        }
+    if(param.subpixel && is_number(pt.disparity)) {
+        const int d = static_cast<int>(pt.disparity);
+        if(dMin<d && d<dMax &&
+           is_number(pt.cost[d-1-dMin]) && is_number(pt.cost[d+1-dMin]))
+            pt.disparity = subpixel(d, pt.cost[d-1-dMin], best,
+                                    pt.cost[d+1-dMin]);
+    }
+    delete cost;
+}
 
+/// Query points with combination of weights \a Comb, in parallel.
+template <class Comb>
+static void queryPoints(const Image& im1, const Image& im2,
+                        int dMin, int dMax, const ParamDisparity& param,
+                        float* distC, const float* distP,
+                        std::vector<PointDisparity>& points) {
+    const int n = static_cast<int>(points.size());
 #ifdef _OPENMP
-#pragma omp parallel for
+#pragma omp parallel for schedule(dynamic)
 #endif
-    for(int y=0; y<height; y++) {
-        // Weight window in reference image
-        Image W1(dim,dim);
-        // Weight windows in target image for each disparity (useless for
-        // COMB_LEFT, but better to have readable code than multiplying #ifdef)
-        Image* weights2 = new Image[nd];
-        for(int d=0; d<nd; d++) {
-            weights2[d] = Image(dim,dim);
-            if(d+1<nd) // Support for dMax computed later
-                support(im2, d,y, r, distC, weights2[d]);
-        }
-
-        for(int x=0; x<width; x++) {
-            // Reference window weights
-            support(im1, x,y, r, distC, W1);
-#ifndef COMB_LEFT // Weight window at disparity dMax in target image
-            support(im2, x+dMax,y, r, distC, weights2[(x+dMax-dMin)%nd]);
+    for(int i=0; i<n; i++)
+        queryPoint<Comb>(im1, im2, dMin, dMax, param, distC, distP,
+                         points[i]);
+}
+
+/// Adaptive Weights disparity of a list of pixels of image 1.
+///
+/// For each point, the aggregated cost at each disparity of [dMin,dMax] is
+/// put in its cost curve (NaN if the matched pixel is outside image 2), and
+/// the disparity of minimum cost is its disparity (NaN if none). No cost
+/// volume of the images is built: the raw costs are computed only in the
+/// window of each point, making the time proportional to the number of
+/// points. The results are those of disparityAW. Options of storage,
+/// tiling and precomputation of the whole images in \a param are not used.
+void disparityPoints(Image im1, Image im2,
+                     int dMin, int dMax, const ParamDisparity& param,
+                     std::vector<PointDisparity>& points) {
+    if(param.intCost && !(is_8bit(im1) && is_8bit(im2))) {
+        std::cerr << "Warning: images are not 8-bit, "
+                  << "using float raw cost" << std::endl;
+        ParamDisparity p(param);
+        p.intCost = false;
+        disparityPoints(im1, im2, dMin, dMax, p, points);
+        return;
+    }
+    float* distC = colorWeights(im1.channels(), param);
+    float* distP = spatialWeights(param);
+    switch(param.comb) {
+    case ParamDisparity::CombineLeft:
+        queryPoints<CombLeft>(im1,im2, dMin,dMax, param, distC,distP, points);
+        break;
+    case ParamDisparity::CombineMax:
+        queryPoints<CombMax>(im1,im2, dMin,dMax, param, distC,distP, points);
+        break;
+    case ParamDisparity::CombineMin:
+        queryPoints<CombMin>(im1,im2, dMin,dMax, param, distC,distP, points);
+        break;
+    case ParamDisparity::CombineMult:
+        queryPoints<CombMult>(im1,im2, dMin,dMax, param, distC,distP, points);
+        break;
+    case ParamDisparity::CombinePlus:
+        queryPoints<CombPlus>(im1,im2, dMin,dMax, param, distC,distP, points);
+        break;
+    }
+    delete [] distC;
+    delete [] distP;
+}
+
+/// Pseudo-random integer in [0,n) from seeds \a a and \a b. It depends only
+/// on the seeds, so that results do not depend on the number of threads.
+static int pmRandom(unsigned int a, unsigned int b, int n) {
+    unsigned int h = a*73856093u ^ b*19349663u;
+    h ^= h>>13;
+    h *= 0x5bd1e995u;
+    h ^= h>>15;
+    return static_cast<int>(h % static_cast<unsigned int>(n));
+}
+
+/// Cache of support windows of pixels of an image.
+///
+/// The window of (x,y) is in slot x%slots, recomputed only if the slot holds
+/// another pixel. With one slot per column, the windows of a row are computed
+/// at most once while the row is processed. If \a premul, windows are
+/// multiplied by the spatial weights, as for Comb::hoisted.
+class PMWindows {
+public:
+    PMWindows(const Image& im, int slots, int r, int s,
+              float* distC, const float* distP, bool premul);
+    const float* get(int x, int y, float& den);
+private:
+    const Image& im;
+    int r, s, dim;
+    float* distC;
+    const float* distP;
+    bool premul;
+    std::vector<float> buf;      ///< Windows of slots
+    std::vector<int> xs, ys;     ///< Pixel of each slot, -1 if none
+    std::vector<float> sums;     ///< Sum of premultiplied weights of slots
+};
+
+/// Constructor, with \a slots empty slots.
+PMWindows::PMWindows(const Image& image, int slots, int radius, int step,
+                     float* dC, const float* dP, bool pre)
+: im(image), r(radius), s(step), dim(2*radius+1), distC(dC), distP(dP),
+  premul(pre), buf(static_cast<size_t>(slots)*dim*dim),
+  xs(slots,-1), ys(slots,-1), sums(slots,0) {}
+
+/// Window of pixel (x,y), with \a den the sum of its premultiplied weights.
+const float* PMWindows::get(int x, int y, float& den) {
+    const int k = x % static_cast<int>(xs.size());
+    float* w = &buf[static_cast<size_t>(k)*dim*dim];
+    if(xs[k]!=x || ys[k]!=y) {
+        Image W(w, dim, dim);
+        support(im, x,y, r,s, distC, W);
+        sums[k] = premul?
+            premultiply(W, x,y, r,s, im.width(),im.height(), distP): 0;
+        xs[k] = x;
+        ys[k] = y;
+    }
+    den = sums[k];
+    return w;
+}
+
+/// PatchMatch search of the disparities of the pixels of one image.
+///
+/// The aggregated cost of matching p in image 1 to p+d in image 2 is the one
+/// of disparityAW. Instead of testing all disparities, each pixel tests at
+/// each iteration only the disparities of its neighbors, propagated in
+/// raster order (reverse order at odd iterations), and random disparities at
+/// exponentially decreasing distances of its current one (Bleyer et al.,
+/// PatchMatch stereo, BMVC 2011, in fronto-parallel version). Rows are
+/// processed in parallel: propagation along the row uses the current
+/// iteration, vertical propagation the previous one. The windows of the
+/// matched pixels are cached for the row, so that each one is computed once,
+/// as in disparityAW.
+template <class Comb, typename T>
+class PatchMatch {
+public:
+    PatchMatch(const Image& im1_, const Image& im2_, int dMin_, int dMax_,
+               const ParamDisparity& param_,
+               float* distC_, const float* distP_, const CostVolumeT<T>& cost_)
+    : im1(im1_), im2(im2_), dMin(dMin_), dMax(dMax_),
+      s(param_.stride), r(param_.radius/param_.stride), param(param_),
+      distC(distC_), distP(distP_), cost(cost_) {}
+    void run(bool right, Image& disp);
+private:
+    const Image &im1, &im2;
+    int dMin, dMax;
+    int s, r; ///< Step and radius in taps of windows
+    const ParamDisparity& param;
+    float* distC;
+    const float* distP;
+    const CostVolumeT<T>& cost;
+    float eval(int xp, int y, int d, PMWindows& win1, PMWindows& win2) const;
+    void range(bool right, int x, int& lo, int& hi) const;
+};
+
+/// Aggregated cost of pixel (xp,y) of image 1 at disparity \a d.
+template <class Comb, typename T>
+float PatchMatch<Comb,T>::eval(int xp, int y, int d,
+                               PMWindows& win1, PMWindows& win2) const {
+    float den1, den2;
+    const float* w1 = win1.get(xp, y, den1);
+    const float* w2 = Comb::left? w1: win2.get(xp+d, y, den2);
+    return costCombined<Comb,0>(xp, xp+d, y, r,s, w1, w2, distP, cost, d,
+                              den1, param.fastSum);
+}
+
+/// Disparities [lo,hi] of pixel \a x matched inside the other image.
+template <class Comb, typename T>
+void PatchMatch<Comb,T>::range(bool right, int x, int& lo, int& hi) const {
+    const int w=im1.width();
+    lo = right? std::max(dMin,x-w+1): std::max(dMin,-x);
+    hi = right? std::min(dMax,x): std::min(dMax,w-1-x);
+}
+
+/// Disparity map \a disp of image 1, or of image 2 if \a right.
+///
+/// Pixel x of image 2 at disparity d is matched to x-d in image 1, and \a disp
+/// is then -d, as in disparityAW. Pixels with no match inside the other image
+/// are not modified.
+template <class Comb, typename T>
+void PatchMatch<Comb,T>::run(bool right, Image& disp) {
+    const int w=im1.width(), h=im1.height();
+    Image D(w,h), E(w,h); // Current disparities and their costs
+    Image prev; // Disparities at previous iteration
+#ifdef _OPENMP
+#pragma omp parallel
 #endif
-            for(int d=dMin; d<=dMax; d++) {
-                if(0<=x+d && x+d<width) {
-                    const Image& e = cost[d-dMin]; // Raw cost for disp. d
-                    const Image& W2 = weights2[(x+d-dMin)%nd];
-                    float E = costCombined(x, x+d, y, r, W1, W2, distP, e);
-                    if(E1(x,y) > E) {
-                        E1(x,y) = E;
-                        disp1(x,y) = static_cast<float>(d);
+    { // Windows of the pixel in one image, of the matched pixels in the other
+    PMWindows win1(im1, right? w: 1, r,s, distC,distP, Comb::hoisted);
+    PMWindows win2(im2, right? 1: w, r,s, distC,distP, false);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for(int y=0; y<h; y++) { // Random initialization
+        for(int x=0; x<w; x++) {
+            int lo, hi;
+            range(right, x, lo, hi);
+            if(lo > hi) {
+                D(x,y) = static_cast<float>(dMin-1);
+                continue;
+            }
+            const int d = lo+pmRandom(y*w+x, 0, hi-lo+1);
+            D(x,y) = static_cast<float>(d);
+            E(x,y) = eval(right? x-d: x, y, d, win1, win2);
+        }
+    }
+    for(int it=0; it<param.pmIterations; it++) {
+        const int dir = (it%2==0)? 1: -1; // Propagation direction
+#ifdef _OPENMP
+#pragma omp single
+#endif
+        prev = D.clone();
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for(int y=0; y<h; y++) {
+            for(int i=0; i<w; i++) {
+                const int x = (dir>0)? i: w-1-i;
+                int lo, hi;
+                range(right, x, lo, hi);
+                if(lo > hi)
+                    continue;
+                int cand[2]={dMin-1,dMin-1}; // Propagated candidates
+                if(0<=x-dir && x-dir<w)
+                    cand[0] = static_cast<int>(D(x-dir,y));
+                if(0<=y-dir && y-dir<h)
+                    cand[1] = static_cast<int>(prev(x,y-dir));
+                for(int k=0; k<2; k++) {
+                    const int d = cand[k];
+                    if(lo<=d && d<=hi && d!=static_cast<int>(D(x,y))) {
+                        const float e = eval(right? x-d: x, y, d, win1, win2);
+                        if(e < E(x,y)) {
+                            E(x,y) = e;
+                            D(x,y) = static_cast<float>(d);
+                        }
                     }
-                    if(E2(x+d,y) > E) {
-                        E2(x+d,y) = E;
-                        disp2(x+d,y)= -static_cast<float>(d);
+                }
+                // Random search around current disparity
+                for(int k=1, R=hi-lo; R>0; k++, R/=2) {
+                    const int d0 = static_cast<int>(D(x,y));
+                    const int a=std::max(lo,d0-R), b=std::min(hi,d0+R);
+                    const int d = a+pmRandom(y*w+x, it*32+k, b-a+1);
+                    if(d == d0)
+                        continue;
+                    const float e = eval(right? x-d: x, y, d, win1, win2);
+                    if(e < E(x,y)) {
+                        E(x,y) = e;
+                        D(x,y) = static_cast<float>(d);
                     }
                 }
             }
         }
-        delete [] weights2;
     }
-    delete [] cost;
+    }
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            if(D(x,y) >= static_cast<float>(dMin))
+                disp(x,y) = right? -D(x,y): D(x,y);
+}
+
+/// PatchMatch of both images with combination of weights \a Comb.
+template <class Comb>
+static void patchMatchComb(const Image& im1, const Image& im2,
+                           int dMin, int dMax, const ParamDisparity& param,
+                           float* distC, const float* distP,
+                           Image& disp1, Image& disp2) {
+    const int width=im1.width(), height=im1.height();
+    if(param.cost16) {
+        CostRows<unsigned short>* rows =
+            newCostRows<unsigned short>(im1, im2, param);
+        CostVolume16* cost = costVolume(*rows, width, height, dMin, dMax,
+                                        0, 0, param.costPages);
+        delete rows;
+        PatchMatch<Comb,unsigned short> pm(im1, im2, dMin, dMax, param,
+                                           distC, distP, *cost);
+        pm.run(false, disp1);
+        if(! param.leftOnly)
+            pm.run(true, disp2);
+        delete cost;
+    } else {
+        CostRows<float>* rows = newCostRows<float>(im1, im2, param);
+        CostVolume* cost = costVolume(*rows, width, height, dMin, dMax,
+                                      0, 0, param.costPages);
+        delete rows;
+        PatchMatch<Comb,float> pm(im1, im2, dMin, dMax, param,
+                                  distC, distP, *cost);
+        pm.run(false, disp1);
+        if(! param.leftOnly)
+            pm.run(true, disp2);
+        delete cost;
+    }
+}
+
+/// Adaptive Weights disparity computation by PatchMatch search.
+///
+/// The aggregated costs are those of disparityAW, but each pixel tests only
+/// about 2+log2(dMax-dMin) disparities per iteration, see PatchMatch, during
+/// \a param.pmIterations iterations. The aggregation time is thus almost
+/// independent of the disparity range, the raw cost volume being still
+/// computed for all disparities. Options of tiling, rolling volume and
+/// precomputed windows in \a param are not used.
+/// \param im1,im2 the two color images
+/// \param dMin,dMax disparity range
+/// \param param raw cost computation parameters
+/// \param disp1 output disparity map from image 1 to image 2
+/// \param disp2 output disparity map from image 2 to image 1
+void disparityPatchMatch(Image im1, Image im2,
+                         int dMin, int dMax, const ParamDisparity& param,
+                         Image& disp1, Image& disp2) {
+    if(param.intCost && !(is_8bit(im1) && is_8bit(im2))) {
+        std::cerr << "Warning: images are not 8-bit, "
+                  << "using float raw cost" << std::endl;
+        ParamDisparity p(param);
+        p.intCost = false;
+        disparityPatchMatch(im1, im2, dMin, dMax, p, disp1, disp2);
+        return;
+    }
+    float* distC = colorWeights(im1.channels(), param);
+    float* distP = spatialWeights(param);
+    switch(param.comb) {
+    case ParamDisparity::CombineLeft:
+        patchMatchComb<CombLeft>(im1,im2, dMin,dMax, param, distC,distP,
+                                 disp1,disp2);
+        break;
+    case ParamDisparity::CombineMax:
+        patchMatchComb<CombMax>(im1,im2, dMin,dMax, param, distC,distP,
+                                disp1,disp2);
+        break;
+    case ParamDisparity::CombineMin:
+        patchMatchComb<CombMin>(im1,im2, dMin,dMax, param, distC,distP,
+                                disp1,disp2);
+        break;
+    case ParamDisparity::CombineMult:
+        patchMatchComb<CombMult>(im1,im2, dMin,dMax, param, distC,distP,
+                                 disp1,disp2);
+        break;
+    case ParamDisparity::CombinePlus:
+        patchMatchComb<CombPlus>(im1,im2, dMin,dMax, param, distC,distP,
+                                 disp1,disp2);
+        break;
+    }
     delete [] distC;
     delete [] distP;
 }
+
+/// Per-pixel range at full resolution from disparity map \a coarse at half
+/// resolution.
+///
+/// The range of (x,y) is the interval of doubled disparities in the 3x3
+/// neighborhood of (x/2,y/2), enlarged by \a band. Where the neighborhood has
+/// no valid disparity (below \a cMin), the range is [dMin,dMax].
+static void upsampleRange(const Image& coarse, int cMin,
+                          int dMin, int dMax, int band, Image& lo, Image& hi) {
+    const int w=coarse.width(), h=coarse.height();
+    for(int y=0; y<lo.height(); y++)
+        for(int x=0; x<lo.width(); x++) {
+            float a=std::numeric_limits<float>::max(), b=-a;
+            for(int j=std::max(0,y/2-1); j<=std::min(h-1,y/2+1); j++)
+                for(int i=std::max(0,x/2-1); i<=std::min(w-1,x/2+1); i++) {
+                    const float v = coarse(i,j);
+                    if(v >= cMin) {
+                        a = std::min(a,v);
+                        b = std::max(b,v);
+                    }
+                }
+            if(a > b) { // No valid coarse disparity
+                lo(x,y) = static_cast<float>(dMin);
+                hi(x,y) = static_cast<float>(dMax);
+            } else {
+                lo(x,y) = std::max(static_cast<float>(dMin), 2*a-band);
+                hi(x,y) = std::min(static_cast<float>(dMax), 2*b+band);
+            }
+        }
+}
+
+/// Level of disparityPyramid on images reduced by \a factor, calling
+/// \a level with its maps if it is not the finest one.
+static void pyramidLevel(Image im1, Image im2,
+                         int dMin, int dMax, const ParamDisparity& param,
+                         int levels, int band, Image& disp1, Image& disp2,
+                         Image* conf, Image* occ, Candidates* top,
+                         int factor, LevelCallback level, void* data) {
+    if(levels<=1 || im1.width()<2 || im1.height()<2) {
+        disparityAW(im1, im2, dMin, dMax, param, disp1, disp2, conf, occ,
+                    top);
+        return;
+    }
+    Image c1=im1.reduce(2), c2=im2.reduce(2);
+    // Coarse range, rounded outwards
+    const int cMin = (dMin>=0)? dMin/2: -((1-dMin)/2);
+    const int cMax = (dMax>=0)? (dMax+1)/2: -((-dMax)/2);
+    ParamDisparity p(param);
+    p.radius = std::max(1, param.radius/2);
+    p.stride = std::max(1, param.stride/2);
+    p.gammaPos = param.gammaPos/2;
+    p.intCost = false; // Averaged images are not 8-bit
+    p.leftOnly = true; // Only cDisp1 is used
+    Image cDisp1(c1.width(),c1.height()), cDisp2(c1.width(),c1.height());
+    cDisp1.fill(static_cast<float>(cMin-1));
+    cDisp2.fill(static_cast<float>(cMin-1));
+    pyramidLevel(c1, c2, cMin, cMax, p, levels-1, band, cDisp1, cDisp2,
+                 0, 0, 0, 2*factor, level, data);
+    if(level)
+        level(cDisp1, 2*factor, cMin, data);
+
+    Image lo(im1.width(),im1.height()), hi(im1.width(),im1.height());
+    upsampleRange(cDisp1, cMin, dMin, dMax, band, lo, hi);
+    disparityAW(im1, im2, dMin, dMax, param, lo, hi, disp1, disp2, conf,
+                occ, top);
+}
+
+/// Coarse to fine Adaptive Weights disparity computation.
+///
+/// With \a levels>1, the images are reduced by a factor 2 and the disparity
+/// maps computed recursively at the coarse scale, with halved range, radius
+/// and spatial gamma. At full resolution, each pixel is then tested only in a
+/// band of \a band pixels around the upsampled coarse disparities, see
+/// upsampleRange(). Only the coarsest level explores the whole range.
+/// \param im1,im2 the two color images
+/// \param dMin,dMax disparity range
+/// \param param raw cost computation parameters
+/// \param levels number of levels of the pyramid, 1 for disparityAW
+/// \param band half-width of search range around coarse disparities
+/// \param disp1 output disparity map from image 1 to image 2
+/// \param disp2 output disparity map from image 2 to image 1
+/// \param conf if not 0, output confidence map of image 1 at full resolution
+/// \param occ if not 0, output disp1 masked by left-right check, see
+/// disparityAW
+/// \param top if not 0, output candidates at full resolution, in the band
+/// \param level if not 0, called with \a data after each coarse level, from
+/// the coarsest one, for previews
+void disparityPyramid(Image im1, Image im2,
+                      int dMin, int dMax, const ParamDisparity& param,
+                      int levels, int band, Image& disp1, Image& disp2,
+                      Image* conf, Image* occ, Candidates* top,
+                      LevelCallback level, void* data) {
+    pyramidLevel(im1, im2, dMin, dMax, param, levels, band, disp1, disp2,
+                 conf, occ, top, 1, level, data);
+}
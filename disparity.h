@@ -19,16 +19,71 @@
 #ifndef DISPARITY_H
 #define DISPARITY_H
 
-class Image;
+#include "costVolume.h"
+#include <string>
+#include <vector>
+#include "image.h"
+class OcclusionMask;
+class SupportTensor;
 
 /// Parameters specific to the disparity computation with adaptive weights
 struct ParamDisparity {
+    /// Raw matching cost between pixels
+    enum RawCost {
+        CostADGrad,   ///< Truncated AD of colors and gradients (reference)
+        CostCensus,   ///< Hamming distance of census transforms
+        CostADCensus, ///< Robust combination of AD of colors and census
+        CostRank      ///< Difference of rank transforms
+    };
+
+    /// Combination of weights of p and q in aggregation
+    enum Combination {
+        CombineLeft, ///< Weight of p only
+        CombineMax,  ///< Max of weights
+        CombineMin,  ///< Min of weights
+        CombineMult, ///< Product of weights
+        CombinePlus  ///< Sum of weights
+    };
+
     float tauCol;   ///< Max cost for color difference term
     float tauGrad;  ///< Max cost for gradient difference term
     float alpha;    ///< Balance between color/gradient difference
     float gammaCol; ///< Weight of color similarity (higher means less weight)
     float gammaPos; ///< Weight for position (higher means less weight)
     int radius;     ///< Radius r of window, size is (2*r+1)x(2*r+1)
+    int stride;     ///< Step between sampled pixels of window
+    RawCost rawCost; ///< Raw matching cost
+    Combination comb; ///< Combination of weights
+    bool cost16;    ///< Store raw costs on 16 bits (fixed point)
+    bool rolling;   ///< Keep only 2r+1 rows of costs per thread
+    bool intCost;   ///< Raw cost in integer arithmetic (8-bit images)
+    bool fastSum;   ///< Vectorized aggregation (not bit-exact)
+    bool intSum;    ///< Aggregation in fixed point, 16-bit costs (not exact)
+    bool dispSum;   ///< Vectorized over disparities, costs by pixel (exact)
+    bool offsetSum; ///< Aggregation by window offset over rows (exact)
+    bool prune;     ///< Stop sums of disparities that cannot win (exact)
+    int cascade;    ///< Disparities aggregated after screening, 0 for all
+    float sparse;   ///< Min weight of the taps summed, 0 for all
+    float adaptRadius; ///< Gradient halving the radius of a pixel, 0: fixed
+    int dispChunk;  ///< Disparities of a cost volume, 0 for all
+    bool weightTensor; ///< Precompute support windows of all pixels
+    bool expWeights; ///< Color weights by exp approximation, not table
+    bool subpixel;  ///< Refine disparity of image 1 by parabola fit
+    int tileWidth;  ///< Width of tiles for aggregation, 0 for automatic
+    int tileHeight; ///< Height of tiles for aggregation, 0 for automatic
+    float sgmP1;    ///< SGM penalty of disparity change 1, ratio of max cost
+    float sgmP2;    ///< SGM penalty of larger disparity change, idem
+    int sgmPaths;   ///< Number of SGM path directions, 4 or 8
+    int pmIterations; ///< Number of PatchMatch iterations
+    std::string costCache; ///< Directory of cached cost volumes, none if empty
+    std::string costScratch; ///< Directory of scratch file of volume, or none
+    CostPages costPages; ///< Memory pages of cost volumes
+    bool firstTouch; ///< Costs computed by the threads aggregating them (NUMA)
+    int tolDisp;    ///< Tolerance of left-right check fused in disparityAW
+    bool leftOnly;  ///< No disparity map of image 2, left untouched
+    bool rightWeights; ///< Map of image 2 with its own weights (CombineLeft)
+    int offsetY;    ///< Row y of image 1 matched with row y+offsetY of image 2
+    int searchY;    ///< Raw cost min over rows offsetY+[-searchY,searchY]
 
     // Constructor with default parameters
     ParamDisparity()
@@ -37,12 +92,143 @@ struct ParamDisparity {
       alpha(0.9f),
       gammaCol(12),
       gammaPos(17.5f),
-      radius(17) {}
+      radius(17),
+      stride(1),
+      rawCost(CostADGrad),
+      comb(CombineMult),
+      cost16(false),
+      rolling(false),
+      intCost(false),
+      fastSum(false),
+      intSum(false),
+      dispSum(false),
+      offsetSum(false),
+      prune(false),
+      cascade(0),
+      sparse(0),
+      adaptRadius(0),
+      dispChunk(0),
+      weightTensor(false),
+      expWeights(false),
+      subpixel(false),
+      tileWidth(0),
+      tileHeight(0),
+      sgmP1(0.2f),
+      sgmP2(1.0f),
+      sgmPaths(8),
+      pmIterations(3),
+      costPages(PagesNormal),
+      firstTouch(false),
+      tolDisp(0),
+      leftOnly(false),
+      rightWeights(false),
+      offsetY(0),
+      searchY(0) {
+#ifdef LOW_MEMORY // Profile of small devices, see CMakeLists.txt
+        cost16 = rolling = intCost = intSum = true;
+#endif
+    }
 
     bool check() const;
+    bool setRawCost(const std::string& name);
+    bool setCombination(const std::string& name);
+    bool setCostPages(const std::string& name);
+};
+
+/// Rectangle of pixels [x,x+w)x[y,y+h)
+struct Rect {
+    int x, y, w, h;
+    Rect(int x0=0, int y0=0, int width=0, int height=0)
+    : x(x0), y(y0), w(width), h(height) {}
+};
+
+/// Query point for disparityPoints, with its results
+struct PointDisparity {
+    int x, y;              ///< Pixel in image 1
+    float disparity;       ///< Disparity of min cost, NaN if none
+    std::vector<float> cost; ///< Aggregated cost at each disparity (or NaN)
 };
 
+/// Best disparities of the pixels of image 1, with their aggregated costs,
+/// for refinement stages needing a few candidates instead of the whole curve.
+///
+/// Channel i of both images, of the size of image 1, holds the candidate of
+/// rank i in increasing order of cost, ties in increasing disparity, NaN where
+/// the pixel has fewer candidates. The number k of channels is chosen by the
+/// caller.
+struct Candidates {
+    Image disp; ///< Disparities of the candidates
+    Image cost; ///< Their aggregated costs
+    Candidates() {}
+    Candidates(int w, int h, int k): disp(w,h,k), cost(w,h,k) {}
+    int k() const { return disp.channels(); } ///< Candidates per pixel
+};
+
+/// Raw cost volume and support windows of a pair, kept by disparityAW for
+/// the next aggregations of the same pair with other support parameters.
+///
+/// The volume is reused while the images, the range and the parameters of the
+/// raw cost (tauCol, tauGrad, alpha, rawCost, intCost, cost16, offsetY,
+/// searchY) do not change, so that only aggregation is redone for other
+/// gammaCol, gammaPos or radius.
+/// With weightTensor, the color distances of the windows are also kept while
+/// the radius and the stride do not change, only the table of weights of
+/// gammaCol being recomputed; those of image 1 are kept even for another
+/// image 2, as for several target cameras of one reference. The images are
+/// held, not copied.
+class SharedCosts {
+public:
+    SharedCosts();
+    ~SharedCosts() { clear(); }
+    void clear();
+private:
+    Image im1, im2;        ///< Images of the costs
+    int dMin, dMax;        ///< Disparity range
+    ParamDisparity param;  ///< Raw cost and support parameters
+    CostVolume* costs;     ///< Float volume, or 0
+    CostVolume16* costs16; ///< Quantized volume, or 0
+    SupportTensor *tensor1, *tensor2; ///< Windows of weightTensor, or 0
+    void update(const Image& im1, const Image& im2, int dMin, int dMax,
+                const ParamDisparity& param);
+    friend void disparityAW(Image, Image, int, int, const ParamDisparity&,
+                            SharedCosts&, Image&, Image&, Image*, Image*,
+                            Candidates*);
+    SharedCosts(const SharedCosts&);            ///< Forbidden
+    SharedCosts& operator=(const SharedCosts&); ///< Forbidden
+};
+
+void disparityAW(Image im1, Image im2, int dMin, int dMax,
+                 const ParamDisparity& param, Image& disp1, Image& disp2,
+                 Image* conf=0, Image* occ=0, Candidates* top=0);
+void disparityAW(Image im1, Image im2, int dMin, int dMax,
+                 const ParamDisparity& param, SharedCosts& shared,
+                 Image& disp1, Image& disp2, Image* conf=0, Image* occ=0,
+                 Candidates* top=0);
+void disparityPoints(Image im1, Image im2, int dMin, int dMax,
+                     const ParamDisparity& param,
+                     std::vector<PointDisparity>& points);
+void disparityAW_roi(Image im1, Image im2, const Rect& roi,
+                     int dMin, int dMax, const ParamDisparity& param,
+                     Image& disp1, Image& disp2);
 void disparityAW(Image im1, Image im2, int dMin, int dMax,
-                 const ParamDisparity& param, Image& disp1, Image& disp2);
+                 const ParamDisparity& param,
+                 const Image& rangeLo, const Image& rangeHi,
+                 Image& disp1, Image& disp2, Image* conf=0, Image* occ=0,
+                 Candidates* top=0);
+void disparityPatchMatch(Image im1, Image im2, int dMin, int dMax,
+                         const ParamDisparity& param,
+                         Image& disp1, Image& disp2);
+/// Callback of disparityPyramid at each coarse level: map \a disp of image 1
+/// on images reduced by \a factor, invalid below \a dMin
+typedef void (*LevelCallback)(const Image& disp, int factor, int dMin,
+                              void* data);
+void disparityPyramid(Image im1, Image im2, int dMin, int dMax,
+                      const ParamDisparity& param, int levels, int band,
+                      Image& disp1, Image& disp2, Image* conf=0,
+                      Image* occ=0, Candidates* top=0,
+                      LevelCallback level=0, void* data=0);
+void fillOcclusionAW(Image& disparity, const Image& im,
+                     const OcclusionMask& mask, int dMin, int dMax,
+                     const ParamDisparity& param);
 
 #endif
@@ -0,0 +1,913 @@
+/**
+ * @file engine.cpp
+ * @brief Whole chain of disparity computation, reusable from pair to pair
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "engine.h"
+#include "bilateralGrid.h"
+#include "guidedFilter.h"
+#include "gpu.h"
+#include "crossSupport.h"
+#include "sgm.h"
+#include "rawCost.h"
+#include "parallel.h"
+#include "timing.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/// Set aggregation method from its \a name.
+bool ParamStereo::setAggregation(const std::string& name) {
+    if(name == "aw")
+        aggreg = AggregAW;
+    else if(name == "pm")
+        aggreg = AggregPM;
+    else if(name == "gf")
+        aggreg = AggregGF;
+    else if(name == "bg")
+        aggreg = AggregBG;
+    else if(name == "cross")
+        aggreg = AggregCross;
+    else if(name == "sgm")
+        aggreg = AggregSGM;
+    else {
+        std::cerr << "Error: unknown aggregation " << name
+                  << " (should be aw, pm, gf, bg, cross or sgm)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Set CPUs from \a list of numbers and ranges, as 0-3,8.
+bool ParamStereo::setCpus(const std::string& list) {
+    cpus.clear();
+    std::istringstream str(list);
+    std::string item;
+    while(std::getline(str, item, ',')) {
+        int first=-1, last=-1;
+        char c=0;
+        std::istringstream in(item);
+        if(!(in>>first) || first<0 ||
+           (!in.eof() && !((in>>c>>last) && in.eof() && c=='-' &&
+                           first<=last))) {
+            std::cerr << "Error: CPUs should be a list of numbers and ranges"
+                      << ", as 0-3,8" << std::endl;
+            cpus.clear();
+            return false;
+        }
+        for(int i=first; i<=std::max(first,last); i++)
+            cpus.push_back(i);
+    }
+    return !cpus.empty();
+}
+
+/// Estimated peak memory in bytes of the maps of a pair of size \a w x \a h
+/// and range [\a dMin,\a dMax], images and densification included.
+///
+/// The main terms are the raw cost volume (full, rolling rows per thread,
+/// quantized), the support tensors, the weight windows of each thread, the
+/// tiles of the map of image 2 and the per-method buffers. With levels, the
+/// finest level is counted with the full range, an upper bound. With scale,
+/// the reduced pair is counted, plus the images and maps at full resolution.
+size_t ParamStereo::memory(int w, int h, int dMin, int dMax) const {
+    const int nThreads = (threads>0)? threads: parallelThreads();
+    const ParamDisparity& d = disparity;
+    const size_t T=nThreads, nd=dMax-dMin+1;
+    if(scale > 1) {
+        ParamStereo q(*this);
+        q.scale = 1;
+        q.lrCheck = false;
+        q.disparity.radius = std::max(1, d.radius/scale);
+        q.disparity.stride = std::max(1, d.stride/scale);
+        const size_t px=static_cast<size_t>(w)*h, f=sizeof(float);
+        const size_t dim=2*(d.radius/d.stride)+1;
+        size_t mem = q.memory((w+scale-1)/scale, (h+scale-1)/scale,
+                              dMin/scale-1, dMax/scale+1);
+        mem += (2*3 + 2 + confidence)*px*f + px/4; // Images, maps, edges
+        if(lrCheck && sense>=0 && sense<=1) // As below
+            mem += (denseRight? 2: 1)*(3*px*f + px) + T*dim*dim*f*8;
+        return mem;
+    }
+    size_t W=w, H=h;
+    if(roi.w > 0) { // Region of interest and its margins
+        W = std::min(W, static_cast<size_t>(roi.w+2*d.radius+nd));
+        H = std::min(H, static_cast<size_t>(roi.h+2*d.radius));
+    }
+    const size_t px=static_cast<size_t>(w)*h, pxRoi=W*H, f=sizeof(float);
+    size_t mem = 2*3*px*f; // Images
+    mem += (2 + confidence + fusedCheck + 2*topK)*px*f; // Output maps
+    mem += 4*pxRoi*f; // Cost setup: gray levels or transforms, gradients
+    const size_t elem = (d.cost16||d.intSum)? 2: 4;
+    const size_t r=d.radius/d.stride, dim=2*r+1;
+    const size_t ndv = // Disparities of a volume, see aggregate()
+        (d.dispChunk>0 && !d.subpixel && !confidence && topK==0 &&
+         d.cascade==0 && d.costCache.empty())?
+        std::min(nd, static_cast<size_t>(d.dispChunk)): nd;
+    switch(aggreg) {
+    case AggregAW:
+        if(gpu) { // Host copies, raw and aggregated costs
+            mem += 2*pxRoi*nd*f + 2*3*pxRoi*f;
+            break;
+        }
+        if(d.rolling) {
+            const size_t rows = std::min(H, static_cast<size_t>(
+                (d.tileHeight>0? d.tileHeight: 32) + 2*d.radius));
+            mem += T*W*rows*ndv*elem;
+        } else if(d.costScratch.empty()) // Else pages of a file
+            mem += pxRoi*ndv*elem;
+        if(ndv < nd) // Maps of image 2 of a chunk
+            mem += 2*pxRoi*f;
+        if(d.weightTensor) // 2 bytes of distance per tap of half window
+            mem += (d.comb==ParamDisparity::CombineLeft? 1: 2)*pxRoi*
+                   (dim*dim+1);
+        mem += T*(nd+1)*dim*dim*(d.intSum? 6: 4); // Windows of each thread
+        if(d.dispSum || d.offsetSum) // Supports of rows of image 2
+            mem += T*W*dim*dim*f;
+        if(d.offsetSum) // Sums of a row of a tile
+            mem += T*2*W*nd*f;
+        mem += 4*pxRoi*f; // E1, E2 and the tiles of E2, disp2
+        break;
+    case AggregPM:
+        mem += pxRoi*nd*(d.cost16? 2: 4) + 2*px*f;
+        break;
+    case AggregGF: // Float volume, layers and filters of both images
+    case AggregBG:
+    case AggregCross:
+        mem += pxRoi*nd*f + 4*px*f + 2*16*px*f;
+        break;
+    case AggregSGM: { // Volume, pixel major copy and sums of paths
+        const size_t n=(nd+15)/16*16;
+        mem += px*nd*2 + px*n*2*(1+std::min<size_t>(d.sgmPaths, T));
+        break;
+    }
+    }
+    if(lrCheck && sense>=0 && sense<=1) // Guidance, mask, weighted median
+        mem += (denseRight? 2: 1)*(3*px*f + px) + T*dim*dim*f*8;
+    return mem;
+}
+
+/// Use \a threads OpenMP threads, on the CPUs of \a cpus if not empty.
+///
+/// If \a threads is 0, it is the number of CPUs, or the OpenMP default
+/// (OMP_NUM_THREADS, else all cores) without CPUs. The calling thread is
+/// restricted to all the CPUs, so that the threads it creates later (writer,
+/// loader) are too, and OpenMP thread i>0 is pinned to cpus[i mod n], the
+/// master one staying free among them. The setting applies to all parallel
+/// stages, which share the OpenMP threads. With another backend of
+/// parallelFor, it sets its number of threads, which are not pinned. Return
+/// false if the CPUs are not available, with a message.
+bool setThreads(int threads, const std::vector<int>& cpus) {
+    if(threads==0)
+        threads = static_cast<int>(cpus.size());
+#ifdef LOW_MEMORY // Threads of the profile of small devices, at most
+    if(threads == 0)
+        threads = std::min(parallelThreads(), LOW_MEMORY);
+#endif
+    setParallelThreads(threads);
+    if(cpus.empty())
+        return true;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(size_t i=0; i<cpus.size(); i++)
+        if(cpus[i] < CPU_SETSIZE)
+            CPU_SET(cpus[i], &set);
+    bool ok = (sched_setaffinity(0, sizeof(set), &set) == 0);
+#ifdef _OPENMP
+    if(ok) {
+#pragma omp parallel reduction(&&:ok)
+        {
+            const int t = omp_get_thread_num();
+            if(t > 0) {
+                cpu_set_t one;
+                CPU_ZERO(&one);
+                CPU_SET(cpus[t%cpus.size()], &one);
+                ok = (sched_setaffinity(0, sizeof(one), &one) == 0);
+            }
+        }
+    }
+#endif
+    if(! ok)
+        std::cerr << "Error: unable to bind threads to the CPUs" << std::endl;
+    return ok;
+#else
+    std::cerr << "Warning: CPU affinity is not available, CPUs ignored"
+              << std::endl;
+    return true;
+#endif
+}
+
+/// CPUs the calling thread can run on, as 0-3,8.
+static std::string threadCpus() {
+#ifdef __linux__
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) != 0)
+        return "?";
+    std::ostringstream str;
+    for(int i=0; i<CPU_SETSIZE; i++) {
+        if(! CPU_ISSET(i, &set))
+            continue;
+        int j=i;
+        while(j+1<CPU_SETSIZE && CPU_ISSET(j+1, &set))
+            j++;
+        if(str.tellp() > 0)
+            str << ',';
+        str << i;
+        if(j > i)
+            str << '-' << j;
+        i = j;
+    }
+    return str.str();
+#else
+    return "any";
+#endif
+}
+
+/// Print the layout of the threads: their number and the CPUs of each one.
+void printThreads(std::ostream& out) {
+#ifdef _OPENMP
+    std::vector<std::string> cpus(omp_get_max_threads());
+#pragma omp parallel
+    {
+        const int t = omp_get_thread_num();
+        if(t < static_cast<int>(cpus.size()))
+            cpus[t] = threadCpus();
+    }
+    out << "OpenMP threads: " << cpus.size() << ", processors: "
+        << omp_get_num_procs() << '\n';
+    for(size_t i=0; i<cpus.size(); i++)
+        out << "  thread " << i << ": CPUs " << cpus[i] << '\n';
+#else
+    out << parallelThreads() << " threads (" << parallelBackend()
+        << "): CPUs " << threadCpus() << '\n';
+#endif
+    out << std::flush;
+}
+
+/// Constructor. If \a recycle is set, the memory of the cost volume of a pair
+/// is kept for the next one.
+StereoEngine::StereoEngine(const ParamStereo& param, bool rec)
+: p(param), recycle(rec), own(true), checked(false), share(false),
+  preview(0), previewData(0),
+  dMin(0), dMax(0), searchMin(0), searchMax(0), coarse(0), device(0),
+  prevMin(0), prevMax(0) {
+    // Fused left-right check, only in adaptive weights on CPU
+    p.fusedCheck = p.fusedCheck && p.aggreg==ParamStereo::AggregAW && !p.gpu &&
+        p.roi.w==0 && p.lrCheck;
+    // Candidates, the same, at full resolution
+    if(p.aggreg!=ParamStereo::AggregAW || p.gpu || p.roi.w>0 || p.scale>1 ||
+       p.incremental>0)
+        p.topK = 0;
+    setDisparity(p.disparity);
+    if(p.threads>0 || !p.cpus.empty())
+        setThreads(p.threads, p.cpus);
+#ifdef LOW_MEMORY // Default threads bounded too, see setThreads
+    else
+        setThreads(0, p.cpus);
+#endif
+    if(recycle)
+        recycleCosts(true);
+    if(p.gpu)
+        device = new GpuPair;
+}
+
+/// Destructor, releasing the memory kept.
+StereoEngine::~StereoEngine() {
+    delete coarse;
+    delete device;
+    shared.clear();
+    if(recycle)
+        recycleCosts(false);
+}
+
+/// Change the parameters of disparity computation for the next pairs.
+void StereoEngine::setDisparity(const ParamDisparity& param) {
+    p.disparity = param;
+    prev1 = Image(); // Maps of previous pair obsolete
+    if(p.fusedCheck)
+        p.disparity.tolDisp = p.occlusion.tol_disp;
+}
+
+/// Maps of size \a w x \a h, reused if the size is unchanged.
+void StereoEngine::alloc(int w, int h) {
+    if(!own || disp1.width()!=w || disp1.height()!=h) {
+        disp1 = Image(w,h);
+        disp2 = Image(w,h);
+        own = true;
+    }
+    if(p.confidence && (conf.width()!=w || conf.height()!=h))
+        conf = Image(w,h);
+    if(p.fusedCheck && (fused.width()!=w || fused.height()!=h))
+        fused = Image(w,h);
+    if(p.topK>0 && (top.disp.width()!=w || top.disp.height()!=h ||
+                    top.k()!=p.topK))
+        top = Candidates(w,h,p.topK);
+}
+
+/// Quotient of \a a by \a s>0 rounded down.
+static int floorDiv(int a, int s) {
+    return (a>=0)? a/s: -((s-1-a)/s);
+}
+
+/// Reduction factor of the images in estimateRange
+static const int AUTO_SCALE=4;
+/// Fraction of checked pixels of a disparity for it to be in the range
+static const float AUTO_MIN_PIXELS=0.005f;
+/// Same for the range of a tile, see estimateTileRanges
+static const float AUTO_TILE_PIXELS=0.05f;
+/// Margin around the estimated range, in disparities of reduced images
+static const int AUTO_MARGIN=1;
+
+/// Disparity map \a d1 of pair \a im1, \a im2 reduced by factor AUTO_SCALE,
+/// of range [\a cMin,\a cMax] bounding the reduced [dMin,dMax], its pixels
+/// failing the left-right check of tolerance \a tolDisp at cMin-1. Return
+/// false for small images.
+///
+/// Adaptive weights run with the radius and gpos reduced in proportion.
+static bool coarseDisparity(const Image& im1, const Image& im2,
+                            const ParamDisparity& param, int tolDisp,
+                            int dMin, int dMax, Image& d1,
+                            int& cMin, int& cMax) {
+    const int s=AUTO_SCALE;
+    if(im1.width()<8*s || im1.height()<8*s)
+        return false;
+    ParamDisparity p(param);
+    p.radius = std::max(1, param.radius/s);
+    p.stride = std::max(1, param.stride/s);
+    p.gammaPos = param.gammaPos/s;
+    p.intCost = false; // Averaged images are not 8-bit
+    p.subpixel = false;
+    p.leftOnly = false; // For the left-right check
+    p.tolDisp = 0;
+    p.costCache.clear();
+    p.offsetY = floorDiv(param.offsetY+s/2, s);
+    p.searchY = -floorDiv(-param.searchY, s);
+    cMin=floorDiv(dMin,s); cMax=-floorDiv(-dMax,s);
+    const Image c1=im1.reduce(s), c2=im2.reduce(s);
+    d1 = Image(c1.width(),c1.height());
+    Image d2(c1.width(),c1.height());
+    d1.fill(static_cast<float>(cMin-1));
+    d2.fill(static_cast<float>(cMin-1));
+    disparityAW(c1, c2, cMin, cMax, p, d1, d2);
+    detect_occlusion(d1, d2, static_cast<float>(cMin-1), tolDisp);
+    return true;
+}
+
+/// Range [\a dMin,\a dMax] of the disparities of at least a fraction
+/// \a frac of the checked pixels of rectangle \a r of coarse map
+/// \a d1 of range [\a cMin,\a cMax], enlarged by AUTO_MARGIN and multiplied
+/// by AUTO_SCALE, intersected with the input range. Return false, the range
+/// being kept, if no disparity has enough pixels.
+static bool histoRange(const Image& d1, const Rect& r, int cMin, int cMax,
+                       float frac, int& dMin, int& dMax) {
+    std::vector<long> histo(cMax-cMin+1, 0);
+    long n=0;
+    for(int y=r.y; y<r.y+r.h; y++)
+        for(int x=r.x; x<r.x+r.w; x++) {
+            const float d = d1(x,y);
+            if(cMin<=d && d<=cMax) {
+                ++histo[static_cast<int>(d)-cMin];
+                ++n;
+            }
+        }
+    if(n == 0)
+        return false;
+    const long m = static_cast<long>(std::ceil(frac*n)); // >0
+    int lo=0, hi=cMax-cMin;
+    while(lo<=hi && histo[lo]<m) ++lo;
+    while(lo<=hi && histo[hi]<m) --hi;
+    if(lo > hi)
+        return false;
+    const int s=AUTO_SCALE;
+    dMin = std::max(dMin, s*(cMin+lo-AUTO_MARGIN));
+    dMax = std::min(dMax, s*(cMin+hi+AUTO_MARGIN));
+    return true;
+}
+
+/// Disparity range of pair \a im1, \a im2 estimated inside [dMin,dMax], for
+/// ParamStereo::autoRange.
+///
+/// The range is the one of the disparities of at least a fraction
+/// AUTO_MIN_PIXELS of the pixels of coarseDisparity() passing the left-right
+/// check, the others being scattered mismatches, see histoRange(). It stays
+/// [dMin,dMax] for small images or if no disparity has enough pixels.
+static void estimateRange(const Image& im1, const Image& im2,
+                          const ParamDisparity& param, int tolDisp,
+                          int& dMin, int& dMax) {
+    Image d1;
+    int cMin, cMax;
+    if(coarseDisparity(im1, im2, param, tolDisp, dMin, dMax, d1, cMin, cMax))
+        histoRange(d1, Rect(0,0,d1.width(),d1.height()), cMin, cMax,
+                   AUTO_MIN_PIXELS, dMin, dMax);
+}
+
+/// Per-pixel ranges \a lo, \a hi of pair \a im1, \a im2, constant on tiles
+/// of \a tile x \a tile pixels, for ParamStereo::rangeTile. The range of a
+/// tile is estimated as in estimateRange() on the pixels of the coarse map
+/// covering the tile and a margin of one coarse pixel, the whole image
+/// giving the range of tiles without enough checked pixels. [dMin,dMax],
+/// input bound, becomes the union of the ranges.
+static void estimateTileRanges(const Image& im1, const Image& im2,
+                               const ParamDisparity& param, int tolDisp,
+                               int tile, int& dMin, int& dMax,
+                               Image& lo, Image& hi) {
+    const int w=im1.width(), h=im1.height(), s=AUTO_SCALE;
+    lo = Image(w,h);
+    hi = Image(w,h);
+    Image d1;
+    int cMin, cMax;
+    if(! coarseDisparity(im1,im2, param, tolDisp, dMin,dMax, d1, cMin,cMax)) {
+        lo.fill(static_cast<float>(dMin));
+        hi.fill(static_cast<float>(dMax));
+        return;
+    }
+    const int cw=d1.width(), ch=d1.height();
+    int gMin=dMin, gMax=dMax; // Range of the whole image
+    histoRange(d1, Rect(0,0,cw,ch), cMin,cMax, AUTO_MIN_PIXELS, gMin,gMax);
+    int uMin=dMax+1, uMax=dMin-1; // Union of tile ranges
+    for(int y0=0; y0<h; y0+=tile)
+        for(int x0=0; x0<w; x0+=tile) {
+            const int x1=std::min(w,x0+tile), y1=std::min(h,y0+tile);
+            Rect r(std::max(0,x0/s-1), std::max(0,y0/s-1));
+            r.w = std::min(cw,(x1-1)/s+2)-r.x;
+            r.h = std::min(ch,(y1-1)/s+2)-r.y;
+            int tMin=gMin, tMax=gMax;
+            if(! histoRange(d1, r, cMin, cMax, AUTO_TILE_PIXELS, tMin,tMax)) {
+                tMin = gMin;
+                tMax = gMax;
+            }
+            uMin = std::min(uMin,tMin);
+            uMax = std::max(uMax,tMax);
+            for(int y=y0; y<y1; y++)
+                for(int x=x0; x<x1; x++) {
+                    lo(x,y) = static_cast<float>(tMin);
+                    hi(x,y) = static_cast<float>(tMax);
+                }
+        }
+    dMin = uMin;
+    dMax = uMax;
+}
+
+/// Express the maps of the range searched in the wider range [\a d0,\a d1]:
+/// their invalid disparities are set to d0-1.
+void StereoEngine::widenRange(int d0, int d1) {
+    const float inv=static_cast<float>(d0-1);
+    const float lo=static_cast<float>(searchMin);
+    const float hi=static_cast<float>(searchMax);
+    for(int y=0; y<disp1.height(); y++)
+        for(int x=0; x<disp1.width(); x++) {
+            if(! (disp1(x,y) >= lo))
+                disp1(x,y) = inv;
+            if(! (-hi<=disp2(x,y) && disp2(x,y)<=-lo))
+                disp2(x,y) = inv;
+            if(p.fusedCheck && !(fused(x,y) >= lo))
+                fused(x,y) = inv;
+        }
+    dMin = d0;
+    dMax = d1;
+}
+
+/// Whether the pixels of tile [\a x0,\a x1)x[\a y0,\a y1) differ in \a a
+/// and \a b.
+static bool tileChanged(const Image& a, const Image& b,
+                        int x0, int x1, int y0, int y1) {
+    for(int y=y0; y<y1; y++)
+        for(int x=x0; x<x1; x++)
+            for(int c=0; c<a.channels(); c++)
+                if(a(x,y,c) != b(x,y,c))
+                    return true;
+    return false;
+}
+
+/// Set to 1 the pixels of rectangle [\a x0,\a x1)x[\a y0,\a y1) of
+/// \a mask of width \a w and height \a h, clipped to it.
+static void markRect(std::vector<unsigned char>& mask, int w, int h,
+                     int x0, int x1, int y0, int y1) {
+    x0=std::max(0,x0); x1=std::min(w,x1);
+    y0=std::max(0,y0); y1=std::min(h,y1);
+    for(int y=y0; y<y1; y++)
+        for(int x=x0; x<x1; x++)
+            mask[y*w+x] = 1;
+}
+
+/// Maps of pair \a im1, \a im2 updated from those of the previous pair, see
+/// ParamStereo::incremental.
+///
+/// Only tiles where the images differ from the previous pair are changed.
+/// Their costs reach the pixels of image 1 whose window, or the window they
+/// are matched to, covers them: these pixels, widened by the length of the
+/// range so as to include all the candidates of the pixels of image 2
+/// matched from them, are computed with a per-pixel range, see disparityAW,
+/// the others being those of the previous pair. Return false if the previous
+/// pair is of another size or range.
+bool StereoEngine::computeIncremental(const Image& im1, const Image& im2,
+                                      int dMin, int dMax) {
+    const int w=im1.width(), h=im1.height(), T=p.incremental;
+    if(prev1.width()!=w || prev1.height()!=h ||
+       prev1.channels()!=im1.channels() || prev2.channels()!=im2.channels() ||
+       prevMin!=dMin || prevMax!=dMax)
+        return false;
+    const ParamDisparity& d=p.disparity;
+    const int m = d.radius + RawCostCensus::RADIUS; // Halo of windows
+    const int my = m + std::abs(d.offsetY) + d.searchY;
+    const int nd = dMax-dMin;
+    std::vector<unsigned char> aggr(w*h,0); // Pixels of image 1 to compute
+    std::vector<unsigned char> exact2(w*h,0); // Pixels of image 2 computed
+    for(int y0=0; y0<h; y0+=T)
+        for(int x0=0; x0<w; x0+=T) {
+            const int x1=std::min(w,x0+T), y1=std::min(h,y0+T);
+            if(!tileChanged(im1, prev1, x0,x1, y0,y1) &&
+               !tileChanged(im2, prev2, x0,x1, y0,y1))
+                continue;
+            // Pixels of image 1 whose costs use the tile
+            const int a0=x0-m-std::max(0,dMax), a1=x1+m-std::min(0,dMin);
+            markRect(aggr, w,h, a0-nd, a1+nd, y0-my, y1+my);
+            markRect(exact2, w,h, a0+dMin, a1+dMax, y0-my, y1+my);
+        }
+    Image lo(w,h), hi(w,h);
+    lo.fill(static_cast<float>(dMax+1)); // Empty range
+    hi.fill(static_cast<float>(dMin-1));
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            if(aggr[y*w+x]) {
+                lo(x,y) = static_cast<float>(dMin);
+                hi(x,y) = static_cast<float>(dMax);
+            }
+    const int tile=p.incremental;
+    p.incremental = 0;
+    compute(im1, im2, dMin, dMax, lo, hi);
+    p.incremental = tile;
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            if(! aggr[y*w+x])
+                disp1(x,y) = raw1(x,y);
+            if(! exact2[y*w+x])
+                disp2(x,y) = raw2(x,y);
+        }
+    return true;
+}
+
+/// Disparity maps of pair \a im1, \a im2 in range [\a dMin,\a dMax].
+///
+/// If \a rangeLo and \a rangeHi are not empty, they are a per-pixel range,
+/// see disparityAW; only aw on CPU without levels or roi uses them.
+/// Otherwise, with p.autoRange, only the range estimated by estimateRange() is
+/// searched, or the ranges of estimateTileRanges() with p.rangeTile. With
+/// p.incremental, see computeIncremental().
+void StereoEngine::compute(const Image& im1, const Image& im2,
+                           int dMin, int dMax,
+                           const Image& rangeLo, const Image& rangeHi) {
+    markFrame();
+    if(device)
+        device->release();
+    if(p.incremental>0 && rangeLo.width()==0) {
+        if(! computeIncremental(im1, im2, dMin, dMax)) {
+            const int tile=p.incremental;
+            p.incremental = 0;
+            compute(im1, im2, dMin, dMax);
+            p.incremental = tile;
+        }
+        prev1 = im1.clone();
+        prev2 = im2.clone();
+        raw1 = disp1.clone();
+        raw2 = disp2.clone();
+        prevMin = dMin;
+        prevMax = dMax;
+        return;
+    }
+    if(p.autoRange && rangeLo.width()==0) {
+        int lo=dMin, hi=dMax;
+        Image tileLo, tileHi;
+        StageTimer timer("auto range");
+        if(p.rangeTile > 0)
+            estimateTileRanges(im1, im2, p.disparity, p.occlusion.tol_disp,
+                               p.rangeTile, lo, hi, tileLo, tileHi);
+        else
+            estimateRange(im1, im2, p.disparity, p.occlusion.tol_disp, lo,hi);
+        timer.stop();
+        p.autoRange = false;
+        compute(im1, im2, lo, hi, tileLo, tileHi);
+        p.autoRange = true;
+        widenRange(dMin, dMax);
+        return;
+    }
+    this->im1 = im1;
+    this->im2 = p.denseRight? im2: Image();
+    this->dMin = searchMin = dMin;
+    this->dMax = searchMax = dMax;
+    startGuidance();
+    if(p.scale > 1) {
+        computeScaled(im1, im2, dMin, dMax);
+        return;
+    }
+    alloc(im1.width(), im1.height());
+    disp1.fill(static_cast<float>(dMin-1));
+    disp2.fill(static_cast<float>(dMin-1));
+    Image* pConf = p.confidence? &conf: 0;
+    if(pConf)
+        conf.fill(-1.0f); // Undefined
+    Image* pOcc = p.fusedCheck? &fused: 0;
+    Candidates* pTop = p.topK>0? &top: 0;
+    checked = false;
+    const ParamDisparity& param = p.disparity;
+    // Adaptive weights on CPU are timed by stages in disparityAW
+    const bool cpuAW = (p.aggreg==ParamStereo::AggregAW && !p.gpu);
+    StageTimer timer(cpuAW? 0: "aggregation", static_cast<double>(im1.width())*
+                     im1.height()*(dMax-dMin+1));
+    switch(p.aggreg) {
+    case ParamStereo::AggregGF:
+        disparityGF(im1, im2, dMin, dMax, param, disp1, disp2);
+        break;
+    case ParamStereo::AggregBG:
+        disparityBG(im1, im2, dMin, dMax, param, disp1, disp2);
+        break;
+    case ParamStereo::AggregPM:
+        disparityPatchMatch(im1, im2, dMin, dMax, param, disp1, disp2);
+        break;
+    case ParamStereo::AggregCross:
+        disparityCross(im1, im2, dMin, dMax, param, disp1, disp2);
+        break;
+    case ParamStereo::AggregSGM:
+        disparitySGM(im1, im2, dMin, dMax, param, disp1, disp2);
+        break;
+    case ParamStereo::AggregAW:
+        if(p.gpu) // Kept on the device for the left-right check
+            device->compute(im1, im2, dMin, dMax, param, disp1, disp2,
+                            p.lrCheck && !p.denseRight);
+        else if(p.roi.w > 0)
+            disparityAW_roi(im1, im2, p.roi, dMin, dMax, param, disp1,disp2);
+        else if(rangeLo.width() > 0)
+            disparityAW(im1, im2, dMin, dMax, param, rangeLo, rangeHi,
+                        disp1, disp2, pConf, pOcc, pTop);
+        else if(share && p.levels==1)
+            disparityAW(im1, im2, dMin, dMax, param, shared, disp1, disp2,
+                        pConf, pOcc, pTop);
+        else
+            disparityPyramid(im1, im2, dMin, dMax, param, p.levels, p.band,
+                             disp1, disp2, pConf, pOcc, pTop,
+                             preview, previewData);
+        checked = (pOcc != 0);
+        break;
+    }
+}
+
+/// Map \a fine of the pixels of map \a coarse enlarged by factor \a s, nearest
+/// neighbor. If \a dMax>=dMin, the values are disparities: they are
+/// multiplied by s and restricted to [dMin,dMax], those below \a cMin
+/// (invalid) being set to dMin-1, and the pixels where the 3x3 neighborhood of
+/// coarse disparities spans more than 1 are marked in \a edges.
+static void upsample(const Image& coarse, int s, int cMin, int dMin, int dMax,
+                     Image& fine, OcclusionMask* edges=0) {
+    const int w=coarse.width(), h=coarse.height();
+    const bool disparity = (dMin<=dMax);
+    for(int j=0; j<h; j++)
+        for(int i=0; i<w; i++) {
+            float v = coarse(i,j);
+            bool edge=false;
+            if(disparity) {
+                float a=v, b=v;
+                for(int l=std::max(0,j-1); l<=std::min(h-1,j+1); l++)
+                    for(int k=std::max(0,i-1); k<=std::min(w-1,i+1); k++) {
+                        a = std::min(a,coarse(k,l));
+                        b = std::max(b,coarse(k,l));
+                    }
+                edge = (b-a > 1);
+                v = (v<cMin)? static_cast<float>(dMin-1):
+                    std::min(static_cast<float>(dMax),
+                             std::max(static_cast<float>(dMin), s*v));
+            }
+            for(int y=s*j; y<std::min(s*j+s,fine.height()); y++)
+                for(int x=s*i; x<std::min(s*i+s,fine.width()); x++) {
+                    fine(x,y) = v;
+                    if(edge)
+                        edges->set(x,y);
+                }
+        }
+}
+
+/// Maps of pair \a im1, \a im2 computed on the images reduced by factor
+/// p.scale, then enlarged.
+///
+/// The coarse engine has the range, radius, stride and spatial gamma divided
+/// by the factor. The enlarged maps are made edge-aware by joint bilateral
+/// upsampling: at pixels near a discontinuity of the coarse map, the value is
+/// the weighted median of its window of radius twice the factor, guided by the
+/// image at full resolution.
+void StereoEngine::computeScaled(const Image& im1, const Image& im2,
+                                 int dMin, int dMax) {
+    const int s=p.scale, w=im1.width(), h=im1.height();
+    ParamStereo q(p);
+    q.scale = 1;
+    q.threads = 0; // Already set
+    q.cpus.clear();
+    q.fusedCheck = false; // Check at full resolution
+    q.lrCheck = q.denseRight = false;
+    ParamDisparity& d = q.disparity;
+    d.radius = std::max(1, d.radius/s);
+    d.stride = std::max(1, d.stride/s);
+    d.gammaPos /= s;
+    d.intCost = false; // Averaged images are not 8-bit
+    d.offsetY = floorDiv(d.offsetY+s/2, s);
+    d.searchY = -floorDiv(-d.searchY, s);
+    if(! coarse)
+        coarse = new StereoEngine(q);
+    else
+        coarse->setDisparity(d);
+    const int cMin=floorDiv(dMin,s), cMax=-floorDiv(-dMax,s);
+    StageTimer timerReduce("reduce");
+    const Image c1=im1.reduce(s), c2=im2.reduce(s);
+    timerReduce.stop();
+    coarse->compute(c1, c2, cMin, cMax);
+
+    StageTimer timer("upsample", static_cast<double>(w)*h);
+    alloc(w, h);
+    checked = false;
+    const float sSpace=static_cast<float>(s), sColor=p.occlusion.sigma_color;
+    OcclusionMask edges(w,h);
+    upsample(coarse->disparity(), s, cMin, dMin, dMax, disp1, &edges);
+    disp1.weightedMedian(im1, edges, dMin-1, dMax, 2*s, sSpace, sColor);
+    if(! d.leftOnly) {
+        OcclusionMask edges2(w,h);
+        upsample(coarse->disparityRight(), s, -cMax, -dMax, -dMin, disp2,
+                 &edges2); // Map of image 2 in [-dMax,-dMin]
+        disp2.weightedMedian(im2, edges2, -dMax-1, -dMin, 2*s, sSpace,
+                             sColor);
+    }
+    if(p.confidence)
+        upsample(coarse->confidence(), s, 0, 0, -1, conf);
+}
+
+/// Disparity maps \a disp1 and \a disp2 of pair of image \a im1 in range
+/// [\a dMin,\a dMax], computed before. They are not copied.
+void StereoEngine::set(const Image& im1, int dMin, int dMax,
+                       const Image& disp1, const Image& disp2) {
+    if(device)
+        device->release();
+    this->im1 = im1;
+    this->im2 = Image();
+    this->dMin = searchMin = dMin;
+    this->dMax = searchMax = dMax;
+    startGuidance();
+    this->disp1 = disp1;
+    this->disp2 = disp2;
+    own = checked = false;
+}
+
+/// Whether densify() of \a p fills by fill_occlusion, which needs a guidance.
+static bool guided(const ParamStereo& p) {
+    return p.lrCheck && p.sense>=0 && p.sense<=1 &&
+        p.occlusion.filler!=ParamOcclusion::FillScan &&
+        !(p.occlusion.support_weights &&
+          p.occlusion.filler==ParamOcclusion::FillMedian);
+}
+
+/// Whether densify() of \a p runs on the device after the aggregation on
+/// GPU, see GpuPair: weighted median of exact colors, map of image 1 only.
+static bool deviceFilled(const ParamStereo& p) {
+    const ParamOcclusion& o = p.occlusion;
+    return p.gpu && gpuSupports(p.disparity) && guided(p) && !p.denseRight &&
+        p.scale==1 && o.filler==ParamOcclusion::FillMedian &&
+        !o.fast_median && o.palette==0;
+}
+
+/// Left-right check: occluded pixels of disparity() are set to dMin-1. Nothing
+/// is done without param().lrCheck. With ParamStereo::denseRight, the pixels of
+/// disparityRight() failing the check against the unchecked disparity() are
+/// marked in occlusionRight(), the map being left as is.
+void StereoEngine::check() {
+    if(! p.lrCheck)
+        return;
+    const bool done = checked;
+    if(checked) // Unchecked map kept as buffer for the next pair
+        std::swap(disp1, fused);
+    checked = false;
+    StageTimer timer("check");
+    if(device && device->resident()) {
+        device->check(p.occlusion.tol_disp, disp1);
+        mask = OcclusionMask(disp1, dMin, dMax);
+        mask2 = OcclusionMask();
+        if(! deviceFilled(p))
+            device->release();
+        return;
+    }
+    mask = OcclusionMask(disp1, dMin, dMax);
+    mask2 = OcclusionMask();
+    if(im2.width() > 0 && !p.disparity.leftOnly) {
+        mask2 = OcclusionMask(disp2, -dMax, -dMin);
+        detect_occlusion(disp2, done? fused: disp1, p.occlusion.tol_disp,
+                         mask2);
+    }
+    if(! done) {
+        detect_occlusion(disp1, disp2, p.occlusion.tol_disp, mask);
+        mask.apply(disp1, static_cast<float>(dMin-1));
+    }
+}
+
+/// Start the computation of guidance of image \a img, after the previous one.
+void GuidanceTask::start(const Image& img) {
+    wait();
+    im = img;
+    guidance = Image();
+#if __cplusplus >= 201103L
+    thread = std::thread(&GuidanceTask::run, this);
+#endif
+}
+
+/// Computation of the guidance.
+void GuidanceTask::run() {
+    StageTimer timer("guidance");
+    guidance = im.median(1);
+}
+
+/// End of the thread, if any.
+void GuidanceTask::wait() {
+#if __cplusplus >= 201103L
+    if(thread.joinable())
+        thread.join();
+#endif
+}
+
+/// The guidance of the image of start(), once computed.
+const Image& GuidanceTask::get() {
+    wait();
+    if(guidance.width()==0 && im.width()>0)
+        run();
+    return guidance;
+}
+
+/// Start the guidance of densify(), for im1 and, with denseRight, for im2.
+void StereoEngine::startGuidance() {
+    if(!guided(p) || deviceFilled(p)) // Device computes its own
+        return;
+    guide1.start(im1);
+    if(im2.width() > 0)
+        guide2.start(im2);
+}
+
+/// Fill occlusions \a mask of map \a disp of image \a im, of disparities in
+/// [\a dMin,\a dMax]: along rows by the max of the neighbors (min if
+/// \a min), \a vOut being combined at the left border, then by the filler of
+/// \a p, guided by \a guide.
+static void fillMap(Image& disp, const Image& im, const OcclusionMask& mask,
+                    int dMin, int dMax, bool min, float vOut,
+                    GuidanceTask& guide, const ParamStereo& p) {
+    StageTimer timer("fill");
+    if(min)
+        disp.fillMinX(mask, vOut);
+    else
+        disp.fillMaxX(mask, vOut);
+    timer.stop();
+    if(p.occlusion.support_weights &&
+       p.occlusion.filler==ParamOcclusion::FillMedian) {
+        StageTimer timerMedian("median");
+        fillOcclusionAW(disp, im, mask, dMin, dMax, p.disparity);
+    } else {
+        const Image& guidance = guide.get();
+        StageTimer timerMedian("median");
+        fill_occlusion(disp, guidance, mask, dMin, dMax, p.occlusion);
+    }
+}
+
+/// Fill occlusions of disparity() in place, after check(). Return false if
+/// there is no densification (sense neither 0 nor 1, or no left-right check).
+/// With ParamStereo::denseRight, disparityRight() is filled next, the roles
+/// of min and max being exchanged since its disparities are opposite. Each
+/// stage runs on all threads, so that the two maps are done in sequence.
+bool StereoEngine::densify() {
+    if(! p.lrCheck || p.sense<0 || p.sense>1)
+        return false;
+    const float d0=static_cast<float>(dMin);
+    if(device && device->resident()) {
+        StageTimer timer("fill");
+        device->fill(p.sense==1, d0);
+        timer.stop();
+        StageTimer timerMedian("median");
+        device->median(p.occlusion, disp1);
+        return true;
+    }
+    if(deviceFilled(p)) // Guidance not started, the maps being on the host
+        guide1.start(im1);
+    fillMap(disp1, im1, mask, dMin, dMax, p.sense==1, d0, guide1, p);
+    if(mask2.width() > 0)
+        fillMap(disp2, im2, mask2, -dMax, -dMin, p.sense==0, -d0, guide2, p);
+    return true;
+}
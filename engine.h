@@ -0,0 +1,189 @@
+/**
+ * @file engine.h
+ * @brief Whole chain of disparity computation, reusable from pair to pair
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "disparity.h"
+#include "occlusion.h"
+#include "image.h"
+#include <iosfwd>
+#include <string>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <thread>
+#endif
+
+class GpuPair;
+
+/// Parameters of the chain, from the images to the dense disparity map
+struct ParamStereo {
+    /// Method of disparity computation
+    enum Aggregation {
+        AggregAW,    ///< Adaptive weights (reference)
+        AggregPM,    ///< Adaptive weights by PatchMatch
+        AggregGF,    ///< Guided filter
+        AggregBG,    ///< Bilateral grid
+        AggregCross, ///< Cross-based support
+        AggregSGM    ///< Semi-global matching
+    };
+
+    ParamDisparity disparity; ///< Raw cost and aggregation
+    ParamOcclusion occlusion; ///< Left-right check and filling
+    Aggregation aggreg; ///< Method of disparity computation
+    bool gpu;        ///< Adaptive weights on GPU
+    int levels;      ///< Levels of coarse to fine search, 1 for full range
+    int band;        ///< Search band around upsampled coarse disparities
+    int scale;       ///< Reduction factor of the images, 1 for full resolution
+    bool autoRange;  ///< Search only the range estimated on reduced images
+    int rangeTile;   ///< With autoRange, size of tiles of own range, or 0
+    int incremental; ///< Tiles recomputed where pair changed (aw), or 0
+    Rect roi;        ///< Region of interest, whole images if empty
+    bool confidence; ///< Compute confidence map
+    int topK;        ///< Best disparities kept per pixel (aw on CPU), or 0
+    bool lrCheck;    ///< Left-right check, else check() and densify() skipped
+    bool denseRight; ///< Check and densify the map of image 2 too
+    bool fusedCheck; ///< Left-right check in aggregation (aw on CPU)
+    int sense;       ///< Camera motion: 0 to right, 1 to left, else no filling
+    int threads;     ///< Number of OpenMP threads, 0 for default
+    std::vector<int> cpus; ///< CPUs of the threads, in turn, any if empty
+
+    // Constructor with default parameters
+    ParamStereo()
+    : aggreg(AggregAW),
+      gpu(false),
+      levels(1),
+      band(2),
+      scale(1),
+      autoRange(false),
+      rangeTile(0),
+      incremental(0),
+      confidence(false),
+      topK(0),
+      lrCheck(true),
+      denseRight(false),
+      fusedCheck(false),
+      sense(0),
+      threads(0) {}
+
+    bool setAggregation(const std::string& name);
+    bool setCpus(const std::string& list);
+    size_t memory(int w, int h, int dMin, int dMax) const;
+};
+
+bool setThreads(int threads, const std::vector<int>& cpus);
+void printThreads(std::ostream& out);
+
+/// Guidance of the filling of occlusions, the median of radius 1 of an image.
+///
+/// It depends only on the image, so that start() computes it in a background
+/// thread, overlapping the aggregation and the left-right check, and get()
+/// waits for it. Without C++11, get() computes it.
+class GuidanceTask {
+public:
+    GuidanceTask() {}
+    ~GuidanceTask() { wait(); }
+    void start(const Image& im);
+    const Image& get();
+private:
+    Image im;       ///< Image of the guidance
+    Image guidance; ///< Result, empty until done
+    void run();
+    void wait();
+#if __cplusplus >= 201103L
+    std::thread thread;
+#endif
+    GuidanceTask(const GuidanceTask&);            ///< Forbidden
+    GuidanceTask& operator=(const GuidanceTask&); ///< Forbidden
+};
+
+/// Disparity computation of stereo pairs, step by step.
+///
+/// For each pair, compute() (or set() for maps computed before) gives the
+/// disparity maps of both images, then check() marks the pixels failing the
+/// left-right check and densify() fills them. The maps can be saved between
+/// the steps, disparity() being modified in place by the last two, as well as
+/// disparityRight() with ParamStereo::denseRight (not after set()). The engine
+/// is meant to live as long as the pairs to process: it reuses its maps, the
+/// OpenMP threads and, if asked at construction, the memory of the cost
+/// volume (see recycleCosts) from one pair to the next. For a sweep of
+/// parameters on the same pair, see setDisparity() and shareCosts(). The
+/// progress and cancellation of the computation are those of timing.h.
+class StereoEngine {
+public:
+    explicit StereoEngine(const ParamStereo& param, bool recycle=false);
+    ~StereoEngine();
+    const ParamStereo& param() const { return p; }
+    void setDisparity(const ParamDisparity& param);
+    /// Keep the cost volume of a pair for the next compute() of the same one
+    /// with other support parameters (aw on CPU, full range), see SharedCosts
+    void shareCosts(bool on) { share=on; if(! on) shared.clear(); }
+    /// Call \a callback with \a data at each coarse level of
+    /// ParamStereo::levels
+    void setPreview(LevelCallback callback, void* data=0) {
+        preview=callback; previewData=data;
+    }
+    void compute(const Image& im1, const Image& im2, int dMin, int dMax,
+                 const Image& rangeLo=Image(), const Image& rangeHi=Image());
+    void set(const Image& im1, int dMin, int dMax,
+             const Image& disp1, const Image& disp2);
+    void check();
+    bool densify();
+    const Image& disparity() const { return disp1; } ///< Map of image 1
+    const Image& disparityRight() const { return disp2; } ///< Map of image 2
+    const Image& confidence() const { return conf; } ///< See --confidence
+    const Candidates& candidates() const { return top; } ///< See topK
+    /// Range searched by the last compute(), see ParamStereo::autoRange
+    void searched(int& lo, int& hi) const { lo=searchMin; hi=searchMax; }
+    const OcclusionMask& occlusion() const { return mask; } ///< After check
+    /// Occluded pixels of image 2 after check, empty without denseRight
+    const OcclusionMask& occlusionRight() const { return mask2; }
+private:
+    ParamStereo p; ///< Parameters, fusedCheck restricted to aw on CPU
+    bool recycle;  ///< Keep memory of cost volumes
+    bool own;      ///< Maps allocated by the engine, not given to set()
+    bool checked;  ///< Left-right check done in aggregation, see fused
+    bool share;    ///< Use shared
+    SharedCosts shared; ///< Cost volume kept from previous compute()
+    LevelCallback preview; ///< Callback of coarse levels, or 0
+    void* previewData;     ///< Its data
+    Image im1;     ///< Guidance of densification
+    Image im2;     ///< Guidance of densification of disp2, with denseRight
+    int dMin, dMax; ///< Disparity range of current pair
+    int searchMin, searchMax; ///< Range searched, inside [dMin,dMax]
+    Image disp1, disp2, conf; ///< Output maps
+    Candidates top; ///< Best disparities of image 1, see ParamStereo::topK
+    Image fused;   ///< Map of image 1 checked during aggregation
+    OcclusionMask mask; ///< Occluded pixels of image 1
+    OcclusionMask mask2; ///< Occluded pixels of image 2, with denseRight
+    GuidanceTask guide1, guide2; ///< Guidance of densify() for im1 and im2
+    StereoEngine* coarse; ///< Engine of reduced images, see ParamStereo::scale
+    GpuPair* device; ///< Maps on the device with ParamStereo::gpu, or 0
+    Image prev1, prev2; ///< Previous pair, see ParamStereo::incremental
+    Image raw1, raw2;   ///< Its maps before check()
+    int prevMin, prevMax; ///< Its disparity range
+    void alloc(int w, int h);
+    void startGuidance();
+    void computeScaled(const Image& im1, const Image& im2, int dMin, int dMax);
+    void widenRange(int d0, int d1);
+    bool computeIncremental(const Image& im1, const Image& im2,
+                            int dMin, int dMax);
+    StereoEngine(const StereoEngine&);            ///< Forbidden
+    StereoEngine& operator=(const StereoEngine&); ///< Forbidden
+};
+
+#endif
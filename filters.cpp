@@ -17,51 +17,133 @@
  */
 
 #include "image.h"
+#include "occlusion.h"
+#include "parallel.h"
+#include "simd.h"
+#include "timing.h"
 #include <algorithm>
-#include <numeric>
 #include <vector>
 #include <cmath>
 #include <cassert>
 
-/// Fill pixels below value \a vMin using values at two closest pixels on same
-/// line above \a vMin. The filling value is the result of \a cmp with the two
-/// values as parameters.
-void Image::fillX(float vMin, const float& (*cmp)(const float&,const float&)) {
-    assert(c==1);
-    for(int y=0; y<h; y++) {
-        int x0=-1;
-        float v0 = vMin;
-        while(x0<w) {
-            int x1=x0+1;
-            while(x1<w && (*this)(x1,y)<vMin) ++x1;
-            float v=v0;
+/// First index in [x,w) where \a p is below \a vMin (not below if \a below
+/// is false), w if none.
+template <typename T>
+static int findBelow(const T* p, int x, int w, T vMin, bool below) {
+    while(x<w && (p[x]<vMin)!=below) ++x;
+    return x;
+}
+
+/// Same as above for float, skipping spans with SIMD_NAME comparisons.
+static int findBelow(const float* p, int x, int w, float vMin, bool below) {
+    const vfloat v=vset(vMin);
+    if(below)
+        while(x+VSIZE<=w && !vanyless(vload(p+x),v)) x+=VSIZE;
+    else
+        while(x+VSIZE<=w && vallless(vload(p+x),v)) x+=VSIZE;
+    while(x<w && (p[x]<vMin)!=below) ++x;
+    return x;
+}
+
+/// Rows of ImageT::fillX filled by a parallel loop: pixels below \a vMin, or
+/// pixels occluded in \a mask if not 0.
+template <typename T>
+class FillRows : public ParallelBody {
+public:
+    FillRows(ImageT<T>& im_, const OcclusionMask* mask_, T vMin_,
+             const T& (*cmp_)(const T&,const T&))
+    : im(im_), mask(mask_), vMin(vMin_), cmp(cmp_) {}
+    void run(int y, int);
+private:
+    ImageT<T>& im;
+    const OcclusionMask* mask;
+    T vMin;
+    const T& (*cmp)(const T&,const T&);
+};
+
+/// Row \a y.
+template <typename T>
+void FillRows<T>::run(int y, int) {
+    const int w=im.width();
+    T* row = &im(0,y);
+    if(! mask) {
+        for(int x=0; (x=findBelow(row,x,w,vMin,true)) < w;) {
+            const int x1=findBelow(row,x,w,vMin,false);
+            T v = (x>0)? row[x-1]: vMin; // Last value above vMin
             if(x1<w)
-                v = cmp(v,v0=(*this)(x1,y));
-            std::fill(&(*this)(x0+1,y), &(*this)(x1,y), v);
-            x0=x1;
+                v = cmp(v,row[x1]);
+            std::fill(row+x, row+x1, v);
+            x=x1;
         }
+        return;
     }
+    for(int x=0; (x=mask->next(x,y,true)) < w;) {
+        const int x1=mask->next(x,y,false);
+        T v = (x>0)? row[x-1]: vMin; // Last non-occluded value
+        if(x1<w)
+            v = cmp(v,row[x1]);
+        std::fill(row+x, row+x1, v);
+        x=x1;
+    }
+}
+
+/// Fill pixels below value \a vMin using values at two closest pixels on same
+/// line above \a vMin. The filling value is the result of \a cmp with the two
+/// values as parameters. Rows are processed in parallel.
+template <typename T>
+void ImageT<T>::fillX(T vMin, const T& (*cmp)(const T&,const T&)) {
+    assert(c==1);
+    FillRows<T> rows(*this, 0, vMin, cmp);
+    parallelFor(h, rows);
+}
+
+/// Fill occluded pixels of \a mask using values at the two closest
+/// non-occluded pixels on same line, combined by \a cmp. Without pixel on the
+/// left, \a vMin is combined. Rows are processed in parallel.
+template <typename T>
+void ImageT<T>::fillX(const OcclusionMask& mask, T vMin,
+                      const T& (*cmp)(const T&,const T&)) {
+    assert(c==1 && mask.width()==w && mask.height()==h);
+    FillRows<T> rows(*this, &mask, vMin, cmp);
+    parallelFor(h, rows);
 }
 
 /// Fill pixels below value \a vMin with min of values at closest pixels on same
 /// line above \a vMin.
-void Image::fillMinX(float vMin) {
-    fillX(vMin, std::min<float>);
+template <typename T>
+void ImageT<T>::fillMinX(T vMin) {
+    fillX(vMin, std::min<T>);
 }
 
 /// Fill pixels below value \a vMin with max of values at closest pixels on same
 /// line above \a vMin.
-void Image::fillMaxX(float vMin) {
-    fillX(vMin, std::max<float>);
+template <typename T>
+void ImageT<T>::fillMaxX(T vMin) {
+    fillX(vMin, std::max<T>);
+}
+
+/// Fill occluded pixels of \a mask with min of values at closest pixels on
+/// same line not occluded.
+template <typename T>
+void ImageT<T>::fillMinX(const OcclusionMask& mask, T vMin) {
+    fillX(mask, vMin, std::min<T>);
+}
+
+/// Fill occluded pixels of \a mask with max of values at closest pixels on
+/// same line not occluded.
+template <typename T>
+void ImageT<T>::fillMaxX(const OcclusionMask& mask, T vMin) {
+    fillX(mask, vMin, std::max<T>);
 }
 
 /// Derivative along x-axis
-Image Image::gradX() const {
+template <typename T>
+ImageT<T> ImageT<T>::gradX() const {
     assert(w>=2 && c==1);
-    Image D(w,h);
-    float* out=D.tab;
+    ImageT D(w,h);
     for(int y=0; y<h; y++) {
-        const float* in=tab+y*w;
+        const T* in=tab+y*s;
+        T* out=D.tab+y*D.s;
         *out++ = in[1]-in[0];
         for(int x=1; x+1<w; x++, in++)
             *out++ = .5f*(in[2]-in[0]);
@@ -70,12 +152,198 @@ Image Image::gradX() const {
     return D;
 }
 
+/// Image reduced by factor \a f, by mean of f x f blocks.
+///
+/// Blocks overlapping the last row or column repeat it, so that they still
+/// have f x f pixels.
+template <typename T>
+ImageT<T> ImageT<T>::reduce(int f) const {
+    assert(f>=1);
+    ImageT out((w+f-1)/f, (h+f-1)/f, c);
+    const T n = static_cast<T>(f*f);
+    for(int y=0; y<out.h; y++)
+        for(int x=0; x<out.w; x++)
+            for(int k=0; k<c; k++) {
+                T sum=0;
+                for(int j=0; j<f; j++) {
+                    const int yj=std::min(f*y+j,h-1);
+                    for(int i=0; i<f; i++)
+                        sum += (*this)(std::min(f*x+i,w-1),yj,k);
+                }
+                out(x,y,k) = sum/n;
+            }
+    return out;
+}
+
+/// Comparators of selection networks for the median of 9 and 25 values,
+/// pruned from Batcher's odd-even merge sort.
+static const unsigned char NET9[][2] = {
+    {0,1}, {2,3}, {4,5}, {6,7}, {0,2}, {1,3}, {4,6}, {5,7}, {1,2}, {5,6},
+    {0,4}, {1,5}, {2,6}, {3,7}, {2,4}, {3,5}, {1,2}, {3,4}, {5,6}, {0,8},
+    {4,8}, {2,4}, {3,5}, {3,4}
+};
+static const unsigned char NET25[][2] = {
+    {0,1}, {2,3}, {4,5}, {6,7}, {8,9}, {10,11}, {12,13}, {14,15}, {16,17},
+    {18,19}, {20,21}, {22,23}, {0,2}, {1,3}, {4,6}, {5,7}, {8,10}, {9,11},
+    {12,14}, {13,15}, {16,18}, {17,19}, {20,22}, {21,23}, {1,2}, {5,6},
+    {9,10}, {13,14}, {17,18}, {21,22}, {0,4}, {1,5}, {2,6}, {3,7}, {8,12},
+    {9,13}, {10,14}, {11,15}, {16,20}, {17,21}, {18,22}, {19,23}, {2,4},
+    {3,5}, {10,12}, {11,13}, {18,20}, {19,21}, {1,2}, {3,4}, {5,6}, {9,10},
+    {11,12}, {13,14}, {17,18}, {19,20}, {21,22}, {0,8}, {1,9}, {2,10}, {3,11},
+    {4,12}, {5,13}, {6,14}, {7,15}, {16,24}, {4,8}, {5,9}, {6,10}, {7,11},
+    {20,24}, {2,4}, {3,5}, {6,8}, {7,9}, {10,12}, {11,13}, {18,20}, {19,21},
+    {22,24}, {1,2}, {3,4}, {5,6}, {7,8}, {9,10}, {11,12}, {13,14}, {17,18},
+    {19,20}, {21,22}, {23,24}, {0,16}, {1,17}, {2,18}, {3,19}, {4,20}, {5,21},
+    {6,22}, {7,23}, {8,24}, {8,16}, {9,17}, {10,18}, {11,19}, {12,20},
+    {13,21}, {6,10}, {7,11}, {12,16}, {13,17}, {10,12}, {11,13}, {11,12}
+};
+
+/// Median of the \a n values of \a v by selection network, n being 9 or 25.
+/// The values are reordered.
+template <typename T>
+static T medianNetwork(T* v, int n) {
+    const unsigned char (*net)[2] = (n==9)? NET9: NET25;
+    const int m = (n==9)? sizeof(NET9)/sizeof(*NET9):
+                          sizeof(NET25)/sizeof(*NET25);
+    for(int k=0; k<m; k++) {
+        T& a=v[net[k][0]];
+        T& b=v[net[k][1]];
+        const T lo=std::min(a,b), hi=std::max(a,b);
+        a=lo; b=hi;
+    }
+    return v[n/2];
+}
+
+/// Whether all values of image \a im are integers in [0,255].
+template <typename T>
+static bool range8bit(const ImageT<T>& im) {
+    for(int y=0; y<im.height(); y++)
+        for(int x=0; x<im.width(); x++)
+            for(int k=0; k<im.channels(); k++) {
+                const T v=im(x,y,k);
+                if(!(0<=v && v<=255 && static_cast<T>(static_cast<int>(v))==v))
+                    return false;
+            }
+    return true;
+}
+
+/// Rows of a stripe sharing column histograms in medianHistogram
+static const int STRIPE=64;
+
+/// Stripes of rows of medianHistogram, run by a parallel loop.
+template <typename T>
+class MedianStripes : public ParallelBody {
+public:
+    MedianStripes(const ImageT<T>& im_, int r_, ImageT<T>& M_)
+    : im(im_), r(r_), M(M_) {}
+    void run(int st, int);
+private:
+    const ImageT<T>& im;
+    const int r;
+    ImageT<T>& M;
+};
+
+/// Channel st%c of stripe st/c, with its own column histograms.
+template <typename T>
+void MedianStripes<T>::run(int st, int) {
+    const int w=im.width(), h=im.height(), c=im.channels();
+    const int k=st%c, y0=(st/c)*STRIPE, y1=std::min(h,y0+STRIPE);
+    // Column histograms, fine and coarse
+    std::vector<unsigned short> colF(w*256,0), colC(w*16,0);
+    // Rows before y0+r, including the one leaving the window at y0
+    for(int y=std::max(0,y0-r-1); y<std::min(h,y0+r); y++)
+        for(int x=0; x<w; x++) {
+            const int v=static_cast<int>(im(x,y,k));
+            ++colF[x*256+v]; ++colC[x*16+v/16];
+        }
+    for(int y=y0; y<y1; y++) {
+        if(y+r<h) // Row entering the window
+            for(int x=0; x<w; x++) {
+                const int v=static_cast<int>(im(x,y+r,k));
+                ++colF[x*256+v]; ++colC[x*16+v/16];
+            }
+        if(y-r-1>=0) // Row leaving the window
+            for(int x=0; x<w; x++) {
+                const int v=static_cast<int>(im(x,y-r-1,k));
+                --colF[x*256+v]; --colC[x*16+v/16];
+            }
+        const int ny=std::min(h-1,y+r)-std::max(0,y-r)+1;
+        int hc[16]={0}, hf[256]={0};
+        int upd[16]; // Window position of each fine segment
+        for(int b=0; b<16; b++)
+            upd[b] = -2*r-2; // Invalid
+        for(int x=0; x<r && x<w; x++)
+            for(int b=0; b<16; b++)
+                hc[b] += colC[x*16+b];
+        for(int x=0; x<w; x++) {
+            if(x+r<w)
+                for(int b=0; b<16; b++)
+                    hc[b] += colC[(x+r)*16+b];
+            if(x-r-1>=0)
+                for(int b=0; b<16; b++)
+                    hc[b] -= colC[(x-r-1)*16+b];
+            const int nx=std::min(w-1,x+r)-std::max(0,x-r)+1;
+            const int rank=(nx*ny)/2;
+            int b=0, sum=0;
+            for(; sum+hc[b]<=rank; b++)
+                sum += hc[b];
+            int* f=hf+16*b;
+            if(x-upd[b] > 2*r+1) { // Recompute segment
+                std::fill(f, f+16, 0);
+                for(int j=std::max(0,x-r); j<=std::min(w-1,x+r); j++)
+                    for(int i=0; i<16; i++)
+                        f[i] += colF[j*256+16*b+i];
+            } else // Update segment
+                for(int j=upd[b]+1; j<=x; j++) {
+                    if(j+r<w)
+                        for(int i=0; i<16; i++)
+                            f[i] += colF[(j+r)*256+16*b+i];
+                    if(j-r-1>=0)
+                        for(int i=0; i<16; i++)
+                            f[i] -= colF[(j-r-1)*256+16*b+i];
+                }
+            upd[b] = x;
+            int i=0;
+            for(; sum+f[i]<=rank; i++)
+                sum += f[i];
+            M(x,y,k) = static_cast<T>(16*b+i);
+        }
+    }
+}
+
+/// Median filter of radius \a r of image \a im with values in [0,255].
+///
+/// This is the constant time algorithm of Perreault and Hebert (2007): each
+/// column has a histogram of its 2r+1 pixels of the window, updated when the
+/// window moves down, and the histogram of the window is the sum of those of
+/// its columns, updated when it moves right. Histograms have 16 coarse bins
+/// and 256 fine bins, a segment of fine bins of the window being updated
+/// only when the median falls in its coarse bin. Windows are cut at image
+/// boundaries, as in median(). Stripes of rows are processed in parallel.
+template <typename T>
+static void medianHistogram(const ImageT<T>& im, int r, ImageT<T>& M) {
+    const int h=im.height(), c=im.channels();
+    const int nStripes=(h+STRIPE-1)/STRIPE;
+    MedianStripes<T> stripes(im, r, M);
+    parallelFor(nStripes*c, stripes, ParallelDynamic);
+}
+
 /// Median filter, write results in \a M
-Image Image::median(int radius) const {
-    Image M(w,h,c);
+///
+/// Images with values in [0,255] use the constant time histogram algorithm for
+/// radius 2 or more. Otherwise, windows of radius 1 or 2 inside the image use
+/// selection networks and others are sorted. The result is the same.
+template <typename T>
+ImageT<T> ImageT<T>::median(int radius) const {
+    ImageT M(w,h,c);
+    if(radius>=2 && range8bit(*this)) {
+        medianHistogram(*this, radius, M);
+        return M;
+    }
     int size=2*radius+1;
     size *= size;
-    float* v = new float[size];
+    const bool network=(radius==1 || radius==2);
+    T* v = new T[size];
     for(int y=0; y<h; y++)
         for(int x=0; x<w; x++)
             for(int k=0; k<c; k++) {
@@ -85,6 +353,10 @@ Image Image::median(int radius) const {
                         for(int i=-radius; i<=radius; i++)
                             if(0<=i+x && i+x<w)
                                 v[n++] = (*this)(i+x,j+y,k);
+                if(network && n==size) {
+                    M(x,y,k) = medianNetwork(v, n);
+                    continue;
+                }
                 // Following line should be used instead of full sort.
                 // However, because of bug #58800 of g++ 4.8.2, we avoid it.
                 // std::nth_element(v, v+n/2, v+n);
@@ -100,70 +372,591 @@ inline float sqr(float v1) {
     return v1*v1;
 }
 
-/// Square L2 distance between colors at (x1,y1) and at (x2,y2)
-float Image::dist2(int x1,int y1, int x2,int y2) const {
-    float d=0;
-    for(int i=0; i<c; i++)
-        d += sqr((*this)(x1,y1,i)-(*this)(x2,y2,i));
-    return d;
-}
+/// Color weights tabulated by rounded squared distance of guidance colors.
+///
+/// A color weight functor has a method center(x,y) setting the central pixel
+/// and an operator() giving the weight of another pixel. The number of
+/// channels of guidance is \a C, a compile-time constant so that the loop of
+/// the distance is unrolled, or any if 0.
+template <typename T, int C>
+class DistanceWeights {
+public:
+    DistanceWeights(const ImageT<T>& g, const std::vector<float>& k)
+    : guidance(g), kColor(k), maxColor(static_cast<int>(k.size())-1),
+      sc(g.channelStep()), p1(0) {}
+    void center(int x, int y) { p1 = guidance.row(y)+x*guidance.step(); }
+    /// Weight of color at (x2,y2) to the central one
+    float operator()(int x2, int y2) const {
+        const T* p2 = guidance.row(y2)+x2*guidance.step();
+        float d2=0;
+        for(int i=0; i<(C? C: guidance.channels()); i++)
+            d2 += sqr(p1[i*sc]-p2[i*sc]);
+        return kColor[std::min(static_cast<int>(d2+0.5f),maxColor)];
+    }
+private:
+    const ImageT<T>& guidance;
+    const std::vector<float>& kColor;
+    int maxColor;
+    ptrdiff_t sc;  ///< Offset between channels of guidance
+    const T* p1;   ///< Central pixel
+};
+
+/// Color weights of guidance quantized on a palette, tabulated by pair of
+/// palette indices.
+class PaletteWeights {
+public:
+    PaletteWeights(const std::vector<unsigned short>& index, int width,
+                   const std::vector<float>& k, int colors)
+    : idx(index), w(width), kPair(k), n(colors), row(0) {}
+    void center(int x, int y) { row = &kPair[idx[y*w+x]*n]; }
+    /// Weight of color at (x2,y2) to the central one
+    float operator()(int x2, int y2) const { return row[idx[y2*w+x2]]; }
+private:
+    const std::vector<unsigned short>& idx;
+    int w;
+    const std::vector<float>& kPair;
+    int n;
+    const float* row; ///< Weights to central color
+};
 
-/// @brief Compute weighted histogram of image values.
+/// @brief Compute weighted histogram of values of image \a im.
 ///
-/// The area is [x-radius,x+radius]x[y-radius,y+radius] (inter image).
-/// Values are shifted by \a vMin.
-/// Weights are computed from the \a guidance image with factors \a sSpace for
-/// spatial distance and \a sColor for color distance to central pixel.
-void Image::weighted_histo(std::vector<float>& tab, int x, int y, int radius,
-                           int vMin, const Image& guidance,
-                           float sSpace, float sColor) const {
+/// The area is [x-radius,x+radius]x[y-radius,y+radius] (inter image), of
+/// which the pixels at offsets multiple of \a step are sampled, \a radius
+/// being here in samples.
+/// Values are rounded and shifted by \a vMin.
+/// A weight is the product of the spatial kernel \a kSpace, of dimension
+/// (2radius+1)^2, and of the \a color weight to the central pixel.
+template <typename T, class W>
+static void weighted_histo(const ImageT<T>& im, std::vector<float>& tab,
+                           int x, int y, int radius, int step, int vMin,
+                           const float* kSpace, W color) {
     std::fill(tab.begin(), tab.end(), 0.0f);
-    for(int dy=-radius; dy<=radius; dy++)
-        if(0<=y+dy && y+dy<h)
-            for(int dx=-radius; dx<=radius; dx++)
-                if(0<=x+dx && x+dx<w) {
-                    float w = exp(-(dx*dx+dy*dy)*sSpace
-                                  -guidance.dist2(x,y,x+dx,y+dy)*sColor);
-                    tab[static_cast<int>((*this)(x+dx,y+dy))-vMin] += w;
-                }
+    color.center(x,y);
+    const int dx0=std::max(-radius,-(x/step));
+    const int dx1=std::min(radius,(im.width()-1-x)/step);
+    const int dy0=std::max(-radius,-(y/step));
+    const int dy1=std::min(radius,(im.height()-1-y)/step);
+    const ptrdiff_t px=im.step()*static_cast<ptrdiff_t>(step);
+    for(int dy=dy0; dy<=dy1; dy++) {
+        const int yy=y+dy*step;
+        const T* v = im.row(yy)+(x+dx0*step)*im.step();
+        const float* k = kSpace+(dy+radius)*(2*radius+1)+radius;
+        for(int dx=dx0; dx<=dx1; dx++, v+=px) {
+            float w = k[dx]*color(x+dx*step,yy);
+            tab[static_cast<int>(std::floor(*v+0.5f))-vMin] += w;
+        }
+    }
 }
 
 /// Index in histogram \a tab reaching median.
+///
+/// The size of \a tab is a multiple of VSIZE, padded with zeros. The total is
+/// summed by SIMD_NAME vectors, then the cumulative sum skips whole vectors
+/// before the median, which is found inside its vector.
 static int median_histo(const std::vector<float>& tab) {
-    float sum=std::accumulate(tab.begin(), tab.end(), 0.0f)/2;
-    int d=-1;
-    for(float cumul=0; cumul<sum;)
-        cumul += tab[++d];
+    const int n=static_cast<int>(tab.size());
+    const float* t=&tab[0];
+    vfloat v=vset(0);
+    for(int i=0; i<n; i+=VSIZE)
+        v = vadd(v, vload(t+i));
+    const float sum=vsum(v)/2;
+    float cumul=0;
+    int d=0;
+    for(float next; d+VSIZE<n && (next=cumul+vsum(vload(t+d)))<sum; d+=VSIZE)
+        cumul = next;
+    for(--d; cumul<sum && d+1<n;)
+        cumul += t[++d];
     return d;
 }
 
-/// @brief Weighted median filter of current image.
+/// Pixels of the list of weighted_median distributed together to a thread
+static const int MEDIAN_BLOCK=16;
+
+/// Blocks of pixels of weighted_median, run by a parallel loop, each thread
+/// with its histogram.
+template <typename T, class W>
+class MedianBlocks : public ParallelBody {
+public:
+    MedianBlocks(const ImageT<T>& im_, const std::vector<int>& list_,
+                 int vMin_, int vMax_, int radius_, int step_,
+                 const float* kSpace_, const W& color_, std::vector<T>& out_,
+                 ProgressStep& progress_)
+    : im(im_), list(list_), vMin(vMin_), radius(radius_), step(step_),
+      kSpace(kSpace_),
+      color(color_), out(out_), progress(progress_),
+      tabs(parallelThreads(), // Padded for SIMD
+           std::vector<float>((vMax_-vMin_+VSIZE)/VSIZE*VSIZE))
+#ifdef WORK_COUNTERS
+    , bins(parallelThreads(), 0)
+#endif
+    {}
+    void run(int b, int thread);
+#ifdef WORK_COUNTERS
+    double binsScanned() const;
+#endif
+private:
+    const ImageT<T>& im;
+    const std::vector<int>& list;
+    const int vMin, radius, step; ///< Radius in samples, at step pixels
+    const float* kSpace;
+    const W& color;
+    std::vector<T>& out;
+    ProgressStep& progress;
+    std::vector< std::vector<float> > tabs; ///< Histogram of each thread
+#ifdef WORK_COUNTERS
+    std::vector<double> bins; ///< Bins read by median_histo, by thread
+#endif
+};
+
+/// Block \a b.
+template <typename T, class W>
+void MedianBlocks<T,W>::run(int b, int thread) {
+    if(computationCancelled())
+        return;
+    TraceSpan span("median block", b);
+    std::vector<float>& tab = tabs[thread];
+    const int n=static_cast<int>(list.size()), w=im.width();
+    const int end=std::min(n,(b+1)*MEDIAN_BLOCK);
+    for(int i=b*MEDIAN_BLOCK; i<end; i++) {
+        const int x=list[i]%w, y=list[i]/w;
+        weighted_histo(im, tab, x,y, radius, step, vMin, kSpace, color);
+        const int d = median_histo(tab);
+        out[i] = static_cast<T>(vMin+d);
+#ifdef WORK_COUNTERS
+        bins[thread] += tab.size()+d+1; // Total, then cumulative to median
+#endif
+    }
+    progress.advance(end-b*MEDIAN_BLOCK);
+}
+
+#ifdef WORK_COUNTERS
+/// Bins of the histograms read by all threads.
+template <typename T, class W>
+double MedianBlocks<T,W>::binsScanned() const {
+    double total=0;
+    for(size_t i=0; i<bins.size(); i++)
+        total += bins[i];
+    return total;
+}
+#endif
+
+/// Side of the square tiles by which weighted_median visits its pixels
+static const int MEDIAN_TILE=16;
+
+/// Order of pixel indices of an image of width \a w by tile of MEDIAN_TILE
+/// pixels, rows of tiles first, then row-major inside a tile.
+class TileLess {
+public:
+    explicit TileLess(int width): w(width) {}
+    bool operator()(int p, int q) const {
+        const int yp=p/w, yq=q/w;
+        if(yp/MEDIAN_TILE != yq/MEDIAN_TILE)
+            return yp < yq;
+        const int xp=p%w/MEDIAN_TILE, xq=q%w/MEDIAN_TILE;
+        return (xp != xq)? xp < xq: p < q;
+    }
+private:
+    int w;
+};
+
+/// Weighted median of pixels of \a im in \a pixels, replacing them.
+///
+/// The list is visited by square tiles, so that the windows of consecutive
+/// pixels overlap in 2D: occluded pixels form vertical bands, whose pixels
+/// would be far apart in row order. It is distributed dynamically to threads,
+/// by blocks. The medians are buffered and written at the end, so that the
+/// windows read only original values: the order does not change the result.
+template <typename T, class W>
+static void weighted_median(ImageT<T>& im, const std::vector<int>& pixels,
+                            int vMin, int vMax, int radius, int step,
+                            const float* kSpace, const W& color) {
+    const int n=static_cast<int>(pixels.size()), w=im.width();
+    std::vector<int> list(pixels);
+    std::sort(list.begin(), list.end(), TileLess(w));
+    std::vector<T> out(n);
+    const int nBlocks=(n+MEDIAN_BLOCK-1)/MEDIAN_BLOCK;
+    ProgressStep progress("median", n);
+    MedianBlocks<T,W> blocks(im, list, vMin, vMax, radius, step, kSpace,
+                             color, out, progress);
+    parallelFor(nBlocks, blocks, ParallelDynamic);
+#ifdef WORK_COUNTERS
+    addCount("median pixels", n);
+    addCount("median bins", blocks.binsScanned());
+#endif
+    for(int i=0; i<n; i++)
+        im(list[i]%w,list[i]/w) = out[i];
+}
+
+/// Order of pixels by one channel of their colors, for medianCut.
+class ChannelLess {
+public:
+    ChannelLess(const float* colors, int channels, int channel)
+    : col(colors), c(channels), k(channel) {}
+    bool operator()(int a, int b) const { return col[a*c+k]<col[b*c+k]; }
+private:
+    const float* col;
+    int c, k;
+};
+
+/// Box of colors in medianCut: pixels [begin,end) of the order.
+struct ColorBox {
+    int begin, end;
+    int channel; ///< Channel of largest range
+    float range; ///< Largest range of the channels
+};
+
+/// Bounding box of colors of pixels [begin,end) of \a order.
+static ColorBox colorBox(const std::vector<float>& col, int c,
+                         const std::vector<int>& order, int begin, int end) {
+    ColorBox box = {begin, end, 0, 0};
+    for(int k=0; k<c; k++) {
+        float lo=col[order[begin]*c+k], hi=lo;
+        for(int i=begin+1; i<end; i++) {
+            const float v=col[order[i]*c+k];
+            lo = std::min(lo,v);
+            hi = std::max(hi,v);
+        }
+        if(hi-lo > box.range) {
+            box.range = hi-lo;
+            box.channel = k;
+        }
+    }
+    return box;
+}
+
+/// @brief Color quantization by median cut (Heckbert, 1982).
+///
+/// The box of largest range of colors is split at the median of its widest
+/// channel, until there are \a nColors boxes or all boxes have a single
+/// color. The mean colors of the boxes are appended to \a palette, channels
+/// being interlaced. Return the image of palette indices.
+template <typename T>
+ImageT<T> ImageT<T>::medianCut(int nColors, std::vector<T>& palette) const {
+    assert(nColors>0);
+    const int n=w*h;
+    std::vector<float> col(static_cast<size_t>(n)*c);
+    std::vector<int> order(n);
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            order[y*w+x] = y*w+x;
+            for(int k=0; k<c; k++)
+                col[(y*w+x)*c+k] = static_cast<float>((*this)(x,y,k));
+        }
+    std::vector<ColorBox> boxes(1, colorBox(col,c, order, 0,n));
+    while(static_cast<int>(boxes.size()) < nColors) {
+        int b=0;
+        for(size_t i=1; i<boxes.size(); i++)
+            if(boxes[i].range > boxes[b].range)
+                b = static_cast<int>(i);
+        if(boxes[b].range <= 0)
+            break;
+        const ColorBox box=boxes[b];
+        const int mid=(box.begin+box.end)/2;
+        std::nth_element(order.begin()+box.begin, order.begin()+mid,
+                         order.begin()+box.end,
+                         ChannelLess(&col[0], c, box.channel));
+        boxes[b] = colorBox(col,c, order, box.begin,mid);
+        boxes.push_back(colorBox(col,c, order, mid,box.end));
+    }
+    ImageT index(w,h);
+    for(size_t b=0; b<boxes.size(); b++) {
+        std::vector<double> mean(c,0.0);
+        for(int i=boxes[b].begin; i<boxes[b].end; i++) {
+            const int p=order[i];
+            index(p%w,p/w) = static_cast<T>(b);
+            for(int k=0; k<c; k++)
+                mean[k] += col[p*c+k];
+        }
+        for(int k=0; k<c; k++)
+            palette.push_back(static_cast<T>(mean[k]/
+                                             (boxes[b].end-boxes[b].begin)));
+    }
+    return index;
+}
+
+/// @brief Weighted median filter of current image, in place.
 ///
 /// Image is assumed to have integer values in [vMin,vMax]. Weights are computed
-/// as in bilateral filter in color image \a guidance. Only pixels of image
-/// \a where outside [vMin,vMax] are filtered.
-Image Image::weightedMedian(const Image& guidance,
-                            const Image& where, int vMin, int vMax,
-                            int radius, float sSpace, float sColor) const {
-    assert(where.c==1);
+/// as in bilateral filter in color image \a guidance. Only occluded pixels of
+/// \a where are filtered, from the values of the image around them. If
+/// \a palette is positive, the guidance is first quantized on this number of
+/// colors by medianCut, so that color weights are tabulated by pair of palette
+/// colors. If \a step>1, only the pixels of the window at offsets multiple of
+/// \a step are sampled, with the spatial weights of their offsets, so that a
+/// radius step times larger has about the same cost.
+template <typename T>
+void ImageT<T>::weightedMedian(const ImageT& guidance,
+                               const OcclusionMask& where, int vMin, int vMax,
+                               int radius, float sSpace, float sColor,
+                               int palette, int step) {
+    assert(where.width()==w && where.height()==h && step>=1);
     sSpace = 1.0f/(sSpace*sSpace);
     sColor = 1.0f/(sColor*sColor);
+    radius /= step; // In samples
+    const int dim=2*radius+1;
+    std::vector<float> kSpace(dim*dim);
+    for(int dy=-radius; dy<=radius; dy++)
+        for(int dx=-radius; dx<=radius; dx++)
+            kSpace[(dy+radius)*dim+dx+radius] =
+                exp(-(dx*dx+dy*dy)*step*step*sSpace);
 
-    const int size=vMax-vMin+1;
-    std::vector<float> tab(size);
-    Image M(w,h);
+    // Work list of pixels to filter, clustered along occluding borders
+    const std::vector<int> list = where.pixels();
+    if(list.empty())
+        return;
 
-#ifdef _OPENMP
-#pragma omp parallel for firstprivate(tab)
-#endif
+    if(palette > 0) {
+        std::vector<T> colors;
+        ImageT index = guidance.medianCut(std::min(palette,65536), colors);
+        const int n=static_cast<int>(colors.size())/guidance.c;
+        std::vector<unsigned short> idx(static_cast<size_t>(w)*h);
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++)
+                idx[y*w+x] = static_cast<unsigned short>(index(x,y));
+        std::vector<float> kPair(n*n);
+        for(int i=0; i<n; i++)
+            for(int j=0; j<n; j++) {
+                float d2=0;
+                for(int k=0; k<guidance.c; k++)
+                    d2 += sqr(colors[i*guidance.c+k]-colors[j*guidance.c+k]);
+                kPair[i*n+j] = exp(-d2*sColor);
+            }
+        weighted_median(*this, list, vMin, vMax, radius, step, &kSpace[0],
+                        PaletteWeights(idx,w,kPair,n));
+        return;
+    }
+    // Color kernel by squared distance, as in 8 bits
+    std::vector<float> kColor(guidance.c*255*255+1);
+    for(size_t d=0; d<kColor.size(); d++)
+        kColor[d] = exp(-(d*sColor));
+    switch(guidance.c) {
+    case 1:
+        weighted_median(*this, list, vMin, vMax, radius, step, &kSpace[0],
+                        DistanceWeights<T,1>(guidance,kColor));
+        break;
+    case 3:
+        weighted_median(*this, list, vMin, vMax, radius, step, &kSpace[0],
+                        DistanceWeights<T,3>(guidance,kColor));
+        break;
+    case 4:
+        weighted_median(*this, list, vMin, vMax, radius, step, &kSpace[0],
+                        DistanceWeights<T,4>(guidance,kColor));
+        break;
+    default:
+        weighted_median(*this, list, vMin, vMax, radius, step, &kSpace[0],
+                        DistanceWeights<T,0>(guidance,kColor));
+    }
+}
+
+/// Levels of quantization per channel of guidance in weightedMedianFast
+static const int WMF_LEVELS=16;
+
+/// Joint histogram of (value,color bin) of a window, for weightedMedianFast.
+///
+/// The non-empty color bins are linked in a list (necklace table). For each
+/// bin, the balance is the number of its pixels of value at most the current
+/// median index m minus the number of the others.
+class JointHistogram {
+public:
+    JointHistogram(int nValues, int nBins);
+    void add(int i, int b, int inc);
+    void clear();
+    void weights(int g, int gc, int levels, const std::vector<float>& weight);
+    int median();
+private:
+    int n;  ///< Number of color bins, also head of necklace
+    int m;  ///< Current median index
+    std::vector<int> H;             ///< Counts by value and bin
+    std::vector<int> balance, count; ///< Balance and count of bins
+    std::vector<int> next, prev;    ///< Necklace of non-empty bins
+    std::vector<float> wb;          ///< Weights of bins to central pixel
+};
+
+/// Constructor for values in [0,nValues) and \a nBins color bins.
+JointHistogram::JointHistogram(int nValues, int nBins)
+: n(nBins), m(0), H(static_cast<size_t>(nValues)*nBins),
+  balance(nBins), count(nBins), next(nBins+1,nBins), prev(nBins+1,nBins),
+  wb(nBins) {}
+
+/// Add \a inc (+1 or -1) pixels of value index \a i and color bin \a b.
+inline void JointHistogram::add(int i, int b, int inc) {
+    H[i*n+b] += inc;
+    balance[b] += (i<=m)? inc: -inc;
+    if(inc>0 && count[b]++==0) { // Insert in necklace
+        next[b]=next[n]; prev[b]=n;
+        prev[next[n]]=b; next[n]=b;
+    }
+    if(inc<0 && --count[b]==0) { // Remove from necklace
+        next[prev[b]]=next[b]; prev[next[b]]=prev[b];
+    }
+}
+
+/// Empty the histogram.
+void JointHistogram::clear() {
+    for(int b=next[n]; b!=n; b=next[b]) {
+        for(size_t k=b; k<H.size(); k+=n)
+            H[k] = 0;
+        balance[b] = count[b] = 0;
+    }
+    next[n] = prev[n] = n;
+}
+
+/// Weights of non-empty bins to central bin \a g, from table \a weight by
+/// squared distance of bins. Bins have \a gc coordinates in [0,levels).
+void JointHistogram::weights(int g, int gc, int levels,
+                             const std::vector<float>& weight) {
+    for(int b=next[n]; b!=n; b=next[b]) {
+        int d2=0;
+        for(int k=0, c=b, c0=g; k<gc; k++, c/=levels, c0/=levels)
+            d2 += (c%levels-c0%levels)*(c%levels-c0%levels);
+        wb[b] = weight[d2];
+    }
+}
+
+/// Weighted median index, the first one where the weighted balance is
+/// non-negative. It is tracked from the previous median.
+int JointHistogram::median() {
+    const int size=static_cast<int>(H.size())/n;
+    double bal=0;
+    for(int b=next[n]; b!=n; b=next[b])
+        bal += wb[b]*balance[b];
+    while(bal<0 && m+1<size) {
+        const int* Hm = &H[(++m)*n];
+        for(int b=next[n]; b!=n; b=next[b])
+            if(Hm[b]) {
+                balance[b] += 2*Hm[b];
+                bal += 2*wb[b]*Hm[b];
+            }
+    }
+    while(m>0) {
+        const int* Hm = &H[m*n];
+        double delta=0;
+        for(int b=next[n]; b!=n; b=next[b])
+            delta += wb[b]*Hm[b];
+        if(bal-2*delta < 0)
+            break;
+        bal -= 2*delta;
+        for(int b=next[n]; b!=n; b=next[b])
+            balance[b] -= 2*Hm[b];
+        --m;
+    }
+    return m;
+}
+
+/// Rows of ImageT::weightedMedianFast, run by a parallel loop, each thread
+/// with its joint histogram.
+template <typename T>
+class MedianRows : public ParallelBody {
+public:
+    MedianRows(ImageT<T>& im_, const OcclusionMask& where_, int vMin_,
+               int vMax_, int radius_, int nBins, int gc_, int levels_,
+               const std::vector<int>& bin_, const std::vector<int>& val_,
+               const std::vector<float>& weight_, ProgressStep& progress_)
+    : im(im_), where(where_), vMin(vMin_), radius(radius_), gc(gc_),
+      levels(levels_), bin(bin_), val(val_), weight(weight_),
+      progress(progress_),
+      histos(parallelThreads(), JointHistogram(vMax_-vMin_+1, nBins)) {}
+    void run(int y, int thread);
+private:
+    ImageT<T>& im;
+    const OcclusionMask& where;
+    const int vMin, radius, gc, levels;
+    const std::vector<int> &bin, &val;
+    const std::vector<float>& weight;
+    ProgressStep& progress;
+    std::vector<JointHistogram> histos; ///< Histogram of each thread
+};
+
+/// Row \a y.
+template <typename T>
+void MedianRows<T>::run(int y, int thread) {
+    if(computationCancelled())
+        return;
+    TraceSpan span("median row", y);
+    JointHistogram& histo = histos[thread];
+    const int w=im.width(), h=im.height();
+    const int y0=std::max(0,y-radius), y1=std::min(h-1,y+radius);
+    int xw=-1; // Current window is the one of xw, none if negative
+    for(int x=where.next(0,y,true); x<w; x=where.next(x+1,y,true)) {
+        if(xw>=0 && x-xw>2*radius+1) { // Rebuild rather than slide
+            histo.clear();
+            xw = -1;
+        }
+        const int x0 = (xw<0)? std::max(0,x-radius): // Columns to add
+            std::min(w,xw+radius+1);
+        for(int xs=x0; xs<=x+radius && xs<w; xs++)
+            for(int j=y0; j<=y1; j++)
+                histo.add(val[j*w+xs], bin[j*w+xs], +1);
+        if(xw>=0) // Columns to remove
+            for(int xs=std::max(0,xw-radius); xs<x-radius; xs++)
+                for(int j=y0; j<=y1; j++)
+                    histo.add(val[j*w+xs], bin[j*w+xs], -1);
+        xw = x;
+        histo.weights(bin[y*w+x], gc, levels, weight);
+        im(x,y) = static_cast<T>(vMin+histo.median());
+    }
+    histo.clear();
+    progress.advance(w);
+}
+
+/// @brief Weighted median filter of current image in constant time, in place.
+///
+/// Approximation of weightedMedian with the joint histogram of Zhang et al.
+/// (2014): the colors of \a guidance, in [0,255], are quantized on WMF_LEVELS
+/// levels per channel (all 256 for gray) and the spatial kernel is the box
+/// window, so that the weights only depend on the pair of color bins. Along a
+/// run of pixels to filter, the window slides instead of being refilled: the
+/// columns leaving and entering it are updated in the histogram, and the
+/// median is tracked from the one of the previous pixel. The window is
+/// rebuilt after a gap wider than itself. The cost per pixel is linear in
+/// \a radius, instead of quadratic, and independent of the number of values.
+/// The windows read the values of the image before filtering.
+template <typename T>
+void ImageT<T>::weightedMedianFast(const ImageT& guidance,
+                                   const OcclusionMask& where,
+                                   int vMin, int vMax, int radius,
+                                   float sColor) {
+    assert(where.width()==w && where.height()==h);
+    const int gc=guidance.c, levels=(gc==1? 256: WMF_LEVELS);
+    const float q=256.0f/levels; // Quantization step
+    int nBins=1;
+    for(int k=0; k<gc; k++)
+        nBins *= levels;
+    // Color bins of guidance and value indices of image
+    std::vector<int> bin(static_cast<size_t>(w)*h), val(bin.size());
     for(int y=0; y<h; y++)
         for(int x=0; x<w; x++) {
-            if(vMin<=where(x,y) && where(x,y)<=vMax) {
-                M(x,y)=(*this)(x,y);
-                continue;
+            int b=0;
+            for(int k=gc-1; k>=0; k--) {
+                int l = static_cast<int>(guidance(x,y,k)/q);
+                b = b*levels + std::min(levels-1,std::max(0,l));
             }
-            weighted_histo(tab, x,y, radius, vMin, guidance, sSpace, sColor);
-            M(x,y) = static_cast<float>(vMin+median_histo(tab));
+            bin[y*w+x] = b;
+            val[y*w+x] = static_cast<int>(std::floor((*this)(x,y)+.5f))-vMin;
         }
-    return M;
+    // Weight by squared distance of bins, in quantization steps
+    sColor = 1.0f/(sColor*sColor);
+    std::vector<float> weight(gc*(levels-1)*(levels-1)+1);
+    for(size_t d2=0; d2<weight.size(); d2++)
+        weight[d2] = exp(-(d2*q*q)*sColor);
+
+    ProgressStep progress("median", static_cast<long>(w)*h);
+    MedianRows<T> rows(*this, where, vMin, vMax, radius, nBins, gc, levels,
+                       bin, val, weight, progress);
+    parallelFor(h, rows, ParallelDynamic);
 }
+
+// Filters of float images
+template Image Image::gradX() const;
+template Image Image::reduce(int) const;
+template void Image::fillMinX(float);
+template void Image::fillMaxX(float);
+template void Image::fillMinX(const OcclusionMask&, float);
+template void Image::fillMaxX(const OcclusionMask&, float);
+template Image Image::median(int) const;
+template Image Image::medianCut(int, std::vector<float>&) const;
+template void Image::weightedMedian(const Image&, const OcclusionMask&,
+                                    int, int, int, float, float, int, int);
+template void Image::weightedMedianFast(const Image&, const OcclusionMask&,
+                                        int, int, int, float);
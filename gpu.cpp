@@ -0,0 +1,456 @@
+/**
+ * @file gpu.cpp
+ * @brief Adaptive weights disparity computed on GPU by OpenMP offloading
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gpu.h"
+#include "disparity.h"
+#include "occlusion.h"
+#include "image.h"
+#include <algorithm>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <iostream>
+
+#ifdef _OPENMP
+#pragma omp declare target
+#endif
+/// Absolute value, with no library call on the device.
+inline float absf(float v) { return v<0? -v: v; }
+
+/// Gray level of pixel i of image \a im with \a c channels, as Image::gray.
+inline float grayAt(const float* im, int c, size_t i) {
+    if(c != 3)
+        return im[i*c];
+    return (6969*im[3*i] + 23434*im[3*i+1] + 2365*im[3*i+2]) / 32768;
+}
+
+/// Combination of weights \a w1 and \a w2 of type \a comb.
+inline float combine(int comb, float w1, float w2) {
+    switch(comb) {
+    case ParamDisparity::CombineLeft: return w1;
+    case ParamDisparity::CombineMax:  return w1<w2? w2: w1;
+    case ParamDisparity::CombineMin:  return w1<w2? w1: w2;
+    case ParamDisparity::CombinePlus: return w1+w2;
+    default: break;
+    }
+    return w1*w2;
+}
+
+/// Nearest integer of \a v, std::floor(v+0.5f) with no library call.
+inline int roundi(float v) {
+    const float f = v+0.5f;
+    const int i = static_cast<int>(f);
+    return (i>f)? i-1: i;
+}
+#ifdef _OPENMP
+#pragma omp end declare target
+#endif
+
+/// Whether the aggregation of \a param runs on the GPU: AD+gradient raw
+/// cost without vertical offset or search.
+bool gpuSupports(const ParamDisparity& param) {
+    return (param.rawCost==ParamDisparity::CostADGrad &&
+            param.offsetY==0 && param.searchY==0);
+}
+
+/// Adaptive Weights disparity computation offloaded to an accelerator.
+///
+/// All stages run in OpenMP target regions: x-derivatives, raw costs, support
+/// weights and aggregation, and the winner-take-all of both images. Only the
+/// images and the tables of color and spatial weights are copied to the
+/// device and the disparity maps back; the raw and aggregated cost volumes
+/// stay in device memory. The support weights of both pixels are computed for
+/// each tap instead of being shared, which suits the device better. Without
+/// offloading support in the compiler, or with no device, the regions run on
+/// the host threads. The raw cost is the AD+gradient one in float; options of
+/// storage, tiling, vectorization and fixed point in \a param do not apply.
+/// Results equal those of disparityAW up to float rounding.
+/// \param im1,im2 the two color images
+/// \param dMin,dMax disparity range
+/// \param param raw cost computation parameters
+/// \param disp1 output disparity map from image 1 to image 2
+/// \param disp2 output disparity map from image 2 to image 1
+void disparityAW_gpu(Image im1, Image im2,
+                     int dMin, int dMax, const ParamDisparity& param,
+                     Image& disp1, Image& disp2) {
+    GpuPair pair;
+    pair.compute(im1, im2, dMin, dMax, param, disp1, disp2);
+}
+
+/// Disparity maps \a disp1 and \a disp2 of disparityAW_gpu. With \a keep,
+/// image 1, the maps and the memory of the aggregated costs stay on the
+/// device for check(). The aggregations not supported by the GPU run on the
+/// CPU, and then nothing is kept.
+void GpuPair::compute(Image im1, Image im2, int dMin, int dMax,
+                      const ParamDisparity& param, Image& disp1, Image& disp2,
+                      bool keep) {
+    release();
+    if(param.rawCost != ParamDisparity::CostADGrad) {
+        std::cerr << "Warning: GPU is only for AD+gradient raw cost, "
+                  << "using CPU" << std::endl;
+        disparityAW(im1, im2, dMin, dMax, param, disp1, disp2);
+        return;
+    }
+    if(param.offsetY!=0 || param.searchY!=0) {
+        std::cerr << "Warning: GPU matches rows of same index, "
+                  << "using CPU" << std::endl;
+        disparityAW(im1, im2, dMin, dMax, param, disp1, disp2);
+        return;
+    }
+    const int w=im1.width(), h=im1.height(), c=im1.channels();
+    const int nd=dMax-dMin+1, n=w*h;
+    this->w = w; this->h = h; this->c = c;
+    this->dMin = dMin; this->dMax = dMax;
+    const int s=param.stride, r=param.radius/s, dim=2*r+1, comb=param.comb;
+    const bool hoisted = (comb==ParamDisparity::CombineMult ||
+                          comb==ParamDisparity::CombineLeft); // As Comb
+    const float tauCol=param.tauCol, tauGrad=param.tauGrad;
+    const float alpha=param.alpha;
+    const size_t nv = static_cast<size_t>(n)*nd; // Size of volumes
+
+    // Tables of color and spatial weights, as in disparityAW
+    const int nC = c*255+1;
+    std::vector<float> tabC(nC), tabP(dim*dim);
+    const float e2=exp(-1/(c*param.gammaCol));
+    tabC[0] = 1.0f;
+    for(int i=1; i<nC; i++)
+        tabC[i] = e2*tabC[i-1];
+    for(int y=-r, i=0; y<=r; y++)
+        for(int x=-r; x<=r; x++, i++)
+            tabP[i] = exp(-2.0f*s*sqrt((float)(x*x+y*y))/param.gammaPos);
+
+    // Contiguous copies of images for transfer to the device
+    pix1.resize(n*c);
+    std::vector<float> pix2(n*c);
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            for(int k=0; k<c; k++) {
+                pix1[(y*w+x)*c+k] = im1(x,y,k);
+                pix2[(y*w+x)*c+k] = im2(x,y,k);
+            }
+    const float *I1=&pix1[0], *I2=&pix2[0], *dC=&tabC[0], *dP=&tabP[0];
+    out1.resize(n);
+    out2.resize(n);
+    float *D1=&out1[0], *D2=&out2[0];
+    float* G = new float[2*n];   // Gradients of both images (device only)
+    float* C = new float[nv];    // Raw costs (device only)
+    float* A = this->A = new float[nv]; // Aggregated costs (device only)
+    const float invalid = static_cast<float>(dMin-1);
+
+    // Mapped until the end of the function, or of median() for I1, A, D1, D2
+#ifdef _OPENMP
+#pragma omp target enter data map(to: I1[0:n*c], I2[0:n*c], dC[0:nC], \
+                                      dP[0:dim*dim]) \
+                              map(alloc: G[0:2*n], C[0:nv], A[0:nv], \
+                                         D1[0:n], D2[0:n])
+#endif
+    // x-derivatives of gray levels, as Image::gradX
+#ifdef _OPENMP
+#pragma omp target teams distribute parallel for collapse(2)
+#endif
+    for(int k=0; k<2; k++)
+        for(int i=0; i<n; i++) {
+            const float* I = k? I2: I1;
+            const int x=i%w, x0=std::max(0,x-1), x1=std::min(w-1,x+1);
+            const float g = grayAt(I,c,i-x+x1)-grayAt(I,c,i-x+x0);
+            G[k*n+i] = (x1-x0==2)? .5f*g: g;
+        }
+
+    // Raw costs, layer d-dMin of pixels x with x+d inside image
+#ifdef _OPENMP
+#pragma omp target teams distribute parallel for collapse(2)
+#endif
+    for(int d=0; d<nd; d++)
+        for(int i=0; i<n; i++) {
+            const int x=i%w, xq=x+d+dMin;
+            if(xq<0 || xq>=w)
+                continue;
+            const int j=i+d+dMin;
+            float costColor=0;
+            for(int k=0; k<c; k++)
+                costColor += absf(I1[i*c+k]-I2[j*c+k]);
+            costColor /= (float)c;
+            if(costColor > tauCol)
+                costColor = tauCol;
+            float costGrad = absf(G[i]-G[n+j]);
+            if(costGrad > tauGrad)
+                costGrad = tauGrad;
+            C[d*static_cast<size_t>(n)+i] = (1-alpha)*costColor+alpha*costGrad;
+        }
+
+    // Aggregation in the part of the window inside both images
+#ifdef _OPENMP
+#pragma omp target teams distribute parallel for collapse(2)
+#endif
+    for(int d=0; d<nd; d++)
+        for(int i=0; i<n; i++) {
+            const int xp=i%w, yp=i/w, xq=xp+d+dMin;
+            float* a = A+d*static_cast<size_t>(n)+i;
+            if(xq<0 || xq>=w) {
+                *a = std::numeric_limits<float>::max();
+                continue;
+            }
+            const int xm=std::min(xp,xq), xM=std::max(xp,xq);
+            const int x0=std::max(-r,-(xm/s)), x1=std::min(r,(w-1-xM)/s);
+            const int y0=std::max(-r,-(yp/s)), y1=std::min(r,(h-1-yp)/s);
+            const float* e = C+d*static_cast<size_t>(n);
+            const int j=i+d+dMin;
+            float num=0, den=0;
+            for(int y=y0; y<=y1; y++)
+                for(int x=x0; x<=x1; x++) {
+                    const int o = y*s*w+x*s; // Offset of tap
+                    float d1=0, d2=0;
+                    for(int k=0; k<c; k++) {
+                        d1 += absf(I1[(i+o)*c+k]-I1[i*c+k]);
+                        d2 += absf(I2[(j+o)*c+k]-I2[j*c+k]);
+                    }
+                    const float wp=dC[(int)d1], wq=dC[(int)d2];
+                    const float dp=dP[(y+r)*dim+x+r];
+                    const float wt = hoisted? combine(comb, dp*wp, wq):
+                                              dp*combine(comb, wp, wq);
+                    num += wt*e[i+o];
+                    den += wt;
+                }
+            *a = num/den;
+        }
+
+    // Winner-take-all in both images
+#ifdef _OPENMP
+#pragma omp target teams distribute parallel for
+#endif
+    for(int i=0; i<n; i++) {
+        const int x=i%w;
+        float E1=std::numeric_limits<float>::max(), E2=E1;
+        D1[i] = D2[i] = invalid;
+        for(int d=0; d<nd; d++) {
+            const float* a = A+d*static_cast<size_t>(n);
+            if(a[i] < E1) { // Pixel x of image 1 matched to x+d
+                E1 = a[i];
+                D1[i] = static_cast<float>(d+dMin);
+            }
+            const int xp=x-d-dMin; // Pixel x of image 2 matched from xp
+            if(0<=xp && xp<w && a[i-d-dMin] < E2) {
+                E2 = a[i-d-dMin];
+                D2[i] = -static_cast<float>(d+dMin);
+            }
+        }
+    }
+#ifdef _OPENMP
+#pragma omp target update from(D1[0:n], D2[0:n])
+#pragma omp target exit data map(delete: I2[0:n*c], dC[0:nC], dP[0:dim*dim], \
+                                         G[0:2*n], C[0:nv])
+#endif
+    delete [] G;
+    delete [] C;
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            if(out1[y*w+x] != invalid)
+                disp1(x,y) = out1[y*w+x];
+            if(out2[y*w+x] != invalid)
+                disp2(x,y) = out2[y*w+x];
+        }
+    if(! keep)
+        release();
+}
+
+/// Left-right check on the device, as detect_occlusion: the pixels of map 1
+/// inconsistent with map 2, or invalid, are set to dMin-1 and marked
+/// occluded. The checked map is copied in \a disp1.
+void GpuPair::check(int tolDisp, Image& disp1) {
+    const int w=this->w, n=w*h;
+    float *D1=&out1[0], *D2=&out2[0];
+    unsigned char* M = this->M = new unsigned char[n];
+    const float vMin=static_cast<float>(dMin), vMax=static_cast<float>(dMax);
+#ifdef _OPENMP
+#pragma omp target enter data map(alloc: M[0:n])
+#pragma omp target teams distribute parallel for
+#endif
+    for(int i=0; i<n; i++) {
+        const int x=i%w, d=roundi(D1[i]);
+        int e = tolDisp+1;
+        if(0<=x+d && x+d<w)
+            e = d+roundi(D2[i+d]);
+        const bool bad = (e<-tolDisp || e>tolDisp ||
+                          !(vMin<=D1[i] && D1[i]<=vMax));
+        M[i] = bad;
+        if(bad)
+            D1[i] = vMin-1;
+    }
+#ifdef _OPENMP
+#pragma omp target update from(D1[0:n])
+#endif
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            disp1(x,y) = out1[y*w+x];
+}
+
+/// Fill occluded pixels along rows on the device, as Image::fillMaxX (or
+/// fillMinX if \a min) with the mask of check(), \a vOut being combined at
+/// the left border. A thread fills a row.
+void GpuPair::fill(bool min, float vOut) {
+    const int w=this->w, h=this->h;
+    float* D1=&out1[0];
+    const unsigned char* M=this->M;
+#ifdef _OPENMP
+#pragma omp target teams distribute parallel for
+#endif
+    for(int y=0; y<h; y++) {
+        float* row = D1+y*w;
+        const unsigned char* occ = M+y*w;
+        for(int x=0; x<w;) {
+            if(! occ[x]) {
+                ++x;
+                continue;
+            }
+            int x1=x+1; // Run [x,x1) of occluded
+            while(x1<w && occ[x1])
+                ++x1;
+            float v = (x>0)? row[x-1]: vOut;
+            if(x1 < w)
+                v = ((row[x1]<v) == min)? row[x1]: v;
+            for(; x<x1; x++)
+                row[x] = v;
+        }
+    }
+}
+
+/// Weighted median of the occluded pixels on the device, as
+/// Image::weightedMedian with the parameters of \a param, guided by the
+/// median of radius 1 of image 1, computed there. The histogram of a pixel
+/// is laid out in the memory of the aggregated costs, with a stride of one
+/// layer, and the medians in that of map 2, so that the windows read only the
+/// filled values. The filled map is copied in \a disp1 and the device memory
+/// released. Palette (\a param.palette) and fast median are not supported.
+void GpuPair::median(const ParamOcclusion& param, Image& disp1) {
+    const int w=this->w, h=this->h, c=this->c, n=w*h;
+    const int nb=dMax-dMin+1, vMin=dMin;
+    const int step=param.median_step, r=param.median_radius/step, dim=2*r+1;
+    const float sSpace=1.0f/(param.sigma_space*param.sigma_space);
+    const float sColor=1.0f/(param.sigma_color*param.sigma_color);
+    std::vector<float> kSpace(dim*dim), kColor(c*255*255+1);
+    for(int dy=-r; dy<=r; dy++)
+        for(int dx=-r; dx<=r; dx++)
+            kSpace[(dy+r)*dim+dx+r] = exp(-(dx*dx+dy*dy)*step*step*sSpace);
+    for(size_t d=0; d<kColor.size(); d++)
+        kColor[d] = exp(-(d*sColor));
+    const int nC=static_cast<int>(kColor.size()), maxColor=nC-1;
+    const float *I1=&pix1[0], *kS=&kSpace[0], *kC=&kColor[0];
+    float *D1=&out1[0], *O=&out2[0], *H=A;
+    const unsigned char* M=this->M;
+    float* G = new float[n*c]; // Guidance (device only)
+
+#ifdef _OPENMP
+#pragma omp target enter data map(to: kS[0:dim*dim], kC[0:nC]) \
+                              map(alloc: G[0:n*c])
+#endif
+    // Guidance, as Image::median(1)
+#ifdef _OPENMP
+#pragma omp target teams distribute parallel for collapse(2)
+#endif
+    for(int i=0; i<n; i++)
+        for(int k=0; k<c; k++) {
+            const int x=i%w, y=i/w;
+            float v[9];
+            int m=0;
+            for(int j=std::max(0,y-1); j<=std::min(h-1,y+1); j++)
+                for(int l=std::max(0,x-1); l<=std::min(w-1,x+1); l++) {
+                    const float u = I1[(j*w+l)*c+k];
+                    int p=m++;
+                    for(; p>0 && u<v[p-1]; p--) // Insertion sort
+                        v[p] = v[p-1];
+                    v[p] = u;
+                }
+            G[i*c+k] = v[m/2];
+        }
+
+    // Weighted histograms of windows and their medians
+#ifdef _OPENMP
+#pragma omp target teams distribute parallel for
+#endif
+    for(int i=0; i<n; i++) {
+        if(! M[i])
+            continue;
+        const int x=i%w, y=i/w;
+        float* t = H+i;
+        for(int b=0; b<nb; b++)
+            t[b*static_cast<size_t>(n)] = 0;
+        const int dx0=std::max(-r,-(x/step)), dx1=std::min(r,(w-1-x)/step);
+        const int dy0=std::max(-r,-(y/step)), dy1=std::min(r,(h-1-y)/step);
+        for(int dy=dy0; dy<=dy1; dy++)
+            for(int dx=dx0; dx<=dx1; dx++) {
+                const int j = i+dy*step*w+dx*step;
+                float d2=0;
+                for(int k=0; k<c; k++) {
+                    const float e = G[i*c+k]-G[j*c+k];
+                    d2 += e*e;
+                }
+                const int dc = static_cast<int>(d2+0.5f);
+                const float wt = kS[(dy+r)*dim+dx+r]*
+                    kC[dc<maxColor? dc: maxColor];
+                t[(roundi(D1[j])-vMin)*static_cast<size_t>(n)] += wt;
+            }
+        float sum=0, cumul=0;
+        for(int b=0; b<nb; b++)
+            sum += t[b*static_cast<size_t>(n)];
+        sum /= 2;
+        int d=-1;
+        while(cumul<sum && d+1<nb)
+            cumul += t[(++d)*static_cast<size_t>(n)];
+        O[i] = static_cast<float>(vMin+d);
+    }
+#ifdef _OPENMP
+#pragma omp target teams distribute parallel for
+#endif
+    for(int i=0; i<n; i++)
+        if(M[i])
+            D1[i] = O[i];
+#ifdef _OPENMP
+#pragma omp target update from(D1[0:n])
+#pragma omp target exit data map(delete: kS[0:dim*dim], kC[0:nC], G[0:n*c])
+#endif
+    delete [] G;
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            disp1(x,y) = out1[y*w+x];
+    release();
+}
+
+/// Free the device memory of the pair.
+void GpuPair::release() {
+    if(! A)
+        return;
+    const int n=w*h;
+    const size_t nv=static_cast<size_t>(n)*(dMax-dMin+1);
+    (void)nv;
+    float *I1=&pix1[0], *D1=&out1[0], *D2=&out2[0], *H=A;
+    unsigned char* occ=M;
+#ifdef _OPENMP
+#pragma omp target exit data map(delete: I1[0:n*c], H[0:nv], \
+                                         D1[0:n], D2[0:n])
+    if(occ) {
+#pragma omp target exit data map(delete: occ[0:n])
+    }
+#endif
+    (void)I1; (void)D1; (void)D2; (void)H; (void)occ; // Only in pragmas
+    delete [] A;
+    delete [] M;
+    A = 0;
+    M = 0;
+    std::vector<float>().swap(pix1);
+    std::vector<float>().swap(out1);
+    std::vector<float>().swap(out2);
+}
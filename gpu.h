@@ -0,0 +1,64 @@
+/**
+ * @file gpu.h
+ * @brief Adaptive weights disparity computed on GPU by OpenMP offloading
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPU_H
+#define GPU_H
+
+#include <vector>
+
+template <typename T> class ImageT;
+typedef ImageT<float> Image;
+struct ParamDisparity;
+struct ParamOcclusion;
+
+bool gpuSupports(const ParamDisparity& param);
+void disparityAW_gpu(Image im1, Image im2, int dMin, int dMax,
+                     const ParamDisparity& param, Image& disp1, Image& disp2);
+
+/// Maps of a stereo pair kept in device memory, from the aggregation to the
+/// filling of occlusions.
+///
+/// compute() is disparityAW_gpu; with \a keep, image 1, both maps and the
+/// memory of the aggregated costs stay on the device afterwards. check(),
+/// fill() and median() then do the left-right check, the filling along rows
+/// and the weighted median there, the guidance (median of radius 1 of image
+/// 1) being computed on the device too: only the map of each step is copied
+/// back to the host. The steps must be called in this order.
+class GpuPair {
+public:
+    GpuPair(): w(0), h(0), c(0), dMin(0), dMax(0), A(0), M(0) {}
+    ~GpuPair() { release(); }
+    bool resident() const { return (A != 0); } ///< Maps on the device?
+    void compute(Image im1, Image im2, int dMin, int dMax,
+                 const ParamDisparity& param, Image& disp1, Image& disp2,
+                 bool keep=false);
+    void check(int tolDisp, Image& disp1);
+    void fill(bool min, float vOut);
+    void median(const ParamOcclusion& param, Image& disp1);
+    void release();
+private:
+    int w, h, c;    ///< Dimensions
+    int dMin, dMax; ///< Disparity range
+    std::vector<float> pix1; ///< Image 1, interlaced (host and device)
+    std::vector<float> out1, out2; ///< Maps (host and device)
+    float* A;         ///< Aggregated costs, then histograms (device only)
+    unsigned char* M; ///< Occluded pixels after check (device only)
+    GpuPair(const GpuPair&);            ///< Forbidden
+    GpuPair& operator=(const GpuPair&); ///< Forbidden
+};
+
+#endif
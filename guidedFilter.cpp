@@ -0,0 +1,276 @@
+/**
+ * @file guidedFilter.cpp
+ * @brief Disparity map estimation by guided filtering of the cost volume
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "guidedFilter.h"
+#include "disparity.h"
+#include "image.h"
+#include "rawCost.h"
+#include <algorithm>
+#include <vector>
+#include <limits>
+#include <iostream>
+
+/// Columns processed together in vertical pass of box filter
+static const int BLOCK=64;
+
+/// Mean of \a in over windows of radius \a r inside the image.
+///
+/// The cost per pixel is independent of \a r, with running sums in double
+/// precision. \a tmp is a buffer of the size of the image.
+static void boxFilter(const float* in, float* out, int w, int h, int r,
+                      float* tmp) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<h; y++) { // Horizontal sums
+        const float* p = in+static_cast<size_t>(y)*w;
+        float* t = tmp+static_cast<size_t>(y)*w;
+        double s=0;
+        for(int x=0; x<=r && x<w; x++)
+            s += p[x];
+        for(int x=0; x<w; x++) {
+            t[x] = static_cast<float>(s);
+            if(x+r+1<w) s += p[x+r+1];
+            if(x-r>=0)  s -= p[x-r];
+        }
+    }
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int xb=0; xb<w; xb+=BLOCK) { // Vertical sums and normalization
+        const int n = std::min(w,xb+BLOCK)-xb;
+        double s[BLOCK];
+        float nx[BLOCK]; // Window width
+        for(int x=0; x<n; x++) {
+            s[x] = 0;
+            nx[x] = static_cast<float>(std::min(w-1,xb+x+r)-
+                                       std::max(0,xb+x-r)+1);
+        }
+        for(int y=0; y<=r && y<h; y++)
+            for(int x=0; x<n; x++)
+                s[x] += tmp[static_cast<size_t>(y)*w+xb+x];
+        for(int y=0; y<h; y++) {
+            const float ny=static_cast<float>(std::min(h-1,y+r)-
+                                              std::max(0,y-r)+1);
+            float* o = out+static_cast<size_t>(y)*w+xb;
+            for(int x=0; x<n; x++)
+                o[x] = static_cast<float>(s[x]/(nx[x]*ny));
+            if(y+r+1<h) {
+                const float* t = tmp+static_cast<size_t>(y+r+1)*w+xb;
+                for(int x=0; x<n; x++) s[x] += t[x];
+            }
+            if(y-r>=0) {
+                const float* t = tmp+static_cast<size_t>(y-r)*w+xb;
+                for(int x=0; x<n; x++) s[x] -= t[x];
+            }
+        }
+    }
+}
+
+/// Guided filter of He et al. (2010), with color or gray guidance.
+///
+/// The statistics of the guidance image, independent of the filtered image,
+/// are computed once.
+class GuidedFilter {
+public:
+    GuidedFilter(const Image& guide, int r, float eps);
+    void filter(const float* p, float* q);
+private:
+    int w, h, c, r;
+    size_t n;                 ///< Number of pixels
+    std::vector<float> I;     ///< Planar guidance
+    std::vector<float> meanI; ///< Planar mean of guidance
+    std::vector<float> inv;   ///< Inverse of regularized covariance
+    std::vector<float> tmp, meanP, meanIP, a, b; ///< Buffers
+    float* plane(std::vector<float>& v, int i) { return &v[i*n]; }
+};
+
+/// Constructor. Guidance with other than 3 channels is converted to gray.
+GuidedFilter::GuidedFilter(const Image& guide, int radius, float eps)
+: w(guide.width()), h(guide.height()), c(guide.channels()==3? 3: 1),
+  r(radius), n(static_cast<size_t>(w)*h),
+  I(c*n), meanI(c*n), inv((c==3? 6: 1)*n),
+  tmp(n), meanP(n), meanIP(c*n), a(c*n), b(n) {
+    Image g = (c==guide.channels())? guide: guide.gray();
+    for(int i=0; i<c; i++)
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++)
+                I[i*n+y*w+x] = g(x,y,i);
+    for(int i=0; i<c; i++)
+        boxFilter(plane(I,i), plane(meanI,i), w, h, r, &tmp[0]);
+    // Covariance of guidance, upper triangle in row-major order
+    std::vector<float> cov((c==3? 6: 1)*n), prod(n);
+    const int pairs[6][2] = {{0,0},{0,1},{0,2},{1,1},{1,2},{2,2}};
+    for(int k=0; k<(c==3? 6: 1); k++) {
+        const int i=pairs[k][0], j=pairs[k][1];
+        const float *Ii=plane(I,i), *Ij=plane(I,j);
+        const float *mi=plane(meanI,i), *mj=plane(meanI,j);
+        for(size_t p=0; p<n; p++)
+            prod[p] = Ii[p]*Ij[p];
+        float* v = &cov[k*n];
+        boxFilter(&prod[0], v, w, h, r, &tmp[0]);
+        for(size_t p=0; p<n; p++)
+            v[p] -= mi[p]*mj[p];
+    }
+    if(c == 1) {
+        for(size_t p=0; p<n; p++)
+            inv[p] = 1/(cov[p]+eps);
+        return;
+    }
+    for(size_t p=0; p<n; p++) { // Inverse of symmetric 3x3 matrix
+        const float s00=cov[p]+eps, s01=cov[n+p], s02=cov[2*n+p],
+            s11=cov[3*n+p]+eps, s12=cov[4*n+p], s22=cov[5*n+p]+eps;
+        const float i00=s11*s22-s12*s12, i01=s02*s12-s01*s22,
+            i02=s01*s12-s02*s11, i11=s00*s22-s02*s02,
+            i12=s01*s02-s00*s12, i22=s00*s11-s01*s01;
+        const float det = s00*i00+s01*i01+s02*i02;
+        inv[p]=i00/det; inv[n+p]=i01/det; inv[2*n+p]=i02/det;
+        inv[3*n+p]=i11/det; inv[4*n+p]=i12/det; inv[5*n+p]=i22/det;
+    }
+}
+
+/// Filter image \a p, result in \a q.
+void GuidedFilter::filter(const float* p, float* q) {
+    boxFilter(p, &meanP[0], w, h, r, &tmp[0]);
+    for(int i=0; i<c; i++) {
+        float* ip=plane(a,i); // Buffer for product
+        const float* Ii=plane(I,i);
+        for(size_t k=0; k<n; k++)
+            ip[k] = Ii[k]*p[k];
+        boxFilter(ip, plane(meanIP,i), w, h, r, &tmp[0]);
+    }
+    // Linear coefficients a and b, meanIP becoming covariance of I and p
+    for(int i=0; i<c; i++) {
+        float *cv=plane(meanIP,i);
+        const float* mi=plane(meanI,i);
+        for(size_t k=0; k<n; k++)
+            cv[k] -= mi[k]*meanP[k];
+    }
+    if(c == 1)
+        for(size_t k=0; k<n; k++)
+            a[k] = inv[k]*meanIP[k];
+    else
+        for(size_t k=0; k<n; k++) {
+            const float c0=meanIP[k], c1=meanIP[n+k], c2=meanIP[2*n+k];
+            const float i00=inv[k], i01=inv[n+k], i02=inv[2*n+k],
+                i11=inv[3*n+k], i12=inv[4*n+k], i22=inv[5*n+k];
+            a[k]     = i00*c0+i01*c1+i02*c2;
+            a[n+k]   = i01*c0+i11*c1+i12*c2;
+            a[2*n+k] = i02*c0+i12*c1+i22*c2;
+        }
+    for(size_t k=0; k<n; k++) {
+        float v = meanP[k];
+        for(int i=0; i<c; i++)
+            v -= a[i*n+k]*meanI[i*n+k];
+        b[k] = v;
+    }
+    // Output: mean of a times guidance plus mean of b
+    boxFilter(&b[0], q, w, h, r, &tmp[0]);
+    for(int i=0; i<c; i++) {
+        float* ai=plane(a,i);
+        boxFilter(ai, &meanP[0], w, h, r, &tmp[0]);
+        const float* Ii=plane(I,i);
+        for(size_t k=0; k<n; k++)
+            q[k] += meanP[k]*Ii[k];
+    }
+}
+
+/// Disparity computation by guided filtering of the cost volume.
+///
+/// This is the fast cost volume filtering of Hosni et al. (2013): each layer
+/// of the cost volume is smoothed by a guided filter, whose cost per pixel
+/// does not depend on the radius, before winner-take-all. The radius of the
+/// filter is \a param.gammaPos/2, its regularization (gammaCol/4)^2, so that
+/// default parameters give the values recommended by the authors. For image 2,
+/// the layers are shifted to be expressed in its coordinates and filtered with
+/// its own guidance. Output maps are as with disparityAW.
+/// \param im1,im2 the two color images
+/// \param dMin,dMax disparity range
+/// \param param raw cost computation parameters
+/// \param disp1 output disparity map from image 1 to image 2
+/// \param disp2 output disparity map from image 2 to image 1
+void disparityGF(Image im1, Image im2,
+                 int dMin, int dMax, const ParamDisparity& param,
+                 Image& disp1, Image& disp2) {
+    if(param.intCost && !(is_8bit(im1) && is_8bit(im2))) {
+        std::cerr << "Warning: images are not 8-bit, "
+                  << "using float raw cost" << std::endl;
+        ParamDisparity p(param);
+        p.intCost = false;
+        disparityGF(im1, im2, dMin, dMax, p, disp1, disp2);
+        return;
+    }
+    const int width=im1.width(), height=im1.height();
+    const int r = std::max(1, static_cast<int>(param.gammaPos/2+0.5f));
+    const float eps = param.gammaCol*param.gammaCol/16;
+
+    CostRows<float>* rows = newCostRows<float>(im1, im2, param);
+    CostVolume* cost = costVolume(*rows, width, height, dMin, dMax,
+                                  0, 0, param.costPages);
+    const float costOut = rows->maxCost();
+    delete rows;
+
+    GuidedFilter gf1(im1, r, eps), gf2(im2, r, eps);
+    // Layer and filtered layer, contiguous for the filter
+    std::vector<float> bufP(static_cast<size_t>(width)*height), bufQ(bufP);
+    Image p(&bufP[0],width,height), q(&bufQ[0],width,height);
+    Image E1(width,height), E2(width,height);
+    E1.fill(std::numeric_limits<float>::max());
+    E2.fill(std::numeric_limits<float>::max());
+    for(int d=dMin; d<=dMax; d++) {
+        const int x0=std::max(0,-d), x1=std::min(width,width-d);
+        if(x0 >= x1)
+            continue;
+        // Layer in coordinates of image 1, pixel x matched to x+d
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=0; x<width; x++)
+                p(x,y) = (x0<=x && x<x1)? cost->get(x,y,d): costOut;
+        gf1.filter(&p(0,0), &q(0,0));
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=x0; x<x1; x++)
+                if(E1(x,y) > q(x,y)) {
+                    E1(x,y) = q(x,y);
+                    disp1(x,y) = static_cast<float>(d);
+                }
+        if(param.leftOnly)
+            continue;
+        // Layer in coordinates of image 2, pixel x matched to x-d
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=0; x<width; x++)
+                p(x,y) = (x0+d<=x && x<x1+d)? cost->get(x-d,y,d): costOut;
+        gf2.filter(&p(0,0), &q(0,0));
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(int x=x0+d; x<x1+d; x++)
+                if(E2(x,y) > q(x,y)) {
+                    E2(x,y) = q(x,y);
+                    disp2(x,y) = -static_cast<float>(d);
+                }
+    }
+    delete cost;
+}
@@ -17,88 +17,431 @@
 
 #include "image.h"
 #include "nan.h"
+#include "pfm.h"
 #include "io_png.h"
 #include "io_tiff.h"
+#include "timing.h"
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <map>
+#include <vector>
 
-/// Constructor
+/// Alignment of rows in bytes (a cache line)
+static const int ALIGN=64;
+
+/// Maximum memory kept in a pool for reuse, in bytes
+static const size_t POOL_MAX=size_t(1)<<28;
+
+/// Blocks of memory of released images, for reuse by later images.
 ///
-/// The main interest of this one is to allow arrays of Image.
-Image::Image()
-: count(0), tab(0), w(0), h(0), c(0) {}
+/// Repeated temporaries of a pipeline, frame after frame, thus avoid the cost
+/// of allocation and page faults. A block up to twice the requested size is
+/// accepted, so that images of a batch of different sizes share the memory.
+/// Access is serialized among threads.
+template <typename T>
+class ImagePool {
+public:
+    ImagePool(): bytes(0) {}
+    ~ImagePool() { clear(); }
+    T* get(size_t& size);
+    void put(T* mem, size_t size);
+    void clear();
+private:
+    std::multimap<size_t,T*> blocks; ///< Free blocks by size
+    size_t bytes; ///< Memory of free blocks
+};
+
+/// Block of at least \a size pixels, reused if available. The smallest
+/// fitting block is chosen and \a size set to its number of pixels.
+template <typename T>
+T* ImagePool<T>::get(size_t& size) {
+    T* mem=0;
+#ifdef _OPENMP
+#pragma omp critical(ImagePool)
+#endif
+    {
+        typename std::multimap<size_t,T*>::iterator it=blocks.lower_bound(size);
+        if(it != blocks.end() && it->first/2 <= size) {
+            size = it->first;
+            mem = it->second;
+            blocks.erase(it);
+            bytes -= size*sizeof(T);
+        }
+    }
+    return mem? mem: new T[size];
+}
+
+/// Keep block \a mem of \a size pixels for reuse, or free it if the pool is
+/// full.
+template <typename T>
+void ImagePool<T>::put(T* mem, size_t size) {
+    bool kept=false;
+#ifdef _OPENMP
+#pragma omp critical(ImagePool)
+#endif
+    if(bytes+size*sizeof(T) <= POOL_MAX) {
+        blocks.insert(std::make_pair(size,mem));
+        bytes += size*sizeof(T);
+        kept = true;
+    }
+    if(! kept)
+        delete [] mem;
+}
+
+/// Free all blocks.
+template <typename T>
+void ImagePool<T>::clear() {
+#ifdef _OPENMP
+#pragma omp critical(ImagePool)
+#endif
+    {
+        typename std::multimap<size_t,T*>::iterator it=blocks.begin();
+        for(; it!=blocks.end(); ++it)
+            delete [] it->second;
+        blocks.clear();
+        bytes = 0;
+    }
+}
+
+/// Pool of images of pixel type T.
+template <typename T>
+static ImagePool<T>& pool() {
+    static ImagePool<T> p;
+    return p;
+}
 
 /// Constructor
-Image::Image(int width, int height, int channels)
-: count(new int(1)), tab(new float[width*height*channels]),
-  w(width), h(height), c(channels) {}
+///
+/// The main interest of this one is to allow arrays of images.
+template <typename T>
+ImageT<T>::ImageT()
+: count(0), tab(0), mem(0), w(0), h(0), c(0), s(0), px(0), sc(0), del(0),
+  size(0) {}
+
+/// Constructor, rows being aligned on 64 bytes.
+template <typename T>
+ImageT<T>::ImageT(int width, int height, int channels, Layout layout)
+: count(new int(1)), tab(0), mem(0), w(width), h(height), c(channels),
+  s(0), px(layout==Planar? 1: channels), sc(1), del(0), size(0) {
+    const int a = ALIGN/sizeof(T); // Alignment in pixels
+    s = (width*px+a-1)/a*a;
+    size = static_cast<size_t>(s)*h;
+    if(layout == Planar) {
+        sc = s*h;
+        size *= c;
+    }
+    size += a;
+    mem = pool<T>().get(size); // Possibly more pixels, a recycled block
+    size_t shift = reinterpret_cast<size_t>(mem) % ALIGN;
+    tab = mem + (shift? a-shift/sizeof(T): 0);
+}
 
 /// Constructor with array of pixels.
 ///
-/// Make sure it is not deleted during the lifetime of the image.
-Image::Image(float* pix, int width, int height, int channels)
-: count(0), tab(pix), w(width), h(height), c(channels) {}
+/// Make sure it is not deleted during the lifetime of the image. If
+/// \a stride is 0, rows are contiguous. Planes of Planar layout are
+/// contiguous.
+template <typename T>
+ImageT<T>::ImageT(T* pix, int width, int height, int channels, int stride,
+                  Layout layout)
+: count(0), tab(pix), mem(0), w(width), h(height), c(channels),
+  s(0), px(layout==Planar? 1: channels), sc(1), del(0), size(0) {
+    s = stride? stride: width*px;
+    if(layout == Planar)
+        sc = s*h;
+}
+
+/// Constructor adopting contiguous array of pixels \a pix.
+///
+/// No copy is done, \a pix is freed by \a deleter after the last copy of the
+/// image, typically std::free for the output of io_png and io_tiff. Rows are
+/// not aligned.
+template <typename T>
+ImageT<T>::ImageT(T* pix, void (*deleter)(void*), int width, int height,
+                  int channels, Layout layout)
+: count(new int(1)), tab(pix), mem(pix), w(width), h(height), c(channels),
+  s(0), px(layout==Planar? 1: channels), sc(1), del(deleter), size(0) {
+    s = width*px;
+    if(layout == Planar)
+        sc = s*h;
+}
 
 /// Copy constructor (shallow copy)
-Image::Image(const Image& I)
-: count(I.count), tab(I.tab), w(I.w), h(I.h), c(I.c) {
-    if(count)
-        ++*count;
+template <typename T>
+ImageT<T>::ImageT(const ImageT& I)
+: count(I.count), tab(I.tab), mem(I.mem), w(I.w), h(I.h), c(I.c), s(I.s),
+  px(I.px), sc(I.sc), del(I.del), size(I.size) {
+    addRef();
 }
 
 /// Assignment operator (shallow copy)
-Image& Image::operator=(const Image& I) {
+template <typename T>
+ImageT<T>& ImageT<T>::operator=(const ImageT& I) {
     if(count != I.count) {
         kill();
-        if(I.count)
-            ++*I.count;
+        count = I.count;
+        addRef();
+    }
+    count=I.count; tab=I.tab; mem=I.mem; w=I.w; h=I.h; c=I.c; s=I.s;
+    px=I.px; sc=I.sc; del=I.del; size=I.size;
+    return *this;
+}
+
+#if __cplusplus >= 201103L
+/// Move constructor, \a I becomes empty.
+template <typename T>
+ImageT<T>::ImageT(ImageT&& I)
+: count(I.count), tab(I.tab), mem(I.mem), w(I.w), h(I.h), c(I.c), s(I.s),
+  px(I.px), sc(I.sc), del(I.del), size(I.size) {
+    I.count=0; I.tab=I.mem=0; I.w=I.h=I.c=I.s=I.px=I.sc=0; I.del=0; I.size=0;
+}
+
+/// Move assignment, \a I becomes empty.
+template <typename T>
+ImageT<T>& ImageT<T>::operator=(ImageT&& I) {
+    if(this != &I) {
+        kill();
+        count=I.count; tab=I.tab; mem=I.mem; w=I.w; h=I.h; c=I.c; s=I.s;
+        px=I.px; sc=I.sc; del=I.del; size=I.size;
+        I.count=0; I.tab=I.mem=0; I.w=I.h=I.c=I.s=I.px=I.sc=0;
+        I.del=0; I.size=0;
     }
-    count=I.count; tab=I.tab; w=I.w; h=I.h; c=I.c;
     return *this;
 }
+#endif
+
+/// Deep copy, with same layout
+template <typename T>
+ImageT<T> ImageT<T>::clone() const {
+    return crop(0,0,w,h);
+}
+
+/// Deep copy of rectangle [x0,x0+width)x[y0,y0+height), inside the image
+template <typename T>
+ImageT<T> ImageT<T>::crop(int x0, int y0, int width, int height) const {
+    assert(0<=x0 && 0<=y0 && x0+width<=w && y0+height<=h);
+    ImageT I(width,height,c,layout());
+    const int planes = (layout()==Planar)? c: 1;
+    for(int i=0; i<planes; i++)
+        for(int y=0; y<height; y++) {
+            const T* in = tab+i*sc+(y0+y)*s+x0*px;
+            std::copy(in, in+width*px, I.tab+i*I.sc+y*I.s);
+        }
+    return I;
+}
 
-/// Deep copy
-Image Image::clone() const {
-    Image I(w,h,c);
-    std::copy(tab, tab+w*h*c, I.tab);
+/// Shallow copy of rectangle [x0,x0+width)x[y0,y0+height), inside the image.
+///
+/// Pixels are shared with the image, with its stride, and stay allocated while
+/// the view exists.
+template <typename T>
+ImageT<T> ImageT<T>::view(int x0, int y0, int width, int height) const {
+    assert(0<=x0 && 0<=y0 && x0+width<=w && y0+height<=h);
+    ImageT I(*this);
+    I.tab = tab+y0*s+x0*px;
+    I.w = width;
+    I.h = height;
     return I;
 }
 
-/// Free memory
-void Image::kill() {
-    if(count && --*count == 0) {
+/// Set all pixels to value \a v.
+template <typename T>
+void ImageT<T>::fill(T v) {
+    const int planes = (layout()==Planar)? c: 1;
+    for(int i=0; i<planes; i++)
+        for(int y=0; y<h; y++)
+            std::fill_n(tab+i*sc+y*s, w*px, v);
+}
+
+/// Increment the count of shallow copies, if pixels are owned.
+template <typename T>
+void ImageT<T>::addRef() {
+    if(count) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+        ++*count;
+    }
+}
+
+/// Free memory if this is the last shallow copy.
+template <typename T>
+void ImageT<T>::kill() {
+    if(! count)
+        return;
+    int n;
+#ifdef _OPENMP
+#pragma omp atomic capture
+#endif
+    n = --*count;
+    if(n == 0) {
         delete count;
-        delete [] tab;
+        if(del)
+            del(mem);
+        else
+            pool<T>().put(mem, size);
     }
 }
 
+/// Free the memory kept for reuse by images of pixel type T.
+template <typename T>
+void ImageT<T>::purgePool() {
+    pool<T>().clear();
+}
+
+/// Pixel value of gray level \a v, rounded for integral types.
+template <typename T>
+static T grayValue(float v) {
+    return static_cast<T>(v+0.5f);
+}
+
+/// No rounding for float images.
+template <>
+float grayValue<float>(float v) {
+    return v;
+}
+
 /// Convert image to gray level
-Image Image::gray() const {
+template <typename T>
+ImageT<T> ImageT<T>::gray() const {
     if(channels() == 1)
         return *this;
     assert(channels() == 3);
-    Image out(w,h);
-    const float* in = tab;
-    for(int y=0; y<h; y++)
-        for(int x=0; x<w; x++, in+=3)
-            out(x,y) = rgb_to_gray(in[0], in[1], in[2]);
+    ImageT out(w,h);
+    for(int y=0; y<h; y++) {
+        const T* in = tab+y*s;
+        for(int x=0; x<w; x++, in+=px)
+            out(x,y) = grayValue<T>(rgb_to_gray(in[0], in[sc], in[2*sc]));
+    }
     return out;
 }
 
-/// Save \a disp map in float TIFF image.
-bool save_disparity(const char* fileName, const Image& disp,
-                    int dMin, int dMax) {
+template class ImageT<float>;
+template class ImageT<unsigned char>;
+template class ImageT<unsigned short>;
+
+/// Copy of image \a im of 8-bit values and at most 4 channels, in 4 bytes per
+/// pixel (RGBX), the missing channels being 0: a pixel is one 32-bit word, its
+/// row 64-byte aligned, so that the L1 distance of colors is a sum of 4 bytes.
+Image8 packRGBX(const Image& im) {
+    const int c=im.channels();
+    assert(c <= 4);
+    Image8 out(im.width(), im.height(), 4);
+    for(int y=0; y<im.height(); y++)
+        for(int x=0; x<im.width(); x++)
+            for(int i=0; i<4; i++)
+                out(x,y,i) = (i<c)? static_cast<unsigned char>(im(x,y,i)): 0;
+    return out;
+}
+
+/// Set compression from name: "none", "lzw", "deflate" or "zstd".
+bool TiffFormat::setCompression(const std::string& name) {
+    if(name == "none")
+        compression = IO_TIFF_NONE;
+    else if(name == "lzw")
+        compression = IO_TIFF_LZW;
+    else if(name == "deflate")
+        compression = IO_TIFF_DEFLATE;
+    else if(name == "zstd")
+        compression = IO_TIFF_ZSTD;
+    else {
+        std::cerr << "Error: unknown TIFF compression " << name
+                  << " (should be none, lzw, deflate or zstd)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Check strip and tile sizes.
+bool TiffFormat::check() const {
+    if(rowsPerStrip<0 || tileSize<0 || tileSize%16!=0) {
+        std::cerr << "Error: rows per strip must be non-negative and tile "
+                  << "size a non-negative multiple of 16" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Row \a y of disparity map \a disp in \a out, values outside [dMin,dMax]
+/// becoming NaN.
+static void disparityRow(const Image& disp, int y, int dMin, int dMax,
+                         float* out) {
+    const float vMin=static_cast<float>(dMin), vMax=static_cast<float>(dMax);
+    for(int x=0; x<disp.width(); x++) {
+        float v = disp(x,y);
+        out[x] = (is_number(v) && vMin<=v && v<=vMax)? v: NaN;
+    }
+}
+
+/// Save disparity map \a disp in 16-bit PNG, as in the KITTI benchmark: 0 for
+/// NaN (invalid) or outside [dMin,dMax], |d|*PNG16_SCALE rounded otherwise, at
+/// least 1 so that it stays valid. The range must not contain both signs.
+static bool save_png16(const char* fileName, const Image& disp,
+                       int dMin, int dMax) {
+    if(dMin<0 && dMax>0) {
+        std::cerr << "Error: 16-bit PNG needs disparities of constant sign"
+                  << std::endl;
+        return false;
+    }
     const int w=disp.width(), h=disp.height();
-    float *out = new float[w*h], *o=out;
-    for(int y=0; y<h; y++)
+    std::vector<unsigned short> out(static_cast<size_t>(w)*h);
+    std::vector<float> row(w);
+    for(int y=0; y<h; y++) {
+        disparityRow(disp, y, dMin, dMax, &row[0]);
+        unsigned short* o = &out[static_cast<size_t>(y)*w];
         for(int x=0; x<w; x++) {
-            float v = disp(x,y);
-            if(! (is_number(v) &&
-                  static_cast<float>(dMin)<=v && v<=static_cast<float>(dMax)))
-                v = NaN;
-            *o++ = v;
+            float v = std::abs(row[x])*PNG16_SCALE+0.5f;
+            o[x] = is_number(row[x])? static_cast<unsigned short>(
+                std::min(std::max(v,1.0f),65535.0f)): 0;
         }
-    bool ok = (io_tiff_write_f32(fileName, out, w, h, 1) == 0);
-    delete [] out;
+    }
+    return (io_png_write_u16(fileName, &out[0], w, h, 1) == 0);
+}
+
+/// Save disparity map \a disp in float TIFF, encoded with \a format, values
+/// outside [dMin,dMax] becoming NaN.
+///
+/// The rows are converted one at a time in a small buffer and given to the
+/// TIFF stream, which compresses and writes them by strips (or rows of tiles)
+/// as they come: no copy of the whole map is made.
+static bool save_tiff(const char* fileName, const Image& disp,
+                      int dMin, int dMax, const TiffFormat& format) {
+    const int w=disp.width(), h=disp.height();
+    io_tiff_stream* out = io_tiff_stream_open(fileName, w, h,
+                                              format.compression,
+                                              format.predictor,
+                                              format.rowsPerStrip,
+                                              format.tileSize);
+    if(! out)
+        return false;
+    std::vector<float> row(w);
+    bool ok=true;
+    for(int y=0; ok && y<h; y++) {
+        disparityRow(disp, y, dMin, dMax, &row[0]);
+        ok = (io_tiff_stream_write_f32(out, &row[0]) == 0);
+    }
+    if(io_tiff_stream_close(out) != 0)
+        ok = false;
     return ok;
 }
+
+/// Save \a disp map in float TIFF image, encoded with \a format, in PFM
+/// format if the file name has extension .pfm, or in 16-bit PNG (KITTI) if it
+/// has extension .png. Values outside [dMin,dMax] are invalid (NaN).
+bool save_disparity(const char* fileName, const Image& disp,
+                    int dMin, int dMax, const TiffFormat& format) {
+    StageTimer timer("write");
+    const std::string name(fileName);
+    if(name.size()>=4 && name.compare(name.size()-4, 4, ".png")==0)
+        return save_png16(fileName, disp, dMin, dMax);
+    if(! is_pfm(name))
+        return save_tiff(fileName, disp, dMin, dMax, format);
+    const int w=disp.width(), h=disp.height();
+    std::vector<float> out(static_cast<size_t>(w)*h);
+    for(int y=0; y<h; y++)
+        disparityRow(disp, y, dMin, dMax, &out[static_cast<size_t>(y)*w]);
+    return save_pfm(fileName, &out[0], w, h);
+}
@@ -18,54 +18,138 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <cstddef>
+#include <string>
 #include <vector>
 
-/// Float image class, with shallow copy for performance.
+class OcclusionMask;
+
+/// Image class templated by pixel type T, with shallow copy for performance.
 ///
 /// Copy constructor and operator= perform a shallow copy, so pixels are shared.
-/// To perform a deep copy, use method clone().
+/// To perform a deep copy, use method clone(). The count of shallow copies is
+/// updated atomically, so that copies can be taken concurrently by threads.
+/// With C++11, moves transfer the pixels without touching the count.
 /// There is a constructor taking array of pixels; no copy is done, make sure
-/// the array exists during the lifetime of the image.
-/// The channels of a color image are interlaced, meaning RGBRGB...
-class Image {
+/// the array exists during the lifetime of the image. Another one adopts the
+/// array, freed with the given deleter after the last copy.
+/// The channels of a color image are interlaced, meaning RGBRGB..., unless the
+/// layout is Planar: each channel is then a plane of the same geometry, as
+/// output by io_png. Rows are separated by stride() pixels. Allocated images
+/// have rows aligned on 64 bytes, so padded; images on an array of pixels are
+/// contiguous unless a stride is given. Pointers to pixels are valid only
+/// inside a row.
+/// A rectangle of an image can be accessed without copy through view().
+/// Memory of allocated images is recycled: after the last copy, it is kept in
+/// a pool for later images of the same or slightly smaller size, see
+/// purgePool().
+///
+/// Storage is instantiated for float, unsigned char and unsigned short, see the
+/// typedefs below. The filters are implemented for float images only.
+template <typename T>
+class ImageT {
     int* count; ///< number of shallow copies
-    float* tab; ///< array of pixels
+    T* tab; ///< array of pixels
+    T* mem; ///< allocated memory, tab is inside
     int w, h, c; ///< width, height, channels
+    int s; ///< stride, number of pixels between rows
+    int px, sc; ///< steps between successive pixels and channels
+    void (*del)(void*); ///< deleter of adopted memory, 0 for delete []
+    size_t size; ///< number of allocated pixels, 0 if not allocated
     void kill();
+    void addRef();
 public:
-    Image();
-    Image(int width, int height, int channels=1);
-    Image(float* pix, int width, int height, int channels=1);
-    Image(const Image& I);
-    ~Image() { kill(); }
-    Image& operator=(const Image& I);
-    Image clone() const;
+    /// Order of storage of channels
+    enum Layout {
+        Interleaved, ///< [y][x][channel]
+        Planar       ///< [channel][y][x]
+    };
+    ImageT();
+    ImageT(int width, int height, int channels=1, Layout layout=Interleaved);
+    ImageT(T* pix, int width, int height, int channels=1, int stride=0,
+           Layout layout=Interleaved);
+    ImageT(T* pix, void (*deleter)(void*), int width, int height,
+           int channels=1, Layout layout=Interleaved);
+    ImageT(const ImageT& I);
+    ~ImageT() { kill(); }
+    ImageT& operator=(const ImageT& I);
+#if __cplusplus >= 201103L
+    ImageT(ImageT&& I);
+    ImageT& operator=(ImageT&& I);
+#endif
+    ImageT clone() const;
+    ImageT crop(int x0, int y0, int width, int height) const;
+    ImageT view(int x0, int y0, int width, int height) const;
 
     int width() const { return w; }
     int height() const { return h; }
     int channels() const { return c; }
-    float  operator()(int i,int j,int d=0) const { return tab[(j*w+i)*c+d]; }
-    float& operator()(int i,int j,int d=0)       { return tab[(j*w+i)*c+d]; }
-    Image gray() const;
+    int stride() const { return s; }
+    Layout layout() const { return (c>1 && px==1)? Planar: Interleaved; }
+    /// No padding between rows, nor between planes
+    bool contiguous() const {
+        return s==w*px && (px>1 || c==1 || sc==s*h);
+    }
+    T  operator()(int i,int j,int d=0) const { return tab[j*s+i*px+d*sc]; }
+    T& operator()(int i,int j,int d=0)       { return tab[j*s+i*px+d*sc]; }
+    /// Pixel 0 of row \a j in channel \a d, pixel i being at i*step() from it
+    const T* row(int j, int d=0) const { return tab+j*s+d*sc; }
+    T*       row(int j, int d=0)       { return tab+j*s+d*sc; }
+    int step() const { return px; }        ///< Offset between pixels of a row
+    int channelStep() const { return sc; } ///< Offset between channels
+    void fill(T v);
+    ImageT gray() const;
+    static void purgePool();
 
     // Filters (implemented in filters.cpp)
-    Image gradX() const;
-    void fillMinX(float vMin);
-    void fillMaxX(float vMin);
-    Image median(int radius) const;
-    Image weightedMedian(const Image& guidance,
-                         const Image& where, int vMin, int vMax,
-                         int radius,
-                         float sigmaSpace, float sigmaColor) const;
+    ImageT gradX() const;
+    ImageT reduce(int factor) const;
+    void fillMinX(T vMin);
+    void fillMaxX(T vMin);
+    ImageT median(int radius) const;
+    ImageT medianCut(int nColors, std::vector<T>& palette) const;
+    void fillMinX(const OcclusionMask& mask, T vMin);
+    void fillMaxX(const OcclusionMask& mask, T vMin);
+    void weightedMedian(const ImageT& guidance,
+                        const OcclusionMask& where, int vMin, int vMax,
+                        int radius, float sigmaSpace, float sigmaColor,
+                        int palette=0, int step=1);
+    void weightedMedianFast(const ImageT& guidance,
+                            const OcclusionMask& where, int vMin, int vMax,
+                            int radius, float sigmaColor);
 private:
-    void fillX(float vMin, const float& (*cmp)(const float&,const float&));
-    float dist2(int x1,int y1, int x2,int y2) const;
-    void weighted_histo(std::vector<float>& tab, int x, int y, int radius,
-                        int vMin, const Image& guidance,
-                        float sSpace, float sColor) const;
+    void fillX(T vMin, const T& (*cmp)(const T&,const T&));
+    void fillX(const OcclusionMask& mask, T vMin,
+               const T& (*cmp)(const T&,const T&));
 };
 
+/// Float image, the type of the pipeline
+typedef ImageT<float> Image;
+/// Image of 8-bit pixels
+typedef ImageT<unsigned char> Image8;
+/// Image of 16-bit pixels
+typedef ImageT<unsigned short> Image16;
+
+Image8 packRGBX(const Image& im);
+
+/// Encoding of TIFF files written by save_disparity
+struct TiffFormat {
+    int compression;  ///< IO_TIFF_NONE, IO_TIFF_LZW, IO_TIFF_DEFLATE or ZSTD
+    bool predictor;   ///< Floating point predictor, with compression
+    int rowsPerStrip; ///< Rows of strips, 0 for libtiff default
+    int tileSize;     ///< Side of square tiles (multiple of 16), 0 for strips
+
+    TiffFormat()
+    : compression(0), predictor(false), rowsPerStrip(0), tileSize(0) {}
+    bool setCompression(const std::string& name);
+    bool check() const;
+};
+
+/// Scale of disparities in 16-bit PNG files written by save_disparity (KITTI)
+static const float PNG16_SCALE=256.0f;
+
 bool save_disparity(const char* file_name, const Image& disparity,
-                    int dMin, int dMax);
+                    int dMin, int dMax,
+                    const TiffFormat& format=TiffFormat());
 
 #endif
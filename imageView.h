@@ -0,0 +1,172 @@
+/**
+ * @file imageView.h
+ * @brief Images on the pixels of external buffers, and maps written in them
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGEVIEW_H
+#define IMAGEVIEW_H
+
+#include "image.h"
+#include "nan.h"
+#include <algorithm>
+#include <cstddef>
+
+/// Type of the samples of a buffer
+enum SampleType {
+    SampleU8,  ///< unsigned char
+    SampleU16, ///< unsigned short
+    SampleF32  ///< float
+};
+
+/// Size in bytes of a sample of type \a t
+inline size_t sampleSize(SampleType t) {
+    return (t==SampleU8)? 1: (t==SampleU16)? 2: 4;
+}
+
+/// Pixels of a buffer of the caller, described by steps in bytes.
+///
+/// The sample of channel d of pixel (x,y) is at data+y*rowBytes+x*pixelBytes+
+/// d*channelBytes, so that any layout of a host buffer (image of OpenCV,
+/// NumPy array, frame mapped from a device) can be described. The steps can
+/// be negative, for instance for rows stored bottom-up.
+struct PixelBuffer {
+    void* data;    ///< Channel 0 of pixel (0,0)
+    int width, height, channels;
+    SampleType type;
+    ptrdiff_t rowBytes, pixelBytes, channelBytes; ///< Steps
+
+    /// Interleaved pixels, rows of \a rowBytes, contiguous if 0
+    PixelBuffer(void* pix, int w, int h, int c, SampleType t,
+                ptrdiff_t rowStep=0)
+    : data(pix), width(w), height(h), channels(c), type(t), rowBytes(rowStep),
+      pixelBytes(static_cast<ptrdiff_t>(c*sampleSize(t))),
+      channelBytes(static_cast<ptrdiff_t>(sampleSize(t))) {
+        if(rowBytes == 0)
+            rowBytes = w*pixelBytes;
+    }
+    /// Sample of channel \a d of pixel (\a x,\a y)
+    unsigned char* at(int x, int y, int d=0) const {
+        return static_cast<unsigned char*>(data)+y*rowBytes+x*pixelBytes+
+            d*channelBytes;
+    }
+};
+
+/// Buffer of planar channels of \a w x \a h pixels at \a pix, rows of
+/// \a rowBytes (w samples if 0), planes of \a planeBytes (h rows if 0).
+inline PixelBuffer planarBuffer(void* pix, int w, int h, int c, SampleType t,
+                                ptrdiff_t rowBytes=0, ptrdiff_t planeBytes=0) {
+    PixelBuffer b(pix, w, h, 1, t, rowBytes);
+    b.channels = c;
+    b.channelBytes = planeBytes? planeBytes: h*b.rowBytes;
+    return b;
+}
+
+/// Buffer of the pixels of image \a im, for a copy to a device or a view of
+/// another library. Valid as long as \a im or one of its copies lives.
+inline PixelBuffer bufferOf(const Image& im) {
+    const ptrdiff_t f=sizeof(float);
+    PixelBuffer b(const_cast<float*>(im.row(0)), im.width(), im.height(),
+                  im.channels(), SampleF32, im.stride()*f);
+    b.pixelBytes = im.step()*f;
+    b.channelBytes = im.channelStep()*f;
+    return b;
+}
+
+/// Image \a im on the pixels of \a b, without copy, if they are floats
+/// interleaved with contiguous pixels, or in planes of contiguous rows
+/// following each other, with rows of any stride (see the constructor of
+/// Image on an array). The buffer must exist during the lifetime of the image
+/// and its copies. Return false if \a b has another type or layout.
+inline bool viewImage(const PixelBuffer& b, Image& im) {
+    const ptrdiff_t f=sizeof(float);
+    if(b.type!=SampleF32 || b.width<1 || b.height<1 || b.channels<1 ||
+       b.rowBytes%f!=0)
+        return false;
+    float* pix = static_cast<float*>(b.data);
+    const int stride = static_cast<int>(b.rowBytes/f);
+    if(b.channelBytes==f && b.pixelBytes==b.channels*f &&
+       b.rowBytes>=b.width*b.pixelBytes)
+        im = Image(pix, b.width, b.height, b.channels, stride);
+    else if(b.pixelBytes==f && b.rowBytes>=b.width*f &&
+            (b.channels==1 || b.channelBytes==b.height*b.rowBytes))
+        im = Image(pix, b.width, b.height, b.channels, stride, Image::Planar);
+    else
+        return false;
+    return true;
+}
+
+/// Image of the pixels of \a b: a view if viewImage() can make one and
+/// \a swapRB is false, otherwise a planar copy, the samples of 8 and 16 bits
+/// having their integer value, as from loadImage. With \a swapRB, channels 0
+/// and 2 of a color buffer are exchanged, for BGR pixels (OpenCV): the color
+/// distances do not depend on the order, but the gray level of the gradient
+/// cost does.
+inline Image toImage(const PixelBuffer& b, bool swapRB=false) {
+    swapRB = swapRB && b.channels>=3;
+    Image im;
+    if(!swapRB && viewImage(b, im))
+        return im;
+    im = Image(b.width, b.height, b.channels, Image::Planar);
+    for(int d=0; d<b.channels; d++) {
+        const int from = (swapRB && d<3)? 2-d: d;
+        for(int y=0; y<b.height; y++) {
+            float* out = &im(0,y,d);
+            const unsigned char* in = b.at(0,y,from);
+            for(int x=0; x<b.width; x++, in+=b.pixelBytes)
+                out[x] = (b.type==SampleU8)? *in:
+                    (b.type==SampleU16)?
+                    *reinterpret_cast<const unsigned short*>(in):
+                    *reinterpret_cast<const float*>(in);
+        }
+    }
+    return im;
+}
+
+/// Write disparity map \a disp in buffer \a out of the caller, of the same
+/// size and channel 0 used, values outside [\a dMin,\a dMax] being invalid,
+/// as in save_disparity: NaN in floats, 0 in integers, which hold
+/// |d|*PNG16_SCALE rounded on 16 bits (KITTI) and |d| rounded on 8 bits, at
+/// least 1. Integers need disparities of constant sign. Return false if the
+/// buffer does not fit.
+inline bool writeDisparity(const Image& disp, const PixelBuffer& out,
+                           int dMin, int dMax) {
+    if(out.width!=disp.width() || out.height!=disp.height() ||
+       (out.type!=SampleF32 && dMin<0 && dMax>0))
+        return false;
+    const float vMin=static_cast<float>(dMin), vMax=static_cast<float>(dMax);
+    const float scale = (out.type==SampleU16)? PNG16_SCALE: 1.0f;
+    const float max = (out.type==SampleU16)? 65535.0f: 255.0f;
+    for(int y=0; y<out.height; y++) {
+        unsigned char* o = out.at(0,y);
+        for(int x=0; x<out.width; x++, o+=out.pixelBytes) {
+            const float v = disp(x,y);
+            const bool valid = (is_number(v) && vMin<=v && v<=vMax);
+            if(out.type == SampleF32) {
+                *reinterpret_cast<float*>(o) = valid? v: NaN;
+                continue;
+            }
+            const float u = valid? std::min(std::max(std::abs(v)*scale+0.5f,
+                                                     1.0f), max): 0.0f;
+            if(out.type == SampleU16)
+                *reinterpret_cast<unsigned short*>(o) =
+                    static_cast<unsigned short>(u);
+            else
+                *o = static_cast<unsigned char>(u);
+        }
+    }
+    return true;
+}
+
+#endif
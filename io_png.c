@@ -45,6 +45,7 @@
 #else
 #include <png.h>
 #endif
+#include <zlib.h>
 
 /* ensure consistency */
 #include "io_png.h"
@@ -54,6 +55,7 @@
 /* internal only data type identifiers */
 #define IO_PNG_U8  0x0001       /*  8bit unsigned integer */
 #define IO_PNG_F32 0x0002       /* 32bit float */
+#define IO_PNG_U16 0x0004       /* 16bit unsigned integer */
 
 /*
  * INFO
@@ -82,6 +84,71 @@ typedef struct _io_png_err_s {
     jmp_buf jmpbuf;
 } _io_png_err_t;
 
+/**
+ * local memory buffer, source or destination of PNG data
+ */
+typedef struct _io_png_mem_s {
+    const unsigned char *in;    /* data to read */
+    unsigned char *out;         /* written data, grown by realloc() */
+    size_t size;                /* bytes of data in or out */
+    size_t pos;                 /* read position */
+    size_t capacity;            /* allocated bytes of out */
+} _io_png_mem_t;
+
+/**
+ * @brief libpng read callback from a memory buffer
+ */
+static void _io_png_mem_read(png_structp png_ptr, png_bytep data,
+                             png_size_t length)
+{
+    _io_png_mem_t *mem = (_io_png_mem_t *) png_get_io_ptr(png_ptr);
+    if (length > mem->size - mem->pos)
+        png_error(png_ptr, "read beyond the end of the buffer");
+    memcpy(data, mem->in + mem->pos, length);
+    mem->pos += length;
+}
+
+/**
+ * @brief internal function used to append bytes to a growing memory buffer
+ *
+ * @return 0 if everything OK, -1 if an error occured
+ */
+static int _io_png_mem_put(_io_png_mem_t * mem,
+                           const void *data, size_t length)
+{
+    unsigned char *out;
+    size_t capacity;
+    if (length > mem->capacity - mem->size) {
+        capacity = 2 * mem->capacity + length;
+        if (NULL == (out = (unsigned char *) realloc(mem->out, capacity)))
+            return -1;
+        mem->out = out;
+        mem->capacity = capacity;
+    }
+    memcpy(mem->out + mem->size, data, length);
+    mem->size += length;
+    return 0;
+}
+
+/**
+ * @brief libpng write callback to a growable memory buffer
+ */
+static void _io_png_mem_write(png_structp png_ptr, png_bytep data,
+                              png_size_t length)
+{
+    _io_png_mem_t *mem = (_io_png_mem_t *) png_get_io_ptr(png_ptr);
+    if (0 != _io_png_mem_put(mem, data, length))
+        png_error(png_ptr, "out of memory for the buffer");
+}
+
+/**
+ * @brief libpng flush callback of a memory buffer, nothing to do
+ */
+static void _io_png_mem_flush(png_structp png_ptr)
+{
+    (void) png_ptr;
+}
+
 /**
  * local error handler
  * see http://www.libpng.org/pub/png/book/chapter14.htmlpointer
@@ -131,6 +198,7 @@ static void *_io_png_read_abort(FILE * fp,
  * @todo don't loose 16bit info
  *
  * @param fname PNG file name, "-" means stdin
+ * @param mem memory buffer read instead of the file if not NULL
  * @param nxp, nyp, ncp pointers to variables to be filled
  *        with the number of columns, lines and channels of the image
  * @param png_transform a PNG_TRANSFORM flag to be added to the
@@ -139,7 +207,7 @@ static void *_io_png_read_abort(FILE * fp,
  * @return pointer to an allocated array of pixels,
  *         or NULL if an error happens
  */
-static void *io_png_read_raw(const char *fname,
+static void *io_png_read_raw(const char *fname, _io_png_mem_t * mem,
                              size_t * nxp, size_t * nyp, size_t * ncp,
                              int png_transform, int dtype)
 {
@@ -150,31 +218,56 @@ static void *io_png_read_raw(const char *fname,
     png_bytep row_ptr;
     /* volatile: because of setjmp/longjmp */
     FILE *volatile fp = NULL;
-    void *data = NULL;
+    void *volatile data = NULL;
     unsigned char *data_u8 = NULL;
     unsigned char *data_u8_ptr = NULL;
     float *data_f32 = NULL;
     float *data_f32_ptr = NULL;
+    unsigned short *data_u16 = NULL;
+    unsigned short *data_u16_ptr = NULL;
+    int bytes, transform;
     size_t size;
     size_t i, j, k;
     /* local error structure */
     _io_png_err_t err;
 
     /* parameters check */
-    if (NULL == fname || NULL == nxp || NULL == nyp || NULL == ncp)
+    if ((NULL == fname && NULL == mem)
+        || NULL == nxp || NULL == nyp || NULL == ncp)
         return NULL;
-    if (IO_PNG_U8 != dtype && IO_PNG_F32 != dtype)
-        return NULL;
-
-    /* open the PNG input file */
-    if (0 == strcmp(fname, "-"))
-        fp = stdin;
-    else if (NULL == (fp = fopen(fname, "rb")))
+    if (IO_PNG_U8 != dtype && IO_PNG_F32 != dtype && IO_PNG_U16 != dtype)
         return NULL;
+    /*
+     * set the read filter transforms before setjmp, not to be clobbered
+     * by longjmp, to get 8bit RGB whatever the original file may contain:
+     * PNG_TRANSFORM_STRIP_16      strip 16-bit samples to 8 bits
+     *                             (not for 16bit output)
+     * PNG_TRANSFORM_PACKING       expand 1, 2 and 4-bit
+     *                             samples to bytes
+     */
+    transform = png_transform | PNG_TRANSFORM_PACKING;
+    if (IO_PNG_U16 != dtype)
+        transform |= PNG_TRANSFORM_STRIP_16;
+
+    if (NULL != mem) {
+        /* read the signature bytes from the buffer */
+        if (mem->size < PNG_SIG_LEN)
+            return NULL;
+        memcpy(png_sig, mem->in, PNG_SIG_LEN);
+        mem->pos = PNG_SIG_LEN;
+    } else {
+        /* open the PNG input file */
+        if (0 == strcmp(fname, "-"))
+            fp = stdin;
+        else if (NULL == (fp = fopen(fname, "rb")))
+            return NULL;
+        /* read in some of the signature bytes */
+        if (PNG_SIG_LEN != fread(png_sig, 1, PNG_SIG_LEN, fp))
+            return _io_png_read_abort(fp, NULL, NULL);
+    }
 
-    /* read in some of the signature bytes and check this signature */
-    if ((PNG_SIG_LEN != fread(png_sig, 1, PNG_SIG_LEN, fp))
-        || 0 != png_sig_cmp(png_sig, (png_size_t) 0, PNG_SIG_LEN))
+    /* check the signature */
+    if (0 != png_sig_cmp(png_sig, (png_size_t) 0, PNG_SIG_LEN))
         return _io_png_read_abort(fp, NULL, NULL);
 
     /*
@@ -193,34 +286,30 @@ static void *io_png_read_raw(const char *fname,
     /* handle read errors */
     if (setjmp(err.jmpbuf))
         /* if we get here, we had a problem reading from the file */
-        return _io_png_read_abort(fp, &png_ptr, NULL);
+        return _io_png_read_abort(fp, &png_ptr, &info_ptr);
 
-    /* set up the input control using standard C streams */
-    png_init_io(png_ptr, fp);
+    /* set up the input control using standard C streams or the buffer */
+    if (NULL != mem)
+        png_set_read_fn(png_ptr, mem, &_io_png_mem_read);
+    else
+        png_init_io(png_ptr, fp);
 
     /* let libpng know that some bytes have been read */
     png_set_sig_bytes(png_ptr, PNG_SIG_LEN);
 
-    /*
-     * set the read filter transforms, to get 8bit RGB whatever the
-     * original file may contain:
-     * PNG_TRANSFORM_STRIP_16      strip 16-bit samples to 8 bits
-     * PNG_TRANSFORM_PACKING       expand 1, 2 and 4-bit
-     *                             samples to bytes
-     */
-    png_transform |= (PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING);
-
     /* convert palette to RGB */
     png_set_palette_to_rgb(png_ptr);
 
     /* read in the entire image at once */
-    png_read_png(png_ptr, info_ptr, png_transform, NULL);
+    png_read_png(png_ptr, info_ptr, transform, NULL);
 
     /* get image informations */
     *nxp = (size_t) png_get_image_width(png_ptr, info_ptr);
     *nyp = (size_t) png_get_image_height(png_ptr, info_ptr);
     *ncp = (size_t) png_get_channels(png_ptr, info_ptr);
     row_pointers = png_get_rows(png_ptr, info_ptr);
+    /* bytes per sample, 16bit samples being big endian */
+    bytes = (16 == png_get_bit_depth(png_ptr, info_ptr)) ? 2 : 1;
 
     /*
      * allocate the output data RGB array
@@ -267,6 +356,28 @@ static void *io_png_read_raw(const char *fname,
             }
         }
         break;
+    case IO_PNG_U16:
+        if (NULL == (data_u16 =
+                     (unsigned short *) malloc(size * sizeof(unsigned short))))
+            return _io_png_read_abort(fp, &png_ptr, &info_ptr);
+        data = (void *) data_u16;
+        for (k = 0; k < *ncp; k++) {
+            /* channel loop */
+            data_u16_ptr = data_u16 + (size_t) (*nxp * *nyp * k);
+            for (j = 0; j < *nyp; j++) {
+                /* row loop */
+                row_ptr = row_pointers[j] + k * bytes;
+                for (i = 0; i < *nxp; i++) {
+                    /* pixel loop */
+                    *data_u16_ptr++ = (unsigned short) ((2 == bytes) ?
+                                                        (row_ptr[0] << 8)
+                                                        | row_ptr[1] :
+                                                        row_ptr[0]);
+                    row_ptr += *ncp * bytes;
+                }
+            }
+        }
+        break;
     }
 
     /* clean up and free any memory allocated, close the file */
@@ -294,7 +405,7 @@ unsigned char *io_png_read_u8(const char *fname,
                               size_t * nxp, size_t * nyp, size_t * ncp)
 {
     /* read the image as unsigned char */
-    return (unsigned char *) io_png_read_raw(fname, nxp, nyp, ncp,
+    return (unsigned char *) io_png_read_raw(fname, NULL, nxp, nyp, ncp,
                                              PNG_TRANSFORM_IDENTITY,
                                              IO_PNG_U8);
 }
@@ -311,7 +422,7 @@ unsigned char *io_png_read_u8_rgb(const char *fname, size_t * nxp,
     unsigned char *img;
 
     /* read the image */
-    img = (unsigned char *) io_png_read_raw(fname, nxp, nyp, &nc,
+    img = (unsigned char *) io_png_read_raw(fname, NULL, nxp, nyp, &nc,
                                             PNG_TRANSFORM_STRIP_ALPHA,
                                             IO_PNG_U8);
     if (NULL == img)
@@ -354,7 +465,7 @@ unsigned char *io_png_read_u8_gray(const char *fname,
     unsigned char *img;
 
     /* read the image */
-    img = (unsigned char *) io_png_read_raw(fname, nxp, nyp, &nc,
+    img = (unsigned char *) io_png_read_raw(fname, NULL, nxp, nyp, &nc,
                                             PNG_TRANSFORM_STRIP_ALPHA,
                                             IO_PNG_U8);
     if (NULL == img)
@@ -410,6 +521,28 @@ unsigned char *io_png_read_u8_gray(const char *fname,
     }
 }
 
+/**
+ * @brief read a PNG file into a 16bit integer array
+ *
+ * The array contains the de-interlaced channels. 16bit samples are kept,
+ * as in the disparity maps of KITTI; 1, 2, 4 and 8bit images are converted
+ * to values between 0 and 1, 3, 15 or 255.
+ *
+ * @param fname PNG file name
+ * @param nxp, nyp, ncp pointers to variables to be filled with the number of
+ *        columns, lines and channels of the image
+ * @return pointer to an allocated unsigned short array of pixels,
+ *         or NULL if an error happens
+ */
+unsigned short *io_png_read_u16(const char *fname,
+                                size_t * nxp, size_t * nyp, size_t * ncp)
+{
+    /* read the image as unsigned short */
+    return (unsigned short *) io_png_read_raw(fname, NULL, nxp, nyp, ncp,
+                                              PNG_TRANSFORM_IDENTITY,
+                                              IO_PNG_U16);
+}
+
 /**
  * @brief read a PNG file into a 32bit float array
  *
@@ -428,7 +561,7 @@ float *io_png_read_f32(const char *fname,
                        size_t * nxp, size_t * nyp, size_t * ncp)
 {
     /* read the image as float */
-    return (float *) io_png_read_raw(fname, nxp, nyp, ncp,
+    return (float *) io_png_read_raw(fname, NULL, nxp, nyp, ncp,
                                      PNG_TRANSFORM_IDENTITY, IO_PNG_F32);
 }
 
@@ -443,7 +576,7 @@ float *io_png_read_f32_rgb(const char *fname, size_t * nxp, size_t * nyp)
     float *img;
 
     /* read the image */
-    img = (float *) io_png_read_raw(fname, nxp, nyp, &nc,
+    img = (float *) io_png_read_raw(fname, NULL, nxp, nyp, &nc,
                                     PNG_TRANSFORM_STRIP_ALPHA, IO_PNG_F32);
     if (NULL == img)
         /* error */
@@ -483,7 +616,7 @@ float *io_png_read_f32_gray(const char *fname, size_t * nxp, size_t * nyp)
     float *img, *ptr_gray, *ptr_end, *ptr_r, *ptr_g, *ptr_b;
 
     /* read the image */
-    img = (float *) io_png_read_raw(fname, nxp, nyp, &nc,
+    img = (float *) io_png_read_raw(fname, NULL, nxp, nyp, &nc,
                                     PNG_TRANSFORM_STRIP_ALPHA, IO_PNG_F32);
     if (NULL == img)
         /* error */
@@ -505,6 +638,333 @@ float *io_png_read_f32_gray(const char *fname, size_t * nxp, size_t * nyp)
     }
 }
 
+/**
+ * @brief internal function used to read a PNG file as RGB directly
+ * into a destination given by the caller
+ *
+ * The rows are decoded one at a time in a single 8bit row buffer and
+ * converted to the destination, so that no full size array is
+ * allocated (except for interlaced PNG files, whose passes need the
+ * whole 8bit image). The conversions are those of
+ * io_png_read_u8_rgb() and io_png_read_f32_rgb().
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param mem memory buffer read instead of the file if not NULL
+ * @param dest function called with the image size once it is known,
+ *        returning the destination and its strides, in number of
+ *        elements, between pixels, rows and channels
+ * @param ctx opaque pointer passed to dest
+ * @param dtype identifier for the data type of the destination
+ * @return 0 if OK, -1 if an error happens
+ */
+static int io_png_read_rgb_to(const char *fname, _io_png_mem_t * mem,
+                              io_png_dest_t dest, void *ctx, int dtype)
+{
+    png_byte png_sig[PNG_SIG_LEN];
+    png_structp png_ptr;
+    png_infop info_ptr;
+    /* volatile: because of setjmp/longjmp */
+    FILE *volatile fp = NULL;
+    png_bytep volatile buffer = NULL;
+    png_bytep *volatile rows = NULL;
+    png_bytep row_ptr;
+    void *data;
+    size_t nx, ny, rowbytes;
+    ptrdiff_t sx, sy, sc;
+    size_t i, j, k;
+    int passes;
+    /* local error structure */
+    _io_png_err_t err;
+
+    /* parameters check */
+    if ((NULL == fname && NULL == mem) || NULL == dest)
+        return -1;
+
+    if (NULL != mem) {
+        /* read the signature bytes from the buffer */
+        if (mem->size < PNG_SIG_LEN)
+            return -1;
+        memcpy(png_sig, mem->in, PNG_SIG_LEN);
+        mem->pos = PNG_SIG_LEN;
+    } else {
+        /* open the PNG input file */
+        if (0 == strcmp(fname, "-"))
+            fp = stdin;
+        else if (NULL == (fp = fopen(fname, "rb")))
+            return -1;
+        /* read in some of the signature bytes */
+        if (PNG_SIG_LEN != fread(png_sig, 1, PNG_SIG_LEN, fp)) {
+            (void) _io_png_read_abort(fp, NULL, NULL);
+            return -1;
+        }
+    }
+
+    /* check the signature */
+    if (0 != png_sig_cmp(png_sig, (png_size_t) 0, PNG_SIG_LEN)) {
+        (void) _io_png_read_abort(fp, NULL, NULL);
+        return -1;
+    }
+
+    /* create and initialize the png_struct with local error handling */
+    if (NULL == (png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                                  &err, &_io_png_err_hdl,
+                                                  NULL))) {
+        (void) _io_png_read_abort(fp, NULL, NULL);
+        return -1;
+    }
+    if (NULL == (info_ptr = png_create_info_struct(png_ptr))) {
+        (void) _io_png_read_abort(fp, &png_ptr, NULL);
+        return -1;
+    }
+
+    /* handle read errors */
+    if (setjmp(err.jmpbuf)) {
+        free(buffer);
+        free(rows);
+        (void) _io_png_read_abort(fp, &png_ptr, &info_ptr);
+        return -1;
+    }
+
+    if (NULL != mem)
+        png_set_read_fn(png_ptr, mem, &_io_png_mem_read);
+    else
+        png_init_io(png_ptr, fp);
+    png_set_sig_bytes(png_ptr, PNG_SIG_LEN);
+    png_read_info(png_ptr, info_ptr);
+
+    /* same transforms as io_png_read_raw(), then to 8bit RGB */
+    png_set_strip_16(png_ptr);
+    png_set_packing(png_ptr);
+    png_set_palette_to_rgb(png_ptr);
+    png_set_strip_alpha(png_ptr);
+    png_set_gray_to_rgb(png_ptr);
+    passes = png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+
+    nx = (size_t) png_get_image_width(png_ptr, info_ptr);
+    ny = (size_t) png_get_image_height(png_ptr, info_ptr);
+    rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    if (3 != png_get_channels(png_ptr, info_ptr)
+        || NULL == (data = dest(ctx, nx, ny, &sx, &sy, &sc))) {
+        (void) _io_png_read_abort(fp, &png_ptr, &info_ptr);
+        return -1;
+    }
+
+    if (1 == passes) {
+        /* one row buffer, decoded row after row */
+        if (NULL == (buffer = (png_bytep) malloc(rowbytes)))
+            longjmp(err.jmpbuf, 1);
+    } else {
+        /* the passes of interlaced images need the whole image */
+        if (NULL == (buffer = (png_bytep) malloc(rowbytes * ny))
+            || NULL == (rows = (png_bytep *) malloc(ny * sizeof(png_bytep))))
+            longjmp(err.jmpbuf, 1);
+        for (j = 0; j < ny; j++)
+            rows[j] = buffer + j * rowbytes;
+        png_read_image(png_ptr, rows);
+    }
+
+    for (j = 0; j < ny; j++) {
+        /* row loop */
+        if (1 == passes) {
+            png_read_row(png_ptr, buffer, NULL);
+            row_ptr = buffer;
+        } else
+            row_ptr = rows[j];
+        for (k = 0; k < 3; k++) {
+            /* channel loop */
+            if (IO_PNG_U8 == dtype) {
+                unsigned char *out = (unsigned char *) data + j * sy + k * sc;
+                for (i = 0; i < nx; i++, out += sx)
+                    *out = (unsigned char) row_ptr[3 * i + k];
+            } else {
+                float *out = (float *) data + j * sy + k * sc;
+                for (i = 0; i < nx; i++, out += sx)
+                    *out = (float) row_ptr[3 * i + k];
+            }
+        }
+    }
+    png_read_end(png_ptr, NULL);
+
+    free(buffer);
+    free(rows);
+    (void) _io_png_read_abort(fp, &png_ptr, &info_ptr);
+    return 0;
+}
+
+/**
+ * @brief read a PNG file as RGB 8bit integers into a destination
+ * provided by the caller
+ *
+ * See io_png_read_rgb_to() for details.
+ */
+int io_png_read_u8_rgb_to(const char *fname, io_png_dest_t dest, void *ctx)
+{
+    return io_png_read_rgb_to(fname, NULL, dest, ctx, IO_PNG_U8);
+}
+
+/**
+ * @brief read a PNG file as RGB 32bit floats into a destination
+ * provided by the caller
+ *
+ * See io_png_read_rgb_to() for details.
+ */
+int io_png_read_f32_rgb_to(const char *fname, io_png_dest_t dest, void *ctx)
+{
+    return io_png_read_rgb_to(fname, NULL, dest, ctx, IO_PNG_F32);
+}
+
+/**
+ * @brief read a PNG image from a memory buffer as RGB 32bit floats into a
+ * destination provided by the caller
+ *
+ * See io_png_read_rgb_to() for details.
+ *
+ * @param buf, size PNG data and its size in bytes
+ */
+int io_png_read_f32_rgb_mem_to(const void *buf, size_t size,
+                               io_png_dest_t dest, void *ctx)
+{
+    _io_png_mem_t mem;
+    if (NULL == buf)
+        return -1;
+    memset(&mem, 0, sizeof(mem));
+    mem.in = (const unsigned char *) buf;
+    mem.size = size;
+    return io_png_read_rgb_to(NULL, &mem, dest, ctx, IO_PNG_F32);
+}
+
+/**
+ * @brief state of a PNG file read row by row
+ */
+struct io_png_stream {
+    FILE *fp;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_bytep buffer;           /* one 8bit RGB row */
+    size_t nx, ny, row;         /* size, index of next row */
+    _io_png_err_t err;
+};
+
+/**
+ * @brief open a PNG file to read it row by row as RGB, see
+ * io_png_stream_read_f32_rgb()
+ *
+ * Only the current row is kept in memory, so that images larger than
+ * the memory can be processed in bands. Interlaced files, whose
+ * passes need the whole image, are not supported.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param nxp, nyp pointers to variables to be filled with the number
+ *        of columns and lines of the image
+ * @return the stream, to be freed by io_png_stream_close(),
+ *         or NULL if an error happens
+ */
+io_png_stream *io_png_stream_open(const char *fname,
+                                  size_t * nxp, size_t * nyp)
+{
+    png_byte png_sig[PNG_SIG_LEN];
+    /* volatile: because of setjmp/longjmp */
+    io_png_stream *volatile st;
+
+    if (NULL == fname || NULL == nxp || NULL == nyp)
+        return NULL;
+    if (NULL == (st = (io_png_stream *) calloc(1, sizeof(io_png_stream))))
+        return NULL;
+
+    /* open the PNG input file and check its signature */
+    if (0 == strcmp(fname, "-"))
+        st->fp = stdin;
+    else if (NULL == (st->fp = fopen(fname, "rb"))) {
+        free(st);
+        return NULL;
+    }
+    if ((PNG_SIG_LEN != fread(png_sig, 1, PNG_SIG_LEN, st->fp))
+        || 0 != png_sig_cmp(png_sig, (png_size_t) 0, PNG_SIG_LEN)
+        || NULL == (st->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                                         &st->err,
+                                                         &_io_png_err_hdl,
+                                                         NULL))
+        || NULL == (st->info_ptr = png_create_info_struct(st->png_ptr))) {
+        io_png_stream_close(st);
+        return NULL;
+    }
+
+    /* handle read errors */
+    if (setjmp(st->err.jmpbuf)) {
+        io_png_stream_close(st);
+        return NULL;
+    }
+
+    png_init_io(st->png_ptr, st->fp);
+    png_set_sig_bytes(st->png_ptr, PNG_SIG_LEN);
+    png_read_info(st->png_ptr, st->info_ptr);
+
+    /* same transforms as io_png_read_rgb_to() */
+    png_set_strip_16(st->png_ptr);
+    png_set_packing(st->png_ptr);
+    png_set_palette_to_rgb(st->png_ptr);
+    png_set_strip_alpha(st->png_ptr);
+    png_set_gray_to_rgb(st->png_ptr);
+    if (1 != png_set_interlace_handling(st->png_ptr)) {
+        fprintf(stderr, "io_png: interlaced PNG cannot be read by rows\n");
+        io_png_stream_close(st);
+        return NULL;
+    }
+    png_read_update_info(st->png_ptr, st->info_ptr);
+
+    st->nx = (size_t) png_get_image_width(st->png_ptr, st->info_ptr);
+    st->ny = (size_t) png_get_image_height(st->png_ptr, st->info_ptr);
+    if (3 != png_get_channels(st->png_ptr, st->info_ptr)
+        || NULL == (st->buffer = (png_bytep)
+                    malloc(png_get_rowbytes(st->png_ptr, st->info_ptr)))) {
+        io_png_stream_close(st);
+        return NULL;
+    }
+    *nxp = st->nx;
+    *nyp = st->ny;
+    return st;
+}
+
+/**
+ * @brief read the next row of a PNG stream as RGB 32bit floats
+ *
+ * @param st stream opened by io_png_stream_open()
+ * @param row destination of the red values of the row, the green and
+ *        blue ones being sc and 2*sc elements further
+ * @param sc stride between channels, in number of elements
+ * @return 0 if OK, -1 if an error happens or all rows were read
+ */
+int io_png_stream_read_f32_rgb(io_png_stream * st, float *row, ptrdiff_t sc)
+{
+    size_t i, k;
+
+    if (NULL == st || NULL == row || st->row >= st->ny)
+        return -1;
+    if (setjmp(st->err.jmpbuf))
+        return -1;
+    png_read_row(st->png_ptr, st->buffer, NULL);
+    for (k = 0; k < 3; k++)
+        for (i = 0; i < st->nx; i++)
+            row[k * sc + i] = (float) st->buffer[3 * i + k];
+    st->row++;
+    return 0;
+}
+
+/**
+ * @brief close a PNG stream and free its memory
+ *
+ * @param st stream opened by io_png_stream_open(), ignored if NULL
+ */
+void io_png_stream_close(io_png_stream * st)
+{
+    if (NULL == st)
+        return;
+    free(st->buffer);
+    (void) _io_png_read_abort(st->fp, &st->png_ptr, &st->info_ptr);
+    free(st);
+}
+
 /*
  * WRITE
  */
@@ -535,117 +995,517 @@ static int _io_png_write_abort(FILE * fp,
 }
 
 /**
- * @brief internal function used to write a byte array as a PNG file
+ * @brief internal function used to append bytes to a file or, if mem
+ * is not NULL, to a memory buffer
+ *
+ * @return 0 if everything OK, -1 if an error occured
+ */
+static int _io_png_put(FILE * fp, _io_png_mem_t * mem,
+                       const void *data, size_t length)
+{
+    if (NULL != mem)
+        return _io_png_mem_put(mem, data, length);
+    return (length == fwrite(data, 1, length, fp)) ? 0 : -1;
+}
+
+/**
+ * @brief internal function used to write a 32bit big endian integer
+ */
+static void _io_png_u32(unsigned char *buf, unsigned long v)
+{
+    buf[0] = (unsigned char) (v >> 24);
+    buf[1] = (unsigned char) (v >> 16);
+    buf[2] = (unsigned char) (v >> 8);
+    buf[3] = (unsigned char) v;
+}
+
+/**
+ * @brief internal function used to write a PNG chunk, with its length
+ * and CRC
+ *
+ * @return 0 if everything OK, -1 if an error occured
+ */
+static int _io_png_put_chunk(FILE * fp, _io_png_mem_t * mem,
+                             const char *type,
+                             const unsigned char *data, size_t length)
+{
+    unsigned char buf[4];
+    uLong crc;
+    crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef *) type, 4);
+    if (0 < length)
+        crc = crc32(crc, data, (uInt) length);
+    _io_png_u32(buf, (unsigned long) length);
+    if (0 != _io_png_put(fp, mem, buf, 4)
+        || 0 != _io_png_put(fp, mem, type, 4)
+        || (0 < length && 0 != _io_png_put(fp, mem, data, length)))
+        return -1;
+    _io_png_u32(buf, (unsigned long) crc);
+    return _io_png_put(fp, mem, buf, 4);
+}
+
+/**
+ * @brief internal function used to apply a PNG filter to a row
+ *
+ * @param type filter IO_PNG_FILTER_NONE to IO_PNG_FILTER_PAETH
+ * @param row, prev row of n bytes and previous row, NULL for the first
+ * @param bpp bytes per pixel
+ * @param out filtered row of n+1 bytes, starting with the filter type
+ * @return sum of absolute values of the filtered bytes, as signed
+ */
+static size_t _io_png_filter_row(int type, const png_byte * row,
+                                 const png_byte * prev, size_t n, size_t bpp,
+                                 png_byte * out)
+{
+    size_t i, sum = 0;
+    int a, b, c, p, pa, pb, pc;
+    *out++ = (png_byte) type;
+    if (NULL == prev && (IO_PNG_FILTER_UP == type))
+        type = IO_PNG_FILTER_NONE;      /* b = 0 */
+    if (NULL == prev && (IO_PNG_FILTER_PAETH == type))
+        type = IO_PNG_FILTER_SUB;       /* b = c = 0, predictor a */
+    switch (type) {
+    case IO_PNG_FILTER_SUB:
+        for (i = 0; i < bpp; i++)
+            out[i] = row[i];
+        for (; i < n; i++)
+            out[i] = (png_byte) (row[i] - row[i - bpp]);
+        break;
+    case IO_PNG_FILTER_UP:
+        for (i = 0; i < n; i++)
+            out[i] = (png_byte) (row[i] - prev[i]);
+        break;
+    case IO_PNG_FILTER_AVG:
+        for (i = 0; i < n; i++) {
+            a = (i >= bpp) ? row[i - bpp] : 0;
+            b = (NULL != prev) ? prev[i] : 0;
+            out[i] = (png_byte) (row[i] - ((a + b) >> 1));
+        }
+        break;
+    case IO_PNG_FILTER_PAETH:
+        for (i = 0; i < bpp; i++)
+            out[i] = (png_byte) (row[i] - prev[i]);
+        for (; i < n; i++) {
+            a = row[i - bpp];
+            b = prev[i];
+            c = prev[i - bpp];
+            pa = abs(b - c);
+            pb = abs(a - c);
+            pc = abs(a + b - 2 * c);
+            p = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+            out[i] = (png_byte) (row[i] - p);
+        }
+        break;
+    default:
+        memcpy(out, row, n);
+    }
+    for (i = 0; i < n; i++)
+        sum += (out[i] < 128) ? out[i] : 256 - out[i];
+    return sum;
+}
+
+/**
+ * @brief internal source of the rows of a PNG file written
  *
- * The PNG file is written as a 8bit image file, interlaced,
- * truecolor. Depending on the number of channels, the color model is
- * gray, gray+alpha, rgb, rgb+alpha.
+ * The rows are given by the row pointers if rows is not NULL, else they
+ * are computed one at a time by fill, see io_png_write_u8_rows().
+ */
+typedef struct _io_png_src_s {
+    png_bytep *rows;            /* ny rows */
+    io_png_row_u8_t fill;       /* callback filling a row */
+    void *ctx;                  /* context of fill */
+} _io_png_src_t;
+
+/**
+ * @brief internal function used to get row j of a source
  *
- * @todo handle 16bit
+ * @param buf buffer of the row, filled if the source is a callback
+ * @return the row, NULL if the callback failed
+ */
+static const png_byte *_io_png_src_row(const _io_png_src_t * src, size_t j,
+                                       png_byte * buf)
+{
+    if (NULL != src->rows)
+        return src->rows[j];
+    return (0 == src->fill(src->ctx, j, buf)) ? buf : NULL;
+}
+
+/**
+ * @brief internal function used to deflate the input of z to a buffer
+ * grown by realloc()
+ *
+ * @param z stream, next_out pointing in *buf of *capacity bytes
+ * @param flush Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH
+ * @return 0 if everything OK, -1 if an error occured
+ */
+static int _io_png_deflate(z_stream * z, unsigned char **buf,
+                           size_t * capacity, int flush)
+{
+    unsigned char *out;
+    size_t used;
+    int ret;
+    while (1) {
+        if (0 == z->avail_out) {
+            used = *capacity;
+            if (NULL == (out = (unsigned char *) realloc(*buf, 2 * used)))
+                return -1;
+            *buf = out;
+            *capacity = 2 * used;
+            z->next_out = out + used;
+            z->avail_out = (uInt) used;
+        }
+        ret = deflate(z, flush);
+        if (Z_STREAM_ERROR == ret)
+            return -1;
+        if (Z_FINISH == flush) {
+            if (Z_STREAM_END == ret)
+                return 0;
+        } else if (0 == z->avail_in && 0 != z->avail_out)
+            return 0;
+    }
+}
+
+/**
+ * @brief internal function used to write PNG rows with a parallel deflate
+ *
+ * The rows are split in one chunk per thread, each one filtered and
+ * compressed row after row, independently, as raw deflate data ended by
+ * a sync flush, except the last one. Their concatenation is a valid
+ * zlib stream, whose Adler-32 checksum is combined from these of the
+ * chunks. Only the compressed data is kept, so that rows given by a
+ * callback are never all in memory. The image is not interlaced since
+ * Adam7 passes span all rows.
+ *
+ * @param fp, mem output file or memory buffer if not NULL
+ * @param src ny rows of rowbytes bytes, filled concurrently if a callback
+ * @param bpp bytes per pixel
+ * @param level zlib compression level, -1 for the default
+ * @param filter PNG filter, IO_PNG_FILTER_DEFAULT for an adaptive choice
+ * @param threads number of chunks compressed in parallel
+ * @return 0 if everything OK, -1 if an error occured
+ */
+static int _io_png_write_par(FILE * fp, _io_png_mem_t * mem,
+                             const _io_png_src_t * src, size_t nx, size_t ny,
+                             size_t rowbytes, size_t bpp,
+                             png_byte bit_depth, int color_type,
+                             int level, int filter, int threads)
+{
+    static const unsigned char sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    unsigned char hdr[13], zhdr[2], adler[4];
+    unsigned char **zdata = NULL;
+    size_t *zsize = NULL;
+    uLong *zadler = NULL;
+    uLong sum;
+    size_t chunk, end;
+    size_t stride = rowbytes + 1;
+    int nchunks, c, ok = 1;
+
+    nchunks = (threads < (int) ny) ? threads : (int) ny;
+    chunk = (ny + nchunks - 1) / nchunks;
+    nchunks = (int) ((ny + chunk - 1) / chunk);
+    zdata = (unsigned char **) calloc(nchunks, sizeof(unsigned char *));
+    zsize = (size_t *) calloc(nchunks, sizeof(size_t));
+    zadler = (uLong *) calloc(nchunks, sizeof(uLong));
+    if (NULL == zdata || NULL == zsize || NULL == zadler)
+        ok = 0;
+
+    /* filter and compress the chunks, the adaptive filter choosing the
+     * one of least sum */
+    if (ok) {
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threads)
+#endif
+        for (c = 0; c < nchunks; c++) {
+            size_t begin = c * chunk;
+            size_t last = (c + 1 == nchunks) ? ny : (c + 1) * chunk;
+            size_t capacity = (last - begin) * stride / 8 + 64, cost, best, j;
+            png_byte *buf = NULL, *out = NULL, *tmp = NULL;
+            const png_byte *row, *prev = NULL;
+            z_stream z;
+            int f, flush;
+            memset(&z, 0, sizeof(z));
+            /* rows of the callback alternate in the two halves of buf */
+            if ((NULL == src->rows
+                 && NULL == (buf = (png_byte *) malloc(2 * rowbytes)))
+                || NULL == (out = (png_byte *) malloc(stride))
+                || (IO_PNG_FILTER_DEFAULT == filter
+                    && NULL == (tmp = (png_byte *) malloc(stride)))
+                || NULL == (zdata[c] = (unsigned char *) malloc(capacity))
+                || Z_OK != deflateInit2(&z, level, Z_DEFLATED, -15, 8,
+                                        (IO_PNG_FILTER_NONE == filter) ?
+                                        Z_DEFAULT_STRATEGY : Z_FILTERED)) {
+                ok = 0;
+                free(buf);
+                free(out);
+                free(tmp);
+                continue;
+            }
+            z.next_out = zdata[c];
+            z.avail_out = (uInt) capacity;
+            zadler[c] = adler32(0L, Z_NULL, 0);
+            if (0 < begin && NULL == (prev = _io_png_src_row(src, begin - 1,
+                                                             buf)))
+                ok = 0;
+            for (j = begin; ok && j < last; j++) {
+                if (NULL == (row = _io_png_src_row(src, j, (NULL == buf) ?
+                                                   NULL : buf + ((j - begin
+                                                                  + 1) % 2)
+                                                   * rowbytes))) {
+                    ok = 0;
+                    break;
+                }
+                best = _io_png_filter_row((NULL == tmp) ? filter :
+                                          IO_PNG_FILTER_NONE,
+                                          row, prev, rowbytes, bpp, out);
+                /* adaptive: out holds no filter, try the others in tmp */
+                for (f = IO_PNG_FILTER_SUB;
+                     NULL != tmp && f <= IO_PNG_FILTER_PAETH; f++) {
+                    cost = _io_png_filter_row(f, row, prev, rowbytes, bpp,
+                                              tmp);
+                    if (cost < best) {
+                        best = cost;
+                        memcpy(out, tmp, stride);
+                    }
+                }
+                zadler[c] = adler32(zadler[c], out, (uInt) stride);
+                flush = (j + 1 < last) ? Z_NO_FLUSH :
+                    ((c + 1 == nchunks) ? Z_FINISH : Z_SYNC_FLUSH);
+                z.next_in = out;
+                z.avail_in = (uInt) stride;
+                if (0 != _io_png_deflate(&z, &zdata[c], &capacity, flush))
+                    ok = 0;
+                prev = row;
+            }
+            zsize[c] = capacity - z.avail_out;
+            (void) deflateEnd(&z);
+            free(buf);
+            free(out);
+            free(tmp);
+        }
+    }
+
+    /* PNG signature, header, zlib header, chunks, Adler-32 and end */
+    if (ok) {
+        _io_png_u32(hdr, (unsigned long) nx);
+        _io_png_u32(hdr + 4, (unsigned long) ny);
+        hdr[8] = bit_depth;
+        hdr[9] = (unsigned char) color_type;
+        hdr[10] = hdr[11] = hdr[12] = 0;
+        zhdr[0] = 0x78;
+        zhdr[1] = (level < 0 || 6 == level) ? 2 :
+            (level < 2 ? 0 : (level < 6 ? 1 : 3));
+        zhdr[1] = (unsigned char) (zhdr[1] << 6);
+        zhdr[1] = (unsigned char) (zhdr[1] + 31 - (zhdr[0] * 256 + zhdr[1])
+                                   % 31);
+        sum = zadler[0];
+        for (c = 1; c < nchunks; c++) {
+            end = (c + 1 == nchunks) ? ny * stride : (c + 1) * chunk * stride;
+            sum = adler32_combine(sum, zadler[c], (z_off_t)
+                                  (end - c * chunk * stride));
+        }
+        _io_png_u32(adler, (unsigned long) sum);
+        ok = (0 == _io_png_put(fp, mem, sig, 8)
+              && 0 == _io_png_put_chunk(fp, mem, "IHDR", hdr, 13)
+              && 0 == _io_png_put_chunk(fp, mem, "IDAT", zhdr, 2));
+        for (c = 0; ok && c < nchunks; c++)
+            ok = (0 == _io_png_put_chunk(fp, mem, "IDAT", zdata[c],
+                                         zsize[c]));
+        ok = ok && (0 == _io_png_put_chunk(fp, mem, "IDAT", adler, 4)
+                    && 0 == _io_png_put_chunk(fp, mem, "IEND", NULL, 0));
+    }
+
+    for (c = 0; NULL != zdata && c < nchunks; c++)
+        free(zdata[c]);
+    free(zdata);
+    free(zsize);
+    free(zadler);
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief internal function used to write the rows of a source as a PNG
+ * file, opened by the caller
+ *
+ * The PNG file is interlaced, with libpng, if threads is 1, else it is
+ * written by _io_png_write_par(), or not interlaced with libpng if
+ * threads is 0. Rows of a callback are filled one at a time, at each pass
+ * of the interlacing in which they appear, so once and in order if
+ * threads is 0.
+ *
+ * @param fp, mem output file or memory buffer if not NULL
+ * @param src ny rows of nx*nc samples of bit_depth bits
+ * @return 0 if everything OK, -1 if an error occured
+ */
+static int _io_png_write_rows(FILE * fp, _io_png_mem_t * mem,
+                              const _io_png_src_t * src,
+                              size_t nx, size_t ny, size_t nc,
+                              png_byte bit_depth,
+                              int level, int filter, int threads)
+{
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    png_byte *volatile buf = NULL;      /* volatile: because of setjmp */
+    const png_byte *row;
+    size_t rowbytes = nc * nx * (bit_depth / 8);
+    size_t j;
+    int color_type, pass, npass;
+    int interlace = (0 == threads) ? PNG_INTERLACE_NONE : PNG_INTERLACE_ADAM7;
+    /* error structure */
+    _io_png_err_t err;
+
+    /* set image informations */
+    switch (nc) {
+    case 1:
+        color_type = PNG_COLOR_TYPE_GRAY;
+        break;
+    case 2:
+        color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+        break;
+    case 3:
+        color_type = PNG_COLOR_TYPE_RGB;
+        break;
+    case 4:
+        color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+        break;
+    default:
+        return -1;
+    }
+
+    /* compress in parallel outside libpng */
+    if (1 < threads)
+        return _io_png_write_par(fp, mem, src, nx, ny, rowbytes,
+                                 nc * (bit_depth / 8), bit_depth,
+                                 color_type, level, filter, threads);
+
+    if (NULL == src->rows
+        && NULL == (buf = (png_byte *) malloc(rowbytes)))
+        return -1;
+
+    /*
+     * create and initialize the png_struct
+     * with local error handling
+     */
+    if (NULL == (png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                                   &err, &_io_png_err_hdl,
+                                                   NULL))
+        || NULL == (info_ptr = png_create_info_struct(png_ptr))) {
+        png_destroy_write_struct(&png_ptr, NULL);
+        free(buf);
+        return -1;
+    }
+
+    /* handle write errors */
+    if (0 != setjmp(err.jmpbuf)) {
+        /* if we get here, we had a problem writing to the file */
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        free(buf);
+        return -1;
+    }
+
+    /* set up the output control using standard C streams or the buffer */
+    if (NULL != mem)
+        png_set_write_fn(png_ptr, mem, &_io_png_mem_write, &_io_png_mem_flush);
+    else
+        png_init_io(png_ptr, fp);
+
+    /* set image header and compression */
+    png_set_IHDR(png_ptr, info_ptr, (png_uint_32) nx, (png_uint_32) ny,
+                 bit_depth, color_type, interlace,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    if (0 <= level)
+        png_set_compression_level(png_ptr, level);
+    if (IO_PNG_FILTER_DEFAULT != filter)        /* PNG_FILTER_NONE..PAETH */
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE,
+                       PNG_FILTER_NONE << filter);
+    /* TODO : significant bit (sBIT), gamma (gAMA), comments (text) chunks */
+    png_write_info(png_ptr, info_ptr);
+
+    /* write out the entire image, as png_write_image(), and end it;
+     * libpng ignores the rows out of the current pass */
+    npass = png_set_interlace_handling(png_ptr);
+    for (pass = 0; pass < npass; pass++)
+        for (j = 0; j < ny; j++) {
+            row = buf;
+            if (NULL != src->rows)
+                row = src->rows[j];
+            else if ((PNG_INTERLACE_NONE == interlace
+                      || PNG_ROW_IN_INTERLACE_PASS(j,
+                             png_get_current_pass_number(png_ptr)))
+                     && NULL == _io_png_src_row(src, j, buf))
+                png_error(png_ptr, "row not filled");
+            png_write_row(png_ptr, row);
+        }
+    png_write_end(png_ptr, info_ptr);
+
+    /* clean up and free any memory allocated */
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(buf);
+    return 0;
+}
+
+/**
+ * @brief internal function used to write a byte array as a PNG file
+ *
+ * The PNG file is written as a 8bit image file (16bit for
+ * IO_PNG_U16), interlaced, truecolor. Depending on the number of
+ * channels, the color model is gray, gray+alpha, rgb, rgb+alpha.
  *
  * @param fname PNG file name, "-" means stdout
+ * @param mem memory buffer written instead of the file if not NULL
  * @param data deinterlaced (RRR..GGG..BBB..AAA) image byte array
  * @param nx, ny, nc number of columns, lines and channels
  * @param dtype identifier for the data type to be used for output
  * @return 0 if everything OK, -1 if an error occured
  */
-static int io_png_write_raw(const char *fname, const void *data,
-                            size_t nx, size_t ny, size_t nc, int dtype)
+static int io_png_write_raw(const char *fname, _io_png_mem_t * mem,
+                            const void *data,
+                            size_t nx, size_t ny, size_t nc, int dtype,
+                            int level, int filter, int threads)
 {
-    png_structp png_ptr;
-    png_infop info_ptr;
     png_byte *idata = NULL, *idata_ptr = NULL;
     png_bytep *row_pointers = NULL;
     png_byte bit_depth;
-    /* volatile: because of setjmp/longjmp */
-    FILE *volatile fp;
+    FILE *fp = NULL;
     const unsigned char *data_u8 = NULL;
     const unsigned char *data_u8_ptr = NULL;
     const float *data_f32 = NULL;
     const float *data_f32_ptr = NULL;
+    const unsigned short *data_u16 = NULL;
+    const unsigned short *data_u16_ptr = NULL;
     float tmp;
-    int color_type, interlace, compression, filter;
     size_t size;
     size_t i, j, k;
-    /* error structure */
-    _io_png_err_t err;
+    _io_png_src_t src;
+    int ret;
 
     /* parameters check */
     if (0 >= nx || 0 >= ny || 0 >= nc)
         return -1;
-    if (NULL == fname || NULL == data)
+    if ((NULL == fname && NULL == mem) || NULL == data)
+        return -1;
+    if (IO_PNG_U8 != dtype && IO_PNG_F32 != dtype && IO_PNG_U16 != dtype)
         return -1;
-    if (IO_PNG_U8 != dtype && IO_PNG_F32 != dtype)
+    if (level < -1 || 9 < level || filter < IO_PNG_FILTER_DEFAULT
+        || IO_PNG_FILTER_PAETH < filter)
         return -1;
 
     /* open the PNG output file */
-    if (0 == strcmp(fname, "-"))
+    if (NULL != mem)
+        fp = NULL;
+    else if (0 == strcmp(fname, "-"))
         fp = stdout;
     else if (NULL == (fp = fopen(fname, "wb")))
         return -1;
 
     /* allocate the interlaced array and row pointers */
-    size = nx * ny * nc;
+    bit_depth = (IO_PNG_U16 == dtype) ? 16 : 8;
+    size = nx * ny * nc * (bit_depth / 8);
     if (NULL == (idata = (png_byte *) malloc(size * sizeof(png_byte))))
         return _io_png_write_abort(fp, NULL, NULL, NULL, NULL);
 
     if (NULL == (row_pointers = (png_bytep *) malloc(ny * sizeof(png_bytep))))
         return _io_png_write_abort(fp, idata, NULL, NULL, NULL);
 
-    /*
-     * create and initialize the png_struct
-     * with local error handling
-     */
-    if (NULL == (png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-                                                   &err, &_io_png_err_hdl,
-                                                   NULL)))
-        return _io_png_write_abort(fp, idata, row_pointers, NULL, NULL);
-
-    /* allocate/initialize the memory for image information */
-    if (NULL == (info_ptr = png_create_info_struct(png_ptr)))
-        return _io_png_write_abort(fp, idata, row_pointers, &png_ptr, NULL);
-
-    /* handle write errors */
-    if (0 != setjmp(err.jmpbuf))
-        /* if we get here, we had a problem writing to the file */
-        return _io_png_write_abort(fp, idata, row_pointers, &png_ptr,
-                                   &info_ptr);
-
-    /* set up the input control using standard C streams */
-    png_init_io(png_ptr, fp);
-
-    /* set image informations */
-    bit_depth = 8;
-    switch (nc) {
-    case 1:
-        color_type = PNG_COLOR_TYPE_GRAY;
-        break;
-    case 2:
-        color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
-        break;
-    case 3:
-        color_type = PNG_COLOR_TYPE_RGB;
-        break;
-    case 4:
-        color_type = PNG_COLOR_TYPE_RGB_ALPHA;
-        break;
-    default:
-        png_destroy_read_struct(&png_ptr, NULL, NULL);
-        free(row_pointers);
-        free(idata);
-        (void) fclose(fp);
-        return -1;
-    }
-    interlace = PNG_INTERLACE_ADAM7;
-    compression = PNG_COMPRESSION_TYPE_BASE;
-    filter = PNG_FILTER_TYPE_BASE;
-
-    /* set image header */
-    png_set_IHDR(png_ptr, info_ptr, (png_uint_32) nx, (png_uint_32) ny,
-                 bit_depth, color_type, interlace, compression, filter);
-    /* TODO : significant bit (sBIT), gamma (gAMA), comments (text) chunks */
-    png_write_info(png_ptr, info_ptr);
-
     /*
      * interlace and convert RRR GGG BBB to RGB RGB RGB
      * the image is interlaced layer after layer
@@ -686,22 +1546,91 @@ static int io_png_write_raw(const char *fname, const void *data,
             }
         }
         break;
+    case IO_PNG_U16:
+        data_u16 = (unsigned short *) data;
+        for (k = 0; k < nc; k++) {
+            /* channel loop */
+            data_u16_ptr = data_u16 + (size_t) (nx * ny * k);
+            idata_ptr = idata + (size_t) (2 * k);
+            for (j = 0; j < ny; j++) {
+                /* row loop */
+                for (i = 0; i < nx; i++) {
+                    /* pixel loop, PNG samples are big endian */
+                    idata_ptr[0] = (png_byte) (*data_u16_ptr >> 8);
+                    idata_ptr[1] = (png_byte) (*data_u16_ptr++ & 0xff);
+                    idata_ptr += 2 * nc;
+                }
+            }
+        }
+        break;
     }
 
     /* set row pointers */
     for (j = 0; j < ny; j++)
-        row_pointers[j] = idata + (size_t) (nc * nx * j);
+        row_pointers[j] = idata + (size_t) (nc * nx * j * (bit_depth / 8));
 
-    /* write out the entire image and end it */
-    png_write_image(png_ptr, row_pointers);
-    png_write_end(png_ptr, info_ptr);
+    src.rows = row_pointers;
+    src.fill = NULL;
+    src.ctx = NULL;
+    ret = _io_png_write_rows(fp, mem, &src, nx, ny, nc, bit_depth,
+                             level, filter, threads);
 
     /* clean up and free any memory allocated, close the file */
-    (void) _io_png_write_abort(fp, idata, row_pointers, &png_ptr, &info_ptr);
-
+    if (0 != ret)
+        return _io_png_write_abort(fp, idata, row_pointers, NULL, NULL);
+    (void) _io_png_write_abort(fp, idata, row_pointers, NULL, NULL);
     return 0;
 }
 
+/**
+ * @brief write an image given row by row into a 8bit PNG file
+ *
+ * Row y of the image, its nx pixels of nc interleaved channels, is
+ * computed by fill(ctx, y, row), returning 0 if OK, so that the image is
+ * never in memory. With threads > 1, fill is called concurrently for
+ * rows of distinct chunks, see io_png_write_u8_opt(); with threads 1, it
+ * is called for each pass of the interlacing in which the row appears.
+ * With threads 0, the image is not interlaced and fill is called once
+ * per row, in order, so that rows can be read from a stream.
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param fill, ctx callback filling a row and its context
+ * @param nx, ny, nc number of columns, lines and channels of the image
+ * @param level, filter as in io_png_write_u8_opt()
+ * @param threads number of parallel compressions, 1 to use libpng, 0 to
+ *        use it without interlacing
+ * @return 0 if everything OK, -1 if an error occured
+ */
+int io_png_write_u8_rows(const char *fname, io_png_row_u8_t fill, void *ctx,
+                         size_t nx, size_t ny, size_t nc,
+                         int level, int filter, int threads)
+{
+    FILE *fp;
+    _io_png_src_t src;
+    int ret;
+
+    /* parameters check */
+    if (0 >= nx || 0 >= ny || 0 >= nc || NULL == fname || NULL == fill
+        || threads < 0)
+        return -1;
+    if (level < -1 || 9 < level || filter < IO_PNG_FILTER_DEFAULT
+        || IO_PNG_FILTER_PAETH < filter)
+        return -1;
+
+    if (0 == strcmp(fname, "-"))
+        fp = stdout;
+    else if (NULL == (fp = fopen(fname, "wb")))
+        return -1;
+    src.rows = NULL;
+    src.fill = fill;
+    src.ctx = ctx;
+    ret = _io_png_write_rows(fp, NULL, &src, nx, ny, nc, 8,
+                             level, filter, threads);
+    if (stdout != fp && 0 != fclose(fp))
+        ret = -1;
+    return ret;
+}
+
 /**
  * @brief write a 8bit unsigned integer array into a PNG file
  *
@@ -713,9 +1642,9 @@ static int io_png_write_raw(const char *fname, const void *data,
 int io_png_write_u8(const char *fname, const unsigned char *data,
                     size_t nx, size_t ny, size_t nc)
 {
-    return io_png_write_raw(fname, (void *) data,
+    return io_png_write_raw(fname, NULL, (void *) data,
                             (png_uint_32) nx, (png_uint_32) ny, (png_byte) nc,
-                            IO_PNG_U8);
+                            IO_PNG_U8, -1, IO_PNG_FILTER_DEFAULT, 1);
 }
 
 /**
@@ -733,9 +1662,163 @@ int io_png_write_u8(const char *fname, const unsigned char *data,
 int io_png_write_f32(const char *fname, const float *data,
                   size_t nx, size_t ny, size_t nc)
 {
-    return io_png_write_raw(fname, (void *) data,
+    return io_png_write_raw(fname, NULL, (void *) data,
+                            (png_uint_32) nx, (png_uint_32) ny, (png_byte) nc,
+                            IO_PNG_F32, -1, IO_PNG_FILTER_DEFAULT, 1);
+}
+
+/**
+ * @brief write a 8bit unsigned integer array into a PNG file, with
+ * compression options
+ *
+ * Faster compression levels and fixed filters trade file size for
+ * speed. With threads > 1, the rows are compressed in parallel in as
+ * many independent chunks and the image is not interlaced; the file is
+ * slightly larger than with one thread.
+ *
+ * @param fname PNG file name
+ * @param data array to write
+ * @param nx, ny, nc number of columns, lines and channels of the image
+ * @param level zlib compression level 0-9, -1 for the default
+ * @param filter IO_PNG_FILTER_xxx, IO_PNG_FILTER_DEFAULT for adaptive
+ * @param threads number of parallel compressions, 1 to use libpng
+ * @return 0 if everything OK, -1 if an error occured
+ */
+int io_png_write_u8_opt(const char *fname, const unsigned char *data,
+                        size_t nx, size_t ny, size_t nc,
+                        int level, int filter, int threads)
+{
+    return io_png_write_raw(fname, NULL, (void *) data,
+                            (png_uint_32) nx, (png_uint_32) ny, (png_byte) nc,
+                            IO_PNG_U8, level, filter, threads);
+}
+
+/**
+ * @brief write a float array into a PNG file, with compression options
+ *
+ * See io_png_write_f32() and io_png_write_u8_opt() for details.
+ */
+int io_png_write_f32_opt(const char *fname, const float *data,
+                         size_t nx, size_t ny, size_t nc,
+                         int level, int filter, int threads)
+{
+    return io_png_write_raw(fname, NULL, (void *) data,
+                            (png_uint_32) nx, (png_uint_32) ny, (png_byte) nc,
+                            IO_PNG_F32, level, filter, threads);
+}
+
+/**
+ * @brief read a PNG image from a memory buffer into a 8bit integer array
+ *
+ * See io_png_read_u8() for details. The buffer is read through libpng
+ * callbacks, with no temporary file.
+ *
+ * @param buf, size PNG data and its size in bytes
+ * @param nxp, nyp, ncp pointers to variables to be filled with the number of
+ *        columns, lines and channels of the image
+ * @return pointer to an allocated unsigned char array of pixels,
+ *         or NULL if an error happens
+ */
+unsigned char *io_png_read_u8_mem(const void *buf, size_t size,
+                                  size_t * nxp, size_t * nyp, size_t * ncp)
+{
+    _io_png_mem_t mem;
+    if (NULL == buf)
+        return NULL;
+    memset(&mem, 0, sizeof(mem));
+    mem.in = (const unsigned char *) buf;
+    mem.size = size;
+    return (unsigned char *) io_png_read_raw(NULL, &mem, nxp, nyp, ncp,
+                                             PNG_TRANSFORM_IDENTITY,
+                                             IO_PNG_U8);
+}
+
+/**
+ * @brief read a PNG image from a memory buffer into a 32bit float array
+ *
+ * See io_png_read_u8_mem() for details.
+ */
+float *io_png_read_f32_mem(const void *buf, size_t size,
+                           size_t * nxp, size_t * nyp, size_t * ncp)
+{
+    _io_png_mem_t mem;
+    if (NULL == buf)
+        return NULL;
+    memset(&mem, 0, sizeof(mem));
+    mem.in = (const unsigned char *) buf;
+    mem.size = size;
+    return (float *) io_png_read_raw(NULL, &mem, nxp, nyp, ncp,
+                                     PNG_TRANSFORM_IDENTITY, IO_PNG_F32);
+}
+
+/**
+ * @brief internal function used to write an array as PNG data in an
+ * allocated memory buffer
+ *
+ * @param bufp, sizep pointers to variables to be filled with the
+ *        buffer, to be freed with free(), and its size in bytes
+ * @return 0 if everything OK, -1 if an error occured
+ */
+static int io_png_write_mem(void **bufp, size_t * sizep, const void *data,
+                            size_t nx, size_t ny, size_t nc, int dtype)
+{
+    _io_png_mem_t mem;
+    if (NULL == bufp || NULL == sizep)
+        return -1;
+    memset(&mem, 0, sizeof(mem));
+    if (0 != io_png_write_raw(NULL, &mem, data, nx, ny, nc, dtype,
+                              -1, IO_PNG_FILTER_DEFAULT, 1)) {
+        free(mem.out);
+        return -1;
+    }
+    *bufp = mem.out;
+    *sizep = mem.size;
+    return 0;
+}
+
+/**
+ * @brief write a 8bit unsigned integer array as PNG data in memory
+ *
+ * The buffer grows as libpng writes, with no temporary file.
+ *
+ * @param bufp, sizep pointers to variables to be filled with the
+ *        allocated PNG data, to be freed with free(), and its size
+ * @param data array to write
+ * @param nx, ny, nc number of columns, lines and channels of the image
+ * @return 0 if everything OK, -1 if an error occured
+ */
+int io_png_write_u8_mem(void **bufp, size_t * sizep,
+                        const unsigned char *data,
+                        size_t nx, size_t ny, size_t nc)
+{
+    return io_png_write_mem(bufp, sizep, data, nx, ny, nc, IO_PNG_U8);
+}
+
+/**
+ * @brief write a float array as PNG data in memory
+ *
+ * See io_png_write_f32() and io_png_write_u8_mem() for details.
+ */
+int io_png_write_f32_mem(void **bufp, size_t * sizep, const float *data,
+                         size_t nx, size_t ny, size_t nc)
+{
+    return io_png_write_mem(bufp, sizep, data, nx, ny, nc, IO_PNG_F32);
+}
+
+/**
+ * @brief write a 16bit unsigned integer array into a PNG file
+ *
+ * @param fname PNG file name
+ * @param data array to write
+ * @param nx, ny, nc number of columns, lines and channels of the image
+ * @return 0 if everything OK, -1 if an error occured
+ */
+int io_png_write_u16(const char *fname, const unsigned short *data,
+                     size_t nx, size_t ny, size_t nc)
+{
+    return io_png_write_raw(fname, NULL, (void *) data,
                             (png_uint_32) nx, (png_uint_32) ny, (png_byte) nc,
-                            IO_PNG_F32);
+                            IO_PNG_U16, -1, IO_PNG_FILTER_DEFAULT, 1);
 }
 
 /**
@@ -9,17 +9,49 @@ extern "C" {
 
 #include <stddef.h>
 
+/* PNG row filters of io_png_write_*_opt() */
+#define IO_PNG_FILTER_DEFAULT -1        /* adaptive */
+#define IO_PNG_FILTER_NONE 0
+#define IO_PNG_FILTER_SUB 1
+#define IO_PNG_FILTER_UP 2
+#define IO_PNG_FILTER_AVG 3
+#define IO_PNG_FILTER_PAETH 4
+
 
 /* io_png.c */
 char *io_png_info(void);
 unsigned char *io_png_read_u8(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp);
 unsigned char *io_png_read_u8_rgb(const char *fname, size_t *nxp, size_t *nyp);
 unsigned char *io_png_read_u8_gray(const char *fname, size_t *nxp, size_t *nyp);
+unsigned short *io_png_read_u16(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp);
 float *io_png_read_f32(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp);
 float *io_png_read_f32_rgb(const char *fname, size_t *nxp, size_t *nyp);
 float *io_png_read_f32_gray(const char *fname, size_t *nxp, size_t *nyp);
+/* destination of nx x ny pixels for io_png_read_*_rgb_to(), with strides */
+typedef void *(*io_png_dest_t)(void *ctx, size_t nx, size_t ny,
+                               ptrdiff_t *sx, ptrdiff_t *sy, ptrdiff_t *sc);
+int io_png_read_u8_rgb_to(const char *fname, io_png_dest_t dest, void *ctx);
+int io_png_read_f32_rgb_to(const char *fname, io_png_dest_t dest, void *ctx);
+int io_png_read_f32_rgb_mem_to(const void *buf, size_t size, io_png_dest_t dest, void *ctx);
+/* row by row reading of non interlaced PNG files, as RGB */
+typedef struct io_png_stream io_png_stream;
+io_png_stream *io_png_stream_open(const char *fname, size_t *nxp, size_t *nyp);
+int io_png_stream_read_f32_rgb(io_png_stream *st, float *row, ptrdiff_t sc);
+void io_png_stream_close(io_png_stream *st);
 int io_png_write_u8(const char *fname, const unsigned char *data, size_t nx, size_t ny, size_t nc);
 int io_png_write_f32(const char *fname, const float *data, size_t nx, size_t ny, size_t nc);
+/* compression level 0-9 (-1 default), filter and parallel compression */
+int io_png_write_u8_opt(const char *fname, const unsigned char *data, size_t nx, size_t ny, size_t nc, int level, int filter, int threads);
+int io_png_write_f32_opt(const char *fname, const float *data, size_t nx, size_t ny, size_t nc, int level, int filter, int threads);
+/* row y of nx x nc interleaved samples, filled by a callback returning 0 */
+typedef int (*io_png_row_u8_t)(void *ctx, size_t y, unsigned char *row);
+int io_png_write_u8_rows(const char *fname, io_png_row_u8_t fill, void *ctx, size_t nx, size_t ny, size_t nc, int level, int filter, int threads);
+int io_png_write_u16(const char *fname, const unsigned short *data, size_t nx, size_t ny, size_t nc);
+/* in-memory variants, PNG data in (buf, size) */
+unsigned char *io_png_read_u8_mem(const void *buf, size_t size, size_t *nxp, size_t *nyp, size_t *ncp);
+float *io_png_read_f32_mem(const void *buf, size_t size, size_t *nxp, size_t *nyp, size_t *ncp);
+int io_png_write_u8_mem(void **bufp, size_t *sizep, const unsigned char *data, size_t nx, size_t ny, size_t nc);
+int io_png_write_f32_mem(void **bufp, size_t *sizep, const float *data, size_t nx, size_t ny, size_t nc);
 
 float rgb_to_gray(float r, float g, float b);
 
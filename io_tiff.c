@@ -35,6 +35,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 /* option to use a local version of the libtiff */
 #ifdef IO_TIFF_LOCAL_LIBTIFF
@@ -70,23 +73,88 @@ char *io_tiff_info(void)
  */
 
 /**
- * Read a TIFF float image.
+ * Read the row of tiles of tw x th pixels of a TIFF float image of size
+ * w x h beginning at row y in the min(th,h-y) rows of w floats of data,
+ * tile being a buffer of a tile. Return 1 if OK, 0 in case of error.
  */
-static float *readTIFF(TIFF * tif, size_t * nx, size_t * ny)
+static int readTileRow(TIFF * tif, uint32_t w, uint32_t h, uint32_t y,
+                       uint32_t tw, uint32_t th, float *tile, float *data)
 {
-    uint32_t w = 0, h = 0, i;
-    uint16_t spp = 0, bps = 0, fmt = 0;
-    float *data, *line;
+    uint32_t x, i, n;
+    for (x = 0; x < w; x += tw) {
+        if (TIFFReadTile(tif, tile, x, y, 0, 0) < 0) {
+            fprintf(stderr, "readTIFF: error reading tile %u,%u\n", x, y);
+            return 0;
+        }
+        n = (w - x < tw) ? w - x : tw;
+        for (i = 0; i < th && y + i < h; i++)
+            memcpy(data + (size_t) i * w + x, tile + (size_t) i * tw,
+                   n * sizeof(float));
+    }
+    return 1;
+}
 
-    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
-    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+/**
+ * Read a tiled TIFF float image of size w x h.
+ */
+static float *readTiledTIFF(TIFF * tif, uint32_t w, uint32_t h,
+                            size_t * nx, size_t * ny)
+{
+    uint32_t tw = 0, th = 0, y;
+    float *data, *tile;
+
+    TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+    TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+    if (0 == tw || 0 == th)
+        return NULL;
+    data = (float *) malloc((size_t) w * h * sizeof(float));
+    tile = (float *) malloc((size_t) tw * th * sizeof(float));
+    if (NULL == data || NULL == tile) {
+        free(data);
+        free(tile);
+        return NULL;
+    }
+    *nx = (size_t) w;
+    *ny = (size_t) h;
+    for (y = 0; y < h; y += th)
+        if (!readTileRow(tif, w, h, y, tw, th, tile, data + (size_t) y * w)) {
+            free(data);
+            free(tile);
+            return NULL;
+        }
+    free(tile);
+    return data;
+}
+
+/**
+ * Get the size w x h of a TIFF image. Return 1 if it is a gray float
+ * image, 0 otherwise.
+ */
+static int formatTIFF(TIFF * tif, uint32_t * w, uint32_t * h)
+{
+    uint16_t spp = 0, bps = 0, fmt = 0;
+    *w = *h = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, w);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, h);
     TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
     TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bps);
     TIFFGetField(tif, TIFFTAG_SAMPLEFORMAT, &fmt);
-    if (spp != 1 || bps != (uint16_t) sizeof(float) * 8
-        || fmt != SAMPLEFORMAT_IEEEFP)
-        return NULL;
+    return (spp == 1 && bps == (uint16_t) sizeof(float) * 8
+            && fmt == SAMPLEFORMAT_IEEEFP);
+}
+
+/**
+ * Read a TIFF float image.
+ */
+static float *readTIFF(TIFF * tif, size_t * nx, size_t * ny)
+{
+    uint32_t w, h, i;
+    float *data, *line;
 
+    if (!formatTIFF(tif, &w, &h))
+        return NULL;
+    if (TIFFIsTiled(tif))
+        return readTiledTIFF(tif, w, h, nx, ny);
     assert((size_t) TIFFScanlineSize(tif) == w * sizeof(float));
     data = (float *) malloc(w * h * sizeof(float));
     *nx = (size_t) w;
@@ -103,49 +171,497 @@ static float *readTIFF(TIFF * tif, size_t * nx, size_t * ny)
     return data;
 }
 
+/*
+ * MEMORY
+ */
+
+/**
+ * Memory buffer, source or destination of TIFF data through
+ * TIFFClientOpen().
+ */
+typedef struct io_tiff_mem_s {
+    const unsigned char *in;    /* data to read */
+    unsigned char *out;         /* written data, grown by realloc() */
+    size_t size;                /* bytes of data in or out */
+    size_t pos;                 /* current position */
+    size_t capacity;            /* allocated bytes of out */
+} io_tiff_mem_t;
+
+static tsize_t memReadTIFF(thandle_t h, tdata_t buf, tsize_t n)
+{
+    io_tiff_mem_t *mem = (io_tiff_mem_t *) h;
+    size_t len = (mem->pos < mem->size) ? mem->size - mem->pos : 0;
+    if ((size_t) n < len)
+        len = (size_t) n;
+    memcpy(buf, (mem->in ? mem->in : mem->out) + mem->pos, len);
+    mem->pos += len;
+    return (tsize_t) len;
+}
+
+static tsize_t memWriteTIFF(thandle_t h, tdata_t buf, tsize_t n)
+{
+    io_tiff_mem_t *mem = (io_tiff_mem_t *) h;
+    size_t end = mem->pos + (size_t) n, capacity;
+    unsigned char *out;
+    if (mem->in)
+        return -1;
+    if (end > mem->capacity) {
+        capacity = 2 * mem->capacity + (size_t) n;
+        if (NULL == (out = (unsigned char *) realloc(mem->out, capacity)))
+            return -1;
+        mem->out = out;
+        mem->capacity = capacity;
+    }
+    if (mem->pos > mem->size)   /* seek beyond the end: fill the gap */
+        memset(mem->out + mem->size, 0, mem->pos - mem->size);
+    memcpy(mem->out + mem->pos, buf, (size_t) n);
+    mem->pos = end;
+    if (end > mem->size)
+        mem->size = end;
+    return n;
+}
+
+static toff_t memSeekTIFF(thandle_t h, toff_t off, int whence)
+{
+    io_tiff_mem_t *mem = (io_tiff_mem_t *) h;
+    if (SEEK_CUR == whence)
+        off += mem->pos;
+    else if (SEEK_END == whence)
+        off += mem->size;
+    mem->pos = (size_t) off;
+    return off;
+}
+
+static int memCloseTIFF(thandle_t h)
+{
+    (void) h;
+    return 0;
+}
+
+static toff_t memSizeTIFF(thandle_t h)
+{
+    return (toff_t) ((io_tiff_mem_t *) h)->size;
+}
+
+/* data to read is used in place, without copy */
+static int memMapTIFF(thandle_t h, tdata_t * base, toff_t * size)
+{
+    io_tiff_mem_t *mem = (io_tiff_mem_t *) h;
+    if (NULL == mem->in)
+        return 0;
+    *base = (tdata_t) mem->in;
+    *size = (toff_t) mem->size;
+    return 1;
+}
+
+static void memUnmapTIFF(thandle_t h, tdata_t base, toff_t size)
+{
+    (void) h;
+    (void) base;
+    (void) size;
+}
+
+/**
+ * Open memory buffer as a TIFF file with mode of TIFFOpen().
+ */
+static TIFF *memOpenTIFF(io_tiff_mem_t * mem, const char *mode)
+{
+    return TIFFClientOpen("memory", mode, (thandle_t) mem,
+                          memReadTIFF, memWriteTIFF, memSeekTIFF,
+                          memCloseTIFF, memSizeTIFF,
+                          memMapTIFF, memUnmapTIFF);
+}
+
+/**
+ * Source of a TIFF image, opened again by each thread decoding it: file
+ * fname if not NULL, else the size bytes of memory buffer buf.
+ */
+typedef struct io_tiff_src_s {
+    const char *fname;
+    const void *buf;
+    size_t size;
+} io_tiff_src_t;
+
+/**
+ * Open TIFF source src for reading, mem being the state of a memory buffer.
+ */
+static TIFF *openTIFF(const io_tiff_src_t * src, io_tiff_mem_t * mem)
+{
+    if (src->fname)
+        return TIFFOpen(src->fname, "r");
+    memset(mem, 0, sizeof(*mem));
+    mem->in = (const unsigned char *) src->buf;
+    mem->size = src->size;
+    return memOpenTIFF(mem, "r");
+}
+
+/**
+ * Decode strip or tile k of the TIFF float image tif of size w x h, with
+ * tiles of tw x th pixels (0 for strips of th rows), in data. Strips are
+ * decoded in place, tiles through the buffer tile. Return 1 if OK, 0 in
+ * case of error.
+ */
+static int readBlockTIFF(TIFF * tif, uint32_t w, uint32_t h, uint32_t tw,
+                         uint32_t th, uint32_t k, float *tile, float *data)
+{
+    uint32_t x, y, i, n;
+    if (0 == tw) {
+        y = k * th;
+        n = (h - y < th) ? h - y : th;
+        if (TIFFReadEncodedStrip(tif, k, data + (size_t) y * w,
+                                 (tsize_t) n * w * sizeof(float)) < 0) {
+            fprintf(stderr, "readTIFF: error reading strip %u\n", k);
+            return 0;
+        }
+        return 1;
+    }
+    x = k % ((w + tw - 1) / tw) * tw;
+    y = k / ((w + tw - 1) / tw) * th;
+    if (TIFFReadTile(tif, tile, x, y, 0, 0) < 0) {
+        fprintf(stderr, "readTIFF: error reading tile %u,%u\n", x, y);
+        return 0;
+    }
+    n = (w - x < tw) ? w - x : tw;
+    for (i = 0; i < th && y + i < h; i++)
+        memcpy(data + (size_t) (y + i) * w + x, tile + (size_t) i * tw,
+               n * sizeof(float));
+    return 1;
+}
+
+/**
+ * Read the TIFF float image tif of source src, decoding its strips or
+ * tiles in parallel. Each is compressed independently, so each thread
+ * opens its own handle of the source (libtiff handles are not thread-safe)
+ * and decodes its blocks directly in the image, the file being mapped by
+ * libtiff. Without OpenMP or with a single block, this is readTIFF().
+ */
+static float *readParallelTIFF(const io_tiff_src_t * src, TIFF * tif,
+                               size_t * nx, size_t * ny)
+{
+#ifdef _OPENMP
+    uint32_t w, h, tw = 0, th = 0, count;
+    int threads, ok = 1;
+    float *data;
+
+    if (!formatTIFF(tif, &w, &h))
+        return NULL;
+    if (TIFFIsTiled(tif)) {
+        TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+        if (0 == tw || 0 == th)
+            return NULL;
+        count = TIFFNumberOfTiles(tif);
+    } else {
+        TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &th);
+        count = TIFFNumberOfStrips(tif);
+    }
+    threads = omp_get_max_threads();
+    if ((uint32_t) threads > count)
+        threads = (int) count;
+    if (threads < 2 || 0 == th
+        || TIFFScanlineSize(tif) != (tsize_t) (w * sizeof(float)))
+        return readTIFF(tif, nx, ny);
+    if (NULL == (data = (float *) malloc((size_t) w * h * sizeof(float))))
+        return NULL;
+#pragma omp parallel num_threads(threads) reduction(&&:ok)
+    {
+        io_tiff_mem_t mem;
+        int k, mine = 1;
+        TIFF *t = (0 == omp_get_thread_num()) ? tif : openTIFF(src, &mem);
+        float *tile = (0 != tw) ?
+            (float *) malloc((size_t) tw * th * sizeof(float)) : NULL;
+        if (NULL == t || (0 != tw && NULL == tile))
+            mine = 0;
+#pragma omp for schedule(dynamic)
+        for (k = 0; k < (int) count; k++)
+            if (mine)
+                mine = readBlockTIFF(t, w, h, tw, th, (uint32_t) k, tile,
+                                     data);
+        ok = mine;
+        if (NULL != t && tif != t)
+            TIFFClose(t);
+        free(tile);
+    }
+    if (!ok) {
+        free(data);
+        return NULL;
+    }
+    *nx = (size_t) w;
+    *ny = (size_t) h;
+    return data;
+#else
+    (void) src;
+    return readTIFF(tif, nx, ny);
+#endif
+}
+
 /**
  * Load TIFF float image.
  */
 float *io_tiff_read_f32_gray(const char *fname, size_t * nx, size_t * ny)
 {
     float *data;
+    io_tiff_src_t src;
     TIFF *tif = TIFFOpen(fname, "r");
     if (!tif) {
         fprintf(stderr, "Unable to read TIFF file %s\n", fname);
         return NULL;
     }
-    data = readTIFF(tif, nx, ny);
+    src.fname = fname;
+    src.buf = NULL;
+    src.size = 0;
+    data = readParallelTIFF(&src, tif, nx, ny);
     TIFFClose(tif);
     return data;
 }
 
+/**
+ * Load TIFF float image from the size bytes of memory buffer buf, used in
+ * place without temporary file.
+ */
+float *io_tiff_read_f32_gray_mem(const void *buf, size_t size,
+                                 size_t * nx, size_t * ny)
+{
+    float *data;
+    io_tiff_mem_t mem;
+    io_tiff_src_t src;
+    TIFF *tif;
+    src.fname = NULL;
+    src.buf = buf;
+    src.size = size;
+    tif = openTIFF(&src, &mem);
+    if (!tif) {
+        fprintf(stderr, "Unable to read TIFF data in memory\n");
+        return NULL;
+    }
+    data = readParallelTIFF(&src, tif, nx, ny);
+    TIFFClose(tif);
+    return data;
+}
+
+/**
+ * State of a gray float TIFF image read row by row.
+ */
+struct io_tiff_reader {
+    TIFF *tif;
+    uint32_t w, h;
+    uint32_t row;               /* index of next row */
+    uint32_t tw, th;            /* size of tiles, 0 for strips */
+    float *rows;                /* rows of current tiles, if tiled */
+    float *tile;                /* buffer tile */
+    uint64_t offset;            /* of a single uncompressed strip, else 0 */
+};
+
+/**
+ * Offset in the file of the single uncompressed strip of a TIFF float
+ * image of w x h pixels, 0 if it has several strips or is compressed.
+ * libtiff reads such a strip at once, not chopping it when the planar
+ * configuration is separate, as written by io_tiff_write_f32().
+ */
+static uint64_t singleStrip(TIFF * tif, uint32_t w, uint32_t h)
+{
+    uint16_t compression = COMPRESSION_NONE;
+    uint64_t *offsets = NULL, *counts = NULL;
+    TIFFGetField(tif, TIFFTAG_COMPRESSION, &compression);
+    if (1 != TIFFNumberOfStrips(tif) || COMPRESSION_NONE != compression
+        || !TIFFGetField(tif, TIFFTAG_STRIPOFFSETS, &offsets)
+        || !TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &counts)
+        || counts[0] < (uint64_t) w * h * sizeof(float))
+        return 0;
+    return offsets[0];
+}
+
+/**
+ * Read size bytes of a row at offset in the file of a TIFF image, in the
+ * byte order of the machine. Return 0 in case of error.
+ */
+static int readRawRow(TIFF * tif, uint64_t offset, float *row,
+                      tmsize_t size)
+{
+    thandle_t fd = TIFFClientdata(tif);
+    if ((uint64_t) TIFFGetSeekProc(tif) (fd, offset, SEEK_SET) != offset
+        || TIFFGetReadProc(tif) (fd, row, size) != size) {
+        fprintf(stderr, "io_tiff_reader: error reading %s\n",
+                TIFFFileName(tif));
+        return 0;
+    }
+    if (TIFFIsByteSwapped(tif))
+        TIFFSwabArrayOfFloat(row, (tmsize_t) (size / sizeof(float)));
+    return 1;
+}
+
+/**
+ * Open a gray float TIFF image, to be read row by row with
+ * io_tiff_reader_read_f32(), its size being put in *nx and *ny. Strips
+ * are decoded by libtiff one scanline at a time, and tiles one row of
+ * tiles at a time, so that the whole image is never in memory. Return
+ * NULL in case of error.
+ */
+io_tiff_reader *io_tiff_reader_open(const char *fname, size_t * nx,
+                                    size_t * ny)
+{
+    io_tiff_reader *rd;
+    if (NULL == (rd = (io_tiff_reader *) calloc(1, sizeof(io_tiff_reader))))
+        return NULL;
+    /* not mapped in memory, whose pages would count in the process */
+    if (!(rd->tif = TIFFOpen(fname, "rm"))) {
+        fprintf(stderr, "Unable to read TIFF file %s\n", fname);
+        io_tiff_reader_close(rd);
+        return NULL;
+    }
+    if (!formatTIFF(rd->tif, &rd->w, &rd->h)) {
+        fprintf(stderr, "TIFF file %s is not a gray float image\n", fname);
+        io_tiff_reader_close(rd);
+        return NULL;
+    }
+    if (TIFFIsTiled(rd->tif)) {
+        TIFFGetField(rd->tif, TIFFTAG_TILEWIDTH, &rd->tw);
+        TIFFGetField(rd->tif, TIFFTAG_TILELENGTH, &rd->th);
+        if (0 == rd->tw || 0 == rd->th
+            || NULL == (rd->rows = (float *)
+                        malloc((size_t) rd->th * rd->w * sizeof(float)))
+            || NULL == (rd->tile = (float *)
+                        malloc((size_t) rd->tw * rd->th * sizeof(float)))) {
+            io_tiff_reader_close(rd);
+            return NULL;
+        }
+    } else
+        rd->offset = singleStrip(rd->tif, rd->w, rd->h);
+    *nx = (size_t) rd->w;
+    *ny = (size_t) rd->h;
+    return rd;
+}
+
+/**
+ * Read the next row of a TIFF reader in row, of nx floats. Return 0 if
+ * OK, -1 in case of error or after the last row.
+ */
+int io_tiff_reader_read_f32(io_tiff_reader * rd, float *row)
+{
+    uint32_t y = rd->row;
+    tmsize_t size = (tmsize_t) rd->w * sizeof(float);
+    if (y >= rd->h)
+        return -1;
+    rd->row++;
+    if (0 != rd->th) {
+        if (0 == y % rd->th
+            && !readTileRow(rd->tif, rd->w, rd->h, y, rd->tw, rd->th,
+                            rd->tile, rd->rows))
+            return -1;
+        memcpy(row, rd->rows + (size_t) (y % rd->th) * rd->w,
+               rd->w * sizeof(float));
+        return 0;
+    }
+    if (0 != rd->offset)
+        return readRawRow(rd->tif, rd->offset + (uint64_t) y * size, row,
+                          size) ? 0 : -1;
+    if (TIFFReadScanline(rd->tif, row, y, 0) < 0) {
+        fprintf(stderr, "io_tiff_reader: error reading row %u\n", y);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Close a TIFF reader.
+ */
+void io_tiff_reader_close(io_tiff_reader * rd)
+{
+    if (NULL == rd)
+        return;
+    if (rd->tif)
+        TIFFClose(rd->tif);
+    free(rd->rows);
+    free(rd->tile);
+    free(rd);
+}
+
 /*
  * WRITE
  */
 
 /**
- * Write a TIFF float image.
+ * Set the tags of a TIFF float image, with the given compression (libtiff
+ * code), floating point predictor if predictor is not 0, and tiles of
+ * tilesize x tilesize pixels if tilesize is not 0, strips of rowsperstrip
+ * rows (default size if 0) otherwise.
  */
-static int writeTIFF(TIFF * tif, const float *data, size_t w, size_t h,
-                     size_t c)
+static void setTagsTIFF(TIFF * tif, size_t w, size_t h, size_t c,
+                        uint16_t compression, int predictor,
+                        size_t rowsperstrip, size_t tilesize)
 {
-    uint32_t rowsperstrip;
-    int ok;
-    size_t k, i;
-    float *line;
-
     TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, (uint32_t) w);
     TIFFSetField(tif, TIFFTAG_IMAGELENGTH, (uint32_t) h);
     TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_SEPARATE);
     TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, (uint16_t) c);
     TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, (uint16_t) sizeof(float) * 8);
     TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
-    rowsperstrip = TIFFDefaultStripSize(tif, (uint32_t) h);
-    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rowsperstrip);
-    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+    if (0 != tilesize) {
+        TIFFSetField(tif, TIFFTAG_TILEWIDTH, (uint32_t) tilesize);
+        TIFFSetField(tif, TIFFTAG_TILELENGTH, (uint32_t) tilesize);
+    } else {
+        if (0 == rowsperstrip)
+            rowsperstrip = TIFFDefaultStripSize(tif, (uint32_t) h);
+        TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, (uint32_t) rowsperstrip);
+    }
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, compression);
+    if (predictor && COMPRESSION_NONE != compression)
+        TIFFSetField(tif, TIFFTAG_PREDICTOR, PREDICTOR_FLOATINGPOINT);
     TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+}
 
+/**
+ * Write the tiles of rows [y, y+tilesize) of a tiled TIFF image, for
+ * sample (channel) k. Rows of data are separated by w floats, and at
+ * least min(tilesize, h-y) of them are given. Tiles beyond the image
+ * borders are padded with zeros in the buffer tile, of tilesize^2
+ * floats. Return 0 in case of error.
+ */
+static int writeTileRow(TIFF * tif, const float *data, size_t w, size_t h,
+                        size_t y, size_t k, size_t tilesize, float *tile)
+{
+    size_t x, i, n;
+    const size_t rows = (h - y < tilesize) ? h - y : tilesize;
+    for (x = 0; x < w; x += tilesize) {
+        n = (w - x < tilesize) ? w - x : tilesize;
+        memset(tile, 0, tilesize * tilesize * sizeof(float));
+        for (i = 0; i < rows; i++)
+            memcpy(tile + i * tilesize, data + i * w + x, n * sizeof(float));
+        if (TIFFWriteTile(tif, tile, (uint32_t) x, (uint32_t) y, 0,
+                          (tsample_t) k) < 0) {
+            fprintf(stderr, "writeTIFF: error writing tile %i,%i\n",
+                    (int) x, (int) y);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Write a TIFF float image, with tags set by setTagsTIFF().
+ */
+static int writeTIFF(TIFF * tif, const float *data, size_t w, size_t h,
+                     size_t c, uint16_t compression, int predictor,
+                     size_t rowsperstrip, size_t tilesize)
+{
+    int ok;
+    size_t k, i;
+    float *line, *tile;
+
+    setTagsTIFF(tif, w, h, c, compression, predictor, rowsperstrip,
+                tilesize);
     ok = 1;
+    if (0 != tilesize) {
+        tile = (float *) malloc(tilesize * tilesize * sizeof(float));
+        if (NULL == tile)
+            return 0;
+        for (k = 0; ok && k < c; k++)
+            for (i = 0; ok && i < h; i += tilesize)
+                ok = writeTileRow(tif, data + (i + k * h) * w, w, h, i, k,
+                                  tilesize, tile);
+        free(tile);
+        return ok;
+    }
     for (k = 0; ok && k < c; k++)
         for (i = 0; ok && i < h; i++) {
             line = (float *) (data + (i + k * h) * w);
@@ -157,20 +673,228 @@ static int writeTIFF(TIFF * tif, const float *data, size_t w, size_t h,
     return ok;
 }
 
+/**
+ * Mode of TIFFOpen() for writing an image of the given size, as BigTIFF if
+ * it may exceed the 4GB of classic TIFF. Compression is ignored, so that
+ * the format does not depend on the compression ratio.
+ */
+static const char *modeTIFF(size_t w, size_t h, size_t c, size_t tilesize)
+{
+    /* uncompressed size, with the padding of tiles */
+    double bytes = (double) sizeof(float) * c;
+    if (0 != tilesize)
+        bytes *= (double) ((w + tilesize - 1) / tilesize * tilesize)
+            * ((h + tilesize - 1) / tilesize * tilesize);
+    else
+        bytes *= (double) w * h;
+    /* margin of 1/16 for tags and offsets */
+    return (bytes > 4294967295.0 / 16 * 15) ? "w8" : "w";
+}
+
+/**
+ * Check size of tiles, multiple of 16 as required by TIFF. Return 0 if it
+ * is not.
+ */
+static int checkTileTIFF(size_t tilesize)
+{
+    if (0 != tilesize % 16) {
+        fprintf(stderr, "TIFF tile size %i is not a multiple of 16\n",
+                (int) tilesize);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Libtiff code of compression IO_TIFF_NONE, IO_TIFF_LZW, IO_TIFF_DEFLATE
+ * or IO_TIFF_ZSTD in code. Return 0 if it is unknown or not supported.
+ */
+static int compressionTIFF(int compression, uint16_t * code)
+{
+    static const uint16_t codes[] = {COMPRESSION_NONE, COMPRESSION_LZW,
+                                     COMPRESSION_ADOBE_DEFLATE,
+                                     COMPRESSION_ZSTD};
+    if (compression < IO_TIFF_NONE || compression > IO_TIFF_ZSTD) {
+        fprintf(stderr, "Unknown TIFF compression %d\n", compression);
+        return 0;
+    }
+    if (!TIFFIsCODECConfigured(codes[compression])) {
+        fprintf(stderr, "TIFF compression %d not supported by libtiff\n",
+                compression);
+        return 0;
+    }
+    *code = codes[compression];
+    return 1;
+}
+
 /**
  * Write float image as TIFF 32 bits per sample.
  */
 int io_tiff_write_f32(const char *fname, const float *data,
                       size_t nx, size_t ny, size_t nc)
 {
+    return io_tiff_write_f32_opt(fname, data, nx, ny, nc,
+                                 IO_TIFF_NONE, 0, 0, 0);
+}
+
+/**
+ * Write float image as TIFF 32 bits per sample, with compression
+ * IO_TIFF_NONE, IO_TIFF_LZW, IO_TIFF_DEFLATE or IO_TIFF_ZSTD, the
+ * floating point predictor if predictor is not 0 (ignored without
+ * compression), and strips of rowsperstrip rows (0 for default).
+ * Strips are compressed independently, so that fewer rows per strip
+ * allow partial reads at the cost of a lower compression ratio.
+ * If tilesize is not 0 (a multiple of 16), the image is stored in
+ * square tiles of this size instead of strips, allowing readers to
+ * access regions, and in BigTIFF format if it exceeds 4GB.
+ */
+int io_tiff_write_f32_opt(const char *fname, const float *data,
+                          size_t nx, size_t ny, size_t nc,
+                          int compression, int predictor,
+                          size_t rowsperstrip, size_t tilesize)
+{
+    uint16_t code;
     int ok;
-    TIFF *tif = TIFFOpen(fname, "w");
+    TIFF *tif;
+    if (!compressionTIFF(compression, &code) || !checkTileTIFF(tilesize))
+        return -1;
+    tif = TIFFOpen(fname, modeTIFF(nx, ny, nc, tilesize));
     if (!tif) {
         fprintf(stderr, "Unable to write TIFF file %s\n", fname);
         return 0;
     }
 
-    ok = writeTIFF(tif, data, nx, ny, nc);
+    ok = writeTIFF(tif, data, nx, ny, nc, code, predictor, rowsperstrip,
+                   tilesize);
     TIFFClose(tif);
     return (ok ? 0 : -1);
 }
+
+/**
+ * State of a gray float TIFF image written row by row.
+ */
+struct io_tiff_stream {
+    TIFF *tif;
+    uint32_t row;               /* index of next row */
+    size_t nx, ny, tilesize;
+    float *rows;                /* rows of current tiles, if tiled */
+    float *tile;                /* buffer tile */
+};
+
+/**
+ * Open a gray float TIFF image of size nx x ny, to be written row by row
+ * with io_tiff_stream_write_f32(), with the options of
+ * io_tiff_write_f32_opt(). Rows are compressed and written by strips, or
+ * by rows of tiles, as they come, so that the whole image is never in
+ * memory. Return NULL in case of error.
+ */
+io_tiff_stream *io_tiff_stream_open(const char *fname, size_t nx, size_t ny,
+                                    int compression, int predictor,
+                                    size_t rowsperstrip, size_t tilesize)
+{
+    uint16_t code;
+    io_tiff_stream *st;
+    if (!compressionTIFF(compression, &code) || !checkTileTIFF(tilesize))
+        return NULL;
+    if (NULL == (st = (io_tiff_stream *) calloc(1, sizeof(io_tiff_stream))))
+        return NULL;
+    st->nx = nx;
+    st->ny = ny;
+    st->tilesize = tilesize;
+    if (0 != tilesize
+        && (NULL == (st->rows = (float *)
+                     malloc(tilesize * nx * sizeof(float)))
+            || NULL == (st->tile = (float *)
+                        malloc(tilesize * tilesize * sizeof(float))))) {
+        io_tiff_stream_close(st);
+        return NULL;
+    }
+    st->tif = TIFFOpen(fname, modeTIFF(nx, ny, 1, tilesize));
+    if (!st->tif) {
+        fprintf(stderr, "Unable to write TIFF file %s\n", fname);
+        io_tiff_stream_close(st);
+        return NULL;
+    }
+    setTagsTIFF(st->tif, nx, ny, 1, code, predictor, rowsperstrip, tilesize);
+    return st;
+}
+
+/**
+ * Write the next row of a TIFF stream. If tiled, the row is kept until
+ * the row of tiles is complete. Return 0 if OK, -1 in case of error.
+ */
+int io_tiff_stream_write_f32(io_tiff_stream * st, const float *row)
+{
+    size_t y;
+    if (0 != st->tilesize) {
+        y = st->row % st->tilesize;
+        memcpy(st->rows + y * st->nx, row, st->nx * sizeof(float));
+        st->row++;
+        if (y + 1 == st->tilesize || st->row == st->ny)
+            return writeTileRow(st->tif, st->rows, st->nx, st->ny,
+                                st->row - 1 - y, 0, st->tilesize,
+                                st->tile) ? 0 : -1;
+        return 0;
+    }
+    if (TIFFWriteScanline(st->tif, (void *) row, st->row, 0) < 0) {
+        fprintf(stderr, "io_tiff_stream: error writing row %i\n",
+                (int) st->row);
+        return -1;
+    }
+    st->row++;
+    return 0;
+}
+
+/**
+ * Close a TIFF stream, flushing its last strip. Return 0 if OK, -1 in
+ * case of error.
+ */
+int io_tiff_stream_close(io_tiff_stream * st)
+{
+    int ok = 1;
+    if (NULL == st)
+        return 0;
+    if (st->tif) {
+        ok = TIFFFlush(st->tif);
+        TIFFClose(st->tif);
+    }
+    free(st->rows);
+    free(st->tile);
+    free(st);
+    return (ok ? 0 : -1);
+}
+
+/**
+ * Write float image as TIFF 32 bits per sample in memory, with the
+ * options of io_tiff_write_f32_opt(). The buffer, returned in *bufp with
+ * its size in *sizep, grows as libtiff writes and is to be freed with
+ * free(). Return 0 if OK, -1 in case of error.
+ */
+int io_tiff_write_f32_mem(void **bufp, size_t * sizep, const float *data,
+                          size_t nx, size_t ny, size_t nc,
+                          int compression, int predictor,
+                          size_t rowsperstrip, size_t tilesize)
+{
+    uint16_t code;
+    int ok;
+    io_tiff_mem_t mem;
+    TIFF *tif;
+    if (!compressionTIFF(compression, &code) || !checkTileTIFF(tilesize))
+        return -1;
+    memset(&mem, 0, sizeof(mem));
+    tif = memOpenTIFF(&mem, modeTIFF(nx, ny, nc, tilesize));
+    if (!tif) {
+        fprintf(stderr, "Unable to write TIFF data in memory\n");
+        return -1;
+    }
+    ok = writeTIFF(tif, data, nx, ny, nc, code, predictor, rowsperstrip,
+                   tilesize);
+    TIFFClose(tif);
+    if (!ok) {
+        free(mem.out);
+        return -1;
+    }
+    *bufp = mem.out;
+    *sizep = mem.size;
+    return 0;
+}
@@ -9,8 +9,34 @@ extern "C" {
 
 #include <stddef.h>
 
+/* compression of io_tiff_write_f32_opt() */
+#define IO_TIFF_NONE    0
+#define IO_TIFF_LZW     1
+#define IO_TIFF_DEFLATE 2
+#define IO_TIFF_ZSTD    3
+
 float *io_tiff_read_f32_gray(const char *fname, size_t *nx, size_t *ny);
+float *io_tiff_read_f32_gray_mem(const void *buf, size_t size, size_t *nx, size_t *ny);
+/* row by row reading of gray float images */
+typedef struct io_tiff_reader io_tiff_reader;
+io_tiff_reader *io_tiff_reader_open(const char *fname, size_t *nx, size_t *ny);
+int io_tiff_reader_read_f32(io_tiff_reader *rd, float *row);
+void io_tiff_reader_close(io_tiff_reader *rd);
 int io_tiff_write_f32(const char *fname, const float *data, size_t nx, size_t ny, size_t nc);
+int io_tiff_write_f32_opt(const char *fname, const float *data, size_t nx, size_t ny, size_t nc,
+                          int compression, int predictor, size_t rowsperstrip,
+                          size_t tilesize);
+int io_tiff_write_f32_mem(void **bufp, size_t *sizep, const float *data,
+                          size_t nx, size_t ny, size_t nc,
+                          int compression, int predictor, size_t rowsperstrip,
+                          size_t tilesize);
+/* row by row writing of gray float images */
+typedef struct io_tiff_stream io_tiff_stream;
+io_tiff_stream *io_tiff_stream_open(const char *fname, size_t nx, size_t ny,
+                                    int compression, int predictor, size_t rowsperstrip,
+                                    size_t tilesize);
+int io_tiff_stream_write_f32(io_tiff_stream *st, const float *row);
+int io_tiff_stream_close(io_tiff_stream *st);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,146 @@
+/**
+ * @file jpg.cpp
+ * @brief Input images in JPEG format, decoded at full or reduced size
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "jpg.h"
+#include "timing.h"
+#include <csetjmp>
+#include <cstdio>
+extern "C" {
+#include <jpeglib.h>
+}
+
+/// Has the file name the extension .jpg or .jpeg, in any case?
+bool is_jpeg(const std::string& fileName) {
+    const size_t dot = fileName.rfind('.');
+    if(dot == std::string::npos)
+        return false;
+    std::string ext = fileName.substr(dot+1);
+    for(size_t i=0; i<ext.size(); i++)
+        if('A'<=ext[i] && ext[i]<='Z')
+            ext[i] = static_cast<char>(ext[i]-'A'+'a');
+    return (ext=="jpg" || ext=="jpeg");
+}
+
+/// Do \a data of \a size bytes begin with the JPEG signature (SOI marker)?
+bool is_jpeg(const void* data, size_t size) {
+    const unsigned char* s = static_cast<const unsigned char*>(data);
+    return (size>=3 && s[0]==0xFF && s[1]==0xD8 && s[2]==0xFF);
+}
+
+/// Errors of libjpeg, returning to the caller instead of exiting
+struct JpegError {
+    jpeg_error_mgr mgr; ///< First, as libjpeg sees it
+    std::jmp_buf jump;  ///< Return point of a fatal error
+};
+
+/// Fatal error of libjpeg: jump back to load_jpeg.
+static void jpegExit(j_common_ptr info) {
+    std::longjmp(reinterpret_cast<JpegError*>(info->err)->jump, 1);
+}
+
+/// Warnings of libjpeg are not displayed, as for PNG.
+static void jpegMessage(j_common_ptr) {}
+
+/// Decode the JPEG of \a info, whose source is set, in \a im reduced by
+/// \a reduce. Fatal errors of libjpeg jump out: no object with a destructor
+/// is created here.
+static bool decode(jpeg_decompress_struct& info, Image& im, int reduce) {
+    jpeg_read_header(&info, TRUE);
+    const bool gray = (info.num_components == 1);
+    if(!gray && info.num_components!=3)
+        return false; // CMYK
+    info.out_color_space = gray? JCS_GRAYSCALE: JCS_RGB;
+    info.scale_num = 1;
+    info.scale_denom = reduce;
+    info.dct_method = JDCT_ISLOW;
+    jpeg_start_decompress(&info);
+    const int w=info.output_width, h=info.output_height;
+    const int c=info.output_components;
+    im = Image(w, h, 3, Image::Planar);
+    JSAMPARRAY row = (*info.mem->alloc_sarray)
+        (reinterpret_cast<j_common_ptr>(&info), JPOOL_IMAGE, w*c, 1);
+    while(info.output_scanline < info.output_height) {
+        const int y = info.output_scanline;
+        jpeg_read_scanlines(&info, row, 1);
+        const JSAMPLE* p = row[0];
+        float *r=&im(0,y,0), *g=&im(0,y,1), *b=&im(0,y,2);
+        if(gray)
+            for(int x=0; x<w; x++)
+                r[x] = g[x] = b[x] = p[x];
+        else
+            for(int x=0; x<w; x++, p+=3) {
+                r[x] = p[0];
+                g[x] = p[1];
+                b[x] = p[2];
+            }
+    }
+    jpeg_finish_decompress(&info);
+    return true;
+}
+
+/// Decode image \a im, planar with 3 channels, from JPEG \a data of \a size
+/// bytes, or from \a file if not 0.
+///
+/// With \a reduce 2, 4 or 8, libjpeg decodes directly at that fraction of the
+/// size, rounded up, by inverse DCT of the low frequencies only, which costs
+/// much less than a full decoding. Gray images are replicated in the three
+/// channels.
+static bool load(FILE* file, const void* data, size_t size, Image& im,
+                 int reduce) {
+    if(reduce!=1 && reduce!=2 && reduce!=4 && reduce!=8)
+        return false;
+    jpeg_decompress_struct info;
+    JpegError err;
+    info.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpegExit;
+    err.mgr.output_message = jpegMessage;
+    if(setjmp(err.jump)) {
+        jpeg_destroy_decompress(&info);
+        im = Image();
+        return false;
+    }
+    jpeg_create_decompress(&info);
+    if(file)
+        jpeg_stdio_src(&info, file);
+    else
+        jpeg_mem_src(&info,
+                     static_cast<unsigned char*>(const_cast<void*>(data)),
+                     static_cast<unsigned long>(size));
+    const bool ok = decode(info, im, reduce);
+    jpeg_destroy_decompress(&info);
+    if(! ok)
+        im = Image();
+    return ok;
+}
+
+/// Load image \a im from JPEG file \a fileName, reduced by \a reduce (1, 2,
+/// 4 or 8). No message is displayed in case of failure, as for loadImage.
+bool load_jpeg(const char* fileName, Image& im, int reduce) {
+    StageTimer timer("load");
+    FILE* file = std::fopen(fileName, "rb");
+    if(! file)
+        return false;
+    const bool ok = load(file, 0, 0, im, reduce);
+    std::fclose(file);
+    return ok;
+}
+
+/// Load image \a im from JPEG \a data of \a size bytes, reduced by \a reduce
+/// (1, 2, 4 or 8).
+bool load_jpeg(const void* data, size_t size, Image& im, int reduce) {
+    return is_jpeg(data, size) && load(0, data, size, im, reduce);
+}
@@ -0,0 +1,468 @@
+/**
+ * @file load_test.cpp
+ * @brief Latency and throughput of the service under a load of requests
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "engine.h"
+#include "loader.h"
+#include "parallel.h"
+#include "cmdLine.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#endif
+#ifdef __unix__
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if __cplusplus >= 201103L
+
+/// Pair replayed by the requests, its files kept in memory
+struct Pair {
+    std::string file1, file2;
+    std::vector<unsigned char> data1, data2; ///< Contents of the files
+    int dMin, dMax;
+};
+
+/// Request of the test, times in seconds from its start
+struct Request {
+    int pair;         ///< Index in the list of pairs
+    double scheduled; ///< Arrival, by the rate
+    double start;     ///< Taken by a client, after its queueing
+    double end;       ///< Response received
+    int w, h;         ///< Size of the map, 0 if the request failed
+};
+
+/// Requests shared by the clients, taken in order of arrival
+struct Load {
+    std::vector<Request> requests;
+    size_t next;  ///< First request not taken
+    bool closed;  ///< No rate: a request arrives when a client is free
+    std::chrono::steady_clock::time_point origin; ///< Start of the test
+    std::mutex mutex; ///< Lock of next
+    /// Seconds since the start of the test
+    double now() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                             -origin).count();
+    }
+};
+
+/// Whole content of file \a name in \a data.
+static bool readFile(const std::string& name,
+                     std::vector<unsigned char>& data) {
+    std::ifstream file(name.c_str(), std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(file),
+                std::istreambuf_iterator<char>());
+    if(!file || data.empty()) {
+        std::cerr << "Unable to read file " << name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Pairs listed in file \a name, lines "im1.png im2.png dmin dmax" possibly
+/// followed by other fields (a list of --batch), # beginning a comment.
+static bool readPairs(const char* name, std::vector<Pair>& pairs) {
+    std::ifstream file(name);
+    if(! file) {
+        std::cerr << "Unable to open file " << name << std::endl;
+        return false;
+    }
+    std::string line;
+    for(int n=1; std::getline(file, line); n++) {
+        std::istringstream str(line);
+        Pair p;
+        if(!(str>>p.file1) || p.file1[0]=='#')
+            continue;
+        if(!(str>>p.file2>>p.dMin>>p.dMax) || p.dMin>p.dMax) {
+            std::cerr << "Error line " << n << " of " << name
+                      << ": im1.png im2.png dmin dmax" << std::endl;
+            return false;
+        }
+        if(!readFile(p.file1, p.data1) || !readFile(p.file2, p.data2))
+            return false;
+        pairs.push_back(p);
+    }
+    if(pairs.empty())
+        std::cerr << "No pair in file " << name << std::endl;
+    return !pairs.empty();
+}
+
+/// Arrival times of \a n requests at \a rate per second, at regular
+/// intervals or, if \a poisson, as a Poisson process of seed \a seed. The
+/// pairs are taken in turn among \a pairs.
+static std::vector<Request> schedule(int n, int pairs, double rate,
+                                     bool poisson, unsigned int seed) {
+    std::mt19937 random(seed);
+    std::exponential_distribution<double> gap(rate>0? rate: 1);
+    std::vector<Request> r(n);
+    double t=0;
+    for(int i=0; i<n; i++) {
+        Request q = {i%pairs, t, 0, 0, 0, 0};
+        r[i] = q;
+        if(rate > 0)
+            t += poisson? gap(random): 1/rate;
+    }
+    return r;
+}
+
+/// Compute pair \a p as serve does, with \a engine: decoding, computation,
+/// left-right check and densification. Return false if it failed.
+static bool computeRequest(StereoEngine& engine, const Pair& p,
+                           int& w, int& h) {
+    Image im1, im2;
+    if(!loadImage(&p.data1[0], p.data1.size(), im1) ||
+       !loadImage(&p.data2[0], p.data2.size(), im2) ||
+       im1.width()!=im2.width() || im1.height()!=im2.height())
+        return false;
+    engine.compute(im1, im2, p.dMin, p.dMax);
+    engine.check();
+    engine.densify();
+    w = im1.width();
+    h = im1.height();
+    return true;
+}
+
+#ifdef __unix__
+/// Write \a size bytes of \a data on \a fd.
+static bool writeAll(int fd, const void* data, size_t size) {
+    const char* d = static_cast<const char*>(data);
+    while(size > 0) {
+        ssize_t n = ::write(fd, d, size);
+        if(n<0 && errno==EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        d += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/// Read exactly \a size bytes of \a fd in \a data.
+static bool readAll(int fd, void* data, size_t size) {
+    char* d = static_cast<char*>(data);
+    while(size > 0) {
+        ssize_t n = ::read(fd, d, size);
+        if(n<0 && errno==EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        d += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/// Request of pair \a p to the server at Unix socket \a path, on a new
+/// connection, the map being read in \a map. The server answers the
+/// connections one at a time, so that a client keeping its connection would
+/// hold the others back. Return false if the request failed.
+static bool sendRequest(const char* path, const Pair& p,
+                        std::vector<float>& map, int& w, int& h) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return false;
+    std::ostringstream head;
+    head << p.dMin << ' ' << p.dMax << ' ' << p.data1.size() << ' '
+         << p.data2.size() << '\n';
+    bool ok = (connect(fd, reinterpret_cast<sockaddr*>(&addr),
+                       sizeof(addr)) == 0 &&
+               writeAll(fd, head.str().data(), head.str().size()) &&
+               writeAll(fd, &p.data1[0], p.data1.size()) &&
+               writeAll(fd, &p.data2[0], p.data2.size()));
+    std::string line;
+    char c=0;
+    while(ok && line.size()<1024 && (ok=readAll(fd, &c, 1)) && c!='\n')
+        line += c;
+    std::istringstream s(line);
+    std::string status;
+    ok = ok && (s>>status>>w>>h) && status=="ok" && w>0 && h>0;
+    if(ok) {
+        map.resize(static_cast<size_t>(w)*h);
+        ok = readAll(fd, &map[0], map.size()*sizeof(float));
+    }
+    close(fd);
+    return ok;
+}
+#endif
+
+/// Client of the test: take the next request, wait for its arrival, and
+/// send it to the server at \a path, or compute it with \a engine on
+/// \a threads threads if \a path is 0, until none is left. Threads are set
+/// only with OpenMP, as for jobs of --batch-jobs.
+static void client(Load& load, const std::vector<Pair>& pairs,
+                   const char* path, StereoEngine* engine, int threads) {
+    if(engine && std::string(parallelBackend())=="OpenMP")
+        setParallelThreads(threads);
+    std::vector<float> map;
+    while(true) {
+        size_t i;
+        {
+            std::lock_guard<std::mutex> lock(load.mutex);
+            if(load.next == load.requests.size())
+                return;
+            i = load.next++;
+        }
+        Request& r = load.requests[i];
+        if(load.closed)
+            r.scheduled = load.now();
+        else
+            std::this_thread::sleep_until(load.origin +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>
+                (std::chrono::duration<double>(r.scheduled)));
+        r.start = load.now();
+        bool ok=false;
+        if(engine)
+            ok = computeRequest(*engine, pairs[r.pair], r.w, r.h);
+#ifdef __unix__
+        else
+            ok = sendRequest(path, pairs[r.pair], map, r.w, r.h);
+#endif
+        r.end = load.now();
+        if(! ok)
+            r.w = r.h = 0;
+    }
+}
+
+/// Percentile \a q in [0,1] of sorted values \a v, by nearest rank.
+static double percentile(const std::vector<double>& v, double q) {
+    if(v.empty())
+        return 0;
+    size_t i = static_cast<size_t>(std::ceil(q*v.size()));
+    return v[std::min(std::max(i,size_t(1)),v.size())-1];
+}
+
+/// Print the distribution of times \a v in ms on a row labelled \a label.
+static void printRow(const char* label, std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    double mean=0;
+    for(size_t i=0; i<v.size(); i++)
+        mean += v[i];
+    if(! v.empty())
+        mean /= static_cast<double>(v.size());
+    std::printf("%-18s %6d %9.1f %9.1f %9.1f %9.1f %9.1f\n", label,
+                static_cast<int>(v.size()), 1e3*percentile(v,0.5),
+                1e3*percentile(v,0.95), 1e3*percentile(v,0.99),
+                v.empty()? 0.0: 1e3*v.back(), 1e3*mean);
+}
+
+/// Write the times of the requests \a r in ms in file \a name, one per line.
+static bool writeRequests(const char* name, const std::vector<Request>& r,
+                          const std::vector<Pair>& pairs, int warmup) {
+    std::ofstream file(name);
+    file << "# pair width height warmup scheduled queue service latency\n";
+    for(size_t i=0; i<r.size(); i++)
+        file << pairs[r[i].pair].file1 << ' ' << r[i].w << ' ' << r[i].h
+             << ' ' << (static_cast<int>(i)<warmup) << ' '
+             << 1e3*r[i].scheduled << ' ' << 1e3*(r[i].start-r[i].scheduled)
+             << ' ' << 1e3*(r[i].end-r[i].start) << ' '
+             << 1e3*(r[i].end-r[i].scheduled) << '\n';
+    if(! file) {
+        std::cerr << "Unable to write file " << name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Replay the pairs of a list as requests to the service (--serve on a Unix
+/// socket) or to the library, at a given rate and concurrency, and print the
+/// percentiles of latency, queueing delay and service time and the
+/// throughput.
+///
+/// The latency of a request runs from its scheduled arrival, not from its
+/// sending, so that a slow response delaying the next requests counts in
+/// their latency instead of hiding it (coordinated omission). The queueing
+/// delay is the wait for a free client; with a socket, the wait of the
+/// connection for the server is in the service time.
+int main(int argc, char *argv[]) {
+    CmdLine cmd; cmd.prefixDoc="    ";
+    ParamStereo param;
+    std::string aggreg("aw"), socketPath, output;
+    int requests=0, clients=1, warmup=-1, threads=0, seed=1;
+    double rate=0;
+    bool poisson=false;
+    cmd.add( make_option('S',socketPath,"socket")
+             .doc("Unix socket of a server (--serve), else the library") );
+    cmd.add( make_option('r',rate,"rate")
+             .doc("requests per second (0: each client sends the next one "
+                  "when answered)") );
+    cmd.add( make_option('c',clients,"clients")
+             .doc("concurrent requests, engines of the library sharing the "
+                  "threads") );
+    cmd.add( make_option('n',requests,"requests")
+             .doc("number of requests (0: 10 per pair)") );
+    cmd.add( make_option('w',warmup,"warmup")
+             .doc("first requests left out of the statistics (-1: one per "
+                  "client)") );
+    cmd.add( make_option(0,poisson,"poisson")
+             .doc("arrivals of a Poisson process instead of regular") );
+    cmd.add( make_option(0,seed,"seed")
+             .doc("seed of the Poisson arrivals") );
+    cmd.add( make_option('o',output,"output")
+             .doc("file of the times of each request, in ms") );
+    cmd.add( make_option('A',aggreg,"aggreg")
+             .doc("method of disparity of the library: aw, pm, gf, bg, "
+                  "cross or sgm") );
+    cmd.add( make_option('R',param.disparity.radius,"radius")
+             .doc("radius of the patch, for the library") );
+    cmd.add( make_option('j',threads,"threads")
+             .doc("threads of the library, 0 for default") );
+    try {
+        cmd.process(argc, argv);
+    } catch(std::string str) {
+        std::cerr << "Error: " << str << std::endl<<std::endl;
+        argc=1; // To display usage
+    }
+    if(argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " [options] pairs.txt\n"
+                  << "Options:\n" << cmd;
+        return 1;
+    }
+    if(rate<0 || clients<1 || requests<0 || threads<0) {
+        std::cerr << "Error: rate, clients, requests and threads must not be "
+                  << "negative, clients positive" << std::endl;
+        return 1;
+    }
+    if(!param.setAggregation(aggreg) || !param.disparity.check() ||
+       !param.occlusion.check())
+        return 1;
+#ifndef __unix__
+    if(! socketPath.empty()) {
+        std::cerr << "Error: socket requires a POSIX system" << std::endl;
+        return 1;
+    }
+#else
+    std::signal(SIGPIPE, SIG_IGN); // Server leaving is a failed request
+#endif
+    std::vector<Pair> pairs;
+    if(! readPairs(argv[1], pairs))
+        return 1;
+    if(requests == 0)
+        requests = 10*static_cast<int>(pairs.size());
+    if(warmup < 0)
+        warmup = clients;
+    warmup = std::min(warmup, requests);
+
+    // Engines of the library, the threads divided between them
+    const int each = std::max(1, (threads? threads: parallelThreads())/clients);
+    std::vector<StereoEngine*> engines;
+    if(socketPath.empty()) {
+        param.threads = 0; // Set by each client
+        for(int i=0; i<clients; i++)
+            engines.push_back(new StereoEngine(param, true));
+    }
+
+    Load load;
+    load.requests = schedule(requests, static_cast<int>(pairs.size()), rate,
+                             poisson, static_cast<unsigned int>(seed));
+    load.next = 0;
+    load.closed = (rate == 0);
+    load.origin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threadsOf;
+    for(int i=0; i<clients; i++)
+        threadsOf.push_back(std::thread(client, std::ref(load),
+                                        std::cref(pairs),
+                                        socketPath.empty()? 0:
+                                        socketPath.c_str(),
+                                        engines.empty()? 0: engines[i],
+                                        each));
+    for(int i=0; i<clients; i++)
+        threadsOf[i].join();
+    for(size_t i=0; i<engines.size(); i++)
+        delete engines[i];
+
+    // Statistics of the requests after warm-up, by size of images if several
+    const std::vector<Request>& r = load.requests;
+    std::vector<double> latency, queue, service;
+    std::vector< std::pair<int,int> > sizes;
+    int failed=0;
+    double first=0, last=0;
+    for(size_t i=warmup; i<r.size(); i++) {
+        if(r[i].w == 0) {
+            failed++;
+            continue;
+        }
+        if(latency.empty() || r[i].scheduled<first)
+            first = r[i].scheduled;
+        last = std::max(last, r[i].end);
+        latency.push_back(r[i].end-r[i].scheduled);
+        queue.push_back(r[i].start-r[i].scheduled);
+        service.push_back(r[i].end-r[i].start);
+        const std::pair<int,int> size(r[i].w, r[i].h);
+        if(std::find(sizes.begin(), sizes.end(), size) == sizes.end())
+            sizes.push_back(size);
+    }
+    const double throughput = (last>first)? latency.size()/(last-first): 0;
+    std::printf("# %d requests (%d warm-up) of %d pairs to %s, %d clients, ",
+                requests, warmup, static_cast<int>(pairs.size()),
+                socketPath.empty()? "library": socketPath.c_str(), clients);
+    if(rate > 0)
+        std::printf("%.2f requests/s %s\n", rate,
+                    poisson? "(Poisson)": "(regular)");
+    else
+        std::printf("closed loop\n");
+    std::printf("%-18s %6s %9s %9s %9s %9s %9s\n", "ms", "n", "p50", "p95",
+                "p99", "max", "mean");
+    printRow("latency", latency);
+    printRow("queue", queue);
+    printRow("service", service);
+    for(size_t s=0; sizes.size()>1 && s<sizes.size(); s++) {
+        std::vector<double> l;
+        for(size_t i=warmup; i<r.size(); i++)
+            if(r[i].w==sizes[s].first && r[i].h==sizes[s].second)
+                l.push_back(r[i].end-r[i].scheduled);
+        std::ostringstream label;
+        label << "latency " << sizes[s].first << 'x' << sizes[s].second;
+        printRow(label.str().c_str(), l);
+    }
+    std::printf("throughput %.2f requests/s, %d failed\n", throughput, failed);
+    if(rate>0 && throughput<0.95*rate && !latency.empty())
+        std::cerr << "Warning: the offered rate is not sustained, the queue "
+                  << "grows during the test" << std::endl;
+    if(!output.empty() &&
+       !writeRequests(output.c_str(), r, pairs, warmup))
+        return 1;
+    return (failed==0)? 0: 1;
+}
+
+#else
+
+/// Not available without C++11.
+int main() {
+    std::cerr << "Error: load_test requires C++11" << std::endl;
+    return 1;
+}
+
+#endif
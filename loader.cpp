@@ -0,0 +1,278 @@
+/**
+ * @file loader.cpp
+ * @brief Decoding of stereo pairs in a background thread
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "loader.h"
+#include "io_png.h"
+#include "jpg.h"
+#include "pnm.h"
+#include "timing.h"
+#include "video.h"
+#include <cstdio>
+
+/// Destination of PNG decoding: planar image, allocated once size is known.
+static void* imageDest(void* ctx, size_t nx, size_t ny,
+                       ptrdiff_t* sx, ptrdiff_t* sy, ptrdiff_t* sc) {
+    Image& im = *static_cast<Image*>(ctx);
+    im = Image(static_cast<int>(nx), static_cast<int>(ny), 3, Image::Planar);
+    *sx = 1;
+    *sy = im.stride();
+    *sc = &im(0,0,1)-&im(0,0,0);
+    return &im(0,0);
+}
+
+/// Load color image \a im, decoded directly in planar layout.
+///
+/// The format is PNG, unless the extension is that of JPEG or of PPM, PGM or
+/// PFM, read without decoding (see load_pnm). With \a reduce>1, the image is
+/// reduced by this factor: JPEG is decoded at that size for 2, 4 and 8 (see
+/// load_jpeg), other ones are reduced by Image::reduce. No message is
+/// displayed in case of failure, so that images can be loaded concurrently.
+bool loadImage(const char* name, Image& im, int reduce) {
+    if(is_jpeg(name) && (reduce==1 || reduce==2 || reduce==4 || reduce==8))
+        return load_jpeg(name, im, reduce);
+    bool ok;
+    if(is_jpeg(name))
+        ok = load_jpeg(name, im);
+    else if(is_pnm(name))
+        ok = load_pnm(name, im);
+    else {
+        StageTimer timer("load");
+        ok = (io_png_read_f32_rgb_to(name, imageDest, &im) == 0);
+    }
+    if(! ok) {
+        im = Image();
+        return false;
+    }
+    if(reduce > 1) {
+        StageTimer timer("reduce");
+        im = im.reduce(reduce);
+    }
+    return true;
+}
+
+/// Load color image \a im from PNG data \a buf of \a size bytes, or JPEG,
+/// PPM, PGM or PFM data by their signature.
+bool loadImage(const void* buf, size_t size, Image& im) {
+    StageTimer timer("load");
+    if(is_jpeg(buf, size) || is_pnm(buf, size)) {
+        if(load_jpeg(buf, size, im) || load_pnm(buf, size, im))
+            return true;
+        im = Image();
+        return false;
+    }
+    if(io_png_read_f32_rgb_mem_to(buf, size, imageDest, &im) == 0)
+        return true;
+    im = Image();
+    return false;
+}
+
+/// Contents of file \a name in \a buf, empty if not readable.
+static void readFile(const std::string& name, std::vector<unsigned char>& buf) {
+    StageTimer timer("read");
+    buf.clear();
+    FILE* f = fopen(name.c_str(), "rb");
+    if(! f)
+        return;
+    unsigned char block[1<<16];
+    size_t n;
+    while((n=fread(block, 1, sizeof(block), f)) > 0)
+        buf.insert(buf.end(), block, block+n);
+    if(ferror(f))
+        buf.clear();
+    fclose(f);
+}
+
+/// Decode image \a im of file \a name, from its contents \a png if read.
+static void decode(const std::string& name, std::vector<unsigned char>& png,
+                   Image& im) {
+    if(png.empty())
+        loadImage(name.c_str(), im);
+    else
+        loadImage(&png[0], png.size(), im);
+    std::vector<unsigned char>().swap(png); // Release
+}
+
+/// Decode the images of \a pair, left empty if not readable.
+static void decode(StereoPair& pair) {
+    decode(pair.file1, pair.png1, pair.im1);
+    decode(pair.file2, pair.png2, pair.im2);
+}
+
+/// Are \a file1 and \a file2 videos, whose frames are the pairs?
+static bool videoPair(const std::string& file1, const std::string& file2) {
+    return is_video(file1) && is_video(file2);
+}
+
+/// Bytes of the decoded images of \a pair.
+static size_t bytes(const StereoPair& pair) {
+    return sizeof(float)*(static_cast<size_t>(pair.im1.stride())*
+                          pair.im1.height()*pair.im1.channels() +
+                          static_cast<size_t>(pair.im2.stride())*
+                          pair.im2.height()*pair.im2.channels());
+}
+
+#if __cplusplus >= 201103L
+
+/// Constructor, starting the thread decoding \a pairs and the \a readers
+/// threads reading their files. The queue holds at most \a capacity pairs
+/// and \a memory bytes of images.
+PairLoader::PairLoader(const std::vector<StereoPair>& p, size_t capacity,
+                       size_t memory, size_t nReaders)
+: pairs(p), cap(capacity>0? capacity: 1), mem(memory), iNext(0),
+  ahead(nReaders), iRead(0), ready(pairs.size(), 0), bytes(0), done(false),
+  thread(&PairLoader::run, this) {
+    for(size_t i=0; i<nReaders; i++)
+        readers.push_back(std::thread(&PairLoader::read, this));
+}
+
+/// Loop of a reader thread: read the files of the pairs from the one being
+/// decoded, at most ahead of them.
+void PairLoader::read() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(!done && iRead < pairs.size()) {
+        if(iRead > iNext+ahead) {
+            cond.wait(lock);
+            continue;
+        }
+        const size_t i = iRead++;
+        const std::string file1=pairs[i].file1, file2=pairs[i].file2;
+        lock.unlock();
+        std::vector<unsigned char> png1, png2;
+        if(! videoPair(file1, file2)) { // Videos are read by ffmpeg
+            readFile(file1, png1);
+            readFile(file2, png2);
+        }
+        lock.lock();
+        pairs[i].png1.swap(png1);
+        pairs[i].png2.swap(png2);
+        ready[i] = 1;
+        cond.notify_all();
+    }
+}
+
+/// Decode the frames of videos \a video in turn, queued while the queue is not
+/// full, taking \a lock, which is taken at the return. The maps of frame n
+/// have the prefix of \a video followed by _n on 6 digits.
+void PairLoader::frames(const StereoPair& video,
+                        std::unique_lock<std::mutex>& lock) {
+    VideoReader v1, v2;
+    v1.open(video.file1);
+    v2.open(video.file2);
+    for(int n=0; true; n++) {
+        StereoPair pair;
+        pair.file1 = video.file1;
+        pair.file2 = video.file2;
+        pair.dMin = video.dMin;
+        pair.dMax = video.dMax;
+        char number[16];
+        std::sprintf(number, "_%06d", n);
+        pair.prefix = video.prefix + number;
+        const bool ok = v1.next(pair.im1) && v2.next(pair.im2);
+        if(!ok && n>0) { // End of the shortest video
+            lock.lock();
+            return;
+        }
+        const size_t b = ::bytes(pair);
+        lock.lock();
+        while(!done && !queue.empty() && (queue.size() >= cap || bytes >= mem))
+            cond.wait(lock);
+        if(done)
+            return;
+        bytes += b;
+        queue.push_back(std::move(pair)); // Not readable if first and not ok
+        cond.notify_all();
+        if(! ok)
+            return;
+        lock.unlock();
+    }
+}
+
+/// Loop of the thread: decode pairs while the queue is not full.
+void PairLoader::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(iNext < pairs.size()) {
+        while(!done && ((!queue.empty() &&
+                         (queue.size() >= cap || bytes >= mem)) ||
+                        (ahead>0 && !ready[iNext])))
+            cond.wait(lock);
+        if(done)
+            return;
+        StereoPair pair = std::move(pairs[iNext]);
+        lock.unlock();
+        if(videoPair(pair.file1, pair.file2)) {
+            frames(pair, lock);
+            pairs[iNext++] = StereoPair();
+            cond.notify_all();
+            continue;
+        }
+        decode(pair);
+        const size_t b = ::bytes(pair);
+        lock.lock();
+        pairs[iNext++] = StereoPair(); // Release file names
+        bytes += b;
+        queue.push_back(std::move(pair));
+        cond.notify_all();
+    }
+}
+
+/// Next pair in \a pair, waiting for its decoding. Return false after the
+/// last pair.
+bool PairLoader::next(StereoPair& pair) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(queue.empty() && iNext < pairs.size())
+        cond.wait(lock);
+    if(queue.empty())
+        return false;
+    pair = std::move(queue.front());
+    queue.pop_front();
+    bytes -= ::bytes(pair);
+    cond.notify_all();
+    return true;
+}
+
+/// Destructor, stopping the thread.
+PairLoader::~PairLoader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cond.notify_all();
+    thread.join();
+    for(size_t i=0; i<readers.size(); i++)
+        readers[i].join();
+}
+
+#else
+
+/// Constructor, pairs being decoded by next(), without reader.
+PairLoader::PairLoader(const std::vector<StereoPair>& p, size_t capacity,
+                       size_t memory, size_t)
+: pairs(p), cap(capacity), mem(memory), iNext(0) {}
+
+/// Next pair in \a pair, decoded at once. Return false after the last pair.
+bool PairLoader::next(StereoPair& pair) {
+    if(iNext >= pairs.size())
+        return false;
+    pair = pairs[iNext++];
+    decode(pair);
+    return true;
+}
+
+/// Destructor
+PairLoader::~PairLoader() {}
+
+#endif
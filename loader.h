@@ -0,0 +1,83 @@
+/**
+ * @file loader.h
+ * @brief Decoding of stereo pairs in a background thread
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "image.h"
+#include <string>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#endif
+
+bool loadImage(const char* name, Image& im, int reduce=1);
+bool loadImage(const void* buf, size_t size, Image& im);
+
+/// Stereo pair of a batch
+struct StereoPair {
+    std::string file1, file2; ///< PNG images
+    int dMin, dMax;           ///< Disparity range
+    std::string prefix;       ///< Prefix of output maps
+    Image im1, im2;           ///< Decoded images, empty if not readable
+    std::vector<unsigned char> png1, png2; ///< Files read ahead, or empty
+};
+
+/// Loader of stereo pairs with loadImage, in a background thread.
+///
+/// The pairs are decoded in order while the previous ones are processed. The
+/// queue holds at most a given number of decoded pairs and a given memory,
+/// except that the next pair is always decoded. With reader threads, the
+/// files of the next pairs are read in memory concurrently, one pair per
+/// reader, ahead of the decoding, so that the latency of the storage
+/// overlaps. A pair of video files (see is_video) gives the pairs of their
+/// frames in turn, decoded by VideoReader. Without C++11, a pair is read and
+/// decoded when asked by next(), videos being unsupported.
+class PairLoader {
+public:
+    PairLoader(const std::vector<StereoPair>& pairs, size_t capacity=2,
+               size_t memory=size_t(512)<<20, size_t readers=0);
+    ~PairLoader();
+    bool next(StereoPair& pair);
+private:
+    std::vector<StereoPair> pairs; ///< Pairs to decode
+    size_t cap;   ///< Capacity of queue, in pairs
+    size_t mem;   ///< Capacity of queue, in bytes
+    size_t iNext; ///< Index of next pair to decode
+#if __cplusplus >= 201103L
+    size_t ahead;        ///< Pairs read ahead of the decoding, 0 for none
+    size_t iRead;        ///< Index of next pair to read
+    std::vector<char> ready; ///< Files of pair read, by index
+    std::deque<StereoPair> queue; ///< Decoded pairs
+    size_t bytes;        ///< Memory of decoded pairs
+    bool done;           ///< Stop decoding
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+    std::vector<std::thread> readers;
+    void run();
+    void read();
+    void frames(const StereoPair& video, std::unique_lock<std::mutex>& lock);
+#endif
+    PairLoader(const PairLoader&);            ///< Forbidden
+    PairLoader& operator=(const PairLoader&); ///< Forbidden
+};
+
+#endif
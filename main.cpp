@@ -18,42 +18,1174 @@
 
 #include "disparity.h"
 #include "occlusion.h"
+#include "engine.h"
+#include "writer.h"
+#include "stream.h"
+#include "loader.h"
+#include "video.h"
+#include "server.h"
+#include "resultCache.h"
+#include "parallel.h"
+#include "timing.h"
+#include "simdKernels.h"
 #include "image.h"
 #include "cmdLine.h"
-#include "io_png.h"
+#include "io_tiff.h"
+#include "nan.h"
+#include "pfm.h"
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#if __cplusplus >= 201103L
+#include <mutex>
+#include <thread>
+#endif
 
 /// Default prefix of output image files
 static const char* PREFIX="disparity";
 static const char* SUFFIX1=".tif";     ///< Suffix for output 1: dense disparity
 static const char* SUFFIX2="_occ.tif"; ///< Suffix for output 2: LR filtered
 static const char* SUFFIX3="_pp.tif";  ///< Suffix for output 3: post_processed
+static const char* SUFFIX_POINTS="_points.txt"; ///< Output of point queries
+static const char* SUFFIX_CONF="_conf.tif"; ///< Output of confidence map
+static const char* SUFFIX_RIGHT="_right.tif"; ///< Output of disparity of im2
+static const char* SUFFIX_TOPK="_topk.tif"; ///< Output of best candidates
+/// Output of filled disparity of im2
+static const char* SUFFIX_RIGHT_PP="_right_pp.tif";
 
 #ifndef COMB
 #error "The macro COMB must be set to one of the allowed values at compilation"
 #endif
 
-/// Load color image
-Image loadImage(const char* name) {
+/// Load per-pixel bound of disparity range from float TIFF image.
+///
+/// Values are rounded outwards, to the floor for a lower bound (\a lower) and
+/// to the ceiling otherwise. NaN values are replaced by \a def.
+Image loadRange(const char* name, bool lower, int def) {
     size_t width, height;
-    float* pix = io_png_read_f32_rgb(name, &width, &height);
+    float* pix = io_tiff_read_f32_gray(name, &width, &height);
     if(! pix) {
-        std::cerr << "Unable to read file " << name << " as PNG" << std::endl;
+        std::cerr << "Unable to read file " << name << " as TIFF" << std::endl;
         std::exit(1);
     }
     const int w=static_cast<int>(width), h=static_cast<int>(height);
-    Image im(w, h, 3);
-    const float *r=pix, *g=r+w*h, *b=g+w*h;
+    for(size_t i=0; i<width*height; i++) // Rounded in place
+        pix[i] = (! is_number(pix[i]))? static_cast<float>(def):
+            lower? std::floor(pix[i]): std::ceil(pix[i]);
+    return Image(pix, std::free, w, h);
+}
+
+/// Suffix \a suffix of an output map, with extension \a ext.
+static std::string mapSuffix(const char* suffix, const std::string& ext) {
+    std::string s(suffix);
+    s.replace(s.rfind('.'), std::string::npos, ext);
+    return s;
+}
+
+/// Load disparity map saved by save_disparity, NaN values becoming \a def.
+///
+/// A PFM file is mapped in \a map, which must outlive the returned image.
+static Image loadDisparity(const std::string& name, int def, MappedPFM& map) {
+    Image disp;
+    if(is_pfm(name)) {
+        if(map.open(name.c_str()))
+            disp = map.image();
+    } else {
+        size_t width, height;
+        float* pix = io_tiff_read_f32_gray(name.c_str(), &width, &height);
+        if(pix)
+            disp = Image(pix, std::free, static_cast<int>(width),
+                         static_cast<int>(height));
+    }
+    if(disp.width() == 0) {
+        std::cerr << "Unable to read disparity map " << name << std::endl;
+        std::exit(1);
+    }
+    for(int y=0; y<disp.height(); y++)
+        for(int x=0; x<disp.width(); x++)
+            if(! is_number(disp(x,y)))
+                disp(x,y) = static_cast<float>(def);
+    return disp;
+}
+
+/// Load query points, a pair of coordinates x y per line.
+static bool loadPoints(const char* name, std::vector<PointDisparity>& pts) {
+    std::ifstream file(name);
+    if(! file) {
+        std::cerr << "Unable to read file " << name << std::endl;
+        return false;
+    }
+    PointDisparity p;
+    while(file >> p.x >> p.y)
+        pts.push_back(p);
+    if(! file.eof()) {
+        std::cerr << "Error reading point " << pts.size()+1 << " in file "
+                  << name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Save results of point queries: x y disparity, then the cost curve.
+static bool savePoints(const std::string& name,
+                       const std::vector<PointDisparity>& pts) {
+    std::ofstream file(name.c_str());
+    for(size_t i=0; i<pts.size(); i++) {
+        file << pts[i].x << ' ' << pts[i].y << ' ' << pts[i].disparity;
+        for(size_t k=0; k<pts[i].cost.size(); k++)
+            file << ' ' << pts[i].cost[k];
+        file << '\n';
+    }
+    return !file.fail();
+}
+
+/// Parse disparity range \a lo \a hi into \a dMin and \a dMax.
+static bool parseRange(const char* lo, const char* hi, int& dMin, int& dMax) {
+    if(! ((std::istringstream(lo)>>dMin).eof() &&
+          (std::istringstream(hi)>>dMax).eof())) {
+        std::cerr << "Error reading dMin or dMax" << std::endl;
+        return false;
+    }
+    if(dMin>dMax) {
+        std::cerr << "Wrong disparity range! (dMin > dMax)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Options of the computation of a pair, shared by all pairs of a batch
+/// Measures of a pair for --stats
+struct PairStats {
+    std::string file1, file2; ///< Images
+    int width, height;        ///< Dimensions of the maps
+    int dMin, dMax;           ///< Disparity range
+    int searchMin, searchMax; ///< Range searched, see --auto-range
+    long occluded;            ///< Pixels failing the left-right check, or -1
+    long filled;              ///< Occluded pixels given a value, or -1
+    int quality;              ///< Level of --deadline, or -1
+    double seconds;           ///< Time of the pair with --deadline
+    bool cached;              ///< Maps of --result-cache, not computed
+    double allocs, bytes;     ///< Heap allocations of the pair, or -1
+};
+
+/// Statistics of the run, written in JSON by --stats
+struct RunStats {
+    std::string aggreg, rawCost, comb, filler; ///< Names of the methods
+    std::vector<PairStats> pairs; ///< Pairs processed, in order
+};
+
+/// Quality levels of --deadline, from the given parameters (0) to the
+/// cheapest, see deadlineParam
+static const int DEADLINE_LEVELS=4;
+
+/// Factor of the estimated time of the finer level at each pair of
+/// --deadline, so that it is tried again when the scenes get easier
+static const double DEADLINE_DECAY=0.9;
+
+/// Budget per pair of --deadline, and state of its callback of progress
+struct Deadline {
+    double budget; ///< Seconds per pair
+    double start;  ///< Time of start of the try of the current pair
+    double aggEnd; ///< Time of end of its aggregation, 0 if not reached
+    double rest;   ///< Seconds after aggregation in the last pair
+    int level;     ///< Quality level of the current pair
+    bool behind;   ///< Aggregation cancelled, late for the budget
+    double cost[DEADLINE_LEVELS]; ///< Last seconds of levels, 0 if unknown
+};
+
+struct Options {
+    ParamStereo stereo;        ///< Parameters of the engine
+    std::string rangeLo, rangeHi; ///< Files of per-pixel disparity range
+    std::string points;        ///< File of query points
+    bool conf, saveRight;      ///< Output of confidence and of im2
+    bool outDisp, outOcc;      ///< Output of raw and checked maps
+    bool progressive;          ///< Maps of coarse levels written first
+    std::string load;          ///< Prefix of maps, post-processing only
+    std::string ext;           ///< Extension of output maps
+    int temporal;              ///< Range around previous frame, -1: none
+    float temporalConf;        ///< Min confidence to use previous frame
+    int rowsBegin, rowsEnd;    ///< Band of rows of the maps, all if empty
+    int rowsHalo;              ///< Rows computed around the band
+    RunStats* stats;           ///< Statistics of --stats, or 0
+    Deadline* deadline;        ///< Budget of --deadline, or 0
+    ResultCache* cache;        ///< Maps of pairs of --result-cache, or 0
+};
+
+/// Disparity map of the previous frame of a sequence, prior of the next one
+struct Temporal {
+    Image disparity;  ///< Disparity map of im1, before left-right check
+    Image confidence; ///< Its confidence, 0 where it may be out of its range
+};
+
+/// Per-pixel range \a lo, \a hi from the previous frame \a prev.
+///
+/// Where the confidence is at least \a minConf, the range is the one of the
+/// disparities of the 3x3 neighborhood in \a prev, extended by \a k;
+/// elsewhere, it is the full range [\a dMin,\a dMax].
+static void temporalRange(const Temporal& prev, int k, float minConf,
+                           int dMin, int dMax, Image& lo, Image& hi) {
+    const Image& d = prev.disparity;
+    const int w=d.width(), h=d.height();
+    lo = Image(w,h);
+    hi = Image(w,h);
     for(int y=0; y<h; y++)
         for(int x=0; x<w; x++) {
-            im(x,y,0) = *r++;
-            im(x,y,1) = *g++;
-            im(x,y,2) = *b++;
+            if(! (prev.confidence(x,y) >= minConf)) { // Also false for NaN
+                lo(x,y) = static_cast<float>(dMin);
+                hi(x,y) = static_cast<float>(dMax);
+                continue;
+            }
+            float l=d(x,y), u=d(x,y);
+            for(int j=std::max(0,y-1); j<=std::min(h-1,y+1); j++)
+                for(int i=std::max(0,x-1); i<=std::min(w-1,x+1); i++) {
+                    l = std::min(l, d(i,j));
+                    u = std::max(u, d(i,j));
+                }
+            lo(x,y) = std::floor(l)-k;
+            hi(x,y) = std::ceil(u)+k;
+        }
+}
+
+/// Keep disparity map \a disp and its \a confidence in \a prev, for the next
+/// frame. The confidence is set to 0 where the disparity is at a bound of a
+/// restricted range \a lo, \a hi: the right one may be beyond.
+static void temporalKeep(const Image& disp, const Image& confidence,
+                         const Image& lo, const Image& hi, int dMin, int dMax,
+                         Temporal& prev) {
+    prev.disparity = disp.clone();
+    prev.confidence = confidence.clone();
+    if(lo.width() == 0)
+        return;
+    for(int y=0; y<disp.height(); y++)
+        for(int x=0; x<disp.width(); x++) {
+            const float d=disp(x,y);
+            if((d<=lo(x,y) && lo(x,y)>dMin) || (d>=hi(x,y) && hi(x,y)<dMax))
+                prev.confidence(x,y) = 0;
+        }
+}
+
+/// Rows [\a top,\a top+\a n) of map \a disp, the whole map if \a n is 0.
+static Image bandRows(const Image& disp, int top, int n) {
+    return (n==0)? disp: disp.view(0, top, disp.width(), n);
+}
+
+/// Save rows [\a top,\a top+\a n) (all if \a n is 0) of candidates \a c in
+/// float TIFF file \a name, the k planes of disparities being followed by the
+/// k planes of costs.
+static bool saveCandidates(const std::string& name, const Candidates& c,
+                           int top, int n) {
+    const Image disp=bandRows(c.disp,top,n), cost=bandRows(c.cost,top,n);
+    const int w=disp.width(), h=disp.height(), k=c.k();
+    std::vector<float> planes(static_cast<size_t>(2*k)*w*h);
+    for(int i=0; i<2*k; i++) {
+        const Image& im = (i<k)? disp: cost;
+        float* out = &planes[static_cast<size_t>(i)*w*h];
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++)
+                *out++ = im(x,y,i%k);
+    }
+    if(io_tiff_write_f32(name.c_str(), &planes[0], w, h, 2*k) != 0) {
+        std::cerr << "Error writing file " << name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Map of image 1 at the coarse levels of --progressive
+struct Preview {
+    DisparityWriter* writer; ///< Writer of the maps
+    std::string file;        ///< Disparity map, rewritten at each level
+    int width, height;       ///< Dimensions of the map
+    int dMin, dMax;          ///< Disparity range
+};
+
+/// Callback of --progressive: save map \a disp of the level reduced by
+/// \a factor, invalid below \a cMin, in the file of the disparity map,
+/// enlarged to full resolution by nearest neighbor and its disparities
+/// multiplied by \a factor.
+static void savePreview(const Image& disp, int factor, int cMin,
+                        void* data) {
+    const Preview& p = *static_cast<const Preview*>(data);
+    Image out(p.width, p.height);
+    for(int y=0; y<p.height; y++)
+        for(int x=0; x<p.width; x++) {
+            const float v = disp(std::min(x/factor,disp.width()-1),
+                                 std::min(y/factor,disp.height()-1));
+            out(x,y) = (v < cMin)? static_cast<float>(p.dMin-1):
+                std::min(std::max(v*factor, static_cast<float>(p.dMin)),
+                         static_cast<float>(p.dMax));
+        }
+    p.writer->save(p.file, out, p.dMin, p.dMax);
+}
+
+/// Save map \a disp in file \a prefix+\a suffix by \a writer, values in
+/// [\a dMin,\a dMax], and add a copy to \a keep if not 0.
+static void saveMap(DisparityWriter& writer, const std::string& prefix,
+                    const std::string& suffix, const Image& disp,
+                    int dMin, int dMax, std::vector<CachedMap>* keep) {
+    writer.save(prefix+suffix, disp, dMin, dMax);
+    if(keep) {
+        CachedMap m = {suffix, disp.clone(), dMin, dMax};
+        keep->push_back(m);
+    }
+}
+
+/// Compute and save the disparity maps of decoded stereo \a pair.
+///
+/// The maps are queued in \a writer. If \a prev is not 0, it is the previous
+/// frame of a sequence, see temporalRange, and it is updated with this one.
+/// If the options have a band of rows, only these rows are written, computed
+/// on the images restricted to the band and its halo. With a cache of results,
+/// the maps of inputs already computed are saved from it. Return false in
+/// case of error, with a message.
+static bool processPair(const StereoPair& pair, const Options& opt,
+                        StereoEngine& engine, DisparityWriter& writer,
+                        Temporal* prev=0) {
+    Image im1=pair.im1, im2=pair.im2;
+    const int dMin=pair.dMin, dMax=pair.dMax;
+    const std::string& prefix=pair.prefix;
+    if(im1.width()==0 || im2.width()==0) {
+        std::cerr << "Unable to read file "
+                  << (im1.width()? pair.file2: pair.file1) << " as image"
+                  << std::endl;
+        return false;
+    }
+    const int width=im1.width(), height=im1.height();
+    if(width!=im2.width() || height!=im2.height()) {
+        std::cerr << "The images must have the same size!" << std::endl;
+        return false;
+    }
+
+    // Band of rows, with the rows of its halo
+    int top=0; // First row of the band in the maps
+    const int rows=opt.rowsEnd-opt.rowsBegin;
+    if(rows > 0) {
+        if(opt.rowsEnd > height) {
+            std::cerr << "The band of rows ends beyond the image height "
+                      << height << std::endl;
+            return false;
+        }
+        const int b0=std::max(0,opt.rowsBegin-opt.rowsHalo);
+        const int b1=std::min(height,opt.rowsEnd+opt.rowsHalo);
+        im1 = im1.view(0, b0, width, b1-b0);
+        im2 = im2.view(0, b0, width, b1-b0);
+        top = opt.rowsBegin-b0;
+    }
+
+    // Per-pixel disparity range
+    Image dLo, dHi;
+    if(! opt.rangeLo.empty()) {
+        dLo = loadRange(opt.rangeLo.c_str(), true, dMin);
+        dHi = loadRange(opt.rangeHi.c_str(), false, dMax);
+        if(dLo.width()!=width || dLo.height()!=height ||
+           dHi.width()!=width || dHi.height()!=height) {
+            std::cerr << "The range images must have the size of the images"
+                      << std::endl;
+            return false;
+        }
+    } else if(prev && prev->disparity.width()==width &&
+              prev->disparity.height()==height)
+        temporalRange(*prev, opt.temporal, opt.temporalConf, dMin, dMax,
+                      dLo, dHi);
+
+    // Sparse query points
+    if(! opt.points.empty()) {
+        std::vector<PointDisparity> pts;
+        if(! loadPoints(opt.points.c_str(), pts))
+            return false;
+        disparityPoints(im1, im2, dMin, dMax, opt.stereo.disparity, pts);
+        if(! savePoints(prefix+SUFFIX_POINTS, pts)) {
+            std::cerr << "Error writing file " << prefix+SUFFIX_POINTS
+                      << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Maps of the same inputs computed before
+    const unsigned long long key = opt.cache?
+        ResultCache::key(im1, im2, dMin, dMax, opt.stereo): 0;
+    std::vector<CachedMap> kept; // Maps saved, for the cache
+    std::vector<CachedMap>* keep = opt.cache? &kept: 0;
+    if(opt.cache && opt.cache->find(key, kept)) {
+        for(size_t i=0; i<kept.size(); i++)
+            writer.save(prefix+kept[i].suffix, kept[i].map,
+                        kept[i].dMin, kept[i].dMax);
+        if(opt.stats) {
+            PairStats s = {pair.file1, pair.file2, width, height, dMin, dMax,
+                           dMin, dMax, -1, -1, -1, 0, true, -1, -1};
+            opt.stats->pairs.push_back(s);
+        }
+        return true;
+    }
+
+    // Compute disparity using the selected aggregation, or load it.
+    MappedPFM map1, map2; // Files of --load in PFM format
+    if(! opt.load.empty()) {
+        Image disp1 = loadDisparity(opt.load+mapSuffix(SUFFIX1,opt.ext),
+                                    dMin-1, map1);
+        Image disp2 = loadDisparity(opt.load+mapSuffix(SUFFIX_RIGHT,opt.ext),
+                                    dMin-1, map2);
+        if(disp1.width()!=width || disp1.height()!=height ||
+           disp2.width()!=width || disp2.height()!=height) {
+            std::cerr << "The loaded disparity maps must have the size of "
+                      << "the images" << std::endl;
+            return false;
+        }
+        engine.set(im1, dMin, dMax, disp1, disp2);
+    } else {
+        Preview preview = {&writer, prefix+mapSuffix(SUFFIX1,opt.ext),
+                           width, height, dMin, dMax};
+        if(opt.progressive)
+            engine.setPreview(savePreview, &preview);
+        engine.compute(im1, im2, dMin, dMax, dLo, dHi);
+        engine.setPreview(0);
+    }
+    if(computationCancelled()) {
+        if(!opt.deadline || !opt.deadline->behind)
+            std::cerr << "Cancelled" << std::endl;
+        return false;
+    }
+
+    if(prev)
+        temporalKeep(engine.disparity(), engine.confidence(), dLo, dHi,
+                     dMin, dMax, *prev);
+
+    // Save disparity image
+    if(opt.outDisp)
+        saveMap(writer, prefix, mapSuffix(SUFFIX1,opt.ext),
+                bandRows(engine.disparity(),top,rows), dMin,dMax, keep);
+
+    // Save disparity image of im2, for later post-processing
+    if(opt.saveRight)
+        saveMap(writer, prefix, mapSuffix(SUFFIX_RIGHT,opt.ext),
+                bandRows(engine.disparityRight(),top,rows), -dMax,-dMin, keep);
+
+    // Save confidence map
+    if(opt.conf)
+        saveMap(writer, prefix, mapSuffix(SUFFIX_CONF,opt.ext),
+                bandRows(engine.confidence(),top,rows), 0,1, keep);
+
+    // Save best candidates
+    if(opt.stereo.topK>0 &&
+       !saveCandidates(prefix+SUFFIX_TOPK, engine.candidates(), top, rows))
+        return false;
+
+    // Detecting occlusions
+    engine.check();
+    if(opt.outOcc)
+        saveMap(writer, prefix, mapSuffix(SUFFIX2,opt.ext),
+                bandRows(engine.disparity(),top,rows), dMin,dMax, keep);
+
+    // Fill occlusions (post-processing), in place
+    const bool filled = engine.densify();
+    if(computationCancelled()) {
+        std::cerr << "Cancelled" << std::endl;
+        return false;
+    }
+    if(filled)
+        saveMap(writer, prefix, mapSuffix(SUFFIX3,opt.ext),
+                bandRows(engine.disparity(),top,rows), dMin,dMax, keep);
+    if(filled && engine.occlusionRight().width()>0)
+        saveMap(writer, prefix, mapSuffix(SUFFIX_RIGHT_PP,opt.ext),
+                bandRows(engine.disparityRight(),top,rows), -dMax,-dMin, keep);
+    if(keep)
+        opt.cache->add(key, *keep);
+
+    if(opt.stats) {
+        PairStats s = {pair.file1, pair.file2, im1.width(), im1.height(),
+                       dMin, dMax, dMin, dMax, -1, -1, -1, 0, false, -1, -1};
+        engine.searched(s.searchMin, s.searchMax);
+        if(opt.stereo.lrCheck) {
+            const std::vector<int> occ = engine.occlusion().pixels();
+            s.occluded = static_cast<long>(occ.size());
+            const Image& d = engine.disparity();
+            if(filled)
+                s.filled = 0;
+            for(size_t i=0; filled && i<occ.size(); i++)
+                if(d(occ[i]%s.width,occ[i]/s.width) >= static_cast<float>(dMin))
+                    ++s.filled;
+        }
+        opt.stats->pairs.push_back(s);
+    }
+    return true;
+}
+
+/// Parameters of quality \a level of --deadline, from those \a p of the
+/// level 0: stride of windows doubled (1), radius also halved (2), or
+/// bilateral grid (3), whose cost does not depend on the radius.
+static ParamStereo deadlineParam(ParamStereo p, int level) {
+    if(level >= 1)
+        p.disparity.stride *= 2;
+    if(level >= 2)
+        p.disparity.radius = std::max(1, p.disparity.radius/2);
+    if(level >= 3)
+        p.aggreg = ParamStereo::AggregBG;
+    return p;
+}
+
+/// Estimated seconds of a pair at quality \a level of \a d: the last time
+/// measured, else half the one of the level above, 0 if none is known.
+static double deadlineCost(const Deadline& d, int level) {
+    if(d.cost[level]>0 || level==0)
+        return d.cost[level];
+    return deadlineCost(d, level-1)/2;
+}
+
+/// Callback of progress of --deadline: cancel the aggregation if its end,
+/// extrapolated from its progress, plus the time after aggregation of the
+/// last pair exceed the budget, the estimate being the cost of the level.
+/// Not before 5% of the aggregation, nor at the cheapest level.
+static bool deadlineProgress(const Progress& p, void* data) {
+    Deadline& d = *static_cast<Deadline*>(data);
+    if(std::strcmp(p.step, "aggregation") != 0)
+        return true;
+    const double now = wallClock();
+    if(p.done == p.total)
+        d.aggEnd = now;
+    if(d.level+1>=DEADLINE_LEVELS || 20*p.done<p.total)
+        return true;
+    const double end = now-d.start + p.elapsed*(p.total-p.done)/p.done;
+    if(end+d.rest <= d.budget)
+        return true;
+    d.cost[d.level] = end+d.rest; // Estimate of the level
+    d.behind = true;
+    return false;
+}
+
+/// Compute and save the maps of \a pair in the budget of \a d, see
+/// processPair; \a engine is the one of adaptive weights, \a grid the one
+/// of the bilateral grid, created if needed.
+///
+/// The level of the pair is the one of the previous pair, raised if it was
+/// late, lowered if the finer level is unknown or expected in 80% of the
+/// budget, its estimate decaying by DEADLINE_DECAY at each pair. If
+/// the aggregation falls behind, it is cancelled and the pair restarted at
+/// the finest cheaper level fitting the time left. The level and the time
+/// are printed, and recorded in the statistics.
+static bool processDeadline(const StereoPair& pair, const Options& opt,
+                            StereoEngine& engine, StereoEngine*& grid,
+                            DisparityWriter& writer) {
+    Deadline& d = *opt.deadline;
+    int level = d.level;
+    if(level>0 && d.cost[level-1] <= .8*d.budget) // Unknown or fitting
+        --level;
+    else if(level+1<DEADLINE_LEVELS && d.cost[level]>d.budget)
+        ++level;
+    if(level>0 && d.cost[level-1]>0) // Finer level forgotten in time
+        d.cost[level-1] *= DEADLINE_DECAY;
+    const double start = wallClock();
+    bool ok;
+    while(true) {
+        const ParamStereo p = deadlineParam(opt.stereo, level);
+        if(p.aggreg==ParamStereo::AggregBG && !grid)
+            grid = new StereoEngine(p, true);
+        if(p.aggreg == ParamStereo::AggregAW)
+            engine.setDisparity(p.disparity);
+        d.start = wallClock();
+        d.aggEnd = 0;
+        d.level = level;
+        d.behind = false;
+        ok = processPair(pair, opt,
+                         (p.aggreg==ParamStereo::AggregBG)? *grid: engine,
+                         writer);
+        const double end = wallClock();
+        if(! d.behind) {
+            d.cost[level] = end-d.start;
+            if(d.aggEnd > 0)
+                d.rest = end-d.aggEnd;
+            break;
+        }
+        cancelComputation(false);
+        const double left = d.budget-(end-start);
+        while(++level+1<DEADLINE_LEVELS && deadlineCost(d,level)>left)
+            ;
+    }
+    const double seconds = wallClock()-start;
+    std::cerr << pair.file1 << ": quality " << level << ", "
+              << static_cast<int>(seconds*1000+.5) << "ms"
+              << ((seconds>d.budget)? " (late)": "") << std::endl;
+    if(ok && opt.stats) {
+        opt.stats->pairs.back().quality = level;
+        opt.stats->pairs.back().seconds = seconds;
+    }
+    return ok;
+}
+
+/// Pixels of a pair per thread below which its rows are too few for the
+/// threads: 1/16 of 640x480, see batchSplit
+static const long BATCH_PIXELS_PER_THREAD=19200;
+
+/// Split of \a threads between the pairs of a batch of \a pairs pairs of
+/// \a pixels pixels: \a jobs pairs computed concurrently, of \a each threads.
+///
+/// If \a jobs is 0, it is chosen for the throughput rather than the latency
+/// of a pair: a pair gets one thread per BATCH_PIXELS_PER_THREAD pixels, the
+/// parallel loops over rows scaling poorly beyond, and the other threads go
+/// to other pairs. Otherwise, the threads are divided between \a jobs pairs.
+static void batchSplit(long pixels, int pairs, int threads,
+                       int& jobs, int& each) {
+    threads = std::max(threads, 1);
+    if(jobs == 0) {
+        each = static_cast<int>(std::min(static_cast<long>(threads),
+                                         pixels/BATCH_PIXELS_PER_THREAD));
+        if(pixels <= 0) // Unknown size
+            each = threads;
+        jobs = threads/std::max(each,1);
+    }
+    jobs = std::max(1, std::min(std::min(jobs,pairs), threads));
+    each = std::max(1, threads/jobs);
+}
+
+#if __cplusplus >= 201103L
+/// Pairs of a batch computed by concurrent jobs, see processBatch
+struct BatchJobs {
+    BatchJobs(PairLoader& l, DisparityWriter& w)
+    : loader(l), writer(w), ok(true) {}
+    PairLoader& loader;      ///< Source of the pairs
+    DisparityWriter& writer; ///< Writer of the maps of all jobs
+    std::mutex mutex;        ///< Lock of ok and of failure messages
+    bool ok;                 ///< No pair failed
+};
+
+/// Job of processBatch: compute with \a engine on \a threads threads the
+/// first \a pair, if not empty, then the next ones of \a jobs until none is
+/// left. Threads are set for the job only with OpenMP, the other backends
+/// sharing theirs between jobs.
+static void batchJob(BatchJobs& jobs, Options opt, StereoEngine& engine,
+                     int threads, StereoPair pair) {
+    if(std::string(parallelBackend()) == "OpenMP")
+        setParallelThreads(threads);
+    bool first = !pair.file1.empty();
+    while(!computationCancelled() && (first || jobs.loader.next(pair))) {
+        first = false;
+        if(! processPair(pair, opt, engine, jobs.writer)) {
+            std::lock_guard<std::mutex> lock(jobs.mutex);
+            std::cerr << "Failure of pair " << pair.file1 << ' '
+                      << pair.file2 << std::endl;
+            jobs.ok = false;
+        }
+    }
+}
+#endif
+
+/// Process the pairs listed in file \a name, one per line:
+///     im1.png im2.png dmin dmax out_prefix
+/// Empty lines and lines beginning with # are ignored. The process, its
+/// threads and its memory are reused from one pair to the next: the images
+/// are recycled by their pool and the engine keeps its maps and the cost
+/// volume for the next pair (see recycleCosts). The work is pipelined: the
+/// next pairs are decoded by a PairLoader, in at most \a memory bytes, their
+/// files read ahead by \a readers threads, and the maps of the previous one
+/// are encoded by \a writer, while a pair is computed. With \a jobs other
+/// than 1, pairs are computed concurrently by their own engine and threads,
+/// see batchSplit, the split being printed if \a verbose. A failing pair is
+/// reported and skipped. Return false if one failed.
+static bool processBatch(const char* name, const Options& opt,
+                         DisparityWriter& writer, size_t memory,
+                         int readers, int jobs, bool verbose) {
+    std::ifstream file(name);
+    if(! file) {
+        std::cerr << "Unable to read file " << name << std::endl;
+        return false;
+    }
+    bool ok=true;
+    std::vector<StereoPair> pairs;
+    std::string line;
+    for(int n=1; std::getline(file, line); n++) {
+        std::istringstream str(line);
+        StereoPair p;
+        std::string lo, hi, extra;
+        if(!(str>>p.file1) || p.file1[0]=='#')
+            continue;
+        if(!(str>>p.file2>>lo>>hi>>p.prefix) || (str>>extra) ||
+           !parseRange(lo.c_str(), hi.c_str(), p.dMin, p.dMax)) {
+            std::cerr << "Error line " << n << " of " << name
+                      << ": im1.png im2.png dmin dmax out_prefix" << std::endl;
+            ok = false;
+        } else
+            pairs.push_back(p);
+    }
+#if __cplusplus >= 201103L
+    if(jobs != 1 && pairs.size() > 1) {
+        PairLoader loader(pairs, std::max(jobs,2), memory, readers);
+        StereoPair pair; // First one, giving the size of images
+        if(! loader.next(pair))
+            return ok;
+        const int threads = parallelThreads();
+        int each;
+        batchSplit(static_cast<long>(pair.im1.width())*pair.im1.height(),
+                   static_cast<int>(pairs.size()), threads, jobs, each);
+        if(verbose)
+            std::cerr << "Batch: " << jobs << " pairs in flight, " << each
+                      << " threads each" << std::endl;
+        ParamStereo p = opt.stereo;
+        p.threads = 0; // Set by each job
+        p.cpus.clear();
+        std::vector<StereoEngine*> engines;
+        std::vector<RunStats> stats(jobs);
+        std::vector<std::thread> threadsOf;
+        BatchJobs batch(loader, writer);
+        for(int i=0; i<jobs; i++) {
+            engines.push_back(new StereoEngine(p, true));
+            Options o = opt;
+            o.stats = opt.stats? &stats[i]: 0;
+            threadsOf.push_back(std::thread(batchJob, std::ref(batch), o,
+                                            std::ref(*engines[i]), each,
+                                            i? StereoPair(): pair));
+        }
+        for(int i=0; i<jobs; i++) {
+            threadsOf[i].join();
+            if(opt.stats)
+                opt.stats->pairs.insert(opt.stats->pairs.end(),
+                                        stats[i].pairs.begin(),
+                                        stats[i].pairs.end());
+        }
+        for(int i=0; i<jobs; i++)
+            delete engines[i];
+        return ok && batch.ok;
+    }
+#else
+    (void)jobs;
+    (void)verbose;
+#endif
+    StereoEngine engine(opt.stereo, true);
+    StereoEngine* grid=0; // Cheapest level of --deadline
+    if(opt.deadline)
+        setProgress(deadlineProgress, opt.deadline);
+    PairLoader loader(pairs, 2, memory, readers);
+    StereoPair pair;
+    Temporal prev;
+    while(!computationCancelled() && loader.next(pair)) {
+        double allocs, bytes; // Heap counts of the process, with ALLOC_COUNTERS
+        const bool heap = heapCounts(allocs, bytes);
+        const size_t done = opt.stats? opt.stats->pairs.size(): 0;
+        if(opt.deadline? !processDeadline(pair, opt, engine, grid, writer):
+           !processPair(pair, opt, engine, writer,
+                        (opt.temporal>=0)? &prev: 0)) {
+            std::cerr << "Failure of pair " << pair.file1 << ' ' << pair.file2
+                      << std::endl;
+            ok = false;
+        }
+        if(heap && opt.stats && opt.stats->pairs.size()>done) {
+            PairStats& s = opt.stats->pairs.back();
+            heapCounts(s.allocs, s.bytes);
+            s.allocs -= allocs;
+            s.bytes -= bytes;
+        }
+    }
+    if(opt.deadline)
+        setProgress(0);
+    delete grid;
+    return ok;
+}
+
+/// Parse the list \a str of output maps of --outputs, names among disp, occ
+/// and pp separated by commas.
+static bool parseOutputs(const std::string& str, bool& disp, bool& occ,
+                         bool& pp) {
+    disp = occ = pp = false;
+    std::istringstream list(str);
+    std::string name;
+    while(std::getline(list, name, ',')) {
+        bool& out = (name=="disp")? disp: (name=="occ")? occ: pp;
+        if(out || (name!="disp" && name!="occ" && name!="pp")) {
+            std::cerr << "Error: outputs should be a list of disp, occ and pp"
+                      << ", each at most once" << std::endl;
+            return false;
+        }
+        out = true;
+    }
+    if(!disp && !occ && !pp)
+        std::cerr << "Error: no output map" << std::endl;
+    return (disp || occ || pp);
+}
+
+/// Names of parameters of --sweep, from outer to inner loop: raw cost first,
+/// so that the cost volume is computed once for all the support parameters,
+/// then combination and radius, so that the support windows of
+/// --weight-tensor are reused.
+static const char* SWEEP_NAMES[] = {"t","g","A","comb","R","gpos","gcol"};
+static const int SWEEP_N = sizeof(SWEEP_NAMES)/sizeof(SWEEP_NAMES[0]);
+static const int SWEEP_COMB=3; ///< Index of comb, whose values are names
+/// Names of ParamDisparity::Combination, in the order of the enum
+static const char* COMB_NAMES[] = {"left", "max", "min", "mult", "plus"};
+
+/// Set parameter of index \a i in SWEEP_NAMES of \a p to \a v, the index of
+/// the enum for comb.
+static void setSweep(ParamDisparity& p, int i, float v) {
+    switch(i) {
+    case 0: p.tauCol = v; break;
+    case 1: p.tauGrad = v; break;
+    case 2: p.alpha = v; break;
+    case SWEEP_COMB:
+        p.comb = static_cast<ParamDisparity::Combination>(
+            static_cast<int>(v));
+        break;
+    case 4: p.radius = static_cast<int>(v); break;
+    case 5: p.gammaPos = v; break;
+    default: p.gammaCol = v; break;
+    }
+}
+
+/// Parse \a spec of --sweep, "name=v1,v2,... name=..." with names of
+/// SWEEP_NAMES, into the values of each parameter, empty if not swept. The
+/// values of comb are names of combinations, stored as their enum.
+static bool parseSweep(const std::string& spec,
+                       std::vector< std::vector<float> >& values) {
+    values.assign(SWEEP_N, std::vector<float>());
+    std::istringstream str(spec);
+    std::string item;
+    bool any=false;
+    while(str >> item) {
+        const size_t eq = item.find('=');
+        int i=0;
+        while(i<SWEEP_N && item.compare(0,eq,SWEEP_NAMES[i])!=0)
+            i++;
+        if(eq==std::string::npos || i==SWEEP_N || !values[i].empty()) {
+            std::cerr << "Error: sweep should be 'name=v1,v2,...' with names "
+                      << "t, g, A, comb, R, gpos or gcol, each at most once"
+                      << std::endl;
+            return false;
+        }
+        std::istringstream list(item.substr(eq+1));
+        if(i == SWEEP_COMB) {
+            std::string name;
+            ParamDisparity p;
+            while(std::getline(list, name, ',')) {
+                if(! p.setCombination(name))
+                    return false;
+                values[i].push_back(static_cast<float>(p.comb));
+            }
+            if(values[i].empty()) {
+                std::cerr << "Error: wrong list of values of comb in sweep"
+                          << std::endl;
+                return false;
+            }
+            any = true;
+            continue;
+        }
+        float v;
+        char sep=',';
+        while(sep==',' && list>>v) {
+            values[i].push_back(v);
+            if(i==4 && v!=static_cast<int>(v))
+                break; // Radius must be integer
+            if(! (list>>sep))
+                sep = 0;
+        }
+        if(values[i].empty() || sep!=0) {
+            std::cerr << "Error: wrong list of values of " << SWEEP_NAMES[i]
+                      << " in sweep" << std::endl;
+            return false;
         }
-    std::free(pix);
-    return im;
+        any = true;
+    }
+    if(! any)
+        std::cerr << "Error: empty sweep" << std::endl;
+    return any;
+}
+
+/// Process \a pair for all combinations of swept parameter \a values, see
+/// parseSweep. Each computation writes its maps with the prefix of the pair
+/// followed by the values, for example prefix_R9_gcol12.tif. The cost volume
+/// is kept by \a engine from one combination to the next while the raw cost
+/// parameters do not change.
+static bool processSweep(StereoPair pair, const Options& opt,
+                         const std::vector< std::vector<float> >& values,
+                         StereoEngine& engine, DisparityWriter& writer) {
+    std::vector<size_t> index(SWEEP_N, 0);
+    // Check all combinations first
+    std::vector<ParamDisparity> params;
+    std::vector<std::string> tags;
+    while(true) {
+        ParamDisparity p = opt.stereo.disparity;
+        std::ostringstream tag;
+        for(int i=0; i<SWEEP_N; i++)
+            if(! values[i].empty()) {
+                setSweep(p, i, values[i][index[i]]);
+                tag << '_' << SWEEP_NAMES[i];
+                if(i == SWEEP_COMB)
+                    tag << COMB_NAMES[static_cast<int>(values[i][index[i]])];
+                else
+                    tag << values[i][index[i]];
+            }
+        if(! p.check())
+            return false;
+        params.push_back(p);
+        tags.push_back(tag.str());
+        int i=SWEEP_N-1; // Next combination, inner parameter first
+        for(; i>=0; i--)
+            if(++index[i] < values[i].size())
+                break;
+            else
+                index[i] = 0;
+        if(i < 0)
+            break;
+    }
+    const std::string prefix = pair.prefix;
+    engine.shareCosts(true);
+    bool ok=true;
+    for(size_t k=0; k<params.size() && !computationCancelled(); k++) {
+        engine.setDisparity(params[k]);
+        pair.prefix = prefix+tags[k];
+        if(! processPair(pair, opt, engine, writer))
+            ok = false;
+    }
+    engine.shareCosts(false);
+    return ok;
+}
+
+/// Process \a pair, then image 1 against each of the \a targets in turn,
+/// whose maps are written with the prefix of the pair followed by _t2, _t3...
+/// (image 2 being the first target). With weightTensor, the support windows
+/// of image 1 are computed once for all targets, kept by \a engine.
+static bool processTargets(StereoPair pair, const Options& opt,
+                           const std::vector<std::string>& targets,
+                           StereoEngine& engine, DisparityWriter& writer) {
+    const std::string prefix = pair.prefix;
+    engine.shareCosts(true);
+    bool ok = processPair(pair, opt, engine, writer);
+    for(size_t k=0; k<targets.size() && !computationCancelled(); k++) {
+        std::ostringstream tag;
+        tag << "_t" << k+2;
+        pair.file2 = targets[k];
+        if(! loadImage(targets[k].c_str(), pair.im2))
+            pair.im2 = Image();
+        pair.prefix = prefix+tag.str();
+        if(! processPair(pair, opt, engine, writer))
+            ok = false;
+    }
+    engine.shareCosts(false);
+    return ok;
+}
+
+/// Check that the estimated peak memory of a pair of size \a w x \a h fits in
+/// \a limit bytes.
+///
+/// For adaptive weights on CPU, the first mode that fits is set in \a stereo,
+/// among the requested one then with 16-bit costs, rolling volume, both, and
+/// the same without support tensors, from the fastest to the most frugal.
+/// Otherwise, or if none fits, the estimate is printed and false returned.
+static bool fitMemory(int w, int h, int dMin, int dMax, size_t limit,
+                      ParamStereo& stereo) {
+    const size_t MB=1<<20, mem=stereo.memory(w, h, dMin, dMax);
+    if(mem <= limit)
+        return true;
+    const bool aw = (stereo.aggreg==ParamStereo::AggregAW && !stereo.gpu);
+    for(int i=1; aw && i<8; i++) {
+        ParamStereo p(stereo);
+        ParamDisparity& d = p.disparity;
+        d.cost16 = d.cost16 || (i&1);
+        d.rolling = d.rolling || (i&2);
+        d.weightTensor = d.weightTensor && !(i&4);
+        const size_t m = p.memory(w, h, dMin, dMax);
+        if(m > limit)
+            continue;
+        const ParamDisparity& d0 = stereo.disparity;
+        if(d0.cost16==d.cost16 && d0.rolling==d.rolling &&
+           d0.weightTensor==d.weightTensor)
+            continue; // Same mode
+        std::cerr << "Estimated memory " << mem/MB << " MB above limit "
+                  << limit/MB << " MB, using";
+        if(d.cost16 != d0.cost16)
+            std::cerr << " --cost16";
+        if(d.rolling != d0.rolling)
+            std::cerr << " --rolling";
+        if(d.weightTensor != d0.weightTensor)
+            std::cerr << " no --weight-tensor";
+        std::cerr << " (" << m/MB << " MB)" << std::endl;
+        stereo = p;
+        return true;
+    }
+    // Then the most frugal mode, by chunks of disparities, the largest first:
+    // the raw costs are recomputed for each chunk with no volume beyond it
+    const int nd=dMax-dMin+1;
+    for(int n=nd/2; aw && n>=1; n/=2) {
+        ParamStereo p(stereo);
+        ParamDisparity& d = p.disparity;
+        d.cost16 = d.rolling = true;
+        d.weightTensor = false;
+        if(d.dispChunk>0 && d.dispChunk<=n)
+            break; // Not fewer disparities than requested
+        d.dispChunk = n;
+        const size_t m = p.memory(w, h, dMin, dMax);
+        if(m > limit)
+            continue;
+        std::cerr << "Estimated memory " << mem/MB << " MB above limit "
+                  << limit/MB << " MB, using --cost16 --rolling "
+                  << "no --weight-tensor --disp-chunk " << n
+                  << " (" << m/MB << " MB)" << std::endl;
+        stereo = p;
+        return true;
+    }
+    std::cerr << "Error: estimated memory " << mem/MB << " MB";
+    if(aw) {
+        stereo.disparity.cost16 = stereo.disparity.rolling = true;
+        stereo.disparity.weightTensor = false;
+        stereo.disparity.dispChunk = 1;
+        std::cerr << " (" << stereo.memory(w, h, dMin, dMax)/MB
+                  << " MB with --cost16 --rolling --disp-chunk 1)";
+    }
+    std::cerr << " above limit " << limit/MB << " MB" << std::endl;
+    return false;
+}
+
+/// String \a str in JSON, quoted and escaped.
+static std::string jsonString(const std::string& str) {
+    std::string out("\"");
+    for(size_t i=0; i<str.size(); i++) {
+        const unsigned char c = str[i];
+        if(c=='"' || c=='\\')
+            out += '\\';
+        if(c < 0x20) {
+            char hex[8];
+            std::sprintf(hex, "\\u%04x", c);
+            out += hex;
+        } else
+            out += c;
+    }
+    return out+'"';
 }
 
+/// Write the statistics of the run in JSON file \a fileName: parameters,
+/// threads, pairs with the counts of occluded and filled pixels (-1 if not
+/// computed), times of stages and peak memory.
+static bool writeStats(const char* fileName, const Options& opt,
+                       const RunStats& stats) {
+    std::ofstream file(fileName);
+    const ParamStereo& p = opt.stereo;
+    const ParamDisparity& d = p.disparity;
+    const ParamOcclusion& o = p.occlusion;
+    const int threads = parallelThreads();
+    file << "{\n  \"parameters\": {"
+         << "\"aggreg\": " << jsonString(stats.aggreg)
+         << ", \"raw_cost\": " << jsonString(stats.rawCost)
+         << ", \"comb\": " << jsonString(stats.comb)
+         << ", \"radius\": " << d.radius << ", \"stride\": " << d.stride
+         << ", \"gamma_col\": " << d.gammaCol
+         << ", \"gamma_pos\": " << d.gammaPos << ", \"alpha\": " << d.alpha
+         << ", \"tau_col\": " << d.tauCol << ", \"tau_grad\": " << d.tauGrad
+         << ",\n    \"cost16\": " << (d.cost16? "true": "false")
+         << ", \"rolling\": " << (d.rolling? "true": "false")
+         << ", \"weight_tensor\": " << (d.weightTensor? "true": "false")
+         << ", \"subpixel\": " << (d.subpixel? "true": "false")
+         << ", \"gpu\": " << (p.gpu? "true": "false")
+         << ", \"levels\": " << p.levels << ", \"band\": " << p.band
+         << ", \"scale\": " << p.scale
+         << ",\n    \"lr_check\": " << (p.lrCheck? "true": "false")
+         << ", \"fused_check\": " << (p.fusedCheck? "true": "false")
+         << ", \"tol_disp\": " << o.tol_disp << ", \"sense\": " << p.sense
+         << ", \"filler\": " << jsonString(stats.filler)
+         << ", \"median_radius\": " << o.median_radius
+         << ", \"median_step\": " << o.median_step
+         << ", \"sigma_color\": " << o.sigma_color
+         << ", \"sigma_space\": " << o.sigma_space << "},\n"
+         << "  \"threads\": " << threads << ",\n  \"pairs\": [";
+    for(size_t i=0; i<stats.pairs.size(); i++) {
+        const PairStats& s = stats.pairs[i];
+        const double px = static_cast<double>(s.width)*s.height;
+        file << (i? ",\n    ": "\n    ")
+             << "{\"im1\": " << jsonString(s.file1)
+             << ", \"im2\": " << jsonString(s.file2)
+             << ", \"width\": " << s.width << ", \"height\": " << s.height
+             << ", \"dmin\": " << s.dMin << ", \"dmax\": " << s.dMax
+             << ", \"searched\": [" << s.searchMin << ", " << s.searchMax << ']'
+             << ", \"occluded\": " << s.occluded
+             << ", \"occluded_fraction\": "
+             << ((s.occluded>=0 && px>0)? s.occluded/px: -1)
+             << ", \"filled\": " << s.filled;
+        if(s.quality >= 0)
+            file << ", \"quality\": " << s.quality
+                 << ", \"seconds\": " << s.seconds;
+        if(s.cached)
+            file << ", \"cached\": true";
+        if(s.allocs >= 0)
+            file << ", \"allocations\": " << s.allocs
+                 << ", \"allocated_mb\": " << s.bytes/1048576.0;
+        file << '}';
+    }
+    file << "],\n  \"stages\": [";
+    const std::vector<StageTime> times = stageTimes();
+    for(size_t i=0; i<times.size(); i++) {
+        const StageTime& t = times[i];
+        file << (i? ",\n    ": "\n    ")
+             << "{\"name\": " << jsonString(t.name)
+             << ", \"calls\": " << t.count << ", \"wall\": " << t.wall
+             << ", \"cpu\": " << t.cpu;
+        if(t.work>0 && t.wall>0)
+            file << ", \"mpx_disp_per_s\": " << t.work/t.wall*1e-6;
+        if(t.allocs > 0)
+            file << ", \"allocations\": " << t.allocs
+                 << ", \"allocated_mb\": " << t.bytes/1048576.0;
+        if(t.joules >= 0) {
+            file << ", \"joules\": " << t.joules;
+            if(t.work > 0)
+                file << ", \"joules_per_mpx_disp\": " << t.joules/t.work*1e6;
+        }
+        if(t.dramJoules >= 0)
+            file << ", \"dram_joules\": " << t.dramJoules;
+        file << '}';
+    }
+    const std::vector<CountTotal> counts = countTotals();
+    if(! counts.empty()) {
+        file << "],\n  \"counts\": [";
+        for(size_t i=0; i<counts.size(); i++)
+            file << (i? ",\n    ": "\n    ")
+                 << "{\"name\": " << jsonString(counts[i].name)
+                 << ", \"total\": " << counts[i].total << '}';
+    }
+    file << "],\n  \"peak_memory_mb\": " << peakMemory()/1048576.0
+         << "\n}\n";
+    file.close();
+    if(! file) {
+        std::cerr << "Error writing file " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Print the progress of a step on stderr, with the estimated time left.
+static bool printProgress(const Progress& p, void*) {
+    std::fprintf(stderr, "\r%-12s %3d%%  ETA %6.1fs", p.step,
+                 static_cast<int>(100.0*p.done/p.total),
+                 p.elapsed*(p.total-p.done)/p.done);
+    if(p.done == p.total)
+        std::fputc('\n', stderr);
+    return true;
+}
+
+/// Cancel the computation on interruption (Ctrl-C), killing on the next one.
+static void interrupt(int) {
+    cancelComputation();
+    std::signal(SIGINT, SIG_DFL);
+}
+
+/// Report of the times of stages, printed at the end of main with --timing,
+/// and trace of the spans written in file \a trace if not empty.
+class TimingReport {
+public:
+    TimingReport(bool on, const std::string& trace)
+    : on(on), trace(trace), total("total") {}
+    ~TimingReport() {
+        total.stop();
+        if(on)
+            printTiming(std::cerr);
+        if(! trace.empty())
+            writeTrace(trace.c_str());
+    }
+    void stop() { total.stop(); } ///< End of the run, before its statistics
+private:
+    bool on;
+    std::string trace;
+    StageTimer total; ///< Whole run
+};
+
 /// Main program
 int main(int argc, char *argv[]) {
     int sense=0; // Camera motion direction: '0'=to-right, '1'=to-left
@@ -63,32 +1195,285 @@ int main(int argc, char *argv[]) {
         sec2("Occlusion detection:"), sec3("Densification:");
 
     ParamDisparity paramD; // Parameters for adaptive weights
+    std::string rawCost("ad"), aggreg("aw"), comb(COMB), pages("normal");
+    int levels=1, band=2; // Coarse to fine search
+    int scale=1; // Reduction of the images
+    int inputScale=1; // Reduction of the images at loading
+    bool autoRange=false; // Search only the estimated range
+    int rangeTile=0; // Size of tiles of own estimated range
+    std::string rangeLo, rangeHi; // Files of per-pixel disparity range
+    std::string roiStr; // Region of interest
+    std::string rowsStr; // Band of rows y0:y1
+    std::string points; // File of query points
+    bool conf=false; // Output confidence map
+    int topK=0; // Output best disparities
+    bool gpu=false; // Adaptive weights on GPU
+    bool saveRight=false; // Output disparity map of im2
+    bool progressive=false; // Maps of coarse levels written first
+    bool denseRight=false; // Output filled disparity map of im2
+    std::string outputs("disp,occ,pp"); // Output disparity maps of im1
+    TiffFormat tiff; // Encoding of output maps
+    std::string compression("none");
+    bool pfm=false; // Output maps in PFM format
+    bool png16=false; // Output maps in 16-bit PNG (KITTI)
+    int streamRows=0; // Rows of bands, streaming mode
+    std::string checkpoint; // Directory of finished bands of stream
+    bool resume=false; // Skip bands of checkpoint
+    std::string load; // Prefix of saved maps, post-processing only
+    std::string batch; // File listing pairs
+    std::string serve; // Address of resident service
+    std::string sweep; // Lists of parameter values
+    std::string targetList; // Other target images, separated by commas
+    int batchMemory=512; // MB of pairs decoded in advance
+    int batchReaders=0; // Threads reading files of pairs ahead
+    std::string hwaccel("auto"); // Hardware decoder of videos
+    int batchJobs=1; // Pairs computed concurrently in batch
+    float deadline=0; // Milliseconds per pair in batch
+    int resultCache=0; // MB of maps kept by hash of inputs
+    int temporal=-1; // Range around disparity of previous frame
+    float temporalConf=0.1f; // Min confidence to use previous frame
+    int incremental=0; // Tiles recomputed where frame changed
+    int threads=0; // Number of threads of computation
+    std::string cpus; // CPUs to pin threads to
+    std::string simd("auto"); // Instruction set of vectorized kernels
+    bool verbose=false; // Print thread layout
+    bool timing=false; // Print times of stages
+    int memLimit=0; // MB of estimated peak memory, 0 for no limit
+    std::string statsFile; // JSON statistics of the run
+    std::string traceFile; // Chrome trace of the spans of threads
+    bool progress=false; // Print progress of aggregation and median
     cmd.section = sec1;
     cmd.add( make_option(0,paramD.gammaCol,"gcol")
              .doc("gamma for color difference") );
     cmd.add( make_option(0,paramD.gammaPos,"gpos")
              .doc("gamma for spatial distance") );
     cmd.add( make_option('R',paramD.radius).doc("radius of patch window") );
+    cmd.add( make_option(0,paramD.stride,"stride")
+             .doc("step between sampled pixels of window") );
     cmd.add( make_option('A',paramD.alpha)
              .doc("value of alpha for matching cost") );
     cmd.add( make_option('t',paramD.tauCol)
              .doc("threshold of color difference in matching cost") );
     cmd.add( make_option('g',paramD.tauGrad)
              .doc("threshold of gradient difference in matching cost") );
+    cmd.add( make_option(0,comb,"comb")
+             .doc("combination of weights: left, max, min, mult or plus") );
+    cmd.add( make_option(0,rawCost,"raw-cost")
+             .doc("raw cost: ad, census, ad-census or rank") );
+    cmd.add( make_option(0,aggreg,"aggreg")
+             .doc("aggregation: aw (adaptive weights), pm (adaptive weights "
+                  "by PatchMatch), gf (guided filter), bg (bilateral grid), "
+                  "cross (cross-based support) or sgm (semi-global "
+                  "matching)") );
+    cmd.add( make_option(0,gpu,"gpu")
+             .doc("adaptive weights on GPU (OpenMP offloading)") );
+    cmd.add( make_option(0,paramD.pmIterations,"pm-iter")
+             .doc("number of PatchMatch iterations") );
+    cmd.add( make_option(0,paramD.sgmP1,"P1")
+             .doc("SGM penalty of disparity change 1, ratio of max cost") );
+    cmd.add( make_option(0,paramD.sgmP2,"P2")
+             .doc("SGM penalty of larger disparity change, idem") );
+    cmd.add( make_option(0,paramD.sgmPaths,"paths")
+             .doc("number of SGM path directions, 4 or 8") );
+    cmd.add( make_option(0,paramD.cost16,"cost16")
+             .doc("store raw costs on 16 bits (half memory)") );
+    cmd.add( make_option(0,paramD.rolling,"rolling")
+             .doc("keep only 2R+1 rows of costs per thread") );
+    cmd.add( make_option(0,paramD.intCost,"int-cost")
+             .doc("raw cost in integer arithmetic (8-bit images)") );
+    cmd.add( make_option(0,paramD.fastSum,"fast-sum")
+             .doc("vectorized aggregation (results differ slightly)") );
+    cmd.add( make_option(0,paramD.intSum,"int-sum")
+             .doc("aggregation in fixed point, implies --cost16") );
+    cmd.add( make_option(0,paramD.dispSum,"disp-sum")
+             .doc("aggregation vectorized over disparities (exact)") );
+    cmd.add( make_option(0,paramD.offsetSum,"offset-sum")
+             .doc("aggregation by window offset over rows (exact)") );
+    cmd.add( make_option(0,paramD.prune,"prune")
+             .doc("stop sums of disparities that cannot win (exact)") );
+    cmd.add( make_option(0,paramD.cascade,"cascade")
+             .doc("aggregate only the best k disparities of a coarse window") );
+    cmd.add( make_option(0,paramD.expWeights,"exp-weights")
+             .doc("color weights by exp approximation, no table") );
+    cmd.add( make_option(0,paramD.dispChunk,"disp-chunk")
+             .doc("cost volume by chunks of N disparities (0: all)") );
+    cmd.add( make_option(0,paramD.sparse,"sparse")
+             .doc("sum only taps of weight above threshold (0: all)") );
+    cmd.add( make_option(0,paramD.adaptRadius,"adapt-radius")
+             .doc("radius halved at each doubling of gradient above g "
+                  "(0: fixed)") );
+    cmd.add( make_option(0,paramD.weightTensor,"weight-tensor")
+             .doc("precompute support windows, (2R+1)^2+1 bytes per pixel") );
+    cmd.add( make_option(0,paramD.subpixel,"subpixel")
+             .doc("sub-pixel disparity by parabola fit of costs") );
+    cmd.add( make_option(0,paramD.rightWeights,"right-weights")
+             .doc("map of im2 with its own weights (comb left)") );
+    cmd.add( make_option(0,paramD.offsetY,"offset-y")
+             .doc("row y of im1 matched with row y+dy of im2") );
+    cmd.add( make_option(0,paramD.searchY,"search-y")
+             .doc("raw cost min over rows of im2 within this offset") );
+    cmd.add( make_option(0,paramD.tileWidth,"tile-width")
+             .doc("width of tiles for aggregation (0: fit L2 cache)") );
+    cmd.add( make_option(0,paramD.tileHeight,"tile-height")
+             .doc("height of tiles for aggregation (0: 32)") );
+    cmd.add( make_option(0,paramD.costCache,"cost-cache")
+             .doc("directory where cost volumes are cached for later runs") );
+    cmd.add( make_option(0,paramD.costScratch,"cost-scratch")
+             .doc("directory of a scratch file holding the cost volume") );
+    cmd.add( make_option(0,pages,"pages")
+             .doc("memory pages of cost volume: normal, thp or huge") );
+    cmd.add( make_option(0,paramD.firstTouch,"first-touch")
+             .doc("costs computed by the threads aggregating them (NUMA)") );
+    cmd.add( make_option(0,levels,"levels")
+             .doc("levels of coarse to fine search (1: full range)") );
+    cmd.add( make_option(0,band,"band")
+             .doc("search band around upsampled coarse disparities") );
+    cmd.add( make_option(0,scale,"scale")
+             .doc("compute on images reduced by this factor, then upsample") );
+    cmd.add( make_option(0,inputScale,"input-scale")
+             .doc("read images reduced by this factor, JPEG decoded at that "
+                  "size for 2, 4, 8; range divided, maps reduced") );
+    cmd.add( make_option(0,autoRange,"auto-range")
+             .doc("search only the range estimated on reduced images") );
+    cmd.add( make_option(0,rangeTile,"range-tile")
+             .doc("with auto-range, estimate a range per tile of this size") );
+    cmd.add( make_option(0,rangeLo,"range-lo")
+             .doc("TIFF image of per-pixel min disparity (prior)") );
+    cmd.add( make_option(0,rangeHi,"range-hi")
+             .doc("TIFF image of per-pixel max disparity (prior)") );
+    cmd.add( make_option(0,roiStr,"roi")
+             .doc("region of interest x,y,w,h (default: whole image)") );
+    cmd.add( make_option(0,rowsStr,"rows")
+             .doc("band of rows y0:y1 of the maps, for stitching by "
+                  "stitch_bands") );
+    cmd.add( make_option(0,conf,"confidence")
+             .doc("output confidence map in [0,1] (prefix"+
+                  std::string(SUFFIX_CONF)+")") );
+    cmd.add( make_option(0,topK,"top-k")
+             .doc("output k best disparities and costs (prefix"+
+                  std::string(SUFFIX_TOPK)+")") );
+    cmd.add( make_option(0,points,"points")
+             .doc("only disparity and costs of points x y listed in file") );
+    cmd.add( make_option(0,saveRight,"save-right")
+             .doc("output disparity map of im2 (prefix"+
+                  std::string(SUFFIX_RIGHT)+")") );
+    cmd.add( make_option(0,progressive,"progressive")
+             .doc("with levels, write the map of each coarse level in prefix"+
+                  std::string(SUFFIX1)+" first, a preview") );
+    cmd.add( make_option(0,denseRight,"dense-right")
+             .doc("output filled disparity map of im2 (prefix"+
+                  std::string(SUFFIX_RIGHT_PP)+")") );
+    cmd.add( make_option(0,outputs,"outputs")
+             .doc("maps of im1 to write, among disp (prefix"+
+                  std::string(SUFFIX1)+"), occ (prefix"+std::string(SUFFIX2)+
+                  ") and pp (prefix"+std::string(SUFFIX3)+")") );
+    cmd.add( make_option(0,compression,"tiff-compression")
+             .doc("compression of output maps: none, lzw, deflate or zstd") );
+    cmd.add( make_option(0,tiff.predictor,"tiff-predictor")
+             .doc("floating point predictor of compression") );
+    cmd.add( make_option(0,tiff.rowsPerStrip,"tiff-strip")
+             .doc("rows per strip of output maps (0: libtiff default)") );
+    cmd.add( make_option(0,tiff.tileSize,"tiff-tile")
+             .doc("tiles of output maps, multiple of 16 (0: strips)") );
+    cmd.add( make_option(0,pfm,"pfm")
+             .doc("output maps in PFM format (.pfm), mapped by --load") );
+    cmd.add( make_option(0,png16,"png16")
+             .doc("output maps in 16-bit PNG (.png), 256*|d|, 0 if invalid") );
+    cmd.add( make_option(0,streamRows,"stream")
+             .doc("rows of bands streamed from PNG to TIFF, for images larger "
+                  "than memory (0: whole images)") );
+    cmd.add( make_option(0,checkpoint,"checkpoint")
+             .doc("directory where the finished bands of stream are saved") );
+    cmd.add( make_option(0,resume,"resume")
+             .doc("stream: skip the bands saved in checkpoint") );
+    cmd.add( make_option(0,load,"load")
+             .doc("post-processing only, of maps saved with --save-right") );
+    cmd.add( make_option(0,batch,"batch")
+             .doc("process the pairs of file, lines "
+                  "'im1.png im2.png dmin dmax out_prefix'") );
+    cmd.add( make_option(0,batchMemory,"batch-memory")
+             .doc("MB of images decoded in advance in batch") );
+    cmd.add( make_option(0,batchReaders,"batch-readers")
+             .doc("threads reading the files of the next pairs in batch, "
+                  "hiding the latency of storage (0: read when decoded)") );
+    cmd.add( make_option(0,hwaccel,"hwaccel")
+             .doc("decoder of videos in batch, -hwaccel of ffmpeg: auto, "
+                  "vaapi, cuda... (none: software)") );
+    cmd.add( make_option(0,batchJobs,"batch-jobs")
+             .doc("pairs computed concurrently in batch, each with its share "
+                  "of threads (0: chosen from image size and threads)") );
+    cmd.add( make_option(0,deadline,"deadline")
+             .doc("ms per pair in batch: quality lowered when late, "
+                  "reported per pair (0: none)") );
+    cmd.add( make_option(0,resultCache,"result-cache")
+             .doc("MB of maps of pairs kept by hash of images and parameters, "
+                  "reused for identical pairs in batch and serve (0: none)") );
+    cmd.add( make_option(0,serve,"serve")
+             .doc("resident service, requests on stdin/stdout (-) or on Unix "
+                  "socket at path") );
+    cmd.add( make_option(0,targetList,"targets")
+             .doc("other images matched against im1, separated by commas") );
+    cmd.add( make_option(0,sweep,"sweep")
+             .doc("all combinations of values, 'name=v1,v2,... name=...' "
+                  "of t, g, A, comb, R, gpos, gcol") );
+    cmd.add( make_option(0,temporal,"temporal")
+             .doc("batch of video frames: range of previous disparity +-k "
+                  "(-1: none)") );
+    cmd.add( make_option(0,temporalConf,"temporal-conf")
+             .doc("min confidence of previous frame, else full range") );
+    cmd.add( make_option(0,incremental,"incremental")
+             .doc("batch of fixed camera: recompute only changed tiles of "
+                  "this size") );
+    cmd.add( make_option('j',threads,"threads")
+             .doc("threads of all parallel stages (0: one per CPU of --cpus, "
+                  "else OMP_NUM_THREADS or all cores)") );
+    cmd.add( make_option(0,cpus,"cpus")
+             .doc("CPUs to pin the threads to, in turn, as 0-3,8 (Linux)") );
+    cmd.add( make_option(0,simd,"simd")
+             .doc("instruction set of vectorized kernels: auto, base, avx2 or "
+                  "avx512") );
+    cmd.add( make_option('v',verbose,"verbose")
+             .doc("print the layout of threads on CPUs") );
+    cmd.add( make_option(0,timing,"timing")
+             .doc("print wall and CPU times of stages") );
+    cmd.add( make_option(0,progress,"progress")
+             .doc("print progress of aggregation and median, with time left") );
+    cmd.add( make_option(0,statsFile,"stats")
+             .doc("JSON file of statistics: parameters, pairs, times of stages,"
+                  " memory") );
+    cmd.add( make_option(0,traceFile,"trace")
+             .doc("JSON file of spans of threads (Chrome trace, Perfetto)") );
+    cmd.add( make_option(0,memLimit,"mem-limit")
+             .doc("MB of memory: fastest mode of aw fitting it, else refusal "
+                  "(0: no limit)") );
 
     ParamOcclusion paramOcc; // Parameters for filling occlusions
     cmd.section = sec2;
     cmd.add( make_option('o',paramOcc.tol_disp)
              .doc("tolerance for left-right disp. diff.") ); // Detect occlusion
+    bool fusedCheck=false; // Left-right check in aggregation
+    cmd.add( make_option(0,fusedCheck,"fused-check")
+             .doc("left-right check during merge of aggregation (aw)") );
     cmd.section = sec3;
     cmd.add( make_option('O',sense)
              .doc("camera sense='0':right, '1':left") ); // Fill occlusion
     cmd.add( make_option('r',paramOcc.median_radius)
              .doc("radius of the weighted median filter") );
+    cmd.add( make_option(0,paramOcc.median_step,"median-step")
+             .doc("step between sampled pixels of the median window") );
     cmd.add( make_option('c',paramOcc.sigma_color)
              .doc("value of sigma_color") );
     cmd.add( make_option('s',paramOcc.sigma_space)
              .doc("value of sigma_space") );
+    cmd.add( make_option(0,paramOcc.fast_median,"fast-median")
+             .doc("constant time weighted median (box window)") );
+    cmd.add( make_option(0,paramOcc.palette,"palette")
+             .doc("colors of quantized guidance of median (0: exact)") );
+    std::string filler("median");
+    cmd.add( make_option(0,filler,"filler")
+             .doc("filling: median, bilateral (separable) or scan (nearest)") );
+    cmd.add( make_option(0,paramOcc.support_weights,"support-weights")
+             .doc("median with weights of aggregation (--gcol,--gpos,-R)") );
 
     try {
         cmd.process(argc, argv);
@@ -96,86 +1481,454 @@ int main(int argc, char *argv[]) {
         std::cerr << "Error: " << str << std::endl<<std::endl;
         argc=1; // To display usage
     }
-    if(argc!=5 && argc!=6) {
+    if((batch.empty() && serve.empty())? (argc!=5 && argc!=6): argc!=1) {
         std::cerr <<"Bilaterally weighted patches for disparity map computation"
                   << "\nUsage: " << argv[0]
-                  << " [options] im1.png im2.png dmin dmax [out_prefix]\n\n"
+                  << " [options] im1.png im2.png dmin dmax [out_prefix]\n"
+                  << "       " << argv[0] << " [options] --batch list.txt\n"
+                  << "       " << argv[0] << " [options] --serve address\n\n"
                   << "Options (default values in parentheses)\n";
-        std::cerr << sec1 << '\n' << CmdLine(cmd, sec1);
-        std::cerr << cmd.prefixDoc << "Combination of weights is '" << COMB
-                  << "' (recompile to change it)\n\n";
+        std::cerr << sec1 << '\n' << CmdLine(cmd, sec1) << '\n';
         std::cerr << sec2 << '\n' << CmdLine(cmd, sec2) << '\n';
         std::cerr << sec3 << '\n' << CmdLine(cmd, sec3);
         return 1;
     }
 
-    if(!paramD.check() || !paramOcc.check())
+    if(!paramD.setRawCost(rawCost) || !paramD.setCombination(comb) ||
+       !paramD.setCostPages(pages) || !paramOcc.setFiller(filler) ||
+       !tiff.setCompression(compression) || !tiff.check() ||
+       !paramD.check() || !paramOcc.check())
         return 1;
-
-    // Load images
-    Image im1 = loadImage(argv[1]);
-    Image im2 = loadImage(argv[2]);
-    const int width=im1.width(), height=im1.height();
-    if(width!=im2.width() || height!=im2.height()) {
-        std::cerr << "The images must have the same size!" << std::endl;
+    ParamStereo stereo;
+    if(! stereo.setAggregation(aggreg))
+        return 1;
+    if(levels<1 || band<0) {
+        std::cerr << "Error: levels must be positive and band non-negative"
+                  << std::endl;
+        return 1;
+    }
+    if(inputScale<1 || (inputScale>1 && (!batch.empty() || !serve.empty() ||
+                                         streamRows>0 || !load.empty() ||
+                                         !points.empty() ||
+                                         !targetList.empty() ||
+                                         !rangeLo.empty() || !roiStr.empty() ||
+                                         !rowsStr.empty()))) {
+        std::cerr << "Error: input-scale must be positive, and is only for a "
+                  << "single pair, without stream, load, points, targets, "
+                  << "range, roi and rows" << std::endl;
+        return 1;
+    }
+    if(scale<1 || (scale>1 && (!rangeLo.empty() || !roiStr.empty() ||
+                               !points.empty() || !load.empty() ||
+                               !rowsStr.empty() || !sweep.empty() ||
+                               streamRows>0))) {
+        std::cerr << "Error: scale must be positive, and is incompatible with "
+                  << "range, roi, points, load, rows, sweep and stream"
+                  << std::endl;
+        return 1;
+    }
+    if(autoRange && (!rangeLo.empty() || !points.empty() || !load.empty() ||
+                     streamRows>0)) {
+        std::cerr << "Error: auto-range is incompatible with range, points, "
+                  << "load and stream" << std::endl;
+        return 1;
+    }
+    if(rangeTile<0 || (rangeTile>0 && (!autoRange || aggreg!="aw" || gpu ||
+                                       levels>1 || scale>1 ||
+                                       !roiStr.empty()))) {
+        std::cerr << "Error: range-tile must be non-negative, and needs "
+                  << "auto-range with aw on CPU without levels, scale and roi"
+                  << std::endl;
+        return 1;
+    }
+    if(topK<0 || (topK>0 && (aggreg!="aw" || gpu || scale>1 ||
+                             !roiStr.empty() || !load.empty() ||
+                             incremental>0 || streamRows>0))) {
+        std::cerr << "Error: top-k must be non-negative, and is only for aw "
+                  << "on CPU, without scale, roi, load, incremental and "
+                  << "stream" << std::endl;
+        return 1;
+    }
+    if(gpu && (aggreg!="aw" || levels>1 || !rangeLo.empty() ||
+               !roiStr.empty() || !points.empty() || conf)) {
+        std::cerr << "Error: GPU is only for adaptive weights on the whole "
+                  << "images, without levels, range or confidence" << std::endl;
+        return 1;
+    }
+    if(!load.empty() && (!points.empty() || conf)) {
+        std::cerr << "Error: option load is incompatible with points and "
+                  << "confidence" << std::endl;
+        return 1;
+    }
+    if(denseRight && (!load.empty() || streamRows>0)) {
+        std::cerr << "Error: option dense-right is incompatible with load and "
+                  << "stream" << std::endl;
+        return 1;
+    }
+    if(png16 && (pfm || !load.empty())) {
+        std::cerr << "Error: option png16 is incompatible with pfm and load"
+                  << std::endl;
+        return 1;
+    }
+    const std::string ext(pfm? ".pfm": png16? ".png": ".tif"); // Output maps
+    if(rangeLo.empty() != rangeHi.empty()) {
+        std::cerr << "Error: options range-lo and range-hi go together"
+                  << std::endl;
+        return 1;
+    }
+    if(!rangeLo.empty() && (levels>1 || aggreg!="aw")) {
+        std::cerr << "Error: per-pixel range is incompatible with levels>1 "
+                  << "and other aggregation than aw" << std::endl;
         return 1;
     }
 
-    // Set disparity range
-    int dMin, dMax;
-    if(! ((std::istringstream(argv[3])>>dMin).eof() &&
-          (std::istringstream(argv[4])>>dMax).eof())) {
-            std::cerr << "Error reading dMin or dMax" << std::endl;
+    Rect roi;
+    if(! roiStr.empty()) {
+        char c1=0, c2=0, c3=0;
+        std::istringstream str(roiStr);
+        if(!((str>>roi.x>>c1>>roi.y>>c2>>roi.w>>c3>>roi.h) && str.eof() &&
+             c1==',' && c2==',' && c3==',' && roi.w>0 && roi.h>0)) {
+            std::cerr << "Error: region of interest must be x,y,w,h with w,h"
+                      << " positive" << std::endl;
+            return 1;
+        }
+        if(levels>1 || aggreg!="aw" || !rangeLo.empty()) {
+            std::cerr << "Error: region of interest is incompatible with "
+                      << "levels>1, range and other aggregation than aw"
+                      << std::endl;
             return 1;
+        }
     }
-    if(dMin>dMax) {
-        std::cerr << "Wrong disparity range! (dMin > dMax)" << std::endl;
+
+    int rowsBegin=0, rowsEnd=0;
+    if(! rowsStr.empty()) {
+        char c=0;
+        std::istringstream str(rowsStr);
+        if(!((str>>rowsBegin>>c>>rowsEnd) && str.eof() && c==':' &&
+             0<=rowsBegin && rowsBegin<rowsEnd)) {
+            std::cerr << "Error: rows must be y0:y1 with 0<=y0<y1" << std::endl;
+            return 1;
+        }
+        if(aggreg!="aw" || gpu || levels>1 || !rangeLo.empty() ||
+           !roiStr.empty() || !points.empty() || !load.empty() || pfm ||
+           png16 || fusedCheck || paramOcc.palette>0 ||
+           paramOcc.filler==ParamOcclusion::FillScan || !batch.empty() ||
+           !serve.empty() || !sweep.empty() || streamRows>0) {
+            std::cerr << "Error: rows is only for adaptive weights (aw) on "
+                      << "the full range of one pair, without levels, gpu, "
+                      << "range, roi, points, load, pfm, png16, fused-check, "
+                      << "palette, scan filler, batch, serve, sweep and stream"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    if(batchMemory < 0) {
+        std::cerr << "Error: batch-memory must be non-negative" << std::endl;
+        return 1;
+    }
+    if(batchReaders<0 || (batchReaders>0 && batch.empty())) {
+        std::cerr << "Error: batch-readers must be non-negative, and is only "
+                  << "for batch" << std::endl;
+        return 1;
+    }
+    if(batchJobs<0 || (batchJobs!=1 && (batch.empty() || temporal>=0 ||
+                                        incremental>0 || !cpus.empty()))) {
+        std::cerr << "Error: batch-jobs must be non-negative, and is only for "
+                  << "batch, without temporal, incremental and cpus"
+                  << std::endl;
+        return 1;
+    }
+    if(deadline<0 || (deadline>0 && (batch.empty() || aggreg!="aw" || gpu ||
+                                     batchJobs!=1 || temporal>=0 ||
+                                     incremental>0 || progress))) {
+        std::cerr << "Error: deadline must be non-negative, and is only for "
+                  << "batch with aw on CPU, without batch-jobs, temporal, "
+                  << "incremental and progress" << std::endl;
+        return 1;
+    }
+    if(resultCache<0 || (resultCache>0 && ((batch.empty() && serve.empty())||
+                                           temporal>=0 || incremental>0 ||
+                                           deadline>0 || topK>0 ||
+                                           rowsEnd>rowsBegin ||
+                                           !load.empty()))) {
+        std::cerr << "Error: result-cache must be non-negative, and is only "
+                  << "for batch and serve, without temporal, incremental, "
+                  << "deadline, top-k, rows and load" << std::endl;
+        return 1;
+    }
+    if(temporal>=0 && (batch.empty() || aggreg!="aw" || gpu || levels>1 ||
+                       !roiStr.empty())) {
+        std::cerr << "Error: temporal is only for batch, with adaptive weights"
+                  << " (aw), without gpu, levels and roi" << std::endl;
+        return 1;
+    }
+    if(incremental<0 || (incremental>0 && (batch.empty() || aggreg!="aw" ||
+                                           gpu || levels>1 || scale>1 ||
+                                           !roiStr.empty() || autoRange ||
+                                           temporal>=0 || conf ||
+                                           fusedCheck))) {
+        std::cerr << "Error: incremental must be non-negative, and is only "
+                  << "for batch with aw on CPU, without levels, scale, roi, "
+                  << "auto-range, temporal, confidence and fused-check"
+                  << std::endl;
+        return 1;
+    }
+    if(!batch.empty() && (streamRows>0 || !load.empty() || !points.empty() ||
+                          !rangeLo.empty())) {
+        std::cerr << "Error: batch is incompatible with stream, load, points "
+                  << "and range" << std::endl;
         return 1;
     }
 
-    // Create disparity images
-    Image disp1(width,height);
-    std::fill_n(&disp1(0,0), width*height, static_cast<float>(dMin-1));
-    Image disp2(width,height);
-    std::fill_n(&disp2(0,0), width*height, static_cast<float>(dMin-1));
+    if(!serve.empty() && (!batch.empty() || streamRows>0 || !load.empty() ||
+                          !points.empty() || !rangeLo.empty() || temporal>=0)) {
+        std::cerr << "Error: serve is incompatible with batch, stream, load, "
+                  << "points, range and temporal" << std::endl;
+        return 1;
+    }
 
-    // Compute disparity using adaptive weights.
-    disparityAW(im1, im2, dMin, dMax, paramD,disp1,disp2);
+    std::vector< std::vector<float> > sweepValues;
+    if(! sweep.empty()) {
+        if(aggreg!="aw" || gpu || levels>1 || !roiStr.empty() ||
+           !rangeLo.empty() || !load.empty() || !points.empty() ||
+           !batch.empty() || !serve.empty() || streamRows>0) {
+            std::cerr << "Error: sweep is only for adaptive weights (aw) on "
+                      << "one pair, without gpu, levels, roi, range, load, "
+                      << "points, batch, serve and stream" << std::endl;
+            return 1;
+        }
+        if(! parseSweep(sweep, sweepValues))
+            return 1;
+    }
 
-    // Prepare output file names
-    std::string prefix((argc>5)? argv[5]: PREFIX);
-    std::string outFile1 = prefix + SUFFIX1; // initial disparity map
-    std::string outFile2 = prefix + SUFFIX2; // with occlusions
-    std::string outFile3 = prefix + SUFFIX3; // filled occlusions
+    std::vector<std::string> targets;
+    if(! targetList.empty()) {
+        if(aggreg!="aw" || gpu || levels>1 || !roiStr.empty() ||
+           !rangeLo.empty() || !load.empty() || !points.empty() ||
+           !batch.empty() || !serve.empty() || streamRows>0 ||
+           !sweep.empty()) {
+            std::cerr << "Error: targets is only for adaptive weights (aw) on "
+                      << "one pair, without gpu, levels, roi, range, load, "
+                      << "points, batch, serve, stream and sweep" << std::endl;
+            return 1;
+        }
+        std::istringstream str(targetList);
+        std::string file;
+        while(std::getline(str, file, ','))
+            targets.push_back(file);
+    }
 
-    // Save disparity image
-    if(! save_disparity(outFile1.c_str(), disp1, dMin,dMax)) {
-        std::cerr << "Error writing file " << outFile1 << std::endl;
+    if(!statsFile.empty() && (!serve.empty() || streamRows>0)) {
+        std::cerr << "Error: stats is incompatible with serve and stream"
+                  << std::endl;
+        return 1;
+    }
+    if(!traceFile.empty() && !serve.empty()) {
+        std::cerr << "Error: trace is incompatible with serve" << std::endl;
+        return 1;
+    }
+    if(memLimit<0 || (memLimit>0 && (!batch.empty() || !serve.empty() ||
+                                     !sweep.empty() || streamRows>0 ||
+                                     !load.empty() || !points.empty()))) {
+        std::cerr << "Error: mem-limit must be non-negative, and is only for "
+                  << "one pair, without batch, serve, sweep, stream, load and "
+                  << "points" << std::endl;
         return 1;
     }
 
-    // Detecting occlusions
-    detect_occlusion(disp1,disp2,static_cast<float>(dMin-1),paramOcc.tol_disp);
-    if(! save_disparity(outFile2.c_str(), disp1, dMin,dMax)) {
-        std::cerr << "Error writing file " << outFile2 << std::endl;
+    bool outDisp, outOcc, outPP;
+    if(! parseOutputs(outputs, outDisp, outOcc, outPP))
+        return 1;
+    if(progressive && (levels==1 || aggreg!="aw" || scale>1 || autoRange ||
+                       !roiStr.empty() || !rowsStr.empty() || !outDisp ||
+                       !load.empty() || !serve.empty() || !sweep.empty() ||
+                       streamRows>0)) {
+        std::cerr << "Error: progressive needs levels>1 with aw and disp in "
+                  << "outputs, without scale, auto-range, roi, rows, load, "
+                  << "serve, sweep and stream" << std::endl;
+        return 1;
+    }
+
+    // Threads, set before any is created
+    if(threads < 0) {
+        std::cerr << "Error: threads must be non-negative" << std::endl;
+        return 1;
+    }
+    if(!cpus.empty() && !stereo.setCpus(cpus))
+        return 1;
+    if(! setThreads(threads, stereo.cpus))
         return 1;
+    stereo.threads = threads;
+    if(! setSimd(simd))
+        return 1;
+    if(verbose) {
+        printThreads(std::cerr);
+        std::cerr << "Vectorized kernels: " << simdKernels().name << " ("
+                  << simdKernels().vsize << " floats)" << std::endl;
     }
+    enableTiming(timing || !statsFile.empty() || !traceFile.empty());
+    enableTrace(! traceFile.empty());
+    if(progress)
+        setProgress(printProgress);
+    if(serve.empty()) // The service is stopped by Ctrl-C
+        std::signal(SIGINT, interrupt);
+    TimingReport report(timing, traceFile);
 
-    // Fill occlusions (post-processing)
-    Image dispDense = disp1.clone();
-    switch(sense) {
-    case 0:
-        dispDense.fillMaxX(static_cast<float>(dMin)); break;
-    case 1:
-        dispDense.fillMinX(static_cast<float>(dMin)); break;
-    default:
-        return 0; // No densification
+    // Set disparity range
+    int dMin=0, dMax=0;
+    if(batch.empty() && serve.empty() &&
+       !parseRange(argv[3], argv[4], dMin, dMax))
+        return 1;
+    if(inputScale > 1) { // Range of reduced images, rounded outwards
+        dMin = (dMin>=0)? dMin/inputScale: -((inputScale-1-dMin)/inputScale);
+        dMax = (dMax<=0)? -(-dMax/inputScale): (dMax+inputScale-1)/inputScale;
     }
-    fill_occlusion(dispDense, im1.median(1), disp1, dMin, dMax, paramOcc);
-    if(! save_disparity(outFile3.c_str(), disp1, dMin,dMax)) {
-        std::cerr << "Error writing file " << outFile3 << std::endl;
+
+    // Output file prefix
+    std::string prefix((argc>5)? argv[5]: PREFIX);
+
+    if((!checkpoint.empty() || resume) &&
+       (streamRows==0 || (resume && checkpoint.empty()))) {
+        std::cerr << "Error: checkpoint is only for stream, and resume needs "
+                  << "checkpoint" << std::endl;
         return 1;
     }
 
-    return 0;
+    // Streaming mode, images never loaded entirely
+    if(streamRows > 0) {
+        if(aggreg!="aw" || gpu || levels>1 || !rangeLo.empty() ||
+           !roiStr.empty() || !points.empty() || conf || saveRight ||
+           !load.empty() || pfm || png16 || fusedCheck || paramOcc.palette>0 ||
+           paramOcc.filler==ParamOcclusion::FillScan ||
+           !(outDisp && outOcc && outPP)) {
+            std::cerr << "Error: stream is only for adaptive weights (aw) on "
+                      << "the full range, without levels, gpu, range, roi, "
+                      << "points, confidence, save-right, load, pfm, png16, "
+                      << "fused-check, palette, scan filler and outputs"
+                      << std::endl;
+            return 1;
+        }
+        StreamFiles files;
+        files.checkpoint = checkpoint;
+        files.resume = resume;
+        files.disparity = prefix+SUFFIX1;
+        files.occlusion = prefix+SUFFIX2;
+        if(sense==0 || sense==1)
+            files.filled = prefix+SUFFIX3;
+        return disparityStream(argv[1], argv[2], dMin, dMax, paramD, paramOcc,
+                               sense, streamRows, files, tiff)? 0: 1;
+    }
+
+    // Options of the pairs, skipping the stages of no requested output
+    stereo.disparity = paramD;
+    stereo.disparity.leftOnly = !(outOcc || outPP || saveRight);
+    stereo.occlusion = paramOcc;
+    stereo.gpu = gpu;
+    stereo.levels = levels;
+    stereo.band = band;
+    stereo.scale = scale;
+    stereo.autoRange = autoRange;
+    stereo.rangeTile = rangeTile;
+    stereo.incremental = incremental;
+    stereo.roi = roi;
+    stereo.confidence = conf || temporal>=0;
+    stereo.topK = topK;
+    stereo.lrCheck = (outOcc || outPP);
+    stereo.denseRight = denseRight;
+    stereo.fusedCheck = fusedCheck;
+    stereo.sense = outPP? sense: -1;
+    Options opt;
+    opt.stereo = stereo;
+    opt.rangeLo = rangeLo;
+    opt.rangeHi = rangeHi;
+    opt.points = points;
+    opt.conf = conf;
+    opt.saveRight = saveRight;
+    opt.progressive = progressive;
+    opt.outDisp = outDisp;
+    opt.outOcc = outOcc;
+    opt.load = load;
+    opt.ext = ext;
+    opt.temporal = temporal;
+    opt.temporalConf = temporalConf;
+    opt.rowsBegin = rowsBegin;
+    opt.rowsEnd = rowsEnd;
+    opt.rowsHalo = bandHalo(paramD, paramOcc);
+    RunStats stats;
+    stats.aggreg = aggreg;
+    stats.rawCost = rawCost;
+    stats.comb = comb;
+    stats.filler = filler;
+    opt.stats = statsFile.empty()? 0: &stats;
+    Deadline budget = {deadline/1000, 0, 0, 0, 0, false, {0, 0, 0, 0}};
+    opt.deadline = (deadline>0)? &budget: 0;
+    ResultCache cache(static_cast<size_t>(resultCache)<<20);
+    opt.cache = (resultCache>0)? &cache: 0;
+
+    // Resident service, maps sent back to the clients
+    if(! serve.empty()) {
+        StereoEngine engine(opt.stereo, true);
+        return serveStereo(serve.c_str(), engine, opt.cache)? 0: 1;
+    }
+
+    // Maps are written in the background while computation goes on
+    DisparityWriter writer(tiff);
+    if(! batch.empty()) {
+        setVideoAccel(hwaccel);
+        bool ok = processBatch(batch.c_str(), opt, writer,
+                               static_cast<size_t>(batchMemory)<<20,
+                               batchReaders,
+                               batchJobs, verbose);
+        ok = writer.finish() && ok;
+        report.stop();
+        if(opt.stats && !writeStats(statsFile.c_str(), opt, stats))
+            ok = false;
+        return ok? 0: 1;
+    }
+
+    // Load images, decoded concurrently (libpng is sequential)
+    StereoPair pair;
+    pair.file1 = argv[1];
+    pair.file2 = argv[2];
+    pair.dMin = dMin;
+    pair.dMax = dMax;
+    pair.prefix = prefix;
+#ifdef _OPENMP
+#pragma omp parallel sections
+#endif
+    {
+#ifdef _OPENMP
+#pragma omp section
+#endif
+        loadImage(argv[1], pair.im1, inputScale);
+#ifdef _OPENMP
+#pragma omp section
+#endif
+        loadImage(argv[2], pair.im2, inputScale);
+    }
+    // Peak memory of the computation, images and maps included
+    size_t memory=0;
+    if(memLimit>0 && pair.im1.width()>0) {
+        const int w=pair.im1.width(), h=pair.im1.height();
+        const int b0 = std::max(0, opt.rowsBegin-opt.rowsHalo);
+        const int b1 = (opt.rowsEnd>0)? std::min(h,opt.rowsEnd+opt.rowsHalo):h;
+        if(! fitMemory(w, b1-b0, dMin, dMax, static_cast<size_t>(memLimit)<<20,
+                       opt.stereo))
+            return 1;
+        memory = opt.stereo.memory(w, b1-b0, dMin, dMax);
+    }
+    StereoEngine engine(opt.stereo);
+    bool ok = !sweep.empty()?
+        processSweep(pair, opt, sweepValues, engine, writer):
+        !targets.empty()? processTargets(pair, opt, targets, engine, writer):
+        processPair(pair, opt, engine, writer);
+    ok = writer.finish() && ok;
+    if(memory>0 && peakMemory()>0)
+        std::cerr << "Peak memory: " << (peakMemory()>>20) << " MB (estimated "
+                  << (memory>>20) << " MB)" << std::endl;
+    report.stop();
+    if(opt.stats && !writeStats(statsFile.c_str(), opt, stats))
+        ok = false;
+    return ok? 0: 1;
 }
@@ -20,6 +20,24 @@
 #include "image.h"
 #include <iostream>
 #include <cstdlib>
+#include <algorithm>
+#include <cmath>
+
+/// Set filler from name: "median", "bilateral" or "scan".
+bool ParamOcclusion::setFiller(const std::string& name) {
+    if(name == "median")
+        filler = FillMedian;
+    else if(name == "bilateral")
+        filler = FillBilateral;
+    else if(name == "scan")
+        filler = FillScan;
+    else {
+        std::cerr << "Error: unknown filler " << name
+                  << " (should be median, bilateral or scan)" << std::endl;
+        return false;
+    }
+    return true;
+}
 
 /// Check all parameters have a reasonable value
 bool ParamOcclusion::check() const {
@@ -40,21 +58,257 @@ bool ParamOcclusion::check() const {
         std::cerr << "Error: Median radius must be positive";
         ok = false;
     }
+    if(median_step<1) {
+        std::cerr << "Error: Step of median window must be positive";
+        ok = false;
+    }
+    if(palette<0) {
+        std::cerr << "Error: Number of colors of palette must be positive";
+        ok = false;
+    }
     if(!ok) std::cout << std::endl;
     return ok;
 }
 
+/// Constructor, no pixel occluded.
+OcclusionMask::OcclusionMask(int width, int height)
+: w(width), h(height), nw((width+31)/32),
+  bits(static_cast<size_t>(nw)*height, 0u) {}
+
+/// Constructor, occluded pixels being those of \a disparity outside
+/// [dMin,dMax] (including NaN).
+OcclusionMask::OcclusionMask(const Image& disparity, int dMin, int dMax)
+: w(disparity.width()), h(disparity.height()), nw((w+31)/32),
+  bits(static_cast<size_t>(nw)*h, 0u) {
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            if(! (dMin<=disparity(x,y) && disparity(x,y)<=dMax))
+                set(x,y);
+}
+
+/// First index in [x,w) of row \a y with occlusion status \a occ, w if none.
+///
+/// Words with no pixel of the status are skipped at once.
+int OcclusionMask::next(int x, int y, bool occ) const {
+    int i = x>>5;
+    if(x>=w)
+        return w;
+    const unsigned int* row = &bits[y*nw];
+    const unsigned int flip = occ? 0u: ~0u; // Searched pixels as set bits
+    unsigned int word = (row[i]^flip) & (~0u<<(x&31));
+    while(! word) {
+        if(++i == nw)
+            return w;
+        word = row[i]^flip;
+    }
+    int b=0;
+    while(! ((word>>b) & 1u))
+        ++b;
+    return std::min(w, 32*i+b);
+}
+
+/// Indices y*w+x of occluded pixels, in raster order.
+std::vector<int> OcclusionMask::pixels() const {
+    std::vector<int> list;
+    for(int y=0; y<h; y++)
+        for(int x=next(0,y,true); x<w; x=next(x+1,y,true))
+            list.push_back(y*w+x);
+    return list;
+}
+
+/// Set occluded pixels of \a disparity to value \a dOcclusion.
+void OcclusionMask::apply(Image& disparity, float dOcclusion) const {
+    for(int y=0; y<h; y++)
+        for(int x=next(0,y,true); x<w; x=next(x+1,y,true))
+            disparity(x,y) = dOcclusion;
+}
+
+/// Rounded disparities of row \a y of \a disparity, in \a out.
+static void round_row(const Image& disparity, int y, std::vector<int>& out) {
+    for(size_t x=0; x<out.size(); x++)
+        out[x] = static_cast<int>(std::floor(disparity(x,y)+0.5f));
+}
+
+/// Left-right check of row \a y, \a bad[x] set for discrepant pixels.
+///
+/// Both rows are rounded once in integer buffers \a left and \a right, so that
+/// the gather right[x+d] is the only non-sequential access.
+static void check_row(const Image& disparityLeft, const Image& disparityRight,
+                      int y, int tolDisp, std::vector<int>& left,
+                      std::vector<int>& right, std::vector<unsigned char>& bad){
+    const int w=static_cast<int>(left.size());
+    round_row(disparityLeft, y, left);
+    round_row(disparityRight, y, right);
+    for(int x=0; x<w; x++) {
+        const int d=left[x];
+        bad[x] = (x+d<0 || x+d>=w || abs(d+right[x+d])>tolDisp);
+    }
+}
+
+/// Left-right check of row \a y: \a out is \a disparityLeft, with incoherent
+/// pixels set to value \a dOcclusion. \a out may be \a disparityLeft.
+void detect_occlusion_row(const Image& disparityLeft,
+                          const Image& disparityRight, Image& out, int y,
+                          float dOcclusion, int tolDisp) {
+    const int w=disparityLeft.width();
+    std::vector<int> left(w), right(w);
+    std::vector<unsigned char> bad(w);
+    check_row(disparityLeft, disparityRight, y, tolDisp, left, right, bad);
+    for(int x=0; x<w; x++)
+        out(x,y) = bad[x]? dOcclusion: disparityLeft(x,y);
+}
+
 /// Detect left-right discrepancies in disparity and put incoherent pixels to
-/// value \a dOcclusion in \a disparityLeft.
+/// value \a dOcclusion in \a disparityLeft. Sub-pixel disparities are rounded.
+/// Rows are processed in parallel.
 void detect_occlusion(Image& disparityLeft, const Image& disparityRight,
                       float dOcclusion, int tolDisp) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<disparityLeft.height(); y++)
+        detect_occlusion_row(disparityLeft, disparityRight, disparityLeft, y,
+                             dOcclusion, tolDisp);
+}
+
+/// Left-right check, pixels discrepant in \a disparityLeft being set in
+/// \a mask. Pixels already set in \a mask stay so. Rows of the mask being
+/// separate words, they are processed in parallel.
+void detect_occlusion(const Image& disparityLeft, const Image& disparityRight,
+                      int tolDisp, OcclusionMask& mask) {
     const int w=disparityLeft.width(), h=disparityLeft.height();
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        std::vector<int> left(w), right(w);
+        std::vector<unsigned char> bad(w);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+        for(int y=0; y<h; y++) {
+            check_row(disparityLeft, disparityRight, y, tolDisp,
+                      left, right, bad);
+            for(int x=0; x<w; x++)
+                if(bad[x])
+                    mask.set(x,y);
+        }
+    }
+}
+
+/// One pass of separable bilateral smoothing of occluded pixels of \a mask.
+///
+/// The window is the segment of radius \a r along x (\a vertical false) or
+/// y. Values are read in \a in, results written in \a out at occluded
+/// pixels. \a kSpace and \a kColor are the tabulated kernels.
+static void bilateral_pass(const Image& in, const Image& guidance,
+                           const OcclusionMask& mask, int r, bool vertical,
+                           const std::vector<float>& kSpace,
+                           const std::vector<float>& kColor, Image& out) {
+    const int w=in.width(), h=in.height(), c=guidance.channels();
+    const int dx=vertical? 0: 1, dy=vertical? 1: 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for(int y=0; y<h; y++)
+        for(int x=mask.next(0,y,true); x<w; x=mask.next(x+1,y,true)) {
+            float sum=0, sumW=0;
+            for(int i=-r; i<=r; i++) {
+                const int x2=x+i*dx, y2=y+i*dy;
+                if(x2<0 || x2>=w || y2<0 || y2>=h)
+                    continue;
+                float d2=0;
+                for(int k=0; k<c; k++) {
+                    const float d=guidance(x,y,k)-guidance(x2,y2,k);
+                    d2 += d*d;
+                }
+                const size_t j=std::min(kColor.size()-1,
+                                        static_cast<size_t>(d2+0.5f));
+                const float wt = kSpace[i+r]*kColor[j];
+                sum += wt*in(x2,y2);
+                sumW += wt;
+            }
+            out(x,y) = sum/sumW; // Central weight is 1
+        }
+}
+
+/// Fill occlusions by bilateral smoothing of densified \a disparity, in place.
+///
+/// Separable filter: a horizontal then a vertical pass of radius
+/// median_radius, with weights of sigma_space and sigma_color in
+/// \a guidance. Only occluded pixels are modified, valid pixels contribute
+/// as they are. The cost per pixel is 2(2r+1) taps instead of (2r+1)^2.
+static void fill_bilateral(Image& disparity, const Image& guidance,
+                           const OcclusionMask& mask,
+                           const ParamOcclusion& paramOcc) {
+    const int r=paramOcc.median_radius;
+    const float sSpace=1/(paramOcc.sigma_space*paramOcc.sigma_space);
+    const float sColor=1/(paramOcc.sigma_color*paramOcc.sigma_color);
+    std::vector<float> kSpace(2*r+1);
+    for(int i=-r; i<=r; i++)
+        kSpace[i+r] = exp(-(i*i)*sSpace);
+    std::vector<float> kColor(guidance.channels()*255*255+1);
+    for(size_t d=0; d<kColor.size(); d++)
+        kColor[d] = exp(-(d*sColor));
+    Image tmp = disparity.clone();
+    bilateral_pass(disparity, guidance, mask, r, false, kSpace, kColor, tmp);
+    bilateral_pass(tmp, guidance, mask, r, true, kSpace, kColor, disparity);
+}
+
+/// Candidate of fill_scan: value at distance \a d if nearer than current.
+inline void nearest(int d, float v, int& dist, float& value) {
+    if(d < dist) {
+        dist = d;
+        value = v;
+    }
+}
+
+/// Fill occlusions of \a mask with the nearest valid pixel in 4 directions.
+///
+/// The nearest valid pixels on the left and right are found by sweeps of
+/// rows, the ones above and below by sweeps of columns, so that the cost is
+/// constant per pixel. On ties, the order is left, right, up, down. Values of
+/// occluded pixels of \a disparity are not read.
+static void fill_scan(Image& disparity, const OcclusionMask& mask) {
+    const int w=disparity.width(), h=disparity.height();
+    const int far=w+h; // Farther than any pixel
+    std::vector<int> dist(static_cast<size_t>(w)*h, far);
+    std::vector<float> value(dist.size());
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
     for(int y=0; y<h; y++)
-        for(int x=0; x<w; x++) {
-            int d = (int)disparityLeft(x,y);
-            if(x+d<0 || x+d>=w || abs(d+(int)disparityRight(x+d,y))>tolDisp)
-                disparityLeft(x,y) = dOcclusion;
+        for(int x=mask.next(0,y,true); x<w;) {
+            const int x1=mask.next(x,y,false); // Run [x,x1) of occluded
+            for(int i=x; i<x1; i++) {
+                int& d=dist[y*w+i];
+                float& v=value[y*w+i];
+                if(x>0) nearest(i-x+1, disparity(x-1,y), d, v);
+                if(x1<w) nearest(x1-i, disparity(x1,y), d, v);
+            }
+            x = mask.next(x1,y,true);
         }
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int x=0; x<w; x++) {
+        int last=-1; // Last valid row, going down
+        for(int y=0; y<h; y++)
+            if(! mask.occluded(x,y))
+                last = y;
+            else if(last>=0)
+                nearest(y-last, disparity(x,last), dist[y*w+x],value[y*w+x]);
+        last = -1; // Going up
+        for(int y=h-1; y>=0; y--)
+            if(! mask.occluded(x,y))
+                last = y;
+            else if(last>=0)
+                nearest(last-y, disparity(x,last), dist[y*w+x],value[y*w+x]);
+    }
+    for(int y=0; y<h; y++)
+        for(int x=mask.next(0,y,true); x<w; x=mask.next(x+1,y,true))
+            if(dist[y*w+x] < far)
+                disparity(x,y) = value[y*w+x];
 }
 
 /// Fill occlusions by weighted median filtering.
@@ -67,9 +321,37 @@ void detect_occlusion(Image& disparityLeft, const Image& disparityRight,
 void fill_occlusion(const Image& dispDense, const Image& guidance,
                     Image& disparity, int dispMin, int dispMax,
                     const ParamOcclusion& paramOcc) {
-    disparity = dispDense.weightedMedian(guidance,
-                                         disparity, dispMin, dispMax,
-                                         paramOcc.median_radius,
-                                         paramOcc.sigma_space,
-                                         paramOcc.sigma_color);
+    OcclusionMask mask(disparity, dispMin, dispMax);
+    disparity = dispDense.clone();
+    fill_occlusion(disparity, guidance, mask, dispMin, dispMax, paramOcc);
+}
+
+/// Fill occlusions of \a mask by weighted median filtering, in place.
+///
+/// \a disparity is densified at occluded pixels, by fillMaxX or fillMinX with
+/// the same \a mask. Only its occluded pixels are modified, so that no copy
+/// is needed. The cheaper fillers of \a paramOcc.filler replace the median.
+void fill_occlusion(Image& disparity, const Image& guidance,
+                    const OcclusionMask& mask, int dispMin, int dispMax,
+                    const ParamOcclusion& paramOcc) {
+    if(paramOcc.filler == ParamOcclusion::FillBilateral) {
+        fill_bilateral(disparity, guidance, mask, paramOcc);
+        return;
+    }
+    if(paramOcc.filler == ParamOcclusion::FillScan) {
+        fill_scan(disparity, mask);
+        return;
+    }
+    if(paramOcc.fast_median) {
+        disparity.weightedMedianFast(guidance, mask, dispMin, dispMax,
+                                     paramOcc.median_radius,
+                                     paramOcc.sigma_color);
+        return;
+    }
+    disparity.weightedMedian(guidance, mask, dispMin, dispMax,
+                             paramOcc.median_radius,
+                             paramOcc.sigma_space,
+                             paramOcc.sigma_color,
+                             paramOcc.palette,
+                             paramOcc.median_step);
 }
@@ -19,28 +19,88 @@
 #ifndef OCCLUSION_H
 #define OCCLUSION_H
 
-class Image;
+#include <string>
+#include <vector>
+
+template <typename T> class ImageT;
+typedef ImageT<float> Image;
+
+/// Occluded pixels of an image, packed on 1 bit per pixel.
+///
+/// Each row is a sequence of 32-bit words, bit x%32 of word x/32 being set if
+/// pixel x is occluded. Spans of valid or occluded pixels are skipped by
+/// words, see next(). This is 32 times less memory than a float image.
+class OcclusionMask {
+public:
+    OcclusionMask(): w(0), h(0), nw(0) {}
+    OcclusionMask(int width, int height);
+    OcclusionMask(const Image& disparity, int dMin, int dMax);
+    int width() const { return w; }
+    int height() const { return h; }
+    /// Is pixel (x,y) occluded?
+    bool occluded(int x, int y) const {
+        return (bits[y*nw+(x>>5)]>>(x&31)) & 1u;
+    }
+    void set(int x, int y) { bits[y*nw+(x>>5)] |= 1u<<(x&31); }
+    int next(int x, int y, bool occ) const;
+    std::vector<int> pixels() const;
+    void apply(Image& disparity, float dOcclusion) const;
+private:
+    int w, h; ///< Dimensions
+    int nw;   ///< Words per row
+    std::vector<unsigned int> bits;
+};
 
 /// Parameters for filling occlusions
 struct ParamOcclusion {
+    /// Method filling occluded pixels
+    enum Filler {
+        FillMedian,    ///< Weighted median (reference)
+        FillBilateral, ///< Separable bilateral smoothing of densified map
+        FillScan       ///< Nearest valid pixel in 4 directions
+    };
+
     int tol_disp; ///< Tolerance of disp diff in left-right consistency check
     float sigma_space; ///< Sigma for space in bilateral weights
     float sigma_color; ///< Sigma for color in bilateral weights
     int median_radius; ///< Radius of window for weighted median filter
+    int median_step; ///< Step between sampled pixels of median window
+    bool fast_median; ///< Joint histogram median, box window, quantized colors
+    int palette; ///< Colors of quantized guidance of median, 0 for exact
+    bool support_weights; ///< Weights of aggregation, see fillOcclusionAW
+    Filler filler; ///< Method of filling
 
     // Constructor with default parameters
     ParamOcclusion()
     : tol_disp(1),
       sigma_space(9),
       sigma_color(255*0.1f),
-      median_radius(9) {}
+      median_radius(9),
+      median_step(1),
+      fast_median(false),
+      palette(0),
+      support_weights(false),
+      filler(FillMedian) {
+#ifdef LOW_MEMORY // Profile of small devices, see CMakeLists.txt
+        fast_median = true;
+#endif
+    }
 
+    bool setFiller(const std::string& name);
     bool check() const;
 };
 
 void detect_occlusion(Image& disparityLeft, const Image& disparityRight,
                       float dOcclusion, int tol_disp);
+void detect_occlusion_row(const Image& disparityLeft,
+                          const Image& disparityRight, Image& out, int y,
+                          float dOcclusion, int tolDisp);
+void detect_occlusion(const Image& disparityLeft, const Image& disparityRight,
+                      int tolDisp, OcclusionMask& mask);
 void fill_occlusion(const Image& dispDense, const Image& guidance,
                     Image& disparity, int dispMin, int dispMax,
                     const ParamOcclusion& paramOcc);
+void fill_occlusion(Image& disparity, const Image& guidance,
+                    const OcclusionMask& mask, int dispMin, int dispMax,
+                    const ParamOcclusion& paramOcc);
 #endif
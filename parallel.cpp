@@ -0,0 +1,312 @@
+/**
+ * @file parallel.cpp
+ * @brief Parallel loops, with OpenMP, TBB or a pool of threads
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The backend is chosen at compilation (CMake variable PARALLEL): TBB with
+// PARALLEL_TBB, a pool of std::thread with PARALLEL_THREADS, else OpenMP if
+// enabled, else serial loops.
+
+#include "parallel.h"
+
+#if defined(PARALLEL_TBB)
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+
+/// Arena of setParallelThreads, 0 for the one of the caller
+static tbb::task_arena* arena=0;
+/// Threads of arena
+static int arenaThreads=0;
+
+/// Loop of parallelFor as TBB tasks.
+class TbbLoop {
+public:
+    TbbLoop(int n_, ParallelBody& body_, ParallelSchedule schedule_)
+    : n(n_), body(body_), schedule(schedule_) {}
+    /// Iterations of a block
+    void operator()(const tbb::blocked_range<int>& range) const {
+        const int t = tbb::this_task_arena::current_thread_index();
+        for(int i=range.begin(); i<range.end(); i++)
+            body.run(i, t);
+    }
+    /// Whole loop, in the current arena
+    void operator()() const {
+        if(schedule == ParallelStatic)
+            tbb::parallel_for(tbb::blocked_range<int>(0,n), *this,
+                              tbb::static_partitioner());
+        else
+            tbb::parallel_for(tbb::blocked_range<int>(0,n,1), *this,
+                              tbb::simple_partitioner());
+    }
+private:
+    int n;
+    ParallelBody& body;
+    ParallelSchedule schedule;
+};
+
+/// Run iterations [0,n) of \a body in parallel.
+///
+/// Without setParallelThreads, the loop runs in the arena of the caller, so
+/// that it shares the threads of a host application using TBB.
+void parallelFor(int n, ParallelBody& body, ParallelSchedule schedule) {
+    TbbLoop loop(n, body, schedule);
+    if(arena)
+        arena->execute(loop);
+    else
+        loop();
+}
+
+/// Maximum number of threads of a loop.
+int parallelThreads() {
+    return arena? arena->max_concurrency():
+        tbb::this_task_arena::max_concurrency();
+}
+
+/// Run loops on \a n threads, 0 for the default.
+void setParallelThreads(int n) {
+    n = (n>0)? n: 0;
+    if(n == arenaThreads)
+        return;
+    delete arena;
+    arena = n? new tbb::task_arena(n): 0;
+    arenaThreads = n;
+}
+
+/// Name of the backend
+const char* parallelBackend() {
+    return "TBB";
+}
+
+#elif defined(PARALLEL_THREADS)
+
+#if __cplusplus < 201103L
+#error "The backend threads of parallel loops needs C++11"
+#endif
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Pool of threads running the loops of parallelFor, the caller being
+/// thread 0.
+class ThreadPool {
+public:
+    explicit ThreadPool(int n);
+    ~ThreadPool();
+    int size() const { return static_cast<int>(workers.size())+1; }
+    void run(int n, ParallelBody& body, ParallelSchedule schedule);
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    ParallelBody* body; ///< Current loop
+    int n;              ///< Iterations of current loop
+    ParallelSchedule schedule;
+    std::atomic<int> next; ///< Next iteration with ParallelDynamic
+    unsigned long loop; ///< Number of loops started
+    int active;         ///< Workers still running the current loop
+    bool quit;
+    void work(int t);
+    void iterate(int t);
+    ThreadPool(const ThreadPool&);            ///< Forbidden
+    ThreadPool& operator=(const ThreadPool&); ///< Forbidden
+};
+
+/// Whether the calling thread runs a loop of the pool
+static thread_local bool insidePool=false;
+
+/// Constructor, starting \a n-1 workers.
+ThreadPool::ThreadPool(int n_)
+: body(0), n(0), schedule(ParallelStatic), next(0), loop(0), active(0),
+  quit(false) {
+    for(int t=1; t<n_; t++)
+        workers.push_back(std::thread(&ThreadPool::work, this, t));
+}
+
+/// Destructor, stopping the workers.
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_all();
+    for(size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+}
+
+/// Loop of worker \a t: wait for a loop and run its iterations.
+void ThreadPool::work(int t) {
+    insidePool = true;
+    unsigned long done=0; // Last loop run
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        while(!quit && loop==done)
+            wake.wait(lock);
+        if(quit)
+            return;
+        done = loop;
+        lock.unlock();
+        iterate(t);
+        lock.lock();
+        if(--active == 0)
+            finished.notify_one();
+    }
+}
+
+/// Iterations of the current loop run by thread \a t.
+void ThreadPool::iterate(int t) {
+    if(schedule == ParallelStatic) {
+        const long T=size();
+        const int i0=static_cast<int>(n*t/T), i1=static_cast<int>(n*(t+1)/T);
+        for(int i=i0; i<i1; i++)
+            body->run(i, t);
+    } else
+        for(int i; (i=next++) < n;)
+            body->run(i, t);
+}
+
+/// Run the \a n iterations of \a body on all threads, return when all are
+/// done.
+void ThreadPool::run(int n_, ParallelBody& body_, ParallelSchedule s) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        body = &body_;
+        n = n_;
+        schedule = s;
+        next = 0;
+        active = size()-1;
+        ++loop;
+    }
+    wake.notify_all();
+    iterate(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    while(active > 0)
+        finished.wait(lock);
+}
+
+/// The pool, created at the first loop
+static ThreadPool* pool=0;
+/// Threads of the pool, 0 for one per core
+static int poolThreads=0;
+/// Lock of the pool, held during a loop
+static std::mutex poolMutex;
+
+/// Run iterations [0,n) of \a body in parallel.
+///
+/// Loops nested in a loop, or started by another thread while the pool runs
+/// one, are serial.
+void parallelFor(int n, ParallelBody& body, ParallelSchedule schedule) {
+    std::unique_lock<std::mutex> lock(poolMutex, std::defer_lock);
+    if(n<=1 || insidePool || !lock.try_lock()) {
+        for(int i=0; i<n; i++)
+            body.run(i, 0);
+        return;
+    }
+    if(! pool)
+        pool = new ThreadPool(parallelThreads());
+    insidePool = true;
+    pool->run(n, body, schedule);
+    insidePool = false;
+}
+
+/// Maximum number of threads of a loop.
+int parallelThreads() {
+    if(poolThreads > 0)
+        return poolThreads;
+    const int n = static_cast<int>(std::thread::hardware_concurrency());
+    return (n>0)? n: 1;
+}
+
+/// Run loops on \a n threads, 0 for one per core.
+void setParallelThreads(int n) {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    if(std::max(n,0) == poolThreads)
+        return;
+    delete pool;
+    pool = 0;
+    poolThreads = std::max(n,0);
+}
+
+/// Name of the backend
+const char* parallelBackend() {
+    return "threads";
+}
+
+#else
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/// Number of the calling thread in the OpenMP team.
+static int thread() {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+/// Run iterations [0,n) of \a body in parallel.
+void parallelFor(int n, ParallelBody& body, ParallelSchedule schedule) {
+    if(schedule == ParallelDynamic) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for(int i=0; i<n; i++)
+            body.run(i, thread());
+    } else {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for(int i=0; i<n; i++)
+            body.run(i, thread());
+    }
+}
+
+/// Maximum number of threads of a loop.
+int parallelThreads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+/// Run loops on \a n threads, 0 for the default.
+void setParallelThreads(int n) {
+#ifdef _OPENMP
+    if(n > 0)
+        omp_set_num_threads(n);
+#else
+    (void)n;
+#endif
+}
+
+/// Name of the backend
+const char* parallelBackend() {
+#ifdef _OPENMP
+    return "OpenMP";
+#else
+    return "serial";
+#endif
+}
+
+#endif
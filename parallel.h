@@ -0,0 +1,45 @@
+/**
+ * @file parallel.h
+ * @brief Parallel loops, with OpenMP, TBB or a pool of threads
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/// Iterations of a loop run by parallelFor.
+///
+/// The index \a thread of the thread running an iteration is in
+/// [0,parallelThreads()), distinct for threads running concurrently in the
+/// loop, so that it selects a workspace of the body.
+class ParallelBody {
+public:
+    virtual ~ParallelBody() {}
+    /// Iteration \a i, by thread \a thread
+    virtual void run(int i, int thread) = 0;
+};
+
+/// Distribution of iterations to threads
+enum ParallelSchedule {
+    ParallelStatic, ///< Contiguous blocks, each one run in increasing order
+    ParallelDynamic ///< One at a time, to the next free thread
+};
+
+void parallelFor(int n, ParallelBody& body,
+                 ParallelSchedule schedule=ParallelStatic);
+int parallelThreads();
+void setParallelThreads(int n);
+const char* parallelBackend();
+
+#endif
@@ -0,0 +1,142 @@
+/**
+ * @file pfm.cpp
+ * @brief Disparity maps in PFM format, memory mapped for reading
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pfm.h"
+#ifdef __unix__
+#include <sys/mman.h>
+#endif
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+
+/// Is the machine little endian?
+static bool little_endian() {
+    const int one=1;
+    return *reinterpret_cast<const char*>(&one) == 1;
+}
+
+/// Reverse the byte order of \a v.
+static void swap_bytes(float& v) {
+    unsigned char* b = reinterpret_cast<unsigned char*>(&v);
+    std::swap(b[0], b[3]);
+    std::swap(b[1], b[2]);
+}
+
+/// Has the file name the extension .pfm?
+bool is_pfm(const std::string& fileName) {
+    const std::string ext(".pfm");
+    return (fileName.size() >= ext.size() &&
+            fileName.compare(fileName.size()-ext.size(),ext.size(),ext)==0);
+}
+
+/// Write gray image \a data of size \a w x \a h in PFM format.
+///
+/// Rows go from bottom to top and pixels are in the byte order of the
+/// machine, as in the PFM specification. The scale line is padded with
+/// decimals so that pixels begin at an offset multiple of 4 bytes, allowing
+/// MappedPFM to use them in place.
+bool save_pfm(const char* fileName, const float* data, int w, int h) {
+    FILE* file = std::fopen(fileName, "wb");
+    if(! file)
+        return false;
+    char dims[32];
+    const size_t n = std::sprintf(dims, "Pf\n%d %d\n", w, h);
+    std::string scale(little_endian()? "-1": "1");
+    while((n+scale.size()+1) % sizeof(float))
+        scale += (scale.find('.')==std::string::npos)? '.': '0';
+    bool ok = (std::fprintf(file, "%s%s\n", dims, scale.c_str()) > 0);
+    for(int y=h-1; ok && y>=0; y--)
+        ok = (std::fwrite(data+static_cast<size_t>(y)*w, sizeof(float), w,
+                          file) == static_cast<size_t>(w));
+    if(std::fclose(file) != 0)
+        ok = false;
+    return ok;
+}
+
+/// Parse the PFM header of \a file, setting the size \a w x \a h, the offset
+/// \a offset of pixels and \a swap if their byte order is not the machine's.
+static bool read_header(FILE* file, int& w, int& h, long& offset,
+                        bool& swap) {
+    char buf[65];
+    size_t n = std::fread(buf, 1, sizeof(buf)-1, file);
+    buf[n] = 0;
+    char type=0;
+    float scale=0;
+    int end=0;
+    if(std::sscanf(buf, "P%c %d %d %f%n", &type, &w, &h, &scale, &end) != 4 ||
+       type!='f' || w<=0 || h<=0 || scale==0 || static_cast<size_t>(end)>=n ||
+       !std::isspace(static_cast<unsigned char>(buf[end])))
+        return false;
+    offset = end+1; // A single white space after scale
+    swap = ((scale<0) != little_endian());
+    return (std::fseek(file, 0, SEEK_END) == 0 &&
+            std::ftell(file) >= offset+static_cast<long>(sizeof(float))*w*h);
+}
+
+/// Map gray PFM file \a fileName, see image().
+bool MappedPFM::open(const char* fileName) {
+    close();
+    FILE* file = std::fopen(fileName, "rb");
+    if(! file)
+        return false;
+    int w, h;
+    long offset;
+    bool swap;
+    bool ok = read_header(file, w, h, offset, swap);
+#ifdef __unix__
+    if(ok && offset%sizeof(float)==0) {
+        baseSize = offset + sizeof(float)*w*h;
+        base = mmap(0, baseSize, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+                    fileno(file), 0);
+        if(base == MAP_FAILED)
+            base = 0;
+        else {
+            float* pix = reinterpret_cast<float*>(static_cast<char*>(base)+
+                                                  offset);
+            im = Image(pix+static_cast<size_t>(h-1)*w, w, h, 1, -w);
+        }
+    }
+#endif
+    if(ok && !base) { // Read in memory
+        im = Image(w, h);
+        ok = (std::fseek(file, offset, SEEK_SET) == 0);
+        for(int y=h-1; ok && y>=0; y--)
+            ok = (std::fread(&im(0,y), sizeof(float), w, file) ==
+                  static_cast<size_t>(w));
+    }
+    std::fclose(file);
+    if(! ok) {
+        close();
+        return false;
+    }
+    if(swap)
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++)
+                swap_bytes(im(x,y));
+    return true;
+}
+
+/// Release the image and unmap the file.
+void MappedPFM::close() {
+    im = Image();
+#ifdef __unix__
+    if(base)
+        munmap(base, baseSize);
+#endif
+    base = 0;
+    baseSize = 0;
+}
@@ -0,0 +1,50 @@
+/**
+ * @file pfm.h
+ * @brief Disparity maps in PFM format, memory mapped for reading
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PFM_H
+#define PFM_H
+
+#include "image.h"
+#include <cstddef>
+#include <string>
+
+bool is_pfm(const std::string& fileName);
+bool save_pfm(const char* fileName, const float* data, int w, int h);
+
+/// Gray PFM file mapped in memory, whose pixels are an image without copy.
+///
+/// The mapping is private: pixels can be modified without changing the file.
+/// As PFM stores rows from bottom to top, the image has a negative stride. It
+/// is valid while the file is mapped, that is until the next open() or the
+/// destruction. If the pixels are not aligned in the file (not written by
+/// save_pfm) or mmap is not available, they are read in an allocated image.
+class MappedPFM {
+public:
+    MappedPFM(): base(0), baseSize(0) {}
+    ~MappedPFM() { close(); }
+    bool open(const char* fileName);
+    void close();
+    const Image& image() const { return im; }
+private:
+    void* base; ///< Mapping of the file, 0 if the image is allocated
+    size_t baseSize; ///< Size in bytes of the mapping
+    Image im; ///< Pixels
+    MappedPFM(const MappedPFM&); // Forbidden
+    MappedPFM& operator=(const MappedPFM&); // Forbidden
+};
+
+#endif
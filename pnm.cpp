@@ -0,0 +1,193 @@
+/**
+ * @file pnm.cpp
+ * @brief Input images in uncompressed formats PPM, PGM and PFM
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pnm.h"
+#include "timing.h"
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+/// Has the file name the extension .ppm, .pgm, .pnm or .pfm?
+bool is_pnm(const std::string& fileName) {
+    const size_t n = fileName.size();
+    if(n<4 || fileName[n-4]!='.' || fileName[n-3]!='p' || fileName[n-1]!='m')
+        return false;
+    const char c = fileName[n-2];
+    return (c=='p' || c=='g' || c=='n' || c=='f');
+}
+
+/// Do \a data of \a size bytes begin with the signature of a PPM (P6), PGM
+/// (P5) or PFM (PF color, Pf gray) image?
+bool is_pnm(const void* data, size_t size) {
+    const char* s = static_cast<const char*>(data);
+    return (size>=2 && s[0]=='P' &&
+            (s[1]=='5' || s[1]=='6' || s[1]=='F' || s[1]=='f'));
+}
+
+/// Skip white spaces and comments from \a i in \a s of size \a n.
+static void skipSpaces(const char* s, size_t n, size_t& i) {
+    while(i<n && (std::isspace(static_cast<unsigned char>(s[i])) || s[i]=='#'))
+        if(s[i++] == '#')
+            while(i<n && s[i]!='\n')
+                i++;
+}
+
+/// Parse the next token of \a s of size \a n from \a i as a number \a v.
+static bool parseNumber(const char* s, size_t n, size_t& i, double& v) {
+    skipSpaces(s, n, i);
+    char buf[32];
+    size_t k=0;
+    while(i<n && k+1<sizeof(buf) &&
+          !std::isspace(static_cast<unsigned char>(s[i])))
+        buf[k++] = s[i++];
+    buf[k] = 0;
+    char* end;
+    v = std::strtod(buf, &end);
+    return (k>0 && *end==0);
+}
+
+/// Is the machine little endian?
+static bool little_endian() {
+    const int one=1;
+    return *reinterpret_cast<const char*>(&one) == 1;
+}
+
+/// Float of 4 bytes \a b, swapped if \a swap.
+static float floatAt(const unsigned char* b, bool swap) {
+    unsigned char v[4] = {b[0], b[1], b[2], b[3]};
+    if(swap) {
+        std::swap(v[0], v[3]);
+        std::swap(v[1], v[2]);
+    }
+    float f;
+    std::memcpy(&f, v, sizeof(f));
+    return f;
+}
+
+/// Value in [0,255] of float sample \a v of PFM, 0 if NaN: the color
+/// distances index the table of colorWeights.
+static float clampSample(float v) {
+    return (v>=0)? std::min(v, 255.0f): 0.0f;
+}
+
+/// Value in [0,255] of sample \a v of 16 bits with maximum value \a m,
+/// rounded, as stripped to 8 bits.
+static float scaleSample(int v, int m) {
+    return static_cast<float>((std::min(v,m)*255+m/2)/m);
+}
+
+/// Load image \a im, planar with 3 channels, from PPM, PGM or PFM \a data of
+/// \a size bytes.
+///
+/// Samples of PPM and PGM on 8 bits keep their values, as decoded from PNG;
+/// on 16 bits (big endian, maximum value over 255), they are scaled to
+/// [0,255] by the maximum value, as PNG is stripped to 8 bits. Samples of PFM
+/// are clamped to [0,255], its rows going from bottom to top, in the byte
+/// order of the sign of the scale. Gray images are replicated in the three
+/// channels. The pixels are converted in one pass, without decoding.
+bool load_pnm(const void* data, size_t size, Image& im) {
+    if(! is_pnm(data, size))
+        return false;
+    const char* s = static_cast<const char*>(data);
+    const char type = s[1];
+    size_t i=2;
+    double w, h, m;
+    if(!parseNumber(s,size,i,w) || !parseNumber(s,size,i,h) ||
+       !parseNumber(s,size,i,m) || i>=size ||
+       !std::isspace(static_cast<unsigned char>(s[i])) ||
+       w<1 || h<1 || w>(1<<20) || h>(1<<20))
+        return false;
+    i++; // A single white space before pixels
+    const bool pfm = (type=='F' || type=='f');
+    const int channels = (type=='6' || type=='F')? 3: 1;
+    if(!pfm && (m<1 || m>65535 || m!=static_cast<int>(m)))
+        return false;
+    const size_t bytesSample = pfm? sizeof(float): (m>255? 2: 1);
+    const int width=static_cast<int>(w), height=static_cast<int>(h);
+    const size_t row = bytesSample*channels*width;
+    if(size-i < row*height || (pfm && m==0))
+        return false;
+    const bool swap = pfm && ((m<0) != little_endian());
+    const int maxVal = pfm? 0: static_cast<int>(m);
+    im = Image(width, height, 3, Image::Planar);
+    for(int y=0; y<height; y++) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(s+i) +
+            row*(pfm? height-1-y: y);
+        float *r=&im(0,y,0), *g=&im(0,y,1), *b=&im(0,y,2);
+        for(int x=0; x<width; x++)
+            for(int c=0; c<channels; c++, p+=bytesSample) {
+                const float v = pfm? clampSample(floatAt(p, swap)):
+                    (bytesSample==1)? static_cast<float>(p[0]):
+                    scaleSample(p[0]<<8|p[1], maxVal);
+                if(c == 0)
+                    r[x] = g[x] = b[x] = v;
+                else
+                    (c==1? g: b)[x] = v;
+            }
+    }
+    return true;
+}
+
+/// Load image \a im from PPM, PGM or PFM file \a fileName, see load_pnm.
+///
+/// The file is mapped in memory, so that its pages are read by the kernel
+/// directly as they are converted, or read at once if mmap is not available.
+/// No message is displayed in case of failure, as for loadImage.
+bool load_pnm(const char* fileName, Image& im) {
+    StageTimer timer("load");
+    bool ok=false;
+#ifdef __unix__
+    const int fd = open(fileName, O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st)==0 && st.st_size>0) {
+        const size_t size = static_cast<size_t>(st.st_size);
+        void* base = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(base != MAP_FAILED) {
+            madvise(base, size, MADV_SEQUENTIAL);
+            ok = load_pnm(base, size, im);
+            munmap(base, size);
+        }
+    }
+    close(fd);
+#else
+    FILE* file = std::fopen(fileName, "rb");
+    if(! file)
+        return false;
+    std::vector<unsigned char> buf;
+    unsigned char block[1<<16];
+    size_t n;
+    while((n=std::fread(block, 1, sizeof(block), file)) > 0)
+        buf.insert(buf.end(), block, block+n);
+    if(!std::ferror(file) && !buf.empty())
+        ok = load_pnm(&buf[0], buf.size(), im);
+    std::fclose(file);
+#endif
+    if(! ok)
+        im = Image();
+    return ok;
+}
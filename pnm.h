@@ -0,0 +1,30 @@
+/**
+ * @file pnm.h
+ * @brief Input images in uncompressed formats PPM, PGM and PFM
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PNM_H
+#define PNM_H
+
+#include "image.h"
+#include <cstddef>
+#include <string>
+
+bool is_pnm(const std::string& fileName);
+bool is_pnm(const void* data, size_t size);
+bool load_pnm(const char* fileName, Image& im);
+bool load_pnm(const void* data, size_t size, Image& im);
+
+#endif
@@ -0,0 +1,351 @@
+/**
+ * @file pystereoaw.cpp
+ * @brief Python module stereoaw: StereoEngine on buffers, without copy
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "engine.h"
+#include <string>
+
+/// Python object Engine, owning a StereoEngine
+struct PyEngine {
+    PyObject_HEAD
+    StereoEngine* engine;
+    bool busy; ///< A method runs without the GIL
+};
+
+/// Python object Map, a map of an engine exported as a 2D float buffer
+struct PyMap {
+    PyObject_HEAD
+    Image* map; ///< Shallow copy of the map of the engine
+    Py_ssize_t shape[2], strides[2];
+};
+
+static PyTypeObject* MapType=0; ///< Type of PyMap, created by the module
+
+/// Is \a format the one of native floats?
+static bool floatFormat(const char* format) {
+    const std::string f(format? format: "B");
+    const int one=1;
+    const bool little = (*reinterpret_cast<const char*>(&one) == 1);
+    return (f=="f" || f=="=f" || f=="@f" || f==(little? "<f": ">f"));
+}
+
+/// Color image on the pixels of buffer \a view, without copy.
+///
+/// The buffer must be float32 of shape (h,w,3) with contiguous pixels, or
+/// (3,h,w) with contiguous planes; rows can be strided, as in views.
+static bool bufferImage(const Py_buffer& view, Image& im) {
+    if(view.ndim!=3 || !floatFormat(view.format)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "image must be a 3D buffer of float32");
+        return false;
+    }
+    float* pix = static_cast<float*>(view.buf);
+    const Py_ssize_t* n=view.shape, *s=view.strides;
+    const Py_ssize_t f=sizeof(float);
+    if(n[2]==3 && s[2]==f && s[1]==3*f && s[0]%f==0 && s[0]>=n[1]*3*f)
+        im = Image(pix, static_cast<int>(n[1]), static_cast<int>(n[0]), 3,
+                   static_cast<int>(s[0]/f));
+    else if(n[0]==3 && s[2]==f && s[1]%f==0 && s[1]>=n[2]*f &&
+            s[0]==s[1]*n[1])
+        im = Image(pix, static_cast<int>(n[2]), static_cast<int>(n[1]), 3,
+                   static_cast<int>(s[1]/f), Image::Planar);
+    else {
+        PyErr_SetString(PyExc_ValueError, "image must be of shape (h,w,3) "
+                        "with contiguous pixels or (3,h,w) with contiguous "
+                        "planes");
+        return false;
+    }
+    return true;
+}
+
+/// Engine(aggreg='aw', levels=1, ...): keyword parameters of ParamStereo.
+static int engine_init(PyObject* self, PyObject* args, PyObject* kw) {
+    ParamStereo p;
+    ParamDisparity& d = p.disparity;
+    ParamOcclusion& o = p.occlusion;
+    const char *aggreg="aw", *rawCost="ad", *comb=COMB, *filler="median";
+    int confidence=p.confidence, lrCheck=p.lrCheck, fusedCheck=p.fusedCheck;
+    int subpixel=d.subpixel, recycle=1;
+    static const char* names[] = {
+        "aggreg", "levels", "band", "radius", "gamma_col", "gamma_pos",
+        "alpha", "tau_col", "tau_grad", "raw_cost", "comb", "subpixel",
+        "tol_disp", "median_radius", "sigma_color", "sigma_space", "filler",
+        "sense", "confidence", "lr_check", "fused_check", "threads",
+        "recycle", NULL};
+    if(! PyArg_ParseTupleAndKeywords(args, kw, "|siiifffffsspiiffsipppip",
+                                     const_cast<char**>(names), &aggreg,
+                                     &p.levels, &p.band, &d.radius,
+                                     &d.gammaCol, &d.gammaPos, &d.alpha,
+                                     &d.tauCol, &d.tauGrad, &rawCost, &comb,
+                                     &subpixel, &o.tol_disp, &o.median_radius,
+                                     &o.sigma_color, &o.sigma_space, &filler,
+                                     &p.sense, &confidence, &lrCheck,
+                                     &fusedCheck, &p.threads, &recycle))
+        return -1;
+    p.confidence = (confidence!=0);
+    p.lrCheck = (lrCheck!=0);
+    p.fusedCheck = (fusedCheck!=0);
+    d.subpixel = (subpixel!=0);
+    d.leftOnly = !p.lrCheck;
+    if(!p.setAggregation(aggreg) || !d.setRawCost(rawCost) ||
+       !d.setCombination(comb) || !o.setFiller(filler) || !d.check() ||
+       !o.check() || p.levels<1 || p.band<0) {
+        PyErr_SetString(PyExc_ValueError, "invalid parameters (see stderr)");
+        return -1;
+    }
+    PyEngine* e = reinterpret_cast<PyEngine*>(self);
+    if(e->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "engine used by another thread");
+        return -1;
+    }
+    delete e->engine;
+    e->engine = new StereoEngine(p, recycle!=0);
+    return 0;
+}
+
+static void engine_dealloc(PyObject* self) {
+    delete reinterpret_cast<PyEngine*>(self)->engine;
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free(self);
+    Py_DECREF(type); // Heap type
+}
+
+/// Engine of \a self, 0 with an exception if not initialized or busy.
+static StereoEngine* engineOf(PyObject* self) {
+    PyEngine* e = reinterpret_cast<PyEngine*>(self);
+    if(! e->engine)
+        PyErr_SetString(PyExc_RuntimeError, "engine not initialized");
+    else if(e->busy)
+        PyErr_SetString(PyExc_RuntimeError, "engine used by another thread");
+    else
+        return e->engine;
+    return 0;
+}
+
+/// compute(im1, im2, dmin, dmax): disparity maps of both images.
+///
+/// The images are read in place, the GIL being released meanwhile.
+static PyObject* engine_compute(PyObject* self, PyObject* args) {
+    StereoEngine* engine = engineOf(self);
+    PyObject *o1, *o2;
+    int dMin, dMax;
+    if(!engine || !PyArg_ParseTuple(args, "OOii", &o1, &o2, &dMin, &dMax))
+        return NULL;
+    if(dMin > dMax) {
+        PyErr_SetString(PyExc_ValueError, "dmin > dmax");
+        return NULL;
+    }
+    Py_buffer v1, v2;
+    const int flags = PyBUF_STRIDES | PyBUF_FORMAT;
+    if(PyObject_GetBuffer(o1, &v1, flags) != 0)
+        return NULL;
+    if(PyObject_GetBuffer(o2, &v2, flags) != 0) {
+        PyBuffer_Release(&v1);
+        return NULL;
+    }
+    Image im1, im2;
+    bool ok = bufferImage(v1, im1) && bufferImage(v2, im2);
+    if(ok && (im1.width()!=im2.width() || im1.height()!=im2.height())) {
+        PyErr_SetString(PyExc_ValueError, "images of different sizes");
+        ok = false;
+    }
+    if(ok) {
+        PyEngine* e = reinterpret_cast<PyEngine*>(self);
+        e->busy = true;
+        Py_BEGIN_ALLOW_THREADS
+        engine->compute(im1, im2, dMin, dMax);
+        Py_END_ALLOW_THREADS
+        e->busy = false;
+    }
+    PyBuffer_Release(&v2);
+    PyBuffer_Release(&v1);
+    if(! ok)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/// check(): left-right check, occlusions set below dmin in disparity().
+static PyObject* engine_check(PyObject* self, PyObject*) {
+    StereoEngine* engine = engineOf(self);
+    if(! engine)
+        return NULL;
+    PyEngine* e = reinterpret_cast<PyEngine*>(self);
+    e->busy = true;
+    Py_BEGIN_ALLOW_THREADS
+    engine->check();
+    Py_END_ALLOW_THREADS
+    e->busy = false;
+    Py_RETURN_NONE;
+}
+
+/// densify(): fill occlusions of disparity(), False if there is no filling.
+static PyObject* engine_densify(PyObject* self, PyObject*) {
+    StereoEngine* engine = engineOf(self);
+    if(! engine)
+        return NULL;
+    PyEngine* e = reinterpret_cast<PyEngine*>(self);
+    bool filled;
+    e->busy = true;
+    Py_BEGIN_ALLOW_THREADS
+    filled = engine->densify();
+    Py_END_ALLOW_THREADS
+    e->busy = false;
+    return PyBool_FromLong(filled);
+}
+
+/// Map object exporting \a im, None if it is empty.
+static PyObject* newMap(const Image& im) {
+    if(im.width() == 0)
+        Py_RETURN_NONE;
+    PyMap* m = PyObject_New(PyMap, MapType);
+    if(! m)
+        return NULL;
+    m->map = new Image(im);
+    m->shape[0] = im.height();
+    m->shape[1] = im.width();
+    m->strides[0] = sizeof(float)*im.stride();
+    m->strides[1] = sizeof(float);
+    return reinterpret_cast<PyObject*>(m);
+}
+
+/// disparity(): current map of image 1, without copy.
+static PyObject* engine_disparity(PyObject* self, PyObject*) {
+    StereoEngine* engine = engineOf(self);
+    return engine? newMap(engine->disparity()): NULL;
+}
+
+/// disparity_right(): map of image 2, without copy.
+static PyObject* engine_disparity_right(PyObject* self, PyObject*) {
+    StereoEngine* engine = engineOf(self);
+    return engine? newMap(engine->disparityRight()): NULL;
+}
+
+/// confidence(): confidence map, None if not computed.
+static PyObject* engine_confidence(PyObject* self, PyObject*) {
+    StereoEngine* engine = engineOf(self);
+    return engine? newMap(engine->confidence()): NULL;
+}
+
+static PyMethodDef engineMethods[] = {
+    {"compute", engine_compute, METH_VARARGS,
+     "compute(im1, im2, dmin, dmax): disparity maps of float32 images "
+     "(h,w,3) or (3,h,w) in [0,255], read in place"},
+    {"check", engine_check, METH_NOARGS,
+     "check(): left-right check of disparity()"},
+    {"densify", engine_densify, METH_NOARGS,
+     "densify(): fill occlusions of disparity(), False if no filling"},
+    {"disparity", engine_disparity, METH_NOARGS,
+     "disparity(): map of im1, values below dmin being invalid"},
+    {"disparity_right", engine_disparity_right, METH_NOARGS,
+     "disparity_right(): map of im2, in [-dmax,-dmin]"},
+    {"confidence", engine_confidence, METH_NOARGS,
+     "confidence(): confidence map in [0,1], None if not computed"},
+    {NULL, NULL, 0, NULL}
+};
+
+/// Export of the map as a read-only 2D buffer of floats.
+static int map_getbuffer(PyObject* self, Py_buffer* view, int flags) {
+    PyMap* m = reinterpret_cast<PyMap*>(self);
+    view->obj = NULL;
+    if(flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "map is read-only");
+        return -1;
+    }
+    const bool strided = (m->strides[0] != m->shape[1]*m->strides[1]);
+    if((flags&PyBUF_STRIDES)!=PyBUF_STRIDES && strided) {
+        PyErr_SetString(PyExc_BufferError, "map rows are padded, strides "
+                        "needed");
+        return -1;
+    }
+    Image& im = *m->map;
+    view->buf = &im(0,0);
+    view->obj = self;
+    Py_INCREF(self);
+    view->len = m->shape[0]*m->shape[1]*sizeof(float);
+    view->readonly = 1;
+    view->itemsize = sizeof(float);
+    view->format = (flags&PyBUF_FORMAT)? const_cast<char*>("f"): NULL;
+    view->ndim = 2;
+    view->shape = ((flags&PyBUF_ND)==PyBUF_ND)? m->shape: NULL;
+    view->strides = ((flags&PyBUF_STRIDES)==PyBUF_STRIDES)? m->strides: NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static void map_dealloc(PyObject* self) {
+    delete reinterpret_cast<PyMap*>(self)->map;
+    PyTypeObject* type = Py_TYPE(self);
+    PyObject_Del(self);
+    Py_DECREF(type); // Heap type
+}
+
+static PyType_Slot engineSlots[] = {
+    {Py_tp_doc, const_cast<char*>("Engine(**param): disparity computation of "
+                                  "stereo pairs, keeping its threads and "
+                                  "memory from one pair to the next")},
+    {Py_tp_new, reinterpret_cast<void*>(PyType_GenericNew)},
+    {Py_tp_init, reinterpret_cast<void*>(engine_init)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(engine_dealloc)},
+    {Py_tp_methods, engineMethods},
+    {0, NULL}
+};
+
+static PyType_Slot mapSlots[] = {
+    {Py_tp_doc, const_cast<char*>("Map of an engine, buffer of float32 (h,w) "
+                                  "without copy, modified by the next steps "
+                                  "of the engine")},
+    {Py_tp_dealloc, reinterpret_cast<void*>(map_dealloc)},
+    {Py_bf_getbuffer, reinterpret_cast<void*>(map_getbuffer)},
+    {0, NULL}
+};
+
+static PyType_Spec engineSpec = {
+    "stereoaw.Engine", sizeof(PyEngine), 0, Py_TPFLAGS_DEFAULT, engineSlots
+};
+static PyType_Spec mapSpec = {
+    "stereoaw.Map", sizeof(PyMap), 0, Py_TPFLAGS_DEFAULT, mapSlots
+};
+
+static PyModuleDef module = {
+    PyModuleDef_HEAD_INIT, "stereoaw",
+    "Disparity maps of stereo pairs by adaptive weights and other methods",
+    -1, NULL, NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit_stereoaw() {
+    PyObject* m = PyModule_Create(&module);
+    if(! m)
+        return NULL;
+    PyObject* engine = PyType_FromSpec(&engineSpec);
+    PyObject* map = PyType_FromSpec(&mapSpec);
+    MapType = reinterpret_cast<PyTypeObject*>(map);
+    if(!engine || !map || PyModule_AddObject(m, "Engine", engine)<0) {
+        Py_XDECREF(engine);
+        Py_XDECREF(map);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(map); // Kept in MapType
+    if(PyModule_AddObject(m, "Map", map) < 0) {
+        Py_DECREF(map);
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
+}
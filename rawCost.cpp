@@ -0,0 +1,543 @@
+/**
+ * @file rawCost.cpp
+ * @brief Raw matching costs between pixels of two images
+ * @author Laura F. Julia <fernandl@imagine.enpc.fr>
+ *         Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Laura F. Julia, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rawCost.h"
+#include "io_png.h"
+#include "simd.h"
+#include "simdKernels.h"
+#include <cmath>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+/// Raw matching cost between two pixels.
+///
+/// A linear combination of colors L1 distance (with max threshold) and
+/// x-derivatives absolute difference (with max threshold). This is the scalar
+/// reference, of which costSpan is the vectorized version.
+/// \param p1,p2 the pixels, channel i at p[i*plane], gradient at
+/// p[channels*plane]
+/// \param plane offset between channels
+/// \param channels number of color channels
+/// \param param parameters for cost computation
+inline float costPixel(const float* p1, const float* p2, ptrdiff_t plane,
+                       int channels, const ParamDisparity& param) {
+    // L1 color distance.
+    float costColor = 0;
+    for(int i=0; i<channels; i++)
+        costColor += std::abs(p1[i*plane]-p2[i*plane]);
+    costColor /= (float)channels;
+    // Color threshold
+    if(costColor > param.tauCol)
+        costColor = param.tauCol;
+
+    // x-derivatives absolute difference and threshold
+    float costGradient = std::min(std::abs(p1[channels*plane]-
+                                           p2[channels*plane]),
+                                  param.tauGrad);
+    // Linear combination of the two penalties
+    return (1-param.alpha)*costColor + param.alpha*costGradient;
+}
+
+/// Raw matching costs of \a n consecutive pixels, all inside both images.
+///
+/// Same as costPixel applied to pixels p1+i and p2+i, 0<=i<n, vectors of the
+/// kernels of simdKernels() handling several pixels at once. Output is
+/// identical to costPixel.
+static void costSpan(const float* p1, const float* p2, ptrdiff_t plane,
+                     int channels, int n, const ParamDisparity& param,
+                     float* out) {
+    int i = simdKernels().costSpan(p1, p2, plane, channels, n, param.tauCol,
+                                   param.tauGrad, param.alpha, out);
+    for(; i<n; i++)
+        out[i] = costPixel(p1+i, p2+i, plane, channels, param);
+}
+
+/// Copy row \a y of \a im and its gradient in planar buffer \a out.
+static void planarRow(const Image& im, const Image& gradient, int y,
+                      float* out) {
+    const int width=im.width(), channels=im.channels();
+    for(int i=0; i<channels; i++)
+        for(int x=0; x<width; x++)
+            *out++ = im(x,y,i);
+    for(int x=0; x<width; x++)
+        *out++ = gradient(x,y);
+}
+
+/// X-derivative of the gray level of \a im, same as im.gray().gradX().
+///
+/// Rows are processed in one pass, without intermediate gray image: the gray
+/// levels of a row are computed in a buffer with the vectors of simdKernels()
+/// when the channels are planar, then derived. Output is identical. \a im is
+/// a shallow copy, for access to its rows.
+static Image grayGradX(Image im) {
+    const int w=im.width(), h=im.height(), c=im.channels();
+    assert(w>=2 && (c==1 || c==3));
+    Image D(w,h);
+    std::vector<float> gray(w);
+    const SimdKernels& k = simdKernels();
+    for(int y=0; y<h; y++) {
+        float* g=&gray[0];
+        int x=0;
+        if(c==1)
+            for(; x<w; x++)
+                g[x] = im(x,y);
+        else if(im.layout() == Image::Planar) { // Same as rgb_to_gray
+            x = k.grayRow(&im(0,y,0), &im(0,y,1), &im(0,y,2), w, g);
+        }
+        for(; x<w; x++)
+            g[x] = rgb_to_gray(im(x,y,0), im(x,y,1), im(x,y,2));
+        float* out=&D(0,y);
+        out[0] = g[1]-g[0];
+        for(x=k.gradRow(g, w, out); x+1<w; x++)
+            out[x] = .5f*(g[x+1]-g[x-1]);
+        out[w-1] = g[w-1]-g[w-2];
+    }
+    return D;
+}
+
+/// Integer domain version of costPixel, for 8-bit images.
+///
+/// The color term is the sum of absolute differences of 8-bit channels and
+/// the gradient term the absolute difference of gradients in 1/128 gray
+/// levels, both in integer arithmetic. Only thresholds and linear
+/// combination are in float.
+/// \param p1,p2 the pixels, channel i at p[i*plane]
+/// \param g1,g2 their gradients
+/// \param plane offset between channels
+/// \param channels number of color channels
+/// \param tauCol,tauGrad thresholds of color and gradient terms
+/// \param fCol,fGrad factors of color and gradient terms
+inline float costPixelU8(const unsigned char* p1, const unsigned char* p2,
+                         const short* g1, const short* g2, ptrdiff_t plane,
+                         int channels, float tauCol, float tauGrad,
+                         float fCol, float fGrad) {
+    int costColor=0;
+    for(int i=0; i<channels; i++)
+        costColor += std::abs(p1[i*plane]-p2[i*plane]);
+    int costGradient = std::min(std::abs(*g1-*g2), 32767);
+    return fCol *std::min((float)costColor,    tauCol) +
+           fGrad*std::min((float)costGradient, tauGrad);
+}
+
+/// Integer domain version of costSpan, for 8-bit images.
+///
+/// With SSE2, 16 pixels are handled at once: absolute color differences are
+/// computed with saturated 8-bit arithmetic and gradient differences with
+/// saturated 16-bit arithmetic. Output is identical to costPixelU8.
+static void costSpanU8(const unsigned char* p1, const unsigned char* p2,
+                       const short* g1, const short* g2, ptrdiff_t plane,
+                       int channels, int n, float tauCol, float tauGrad,
+                       float fCol, float fGrad, float* out) {
+    int i=0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 vtauCol=_mm_set1_ps(tauCol), vtauGrad=_mm_set1_ps(tauGrad);
+    const __m128 vfCol=_mm_set1_ps(fCol), vfGrad=_mm_set1_ps(fGrad);
+    for(; i+16<=n; i+=16) {
+        __m128i col[2] = {zero, zero}; // Sum of abs. diff. on 16 bits
+        for(int k=0; k<channels; k++) {
+            __m128i a=_mm_loadu_si128((const __m128i*)(p1+i+k*plane));
+            __m128i b=_mm_loadu_si128((const __m128i*)(p2+i+k*plane));
+            __m128i diff = _mm_or_si128(_mm_subs_epu8(a,b),_mm_subs_epu8(b,a));
+            col[0] = _mm_add_epi16(col[0], _mm_unpacklo_epi8(diff,zero));
+            col[1] = _mm_add_epi16(col[1], _mm_unpackhi_epi8(diff,zero));
+        }
+        for(int j=0; j<2; j++) {
+            __m128i a=_mm_loadu_si128((const __m128i*)(g1+i+8*j));
+            __m128i b=_mm_loadu_si128((const __m128i*)(g2+i+8*j));
+            __m128i diff = _mm_subs_epi16(a,b);
+            __m128i grad = _mm_max_epi16(diff, _mm_subs_epi16(zero,diff));
+            __m128i c[2] = {_mm_unpacklo_epi16(col[j],zero),
+                            _mm_unpackhi_epi16(col[j],zero)};
+            __m128i g[2] = {_mm_unpacklo_epi16(grad,zero),
+                            _mm_unpackhi_epi16(grad,zero)};
+            for(int h=0; h<2; h++) {
+                __m128 vc=_mm_min_ps(_mm_cvtepi32_ps(c[h]), vtauCol);
+                __m128 vg=_mm_min_ps(_mm_cvtepi32_ps(g[h]), vtauGrad);
+                _mm_storeu_ps(out+i+8*j+4*h,
+                              _mm_add_ps(_mm_mul_ps(vfCol,vc),
+                                         _mm_mul_ps(vfGrad,vg)));
+            }
+        }
+    }
+#endif
+    for(; i<n; i++)
+        out[i] = costPixelU8(p1+i, p2+i, g1+i, g2+i, plane, channels,
+                             tauCol, tauGrad, fCol, fGrad);
+}
+
+/// Copy row \a y of 8-bit image \a im in planar buffer \a out and compute its
+/// gradient in \a grad, in 1/128 gray levels.
+static void planarRowU8(const Image8& im, int y,
+                        unsigned char* out, short* grad) {
+    const int width=im.width(), channels=im.channels();
+    for(int i=0; i<channels; i++)
+        for(int x=0; x<width; x++)
+            out[i*width+x] = im(x,y,i);
+    // Gray level in 1/128 units (same weights as rgb_to_gray), stored in grad
+    for(int x=0; x<width; x++) {
+        const unsigned char* p = out+x;
+        int g = (channels==3)?
+            (6969*p[0] + 23434*p[width] + 2365*p[2*width] + 128) >> 8:
+            p[0] << 7;
+        grad[x] = static_cast<short>(g);
+    }
+    if(width<2)
+        return;
+    // Derivative along x, as in Image::gradX
+    short prev=grad[0];
+    grad[0] = static_cast<short>(grad[1]-grad[0]);
+    for(int x=1; x+1<width; x++) {
+        short cur=grad[x];
+        grad[x] = static_cast<short>((grad[x+1]-prev)/2);
+        prev = cur;
+    }
+    grad[width-1] = static_cast<short>(grad[width-1]-prev);
+}
+
+/// Copy of 8-bit image \a im in 8-bit storage.
+static Image8 image8(const Image& im) {
+    Image8 out(im.width(), im.height(), im.channels());
+    for(int y=0; y<im.height(); y++)
+        for(int x=0; x<im.width(); x++)
+            for(int i=0; i<im.channels(); i++)
+                out(x,y,i) = static_cast<unsigned char>(im(x,y,i));
+    return out;
+}
+
+/// Check whether image has only integral values in [0,255].
+bool is_8bit(const Image& im) {
+    for(int y=0; y<im.height(); y++)
+        for(int x=0; x<im.width(); x++)
+            for(int i=0; i<im.channels(); i++) {
+                float v = im(x,y,i);
+                if(! (0<=v && v<=255 && v==static_cast<int>(v)))
+                    return false;
+            }
+    return true;
+}
+
+/// FNV-1a hash of \a n bytes at \a p, continuing hash \a h (HASH_SEED to
+/// begin).
+unsigned long long hashBytes(const void* p, size_t n, unsigned long long h) {
+    const unsigned char* c = static_cast<const unsigned char*>(p);
+    for(size_t i=0; i<n; i++)
+        h = (h ^ c[i]) * 1099511628211ULL;
+    return h;
+}
+
+/// Hash of dimensions and pixels of image \a im, continuing hash \a h.
+unsigned long long hashImage(const Image& im, unsigned long long h) {
+    const int dims[3] = {im.width(), im.height(), im.channels()};
+    h = hashBytes(dims, sizeof(dims), h);
+    for(int y=0; y<im.height(); y++)
+        for(int x=0; x<im.width(); x++)
+            for(int i=0; i<im.channels(); i++) {
+                float v = im(x,y,i);
+                h = hashBytes(&v, sizeof(v), h);
+            }
+    return h;
+}
+
+/// Name of the cache file in directory \a dir of the cost volume of images
+/// \a im1 and \a im2, of elements of \a elemSize bytes.
+///
+/// It depends on a hash of all inputs determining the raw costs.
+std::string costCacheName(const std::string& dir,
+                          const Image& im1, const Image& im2,
+                          int dMin, int dMax, const ParamDisparity& param,
+                          size_t elemSize) {
+    unsigned long long h = HASH_SEED;
+    h = hashImage(im1, h);
+    h = hashImage(im2, h);
+    const int ints[7] = {dMin, dMax, static_cast<int>(param.rawCost),
+                         static_cast<int>(param.intCost),
+                         static_cast<int>(elemSize),
+                         param.offsetY, param.searchY};
+    const float floats[3] = {param.tauCol, param.tauGrad, param.alpha};
+    h = hashBytes(ints, sizeof(ints), h);
+    h = hashBytes(floats, sizeof(floats), h);
+    char name[32];
+    std::sprintf(name, "aw_%016llx.cost", h);
+    std::string file(dir);
+    if(!file.empty() && file[file.size()-1]!='/')
+        file += '/';
+    return file+name;
+}
+
+/*
+ * RawCostADGrad
+ */
+
+/// Constructor, computing gradients of both images concurrently.
+RawCostADGrad::RawCostADGrad(const Image& I1, const Image& I2,
+                             const ParamDisparity& p)
+: im1(I1), im2(I2), param(p) {
+    assert(im1.channels() == im2.channels());
+#ifdef _OPENMP
+#pragma omp parallel sections
+#endif
+    {
+#ifdef _OPENMP
+#pragma omp section
+#endif
+        grad1 = grayGradX(im1);
+#ifdef _OPENMP
+#pragma omp section
+#endif
+        grad2 = grayGradX(im2);
+    }
+}
+
+/// Cost of pixels with both thresholds reached.
+float RawCostADGrad::maxCost() const {
+    return (1-param.alpha)*param.tauCol + param.alpha*param.tauGrad;
+}
+
+/// Constructor, allocating rows of both images and gradients.
+RawCostADGrad::Row::Row(const RawCostADGrad& c)
+: cost(c), channels(c.im1.channels()), plane(c.im1.width()),
+  buffer(2*(channels+1)*plane) {}
+
+/// Copy rows \a y1 and \a y2 of images and gradients in planar form.
+void RawCostADGrad::Row::load(int y1, int y2) {
+    planarRow(cost.im1, cost.grad1, y1, &buffer[0]);
+    planarRow(cost.im2, cost.grad2, y2, &buffer[(channels+1)*plane]);
+}
+
+/// Costs at disparity \a d of pixels x0<=x<x1.
+void RawCostADGrad::Row::span(int d, int x0, int x1, float* out) const {
+    const float *p1=&buffer[0], *p2=p1+(channels+1)*plane;
+    costSpan(p1+x0, p2+x0+d, plane, channels, x1-x0, cost.param, out);
+}
+
+/*
+ * RawCostADGradU8
+ */
+
+/// Constructor
+RawCostADGradU8::RawCostADGradU8(const Image& I1, const Image& I2,
+                                 const ParamDisparity& param)
+: im1(image8(I1)), im2(image8(I2)),
+  tauCol(param.tauCol*I1.channels()), tauGrad(param.tauGrad*128),
+  fCol((1-param.alpha)/I1.channels()), fGrad(param.alpha/128),
+  max((1-param.alpha)*param.tauCol + param.alpha*param.tauGrad) {
+    assert(im1.channels() == im2.channels());
+}
+
+/// Cost of pixels with both thresholds reached.
+float RawCostADGradU8::maxCost() const {
+    return max;
+}
+
+/// Constructor, allocating 8-bit rows of both images and gradients.
+RawCostADGradU8::Row::Row(const RawCostADGradU8& c)
+: cost(c), plane(c.im1.width()),
+  pix(2*c.im1.channels()*plane), grad(2*plane) {}
+
+/// Copy rows \a y1 and \a y2 of images and gradients in 8-bit planar form.
+void RawCostADGradU8::Row::load(int y1, int y2) {
+    planarRowU8(cost.im1, y1, &pix[0], &grad[0]);
+    planarRowU8(cost.im2, y2, &pix[cost.im1.channels()*plane], &grad[plane]);
+}
+
+/// Costs at disparity \a d of pixels x0<=x<x1.
+void RawCostADGradU8::Row::span(int d, int x0, int x1, float* out) const {
+    const int channels=cost.im1.channels();
+    const unsigned char *p1=&pix[0], *p2=p1+channels*plane;
+    const short *g1=&grad[0], *g2=g1+plane;
+    costSpanU8(p1+x0, p2+x0+d, g1+x0, g2+x0+d, plane, channels, x1-x0,
+               cost.tauCol, cost.tauGrad, cost.fCol, cost.fGrad, out);
+}
+
+/*
+ * RawCostCensus
+ */
+
+/// Census transform of gray image \a im in a (2r+1)x(2r+1) window. Neighbors
+/// outside the image are replaced by the closest pixel inside.
+static void census(const Image& im, int r, std::vector<unsigned int>& out) {
+    assert((2*r+1)*(2*r+1)-1 <= 32);
+    const int w=im.width(), h=im.height();
+    out.resize(w*h);
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            const float c = im(x,y);
+            unsigned int bits=0;
+            for(int j=-r; j<=r; j++) {
+                const int yy = std::min(std::max(y+j,0),h-1);
+                for(int i=-r; i<=r; i++)
+                    if(i!=0 || j!=0) {
+                        const int xx = std::min(std::max(x+i,0),w-1);
+                        bits = (bits<<1) | (im(xx,yy)<c? 1: 0);
+                    }
+            }
+            out[y*w+x] = bits;
+        }
+}
+
+/// Number of bits set in \a v.
+inline int popcount(unsigned int v) {
+    v = v - ((v>>1) & 0x55555555u);
+    v = (v & 0x33333333u) + ((v>>2) & 0x33333333u);
+    return static_cast<int>((((v + (v>>4)) & 0x0F0F0F0Fu) * 0x01010101u)>>24);
+}
+
+/// Constructor, computing census transforms of images.
+RawCostCensus::RawCostCensus(const Image& im1, const Image& im2,
+                             const ParamDisparity&)
+: w(im1.width()) {
+    census(im1.gray(), RADIUS, census1);
+    census(im2.gray(), RADIUS, census2);
+}
+
+/// Number of bits of census transform.
+float RawCostCensus::maxCost() const {
+    return static_cast<float>((2*RADIUS+1)*(2*RADIUS+1)-1);
+}
+
+/// Constructor
+RawCostCensus::Row::Row(const RawCostCensus& c)
+: cost(c), c1(0), c2(0) {}
+
+/// Point to rows \a y1 and \a y2 of census images.
+void RawCostCensus::Row::load(int y1, int y2) {
+    c1 = &cost.census1[y1*cost.w];
+    c2 = &cost.census2[y2*cost.w];
+}
+
+/// Costs at disparity \a d of pixels x0<=x<x1.
+void RawCostCensus::Row::span(int d, int x0, int x1, float* out) const {
+    for(int x=x0; x<x1; x++)
+        *out++ = static_cast<float>(popcount(c1[x]^c2[x+d]));
+}
+
+/*
+ * RawCostRank
+ */
+
+/// Rank transform of gray image \a im in a (2r+1)x(2r+1) window. Neighbors
+/// outside the image are replaced by the closest pixel inside.
+static void rank(const Image& im, int r, std::vector<unsigned char>& out) {
+    assert((2*r+1)*(2*r+1) <= 256);
+    const int w=im.width(), h=im.height();
+    out.resize(w*h);
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            const float c = im(x,y);
+            int n=0;
+            for(int j=-r; j<=r; j++) {
+                const int yy = std::min(std::max(y+j,0),h-1);
+                for(int i=-r; i<=r; i++) {
+                    const int xx = std::min(std::max(x+i,0),w-1);
+                    if(im(xx,yy)<c)
+                        ++n;
+                }
+            }
+            out[y*w+x] = static_cast<unsigned char>(n);
+        }
+}
+
+/// Constructor, computing rank transforms of images.
+RawCostRank::RawCostRank(const Image& im1, const Image& im2,
+                         const ParamDisparity&)
+: w(im1.width()) {
+    rank(im1.gray(), RADIUS, rank1);
+    rank(im2.gray(), RADIUS, rank2);
+}
+
+/// Maximum rank difference.
+float RawCostRank::maxCost() const {
+    return static_cast<float>((2*RADIUS+1)*(2*RADIUS+1)-1);
+}
+
+/// Constructor
+RawCostRank::Row::Row(const RawCostRank& c)
+: cost(c), r1(0), r2(0) {}
+
+/// Point to rows \a y1 and \a y2 of rank images.
+void RawCostRank::Row::load(int y1, int y2) {
+    r1 = &cost.rank1[y1*cost.w];
+    r2 = &cost.rank2[y2*cost.w];
+}
+
+/// Costs at disparity \a d of pixels x0<=x<x1.
+void RawCostRank::Row::span(int d, int x0, int x1, float* out) const {
+    for(int x=x0; x<x1; x++)
+        *out++ = static_cast<float>(std::abs(r1[x]-r2[x+d]));
+}
+
+/*
+ * RawCostADCensus
+ */
+
+/// Parameter lambda of AD term, in gray levels
+static const float LAMBDA_AD=10.0f;
+/// Parameter lambda of census term, in bits
+static const float LAMBDA_CENSUS=30.0f;
+
+/// Constructor, tabulating robust functions.
+RawCostADCensus::RawCostADCensus(const Image& I1, const Image& I2,
+                                 const ParamDisparity& param)
+: im1(I1), im2(I2), census(I1, I2, param), tabAD(I1.channels()*255+1) {
+    assert(im1.channels() == im2.channels());
+    const float c = static_cast<float>(im1.channels());
+    for(size_t i=0; i<tabAD.size(); i++)
+        tabAD[i] = 1-std::exp(-(i/c)/LAMBDA_AD);
+    for(int i=0; i<=32; i++)
+        tabCensus[i] = 1-std::exp(-i/LAMBDA_CENSUS);
+}
+
+/// Upper bound of costs.
+float RawCostADCensus::maxCost() const {
+    return 2.0f;
+}
+
+/// Constructor, allocating rows of both images.
+RawCostADCensus::Row::Row(const RawCostADCensus& c)
+: cost(c), census(c.census), channels(c.im1.channels()),
+  plane(c.im1.width()), buffer(2*channels*plane) {}
+
+/// Copy rows \a y1 and \a y2 of images in planar form and point to census
+/// rows.
+void RawCostADCensus::Row::load(int y1, int y2) {
+    census.load(y1, y2);
+    float* out=&buffer[0];
+    for(int k=0; k<2; k++) {
+        const Image& im = k? cost.im2: cost.im1;
+        const int y = k? y2: y1;
+        for(int i=0; i<channels; i++)
+            for(int x=0; x<plane; x++)
+                *out++ = im(x,y,i);
+    }
+}
+
+/// Costs at disparity \a d of pixels x0<=x<x1.
+void RawCostADCensus::Row::span(int d, int x0, int x1, float* out) const {
+    census.span(d, x0, x1, out);
+    const float *p1=&buffer[0], *p2=p1+channels*plane;
+    const int maxAD = static_cast<int>(cost.tabAD.size())-1;
+    for(int x=x0; x<x1; x++, out++) {
+        float ad=0;
+        for(int i=0; i<channels; i++)
+            ad += std::abs(p1[x+i*plane]-p2[x+d+i*plane]);
+        const int iad = std::min(static_cast<int>(ad), maxAD);
+        *out = cost.tabAD[iad] + cost.tabCensus[static_cast<int>(*out)];
+    }
+}
@@ -0,0 +1,408 @@
+/**
+ * @file rawCost.h
+ * @brief Raw matching costs between pixels of two images
+ * @author Laura F. Julia <fernandl@imagine.enpc.fr>
+ *         Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Laura F. Julia, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RAWCOST_H
+#define RAWCOST_H
+
+#include "costVolume.h"
+#include "disparity.h"
+#include "image.h"
+#include "parallel.h"
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/// A raw cost policy is a class with:
+///   - a constructor taking the two images and the ParamDisparity, doing the
+///     precomputations needed for the whole images;
+///   - a method maxCost(), giving an upper bound of costs;
+///   - an inner class Row, constructed from the policy, having a method
+///     load(y1,y2) reading row y1 of image 1 and row y2 of image 2, and a
+///     method span(d,x0,x1,out) writing in out[0..x1-x0) the costs of pixels
+///     (x,y1), x0<=x<x1, matched with (x+d,y2). All x+d are inside the image.
+///     A Row is reused for the next rows, so that its buffers are allocated
+///     once.
+/// The policy is a template parameter of costRow, so that each kernel is
+/// inlined without virtual call.
+
+/// Truncated absolute difference of colors and of x-derivatives, linearly
+/// combined. This is the reference raw cost.
+class RawCostADGrad {
+public:
+    RawCostADGrad(const Image& im1, const Image& im2,
+                  const ParamDisparity& param);
+    float maxCost() const;
+    /// Rows of both images and their gradients in planar form.
+    class Row {
+    public:
+        explicit Row(const RawCostADGrad& cost);
+        void load(int y1, int y2);
+        void span(int d, int x0, int x1, float* out) const;
+    private:
+        const RawCostADGrad& cost;
+        int channels;
+        ptrdiff_t plane;
+        std::vector<float> buffer;
+    };
+private:
+    Image im1, im2, grad1, grad2;
+    ParamDisparity param;
+};
+
+/// Same as RawCostADGrad in integer arithmetic, for 8-bit images.
+class RawCostADGradU8 {
+public:
+    RawCostADGradU8(const Image& im1, const Image& im2,
+                    const ParamDisparity& param);
+    float maxCost() const;
+    /// Rows of both images and their gradients in 8-bit planar form.
+    class Row {
+    public:
+        explicit Row(const RawCostADGradU8& cost);
+        void load(int y1, int y2);
+        void span(int d, int x0, int x1, float* out) const;
+    private:
+        const RawCostADGradU8& cost;
+        ptrdiff_t plane;
+        std::vector<unsigned char> pix;
+        std::vector<short> grad;
+    };
+private:
+    Image8 im1, im2; ///< Images stored on 8 bits
+    float tauCol;  ///< Threshold of the sum of absolute color differences
+    float tauGrad; ///< Threshold of gradient difference, in 1/128 gray levels
+    float fCol;    ///< Factor of color term
+    float fGrad;   ///< Factor of gradient term
+    float max;     ///< Maximum cost
+};
+
+/// Hamming distance between census transforms of gray levels. The census
+/// transform of a pixel is the bit string of comparisons of its neighbors in a
+/// 5x5 window with the central pixel.
+class RawCostCensus {
+public:
+    RawCostCensus(const Image& im1, const Image& im2,
+                  const ParamDisparity& param);
+    float maxCost() const;
+    /// Rows of both census images.
+    class Row {
+    public:
+        explicit Row(const RawCostCensus& cost);
+        void load(int y1, int y2);
+        void span(int d, int x0, int x1, float* out) const;
+    private:
+        const RawCostCensus& cost;
+        const unsigned int *c1, *c2;
+    };
+    static const int RADIUS=2; ///< Census window radius
+private:
+    std::vector<unsigned int> census1, census2;
+    int w;
+};
+
+/// Absolute difference of rank transforms of gray levels. The rank transform
+/// of a pixel is the number of pixels in the 5x5 window around it with lower
+/// gray level.
+class RawCostRank {
+public:
+    RawCostRank(const Image& im1, const Image& im2,
+                const ParamDisparity& param);
+    float maxCost() const;
+    /// Rows of both rank images.
+    class Row {
+    public:
+        explicit Row(const RawCostRank& cost);
+        void load(int y1, int y2);
+        void span(int d, int x0, int x1, float* out) const;
+    private:
+        const RawCostRank& cost;
+        const unsigned char *r1, *r2;
+    };
+    static const int RADIUS=2; ///< Rank window radius
+private:
+    std::vector<unsigned char> rank1, rank2;
+    int w;
+};
+
+/// AD-Census: robust combination 2-exp(-AD/lambdaAD)-exp(-C/lambdaC), with AD
+/// the mean absolute color difference and C the census cost.
+class RawCostADCensus {
+public:
+    RawCostADCensus(const Image& im1, const Image& im2,
+                    const ParamDisparity& param);
+    float maxCost() const;
+    /// Rows of both images in planar form and census rows.
+    class Row {
+    public:
+        explicit Row(const RawCostADCensus& cost);
+        void load(int y1, int y2);
+        void span(int d, int x0, int x1, float* out) const;
+    private:
+        const RawCostADCensus& cost;
+        RawCostCensus::Row census;
+        int channels;
+        ptrdiff_t plane;
+        std::vector<float> buffer;
+    };
+private:
+    Image im1, im2;
+    RawCostCensus census;
+    std::vector<float> tabAD;     ///< 1-exp(-AD/lambdaAD) by sum of abs. diff.
+    float tabCensus[32+1];        ///< 1-exp(-C/lambdaC)
+};
+
+bool is_8bit(const Image& im);
+/// Initial value of hashBytes and hashImage
+static const unsigned long long HASH_SEED=14695981039346656037ULL;
+unsigned long long hashBytes(const void* p, size_t n, unsigned long long h);
+unsigned long long hashImage(const Image& im, unsigned long long h);
+std::string costCacheName(const std::string& dir,
+                          const Image& im1, const Image& im2,
+                          int dMin, int dMax, const ParamDisparity& param,
+                          size_t elemSize);
+
+/// Computes row \a y of raw matching costs at disparities in [d0,d1].
+///
+/// Only the span of pixels matched inside the target image is computed, the
+/// other costs of the volume are left untouched: aggregation never reads them.
+/// Row y is matched with rows y+dy+k of image 2, |k|<=ry, clamped inside the
+/// image, the cost being the minimum over them (ParamDisparity::offsetY and
+/// searchY). The Row objects in \a rows and the \a buffer are workspaces,
+/// grown as needed and kept by the caller for the next rows.
+template <class Policy, typename T>
+void costRow(const Policy& policy, int y, CostVolumeT<T>& cost, int d0, int d1,
+             int dy, int ry, std::vector<typename Policy::Row*>& rows,
+             std::vector<float>& buffer) {
+    const int width=cost.width(), height=cost.height();
+    size_t n=0; // Rows of image 2 matched
+    for(int k=-ry; k<=ry; k++) {
+        const int y2 = std::min(std::max(y+dy+k,0), height-1);
+        if(k==-ry || y2!=std::min(std::max(y+dy+k-1,0), height-1)) {
+            if(n == rows.size())
+                rows.push_back(new typename Policy::Row(policy));
+            rows[n++]->load(y, y2);
+        }
+    }
+    buffer.resize(n>1? 2*width: width);
+    float *e=&buffer[0], *e2=e+width;
+
+    for(int d=std::max(d0,cost.dMin()); d<=std::min(d1,cost.dMax()); d++) {
+        // Pixels keeping x+d inside image
+        const int x0=std::max(0,-d);
+        const int x1=std::max(x0,std::min(width,width-d));
+        rows[0]->span(d, x0, x1, e+x0);
+        for(size_t k=1; k<n; k++) {
+            rows[k]->span(d, x0, x1, e2+x0);
+            for(int x=x0; x<x1; x++)
+                e[x] = std::min(e[x],e2[x]);
+        }
+        cost.setRow(y, d, e, x0, x1);
+    }
+}
+
+/// Computation of rows of cost volume, hiding the raw cost policy.
+///
+/// The virtual call is once per row, the pixel kernels are inlined.
+template <typename T>
+class CostRows {
+public:
+    virtual ~CostRows() {}
+    virtual float maxCost() const=0;
+    /// Compute costs of row y at disparities in [d0,d1], by thread \a thread
+    /// of a parallel loop (see ParallelBody).
+    virtual void row(int y, CostVolumeT<T>& cost, int d0, int d1,
+                     int thread) const=0;
+    /// Compute costs of row y at all disparities.
+    void row(int y, CostVolumeT<T>& cost) const {
+        row(y, cost, cost.dMin(), cost.dMax(), 0);
+    }
+};
+
+/// Rows of costs computed with raw cost \a Policy.
+///
+/// Each thread has its Row objects and buffer of costRow, allocated at its
+/// first row and reused for the others.
+template <class Policy, typename T>
+class CostRowsT : public CostRows<T> {
+    typedef std::vector<typename Policy::Row*> Rows;
+public:
+    CostRowsT(const Policy& p, const ParamDisparity& param)
+    : policy(p), dy(param.offsetY), ry(param.searchY),
+      rows(parallelThreads()), buffers(parallelThreads()) {}
+    ~CostRowsT() {
+        for(size_t i=0; i<rows.size(); i++)
+            clear(rows[i]);
+    }
+    float maxCost() const { return policy.maxCost(); }
+    void row(int y, CostVolumeT<T>& cost, int d0, int d1, int thread) const {
+        if(thread < static_cast<int>(rows.size())) {
+            costRow(policy, y, cost, d0, d1, dy, ry,
+                    rows[thread], buffers[thread]);
+            return;
+        }
+        Rows r; // More threads than at construction, see setParallelThreads
+        std::vector<float> buffer;
+        costRow(policy, y, cost, d0, d1, dy, ry, r, buffer);
+        clear(r);
+    }
+private:
+    Policy policy;
+    int dy, ry; ///< Band of rows of image 2, see costRow
+    mutable std::vector<Rows> rows; ///< Workspace by thread
+    mutable std::vector< std::vector<float> > buffers; ///< Idem
+
+    static void clear(Rows& r) {
+        for(size_t k=0; k<r.size(); k++)
+            delete r[k];
+    }
+    CostRowsT(const CostRowsT&); // Forbidden
+    CostRowsT& operator=(const CostRowsT&); // Forbidden
+};
+
+/// Computation of rows of costs for raw cost selected in \a param.
+template <typename T>
+CostRows<T>* newCostRows(const Image& im1, const Image& im2,
+                         const ParamDisparity& param) {
+    switch(param.rawCost) {
+    case ParamDisparity::CostCensus:
+        return new CostRowsT<RawCostCensus,T>(RawCostCensus(im1,im2,param),
+                                              param);
+    case ParamDisparity::CostRank:
+        return new CostRowsT<RawCostRank,T>(RawCostRank(im1,im2,param),
+                                            param);
+    case ParamDisparity::CostADCensus:
+        return new CostRowsT<RawCostADCensus,T>(RawCostADCensus(im1,im2,
+                                                                param), param);
+    default:
+        break;
+    }
+    if(param.intCost)
+        return new CostRowsT<RawCostADGradU8,T>(RawCostADGradU8(im1,im2,
+                                                                param), param);
+    return new CostRowsT<RawCostADGrad,T>(RawCostADGrad(im1,im2,param), param);
+}
+
+/// Rows of a cost volume computed by a parallel loop, at disparities
+/// [rowLo[y],rowHi[y]] if given, else at all.
+template <typename T>
+class CostRowsLoop : public ParallelBody {
+public:
+    CostRowsLoop(const CostRows<T>& r, CostVolumeT<T>& c,
+                 const int* lo=0, const int* hi=0)
+    : rows(r), cost(c), rowLo(lo), rowHi(hi) {}
+    void run(int y, int thread) {
+        rows.row(y, cost, rowLo? rowLo[y]: cost.dMin(),
+                 rowHi? rowHi[y]: cost.dMax(), thread);
+    }
+private:
+    const CostRows<T>& rows;
+    CostVolumeT<T>& cost;
+    const int *rowLo, *rowHi;
+};
+
+/// Allocate the cost volume of images of dimension \a width x \a height,
+/// without computing costs.
+///
+/// Storage type is \a T, float or unsigned short for quantized costs. If
+/// \a rowLo and \a rowHi are given, row y has costs only at disparities in
+/// [rowLo[y],rowHi[y]], in a volume of layout RowRagged, else the layout is
+/// \a layout. Memory is in \a pages.
+template <typename T>
+CostVolumeT<T>* newCostVolume(const CostRows<T>& rows, int width, int height,
+                              int dMin, int dMax,
+                              const int* rowLo=0, const int* rowHi=0,
+                              CostPages pages=PagesNormal,
+                              typename CostVolumeT<T>::Layout layout=
+                              CostVolumeT<T>::DispMajor) {
+    if(rowLo && rowHi)
+        return CostVolumeT<T>::ragged(width, height, dMin, dMax,
+                                      rows.maxCost(), rowLo, rowHi, pages);
+    return new CostVolumeT<T>(width, height, dMin, dMax, rows.maxCost(),
+                              layout, 0, pages);
+}
+
+/// Compute the cost volume of images of dimension \a width x \a height.
+///
+/// The volume is allocated by newCostVolume. Rows are independent and
+/// distributed among threads by parallelFor, as the aggregation in
+/// disparityAW.
+template <typename T>
+CostVolumeT<T>* costVolume(const CostRows<T>& rows, int width, int height,
+                           int dMin, int dMax,
+                           const int* rowLo=0, const int* rowHi=0,
+                           CostPages pages=PagesNormal,
+                           typename CostVolumeT<T>::Layout layout=
+                           CostVolumeT<T>::DispMajor) {
+    CostVolumeT<T>* cost = newCostVolume(rows, width, height, dMin, dMax,
+                                         rowLo, rowHi, pages, layout);
+    CostRowsLoop<T> loop(rows, *cost, rowLo, rowHi);
+    parallelFor(height, loop);
+    return cost;
+}
+
+/// Cost volume spilled to a scratch file in directory \a dir, see
+/// CostVolumeT::scratch. Return 0 if the file cannot be mapped.
+template <typename T>
+CostVolumeT<T>* scratchCostVolume(const CostRows<T>& rows,
+                                  int width, int height, int dMin, int dMax,
+                                  const std::string& dir) {
+    CostVolumeT<T>* cost = CostVolumeT<T>::scratch(dir, width, height,
+                                                   dMin, dMax, rows.maxCost());
+    if(! cost) {
+        std::cerr << "Warning: unable to map scratch file in " << dir
+                  << std::endl;
+        return 0;
+    }
+    CostRowsLoop<T> loop(rows, *cost);
+    parallelFor(height, loop);
+    return cost;
+}
+
+/// Cost volume cached in directory \a param.costCache.
+///
+/// The volume is memory mapped from a file named after a hash of the inputs,
+/// so that a later run with the same images and cost parameters reuses it with
+/// no copy. If absent, the file is created and the costs computed in it.
+/// Return 0 if the file cannot be mapped.
+template <typename T>
+CostVolumeT<T>* cachedCostVolume(const CostRows<T>& rows,
+                                 const Image& im1, const Image& im2,
+                                 int dMin, int dMax,
+                                 const ParamDisparity& param) {
+    const int width=im1.width(), height=im1.height();
+    const std::string file = costCacheName(param.costCache, im1, im2,
+                                           dMin, dMax, param, sizeof(T));
+    bool existing=false;
+    CostVolumeT<T>* cost = CostVolumeT<T>::mapped(file, width, height,
+                                                  dMin, dMax, rows.maxCost(),
+                                                  existing);
+    if(! cost) {
+        std::cerr << "Warning: unable to map cost file " << file << std::endl;
+        return 0;
+    }
+    if(existing)
+        return cost;
+    CostRowsLoop<T> loop(rows, *cost);
+    parallelFor(height, loop);
+    if(! cost->commit())
+        std::cerr << "Warning: unable to write cost file " << file << std::endl;
+    return cost;
+}
+
+#endif
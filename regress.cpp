@@ -0,0 +1,338 @@
+/**
+ * @file regress.cpp
+ * @brief Regression of running time, memory and accuracy on standard pairs
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pfm.h"
+#include "timing.h"
+#include "cmdLine.h"
+#include "io_png.h"
+#include "io_tiff.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/// A pair of the suite, with its ground truth
+struct Pair {
+    std::string name;      ///< Identifier, prefix of output files
+    std::string im1, im2;  ///< Images
+    int dMin, dMax;        ///< Disparity range
+    std::string gt;        ///< Ground truth disparity map of im1
+    float scale;           ///< Factor from values of gt to disparities
+};
+
+/// Measures of a pair
+struct Result {
+    Result(): time(0), rss(0), bad(0) {}
+    double time; ///< Wall time in seconds
+    double rss;  ///< Peak resident memory in MB, 0 if unknown
+    double bad;  ///< Percentage of bad pixels
+};
+
+/// Read the suite file \a fileName, one pair per line
+/// "name im1 im2 dmin dmax gt scale".
+static bool readSuite(const char* fileName, std::vector<Pair>& pairs) {
+    std::ifstream file(fileName);
+    if(! file) {
+        std::cerr << "Unable to read suite file " << fileName << std::endl;
+        return false;
+    }
+    std::string line;
+    for(int n=1; std::getline(file, line); n++) {
+        std::istringstream in(line);
+        Pair p;
+        if(!(in >> p.name) || p.name[0]=='#')
+            continue;
+        std::string end;
+        if(!(in >> p.im1 >> p.im2 >> p.dMin >> p.dMax >> p.gt >> p.scale) ||
+           (in >> end) || p.dMin>p.dMax || p.scale==0) {
+            std::cerr << fileName << ':' << n << ": wrong pair" << std::endl;
+            return false;
+        }
+        pairs.push_back(p);
+    }
+    return !pairs.empty();
+}
+
+/// Read the baseline file \a fileName, as written by saveResults.
+static bool readBaseline(const char* fileName,
+                         std::map<std::string,Result>& baseline) {
+    std::ifstream file(fileName);
+    if(! file) {
+        std::cerr << "Unable to read baseline " << fileName << std::endl;
+        return false;
+    }
+    std::string line;
+    while(std::getline(file, line)) {
+        std::istringstream in(line);
+        std::string name;
+        Result r;
+        if((in >> name) && name[0]!='#' && (in >> r.time >> r.rss >> r.bad))
+            baseline[name] = r;
+    }
+    return true;
+}
+
+/// Write the results of \a pairs in file \a fileName, to be a baseline.
+static bool saveResults(const char* fileName, const std::vector<Pair>& pairs,
+                        const std::vector<Result>& res) {
+    std::ofstream file(fileName);
+    file << "# name time(s) rss(MB) bad(%)\n";
+    for(size_t i=0; i<pairs.size(); i++)
+        file << pairs[i].name << ' ' << res[i].time << ' ' << res[i].rss
+             << ' ' << res[i].bad << '\n';
+    file.close();
+    if(! file) {
+        std::cerr << "Unable to write baseline " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Has file name \a name the extension \a ext?
+static bool hasExtension(const std::string& name, const std::string& ext) {
+    return (name.size() >= ext.size() &&
+            name.compare(name.size()-ext.size(), ext.size(), ext) == 0);
+}
+
+/// Read disparity map \a fileName in \a disp, multiplied by \a scale: PFM
+/// (Middlebury), 16-bit PNG (KITTI) or 8-bit PNG (older Middlebury), float
+/// TIFF. The first channel is used.
+static bool readMap(const std::string& fileName, float scale, Image& disp) {
+    size_t w=0, h=0, c=1;
+    if(is_pfm(fileName)) {
+        MappedPFM pfm;
+        if(! pfm.open(fileName.c_str()))
+            return false;
+        disp = pfm.image().clone();
+    } else if(hasExtension(fileName, ".png")) {
+        unsigned short* pix = io_png_read_u16(fileName.c_str(), &w, &h, &c);
+        if(! pix)
+            return false;
+        disp = Image(static_cast<int>(w), static_cast<int>(h));
+        for(size_t i=0; i<w*h; i++)
+            disp(static_cast<int>(i%w),static_cast<int>(i/w)) = pix[i];
+        std::free(pix);
+    } else {
+        float* pix = io_tiff_read_f32_gray(fileName.c_str(), &w, &h);
+        if(! pix)
+            return false;
+        disp = Image(pix, static_cast<int>(w), static_cast<int>(h)).clone();
+        std::free(pix);
+    }
+    for(int y=0; y<disp.height(); y++)
+        for(int x=0; x<disp.width(); x++)
+            disp(x,y) *= scale;
+    return true;
+}
+
+/// Percentage of bad pixels of \a disp against ground truth \a gt, at error
+/// above \a threshold. Pixels of gt 0 or not finite are unknown and ignored;
+/// invalid pixels of disp (NaN) are bad.
+static double badPixels(const Image& disp, const Image& gt, float threshold) {
+    size_t n=0, bad=0;
+    for(int y=0; y<gt.height(); y++)
+        for(int x=0; x<gt.width(); x++) {
+            const float g = gt(x,y);
+            if(g==0 || !(std::fabs(g) <= 1e30f))
+                continue;
+            ++n;
+            if(!(std::fabs(disp(x,y)-g) <= threshold))
+                ++bad;
+        }
+    return n? 100.0*bad/n: 0;
+}
+
+/// Run program \a args[0] with arguments \a args, its outputs going to file
+/// \a log. Set its wall time \a time and peak resident memory \a rss (MB).
+static bool run(const std::vector<std::string>& args, const std::string& log,
+                double& time, double& rss) {
+    rss = 0;
+    const double t0 = wallClock();
+#ifdef __unix__
+    std::vector<char*> argv;
+    for(size_t i=0; i<args.size(); i++)
+        argv.push_back(const_cast<char*>(args[i].c_str()));
+    argv.push_back(0);
+    pid_t pid = fork();
+    if(pid == 0) {
+        int fd = open(log.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if(fd >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+            close(fd);
+        }
+        execvp(argv[0], &argv[0]);
+        _exit(127);
+    }
+    int status=0;
+    rusage usage;
+    if(pid<0 || wait4(pid, &status, 0, &usage)!=pid)
+        return false;
+    time = wallClock()-t0;
+    rss = usage.ru_maxrss/1024.0; // kB in Linux
+    return WIFEXITED(status) && WEXITSTATUS(status)==0;
+#else
+    std::string command;
+    for(size_t i=0; i<args.size(); i++)
+        command += '"' + args[i] + "\" ";
+    command += "> \"" + log + "\" 2>&1";
+    const bool ok = (std::system(command.c_str()) == 0);
+    time = wallClock()-t0;
+    return ok;
+#endif
+}
+
+/// Split \a str at spaces, appending the words to \a words.
+static void split(const std::string& str, std::vector<std::string>& words) {
+    std::istringstream in(str);
+    std::string w;
+    while(in >> w)
+        words.push_back(w);
+}
+
+/// Run the program on the pairs of a suite, measure time, memory and bad
+/// pixels and compare them to a baseline.
+int main(int argc, char *argv[]) {
+    CmdLine cmd; cmd.prefixDoc="    ";
+    std::string program("./stereoAdaptiveWeights"), args, baseFile, saveFile,
+        dir("."), map("pp");
+    float threshold=1.0f, timeTol=10.0f, memTol=10.0f, badTol=0.1f;
+    int repeat=1;
+    cmd.add( make_option('p',program,"program")
+             .doc("program computing the maps") );
+    cmd.add( make_option('a',args,"args")
+             .doc("options of the program, separated by spaces") );
+    cmd.add( make_option('b',baseFile,"baseline")
+             .doc("results to compare to") );
+    cmd.add( make_option('s',saveFile,"save")
+             .doc("file where to write the results, as a baseline") );
+    cmd.add( make_option('m',map,"map")
+             .doc("map compared to ground truth: disp, occ or pp") );
+    cmd.add( make_option('t',threshold,"threshold")
+             .doc("error of bad pixels") );
+    cmd.add( make_option('n',repeat,"repeat")
+             .doc("runs of each pair, the best time being kept") );
+    cmd.add( make_option(0,timeTol,"time-tol")
+             .doc("tolerance of time increase, in percent") );
+    cmd.add( make_option(0,memTol,"memory-tol")
+             .doc("tolerance of memory increase, in percent") );
+    cmd.add( make_option(0,badTol,"bad-tol")
+             .doc("tolerance of bad pixel increase, in points of percent") );
+    cmd.add( make_option('d',dir,"dir")
+             .doc("directory of output maps and logs of the program") );
+    try {
+        cmd.process(argc, argv);
+    } catch(std::string str) {
+        std::cerr << "Error: " << str << std::endl<<std::endl;
+        argc=1; // To display usage
+    }
+    const char* suffix = (map=="pp")? "_pp.tif":
+        (map=="occ")? "_occ.tif": (map=="disp")? ".tif": 0;
+    if(argc!=2 || !suffix || repeat<1) {
+        std::cerr << "Usage: " << argv[0] << " [options] suite.txt\n"
+                  << "Options:\n" << cmd;
+        return 1;
+    }
+
+    std::vector<Pair> pairs;
+    std::map<std::string,Result> baseline;
+    if(!readSuite(argv[1], pairs) ||
+       (!baseFile.empty() && !readBaseline(baseFile.c_str(), baseline)))
+        return 1;
+
+    std::vector<std::string> words(1, program);
+    split(args, words);
+    std::vector<Result> res(pairs.size());
+    int failures=0;
+    std::printf("%-16s %9s %9s %8s", "pair", "time (s)", "rss (MB)", "bad (%)");
+    if(! baseline.empty())
+        std::printf(" %8s %8s %8s", "time", "rss", "bad");
+    std::printf("\n");
+    for(size_t i=0; i<pairs.size(); i++) {
+        const Pair& p = pairs[i];
+        const std::string out = dir + '/' + p.name;
+        std::vector<std::string> argv2(words);
+        std::ostringstream dMin, dMax;
+        dMin << p.dMin;
+        dMax << p.dMax;
+        argv2.push_back(p.im1);
+        argv2.push_back(p.im2);
+        argv2.push_back(dMin.str());
+        argv2.push_back(dMax.str());
+        argv2.push_back(out);
+        bool ok=true;
+        for(int k=0; ok && k<repeat; k++) {
+            double t=0, rss=0;
+            ok = run(argv2, out+".log", t, rss);
+            if(k==0 || t<res[i].time)
+                res[i].time = t;
+            res[i].rss = std::max(res[i].rss, rss);
+        }
+        Image disp, gt;
+        if(! ok)
+            std::cerr << p.name << ": failure of program, see " << out
+                      << ".log" << std::endl;
+        else if(! readMap(out+suffix, 1.0f, disp))
+            std::cerr << p.name << ": unable to read " << out+suffix
+                      << std::endl;
+        else if(! readMap(p.gt, p.scale, gt))
+            std::cerr << p.name << ": unable to read " << p.gt << std::endl;
+        else if(disp.width()!=gt.width() || disp.height()!=gt.height())
+            std::cerr << p.name << ": size of " << p.gt << " differs"
+                      << std::endl;
+        else {
+            res[i].bad = badPixels(disp, gt, threshold);
+            std::printf("%-16s %9.3f %9.1f %8.2f", p.name.c_str(),
+                        res[i].time, res[i].rss, res[i].bad);
+            std::map<std::string,Result>::const_iterator b =
+                baseline.find(p.name);
+            if(b != baseline.end()) {
+                const Result& r = b->second;
+                const double dt = 100.0*(res[i].time/r.time-1);
+                const double dm = (r.rss>0)? 100.0*(res[i].rss/r.rss-1): 0;
+                const double db = res[i].bad-r.bad;
+                std::printf(" %+7.1f%% %+7.1f%% %+8.2f", dt, dm, db);
+                if(dt > timeTol)  std::printf(" SLOWER");
+                if(dm > memTol)   std::printf(" MEMORY");
+                if(db > badTol)   std::printf(" ACCURACY");
+                if(db < -badTol)  std::printf(" better");
+                failures += (dt>timeTol || dm>memTol || db>badTol);
+            } else if(! baseline.empty())
+                std::printf(" (not in baseline)");
+            std::printf("\n");
+            std::fflush(stdout);
+            continue;
+        }
+        ++failures;
+    }
+    if(!saveFile.empty() && !saveResults(saveFile.c_str(), pairs, res))
+        return 1;
+    if(failures)
+        std::cout << failures << " regression(s) or failure(s)" << std::endl;
+    return failures? 1: 0;
+}
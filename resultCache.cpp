@@ -0,0 +1,97 @@
+/**
+ * @file resultCache.cpp
+ * @brief Cache of the output maps of pairs, by hash of inputs
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "resultCache.h"
+#include "engine.h"
+#include "rawCost.h"
+
+/// Constructor, keeping at most \a bytes of pixels of maps.
+ResultCache::ResultCache(size_t bytes)
+: cap(bytes), used(0) {}
+
+/// Key of pair \a im1, \a im2 with range [\a dMin,\a dMax] and parameters
+/// \a p: all those that may change the maps, even the exact options of
+/// aggregation, except threads and memory layout.
+unsigned long long ResultCache::key(const Image& im1, const Image& im2,
+                                    int dMin, int dMax, const ParamStereo& p) {
+    const ParamDisparity& d = p.disparity;
+    const ParamOcclusion& o = p.occlusion;
+    const int ints[] = {
+        dMin, dMax, d.radius, d.stride, d.rawCost, d.comb, d.cost16,
+        d.intCost, d.fastSum, d.intSum, d.dispSum, d.offsetSum, d.prune,
+        d.cascade, d.weightTensor, d.expWeights, d.subpixel, d.sgmPaths,
+        d.pmIterations, d.tolDisp, d.leftOnly, d.rightWeights, d.offsetY,
+        d.searchY, o.tol_disp, o.median_radius, o.median_step, o.fast_median,
+        o.palette, o.support_weights, o.filler, p.aggreg, p.gpu, p.levels,
+        p.band, p.scale, p.autoRange, p.rangeTile, p.roi.x, p.roi.y, p.roi.w,
+        p.roi.h, p.confidence, p.lrCheck, p.denseRight, p.fusedCheck, p.sense
+    };
+    const float floats[] = {
+        d.tauCol, d.tauGrad, d.alpha, d.gammaCol, d.gammaPos, d.sparse,
+        d.adaptRadius, d.sgmP1, d.sgmP2, o.sigma_space, o.sigma_color
+    };
+    unsigned long long h = HASH_SEED;
+    h = hashImage(im1, h);
+    h = hashImage(im2, h);
+    h = hashBytes(ints, sizeof(ints), h);
+    return hashBytes(floats, sizeof(floats), h);
+}
+
+/// Set \a maps to those of \a key, if present, which becomes the most
+/// recently used. Their pixels are shared with the cache, not to be modified.
+bool ResultCache::find(unsigned long long key, std::vector<CachedMap>& maps) {
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    std::list<Entry>::iterator it=entries.begin();
+    while(it!=entries.end() && it->key!=key)
+        ++it;
+    if(it == entries.end())
+        return false;
+    entries.splice(entries.begin(), entries, it);
+    maps = it->maps;
+    return true;
+}
+
+/// Keep \a maps under \a key, evicting the least recently used pairs. The
+/// pixels are shared: they must not be modified afterwards. Maps larger
+/// than the capacity are not kept.
+void ResultCache::add(unsigned long long key,
+                      const std::vector<CachedMap>& maps) {
+    Entry e;
+    e.key = key;
+    e.bytes = 0;
+    for(size_t i=0; i<maps.size(); i++) {
+        const Image& m = maps[i].map;
+        e.bytes += sizeof(float)*m.width()*m.height()*m.channels();
+    }
+    if(e.bytes > cap)
+        return;
+    e.maps = maps;
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    for(std::list<Entry>::iterator it=entries.begin(); it!=entries.end(); ++it)
+        if(it->key == key) // Computed concurrently
+            return;
+    while(used+e.bytes > cap) {
+        used -= entries.back().bytes;
+        entries.pop_back();
+    }
+    entries.push_front(e);
+    used += e.bytes;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file resultCache.h
+ * @brief Cache of the output maps of pairs, by hash of inputs
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include "image.h"
+#include <list>
+#include <string>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <mutex>
+#endif
+struct ParamStereo;
+
+/// Output map of a pair kept by ResultCache
+struct CachedMap {
+    std::string suffix; ///< Name of its file after the prefix of the pair
+    Image map;          ///< Pixels, own copy
+    int dMin, dMax;     ///< Range of valid values
+};
+
+/// Output maps of pairs already computed, by hash of their inputs.
+///
+/// The key of a pair is a hash of the pixels of both images, the disparity
+/// range and the parameters determining the maps. The least recently used
+/// pairs are evicted so that the pixels of the maps kept fit in the given
+/// memory. Safe to call from several threads.
+class ResultCache {
+public:
+    explicit ResultCache(size_t bytes);
+    static unsigned long long key(const Image& im1, const Image& im2,
+                                  int dMin, int dMax, const ParamStereo& p);
+    bool find(unsigned long long key, std::vector<CachedMap>& maps);
+    void add(unsigned long long key, const std::vector<CachedMap>& maps);
+private:
+    /// Maps of a pair
+    struct Entry {
+        unsigned long long key;
+        std::vector<CachedMap> maps;
+        size_t bytes; ///< Memory of pixels
+    };
+    std::list<Entry> entries; ///< Most recently used first
+    size_t cap;  ///< Capacity in bytes
+    size_t used; ///< Memory of entries
+#if __cplusplus >= 201103L
+    std::mutex mutex;
+#endif
+    ResultCache(const ResultCache&);            ///< Forbidden
+    ResultCache& operator=(const ResultCache&); ///< Forbidden
+};
+
+#endif
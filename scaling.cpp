@@ -0,0 +1,192 @@
+/**
+ * @file scaling.cpp
+ * @brief Scaling of the stages of the pipeline with the number of threads
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "engine.h"
+#include "loader.h"
+#include "parallel.h"
+#include "timing.h"
+#include "cmdLine.h"
+#include "argList.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+/// Stages of a run, the whole pipeline added as "total"
+static std::vector<StageTime> stages(double wall, double cpu) {
+    std::vector<StageTime> s = stageTimes();
+    StageTime total = {"total", 1, wall, cpu, 0, 0, 0, -1, -1};
+    s.push_back(total);
+    return s;
+}
+
+/// Times of the stages of the fastest of \a repeat runs of the pipeline with
+/// \a p on \a threads threads: compute(), then check() and densify() if
+/// \a pp. Timing is reset before each run, so that a stage holds one run.
+static std::vector<StageTime> run(ParamStereo p, int threads,
+                                  const Image& im1, const Image& im2,
+                                  int dMin, int dMax, bool pp, int repeat) {
+    p.threads = threads;
+    StereoEngine engine(p, true);
+    std::vector<StageTime> best;
+    for(int i=0; i<repeat; i++) {
+        enableTiming(true);
+        const double t0=wallClock(), c0=std::clock();
+        engine.compute(im1, im2, dMin, dMax);
+        if(pp) {
+            engine.check();
+            engine.densify();
+        }
+        const double wall = wallClock()-t0;
+        const double cpu = (std::clock()-c0)/CLOCKS_PER_SEC; // c0 double
+        if(i==0 || wall<best.back().wall)
+            best = stages(wall, cpu);
+    }
+    enableTiming(false);
+    return best;
+}
+
+/// Stage \a name in \a s, or 0.
+static const StageTime* find(const std::vector<StageTime>& s,
+                             const char* name) {
+    for(size_t i=0; i<s.size(); i++)
+        if(std::strcmp(s[i].name, name) == 0)
+            return &s[i];
+    return 0;
+}
+
+/// Likely limit of a stage below 80% efficiency: memory if its threads need
+/// 25% more CPU than the reference for the same work (bandwidth, caches),
+/// else idle threads: imbalance if the serial fraction grows with the
+/// threads, serial sections if it stays.
+static const char* limit(double efficiency, double cpuRatio,
+                         double serial, double prevSerial) {
+    if(efficiency >= 0.8)
+        return "-";
+    if(cpuRatio >= 1.25)
+        return "memory";
+    return (prevSerial>0 && serial>1.5*prevSerial)? "imbalance": "serial";
+}
+
+/// Run the pipeline on a pair for each number of threads, and print for each
+/// stage its speedup, parallel efficiency and serial fraction relative to the
+/// first number of threads.
+int main(int argc, char *argv[]) {
+    CmdLine cmd; cmd.prefixDoc="    ";
+    ParamStereo param;
+    std::string threadStr, aggreg("aw"), map("pp");
+    int repeat=1;
+    cmd.add( make_option('j',threadStr,"threads")
+             .doc("numbers of threads, separated by commas, the first one "
+                  "the reference (1,2,4... up to the OpenMP default)") );
+    cmd.add( make_option('A',aggreg,"aggreg")
+             .doc("method of disparity: aw, pm, gf, bg, cross or sgm") );
+    cmd.add( make_option('R',param.disparity.radius,"radius")
+             .doc("radius of the patch") );
+    cmd.add( make_option('m',map,"map")
+             .doc("end of the pipeline: disp (raw) or pp (densified)") );
+    cmd.add( make_option('n',repeat,"repeat")
+             .doc("runs of each number of threads, the fastest being kept") );
+    try {
+        cmd.process(argc, argv);
+    } catch(std::string str) {
+        std::cerr << "Error: " << str << std::endl<<std::endl;
+        argc=1; // To display usage
+    }
+    if(argc != 5) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [options] im1.png im2.png dmin dmax\n"
+                  << "Options:\n" << cmd;
+        return 1;
+    }
+    std::vector<int> threads;
+    if(threadStr.empty()) {
+        const int max = parallelThreads();
+        for(int n=1; n<max; n*=2)
+            threads.push_back(n);
+        threads.push_back(max);
+    } else if(! parseList(threadStr, threads)) {
+        std::cerr << "Error: threads must be positive integers separated by "
+                  << "commas" << std::endl;
+        return 1;
+    }
+    if(map!="disp" && map!="pp") {
+        std::cerr << "Error: map should be disp or pp" << std::endl;
+        return 1;
+    }
+    if(!param.setAggregation(aggreg) || !param.disparity.check() ||
+       !param.occlusion.check())
+        return 1;
+    if(repeat < 1) {
+        std::cerr << "Error: repeat must be positive" << std::endl;
+        return 1;
+    }
+    const int dMin=std::atoi(argv[3]), dMax=std::atoi(argv[4]);
+    if(dMin > dMax) {
+        std::cerr << "Error: dmin must not exceed dmax" << std::endl;
+        return 1;
+    }
+    Image im1, im2;
+    if(!loadImage(argv[1], im1) || !loadImage(argv[2], im2))
+        return 1;
+    if(im1.width()!=im2.width() || im1.height()!=im2.height()) {
+        std::cerr << "The images must have the same size" << std::endl;
+        return 1;
+    }
+    const char* wait = std::getenv("OMP_WAIT_POLICY");
+    if(!wait || std::strcmp(wait,"passive")!=0)
+        std::cerr << "Warning: without OMP_WAIT_POLICY=passive, threads "
+                  << "waiting count as busy" << std::endl;
+
+    const bool pp = (map=="pp");
+    param.lrCheck = pp;
+    run(param, threads[0], im1, im2, dMin, dMax, pp, 1); // Warm-up
+    std::vector< std::vector<StageTime> > runs(threads.size());
+    for(size_t i=0; i<threads.size(); i++)
+        runs[i] = run(param, threads[i], im1, im2, dMin, dMax, pp, repeat);
+
+    std::printf("%-16s %7s %10s %7s %6s %6s %5s %5s  %s\n", "stage",
+                "threads", "wall (ms)", "speedup", "effic", "serial",
+                "busy", "cpu x", "limit");
+    const std::vector<StageTime>& ref = runs[0];
+    for(size_t s=0; s<ref.size(); s++) {
+        const StageTime& r = ref[s];
+        double prevSerial=0;
+        for(size_t i=0; i<threads.size(); i++) {
+            const StageTime* t = find(runs[i], r.name);
+            if(! t)
+                continue;
+            const double n = static_cast<double>(threads[i])/threads[0];
+            const double speedup = (t->wall>0)? r.wall/t->wall: 0;
+            const double efficiency = speedup/n;
+            // Karp-Flatt metric, serial fraction explaining the speedup
+            const double serial = (n>1 && speedup>0)?
+                (1/speedup-1/n)/(1-1/n): 0;
+            const double busy = (t->wall>0)? t->cpu/(threads[i]*t->wall): 0;
+            const double cpuRatio = (r.cpu>0)? t->cpu/r.cpu: 0;
+            std::printf("%-16s %7d %10.2f %7.2f %6.2f %6.3f %5.2f %5.2f  %s\n",
+                        r.name, threads[i], 1e3*t->wall, speedup,
+                        efficiency, serial, busy, cpuRatio,
+                        (n>1)? limit(efficiency, cpuRatio, serial,
+                                     prevSerial): "-");
+            prevSerial = serial;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,307 @@
+/**
+ * @file server.cpp
+ * @brief Resident process computing disparity maps of pairs sent to it
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "server.h"
+#include "engine.h"
+#include "loader.h"
+#include "nan.h"
+#include "resultCache.h"
+#include "timing.h"
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#ifdef __unix__
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifdef __unix__
+
+/// Max size of PNG data of an image in a request
+static const size_t MAX_PNG_SIZE = size_t(1)<<30;
+
+/// Buffered reading and writing of file descriptors
+class Channel {
+public:
+    Channel(int fdIn, int fdOut): in(fdIn), out(fdOut), pos(0), len(0) {}
+    bool getLine(std::string& line);
+    bool read(void* data, size_t size);
+    bool write(const void* data, size_t size);
+private:
+    int in, out;   ///< File descriptors
+    char buf[1<<16]; ///< Data read in advance
+    size_t pos, len; ///< Unused data of buf
+    bool fill();
+};
+
+/// Read more data in buffer. Return false at end of file or error.
+bool Channel::fill() {
+    ssize_t n;
+    do
+        n = ::read(in, buf, sizeof(buf));
+    while(n<0 && errno==EINTR);
+    pos = 0;
+    len = (n>0)? static_cast<size_t>(n): 0;
+    return (n > 0);
+}
+
+/// Read a line, terminated by '\n' (not included).
+bool Channel::getLine(std::string& line) {
+    line.clear();
+    while(true) {
+        if(pos==len && !fill())
+            return false;
+        const char* end = static_cast<const char*>(std::memchr(buf+pos, '\n',
+                                                                len-pos));
+        if(end) {
+            line.append(buf+pos, end-(buf+pos));
+            pos = end-buf+1;
+            return true;
+        }
+        line.append(buf+pos, len-pos);
+        pos = len;
+        if(line.size() > 1024)
+            return false; // Not a request
+    }
+}
+
+/// Read exactly \a size bytes in \a data.
+bool Channel::read(void* data, size_t size) {
+    char* d = static_cast<char*>(data);
+    while(size > 0) {
+        if(pos==len && !fill())
+            return false;
+        size_t n = std::min(size, len-pos);
+        std::memcpy(d, buf+pos, n);
+        pos += n;
+        d += n;
+        size -= n;
+    }
+    return true;
+}
+
+/// Write \a size bytes of \a data.
+bool Channel::write(const void* data, size_t size) {
+    const char* d = static_cast<const char*>(data);
+    while(size > 0) {
+        ssize_t n = ::write(out, d, size);
+        if(n<0 && errno==EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        d += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/// Send an error response with \a msg. The request being answered, a
+/// cancellation by signal pending for it is reset.
+static bool sendError(Channel& c, const std::string& msg) {
+    const std::string line = "error "+msg+'\n';
+    const bool ok = c.write(line.data(), line.size());
+    cancelComputation(false);
+    return ok;
+}
+
+/// Answer requests on channel \a c until end of file. The buffers of PNG data
+/// \a png1, \a png2 and of pixels \a pix are reused from one request to the
+/// next. The maps of requests already answered are taken from \a cache if
+/// not 0. Return false if the connection got out of sync or failed.
+static bool serveChannel(Channel& c, StereoEngine& engine, ResultCache* cache,
+                         std::vector<unsigned char>& png1,
+                         std::vector<unsigned char>& png2,
+                         std::vector<float>& pix) {
+    std::string line;
+    while(c.getLine(line)) {
+        std::istringstream s(line);
+        int dMin, dMax;
+        size_t size1, size2;
+        if(! (s >> dMin >> dMax >> size1 >> size2) || size1==0 || size2==0 ||
+           size1>MAX_PNG_SIZE || size2>MAX_PNG_SIZE) {
+            sendError(c, "request should be: dmin dmax size1 size2");
+            return false;
+        }
+        png1.resize(size1);
+        png2.resize(size2);
+        if(!c.read(&png1[0], size1) || !c.read(&png2[0], size2))
+            return false;
+        Image im1, im2;
+        if(!loadImage(&png1[0], size1, im1) ||
+           !loadImage(&png2[0], size2, im2)) {
+            if(! sendError(c, "unable to decode PNG image"))
+                return false;
+            continue;
+        }
+        const int w=im1.width(), h=im1.height();
+        const long long range = static_cast<long long>(dMax)-dMin+1;
+        if(w!=im2.width() || h!=im2.height() || range<1 || range>w) {
+            if(! sendError(c, (w!=im2.width() || h!=im2.height())?
+                           "images of different sizes":
+                           "wrong disparity range"))
+                return false;
+            continue;
+        }
+        const unsigned long long key = cache?
+            ResultCache::key(im1, im2, dMin, dMax, engine.param()): 0;
+        std::vector<CachedMap> kept;
+        if(!cache || !cache->find(key, kept)) {
+            try {
+                engine.compute(im1, im2, dMin, dMax);
+                engine.check();
+                engine.densify();
+            } catch(const std::exception& e) { // The service goes on
+                if(! sendError(c, std::string("computation failed: ")+
+                               e.what()))
+                    return false;
+                continue;
+            }
+            if(computationCancelled()) {
+                if(! sendError(c, "cancelled"))
+                    return false;
+                continue;
+            }
+            CachedMap m = {"", engine.disparity(), dMin, dMax};
+            kept.assign(1, m);
+            if(cache) {
+                kept[0].map = m.map.clone();
+                cache->add(key, kept);
+            }
+        }
+        const Image& disp = kept[0].map;
+        pix.resize(static_cast<size_t>(w)*h);
+        std::vector<float>::iterator p=pix.begin();
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++) {
+                float v = disp(x,y);
+                if(! (static_cast<float>(dMin)<=v &&
+                      v<=static_cast<float>(dMax)))
+                    v = NaN;
+                *p++ = v;
+            }
+        std::ostringstream head;
+        head << "ok " << w << ' ' << h << '\n';
+        if(!c.write(head.str().data(), head.str().size()) ||
+           !c.write(&pix[0], pix.size()*sizeof(float)))
+            return false;
+        cancelComputation(false); // Answered, see sendError
+    }
+    return true;
+}
+
+/// Serve on Unix socket \a path, one connection at a time.
+static bool serveSocket(const char* path, StereoEngine& engine,
+                        ResultCache* cache,
+                        std::vector<unsigned char>& png1,
+                        std::vector<unsigned char>& png2,
+                        std::vector<float>& pix) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(std::strlen(path) >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return false;
+    }
+    std::strcpy(addr.sun_path, path);
+    struct stat st;
+    if(stat(path, &st)==0 && S_ISSOCK(st.st_mode))
+        unlink(path); // Left by a previous server
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd<0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))!=0 ||
+       listen(fd, 16)!=0) {
+        std::cerr << "Unable to listen on socket " << path << ": "
+                  << std::strerror(errno) << std::endl;
+        if(fd >= 0)
+            close(fd);
+        return false;
+    }
+    while(true) {
+        int client = accept(fd, 0, 0);
+        if(client < 0) {
+            if(errno == EINTR)
+                continue;
+            std::cerr << "Error accepting connection: " << std::strerror(errno)
+                      << std::endl;
+            break;
+        }
+        Channel c(client, client);
+        serveChannel(c, engine, cache, png1, png2, pix);
+        close(client);
+    }
+    close(fd);
+    unlink(path);
+    return false;
+}
+
+/// Cancel the current request on signal SIGUSR1.
+static void cancelRequest(int) {
+    cancelComputation();
+}
+
+/// Answer the requests of pairs at \a address with \a engine.
+///
+/// A request is a text line followed by the PNG data of both images:
+///     dmin dmax size1 size2\n<size1 bytes of im1.png><size2 bytes of im2.png>
+/// The response is a text line, followed by the pixels of the final disparity
+/// map of im1 if successful (dense, or checked only if the engine does not
+/// densify, or raw without left-right check), as w*h floats in the byte order
+/// of the machine, row after row, NaN meaning invalid:
+///     ok w h\n<4*w*h bytes>
+/// or else:
+///     error message\n
+/// If \a address is "-", requests are read from stdin and responses written
+/// to stdout until end of input; otherwise it is the path of a Unix socket,
+/// served until the process is killed. The engine, with OpenMP threads and
+/// pooled images, stays warm from one request to the next, so that no startup
+/// cost is paid by request. The signal SIGUSR1 cancels the current request,
+/// answered with an error, freeing the threads at once (stale request), or
+/// the next one if none is being computed; the request is then answered and
+/// the signal forgotten. A range of more disparities than the width, or a
+/// computation failing (out of memory), is answered with an error. If
+/// \a cache is not 0, a request of images, range and parameters already
+/// answered gets the stored map without computation. Requires a POSIX system.
+bool serveStereo(const char* address, StereoEngine& engine,
+                 ResultCache* cache) {
+    std::signal(SIGPIPE, SIG_IGN); // Clients leaving are write errors
+    std::signal(SIGUSR1, cancelRequest);
+    std::vector<unsigned char> png1, png2;
+    std::vector<float> pix;
+    if(std::strcmp(address, "-") == 0) {
+        Channel c(STDIN_FILENO, STDOUT_FILENO);
+        return serveChannel(c, engine, cache, png1, png2, pix);
+    }
+    return serveSocket(address, engine, cache, png1, png2, pix);
+}
+
+#else
+
+/// Not available without POSIX.
+bool serveStereo(const char*, StereoEngine&, ResultCache*) {
+    std::cerr << "Error: serve requires a POSIX system" << std::endl;
+    return false;
+}
+
+#endif
@@ -0,0 +1,27 @@
+/**
+ * @file server.h
+ * @brief Resident process computing disparity maps of pairs sent to it
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+class StereoEngine;
+class ResultCache;
+
+bool serveStereo(const char* address, StereoEngine& engine,
+                 ResultCache* cache=0);
+
+#endif
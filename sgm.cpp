@@ -0,0 +1,223 @@
+/**
+ * @file sgm.cpp
+ * @brief Disparity map estimation by semi-global matching of the cost volume
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sgm.h"
+#include "disparity.h"
+#include "image.h"
+#include "rawCost.h"
+#include "simd.h"
+#include <algorithm>
+#include <vector>
+#include <iostream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/// Max quantized raw cost: 16-bit costs of the volume shifted by SHIFT bits
+static const int COST_MAX=1023;
+static const int SHIFT=6;
+/// Max quantized penalty P2, so that the sum of 8 path costs, each at most
+/// COST_MAX+P2, fits in 16 bits
+static const int P2_MAX=0xffff/8-COST_MAX;
+/// Cost of padding disparities, path costs at real disparities stay below
+static const unsigned short PAD=0x3fff;
+
+/// Path directions (dx,dy), horizontal and vertical ones first
+static const int DIRS[8][2] = {{1,0}, {-1,0}, {0,1}, {0,-1},
+                               {1,1}, {-1,1}, {1,-1}, {-1,-1}};
+
+/// Add to \a sum the path costs in direction (dx,dy) of all pixels.
+///
+/// Each pixel has \a n costs in \a cost and \a sum, disparities beyond the
+/// real ones having cost PAD. The path cost at pixel p and disparity d is
+///   L(p,d) = C(p,d) + min(L(p-r,d), L(p-r,d-1)+P1, L(p-r,d+1)+P1, m+P2) - m
+/// with m the minimum of L(p-r,.), so that L(p,d)<=COST_MAX+P2. Only two rows
+/// of path costs are kept, with n+2 values per pixel so that d-1 and d+1 are
+/// always readable, the extra ones being PAD.
+static void aggregatePath(int dx, int dy, const unsigned short* cost,
+                          int w, int h, int n,
+                          unsigned short P1, unsigned short P2,
+                          unsigned short* sum) {
+    const int m=n+2;
+    std::vector<unsigned short> buf1(static_cast<size_t>(w)*m, PAD), buf2(buf1);
+    std::vector<unsigned short> min1(w), min2(w); // Min of path costs of pixels
+    unsigned short *prev=&buf1[0], *cur=&buf2[0];
+    unsigned short *minPrev=&min1[0], *minCur=&min2[0];
+    const vu16 p1=vset16(P1);
+    for(int i=0; i<h; i++) {
+        const int y = (dy>=0)? i: h-1-i;
+        for(int j=0; j<w; j++) {
+            const int x = (dx>=0)? j: w-1-j, xp=x-dx;
+            const size_t k = (static_cast<size_t>(y)*w+x)*n;
+            const unsigned short* c = cost+k;
+            unsigned short *s=sum+k, *l=cur+x*m+1;
+            vu16 vm = vset16(PAD);
+            if(xp<0 || xp>=w || (dy!=0 && i==0)) { // Start of path
+                for(int d=0; d<n; d+=VSIZE16) {
+                    const vu16 v = vload16(c+d);
+                    vstore16(l+d, v);
+                    vstore16(s+d, vadd16(vload16(s+d),v));
+                    vm = vmin15(vm, v);
+                }
+            } else {
+                const unsigned short* lp = (dy==0? cur: prev) + xp*m+1;
+                const unsigned short mp = (dy==0? minCur: minPrev)[xp];
+                const vu16 vmp=vset16(mp), vmp2=vset16(mp+P2);
+                for(int d=0; d<n; d+=VSIZE16) {
+                    vu16 v = vmin15(vadd16(vload16(lp+d-1),p1),
+                                    vadd16(vload16(lp+d+1),p1));
+                    v = vmin15(vmin15(v,vload16(lp+d)), vmp2);
+                    v = vadd16(vload16(c+d), vsub16(v,vmp));
+                    vstore16(l+d, v);
+                    vstore16(s+d, vadd16(vload16(s+d),v));
+                    vm = vmin15(vm, v);
+                }
+            }
+            minCur[x] = vminlanes15(vm);
+        }
+        std::swap(prev,cur);
+        std::swap(minPrev,minCur);
+    }
+}
+
+/// Quantized penalty of ratio \a p of max cost.
+static unsigned short penalty(float p) {
+    return static_cast<unsigned short>(std::min(static_cast<float>(P2_MAX),
+                                                p*COST_MAX+0.5f));
+}
+
+/// Disparity computation by semi-global matching of the cost volume.
+///
+/// This is the method of Hirschmuller (2008): path costs along param.sgmPaths
+/// directions (4 or 8) are summed and the disparity is the winner-take-all.
+/// Raw costs are quantized in [0,COST_MAX] and penalties sgmP1 and sgmP2 are
+/// ratios of the max cost, so that path costs and their sum fit in 16 bits and
+/// are computed in vectors over disparities. Directions are distributed among
+/// threads, each summing in its own volume. The map of image 2 is the
+/// winner-take-all of the same sums along its epipolar lines. Output maps are
+/// as with disparityAW.
+/// \param im1,im2 the two color images
+/// \param dMin,dMax disparity range
+/// \param param raw cost computation parameters
+/// \param disp1 output disparity map from image 1 to image 2
+/// \param disp2 output disparity map from image 2 to image 1
+void disparitySGM(Image im1, Image im2,
+                  int dMin, int dMax, const ParamDisparity& param,
+                  Image& disp1, Image& disp2) {
+    if(param.intCost && !(is_8bit(im1) && is_8bit(im2))) {
+        std::cerr << "Warning: images are not 8-bit, "
+                  << "using float raw cost" << std::endl;
+        ParamDisparity p(param);
+        p.intCost = false;
+        disparitySGM(im1, im2, dMin, dMax, p, disp1, disp2);
+        return;
+    }
+    const int width=im1.width(), height=im1.height();
+    const int nd=dMax-dMin+1, n=(nd+VSIZE16-1)/VSIZE16*VSIZE16;
+    const size_t size = static_cast<size_t>(width)*height*n;
+    const unsigned short P2=penalty(param.sgmP2);
+    const unsigned short P1=std::min(P2,penalty(param.sgmP1));
+
+    // Quantized raw costs, pixel major
+    std::vector<unsigned short> C(size);
+    {
+        CostRows<unsigned short>* rows =
+            newCostRows<unsigned short>(im1, im2, param);
+        CostVolume16* cost = costVolume(*rows, width, height, dMin, dMax,
+                                        0, 0, param.costPages);
+        delete rows;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++) {
+            unsigned short* c = &C[static_cast<size_t>(y)*width*n];
+            for(int d=dMin; d<=dMax; d++) {
+                const int x0=std::max(0,-d), x1=std::max(x0,width-d);
+                for(int x=0; x<width; x++)
+                    c[x*n+d-dMin] = (x0<=x && x<x1)?
+                        static_cast<unsigned short>(*cost->ptr(x,y,d)>>SHIFT):
+                        static_cast<unsigned short>(COST_MAX);
+            }
+            for(int x=0; x<width; x++)
+                std::fill(c+x*n+nd, c+(x+1)*n, PAD);
+        }
+        delete cost;
+    }
+
+    // Sum of path costs, one volume per thread
+    const int paths=param.sgmPaths;
+    int threads=1;
+#ifdef _OPENMP
+    threads = std::min(paths, omp_get_max_threads());
+#endif
+    std::vector< std::vector<unsigned short> > sums(threads);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+    for(int i=0; i<paths; i++) {
+        int t=0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        if(sums[t].empty())
+            sums[t].resize(size, 0);
+        aggregatePath(DIRS[i][0], DIRS[i][1], &C[0], width, height, n,
+                      P1, P2, &sums[t][0]);
+    }
+    int t0=0; // First thread having computed paths
+    while(sums[t0].empty())
+        ++t0;
+    std::vector<unsigned short>& S = sums[t0];
+    const size_t row = static_cast<size_t>(width)*n;
+    for(int t=t0+1; t<threads; t++) {
+        if(sums[t].empty())
+            continue;
+        unsigned short* s = &S[0];
+        const unsigned short* st = &sums[t][0];
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<height; y++)
+            for(size_t k=y*row; k<(y+1)*row; k+=VSIZE16)
+                vstore16(s+k, vadd16(vload16(s+k),vload16(st+k)));
+    }
+
+    // Winner-take-all in both images
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<height; y++) {
+        const unsigned short* s = &S[y*row];
+        for(int x=0; x<width; x++) {
+            int best=dMin-1; // Best disparity of x in image 1
+            for(int d=std::max(dMin,-x); d<=std::min(dMax,width-1-x); d++)
+                if(best<dMin || s[x*n+d-dMin] < s[x*n+best-dMin])
+                    best = d;
+            if(best >= dMin)
+                disp1(x,y) = static_cast<float>(best);
+            if(param.leftOnly)
+                continue;
+            best=dMin-1; // Best disparity of x in image 2, matched to x-d
+            for(int d=std::max(dMin,x-width+1); d<=std::min(dMax,x); d++)
+                if(best<dMin ||
+                   s[(x-d)*n+d-dMin] < s[(x-best)*n+best-dMin])
+                    best = d;
+            if(best >= dMin)
+                disp2(x,y) = -static_cast<float>(best);
+        }
+    }
+}
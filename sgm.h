@@ -0,0 +1,28 @@
+/**
+ * @file sgm.h
+ * @brief Disparity map estimation by semi-global matching of the cost volume
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SGM_H
+#define SGM_H
+
+template <typename T> class ImageT;
+typedef ImageT<float> Image;
+struct ParamDisparity;
+
+void disparitySGM(Image im1, Image im2, int dMin, int dMax,
+                  const ParamDisparity& param, Image& disp1, Image& disp2);
+
+#endif
@@ -17,83 +17,45 @@
 */
 
 #include "disparity.h"
+#include "weights.h"
 #include "image.h"
+#include "loader.h"
+#include "parallel.h"
 #include "cmdLine.h"
 #include "io_png.h"
 #include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <cmath>
-
-/// Type for weights combination
-typedef float (*Comb)(float,float);
-
-/// The std::max and std::min functions take arguments float&, not float.
-/// We need to encapsulate them for parameter compatibility.
-static float max(float a, float b) {
-    return std::max(a,b);
-}
-static float min(float a, float b) {
-    return std::min(a,b);
-}
-static float mult(float a, float b) {
-    return a*b;
-}
-static float plus(float a, float b) {
-    return a+b;
-}
-static float left(float a, float) {
-    return a;
-}
-
-/// Load color image
-Image loadImage(const char* name) {
-    size_t width, height;
-    float* pix = io_png_read_f32_rgb(name, &width, &height);
-    if(! pix) {
-        std::cerr << "Unable to read file " << name << " as PNG" << std::endl;
-        std::exit(1);
+#include <vector>
+
+/// Window of weights of a combination, see weightWindow().
+typedef void (*WindowWeights)(const Image& im1, const Image& im2,
+                              int xp, int yp, int xq, int r, int s,
+                              const float* distC, const float* distP,
+                              Image& w1, Image& w2, Image& w);
+
+/// Window of weights of combination \a comb.
+static WindowWeights windowWeights(ParamDisparity::Combination comb) {
+    switch(comb) {
+    case ParamDisparity::CombineMax:  return weightWindow<CombMax>;
+    case ParamDisparity::CombineMin:  return weightWindow<CombMin>;
+    case ParamDisparity::CombineMult: return weightWindow<CombMult>;
+    case ParamDisparity::CombinePlus: return weightWindow<CombPlus>;
+    default: return weightWindow<CombLeft>;
     }
-    const int w=static_cast<int>(width), h=static_cast<int>(height);
-    Image im(w, h, 3);
-    const float *r=pix, *g=r+w*h, *b=g+w*h;
-    for(int y=0; y<h; y++)
-        for(int x=0; x<w; x++) {
-            im(x,y,0) = *r++;
-            im(x,y,1) = *g++;
-            im(x,y,2) = *b++;
-        }
-    std::free(pix);
-    return im;
-}
-
-/// Relative color weight between pixels (x,y) and (x+dx,y+dy).
-float weight(const Image& im, int x, int y, int dx, int dy, float gammaCol) {
-    float d=0; // L1 color distance
-    for(int i=0; i<im.channels(); i++)
-        d += std::abs(im(x+dx,y+dy,i)-im(x,y,i));
-    return std::exp(-d/(im.channels()*gammaCol));
 }
 
-/// Compute the window of weights around pixel (xp,yp) in \a im1.
-Image show_weights(const Image& im1, const Image& im2, int xp, int yp, int xq,
-                   Comb* comb, int r, float gammaCol, float gammaPos) {
-    Image W(2*r+1,2*r+1);
-    std::fill_n(&W(0,0), W.width()*W.height(), 0.0f);
-    int w1=im1.width(), h1=im1.height();
-    int w2=im2.width(), h2=im2.height();
-    const float f = (comb? 2.0f: 1.0f);
-    for(int y=-r; y<=r; y++)
-        if(0<=yp+y && yp+y<h1 && (!comb || yp+y<h2))
-            for(int x=-r; x<=r; x++)
-                if(0<=xp+x && xp+x<w1 &&
-                   (!comb || (0<=xq+x && xq+x<w2))) {
-                    float w = weight(im1, xp,yp, x,y, gammaCol);
-                    if(comb)
-                        w = (*comb)(w, weight(im2, xq,yp, x,y, gammaCol));
-                    W(x+r,y+r) = w *
-                        std::exp(-f*std::sqrt(float(x*x+y*y))/gammaPos);
-                }
-    return W;
+/// Compute the window of weights \a W around pixel (xp,yp) in \a im1, of
+/// 2r+1 taps at step \a s, combined by \a comb with the weights of (xq,yp) in
+/// \a im2, exactly as the aggregation of disparityAW.
+void show_weights(const Image& im1, const Image& im2, int xp, int yp, int xq,
+                  WindowWeights comb, int r, int s, const float* distC,
+                  const float* distP, Image& W) {
+    const int dim=2*r+1;
+    std::vector<float> windows(2*dim*dim);
+    Image W1(&windows[0], dim, dim), W2(&windows[dim*dim], dim, dim);
+    comb(im1, im2, xp, yp, xq, r, s, distC, distP, W1, W2, W);
 }
 
 /// Rescale weights to interval [0,255]
@@ -108,17 +70,87 @@ void rescale(Image& w) {
         }
 }
 
+/// Window of a point of a list
+struct PointWeights {
+    int x, y, disp;
+};
+
+/// Load the points of file \a name, lines x y [disp], disp being 0 if
+/// omitted. Empty lines and lines beginning with # are ignored.
+static bool loadPoints(const char* name, std::vector<PointWeights>& pts) {
+    std::ifstream file(name);
+    if(! file) {
+        std::cerr << "Unable to read file " << name << std::endl;
+        return false;
+    }
+    std::string line;
+    for(int n=1; std::getline(file, line); n++) {
+        std::istringstream str(line);
+        std::string first;
+        if(!(str>>first) || first[0]=='#')
+            continue;
+        PointWeights p;
+        p.disp = 0;
+        str.clear();
+        str.seekg(0);
+        if(!(str>>p.x>>p.y) || !((str>>p.disp) || str.eof()) ||
+           !(str>>std::ws).eof()) {
+            std::cerr << "Error line " << n << " of " << name
+                      << ": x y [disp]" << std::endl;
+            return false;
+        }
+        pts.push_back(p);
+    }
+    return true;
+}
+
+/// Windows of a list of points, computed in parallel, each one in its tile of
+/// a mosaic.
+class WindowsBody : public ParallelBody {
+public:
+    WindowsBody(const Image& i1, const Image& i2, WindowWeights c,
+                const ParamDisparity& param, const std::vector<PointWeights>& p,
+                int columns, Image& m)
+    : im1(i1), im2(i2), comb(c), s(param.stride), r(param.radius/s),
+      distC(colorWeights(i1.channels(), param)), distP(spatialWeights(param)),
+      pts(p), cols(columns), mosaic(m) {}
+    ~WindowsBody() { delete [] distC; delete [] distP; }
+    void run(int i, int) {
+        const int dim=2*r+1;
+        Image W = mosaic.view((i%cols)*dim, (i/cols)*dim, dim, dim);
+        const PointWeights& p = pts[i];
+        show_weights(im1, im2, p.x, p.y, p.x+p.disp, comb, r, s, distC, distP,
+                     W);
+        rescale(W);
+    }
+private:
+    const Image &im1, &im2;
+    WindowWeights comb;
+    int s, r; ///< Step and radius in taps of windows
+    float *distC, *distP; ///< Tabulated color and spatial weights
+    const std::vector<PointWeights>& pts;
+    int cols; ///< Tiles in a row of the mosaic
+    Image& mosaic;
+    WindowsBody(const WindowsBody&);            ///< Forbidden
+    WindowsBody& operator=(const WindowsBody&); ///< Forbidden
+};
+
 /// Main Program
 int main(int argc, char *argv[])
 {
     CmdLine cmd; cmd.prefixDoc="    ";
 
-    std::string combine;
+    std::string combine, points;
+    int threads=0;
     ParamDisparity p; // Parameters for adaptive weights
     cmd.add( make_option('R',p.radius).doc("radius of the window patch") );
     cmd.add(make_option(0,p.gammaCol,"gcol").doc("gamma for color similarity"));
     cmd.add( make_option(0,p.gammaPos,"gpos").doc("gamma for distance") );
     cmd.add( make_option('c', combine).doc("weights combination (see below)") );
+    cmd.add( make_option(0,points,"points")
+             .doc("windows of points x y [disp] listed in file, in a mosaic") );
+    cmd.add( make_option('j',threads,"threads")
+             .doc("threads computing the windows of points (0: default)") );
 
     try {
         cmd.process(argc, argv);
@@ -126,10 +158,13 @@ int main(int argc, char *argv[])
         std::cerr << "Error: " << str << std::endl<<std::endl;
         argc = 1; // To display usage
     }
-    if(argc!=5 && argc!=7) {
+    const bool list = !points.empty();
+    if(list? (argc!=3 && argc!=4): (argc!=5 && argc!=7)) {
         std::cerr <<"Show weights\n"
                   << "Usage: " << argv[0]
                   << " [options] im1.png x y out.png [im2.png disp]\n"
+                  << "       " << argv[0]
+                  << " [options] --points list.txt im1.png out.png [im2.png]\n"
                   << "Options (default values in parentheses)\n"
                   << "Adaptive weights parameters:\n" << cmd << '\n';
         std::cerr << "Weights combination choice (relevant only with im2.png):"
@@ -141,50 +176,62 @@ int main(int argc, char *argv[])
                   << std::endl;
         return 1;
     }
+    const char* out = list? argv[2]: argv[4];
 
     // Load images
-    Image im1 = loadImage(argv[1]);
-    Image im2;
-    if(argc>5)
-        im2 = loadImage(argv[5]);
-
-    int x,y;
-    if(! ((std::istringstream(argv[2])>>x).eof() &&
-          (std::istringstream(argv[3])>>y).eof())) {
-        std::cerr << "Error reading x or y" << std::endl;
-        return 1;
-    }
-
-    int disp=0;
-    if(argc>6 && !((std::istringstream(argv[6])>>disp).eof()) ) {
-        std::cerr << "Error reading disparity" << std::endl;
+    Image im1, im2;
+    const char* name2 = (argc == (list? 4: 7))? argv[list? 3: 5]: 0;
+    if(! loadImage(argv[1], im1) || (name2 && !loadImage(name2, im2))) {
+        std::cerr << "Unable to read file " << (im1.channels()? name2: argv[1])
+                  << " as image" << std::endl;
         return 1;
     }
 
-    Comb* comb=0;
-    if(cmd.used('c') && im2.channels()!=0) {
-        if(combine == "left")
-            comb = new Comb(left);
-        else if(combine == "max")
-            comb = new Comb(max);
-        else if(combine == "min")
-            comb = new Comb(min);
-        else if(combine == "mult")
-            comb = new Comb(mult);
-        else if(combine == "plus")
-            comb = new Comb(plus);
-        else {
-            std::cerr << "Unrecognized option for weights combination "
-                      << "(should be left,max,min,mult or plus)" << std::endl;
+    std::vector<PointWeights> pts;
+    if(list) {
+        if(! loadPoints(points.c_str(), pts))
+            return 1;
+    } else {
+        PointWeights pt;
+        pt.disp=0;
+        if(! ((std::istringstream(argv[2])>>pt.x).eof() &&
+              (std::istringstream(argv[3])>>pt.y).eof())) {
+            std::cerr << "Error reading x or y" << std::endl;
+            return 1;
+        }
+        if(argc>6 && !((std::istringstream(argv[6])>>pt.disp).eof()) ) {
+            std::cerr << "Error reading disparity" << std::endl;
             return 1;
         }
+        pts.push_back(pt);
     }
+    for(size_t i=0; i<pts.size(); i++)
+        if(!(0<=pts[i].x && pts[i].x<im1.width() &&
+             0<=pts[i].y && pts[i].y<im1.height())) {
+            std::cerr << "Error: point " << pts[i].x << ' ' << pts[i].y
+                      << " outside image" << std::endl;
+            return 1;
+        }
+
+    p.comb = ParamDisparity::CombineLeft;
+    if(cmd.used('c') && im2.channels()!=0 && !p.setCombination(combine))
+        return 1;
 
-    Image w = show_weights(im1, im2, x, y, x+disp, comb,
-                           p.radius, p.gammaCol, p.gammaPos);
-    rescale(w);
-    if(io_png_write_f32(argv[4], &w(0,0), w.width(), w.height(), 1) != 0) {
-        std::cerr << "Unable to write file " << argv[4] << std::endl;
+    // Mosaic of windows, cols x rows, a single one without list
+    const int n=static_cast<int>(pts.size()), dim=2*(p.radius/p.stride)+1;
+    const int cols=std::max(1,static_cast<int>(std::ceil(std::sqrt(n-.5)))),
+        rows=(n+cols-1)/cols;
+    Image w(cols*dim, std::max(rows,1)*dim);
+    w.fill(0.0f);
+    WindowsBody windows(im1, im2, windowWeights(p.comb), p, pts, cols, w);
+    setParallelThreads(threads);
+    parallelFor(n, windows);
+
+    std::vector<float> pix; // Contiguous pixels
+    for(int i=0; i<w.height(); i++)
+        pix.insert(pix.end(), &w(0,i), &w(0,i)+w.width());
+    if(io_png_write_f32(out, &pix[0], w.width(), w.height(), 1) != 0) {
+        std::cerr << "Unable to write file " << out << std::endl;
         return 1;
     }
 
@@ -0,0 +1,283 @@
+/**
+ * @file simd.h
+ * @brief Thin portable layer over SIMD float vectors
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+/// The instruction set is the best one enabled at compile time: AVX-512, AVX,
+/// SSE2 or NEON (64-bit ARM). Without any, vectors have a single float, so
+/// that kernels written with these functions still compile and run. The
+/// functions have internal linkage, so that translation units compiled for
+/// other instruction sets (see simdKernels.h) do not share their code.
+/// Only IEEE exact operations are provided (no FMA, no approximate division),
+/// so that vector kernels give the same results as their scalar counterparts.
+/// The exceptions are vmuladd, fused when FMA is enabled, and the horizontal
+/// sum vsum, whose order of summation differs from a scalar loop: kernels using
+/// them are not bit-exact. vanyless and vallless test whether a<b in some or
+/// all lanes (false for NaN), and vselless(a,b,x,y) is x where a<b, else y.
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define SIMD_NAME "AVX-512"
+typedef __m512 vfloat;
+static const int VSIZE=16; ///< Number of floats in a vector
+static inline vfloat vload(const float* p)     { return _mm512_loadu_ps(p); }
+static inline void vstore(float* p, vfloat v)  { _mm512_storeu_ps(p,v); }
+static inline vfloat vset(float v)             { return _mm512_set1_ps(v); }
+static inline vfloat vadd(vfloat a, vfloat b)  { return _mm512_add_ps(a,b); }
+static inline vfloat vsub(vfloat a, vfloat b)  { return _mm512_sub_ps(a,b); }
+static inline vfloat vmul(vfloat a, vfloat b)  { return _mm512_mul_ps(a,b); }
+static inline vfloat vdiv(vfloat a, vfloat b)  { return _mm512_div_ps(a,b); }
+static inline vfloat vmin(vfloat a, vfloat b)  { return _mm512_min_ps(a,b); }
+static inline vfloat vmax(vfloat a, vfloat b)  { return _mm512_max_ps(a,b); }
+static inline vfloat vabs(vfloat a)            { return _mm512_abs_ps(a); }
+static inline vfloat vmuladd(vfloat a, vfloat b, vfloat c) {
+    return _mm512_fmadd_ps(a,b,c);
+}
+static inline bool vanyless(vfloat a, vfloat b) {
+    return _mm512_cmp_ps_mask(a,b,_CMP_LT_OQ) != 0;
+}
+static inline bool vallless(vfloat a, vfloat b) {
+    return _mm512_cmp_ps_mask(a,b,_CMP_LT_OQ) == 0xffff;
+}
+static inline vfloat vselless(vfloat a, vfloat b, vfloat x, vfloat y) {
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a,b,_CMP_LT_OQ), y, x);
+}
+static inline float vsum(vfloat a) {
+    return _mm512_reduce_add_ps(a);
+}
+#elif defined(__AVX__)
+#include <immintrin.h>
+#ifdef __AVX2__
+#define SIMD_NAME "AVX2"
+#else
+#define SIMD_NAME "AVX"
+#endif
+typedef __m256 vfloat;
+static const int VSIZE=8; ///< Number of floats in a vector
+static inline vfloat vload(const float* p)     { return _mm256_loadu_ps(p); }
+static inline void vstore(float* p, vfloat v)  { _mm256_storeu_ps(p,v); }
+static inline vfloat vset(float v)             { return _mm256_set1_ps(v); }
+static inline vfloat vadd(vfloat a, vfloat b)  { return _mm256_add_ps(a,b); }
+static inline vfloat vsub(vfloat a, vfloat b)  { return _mm256_sub_ps(a,b); }
+static inline vfloat vmul(vfloat a, vfloat b)  { return _mm256_mul_ps(a,b); }
+static inline vfloat vdiv(vfloat a, vfloat b)  { return _mm256_div_ps(a,b); }
+static inline vfloat vmin(vfloat a, vfloat b)  { return _mm256_min_ps(a,b); }
+static inline vfloat vmax(vfloat a, vfloat b)  { return _mm256_max_ps(a,b); }
+static inline vfloat vabs(vfloat a) {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+}
+#ifdef __FMA__
+static inline vfloat vmuladd(vfloat a, vfloat b, vfloat c) {
+    return _mm256_fmadd_ps(a,b,c);
+}
+#else
+static inline vfloat vmuladd(vfloat a, vfloat b, vfloat c) {
+    return _mm256_add_ps(_mm256_mul_ps(a,b),c);
+}
+#endif
+static inline bool vanyless(vfloat a, vfloat b) {
+    return _mm256_movemask_ps(_mm256_cmp_ps(a,b,_CMP_LT_OQ)) != 0;
+}
+static inline bool vallless(vfloat a, vfloat b) {
+    return _mm256_movemask_ps(_mm256_cmp_ps(a,b,_CMP_LT_OQ)) == 0xff;
+}
+static inline vfloat vselless(vfloat a, vfloat b, vfloat x, vfloat y) {
+    return _mm256_blendv_ps(y, x, _mm256_cmp_ps(a,b,_CMP_LT_OQ));
+}
+static inline float vsum(vfloat a) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(a),
+                          _mm256_extractf128_ps(a,1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s,s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s,s,1));
+    return _mm_cvtss_f32(s);
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_NAME "SSE2"
+typedef __m128 vfloat;
+static const int VSIZE=4; ///< Number of floats in a vector
+static inline vfloat vload(const float* p)     { return _mm_loadu_ps(p); }
+static inline void vstore(float* p, vfloat v)  { _mm_storeu_ps(p,v); }
+static inline vfloat vset(float v)             { return _mm_set1_ps(v); }
+static inline vfloat vadd(vfloat a, vfloat b)  { return _mm_add_ps(a,b); }
+static inline vfloat vsub(vfloat a, vfloat b)  { return _mm_sub_ps(a,b); }
+static inline vfloat vmul(vfloat a, vfloat b)  { return _mm_mul_ps(a,b); }
+static inline vfloat vdiv(vfloat a, vfloat b)  { return _mm_div_ps(a,b); }
+static inline vfloat vmin(vfloat a, vfloat b)  { return _mm_min_ps(a,b); }
+static inline vfloat vmax(vfloat a, vfloat b)  { return _mm_max_ps(a,b); }
+static inline vfloat vabs(vfloat a) {
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+}
+static inline vfloat vmuladd(vfloat a, vfloat b, vfloat c) {
+    return _mm_add_ps(_mm_mul_ps(a,b),c);
+}
+static inline bool vanyless(vfloat a, vfloat b) {
+    return _mm_movemask_ps(_mm_cmplt_ps(a,b)) != 0;
+}
+static inline bool vallless(vfloat a, vfloat b) {
+    return _mm_movemask_ps(_mm_cmplt_ps(a,b)) == 0xf;
+}
+static inline vfloat vselless(vfloat a, vfloat b, vfloat x, vfloat y) {
+    const __m128 m = _mm_cmplt_ps(a,b);
+    return _mm_or_ps(_mm_and_ps(m,x), _mm_andnot_ps(m,y));
+}
+static inline float vsum(vfloat a) {
+    __m128 s = _mm_add_ps(a, _mm_movehl_ps(a,a));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s,s,1));
+    return _mm_cvtss_f32(s);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NAME "NEON"
+typedef float32x4_t vfloat;
+static const int VSIZE=4; ///< Number of floats in a vector
+static inline vfloat vload(const float* p)     { return vld1q_f32(p); }
+static inline void vstore(float* p, vfloat v)  { vst1q_f32(p,v); }
+static inline vfloat vset(float v)             { return vdupq_n_f32(v); }
+static inline vfloat vadd(vfloat a, vfloat b)  { return vaddq_f32(a,b); }
+static inline vfloat vsub(vfloat a, vfloat b)  { return vsubq_f32(a,b); }
+static inline vfloat vmul(vfloat a, vfloat b)  { return vmulq_f32(a,b); }
+static inline vfloat vdiv(vfloat a, vfloat b)  { return vdivq_f32(a,b); }
+static inline vfloat vmin(vfloat a, vfloat b)  { return vminq_f32(a,b); }
+static inline vfloat vmax(vfloat a, vfloat b)  { return vmaxq_f32(a,b); }
+static inline vfloat vabs(vfloat a)            { return vabsq_f32(a); }
+static inline vfloat vmuladd(vfloat a, vfloat b, vfloat c) {
+    return vfmaq_f32(c,a,b);
+}
+static inline bool vanyless(vfloat a, vfloat b) {
+    return vmaxvq_u32(vcltq_f32(a,b)) != 0;
+}
+static inline bool vallless(vfloat a, vfloat b) {
+    return vminvq_u32(vcltq_f32(a,b)) != 0;
+}
+static inline vfloat vselless(vfloat a, vfloat b, vfloat x, vfloat y) {
+    return vbslq_f32(vcltq_f32(a,b), x, y);
+}
+static inline float vsum(vfloat a)             { return vaddvq_f32(a); }
+#else
+#include <algorithm>
+#include <cmath>
+#define SIMD_NAME "none"
+typedef float vfloat;
+static const int VSIZE=1; ///< Number of floats in a vector
+static inline vfloat vload(const float* p)     { return *p; }
+static inline void vstore(float* p, vfloat v)  { *p = v; }
+static inline vfloat vset(float v)             { return v; }
+static inline vfloat vadd(vfloat a, vfloat b)  { return a+b; }
+static inline vfloat vsub(vfloat a, vfloat b)  { return a-b; }
+static inline vfloat vmul(vfloat a, vfloat b)  { return a*b; }
+static inline vfloat vdiv(vfloat a, vfloat b)  { return a/b; }
+static inline vfloat vmin(vfloat a, vfloat b)  { return std::min(a,b); }
+static inline vfloat vmax(vfloat a, vfloat b)  { return std::max(a,b); }
+static inline vfloat vabs(vfloat a)            { return std::abs(a); }
+static inline vfloat vmuladd(vfloat a, vfloat b, vfloat c) { return a*b+c; }
+static inline bool vanyless(vfloat a, vfloat b) { return a<b; }
+static inline bool vallless(vfloat a, vfloat b) { return a<b; }
+static inline vfloat vselless(vfloat a, vfloat b, vfloat x, vfloat y) {
+    return (a<b)? x: y;
+}
+static inline float vsum(vfloat a)             { return a; }
+#endif
+
+
+/// Vectors of unsigned 16-bit integers, for fixed point kernels: 8 lanes with
+/// SSE2 (also when AVX is enabled) or NEON, 1 otherwise. Functions suffixed 15
+/// require values below 2^15. vmulhi16 keeps the high 16 bits of products.
+/// vaddpairs widens to a vector of 32-bit sums, adding pairs of lanes as
+/// pmaddwd does. vminlanes15 is the minimum of the lanes. All operations are
+/// exact.
+#if defined(__SSE2__) || defined(_M_X64)
+typedef __m128i vu16;
+typedef __m128i vu32;
+static const int VSIZE16=8; ///< Number of 16-bit integers in a vector
+static inline vu16 vload16(const unsigned short* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+static inline void vstore16(unsigned short* p, vu16 v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+}
+static inline vu16 vset16(unsigned short v) {
+    return _mm_set1_epi16(static_cast<short>(v));
+}
+static inline vu16 vadd16(vu16 a, vu16 b)   { return _mm_add_epi16(a,b); }
+static inline vu16 vsub16(vu16 a, vu16 b)   { return _mm_sub_epi16(a,b); }
+static inline vu16 vmulhi16(vu16 a, vu16 b) { return _mm_mulhi_epu16(a,b); }
+static inline vu16 vmin15(vu16 a, vu16 b)   { return _mm_min_epi16(a,b); }
+static inline vu16 vmax15(vu16 a, vu16 b)   { return _mm_max_epi16(a,b); }
+static inline vu16 vshl1_16(vu16 a)         { return _mm_slli_epi16(a,1); }
+static inline vu16 vshr1_16(vu16 a)         { return _mm_srli_epi16(a,1); }
+static inline vu32 vzero32()                { return _mm_setzero_si128(); }
+static inline vu32 vaddpairs15(vu32 s, vu16 a) {
+    return _mm_add_epi32(s, _mm_madd_epi16(a, _mm_set1_epi16(1)));
+}
+static inline unsigned int vsum32(vu32 a) {
+    a = _mm_add_epi32(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(1,0,3,2)));
+    a = _mm_add_epi32(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2,3,0,1)));
+    return static_cast<unsigned int>(_mm_cvtsi128_si32(a));
+}
+static inline unsigned short vminlanes15(vu16 a) {
+    a = _mm_min_epi16(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(1,0,3,2)));
+    a = _mm_min_epi16(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2,3,0,1)));
+    a = _mm_min_epi16(a, _mm_shufflelo_epi16(a, _MM_SHUFFLE(2,3,0,1)));
+    return static_cast<unsigned short>(_mm_cvtsi128_si32(a));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+typedef uint16x8_t vu16;
+typedef uint32x4_t vu32;
+static const int VSIZE16=8; ///< Number of 16-bit integers in a vector
+static inline vu16 vload16(const unsigned short* p) { return vld1q_u16(p); }
+static inline void vstore16(unsigned short* p, vu16 v) { vst1q_u16(p,v); }
+static inline vu16 vset16(unsigned short v) { return vdupq_n_u16(v); }
+static inline vu16 vadd16(vu16 a, vu16 b)   { return vaddq_u16(a,b); }
+static inline vu16 vsub16(vu16 a, vu16 b)   { return vsubq_u16(a,b); }
+static inline vu16 vmulhi16(vu16 a, vu16 b) {
+    return vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(a),
+                                              vget_low_u16(b)),16),
+                        vshrn_n_u32(vmull_high_u16(a,b),16));
+}
+static inline vu16 vmin15(vu16 a, vu16 b)   { return vminq_u16(a,b); }
+static inline vu16 vmax15(vu16 a, vu16 b)   { return vmaxq_u16(a,b); }
+static inline vu16 vshl1_16(vu16 a)         { return vshlq_n_u16(a,1); }
+static inline vu16 vshr1_16(vu16 a)         { return vshrq_n_u16(a,1); }
+static inline vu32 vzero32()                { return vdupq_n_u32(0); }
+static inline vu32 vaddpairs15(vu32 s, vu16 a) { return vpadalq_u16(s,a); }
+static inline unsigned int vsum32(vu32 a)   { return vaddvq_u32(a); }
+static inline unsigned short vminlanes15(vu16 a) { return vminvq_u16(a); }
+#else
+typedef unsigned short vu16;
+typedef unsigned int vu32;
+static const int VSIZE16=1; ///< Number of 16-bit integers in a vector
+static inline vu16 vload16(const unsigned short* p) { return *p; }
+static inline void vstore16(unsigned short* p, vu16 v) { *p = v; }
+static inline vu16 vset16(unsigned short v) { return v; }
+static inline vu16 vadd16(vu16 a, vu16 b)   { return static_cast<vu16>(a+b); }
+static inline vu16 vsub16(vu16 a, vu16 b)   { return static_cast<vu16>(a-b); }
+static inline vu16 vmulhi16(vu16 a, vu16 b) {
+    return static_cast<vu16>((static_cast<vu32>(a)*b)>>16);
+}
+static inline vu16 vmin15(vu16 a, vu16 b)   { return std::min(a,b); }
+static inline vu16 vmax15(vu16 a, vu16 b)   { return std::max(a,b); }
+static inline vu16 vshl1_16(vu16 a)         { return static_cast<vu16>(a<<1); }
+static inline vu16 vshr1_16(vu16 a)         { return static_cast<vu16>(a>>1); }
+static inline vu32 vzero32()                { return 0; }
+static inline vu32 vaddpairs15(vu32 s, vu16 a) { return s+a; }
+static inline unsigned int vsum32(vu32 a)   { return a; }
+static inline unsigned short vminlanes15(vu16 a) { return a; }
+#endif
+
+#endif
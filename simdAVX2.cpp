@@ -0,0 +1,20 @@
+/**
+ * @file simdAVX2.cpp
+ * @brief Vectorized kernels compiled for AVX2 (with FMA)
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Built with SIMD_DISPATCH only, with the flags of CMakeLists.txt
+#define SIMD_VARIANT kernelsAVX2
+#include "simdVariant.h"
@@ -0,0 +1,76 @@
+/**
+ * @file simdKernels.cpp
+ * @brief Vectorized kernels in several instruction sets, chosen at run time
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compiled with the flags of the whole library: the baseline variant
+#define SIMD_VARIANT kernelsBase
+#include "simdVariant.h"
+#include <iostream>
+
+#ifdef SIMD_DISPATCH
+const SimdKernels& kernelsAVX2();
+const SimdKernels& kernelsAVX512();
+#endif
+
+static const SimdKernels* current=0; ///< Selected kernels, 0 before first use
+
+/// Best variant supported by the CPU and the system (AVX state saved).
+static const SimdKernels* bestKernels() {
+#ifdef SIMD_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f"))
+        return &kernelsAVX512();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return &kernelsAVX2();
+#endif
+    return &kernelsBase();
+}
+
+/// Kernels of the instruction set in use: the best one supported by the CPU
+/// among those compiled (with CMake option SIMD_DISPATCH on x86-64, AVX2 and
+/// AVX-512 besides the baseline of the compiler flags), unless set by
+/// setSimd().
+const SimdKernels& simdKernels() {
+    if(! current)
+        current = bestKernels();
+    return *current;
+}
+
+/// Use the kernels of instruction set \a name: auto (the best), base (those
+/// of the compiler flags), avx2 or avx512. Return false if not compiled or
+/// not supported by the CPU. To be called before the computation.
+bool setSimd(const std::string& name) {
+    const SimdKernels* k=0;
+    if(name == "auto")
+        k = bestKernels();
+    else if(name == "base")
+        k = &kernelsBase();
+#ifdef SIMD_DISPATCH
+    else if(name=="avx2" && __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("fma"))
+        k = &kernelsAVX2();
+    else if(name=="avx512" && __builtin_cpu_supports("avx512f"))
+        k = &kernelsAVX512();
+#endif
+    if(! k) {
+        std::cerr << "Unavailable instruction set " << name
+                  << ", should be auto, base, avx2 or avx512 (if compiled and "
+                  << "supported by the CPU)" << std::endl;
+        return false;
+    }
+    current = k;
+    return true;
+}
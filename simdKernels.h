@@ -0,0 +1,78 @@
+/**
+ * @file simdKernels.h
+ * @brief Vectorized kernels in several instruction sets, chosen at run time
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMDKERNELS_H
+#define SIMDKERNELS_H
+
+#include <cstddef>
+#include <string>
+
+/// Kernels of the chain written with simd.h, compiled for one instruction
+/// set, see simdVariant.h.
+///
+/// The first four handle the pixels fitting in whole vectors and return the
+/// number done, the caller finishing the row with scalar code; their results
+/// are exact, the same for all instruction sets. sumWindow, indexed by
+/// ParamDisparity::Combination, is the vectorized sum of costCombined (option
+/// fastSum), whose order of summation depends on the size of vectors.
+/// laneWindow is the sum of build option FAST_MATH, in SUM_LANES lanes
+/// whatever the size of vectors, so that all instruction sets give the same
+/// result. dispWindow sums SUM_LANES consecutive disparities at once (option
+/// dispSum), each in its lane in the order of costCombined: it is exact.
+struct SimdKernels {
+    const char* name; ///< Instruction set
+    int vsize;        ///< Floats in a vector
+    /// Raw costs of costSpan (rawCost.cpp)
+    int (*costSpan)(const float* p1, const float* p2, ptrdiff_t plane,
+                    int channels, int n, float tauCol, float tauGrad,
+                    float alpha, float* out);
+    /// Gray levels of planar colors \a r, \a g, \a b, as rgb_to_gray
+    int (*grayRow)(const float* r, const float* g, const float* b, int n,
+                   float* out);
+    /// Centered differences out[x]=(g[x+1]-g[x-1])/2 from x=1, return end x
+    int (*gradRow)(const float* g, int n, float* out);
+    /// Winner-take-all step of costs \a e at disparity \a d: where
+    /// e[x]<best[x], best[x]=e[x] and arg[x]=d (not for NaN costs)
+    int (*argminRow)(const float* e, float d, int n, float* best, float* arg);
+    /// Sums of weights and weighted costs of \a rows rows of \a n taps of
+    /// windows \a wp, \a wq, \a dp of width \a dim, costs of row y at e[y],
+    /// added to \a num and \a den
+    void (*sumWindow[5])(const float* wp, const float* wq, const float* dp,
+                         const float* const* e, int rows, int dim, int n,
+                         float& num, float& den);
+    /// As sumWindow, tap x of a row being added to lane x%SUM_LANES of
+    /// \a num and \a den
+    void (*laneWindow[5])(const float* wp, const float* wq, const float* dp,
+                          const float* const* e, int rows, int dim, int n,
+                          float* num, float* den);
+    /// Sums of SUM_LANES disparities, lane k of \a num and \a den being the
+    /// one of disparity k: \a rows rows of \a dim taps of windows \a wp,
+    /// \a dp, the weights of q for tap x of row y at wq[y]+x*sq (ignored by
+    /// CombineLeft), the costs at e[y]+x*se, contiguous in disparity
+    void (*dispWindow[5])(const float* wp, const float* dp,
+                          const float* const* wq, ptrdiff_t sq,
+                          const float* const* e, ptrdiff_t se,
+                          int rows, int dim, float* num, float* den);
+};
+
+/// Lanes of SimdKernels::laneWindow, a multiple of all vector sizes
+static const int SUM_LANES=16;
+
+const SimdKernels& simdKernels();
+bool setSimd(const std::string& name);
+
+#endif
@@ -0,0 +1,231 @@
+/**
+ * @file simdVariant.h
+ * @brief Vectorized kernels for the instruction set of the translation unit
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Included once by each translation unit of a variant, after defining
+// SIMD_VARIANT as the name of the function returning its kernels. Everything
+// else has internal linkage and no inline function of the standard library is
+// used, so that no code compiled for an instruction set the CPU may lack is
+// shared with other translation units.
+
+#include "simdKernels.h"
+#include "simd.h"
+
+namespace {
+
+/// See SimdKernels::costSpan.
+int costSpan(const float* p1, const float* p2, ptrdiff_t plane, int channels,
+             int n, float tauCol, float tauGrad, float alpha, float* out) {
+    const vfloat vtauCol=vset(tauCol), vtauGrad=vset(tauGrad);
+    const vfloat valpha=vset(alpha), beta=vset(1-alpha);
+    const vfloat c=vset((float)channels);
+    int i=0;
+    for(; i+VSIZE<=n; i+=VSIZE) {
+        vfloat costColor = vset(0);
+        for(int k=0; k<channels; k++)
+            costColor = vadd(costColor, vabs(vsub(vload(p1+i+k*plane),
+                                                  vload(p2+i+k*plane))));
+        costColor = vmin(vtauCol, vdiv(costColor,c));
+        vfloat costGradient = vmin(vtauGrad,
+                                   vabs(vsub(vload(p1+i+channels*plane),
+                                             vload(p2+i+channels*plane))));
+        vstore(out+i, vadd(vmul(beta,costColor), vmul(valpha,costGradient)));
+    }
+    return i;
+}
+
+/// See SimdKernels::grayRow.
+int grayRow(const float* r, const float* g, const float* b, int n,
+            float* out) {
+    const vfloat fR=vset(6969), fG=vset(23434), fB=vset(2365),
+        f=vset(1.0f/32768);
+    int x=0;
+    for(; x+VSIZE<=n; x+=VSIZE)
+        vstore(out+x, vmul(vadd(vadd(vmul(fR,vload(r+x)), vmul(fG,vload(g+x))),
+                                vmul(fB,vload(b+x))), f));
+    return x;
+}
+
+/// See SimdKernels::gradRow.
+int gradRow(const float* g, int n, float* out) {
+    const vfloat half=vset(.5f);
+    int x=1;
+    for(; x+VSIZE<n; x+=VSIZE)
+        vstore(out+x, vmul(half, vsub(vload(g+x+1), vload(g+x-1))));
+    return x;
+}
+
+/// See SimdKernels::argminRow.
+int argminRow(const float* e, float d, int n, float* best, float* arg) {
+    const vfloat vd=vset(d);
+    int x=0;
+    for(; x+VSIZE<=n; x+=VSIZE) {
+        const vfloat c=vload(e+x), b=vload(best+x);
+        vstore(arg+x, vselless(c, b, vd, vload(arg+x)));
+        vstore(best+x, vselless(c, b, c, b));
+    }
+    return x;
+}
+
+/// Combinations of weights, as in disparity.cpp
+struct CombLeft {
+    static const bool hoisted=true;
+    static float comb(float w1, float)       { return w1; }
+    static vfloat vcomb(vfloat w1, vfloat)   { return w1; }
+};
+struct CombMax {
+    static const bool hoisted=false;
+    static float comb(float w1, float w2)     { return (w1<w2)? w2: w1; }
+    static vfloat vcomb(vfloat w1, vfloat w2) { return vmax(w1,w2); }
+};
+struct CombMin {
+    static const bool hoisted=false;
+    static float comb(float w1, float w2)     { return (w2<w1)? w2: w1; }
+    static vfloat vcomb(vfloat w1, vfloat w2) { return vmin(w1,w2); }
+};
+struct CombMult {
+    static const bool hoisted=true;
+    static float comb(float w1, float w2)     { return w1*w2; }
+    static vfloat vcomb(vfloat w1, vfloat w2) { return vmul(w1,w2); }
+};
+struct CombPlus {
+    static const bool hoisted=false;
+    static float comb(float w1, float w2)     { return w1+w2; }
+    static vfloat vcomb(vfloat w1, vfloat w2) { return vadd(w1,w2); }
+};
+
+/// See SimdKernels::sumWindow. Taps of a row are summed by vectors, the
+/// remaining ones in \a num and \a den, the vectors being added at the end.
+template <class Comb>
+void sumWindow(const float* wp, const float* wq, const float* dp,
+               const float* const* e, int rows, int dim, int n,
+               float& num, float& den) {
+    vfloat vnum=vset(0), vden=vset(0);
+    for(int y=0; y<rows; y++, wp+=dim, wq+=dim, dp+=dim) {
+        const float* ey=e[y];
+        int x=0;
+        for(; x+VSIZE<=n; x+=VSIZE) {
+            vfloat comb = Comb::vcomb(vload(wp+x),vload(wq+x));
+            if(! Comb::hoisted)
+                comb = vmul(vload(dp+x),comb);
+            vnum = vmuladd(comb, vload(ey+x), vnum);
+            vden = vadd(vden, comb);
+        }
+        for(; x<n; x++) {
+            float comb = Comb::hoisted? Comb::comb(wp[x],wq[x]):
+                                        dp[x]*Comb::comb(wp[x],wq[x]);
+            num+=comb*ey[x];
+            den+=comb;
+        }
+    }
+    num += vsum(vnum);
+    den += vsum(vden);
+}
+
+/// Vectors of the lanes of laneWindow
+static const int LANE_VECTORS=SUM_LANES/VSIZE;
+
+/// See SimdKernels::laneWindow. The taps past the last multiple of SUM_LANES
+/// of a row are copied to a block padded with null weights, whose products
+/// add exact zeros. Multiplications and additions are not fused, as in the
+/// scalar code.
+template <class Comb>
+void laneWindow(const float* wp, const float* wq, const float* dp,
+                const float* const* e, int rows, int dim, int n,
+                float* num, float* den) {
+    vfloat vnum[LANE_VECTORS], vden[LANE_VECTORS];
+    for(int k=0; k<LANE_VECTORS; k++) {
+        vnum[k] = vload(num+k*VSIZE);
+        vden[k] = vload(den+k*VSIZE);
+    }
+    const int m = n/SUM_LANES*SUM_LANES; // Taps in whole blocks
+    float tp[SUM_LANES], tq[SUM_LANES], td[SUM_LANES], te[SUM_LANES];
+    for(int i=0; i<SUM_LANES; i++)
+        tp[i] = tq[i] = td[i] = te[i] = 0;
+    for(int y=0; y<rows; y++, wp+=dim, wq+=dim, dp+=dim) {
+        const float* ey=e[y];
+        for(int x=0; x<n; x+=SUM_LANES) {
+            const float *p=wp+x, *q=wq+x, *w=dp+x, *c=ey+x;
+            if(x == m) { // Last block, padded
+                for(int i=0; i<n-m; i++) {
+                    tp[i]=p[i]; tq[i]=q[i]; td[i]=w[i]; te[i]=c[i];
+                }
+                p=tp; q=tq; w=td; c=te;
+            }
+            for(int k=0; k<LANE_VECTORS; k++) {
+                const int i=k*VSIZE;
+                vfloat comb = Comb::vcomb(vload(p+i),vload(q+i));
+                if(! Comb::hoisted)
+                    comb = vmul(vload(w+i),comb);
+                vnum[k] = vadd(vnum[k], vmul(comb,vload(c+i)));
+                vden[k] = vadd(vden[k], comb);
+            }
+        }
+    }
+    for(int k=0; k<LANE_VECTORS; k++) {
+        vstore(num+k*VSIZE, vnum[k]);
+        vstore(den+k*VSIZE, vden[k]);
+    }
+}
+
+/// See SimdKernels::dispWindow. The weight of p and the spatial weight of a
+/// tap are loaded once for all disparities, multiplications and additions not
+/// being fused, as in the scalar code.
+template <class Comb>
+void dispWindow(const float* wp, const float* dp,
+                const float* const* wq, ptrdiff_t sq,
+                const float* const* e, ptrdiff_t se,
+                int rows, int dim, float* num, float* den) {
+    vfloat vnum[LANE_VECTORS], vden[LANE_VECTORS];
+    for(int k=0; k<LANE_VECTORS; k++)
+        vnum[k] = vden[k] = vset(0);
+    for(int y=0; y<rows; y++, wp+=dim, dp+=dim) {
+        const float *q=wq[y], *c=e[y];
+        for(int x=0; x<dim; x++, q+=sq, c+=se) {
+            const vfloat p=vset(wp[x]), w=vset(dp[x]);
+            for(int k=0; k<LANE_VECTORS; k++) {
+                const int i=k*VSIZE;
+                vfloat comb = Comb::vcomb(p,vload(q+i));
+                if(! Comb::hoisted)
+                    comb = vmul(w,comb);
+                vnum[k] = vadd(vnum[k], vmul(comb,vload(c+i)));
+                vden[k] = vadd(vden[k], comb);
+            }
+        }
+    }
+    for(int k=0; k<LANE_VECTORS; k++) {
+        vstore(num+k*VSIZE, vnum[k]);
+        vstore(den+k*VSIZE, vden[k]);
+    }
+}
+
+/// Kernels of the variant
+const SimdKernels kernels = {
+    SIMD_NAME, VSIZE, costSpan, grayRow, gradRow, argminRow,
+    {sumWindow<CombLeft>, sumWindow<CombMax>, sumWindow<CombMin>,
+     sumWindow<CombMult>, sumWindow<CombPlus>},
+    {laneWindow<CombLeft>, laneWindow<CombMax>, laneWindow<CombMin>,
+     laneWindow<CombMult>, laneWindow<CombPlus>},
+    {dispWindow<CombLeft>, dispWindow<CombMax>, dispWindow<CombMin>,
+     dispWindow<CombMult>, dispWindow<CombPlus>}
+};
+
+}
+
+/// Kernels compiled for the instruction set of this translation unit.
+const SimdKernels& SIMD_VARIANT() {
+    return kernels;
+}
@@ -0,0 +1,106 @@
+/**
+ * @file stitch_bands.cpp
+ * @brief Assemble the bands of rows of a map computed with option --rows
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "writer.h"
+#include "cmdLine.h"
+#include "io_tiff.h"
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+
+/// Float TIFF bands, listed from top to bottom, stacked in a single TIFF.
+///
+/// The bands are read one at a time and their rows appended to the output,
+/// so that memory is the one of the largest band.
+int main(int argc, char *argv[]) {
+    CmdLine cmd; cmd.prefixDoc="    ";
+    TiffFormat tiff;
+    std::string compression("none");
+    int height=0;
+    cmd.add( make_option(0,compression,"tiff-compression")
+             .doc("compression of output map: none, lzw, deflate or zstd") );
+    cmd.add( make_option(0,tiff.predictor,"tiff-predictor")
+             .doc("floating point predictor of compression") );
+    cmd.add( make_option(0,tiff.rowsPerStrip,"tiff-strip")
+             .doc("rows per strip of output map (0: libtiff default)") );
+    cmd.add( make_option(0,tiff.tileSize,"tiff-tile")
+             .doc("tiles of output map, multiple of 16 (0: strips)") );
+    cmd.add( make_option('H',height,"height")
+             .doc("expected height of the map, 0 for no check") );
+
+    try {
+        cmd.process(argc, argv);
+    } catch(std::string str) {
+        std::cerr << "Error: " << str << std::endl<<std::endl;
+        argc=1; // To display usage
+    }
+    if(argc<3) {
+        std::cerr << "Usage: "<< argv[0]
+                  << " [options] out.tif band1.tif [band2.tif ...]\n"
+                  << "Options:\n" << cmd;
+        return 1;
+    }
+    if(!tiff.setCompression(compression) || !tiff.check())
+        return 1;
+
+    // Sizes of bands, checked before writing anything
+    std::vector<size_t> rows(argc-2);
+    size_t w=0, h=0;
+    for(int i=2; i<argc; i++) {
+        size_t wi, hi;
+        float* pix = io_tiff_read_f32_gray(argv[i], &wi, &hi);
+        if(! pix) {
+            std::cerr << "Unable to read file " << argv[i] << " as TIFF"
+                      << std::endl;
+            return 1;
+        }
+        std::free(pix);
+        if(i>2 && wi!=w) {
+            std::cerr << "Band " << argv[i] << " has width " << wi
+                      << " instead of " << w << std::endl;
+            return 1;
+        }
+        w = wi;
+        h += rows[i-2] = hi;
+    }
+    if(height>0 && h!=static_cast<size_t>(height)) {
+        std::cerr << "The bands have " << h << " rows instead of " << height
+                  << std::endl;
+        return 1;
+    }
+
+    io_tiff_stream* out = io_tiff_stream_open(argv[1], w, h, tiff.compression,
+                                              tiff.predictor,
+                                              tiff.rowsPerStrip,
+                                              tiff.tileSize);
+    bool ok = (out != 0);
+    for(int i=2; ok && i<argc; i++) {
+        size_t wi, hi;
+        float* pix = io_tiff_read_f32_gray(argv[i], &wi, &hi);
+        ok = (pix && wi==w && hi==rows[i-2]);
+        for(size_t y=0; ok && y<hi; y++)
+            ok = (io_tiff_stream_write_f32(out, pix+y*w) == 0);
+        std::free(pix);
+    }
+    if(out && io_tiff_stream_close(out)!=0)
+        ok = false;
+    if(! ok) {
+        std::cerr << "Unable to write file " << argv[1] << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,314 @@
+/**
+ * @file stream.cpp
+ * @brief Disparity of images larger than memory, computed by bands of rows
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stream.h"
+#include "disparity.h"
+#include "occlusion.h"
+#include "rawCost.h"
+#include "image.h"
+#include "io_png.h"
+#include "io_tiff.h"
+#include "nan.h"
+#include "pfm.h"
+#include "timing.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+/// Input images and output maps of disparityStream, closed at destruction.
+struct Streams {
+    io_png_stream* in[2];
+    io_tiff_stream* out[3];
+    Streams() { in[0]=in[1]=0; out[0]=out[1]=out[2]=0; }
+    ~Streams() { close(); }
+    bool close();
+};
+
+/// Close all files, return false if an output map could not be completed.
+bool Streams::close() {
+    bool ok=true;
+    for(int i=0; i<2; i++) {
+        io_png_stream_close(in[i]);
+        in[i] = 0;
+    }
+    for(int i=0; i<3; i++) {
+        if(io_tiff_stream_close(out[i]) != 0)
+            ok = false;
+        out[i] = 0;
+    }
+    return ok;
+}
+
+/// Rows of margin around a band for the results in the band to be exact.
+///
+/// The aggregation window reaches param.radius rows, plus the window of the
+/// census or rank transform, and the band of rows of image 2 matched with a
+/// row of image 1. The post-processing reaches the radius of its filter, plus
+/// one row for the median of the guidance.
+int bandHalo(const ParamDisparity& paramD, const ParamOcclusion& paramOcc) {
+    int halo = paramD.radius;
+    if(paramD.rawCost != ParamDisparity::CostADGrad) {
+        const int census=RawCostCensus::RADIUS, rank=RawCostRank::RADIUS;
+        halo += std::max(census, rank); // Copies: members are not defined
+    }
+    halo += std::abs(paramD.offsetY)+paramD.searchY; // Rows of image 2
+    if(paramOcc.support_weights && paramOcc.filler==ParamOcclusion::FillMedian)
+        halo += paramD.radius;
+    else
+        halo += paramOcc.median_radius;
+    return halo+1;
+}
+
+/// Image of rows [y0,y1) read from \a in, \a band holding rows from \a top.
+///
+/// The rows of \a band are reused, the others are read in sequence from
+/// \a in, whose next row is the one after \a band. Return an empty image in
+/// case of read error.
+static Image slideBand(io_png_stream* in, Image band, int top,
+                       int y0, int y1) {
+    const int w=band.width();
+    Image next(w, y1-y0, 3, Image::Planar);
+    const ptrdiff_t sc = &next(0,0,1)-&next(0,0,0);
+    int y=y0;
+    for(; y<top+band.height(); y++)
+        for(int k=0; k<3; k++) {
+            const float* row = &band(0,y-top,k);
+            std::copy(row, row+w, &next(0,y-y0,k));
+        }
+    for(; y<y1; y++)
+        if(io_png_stream_read_f32_rgb(in, &next(0,y-y0), sc) != 0)
+            return Image();
+    return next;
+}
+
+/// Write rows [y0,y1) of \a disp in \a out, values outside [dMin,dMax] being
+/// NaN as in save_disparity. A null \a out is ignored.
+static bool writeRows(io_tiff_stream* out, const Image& disp, int y0, int y1,
+                      int dMin, int dMax) {
+    if(! out)
+        return true;
+    const float vMin=static_cast<float>(dMin), vMax=static_cast<float>(dMax);
+    std::vector<float> row(disp.width());
+    for(int y=y0; y<y1; y++) {
+        for(int x=0; x<disp.width(); x++) {
+            float v = disp(x,y);
+            row[x] = (is_number(v) && vMin<=v && v<=vMax)? v: NaN;
+        }
+        if(io_tiff_stream_write_f32(out, &row[0]) != 0)
+            return false;
+    }
+    return true;
+}
+
+/// Checkpoint of disparityStream in directory \a dir: file of band \a n, or
+/// the manifest if \a n<0.
+static std::string checkpointFile(const std::string& dir, int n) {
+    std::ostringstream name;
+    name << dir << '/';
+    if(n < 0)
+        name << "progress.txt";
+    else
+        name << "band_" << n << ".pfm";
+    return name.str();
+}
+
+/// Open the checkpoint of \a files with first line \a header. With resume,
+/// the bands listed in the manifest are set in \a done, the manifest having
+/// to begin with \a header; otherwise, or if there is no manifest, a new one
+/// is written.
+static bool openCheckpoint(const StreamFiles& files, const std::string& header,
+                           std::vector<bool>& done) {
+    const std::string name = checkpointFile(files.checkpoint, -1);
+    std::ifstream in(name.c_str());
+    if(files.resume && in) {
+        std::string line;
+        if(!std::getline(in, line) || line!=header) {
+            std::cerr << "Error: checkpoint " << name << " is of another job"
+                      << std::endl;
+            return false;
+        }
+        int n;
+        while(in >> n)
+            if(0<=n && n<static_cast<int>(done.size()))
+                done[n] = true;
+        return true;
+    }
+    std::ofstream out(name.c_str());
+    out << header << std::endl;
+    if(! out)
+        std::cerr << "Error writing file " << name << std::endl;
+    return static_cast<bool>(out);
+}
+
+/// Save rows \a rows, w x 3n of the three maps, of band \a n in the
+/// checkpoint directory \a dir, then add the band to the manifest. The file
+/// is written under a temporary name and renamed when complete.
+static bool saveBand(const std::string& dir, int n,
+                     const std::vector<float>& rows, int w) {
+    const std::string name = checkpointFile(dir, n), tmp = name+".tmp";
+    const int h = static_cast<int>(rows.size()/w);
+    bool ok = save_pfm(tmp.c_str(), &rows[0], w, h) &&
+        std::rename(tmp.c_str(), name.c_str())==0;
+    if(ok) {
+        std::ofstream out(checkpointFile(dir,-1).c_str(), std::ios::app);
+        out << n << std::endl;
+        ok = static_cast<bool>(out);
+    }
+    if(! ok)
+        std::cerr << "Error writing checkpoint " << name << std::endl;
+    return ok;
+}
+
+/// Copy rows [y0,y1) of \a disp to \a out, contiguous.
+static void copyRows(const Image& disp, int y0, int y1, float* out) {
+    for(int y=y0; y<y1; y++)
+        for(int x=0; x<disp.width(); x++)
+            *out++ = disp(x,y);
+}
+
+/// Disparity pipeline of main on images too large for memory.
+///
+/// The images are read by bands of \a bandRows rows, each extended by a halo
+/// so that the disparity, left-right check and occlusion filling of its rows
+/// are the same as on the whole images. The rows of each band are then
+/// appended to the striped TIFF \a files, so that memory is proportional to
+/// the band height. Only adaptive weights on the full range are supported.
+/// The filled map is not computed if its file name is empty; \a sense is the
+/// one of fillMaxX (0) or fillMinX (1). With a checkpoint directory, the
+/// rows of each band are also saved there and listed in its manifest; on
+/// resume, the listed bands are read from it instead of being computed. The
+/// checkpoint is removed when the maps are complete.
+bool disparityStream(const char* file1, const char* file2, int dMin, int dMax,
+                     const ParamDisparity& paramD,
+                     const ParamOcclusion& paramOcc, int sense, int bandRows,
+                     const StreamFiles& files, const TiffFormat& format) {
+    Streams st;
+    size_t w1=0, h1=0, w2=0, h2=0;
+    st.in[0] = io_png_stream_open(file1, &w1, &h1);
+    st.in[1] = io_png_stream_open(file2, &w2, &h2);
+    if(!st.in[0] || !st.in[1]) {
+        std::cerr << "Unable to read file " << (st.in[0]? file2: file1)
+                  << " as PNG" << std::endl;
+        return false;
+    }
+    if(w1!=w2 || h1!=h2) {
+        std::cerr << "The images must have the same size!" << std::endl;
+        return false;
+    }
+    const int w=static_cast<int>(w1), h=static_cast<int>(h1);
+    const std::string* names[3] = {&files.disparity, &files.occlusion,
+                                   &files.filled};
+    for(int i=0; i<3; i++)
+        if(! names[i]->empty() &&
+           !(st.out[i] = io_tiff_stream_open(names[i]->c_str(), w, h,
+                                             format.compression,
+                                             format.predictor,
+                                             format.rowsPerStrip,
+                                             format.tileSize)))
+            return false;
+
+    const int halo = bandHalo(paramD, paramOcc);
+    const int bands = (h+bandRows-1)/bandRows;
+    std::vector<bool> done(bands, false); // Bands read from checkpoint
+    if(! files.checkpoint.empty()) {
+        std::ostringstream header;
+        header << "stream " << file1 << ' ' << file2 << ' ' << w << ' ' << h
+               << ' ' << dMin << ' ' << dMax << ' ' << bandRows << ' ' << halo;
+        if(! openCheckpoint(files, header.str(), done))
+            return false;
+    }
+    Image im1(w,0,3,Image::Planar), im2(w,0,3,Image::Planar);
+    int top=0; // First row of im1 and im2 in the images
+    for(int y0=0, n=0; y0<h; y0+=bandRows, n++) {
+        const int y1=std::min(h,y0+bandRows);
+        const int b0=std::max(0,y0-halo), b1=std::min(h,y1+halo);
+        im1 = slideBand(st.in[0], im1, top, b0, b1);
+        im2 = slideBand(st.in[1], im2, top, b0, b1);
+        top = b0;
+        if(im1.height()==0 || im2.height()==0) {
+            std::cerr << "Error reading rows of images" << std::endl;
+            return false;
+        }
+
+        const int rows=y1-y0;
+        if(done[n]) {
+            MappedPFM band;
+            if(!band.open(checkpointFile(files.checkpoint,n).c_str()) ||
+               band.image().width()!=w || band.image().height()!=3*rows) {
+                std::cerr << "Error reading checkpoint "
+                          << checkpointFile(files.checkpoint,n) << std::endl;
+                return false;
+            }
+            const Image& b = band.image();
+            if(!writeRows(st.out[0], b, 0, rows, dMin, dMax) ||
+               !writeRows(st.out[1], b, rows, 2*rows, dMin, dMax) ||
+               !writeRows(st.out[2], b, 2*rows, 3*rows, dMin, dMax))
+                return false;
+            continue;
+        }
+        std::vector<float> saved(files.checkpoint.empty()? 0: 3*w*rows);
+
+        Image disp1(w,b1-b0), disp2(w,b1-b0);
+        disp1.fill(static_cast<float>(dMin-1));
+        disp2.fill(static_cast<float>(dMin-1));
+        disparityAW(im1, im2, dMin, dMax, paramD, disp1, disp2);
+        if(computationCancelled()) {
+            st.close();
+            std::cerr << "Cancelled" << std::endl;
+            return false;
+        }
+        bool ok = writeRows(st.out[0], disp1, y0-b0, y1-b0, dMin, dMax);
+        if(! saved.empty())
+            copyRows(disp1, y0-b0, y1-b0, &saved[0]);
+
+        OcclusionMask occ(disp1, dMin, dMax);
+        detect_occlusion(disp1, disp2, paramOcc.tol_disp, occ);
+        occ.apply(disp1, static_cast<float>(dMin-1));
+        ok = ok && writeRows(st.out[1], disp1, y0-b0, y1-b0, dMin, dMax);
+        if(! saved.empty())
+            copyRows(disp1, y0-b0, y1-b0, &saved[w*rows]);
+
+        if(st.out[2]) {
+            if(sense == 0)
+                disp1.fillMaxX(occ, static_cast<float>(dMin));
+            else
+                disp1.fillMinX(occ, static_cast<float>(dMin));
+            if(paramOcc.support_weights &&
+               paramOcc.filler==ParamOcclusion::FillMedian)
+                fillOcclusionAW(disp1, im1, occ, dMin, dMax, paramD);
+            else
+                fill_occlusion(disp1, im1.median(1), occ, dMin, dMax,
+                               paramOcc);
+            ok = ok && writeRows(st.out[2], disp1, y0-b0, y1-b0, dMin, dMax);
+        }
+        if(! saved.empty()) {
+            copyRows(disp1, y0-b0, y1-b0, &saved[2*w*rows]);
+            ok = ok && saveBand(files.checkpoint, n, saved, w);
+        }
+        if(! ok)
+            return false;
+    }
+    if(! st.close())
+        return false;
+    for(int n=0; !files.checkpoint.empty() && n<=bands; n++) // Job complete
+        std::remove(checkpointFile(files.checkpoint, (n<bands)? n: -1).c_str());
+    return true;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file stream.h
+ * @brief Disparity of images larger than memory, computed by bands of rows
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <string>
+struct ParamDisparity;
+struct ParamOcclusion;
+struct TiffFormat;
+
+/// Output maps of disparityStream
+struct StreamFiles {
+    StreamFiles(): resume(false) {}
+    std::string disparity; ///< Disparity map of im1
+    std::string occlusion; ///< After left-right check
+    std::string filled;    ///< Occlusions filled, none if empty
+    std::string checkpoint; ///< Directory of finished bands, none if empty
+    bool resume;           ///< Bands of checkpoint not computed again
+};
+
+int bandHalo(const ParamDisparity& paramD, const ParamOcclusion& paramOcc);
+bool disparityStream(const char* file1, const char* file2, int dMin, int dMax,
+                     const ParamDisparity& paramD,
+                     const ParamOcclusion& paramOcc, int sense, int bandRows,
+                     const StreamFiles& files, const TiffFormat& format);
+
+#endif
@@ -0,0 +1,360 @@
+/**
+ * @file synth_pair.cpp
+ * @brief Synthetic rectified stereo pairs with ground truth disparity
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cmdLine.h"
+#include "io_png.h"
+#include "io_tiff.h"
+#include "nan.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+/// Pseudo-random generator, for reproducible scenes
+static unsigned int lcg(unsigned int& seed) {
+    seed = seed*1664525u + 1013904223u;
+    return seed>>8;
+}
+
+/// Pseudo-random value of the integer triple (a,b,c), for textures evaluated
+/// anywhere without storing them.
+static unsigned int hash(unsigned int a, unsigned int b, unsigned int c) {
+    unsigned int h = a*0x9E3779B1u ^ b*0x85EBCA77u ^ c*0xC2B2AE3Du;
+    h ^= h>>16; h *= 0x7FEB352Du;
+    h ^= h>>15; h *= 0x846CA68Bu;
+    return h ^ (h>>16);
+}
+
+/// Fronto-parallel rectangle of the scene, coordinates in image 1
+struct Plane {
+    int x0, x1, y0, y1; ///< Pixels [x0,x1)x[y0,y1)
+    int d;              ///< Disparity
+    unsigned int id;    ///< Seed of its texture
+};
+
+/// Order of planes from back to front, by distance of disparity to the far
+/// end of the range
+class FartherFirst {
+public:
+    explicit FartherFirst(int dFar): far(dFar) {}
+    bool operator()(const Plane& p, const Plane& q) const {
+        return std::abs(p.d-far) < std::abs(q.d-far);
+    }
+private:
+    int far;
+};
+
+/// Scene seen by the pair: a slanted background plane behind rectangles at
+/// constant disparities.
+///
+/// Nearer objects have disparities closer to the end of the range of larger
+/// magnitude (dmin for the negative disparities of tsukuba). The background
+/// spans the farthest quarter of the range, from left to right, and the
+/// planes the rest. Each row of an image is rendered independently, the
+/// planes painted from back to front, so that no image is held in memory.
+class Scene {
+public:
+    Scene(int w, int h, int dMin, int dMax, unsigned int seed,
+          bool smooth, int dot, double occlusion);
+    int width() const { return w; }
+    int planes() const { return static_cast<int>(rects.size()); }
+    void colors(int image, int y, unsigned char* row) const;
+    void truth(int y, float* disp, unsigned char* visible) const;
+private:
+    int w, h;
+    float a, b;                ///< Disparity of background a+b*x
+    unsigned int bgId;         ///< Seed of texture of background
+    bool smooth;               ///< Bilinear texture instead of dots
+    int dot;                   ///< Size of dots, or step of smooth texture
+    std::vector<Plane> rects;  ///< From back to front
+
+    float texture(unsigned int id, float u, int y, int k) const;
+    void layers(int image, int y, std::vector<int>& layer) const;
+    double sampleOcclusion() const;
+    /// Disparity of layer \a l (0 background, i+1 for rects[i]) at \a x
+    float disparity(int l, int x) const { return l? rects[l-1].d: a+b*x; }
+};
+
+/// Random scene of size \a w x \a h with disparities in [dMin,dMax].
+///
+/// Planes are added until the occluded pixels of image 1 they produce, the
+/// height of a plane by its jump of disparity over the background, plus the
+/// columns of the background out of image 2, reach a goal. This estimate
+/// ignores the planes hiding each other: the fraction is then measured on
+/// sample rows and the goal raised in proportion, with smaller planes, until
+/// \a occlusion is reached. The exact fraction is given by truth().
+Scene::Scene(int w_, int h_, int dMin, int dMax, unsigned int seed,
+             bool smooth_, int dot_, double occlusion)
+: w(w_), h(h_), smooth(smooth_), dot(dot_) {
+    const bool negative = (std::abs(dMin) >= std::abs(dMax));
+    const int dFar = negative? dMax: dMin, dNear = negative? dMin: dMax;
+    const float quarter = (dNear-dFar)/4.0f;
+    a = static_cast<float>(dFar);
+    b = quarter/w;
+    bgId = lcg(seed);
+    const int dBack = dFar + static_cast<int>(quarter); // Nearest background
+    const int n = std::abs(dNear-dBack)+1;
+    double occluded = h*std::min<double>(w, std::abs(a+b*w/2));
+    double goal = occlusion*w*h;
+    const int maxPlanes = 1<<16;
+    for(int pass=0; pass<8; pass++) {
+        while(dNear!=dFar && occluded<goal && planes()<maxPlanes) {
+            Plane p;
+            const int sw=w/(pass+1), sh=h/(pass+1); // Smaller at each pass
+            const int pw = sw/16 + static_cast<int>(lcg(seed)%(sw/4+1)) + 1;
+            const int ph = sh/16 + static_cast<int>(lcg(seed)%(sh/4+1)) + 1;
+            p.x0 = static_cast<int>(lcg(seed)%w) - pw/2;
+            p.y0 = static_cast<int>(lcg(seed)%h) - ph/2;
+            p.x1 = std::min(w, p.x0+pw);
+            p.y1 = std::min(h, p.y0+ph);
+            p.x0 = std::max(0, p.x0);
+            p.y0 = std::max(0, p.y0);
+            const int i = static_cast<int>(lcg(seed)%n);
+            p.d = negative? dBack-i: dBack+i;
+            p.id = lcg(seed);
+            const float jump = std::abs(p.d-(a+b*p.x0));
+            occluded += (p.y1-p.y0)*std::min<double>(p.x1-p.x0, jump);
+            rects.push_back(p);
+        }
+        // Back to front, the order of generation between planes of same depth
+        std::stable_sort(rects.begin(), rects.end(), FartherFirst(dFar));
+        const double f = sampleOcclusion();
+        if(f>=occlusion || dNear==dFar || planes()>=maxPlanes)
+            break;
+        goal = occluded*(f>0? occlusion/f: 2);
+    }
+}
+
+/// Fraction of occluded pixels of image 1 in at most 64 rows, evenly spaced.
+double Scene::sampleOcclusion() const {
+    const int rows = std::min(h, 64);
+    std::vector<float> disp(w);
+    std::vector<unsigned char> visible(w);
+    double occluded=0;
+    for(int i=0; i<rows; i++) {
+        truth((2*i+1)*h/(2*rows), &disp[0], &visible[0]);
+        occluded += std::count(visible.begin(), visible.end(), 0);
+    }
+    return occluded/(static_cast<double>(w)*rows);
+}
+
+/// Channel \a k of the texture \a id at column \a u of image 1 and row \a y:
+/// random dots of dot x dot pixels, or random values at this step
+/// interpolated bilinearly.
+float Scene::texture(unsigned int id, float u, int y, int k) const {
+    const float s = u/dot;
+    const int i = static_cast<int>(std::floor(s));
+    if(! smooth)
+        return static_cast<float>(hash(id+k, i, y/dot) & 0xFF);
+    const float t = static_cast<float>(y)/dot;
+    const int j = y/dot;
+    const float fx=s-i, fy=t-j;
+    float v=0;
+    for(int dy=0; dy<2; dy++)
+        for(int dx=0; dx<2; dx++)
+            v += (dx? fx: 1-fx) * (dy? fy: 1-fy) *
+                (hash(id+k, i+dx, j+dy) & 0xFF);
+    return v;
+}
+
+/// Layer seen at each pixel of row \a y of \a image (1 or 2), 0 for the
+/// background and i+1 for rects[i].
+void Scene::layers(int image, int y, std::vector<int>& layer) const {
+    layer.assign(w, 0);
+    for(size_t i=0; i<rects.size(); i++) {
+        const Plane& p = rects[i];
+        if(y<p.y0 || y>=p.y1)
+            continue;
+        const int shift = (image==1)? 0: p.d;
+        const int x0=std::max(0,p.x0+shift), x1=std::min(w,p.x1+shift);
+        for(int x=x0; x<x1; x++)
+            layer[x] = static_cast<int>(i)+1;
+    }
+}
+
+/// Row \a y of \a image (1 or 2) as RGB colors in \a row. Image 2 at x shows
+/// the point of image 1 at x-d, at the inverse of the background disparity
+/// for it.
+void Scene::colors(int image, int y, unsigned char* row) const {
+    std::vector<int> layer;
+    layers(image, y, layer);
+    for(int x=0; x<w; x++, row+=3) {
+        const int l = layer[x];
+        float u = static_cast<float>(x);
+        if(image != 1)
+            u = l? u-rects[l-1].d: (u-a)/(1+b);
+        const unsigned int id = l? rects[l-1].id: bgId;
+        for(int k=0; k<3; k++)
+            row[k] = static_cast<unsigned char>(texture(id, u, y, k)+0.5f);
+    }
+}
+
+/// Ground truth of row \a y of image 1: disparity and whether the pixel is
+/// visible in image 2, the same layer being visible at x+d.
+void Scene::truth(int y, float* disp, unsigned char* visible) const {
+    std::vector<int> layer1, layer2;
+    layers(1, y, layer1);
+    layers(2, y, layer2);
+    for(int x=0; x<w; x++) {
+        const int l = layer1[x];
+        disp[x] = disparity(l, x);
+        const int x2 = static_cast<int>(std::floor(x+disp[x]+0.5f));
+        visible[x] = (0<=x2 && x2<w && layer2[x2]==l);
+    }
+}
+
+/// Source of the rows of a PNG image of the scene
+struct SceneImage {
+    const Scene* scene;
+    int image; ///< 1 or 2, 0 for the mask of visible pixels
+};
+
+/// Row \a y of \a ctx, a SceneImage. Rows are independent, so that they can
+/// be filled by concurrent threads.
+static int sceneRow(void* ctx, size_t y, unsigned char* row) {
+    const SceneImage& s = *static_cast<const SceneImage*>(ctx);
+    if(s.image) {
+        s.scene->colors(s.image, static_cast<int>(y), row);
+        return 0;
+    }
+    std::vector<float> disp(s.scene->width());
+    s.scene->truth(static_cast<int>(y), &disp[0], row);
+    for(int x=0; x<s.scene->width(); x++)
+        row[x] = row[x]? 255: 128; // As masks of Middlebury 2014
+    return 0;
+}
+
+/// Write \a image of \a scene of size \a w x \a h in PNG file \a fileName.
+static bool writeImage(const std::string& fileName, const Scene& scene,
+                       int image, size_t w, size_t h, int level, int threads) {
+    SceneImage s = {&scene, image};
+    if(io_png_write_u8_rows(fileName.c_str(), sceneRow, &s, w, h,
+                            image? 3: 1, level, IO_PNG_FILTER_DEFAULT,
+                            threads>1? threads: 0) != 0) {
+        std::cerr << "Unable to write file " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Write the ground truth disparity of image 1 in float TIFF \a fileName,
+/// NaN at occluded pixels if \a nonocc, and count the occluded pixels.
+static bool writeTruth(const std::string& fileName, const Scene& scene,
+                       size_t w, size_t h, bool nonocc, double& occluded) {
+    io_tiff_stream* out = io_tiff_stream_open(fileName.c_str(), w, h,
+                                              0, 0, 0, 0);
+    bool ok = (out != 0);
+    std::vector<float> disp(w);
+    std::vector<unsigned char> visible(w);
+    occluded = 0;
+    for(size_t y=0; ok && y<h; y++) {
+        scene.truth(static_cast<int>(y), &disp[0], &visible[0]);
+        for(size_t x=0; x<w; x++)
+            if(! visible[x]) {
+                occluded++;
+                if(nonocc)
+                    disp[x] = NaN;
+            }
+        ok = (io_tiff_stream_write_f32(out, &disp[0]) == 0);
+    }
+    if(out && io_tiff_stream_close(out)!=0)
+        ok = false;
+    if(! ok)
+        std::cerr << "Unable to write file " << fileName << std::endl;
+    return ok;
+}
+
+/// Synthetic rectified pair with its ground truth, of any size and range.
+///
+/// Writes prefix_l.png, prefix_r.png, prefix_gt.tif (disparity of image 1)
+/// and prefix_occ.png (255 visible, 128 occluded in image 2), and prints on
+/// stdout the line of the pair for a suite of regress.
+int main(int argc, char *argv[]) {
+    CmdLine cmd; cmd.prefixDoc="    ";
+    int seed=1, dot=2, level=-1, threads=1;
+    double occlusion=0.05;
+    std::string textureName("dots");
+    bool nonocc=false;
+    cmd.add( make_option('s',seed,"seed")
+             .doc("seed of the random scene") );
+    cmd.add( make_option('t',textureName,"texture")
+             .doc("texture of planes: dots (random) or smooth (bilinear)") );
+    cmd.add( make_option(0,dot,"dot")
+             .doc("size of dots, or step of smooth texture, in pixels") );
+    cmd.add( make_option('o',occlusion,"occlusion")
+             .doc("target fraction of pixels of image 1 occluded in image 2"));
+    cmd.add( make_option(0,nonocc,"nonocc")
+             .doc("ground truth NaN (unknown) at occluded pixels") );
+    cmd.add( make_option('l',level,"level")
+             .doc("zlib compression level 0-9, -1 for default") );
+    cmd.add( make_option('j',threads,"threads")
+             .doc("parallel compression of PNG images if >1") );
+
+    try {
+        cmd.process(argc, argv);
+    } catch(std::string str) {
+        std::cerr << "Error: " << str << std::endl<<std::endl;
+        argc=0; // To display usage
+    }
+    if(argc != 6) {
+        std::cerr << "Usage: "<< argv[0]
+                  << " [options] width height dmin dmax prefix\n"
+                  << "Options:\n" << cmd;
+        return 1;
+    }
+
+    int w=0, h=0, dMin=0, dMax=-1;
+    if(! ((std::istringstream(argv[1])>>w).eof() &&
+          (std::istringstream(argv[2])>>h).eof() &&
+          (std::istringstream(argv[3])>>dMin).eof() &&
+          (std::istringstream(argv[4])>>dMax).eof()) ||
+       w<1 || h<1 || dMin>dMax) {
+        std::cerr << "Error: width and height must be positive integers, "
+                  << "dmin<=dmax integers" << std::endl;
+        return 1;
+    }
+    if(textureName!="dots" && textureName!="smooth") {
+        std::cerr << "Error: texture should be dots or smooth" << std::endl;
+        return 1;
+    }
+    if(dot<1 || occlusion<0 || occlusion>=1 || level<-1 || level>9 ||
+       threads<1) {
+        std::cerr << "Error: dot and threads must be positive, occlusion in "
+                  << "[0,1) and level in [-1,9]" << std::endl;
+        return 1;
+    }
+
+    const Scene scene(w, h, dMin, dMax, static_cast<unsigned int>(seed),
+                      textureName=="smooth", dot, occlusion);
+    const std::string prefix(argv[5]);
+    double occluded=0;
+    if(!writeImage(prefix+"_l.png", scene, 1, w, h, level, threads) ||
+       !writeImage(prefix+"_r.png", scene, 2, w, h, level, threads) ||
+       !writeImage(prefix+"_occ.png", scene, 0, w, h, level, threads) ||
+       !writeTruth(prefix+"_gt.tif", scene, w, h, nonocc, occluded))
+        return 1;
+
+    const std::string name = prefix.substr(prefix.find_last_of('/')+1);
+    std::printf("# %dx%d, disparities [%d,%d], %d planes, %.2f%% occluded\n",
+                w, h, dMin, dMax, scene.planes(),
+                100*occluded/(static_cast<double>(w)*h));
+    std::printf("%s %s_l.png %s_r.png %d %d %s_gt.tif 1\n", name.c_str(),
+                prefix.c_str(), prefix.c_str(), dMin, dMax, prefix.c_str());
+    return 0;
+}
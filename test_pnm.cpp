@@ -0,0 +1,84 @@
+/**
+ * @file test_pnm.cpp
+ * @brief Test of the samples of 16-bit PPM/PGM and PFM images
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pnm.h"
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+/// File of header \a header followed by \a n bytes of \a pix.
+static std::vector<unsigned char> file(const std::string& header,
+                                       const void* pix, size_t n) {
+    std::vector<unsigned char> f(header.begin(), header.end());
+    const unsigned char* p = static_cast<const unsigned char*>(pix);
+    f.insert(f.end(), p, p+n);
+    return f;
+}
+
+/// Load file \a f of one row and compare its samples with the \a n of \a v,
+/// in all channels.
+static bool check(const char* name, const std::vector<unsigned char>& f,
+                  const float* v, int n) {
+    Image im;
+    if(!load_pnm(&f[0], f.size(), im) || im.width()!=n || im.height()!=1 ||
+       im.channels()!=3) {
+        std::cerr << name << ": not loaded" << std::endl;
+        return false;
+    }
+    bool ok=true;
+    for(int x=0; x<n; x++)
+        for(int c=0; c<3; c++)
+            if(im(x,0,c) != v[x]) {
+                std::cerr << name << ": sample " << x << " is " << im(x,0,c)
+                          << " instead of " << v[x] << std::endl;
+                ok = false;
+            }
+    return ok;
+}
+
+/// Samples of 16-bit PGM are scaled to [0,255] by the maximum value, those
+/// of PFM are clamped to [0,255], so that they index the table of the color
+/// weights.
+int main() {
+    bool ok=true;
+
+    // 16-bit PGM, big endian, maximum 65535
+    const unsigned char pgm[] = {0,0, 0x80,0x00, 0xff,0xff, 0x01,0x01};
+    const float vPgm[] = {0, 128, 255, 1};
+    std::vector<unsigned char> f = file("P5 4 1 65535\n", pgm, sizeof(pgm));
+    ok = check("PGM 65535", f, vPgm, 4) && ok;
+
+    // 16-bit PGM of maximum 1023, a sample above it
+    const unsigned char pgm10[] = {0x03,0xff, 0x02,0x00, 0x04,0x00, 0,4};
+    const float vPgm10[] = {255, 128, 255, 1};
+    f = file("P5 4 1 1023\n", pgm10, sizeof(pgm10));
+    ok = check("PGM 1023", f, vPgm10, 4) && ok;
+
+    // PFM in the byte order of the machine, out of range values
+    const float pfm[] = {-5, 300, std::numeric_limits<float>::quiet_NaN(),
+                         12.5f};
+    const float vPfm[] = {0, 255, 0, 12.5f};
+    const int one=1;
+    const bool little = (*reinterpret_cast<const char*>(&one) == 1);
+    f = file(little? "Pf 4 1 -1\n": "Pf 4 1 1\n", pfm, sizeof(pfm));
+    ok = check("PFM", f, vPfm, 4) && ok;
+
+    if(! ok)
+        std::cerr << "FAILED" << std::endl;
+    return ok? 0: 1;
+}
@@ -16,45 +16,401 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "nan.h"
+#include "parallel.h"
 #include "cmdLine.h"
 #include "io_png.h"
 #include "io_tiff.h"
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <vector>
 #include <cstdlib>
+#include <cmath>
+#ifdef __unix__
+#include <dirent.h>
+#endif
+
+/// PNG filter of name \a name.
+static bool pngFilter(const std::string& name, int& filter) {
+    const char* names[] = {"none", "sub", "up", "avg", "paeth"};
+    filter = IO_PNG_FILTER_DEFAULT;
+    if(name == "adaptive")
+        return true;
+    for(int i=0; i<5; i++)
+        if(name == names[i]) {
+            filter = IO_PNG_FILTER_NONE+i;
+            return true;
+        }
+    std::cerr << "Error: unknown PNG filter " << name
+              << " (should be adaptive, none, sub, up, avg or paeth)"
+              << std::endl;
+    return false;
+}
+
+/// Levels of the palette of a colormap other than gray
+static const int COLOR_LEVELS=4096;
+
+/// Colormaps of the output
+enum Colormap { ColormapGray, ColormapJet, ColormapTurbo, ColormapViridis };
+
+/// Colormap of name \a name.
+static bool colormap(const std::string& name, Colormap& map) {
+    const char* names[] = {"gray", "jet", "turbo", "viridis"};
+    for(int i=0; i<4; i++)
+        if(name == names[i]) {
+            map = static_cast<Colormap>(i);
+            return true;
+        }
+    std::cerr << "Error: unknown colormap " << name
+              << " (should be gray, jet, turbo or viridis)" << std::endl;
+    return false;
+}
+
+/// Color r,g,b of string \a str in \a c.
+static bool parseColor(const std::string& str, unsigned char c[3]) {
+    int r=-1, g=-1, b=-1;
+    char c1=0, c2=0;
+    std::istringstream in(str);
+    if(!((in>>r>>c1>>g>>c2>>b) && in.eof() && c1==',' && c2==',' &&
+         0<=std::min(std::min(r,g),b) && std::max(std::max(r,g),b)<=255)) {
+        std::cerr << "Error: color must be r,g,b in [0,255]" << std::endl;
+        return false;
+    }
+    c[0]=static_cast<unsigned char>(r);
+    c[1]=static_cast<unsigned char>(g);
+    c[2]=static_cast<unsigned char>(b);
+    return true;
+}
+
+/// Polynomial of degree 6 with coefficients \a c at \a t.
+static float poly6(const float c[7], float t) {
+    return c[0]+t*(c[1]+t*(c[2]+t*(c[3]+t*(c[4]+t*(c[5]+t*c[6])))));
+}
+
+/// Color of \a map at \a t in [0,1], components in [0,1]. Turbo and viridis
+/// are the polynomial approximations published by their authors (A. Mikhailov
+/// for turbo, M. Zucker for viridis), within 0.05 of the original tables.
+static void colorAt(Colormap map, float t, float rgb[3]) {
+    static const float turbo[3][7] = {
+        {0.13572138f, 4.61539260f, -42.66032258f, 132.13108234f,
+         -152.94239396f, 59.28637943f, 0},
+        {0.09140261f, 2.19418839f, 4.84296658f, -14.18503333f,
+         4.27729857f, 2.82956604f, 0},
+        {0.10667330f, 12.64194608f, -60.58204836f, 110.36276771f,
+         -89.90310912f, 27.34824973f, 0}};
+    static const float viridis[3][7] = {
+        {0.2777273272f, 0.1050930431f, -0.3308618287f, -4.6342304990f,
+         6.2282699363f, 4.7763849977f, -5.4354558559f},
+        {0.0054073445f, 1.4046135299f, 0.2148475595f, -5.7991009734f,
+         14.1799333668f, -13.7451453777f, 4.6458526122f},
+        {0.3340998053f, 1.3845901626f, 0.0950951630f, -19.3324409563f,
+         56.6905526007f, -65.3530326334f, 26.3124352496f}};
+    for(int k=0; k<3; k++) {
+        switch(map) {
+        default: rgb[k] = t; break;
+        case ColormapJet: rgb[k] = 1.5f-std::abs(4*t-3+k); break;
+        case ColormapTurbo: rgb[k] = poly6(turbo[k], t); break;
+        case ColormapViridis: rgb[k] = poly6(viridis[k], t); break;
+        }
+        rgb[k] = std::min(1.0f, std::max(0.0f, rgb[k]));
+    }
+}
+
+/// Options of the PNG images
+struct OutputPNG {
+    int grayMin, grayMax;
+    int level, filter;
+    Colormap colormap;
+    unsigned char nan[3], out[3]; ///< Colors of NaN and out of range values
+};
+
+/// Affine map of values to the levels of a palette, filling the rows of the
+/// PNG image.
+struct GrayMap {
+    const float* pix; ///< Values
+    size_t w;         ///< Width
+    float vMin, vMax; ///< Range of valid values
+    float a, b;       ///< Coefficients of the map
+    float top;        ///< Last level
+    /// Color of level g at g+2, of NaN at 0 and out of range values at 1
+    unsigned char rgb[COLOR_LEVELS+2][3];
+};
+
+/// Pixels of a row mapped by one loop of grayRow
+static const int GRAY_BLOCK=256;
+
+/// Row \a y of \a ctx, a GrayMap, as RGB colors in \a row.
+///
+/// The levels of a block, -2 for NaN and -1 for values out of range, are
+/// computed by a loop with no branch, vectorized by the compiler: a NaN value
+/// being out of the range, it needs no separate test of validity. Colors are
+/// then looked up in m.rgb.
+static int grayRow(void* ctx, size_t y, unsigned char* row) {
+    const GrayMap& m = *static_cast<const GrayMap*>(ctx);
+    const float vMin=m.vMin, vMax=m.vMax, a=m.a, b=m.b, top=m.top;
+    int gray[GRAY_BLOCK];
+    for(size_t x0=0; x0<m.w; x0+=GRAY_BLOCK) {
+        const float* in = m.pix+y*m.w+x0;
+        const int n = static_cast<int>(std::min<size_t>(GRAY_BLOCK, m.w-x0));
+        for(int x=0; x<n; x++) {
+            const bool valid = (vMin<=in[x]) & (in[x]<=vMax);
+            const int invalid = (in[x]==in[x])? -1: -2;
+            float v = a*in[x]+b +0.5f;
+            v = (v<0)? 0: v;
+            v = (v>top)? top: v;
+            gray[x] = valid? static_cast<int>(v): invalid;
+        }
+        for(int x=0; x<n; x++, row+=3) {
+            const unsigned char* c = m.rgb[gray[x]+2];
+            row[0]=c[0]; row[1]=c[1]; row[2]=c[2];
+        }
+    }
+    return 0;
+}
+
+/// Map of [vMin,vMax] to [grayMin,grayMax] for values \a pix of width \a w.
+/// The gray colormap has the 256 levels of the PNG image, the others
+/// COLOR_LEVELS, grayMin and grayMax being scaled to them.
+static void initMap(GrayMap& map, const float* pix, size_t w,
+                    float vMin, float vMax, const OutputPNG& png) {
+    const int levels = (png.colormap==ColormapGray)? 256: COLOR_LEVELS;
+    const float s = (levels-1)/255.0f;
+    map.pix = pix;
+    map.w = w;
+    map.vMin = vMin;
+    map.vMax = vMax;
+    map.top = static_cast<float>(levels-1);
+    map.a = s*(png.grayMax-png.grayMin)/float(vMax-vMin);
+    map.b = s*(png.grayMin*vMax-png.grayMax*vMin)/float(vMax-vMin);
+    std::copy(png.nan, png.nan+3, map.rgb[0]);
+    std::copy(png.out, png.out+3, map.rgb[1]);
+    for(int g=0; g<levels; g++) {
+        float c[3];
+        colorAt(png.colormap, g/map.top, c);
+        for(int k=0; k<3; k++)
+            map.rgb[g+2][k] = static_cast<unsigned char>(255*c[k]+0.5f);
+    }
+}
+
+/// Parse the range [vMin,vMax] in \a lo and \a hi.
+static bool parseRange(const char* lo, const char* hi,
+                       float& vMin, float& vMax) {
+    if(! ((std::istringstream(lo)>>vMin).eof() &&
+          (std::istringstream(hi)>>vMax).eof())) {
+        std::cerr << "Error reading vMin or vMax" << std::endl;
+        return false;
+    }
+    if(vMax < vMin) {
+        std::cerr << "Error: vMax("<<vMax<< ") < vMin("<<vMin<< ')'<< std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// A file to convert, in batch mode
+struct Conversion {
+    std::string in, out;
+    float vMin, vMax;
+};
+
+/// Rows of a TIFF file read one at a time, mapped to gray levels.
+struct StreamMap {
+    io_tiff_reader* reader;
+    std::vector<float> row; ///< Values of the current row
+    GrayMap map;            ///< Map of row
+};
+
+/// Next row of \a ctx, a StreamMap, as RGB colors in \a row.
+static int streamRow(void* ctx, size_t, unsigned char* row) {
+    StreamMap& s = *static_cast<StreamMap*>(ctx);
+    if(io_tiff_reader_read_f32(s.reader, &s.row[0]) != 0)
+        return -1;
+    return grayRow(&s.map, 0, row);
+}
+
+/// Convert the file of \a c row by row: the PNG image is not interlaced, so
+/// that the rows are read, mapped and compressed in order, and the memory is
+/// a few rows whatever the size of the image.
+static bool convertStream(const Conversion& c, const OutputPNG& png) {
+    size_t w, h;
+    StreamMap s;
+    if(! (s.reader = io_tiff_reader_open(c.in.c_str(), &w, &h)))
+        return false;
+    s.row.resize(w);
+    initMap(s.map, &s.row[0], w, c.vMin, c.vMax, png);
+    const bool ok = (io_png_write_u8_rows(c.out.c_str(), streamRow, &s, w, h,
+                                          3, png.level, png.filter, 0) == 0);
+    io_tiff_reader_close(s.reader);
+    if(! ok)
+        std::cerr << "Unable to write file " << c.out << " as PNG" <<std::endl;
+    return ok;
+}
+
+/// Conversions of a batch, run by a pool of threads, one file at a time.
+class ConvertFiles : public ParallelBody {
+public:
+    ConvertFiles(const std::vector<Conversion>& c, const OutputPNG& p)
+    : conversions(c), png(p), failed(c.size(),0) {}
+    void run(int i, int) { failed[i] = !convertStream(conversions[i], png); }
+    /// Number of failed conversions
+    int failures() const {
+        return static_cast<int>(std::count(failed.begin(), failed.end(), 1));
+    }
+private:
+    const std::vector<Conversion>& conversions;
+    const OutputPNG& png;
+    std::vector<char> failed;
+};
+
+/// Add the conversions listed in file \a name, one per line:
+///     in.tif vMin vMax out.png
+/// Empty lines and lines beginning with # are ignored. Return false if a line
+/// is wrong, the others being added anyway.
+static bool readList(const char* name, std::vector<Conversion>& conversions) {
+    std::ifstream file(name);
+    if(! file) {
+        std::cerr << "Unable to read file " << name << std::endl;
+        return false;
+    }
+    bool ok=true;
+    std::string line;
+    for(int n=1; std::getline(file, line); n++) {
+        std::istringstream str(line);
+        Conversion c;
+        std::string lo, hi, extra;
+        if(!(str>>c.in) || c.in[0]=='#')
+            continue;
+        if(!(str>>lo>>hi>>c.out) || (str>>extra) ||
+           !parseRange(lo.c_str(), hi.c_str(), c.vMin, c.vMax)) {
+            std::cerr << "Error line " << n << " of " << name
+                      << ": in.tif vMin vMax out.png" << std::endl;
+            ok = false;
+        } else
+            conversions.push_back(c);
+    }
+    return ok;
+}
+
+/// Whether \a name ends with \a ext.
+static bool hasExtension(const std::string& name, const std::string& ext) {
+    return (name.size()>ext.size() &&
+            name.compare(name.size()-ext.size(), ext.size(), ext)==0);
+}
+
+/// Add the conversions of the files .tif and .tiff of directory \a dir to
+/// the files .png of the same name, in alphabetical order.
+static bool listDirectory(const std::string& dir, float vMin, float vMax,
+                          std::vector<Conversion>& conversions) {
+#ifdef __unix__
+    DIR* d = opendir(dir.c_str());
+    if(! d) {
+        std::cerr << "Unable to read directory " << dir << std::endl;
+        return false;
+    }
+    std::vector<std::string> names;
+    while(const dirent* e = readdir(d)) {
+        const std::string name(e->d_name);
+        if(hasExtension(name,".tif") || hasExtension(name,".tiff"))
+            names.push_back(name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for(size_t i=0; i<names.size(); i++) {
+        Conversion c;
+        c.in = dir+'/'+names[i];
+        c.out = c.in.substr(0, c.in.rfind('.'))+".png";
+        c.vMin = vMin;
+        c.vMax = vMax;
+        conversions.push_back(c);
+    }
+    return true;
+#else
+    (void)dir; (void)vMin; (void)vMax; (void)conversions;
+    std::cerr << "Error: option dir needs a POSIX system" << std::endl;
+    return false;
+#endif
+}
 
 /// Float TIFF to 8-bit color PNG conversion.
 ///
 /// The value->gray function is affine: gray=a*value+b.
 /// Values outside [vMin,vMax] are assumed invalid and written in cyan color.
 int main(int argc, char *argv[]) {
-    int grayMin=255, grayMax=0;
+    OutputPNG png = {255, 0, -1, IO_PNG_FILTER_DEFAULT, ColormapGray,
+                     {0,255,255}, {0,255,255}};
     CmdLine cmd; cmd.prefixDoc="    ";
-    cmd.add( make_option('m',grayMin,"min").doc("gray level for vMin") );
-    cmd.add( make_option('M',grayMax,"max").doc("gray level for vMax") );
+    cmd.add( make_option('m',png.grayMin,"min").doc("gray level for vMin") );
+    cmd.add( make_option('M',png.grayMax,"max").doc("gray level for vMax") );
+    int threads=1;
+    std::string filterName("adaptive"), batch, dir;
+    std::string mapName("gray"), nanColor("0,255,255"), outColor("0,255,255");
+    cmd.add( make_option('l',png.level,"level")
+             .doc("zlib compression level 0-9, -1 for default") );
+    cmd.add( make_option('f',filterName,"filter")
+             .doc("PNG filter: adaptive, none, sub, up, avg or paeth") );
+    cmd.add( make_option('c',mapName,"colormap")
+             .doc("colormap: gray, jet, turbo or viridis") );
+    cmd.add( make_option(0,nanColor,"nan-color")
+             .doc("color r,g,b of NaN values") );
+    cmd.add( make_option(0,outColor,"out-color")
+             .doc("color r,g,b of values out of [vMin,vMax]") );
+    cmd.add( make_option('j',threads,"threads")
+             .doc("parallel compression (non-interlaced PNG) if >1, files "
+                  "converted concurrently in batch") );
+    cmd.add( make_option(0,batch,"batch")
+             .doc("convert the files of a list, lines in.tif vMin vMax "
+                  "out.png") );
+    cmd.add( make_option(0,dir,"dir")
+             .doc("convert all TIFF files of a directory to PNG") );
 
     try {
         cmd.process(argc, argv);
     } catch(std::string str) {
         std::cerr << "Error: " << str << std::endl<<std::endl;
-        argc=1; // To display usage
+        argc=0; // To display usage
     }
-    if(argc!=5) {
+    if(!batch.empty() && !dir.empty()) {
+        std::cerr << "Error: batch and dir are exclusive" << std::endl;
+        return 1;
+    }
+    const int nArgs = !batch.empty()? 1: (!dir.empty()? 3: 5);
+    if(argc != nArgs) {
         std::cerr << "Usage: "<< argv[0]
                   << " [options] in.tif vMin vMax out.png\n"
+                  << "       " << argv[0] << " [options] --batch list.txt\n"
+                  << "       " << argv[0] << " [options] --dir dir vMin vMax\n"
                   << "Options:\n" << cmd;
         return 1;
     }
 
-    float vMin, vMax;
-    if(! ((std::istringstream(argv[2])>>vMin).eof() &&
-          (std::istringstream(argv[3])>>vMax).eof())) {
-        std::cerr << "Error reading vMin or vMax" << std::endl;
+    float vMin=0, vMax=0;
+    const int r = (nArgs==5)? 2: 1; // Index of vMin
+    if(nArgs>1 && !parseRange(argv[r], argv[r+1], vMin, vMax))
         return 1;
-    }
-    if(vMax < vMin) {
-        std::cerr << "Error: vMax("<<vMax<< ") < vMin("<<vMin<< ')'<< std::endl;
+    if(! pngFilter(filterName, png.filter) ||
+       !colormap(mapName, png.colormap) ||
+       !parseColor(nanColor, png.nan) || !parseColor(outColor, png.out))
         return 1;
+    if(png.level<-1 || png.level>9 || threads<1) {
+        std::cerr << "Error: level must be in [-1,9] and threads positive"
+                  << std::endl;
+        return 1;
+    }
+
+    if(nArgs != 5) { // Pool of threads converting one file at a time each
+        std::vector<Conversion> conversions;
+        bool ok = batch.empty()? listDirectory(dir, vMin, vMax, conversions):
+            readList(batch.c_str(), conversions);
+        setParallelThreads(threads);
+        ConvertFiles files(conversions, png);
+        parallelFor(static_cast<int>(conversions.size()), files,
+                    ParallelDynamic);
+        if(files.failures() > 0) {
+            std::cerr << files.failures() << " of " << conversions.size()
+                      << " conversions failed" << std::endl;
+            ok = false;
+        }
+        return ok? 0: 1;
     }
 
     size_t w, h;
@@ -64,30 +420,15 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    const float a=(grayMax-grayMin)/float(vMax-vMin);
-    const float b=(grayMin*vMax-grayMax*vMin)/float(vMax-vMin);
-
-    const float* in=pix;
-    unsigned char *out=new unsigned char[3*w*h];
-    unsigned char *red=out, *green=out+w*h, *blue=out+2*w*h;
-    for(size_t i=w*h; i>0; i--, in++, red++) {
-        if(is_number(*in) && vMin<=*in && *in<=vMax) {
-            float v = a * *in + b +0.5f;
-            if(v<0) v=0;
-            if(v>255) v=255;
-            *red = static_cast<unsigned char>(v);
-            *green++ = *red;
-            *blue++  = *red;
-        } else { // Cyan for disparities out of range
-            *red=0;
-            *green++ = *blue++ = 255;
-        }
-    }
-    if(io_png_write_u8(argv[4], out, w, h, 3) != 0) {
-        std::cerr << "Unable to write file " <<argv[4]<< " as TIFF" <<std::endl;
+    GrayMap map;
+    initMap(map, pix, w, vMin, vMax, png);
+    // Rows mapped as they are compressed, in parallel with threads>1
+    if(io_png_write_u8_rows(argv[4], grayRow, &map, w, h, 3,
+                            png.level, png.filter, threads) != 0) {
+        std::cerr << "Unable to write file " <<argv[4]<< " as PNG" <<std::endl;
+        std::free(pix);
         return 1;
     }
-    delete [] out;
     std::free(pix);
     return 0;
 }
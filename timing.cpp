@@ -0,0 +1,781 @@
+/**
+ * @file timing.cpp
+ * @brief Wall and CPU time of the stages of the disparity chain
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timing.h"
+#include <algorithm>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#if __cplusplus >= 201103L
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __unix__
+#include <sys/resource.h>
+#endif
+#if defined(PERF_COUNTERS) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define HW_COUNTERS
+#endif
+#ifdef PROFILER_ITT
+#include <ittnotify.h>
+#endif
+#ifdef PROFILER_TRACY
+#include <map>
+#include <tracy/TracyC.h>
+#endif
+#if defined(ALLOC_COUNTERS) && __cplusplus >= 201103L
+#include <cstdlib>
+#include <new>
+#define HEAP_COUNTERS
+#endif
+
+/// Accumulated measures of a stage
+struct Stage {
+    const char* name;
+    int count;          ///< Number of measures
+    double wall, cpu;   ///< Seconds
+    double work;        ///< Units of work
+    double allocs, bytes; ///< Heap allocations and their bytes
+    double joules, dramJoules; ///< RAPL energy of packages and DRAM
+    std::vector<double> counters; ///< Hardware counters of each thread
+};
+
+static bool timing=false;        ///< Measures are taken
+static std::vector<Stage> stages; ///< In order of first measure
+/// Named counts of addCount(), in order of first count
+static std::vector<std::pair<const char*,double> > counts;
+#if __cplusplus >= 201103L
+static std::mutex mutex;         ///< Stages measured in several threads
+#endif
+
+/// Span of the trace
+struct TraceEvent {
+    const char* name;
+    int index;         ///< Argument, none if negative
+    int thread;        ///< Number of thread, in order of first event
+    bool stage;        ///< Stage of StageTimer, else work of a thread
+    double begin, end; ///< Seconds
+};
+
+static bool tracing=false;             ///< Spans are recorded
+static double traceStart=0;            ///< Origin of times of the trace
+static std::vector<TraceEvent> events; ///< Recorded spans
+#if __cplusplus >= 201103L
+static std::vector<std::thread::id> traceThreads; ///< Threads of events
+#endif
+
+static ProgressCallback progress=0; ///< Callback of ProgressStep, or 0
+static void* progressData=0;        ///< Argument of progress
+#if __cplusplus >= 201103L
+static std::mutex progressMutex;    ///< One callback at a time
+static std::atomic<bool> cancel(false); ///< Computation cancelled
+#else
+static volatile bool cancel=false;  ///< Computation cancelled
+#endif
+
+#ifdef HEAP_COUNTERS
+/// Calls of operator new in all threads since the start, and bytes requested
+static std::atomic<unsigned long long> heapAllocs(0), heapBytes(0);
+
+/// Counted allocation of \a size bytes, of all the forms of operator new.
+static void* countedNew(size_t size) {
+    heapAllocs.fetch_add(1, std::memory_order_relaxed);
+    heapBytes.fetch_add(size, std::memory_order_relaxed);
+    void* p = std::malloc(size? size: 1);
+    if(! p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size) { return countedNew(size); }
+void* operator new[](size_t size) { return countedNew(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try { return countedNew(size); } catch(...) { return 0; }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    try { return countedNew(size); } catch(...) { return 0; }
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    std::free(p);
+}
+#if __cplusplus >= 201402L
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+#endif
+#endif
+
+/// Heap allocations by operator new in all threads since the start of the
+/// process, and the bytes requested. Return false, with zeros, if not built
+/// with ALLOC_COUNTERS: allocations of the C code (malloc of the codecs) are
+/// not counted.
+bool heapCounts(double& allocs, double& bytes) {
+#ifdef HEAP_COUNTERS
+    allocs = static_cast<double>(heapAllocs.load(std::memory_order_relaxed));
+    bytes = static_cast<double>(heapBytes.load(std::memory_order_relaxed));
+    return true;
+#else
+    allocs = bytes = 0;
+    return false;
+#endif
+}
+
+/// Energy counter of a RAPL domain of the Linux powercap interface
+struct RaplDomain {
+    std::string file; ///< energy_uj, in microjoules
+    double range;     ///< Value at which the counter wraps around
+    bool dram;        ///< DRAM of a package, else the package
+};
+
+static std::vector<RaplDomain> rapl; ///< Readable domains
+static bool raplOpened=false;        ///< Domains searched
+
+/// Value of the file \a name as a number, -1 if it cannot be read.
+static double readNumber(const std::string& name) {
+    std::ifstream file(name.c_str());
+    double v=-1;
+    if(!(file >> v))
+        return -1;
+    return v;
+}
+
+/// Search the readable RAPL domains: each package (intel-rapl:N, also for
+/// recent AMD processors) and its DRAM subdomain. Reading energy_uj needs
+/// root on kernels since 5.10, none being then found.
+static void openRapl() {
+    if(raplOpened)
+        return;
+    raplOpened = true;
+#ifdef __linux__
+    const std::string root("/sys/class/powercap/intel-rapl:");
+    for(int n=0; n<64; n++)
+        for(int m=-1; m<8; m++) {
+            std::ostringstream dir;
+            dir << root << n;
+            if(m >= 0)
+                dir << ':' << m;
+            std::ifstream nameFile((dir.str()+"/name").c_str());
+            std::string name;
+            if(!(nameFile >> name)) {
+                if(m < 0)
+                    return; // No more package
+                continue;
+            }
+            const bool dram = (name=="dram");
+            if(m>=0? !dram: name.compare(0, 7, "package")!=0)
+                continue; // Cores, uncore: parts of package; psys: platform
+            RaplDomain d = {dir.str()+"/energy_uj",
+                            readNumber(dir.str()+"/max_energy_range_uj"),
+                            dram};
+            if(readNumber(d.file) >= 0)
+                rapl.push_back(d);
+        }
+#endif
+}
+
+/// Energy counters of the RAPL domains, in microjoules, in \a v.
+static void readRapl(std::vector<double>& v) {
+    v.resize(rapl.size());
+    for(size_t i=0; i<rapl.size(); i++)
+        v[i] = readNumber(rapl[i].file);
+}
+
+#ifdef PROFILER_ITT
+/// Domain of the tasks of VTune
+static __itt_domain* ittDomain() {
+    static __itt_domain* domain = __itt_domain_create("stereoaw");
+    return domain;
+}
+static bool ittFrame=false; ///< A frame is open
+#endif
+
+#ifdef PROFILER_TRACY
+/// Source location of the zones of Tracy named \a name, kept for the
+/// lifetime of the program as Tracy requires. Names are literals, so their
+/// address identifies them.
+static const ___tracy_source_location_data* tracyLocation(const char* name) {
+    static std::map<const char*,___tracy_source_location_data*> locations;
+    static std::mutex locationMutex;
+    std::lock_guard<std::mutex> lock(locationMutex);
+    ___tracy_source_location_data*& loc = locations[name];
+    if(! loc) {
+        ___tracy_source_location_data l = {name, name, __FILE__, 0, 0};
+        loc = new ___tracy_source_location_data(l);
+    }
+    return loc;
+}
+#endif
+
+/// Begin \a zone named \a name of the external profiler, none if \a name
+/// is 0 or without PROFILER.
+static void beginZone(ProfilerZone& zone, const char* name) {
+    zone.id = 0;
+    zone.active = 0;
+    if(! name)
+        return;
+#if defined(PROFILER_ITT)
+    __itt_task_begin(ittDomain(), __itt_null, __itt_null,
+                     __itt_string_handle_create(name));
+    zone.active = 1;
+#elif defined(PROFILER_TRACY)
+    TracyCZoneCtx ctx = ___tracy_emit_zone_begin(tracyLocation(name), 1);
+    zone.id = ctx.id;
+    zone.active = ctx.active;
+#endif
+}
+
+/// End \a zone if active.
+static void endZone(ProfilerZone& zone) {
+    if(! zone.active)
+        return;
+#if defined(PROFILER_ITT)
+    __itt_task_end(ittDomain());
+#elif defined(PROFILER_TRACY)
+    TracyCZoneCtx ctx = {zone.id, zone.active};
+    ___tracy_emit_zone_end(ctx);
+#endif
+    zone.active = 0;
+}
+
+/// End of a frame of the external profiler, a pair computed by the engine,
+/// and start of the next one.
+void markFrame() {
+#if defined(PROFILER_ITT)
+    if(ittFrame)
+        __itt_frame_end_v3(ittDomain(), 0);
+    __itt_frame_begin_v3(ittDomain(), 0);
+    ittFrame = true;
+#elif defined(PROFILER_TRACY)
+    ___tracy_emit_frame_mark(0);
+#endif
+}
+
+/// Hardware counters: cycles, instructions, last level cache misses, cycles
+/// stalled in the front end (fetch, decode) and in the back end (memory,
+/// execution units).
+static const int NCOUNTERS=5;
+static const char* COUNTER_NAMES[NCOUNTERS] = {
+    "cycles", "instr", "LLC miss", "front stall", "back stall"
+};
+
+#ifdef HW_COUNTERS
+static const unsigned long long COUNTER_EVENTS[NCOUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND,
+    PERF_COUNT_HW_STALLED_CYCLES_BACKEND
+};
+#endif
+
+/// Counters of a thread
+struct ThreadCounters {
+    long tid;           ///< Linux thread id
+    int fd[NCOUNTERS];  ///< Events of perf_event_open, -1 if unavailable
+};
+
+/// Threads with counters, the OpenMP team (thread i in row i) then others
+static std::vector<ThreadCounters> counted;
+static size_t teamSize=0; ///< Threads of the OpenMP team in counted
+
+#ifdef HW_COUNTERS
+/// Linux id of the calling thread.
+static long threadId() {
+    return syscall(SYS_gettid);
+}
+
+/// Open the counters of the calling thread, user space only.
+static ThreadCounters openCounters() {
+    ThreadCounters c;
+    c.tid = threadId();
+    for(int k=0; k<NCOUNTERS; k++) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = COUNTER_EVENTS[k];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED|
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        c.fd[k] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1,
+                                           -1, 0));
+    }
+    return c;
+}
+
+/// Value of counter \a fd, scaled if it was multiplexed; -1 if unavailable.
+static double readCounter(int fd) {
+    unsigned long long v[3]; // Value, time enabled, time running
+    if(fd<0 || read(fd, v, sizeof(v)) != sizeof(v))
+        return -1;
+    return (v[2]>0)? static_cast<double>(v[0])*v[1]/v[2]: 0;
+}
+#endif
+
+/// Open the counters of the OpenMP threads, kept from one parallel region to
+/// the next as in libgomp.
+static void openTeamCounters() {
+#ifdef HW_COUNTERS
+    if(teamSize > 0)
+        return;
+#ifdef _OPENMP
+    const int n = omp_get_max_threads();
+#else
+    const int n = 1;
+#endif
+    ThreadCounters none;
+    none.tid = 0;
+    for(int k=0; k<NCOUNTERS; k++)
+        none.fd[k] = -1;
+    counted.assign(n, none);
+#ifdef _OPENMP
+#pragma omp parallel
+    if(omp_get_thread_num() < n)
+        counted[omp_get_thread_num()] = openCounters();
+#else
+    counted[0] = openCounters();
+#endif
+    teamSize = n;
+#endif
+}
+
+/// Take measures of stages from now on if \a on, and forget previous ones.
+void enableTiming(bool on) {
+    timing = on;
+    stages.clear();
+    counts.clear();
+    if(on) {
+        openTeamCounters();
+        openRapl();
+    }
+}
+
+/// Add \a n to the count of events \a name, printed with the times, if
+/// measures are taken.
+void addCount(const char* name, double n) {
+    if(! timing)
+        return;
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    size_t i=0;
+    while(i<counts.size() && std::strcmp(counts[i].first,name)!=0)
+        i++;
+    if(i == counts.size())
+        counts.push_back(std::make_pair(name, 0.0));
+    counts[i].second += n;
+}
+
+/// Wall clock time in seconds, from an arbitrary origin, for the budgets of
+/// callers and the tools.
+double wallClock() {
+#if __cplusplus >= 201103L
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+    return std::clock()/static_cast<double>(CLOCKS_PER_SEC);
+#endif
+}
+
+/// CPU time of the process in seconds.
+static double cpuTime() {
+    return std::clock()/static_cast<double>(CLOCKS_PER_SEC);
+}
+
+/// Number of the calling thread in the trace, with the lock held: in order
+/// of first event (main thread first), or OpenMP number without C++11.
+static int traceThread() {
+#if __cplusplus >= 201103L
+    const std::thread::id id = std::this_thread::get_id();
+    size_t i=0;
+    while(i<traceThreads.size() && traceThreads[i]!=id)
+        i++;
+    if(i == traceThreads.size())
+        traceThreads.push_back(id);
+    return static_cast<int>(i);
+#elif defined(_OPENMP)
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+/// Record the span from \a begin to now of the calling thread.
+static void addEvent(const char* name, int index, bool stage, double begin) {
+    const double end = wallClock();
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    TraceEvent e = {name, index, traceThread(), stage, begin, end};
+    events.push_back(e);
+}
+
+/// Record spans from now on if \a on, and forget previous ones.
+void enableTrace(bool on) {
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    tracing = on;
+    events.clear();
+#if __cplusplus >= 201103L
+    traceThreads.clear();
+#endif
+    traceStart = wallClock();
+    if(on)
+        traceThread(); // Calling thread first
+}
+
+/// Write the spans in the Chrome trace event format (JSON), for
+/// chrome://tracing or Perfetto: complete events, in microseconds.
+bool writeTrace(const char* fileName) {
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    std::ofstream file(fileName);
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    int threads=0;
+    char line[192];
+    for(size_t i=0; i<events.size(); i++) {
+        const TraceEvent& e = events[i];
+        threads = std::max(threads, e.thread+1);
+        std::sprintf(line, "%s\n{\"name\": \"%s\", \"cat\": \"%s\", "
+                     "\"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                     "\"ts\": %.1f, \"dur\": %.1f", i? ",": "", e.name,
+                     e.stage? "stage": "work", e.thread,
+                     (e.begin-traceStart)*1e6, (e.end-e.begin)*1e6);
+        file << line;
+        if(e.index >= 0)
+            file << ", \"args\": {\"index\": " << e.index << '}';
+        file << '}';
+    }
+    for(int t=0; t<threads; t++) {
+        char thread[24] = "main";
+        if(t > 0)
+            std::sprintf(thread, "thread %d", t);
+        std::sprintf(line, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                     "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": "
+                     "\"%s\"}}", events.empty()? "": ",", t, thread);
+        file << line;
+    }
+    file << "\n]}\n";
+    file.close();
+    if(! file) {
+        std::cerr << "Error writing file " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Constructor, starting the span.
+TraceSpan::TraceSpan(const char* n, int i)
+: name(tracing? n: 0), index(i), begin(0) {
+    beginZone(zone, n);
+    if(name)
+        begin = wallClock();
+}
+
+/// Destructor, recording the span.
+TraceSpan::~TraceSpan() {
+    endZone(zone);
+    if(name)
+        addEvent(name, index, false, begin);
+}
+
+/// Report the progress of steps to \a callback, called with \a data, none
+/// if 0. To be set before the computation.
+void setProgress(ProgressCallback callback, void* data) {
+    progress = callback;
+    progressData = data;
+}
+
+/// Cancel the computation if \a on, else allow it again. Any thread, or a
+/// signal handler, may call it. The loops over rows, tiles and pixels skip
+/// the remaining ones, so that the computation soon returns with meaningless
+/// maps; the caller checks computationCancelled() and calls
+/// cancelComputation(false) before the next one.
+void cancelComputation(bool on) {
+    cancel = on;
+}
+
+/// Whether the computation was cancelled, see cancelComputation().
+bool computationCancelled() {
+    return cancel;
+}
+
+/// Constructor, starting the step.
+ProgressStep::ProgressStep(const char* name, long pixels)
+: step((progress && pixels>0)? name: 0), done(0), total(pixels), start(0) {
+    if(step)
+        start = wallClock();
+}
+
+/// Add \a pixels to those done, calling the callback at each new percent.
+/// If it returns false, the computation is cancelled.
+void ProgressStep::advance(long pixels) {
+    if(! step)
+        return;
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(progressMutex);
+#endif
+    const int before = static_cast<int>(100.0*done/total);
+    done += pixels;
+    if(static_cast<int>(100.0*done/total) == before)
+        return;
+    Progress p = {step, done, total, wallClock()-start};
+    if(! progress(p, progressData))
+        cancelComputation();
+}
+
+/// Rows in counted of the threads of a stage measured by the calling thread,
+/// appended to counted if needed.
+static void countedRows(size_t& row, size_t& rows) {
+    row = rows = 0;
+#ifdef HW_COUNTERS
+    const long tid = threadId();
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    if(teamSize>0 && counted[0].tid==tid) { // Main thread, whole team
+        rows = teamSize;
+        return;
+    }
+    for(row=teamSize; row<counted.size() && counted[row].tid!=tid; row++)
+        ;
+    if(row == counted.size())
+        counted.push_back(openCounters());
+    rows = 1;
+#endif
+}
+
+/// Read the counters of \a rows threads from \a row, appended to \a v.
+static void readCounters(size_t row, size_t rows, std::vector<double>& v) {
+#ifdef HW_COUNTERS
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex); // counted may grow
+#endif
+    for(size_t i=row; i<row+rows; i++)
+        for(int k=0; k<NCOUNTERS; k++)
+            v.push_back(readCounter(counted[i].fd[k]));
+#else
+    (void)row; (void)rows; (void)v;
+#endif
+}
+
+/// Constructor, starting the measure.
+StageTimer::StageTimer(const char* name, double units)
+: stage(timing? name: 0), work(units), wall(0), cpu(0), allocs(0), bytes(0),
+  row(0), rows(0) {
+    beginZone(zone, name);
+    if(stage) {
+        countedRows(row, rows);
+        readCounters(row, rows, start);
+        heapCounts(allocs, bytes);
+        readRapl(energy);
+        wall = wallClock();
+        cpu = cpuTime();
+    }
+}
+
+/// End the measure, added to the stage.
+void StageTimer::stop() {
+    endZone(zone);
+    if(! stage)
+        return;
+    const double dWall=wallClock()-wall, dCpu=cpuTime()-cpu;
+    double nAllocs, nBytes;
+    heapCounts(nAllocs, nBytes);
+    std::vector<double> energyEnd;
+    readRapl(energyEnd);
+    if(tracing)
+        addEvent(stage, -1, true, wall);
+    std::vector<double> end;
+    readCounters(row, rows, end);
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    size_t i=0;
+    while(i<stages.size() && std::strcmp(stages[i].name,stage)!=0)
+        i++;
+    if(i == stages.size()) {
+        Stage s = {stage, 0, 0, 0, 0, 0, 0, 0, 0, std::vector<double>()};
+        stages.push_back(s);
+    }
+    Stage& s = stages[i];
+    s.count++;
+    s.wall += dWall;
+    s.cpu += dCpu;
+    s.work += work;
+    s.allocs += nAllocs-allocs;
+    s.bytes += nBytes-bytes;
+    for(size_t j=0; j<energyEnd.size(); j++)
+        if(energy[j]>=0 && energyEnd[j]>=0) {
+            double e = energyEnd[j]-energy[j];
+            if(e < 0) // Wrapped around
+                e += rapl[j].range;
+            (rapl[j].dram? s.dramJoules: s.joules) += e*1e-6;
+        }
+    if(s.counters.size() < counted.size()*NCOUNTERS)
+        s.counters.resize(counted.size()*NCOUNTERS, 0);
+    for(size_t j=0; j<end.size(); j++)
+        if(start[j]>=0 && end[j]>=0)
+            s.counters[row*NCOUNTERS+j] += end[j]-start[j];
+        else
+            s.counters[row*NCOUNTERS+j] = -1; // Unavailable
+    start.clear();
+    stage = 0;
+}
+
+/// Print the hardware counters of the stages, in millions, for each thread
+/// with cycles: OpenMP thread number, or b0, b1... for other threads.
+static void printCounters(std::ostream& out) {
+    char line[160];
+    bool any=false;
+    for(size_t i=0; i<stages.size(); i++) {
+        const Stage& s = stages[i];
+        for(size_t t=0; t*NCOUNTERS<s.counters.size(); t++) {
+            const double* c = &s.counters[t*NCOUNTERS];
+            if(c[0] <= 0)
+                continue;
+            if(! any) {
+                std::sprintf(line, "%-16s %6s", "Counters (M)", "thread");
+                out << line;
+                for(int k=0; k<NCOUNTERS; k++) {
+                    std::sprintf(line, " %11s", COUNTER_NAMES[k]);
+                    out << line;
+                }
+                out << "   IPC\n";
+                any = true;
+            }
+            char thread[16];
+            if(t < teamSize)
+                std::sprintf(thread, "%d", static_cast<int>(t));
+            else
+                std::sprintf(thread, "b%d", static_cast<int>(t-teamSize));
+            std::sprintf(line, "%-16s %6s", s.name, thread);
+            out << line;
+            for(int k=0; k<NCOUNTERS; k++) {
+                if(c[k] >= 0)
+                    std::sprintf(line, " %11.1f", c[k]*1e-6);
+                else
+                    std::sprintf(line, " %11s", "-");
+                out << line;
+            }
+            std::sprintf(line, " %5.2f\n", (c[1]>=0)? c[1]/c[0]: 0);
+            out << line;
+        }
+    }
+    if(!any && teamSize>0)
+        out << "Hardware counters unavailable (see perf_event_paranoid)\n";
+}
+
+/// Measures of the stages, in order of first measure.
+std::vector<StageTime> stageTimes() {
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    std::vector<StageTime> times(stages.size());
+    for(size_t i=0; i<stages.size(); i++) {
+        const Stage& s = stages[i];
+        StageTime t = {s.name, s.count, s.wall, s.cpu, s.work, s.allocs,
+                       s.bytes, -1, -1};
+        for(size_t j=0; j<rapl.size(); j++) {
+            if(rapl[j].dram)
+                t.dramJoules = s.dramJoules;
+            else
+                t.joules = s.joules;
+        }
+        times[i] = t;
+    }
+    return times;
+}
+
+/// Counts of addCount(), in order of first count.
+std::vector<CountTotal> countTotals() {
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    std::vector<CountTotal> totals(counts.size());
+    for(size_t i=0; i<counts.size(); i++) {
+        CountTotal t = {counts[i].first, counts[i].second};
+        totals[i] = t;
+    }
+    return totals;
+}
+
+/// Peak resident memory of the process in bytes, 0 if unknown.
+size_t peakMemory() {
+#ifdef __unix__
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0)
+        return static_cast<size_t>(usage.ru_maxrss)*1024; // kB in Linux
+#endif
+    return 0;
+}
+
+/// Print the times of the stages, and the throughput of those with work in
+/// millions of pixel-disparities per second (wall time).
+void printTiming(std::ostream& out) {
+#if __cplusplus >= 201103L
+    std::lock_guard<std::mutex> lock(mutex);
+#endif
+    char line[128];
+    double allocs, bytes;
+    const bool heap = heapCounts(allocs, bytes);
+    std::sprintf(line, "%-16s %6s %10s %10s", "Stage", "calls", "wall (s)",
+                 "CPU (s)");
+    out << line << (heap? "     allocs   MB alloc\n": "\n");
+    for(size_t i=0; i<stages.size(); i++) {
+        const Stage& s = stages[i];
+        std::sprintf(line, "%-16s %6d %10.3f %10.3f", s.name, s.count, s.wall,
+                     s.cpu);
+        out << line;
+        if(heap) {
+            std::sprintf(line, " %10.0f %10.1f", s.allocs, s.bytes/1048576.0);
+            out << line;
+        }
+        if(s.work>0 && s.wall>0) {
+            std::sprintf(line, " %10.1f Mpx.disp/s", s.work/s.wall*1e-6);
+            out << line;
+        }
+        out << '\n';
+    }
+    for(size_t i=0; i<counts.size(); i++) {
+        std::sprintf(line, "%-16s %6s %10.1f M\n", counts[i].first, "",
+                     counts[i].second*1e-6);
+        out << line;
+    }
+    if(peakMemory() > 0) {
+        std::sprintf(line, "%-16s %6s %10.1f MB\n", "peak memory", "",
+                     peakMemory()/1048576.0);
+        out << line;
+    }
+    printCounters(out);
+    out << std::flush;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file timing.h
+ * @brief Wall and CPU time of the stages of the disparity chain
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <cstddef>
+#include <iosfwd>
+#include <vector>
+
+/// Accumulated measures of a stage, see stageTimes()
+struct StageTime {
+    const char* name;
+    int count;        ///< Number of measures
+    double wall, cpu; ///< Seconds
+    double work;      ///< Units of work
+    double allocs, bytes; ///< Heap allocations, see heapCounts()
+    double joules, dramJoules; ///< RAPL energy (Linux), -1 if unavailable
+};
+
+/// Accumulated count of addCount(), see countTotals()
+struct CountTotal {
+    const char* name;
+    double total;
+};
+
+void enableTiming(bool on);
+void addCount(const char* name, double n);
+void printTiming(std::ostream& out);
+std::vector<StageTime> stageTimes();
+std::vector<CountTotal> countTotals();
+bool heapCounts(double& allocs, double& bytes);
+size_t peakMemory();
+double wallClock();
+void enableTrace(bool on);
+bool writeTrace(const char* fileName);
+void markFrame();
+
+/// Task of VTune or zone of Tracy, if built with PROFILER itt or tracy
+struct ProfilerZone {
+    unsigned int id; ///< Zone of Tracy
+    int active;      ///< Begun and not yet ended
+};
+
+/// Measure of a stage, from construction to stop() or destruction.
+///
+/// The wall and CPU times are added to those of the stage of the same name,
+/// with \a work units (pixel-disparities), for a throughput. Nothing is done
+/// unless enableTiming(true) was called, or if the name is 0. CPU time is the
+/// one of the process, all threads included, as are the heap allocations if
+/// built with ALLOC_COUNTERS. If built with PERF_COUNTERS, the hardware
+/// counters of each thread are also added: those of the OpenMP threads for a
+/// stage measured by the main thread, or else those of the calling thread.
+/// On Linux, the energy of the RAPL counters readable at enableTiming() is
+/// added too: that of the whole packages and their DRAM, all processes
+/// included. If built with a PROFILER, the stage is also a task of VTune or
+/// a zone of Tracy, whether measured or not.
+class StageTimer {
+public:
+    explicit StageTimer(const char* stage, double work=0);
+    ~StageTimer() { stop(); }
+    void stop();
+private:
+    const char* stage; ///< Name, 0 if not measured
+    double work;       ///< Units of work of the stage
+    double wall, cpu;  ///< Times at start
+    double allocs, bytes; ///< Heap counts at start
+    size_t row, rows;  ///< Threads of hardware counters
+    std::vector<double> start; ///< Hardware counters at start
+    std::vector<double> energy; ///< RAPL counters at start
+    ProfilerZone zone; ///< Of the external profiler
+    StageTimer(const StageTimer&);            ///< Forbidden
+    StageTimer& operator=(const StageTimer&); ///< Forbidden
+};
+
+/// State of a step, given to the callback of setProgress()
+struct Progress {
+    const char* step; ///< Name, as the stage of StageTimer
+    long done, total; ///< Pixels
+    double elapsed;   ///< Seconds since the start of the step
+};
+
+/// Callback of progress, returning false to cancel the computation
+typedef bool (*ProgressCallback)(const Progress& progress, void* data);
+
+void setProgress(ProgressCallback callback, void* data=0);
+void cancelComputation(bool on=true);
+bool computationCancelled();
+
+/// Step of \a total pixels, whose progress is reported at each percent.
+///
+/// advance() is called by the threads as pixels are done. The callback of
+/// setProgress() is called by one of them at a time, the one crossing the
+/// percent. Nothing is done if there is no callback.
+class ProgressStep {
+public:
+    ProgressStep(const char* step, long total);
+    void advance(long pixels);
+private:
+    const char* step; ///< Name, 0 if not reported
+    long done, total; ///< Pixels
+    double start;     ///< Time at start
+    ProgressStep(const ProgressStep&);            ///< Forbidden
+    ProgressStep& operator=(const ProgressStep&); ///< Forbidden
+};
+
+/// Span of work of the calling thread, from construction to destruction.
+///
+/// Recorded for writeTrace() if enableTrace(true) was called, with \a index
+/// (row, tile...) if non-negative. The stages of StageTimer are also spans.
+/// If built with a PROFILER, the span is a task of VTune or a zone of Tracy.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, int index=-1);
+    ~TraceSpan();
+private:
+    const char* name; ///< 0 if not traced
+    int index;        ///< Argument of the span
+    double begin;     ///< Time at start
+    ProfilerZone zone; ///< Of the external profiler
+    TraceSpan(const TraceSpan&);            ///< Forbidden
+    TraceSpan& operator=(const TraceSpan&); ///< Forbidden
+};
+
+#endif
@@ -0,0 +1,121 @@
+/**
+ * @file video.cpp
+ * @brief Frames of video files decoded by an external ffmpeg process
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "video.h"
+#include "pnm.h"
+#include "timing.h"
+#include <cctype>
+
+/// Hardware decoder given to ffmpeg, see setVideoAccel
+static std::string accel("auto");
+
+/// Has the file name the extension of a video container or stream (.mp4,
+/// .mkv, .avi, .mov, .webm, .h264, .h265, .hevc, .y4m), in any case?
+bool is_video(const std::string& fileName) {
+    static const char* exts[] = {
+        "mp4", "mkv", "avi", "mov", "webm", "h264", "h265", "hevc", "y4m"
+    };
+    const size_t dot = fileName.rfind('.');
+    if(dot == std::string::npos)
+        return false;
+    std::string ext = fileName.substr(dot+1);
+    for(size_t i=0; i<ext.size(); i++)
+        ext[i] = static_cast<char>(std::tolower(
+                     static_cast<unsigned char>(ext[i])));
+    for(size_t i=0; i<sizeof(exts)/sizeof(*exts); i++)
+        if(ext == exts[i])
+            return true;
+    return false;
+}
+
+/// Hardware decoder of the videos opened afterwards, the value of option
+/// -hwaccel of ffmpeg (auto, vaapi, cuda, qsv, videotoolbox...), or "none"
+/// for software decoding.
+void setVideoAccel(const std::string& hwaccel) {
+    accel = hwaccel;
+}
+
+/// Argument \a s quoted for the shell.
+static std::string quote(const std::string& s) {
+    std::string q("'");
+    for(size_t i=0; i<s.size(); i++)
+        if(s[i] == '\'')
+            q += "'\\''";
+        else
+            q += s[i];
+    return q + "'";
+}
+
+/// Start ffmpeg decoding video \a fileName. Failures are reported by ffmpeg
+/// at the first next().
+bool VideoReader::open(const std::string& fileName) {
+    close();
+#ifdef __unix__
+    std::string cmd("ffmpeg -nostdin -v error");
+    if(accel != "none")
+        cmd += " -hwaccel " + quote(accel);
+    cmd += " -i " + quote(fileName) + " -f image2pipe -c:v ppm -";
+    pipe = popen(cmd.c_str(), "r");
+#else
+    (void)fileName;
+#endif
+    return (pipe != 0);
+}
+
+/// Next frame in \a im, planar with 3 channels. Return false at the end of
+/// the video or if ffmpeg failed.
+bool VideoReader::next(Image& im) {
+    if(! pipe)
+        return false;
+    StageTimer timer("load");
+    // Header "P6 w h 255" ending with a single white space, as by ffmpeg
+    frame.clear();
+    int numbers=0;
+    bool digit=false;
+    while(numbers < 3) {
+        const int c = std::getc(pipe);
+        if(c==EOF || frame.size()>=64)
+            return false;
+        frame.push_back(static_cast<unsigned char>(c));
+        const bool d = (frame.size()>2 && std::isdigit(c));
+        if(digit && !d)
+            numbers++;
+        digit = d;
+    }
+    int w=0, h=0, m=0;
+    frame.push_back(0);
+    if(std::sscanf(reinterpret_cast<const char*>(&frame[0]), "P6 %d %d %d",
+                   &w, &h, &m) != 3 || w<=0 || h<=0 || m<=0 || m>65535)
+        return false;
+    frame.pop_back();
+    const size_t header = frame.size();
+    const size_t size = static_cast<size_t>(w)*h*3*(m>255? 2: 1);
+    frame.resize(header+size);
+    if(std::fread(&frame[header], 1, size, pipe) != size)
+        return false;
+    return load_pnm(&frame[0], frame.size(), im);
+}
+
+/// Stop ffmpeg.
+void VideoReader::close() {
+#ifdef __unix__
+    if(pipe)
+        pclose(pipe);
+#endif
+    pipe = 0;
+    std::vector<unsigned char>().swap(frame);
+}
@@ -0,0 +1,50 @@
+/**
+ * @file video.h
+ * @brief Frames of video files decoded by an external ffmpeg process
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include "image.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+bool is_video(const std::string& fileName);
+void setVideoAccel(const std::string& hwaccel);
+
+/// Frames of a video file, decoded by ffmpeg in a child process.
+///
+/// ffmpeg writes the frames on a pipe as PPM images, with the hardware
+/// decoder of setVideoAccel ("auto" by default: VAAPI, NVDEC... if
+/// available, else software), and next() converts them to planar color
+/// images from the pool, without intermediate file. Requires a POSIX system
+/// and the program ffmpeg in the PATH.
+class VideoReader {
+public:
+    VideoReader(): pipe(0) {}
+    ~VideoReader() { close(); }
+    bool open(const std::string& fileName);
+    bool next(Image& im);
+    void close();
+private:
+    FILE* pipe; ///< Output of ffmpeg, 0 if not open
+    std::vector<unsigned char> frame; ///< PPM data of the last frame
+    VideoReader(const VideoReader&);            ///< Forbidden
+    VideoReader& operator=(const VideoReader&); ///< Forbidden
+};
+
+#endif
@@ -0,0 +1,325 @@
+/**
+ * @file weights.h
+ * @brief Tabulated adaptive weights, shared by disparityAW and show_weights
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WEIGHTS_H
+#define WEIGHTS_H
+
+#include "disparity.h"
+#include "image.h"
+#include "simd.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+/// Combinations of weights w1 and w2 of p and q, as functors given in
+/// template parameter to the aggregation: usage of a function pointer is
+/// significantly slower, unfortunately. Member hoisted tells whether the
+/// spatial weight can be factored with the weight of p, out of the loop on
+/// disparities: distP*comb(w1,w2) = comb(distP*w1,w2). Member left tells
+/// whether the weight of q is ignored. Member right tells that the weights
+/// given first are the ones of q, swapped by the caller. Member id is the
+/// index of its kernel in SimdKernels::sumWindow. Methods icomb and vicomb
+/// combine weights in fixed point with 15 bits, see costCombinedInt(): the sum
+/// is halved to stay in range, which does not change the ratio of aggregation.
+struct CombLeft {
+    static const bool hoisted=true, left=true, right=false;
+    static const int id=ParamDisparity::CombineLeft;
+    static float comb(float w1, float)       { return w1; }
+    static unsigned icomb(unsigned w1, unsigned) { return w1; }
+    static vu16 vicomb(vu16 w1, vu16)            { return w1; }
+};
+struct CombMax {
+    static const bool hoisted=false, left=false, right=false;
+    static const int id=ParamDisparity::CombineMax;
+    static float comb(float w1, float w2)     { return std::max(w1,w2); }
+    static unsigned icomb(unsigned w1, unsigned w2) {return std::max(w1,w2);}
+    static vu16 vicomb(vu16 w1, vu16 w2)        { return vmax15(w1,w2); }
+};
+struct CombMin {
+    static const bool hoisted=false, left=false, right=false;
+    static const int id=ParamDisparity::CombineMin;
+    static float comb(float w1, float w2)     { return std::min(w1,w2); }
+    static unsigned icomb(unsigned w1, unsigned w2) {return std::min(w1,w2);}
+    static vu16 vicomb(vu16 w1, vu16 w2)        { return vmin15(w1,w2); }
+};
+/// The combined weight distC[d1]*distC[d2] is not looked up from d1+d2 in a
+/// table extended to twice the distances: with hoisted, a tap is the single
+/// product w1*w2, which vectorizes, whereas the table would cost an addition
+/// and a gather per tap and disparity, and round differently.
+struct CombMult {
+    static const bool hoisted=true, left=false, right=false;
+    static const int id=ParamDisparity::CombineMult;
+    static float comb(float w1, float w2)     { return w1*w2; }
+    static unsigned icomb(unsigned w1, unsigned w2) { return (w1*w2)>>15; }
+    static vu16 vicomb(vu16 w1, vu16 w2) { return vmulhi16(w1,vshl1_16(w2)); }
+};
+struct CombPlus {
+    static const bool hoisted=false, left=false, right=false;
+    static const int id=ParamDisparity::CombinePlus;
+    static float comb(float w1, float w2)     { return w1+w2; }
+    static unsigned icomb(unsigned w1, unsigned w2) { return (w1+w2)>>1; }
+    static vu16 vicomb(vu16 w1, vu16 w2) { return vshr1_16(vadd16(w1,w2)); }
+};
+/// Weight of q only, for the map of image 2 aggregated with its own weights.
+struct CombRight : public CombLeft {
+    static const bool right=true;
+};
+
+/// Tabulated color weights exp(-L1/(c*gammaCol)) for images with \a c
+/// channels, indexed by the integer L1 distance of colors. Free with delete[].
+inline float* colorWeights(int c, const ParamDisparity& param) {
+    const int maxL1 = c*255; // Maximum L1 distance between colors
+    float* distC = new float[maxL1+1];
+    float e2=exp(-1/(c*param.gammaCol));
+    distC[0]=1.0f;
+    for(int x=1; x<=maxL1; x++)
+        distC[x] = e2*distC[x-1]; // distC[x] = exp(-x/(c*gamma))
+    return distC;
+}
+
+/// exp(x) for -87<=x<=0, without table.
+///
+/// With t=x/ln2 truncated to integer i=ceil(t), exp(x) is 2^i, whose bits are
+/// built from the exponent field, times exp((t-i)ln2), evaluated by its Taylor
+/// polynomial of degree 7 on (-ln2,0]: the relative error is below 2e-6. The
+/// code has no branch nor lookup, so that loops over it are vectorized.
+inline float expNeg(float x) {
+    const float t = x*1.44269504f;
+    const int i = static_cast<int>(t);
+    const float f = (t-i)*0.693147181f;
+    const float p = 1+f*(1+f*(1/2.0f+f*(1/6.0f+f*(1/24.0f+f*(1/120.0f+
+                    f*(1/720.0f+f*(1/5040.0f)))))));
+    const int bits = (i+127)<<23;
+    float e;
+    std::memcpy(&e, &bits, sizeof(e));
+    return p*e;
+}
+
+/// Color weights exp(-k*d) of the \a n distances \a d, truncated to integers
+/// as the index of colorWeights, in \a out: the path without gather of
+/// ParamDisparity::expWeights, \a k being 1/(c*gammaCol). The distances are
+/// clamped in integers, where exp reaches its minimum exp(-87).
+template <typename D>
+inline void expWeights(const D* d, int n, float k, float* out) {
+    const int m = static_cast<int>(std::min(87/k, 65535.0f));
+    for(int x=0; x<n; x++)
+        out[x] = expNeg(-k*static_cast<float>(std::min(static_cast<int>(d[x]),
+                                                       m)));
+}
+
+/// Factor k of expWeights for \a c channels, 0 if the weights are tabulated.
+inline float expScale(int c, const ParamDisparity& param) {
+    return param.expWeights? 1/(c*param.gammaCol): 0;
+}
+
+/// Tabulated spatial weights of the sampled offsets of the window, in
+/// row-major order. Free with delete[].
+inline float* spatialWeights(const ParamDisparity& param) {
+    const int s = param.stride, r = param.radius/s; // Window in taps
+    const int dim=2*r+1; // window dimension
+    float *distP = new float[dim*dim], *d=distP;
+    for(int y=-r; y<=r; y++)
+    for(int x=-r; x<=r; x++)
+        *d++ = exp(-2.0f*s*sqrt((float)(x*x+y*y))/param.gammaPos);
+    return distP;
+}
+
+/// Taps [t0,t1] of a window of radius \a r taps at step \a s pixels around
+/// coordinate \a p, restricted to pixels in [0,n). Tap t is at pixel p+t*s.
+inline void taps(int p, int n, int r, int s, int& t0, int& t1) {
+    t0 = std::max(-r,-(p/s));
+    t1 = std::min(r,(n-1-p)/s);
+}
+
+/// L1 color distance of pixels \a p and \a q of \a c channels at offset
+/// \a sc, a compile-time constant \a C if not 0, so that the loop is unrolled.
+template <int C>
+inline float dist1(const float* p, const float* q, ptrdiff_t sc, int c) {
+    float d=0;
+    for(int i=0; i<(C? C: c); i++)
+        d += std::abs(q[i*sc]-p[i*sc]);
+    return d;
+}
+
+/// Support weights of support(), for images of \a C channels (see dist1).
+///
+/// The pixels of a row of the window are reached by advancing a pointer.
+template <int C>
+inline void supportC(const Image& im, int xp, int yp, int r, int s,
+                     const float* distC, Image& w) {
+    const int width=im.width(), height=im.height(), c=im.channels();
+    const ptrdiff_t sc=im.channelStep(), sx=static_cast<ptrdiff_t>(s)*im.step();
+    // Window span inside image, so that there is no test in the loops
+    int x0, x1, y0, y1;
+    taps(xp, width, r, s, x0, x1);
+    taps(yp, height, r, s, y0, y1);
+    const float* p = im.row(yp)+xp*im.step();
+    for(int y=y0; y<=y1; y++) {
+        const float* q = im.row(yp+y*s)+(xp+x0*s)*im.step();
+        float* out = w.row(y+r)+(x0+r)*w.step();
+        for(int x=x0; x<=x1; x++, q+=sx, out+=w.step())
+            *out = distC[static_cast<int>(dist1<C>(p, q, sc, c))];
+    }
+}
+
+/// Fill support weights.
+///
+/// The number of channels is dispatched to a specialization for gray, RGB and
+/// RGBX images.
+/// \param im The image
+/// \param xp,yp Center point
+/// \param r Window radius, in taps
+/// \param s Step between taps, in pixels
+/// \param distC Tabulated color distances
+/// \param w The output support window
+inline void support(const Image& im, int xp, int yp, int r, int s,
+                    const float* distC, Image& w) {
+    assert(0<=yp && yp<im.height());
+    if(!  (0<=xp && xp<im.width()))
+        return;
+    switch(im.channels()) {
+    case 1:  supportC<1>(im, xp, yp, r, s, distC, w); break;
+    case 3:  supportC<3>(im, xp, yp, r, s, distC, w); break;
+    case 4:  supportC<4>(im, xp, yp, r, s, distC, w); break;
+    default: supportC<0>(im, xp, yp, r, s, distC, w); break;
+    }
+}
+
+/// L1 color distances of packed pixels (see packRGBX) p[x] and q[x], 0<=x<n,
+/// in \a out, p being the same pixel for all x if \a center.
+///
+/// With SSE2, 4 pixels are handled at once: the absolute differences of bytes
+/// are computed with saturated arithmetic, and summed by pixel with psadbw on
+/// the even then the odd pixels. Output is identical to the float distances.
+inline void distRGBX(const unsigned char* p, bool center,
+                     const unsigned char* q, int n, int* out) {
+    int x=0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i zero=_mm_setzero_si128(), even=_mm_set_epi32(0,-1,0,-1);
+    const unsigned int word = p[0] | p[1]<<8 | p[2]<<16 |
+                              static_cast<unsigned int>(p[3])<<24;
+    const __m128i c=_mm_set1_epi32(static_cast<int>(word));
+    for(; x+4<=n; x+=4) {
+        __m128i a = center? c: _mm_loadu_si128((const __m128i*)(p+4*x));
+        __m128i b = _mm_loadu_si128((const __m128i*)(q+4*x));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(a,b), _mm_subs_epu8(b,a));
+        __m128i d0 = _mm_sad_epu8(_mm_and_si128(diff,even), zero);
+        __m128i d1 = _mm_sad_epu8(_mm_andnot_si128(even,diff), zero);
+        _mm_storeu_si128((__m128i*)(out+x),
+                         _mm_or_si128(d0, _mm_slli_epi64(d1,32)));
+    }
+#endif
+    for(; x<n; x++) {
+        const unsigned char *a=center? p: p+4*x, *b=q+4*x;
+        out[x] = std::abs(a[0]-b[0]) + std::abs(a[1]-b[1]) +
+                 std::abs(a[2]-b[2]) + std::abs(a[3]-b[3]);
+    }
+}
+
+/// Same as support() on image \a im packed by packRGBX.
+///
+/// With step \a s=1, the distances of a row of the window are computed by
+/// distRGBX on contiguous pixels. If \a k>0, the weights are given by
+/// expWeights instead of distC.
+inline void supportRGBX(Image8& im, int xp, int yp, int r, int s,
+                        const float* distC, Image& w, float k=0) {
+    const int width=im.width(), height=im.height();
+    assert(0<=yp && yp<height);
+    if(!  (0<=xp && xp<width))
+        return;
+    int x0, x1, y0, y1;
+    taps(xp, width, r, s, x0, x1);
+    taps(yp, height, r, s, y0, y1);
+    const unsigned char* c = &im(xp,yp);
+    int d[64]; // Distances of a run of taps
+    for(int y=y0; y<=y1; y++)
+        for(int x=x0; x<=x1; x+=64) {
+            const int n = std::min(64, x1+1-x);
+            if(s == 1)
+                distRGBX(c, true, &im(xp+x,yp+y), n, d);
+            else
+                for(int i=0; i<n; i++)
+                    distRGBX(c, true, &im(xp+(x+i)*s,yp+y*s), 1, d+i);
+            float* out = &w(x+r,y+r);
+            if(k > 0)
+                expWeights(d, n, k, out);
+            else
+                for(int i=0; i<n; i++)
+                    out[i] = distC[d[i]];
+        }
+}
+
+/// Multiply support weights \a wp of (xp,yp) by spatial weights \a distP.
+///
+/// Only weights of pixels inside the image of dimension \a width x \a height
+/// are modified. Return their sum.
+inline float premultiply(Image& wp, int xp, int yp, int r, int s,
+                         int width, int height, const float* distP) {
+    int x0, x1, y0, y1;
+    taps(xp, width, r, s, x0, x1);
+    taps(yp, height, r, s, y0, y1);
+    float sum=0;
+    for(int y=y0; y<=y1; y++) {
+        const float* dp = distP+(y+r)*(2*r+1)+r;
+        for(int x=x0; x<=x1; x++)
+            sum += (wp(x+r,y+r) *= dp[x]);
+    }
+    return sum;
+}
+
+/// Window \a w of the weights aggregating the costs of pixel (xp,yp) of
+/// \a im1 at disparity xq-xp, computed as in costCombined(): the support
+/// weights of (xp,yp) in \a im1 and of (xq,yp) in \a im2 (ignored if
+/// Comb::left) are combined and multiplied by the spatial weights, the latter
+/// being first applied to the weights of \a im1 if Comb::hoisted.
+///
+/// \a w1 and \a w2 are buffers of the size of \a w, for the support weights.
+/// Taps outside the images are not set.
+template <class Comb>
+void weightWindow(const Image& im1, const Image& im2, int xp, int yp, int xq,
+                  int r, int s, const float* distC, const float* distP,
+                  Image& w1, Image& w2, Image& w) {
+    if(!  (0<=xp && xp<im1.width()))
+        return;
+    int x0, x1, y0, y1;
+    taps(xp, im1.width(), r, s, x0, x1);
+    taps(yp, im1.height(), r, s, y0, y1);
+    if(! Comb::left) {
+        if(!(0<=xq && xq<im2.width() && yp<im2.height()))
+            return;
+        int t0, t1;
+        taps(xq, im2.width(), r, s, t0, t1);
+        x0 = std::max(x0,t0); x1 = std::min(x1,t1);
+        taps(yp, im2.height(), r, s, t0, t1);
+        y1 = std::min(y1,t1);
+        support(im2, xq, yp, r, s, distC, w2);
+    }
+    support(im1, xp, yp, r, s, distC, w1);
+    if(Comb::hoisted)
+        premultiply(w1, xp, yp, r, s, im1.width(), im1.height(), distP);
+    for(int y=y0; y<=y1; y++) {
+        const float* dp = distP+(y+r)*(2*r+1)+r;
+        for(int x=x0; x<=x1; x++) {
+            const float c = Comb::comb(w1(x+r,y+r),
+                                       Comb::left? 0: w2(x+r,y+r));
+            w(x+r,y+r) = Comb::hoisted? c: dp[x]*c;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,108 @@
+/**
+ * @file writer.cpp
+ * @brief Writing of disparity maps in a background thread
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "writer.h"
+#include <iostream>
+
+#if __cplusplus >= 201103L
+
+/// Constructor, starting the thread. The queue holds at most \a capacity maps.
+DisparityWriter::DisparityWriter(const TiffFormat& f, size_t capacity)
+: format(f), cap(capacity>0? capacity: 1), done(false),
+  thread(&DisparityWriter::run, this) {}
+
+/// Queue a copy of \a disparity, to be written in \a file.
+void DisparityWriter::save(const std::string& file, const Image& disparity,
+                           int dMin, int dMax) {
+    Job job;
+    job.file = file;
+    job.disparity = disparity.clone(); // The caller may modify it afterwards
+    job.dMin = dMin;
+    job.dMax = dMax;
+    std::unique_lock<std::mutex> lock(mutex);
+    while(queue.size() >= cap)
+        cond.wait(lock);
+    queue.push_back(std::move(job));
+    cond.notify_all();
+}
+
+/// Loop of the thread: write queued maps until finish().
+void DisparityWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        while(!done && queue.empty())
+            cond.wait(lock);
+        if(queue.empty())
+            return;
+        Job job = std::move(queue.front());
+        queue.pop_front();
+        cond.notify_all();
+        lock.unlock();
+        const bool ok = save_disparity(job.file.c_str(), job.disparity,
+                                       job.dMin, job.dMax, format);
+        job.disparity = Image(); // Release before taking the lock
+        lock.lock();
+        if(! ok)
+            failed.push_back(job.file);
+    }
+}
+
+/// Wait for all maps to be written. Return whether all were written, failures
+/// being reported. No map can be saved after.
+bool DisparityWriter::finish() {
+    if(thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+    for(size_t i=0; i<failed.size(); i++)
+        std::cerr << "Error writing file " << failed[i] << std::endl;
+    const bool ok = failed.empty();
+    failed.clear();
+    return ok;
+}
+
+#else
+
+/// Constructor, maps being written at once.
+DisparityWriter::DisparityWriter(const TiffFormat& f, size_t): format(f) {}
+
+/// Write \a disparity in \a file.
+void DisparityWriter::save(const std::string& file, const Image& disparity,
+                           int dMin, int dMax) {
+    if(! save_disparity(file.c_str(), disparity, dMin, dMax, format))
+        failed.push_back(file);
+}
+
+/// Return whether all maps were written, failures being reported.
+bool DisparityWriter::finish() {
+    for(size_t i=0; i<failed.size(); i++)
+        std::cerr << "Error writing file " << failed[i] << std::endl;
+    const bool ok = failed.empty();
+    failed.clear();
+    return ok;
+}
+
+#endif
+
+/// Destructor, waiting for the queued maps to be written.
+DisparityWriter::~DisparityWriter() {
+    finish();
+}
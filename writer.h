@@ -0,0 +1,66 @@
+/**
+ * @file writer.h
+ * @brief Writing of disparity maps in a background thread
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2014-2015, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include "image.h"
+#include <string>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#endif
+
+/// Writer of disparity maps with save_disparity, in a background thread.
+///
+/// A map to save is copied and queued, so that computation goes on while the
+/// previous maps are encoded. The queue holds at most a given number of maps,
+/// save() waiting when it is full. Without C++11, maps are written at once.
+class DisparityWriter {
+public:
+    explicit DisparityWriter(const TiffFormat& format=TiffFormat(),
+                             size_t capacity=2);
+    ~DisparityWriter();
+    void save(const std::string& file, const Image& disparity,
+              int dMin, int dMax);
+    bool finish();
+private:
+    /// Map to save
+    struct Job {
+        std::string file;
+        Image disparity;
+        int dMin, dMax;
+    };
+    TiffFormat format; ///< Encoding of files
+    std::vector<std::string> failed; ///< Files not written
+#if __cplusplus >= 201103L
+    size_t cap;             ///< Capacity of queue
+    std::deque<Job> queue;  ///< Maps to save
+    bool done;              ///< No more map
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+    void run();
+#endif
+    DisparityWriter(const DisparityWriter&);            ///< Forbidden
+    DisparityWriter& operator=(const DisparityWriter&); ///< Forbidden
+};
+
+#endif